@@ -55,6 +55,9 @@
 #define LAPIC_TIMER_DCR_DIV64 0x00000009 /* Divide by 64 */
 #define LAPIC_TIMER_DCR_DIV128 0x0000000A /* Divide by 128 */
 
+/* Local APIC timer vector */
+#define LAPIC_TIMER_VECTOR  0xFE
+
 /* ICR flags */
 #define LAPIC_ICR_BUSY      0x00001000  /* Delivery Status */
 #define LAPIC_ICR_FIXED     0x00000000  /* Fixed Delivery Mode */
@@ -0,0 +1,37 @@
+/**
+ * tsc.h - x86 time stamp counter definitions
+ *
+ * This file contains x86-specific definitions for the time stamp counter
+ * and the CPUID feature bits the timekeeping checks for it.
+ */
+
+#ifndef _ASM_TSC_H
+#define _ASM_TSC_H
+
+#include <horizon/types.h>
+
+/* CPUID leaf 1 EDX feature bits */
+#define CPUID_FEATURE_TSC       (1 << 4)    /* Time stamp counter */
+#define CPUID_FEATURE_APIC      (1 << 9)    /* Local APIC */
+
+/* CPUID leaf 0x80000007 EDX feature bits */
+#define CPUID_FEATURE_INVARIANT_TSC (1 << 8) /* TSC rate is constant in all states */
+
+/* Execute CPUID */
+static inline void cpuid(u32 leaf, u32 *eax, u32 *ebx, u32 *ecx, u32 *edx) {
+    __asm__ volatile("cpuid"
+                     : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                     : "a"(leaf), "c"(0));
+}
+
+/* Read the time stamp counter */
+static inline u64 rdtsc(void) {
+    u32 lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((u64)hi << 32) | lo;
+}
+
+/* TSC frequency in kHz, 0 if not calibrated */
+extern u32 tsc_khz;
+
+#endif /* _ASM_TSC_H */
@@ -221,6 +221,13 @@ void lapic_write(u32 reg, u32 value) {
     *(volatile u32 *)((u8 *)lapic_base + reg) = value;
 }
 
+/**
+ * Signal the end of an interrupt to the local APIC
+ */
+void lapic_eoi(void) {
+    lapic_write(LAPIC_EOI, 0);
+}
+
 /**
  * Initialize local APIC
  */
@@ -241,7 +248,7 @@ void lapic_init(void) {
     lapic_write(LAPIC_LVT_ERROR, 0xFF);
     
     /* Configure timer */
-    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED | LAPIC_TIMER_PERIODIC | 0xFE);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED | LAPIC_TIMER_PERIODIC | LAPIC_TIMER_VECTOR);
     lapic_write(LAPIC_TIMER_DCR, LAPIC_TIMER_DCR_DIV1);
     lapic_write(LAPIC_TIMER_ICR, 10000000);
 }
@@ -1,7 +1,11 @@
 /**
  * timer.c - Horizon kernel x86 timer implementation
  *
- * This file contains the implementation of the x86 timer subsystem.
+ * This file contains the implementation of the x86 timer subsystem. The
+ * PIT drives the periodic tick. At boot the TSC and the local APIC timer
+ * are calibrated against it: the TSC becomes the clock source, and the
+ * LAPIC timer in one-shot mode the clock event the high resolution timers
+ * program for their next expiry.
  */
 
 #include <horizon/kernel.h>
@@ -9,6 +13,13 @@
 #include <horizon/timer.h>
 #include <horizon/interrupt.h>
 #include <horizon/io.h>
+#include <horizon/clocksource.h>
+#include <horizon/irqflags.h>
+#include <horizon/errno.h>
+#include <horizon/printk.h>
+#include <horizon/vdso.h>
+#include <asm/apic.h>
+#include <asm/tsc.h>
 
 /* PIT (Programmable Interval Timer) ports */
 #define PIT_CHANNEL0     0x40    /* Channel 0 data port */
@@ -18,26 +29,98 @@
 
 /* PIT commands */
 #define PIT_CMD_CHANNEL0 0x00    /* Select channel 0 */
+#define PIT_CMD_CHANNEL2 0x80    /* Select channel 2 */
 #define PIT_CMD_LATCH    0x00    /* Latch counter value command */
 #define PIT_CMD_ACCESS   0x30    /* Access mode: low byte then high byte */
+#define PIT_CMD_MODE0    0x00    /* Mode 0: interrupt on terminal count */
 #define PIT_CMD_MODE3    0x06    /* Mode 3: square wave generator */
 #define PIT_CMD_BINARY   0x00    /* 16-bit binary counter */
 
 /* PIT frequency */
 #define PIT_FREQUENCY    1193182 /* PIT input frequency in Hz */
 
+/* Port B of the keyboard controller, gates PIT channel 2 */
+#define PIT_PORT_B       0x61
+#define PIT_B_GATE2      0x01    /* Channel 2 gate */
+#define PIT_B_SPEAKER    0x02    /* Channel 2 drives the speaker */
+#define PIT_B_OUT2       0x20    /* Channel 2 output */
+
+/* Calibration window, counted down by PIT channel 2 */
+#define CALIBRATE_MS     10
+#define CALIBRATE_LATCH  (PIT_FREQUENCY / (1000 / CALIBRATE_MS))
+#define CALIBRATE_MAX_LOOPS 10000000
+
+/* Shortest LAPIC timer countdown, in counts */
+#define LAPIC_TIMER_MIN_COUNT 16
+
 /* Timer IRQ */
 #define TIMER_IRQ        0       /* IRQ 0 */
 
 /* Timer frequency */
 static u32 timer_frequency = 0;
 
+/* PIT counts per tick */
+static u32 timer_divisor = 0;
+
+/* One-shot state for tickless idle */
+static int timer_oneshot = 0;          /* One-shot countdown is armed */
+static u32 timer_oneshot_ticks = 0;    /* Ticks covered by the countdown */
+
+/* TSC frequency in kHz */
+u32 tsc_khz = 0;
+
+/* LAPIC timer frequency in Hz, after the divide by 16 */
+static u32 lapic_timer_hz = 0;
+
+/* LAPIC timer counts per nanosecond, shifted left by 32 */
+static u64 lapic_timer_mult = 0;
+
+/* Read the TSC */
+static u64 tsc_read(void) {
+    return rdtsc();
+}
+
+/* TSC clock source */
+static clocksource_t clocksource_tsc = {
+    .name = "tsc",
+    .read = tsc_read,
+    .mask = ~0ULL,
+    .rating = 300,
+    .vdso_clock_mode = VDSO_CLOCK_TSC,
+};
+
+/* Program the PIT counter */
+static void timer_program(u32 mode, u32 count) {
+    outb(PIT_COMMAND, PIT_CMD_CHANNEL0 | PIT_CMD_ACCESS | mode | PIT_CMD_BINARY);
+    outb(PIT_CHANNEL0, count & 0xFF);           /* Low byte */
+    outb(PIT_CHANNEL0, (count >> 8) & 0xFF);    /* High byte */
+}
+
 /* Timer IRQ handler */
 static void timer_irq_handler(struct interrupt_frame *frame) {
+    (void)frame;
+
+    /* A one-shot countdown ran out, resume the periodic tick */
+    if (timer_oneshot) {
+        timer_oneshot = 0;
+        timer_program(PIT_CMD_MODE3, timer_divisor);
+
+        /* This interrupt counts as one tick, account for the rest */
+        timer_account_ticks(timer_oneshot_ticks - 1);
+    }
+
     /* Call the timer tick handler */
     timer_tick();
 }
 
+/* LAPIC timer interrupt handler */
+static void lapic_timer_handler(struct interrupt_frame *frame) {
+    (void)frame;
+
+    lapic_eoi();
+    hrtimer_interrupt();
+}
+
 /**
  * Initialize the architecture-specific timer
  * 
@@ -55,12 +138,10 @@ void arch_timer_init(u32 frequency) {
         divisor = 65535;
     }
 
-    /* Set the PIT mode */
-    outb(PIT_COMMAND, PIT_CMD_CHANNEL0 | PIT_CMD_ACCESS | PIT_CMD_MODE3 | PIT_CMD_BINARY);
-
-    /* Set the PIT frequency */
-    outb(PIT_CHANNEL0, divisor & 0xFF);           /* Low byte */
-    outb(PIT_CHANNEL0, (divisor >> 8) & 0xFF);    /* High byte */
+    /* Set the PIT to periodic mode at the tick frequency */
+    timer_divisor = divisor;
+    timer_oneshot = 0;
+    timer_program(PIT_CMD_MODE3, divisor);
 
     /* Register the timer IRQ handler */
     interrupt_register_handler(TIMER_IRQ, timer_irq_handler);
@@ -124,3 +205,214 @@ void arch_timer_set_frequency(u32 frequency) {
 u32 arch_timer_get_frequency(void) {
     return timer_frequency;
 }
+
+/**
+ * Replace the periodic tick with a single interrupt some ticks from now
+ *
+ * The PIT counter is 16 bits wide, so long requests are shortened; the
+ * caller re-arms after each expiry.
+ *
+ * @param ticks Number of ticks until the interrupt
+ * @return Number of ticks actually programmed
+ */
+u32 arch_timer_set_oneshot(u32 ticks) {
+    u32 max_ticks;
+
+    if (timer_divisor == 0 || ticks == 0) {
+        return 0;
+    }
+
+    /* Clamp to what the counter can hold */
+    max_ticks = 65535 / timer_divisor;
+    if (max_ticks == 0) {
+        max_ticks = 1;
+    }
+    if (ticks > max_ticks) {
+        ticks = max_ticks;
+    }
+
+    timer_oneshot_ticks = ticks;
+    timer_oneshot = 1;
+    timer_program(PIT_CMD_MODE0, ticks * timer_divisor);
+
+    return ticks;
+}
+
+/**
+ * Disarm a pending one-shot countdown and resume the periodic tick
+ *
+ * Must be called with interrupts disabled.
+ *
+ * @return Number of whole ticks that elapsed while the countdown ran
+ */
+u32 arch_timer_cancel_oneshot(void) {
+    u32 remaining, elapsed;
+
+    if (!timer_oneshot) {
+        return 0;
+    }
+
+    /* Work out how far the countdown got */
+    remaining = (u32)arch_timer_read();
+    if (remaining > timer_oneshot_ticks * timer_divisor) {
+        remaining = 0;
+    }
+    elapsed = (timer_oneshot_ticks * timer_divisor - remaining) / timer_divisor;
+
+    timer_oneshot = 0;
+    timer_program(PIT_CMD_MODE3, timer_divisor);
+
+    return elapsed;
+}
+
+/**
+ * Measure the TSC and the LAPIC timer over a PIT channel 2 countdown
+ *
+ * Must be called with interrupts disabled.
+ *
+ * @param apic Measure the LAPIC timer too
+ * @param tsc_delta TSC cycles in the window
+ * @param apic_delta LAPIC timer counts in the window
+ * @return 0 on success, -ETIMEDOUT if the countdown never ended
+ */
+static int timer_calibrate(int apic, u64 *tsc_delta, u32 *apic_delta) {
+    u8 portb = inb(PIT_PORT_B);
+    u64 tsc_start;
+    u32 loops = 0;
+
+    /* Gate channel 2 on with the speaker off, count down once */
+    outb(PIT_PORT_B, (portb & ~PIT_B_SPEAKER) | PIT_B_GATE2);
+    outb(PIT_COMMAND, PIT_CMD_CHANNEL2 | PIT_CMD_ACCESS | PIT_CMD_MODE0 | PIT_CMD_BINARY);
+    outb(PIT_CHANNEL2, CALIBRATE_LATCH & 0xFF);
+    outb(PIT_CHANNEL2, (CALIBRATE_LATCH >> 8) & 0xFF);
+
+    if (apic) {
+        lapic_write(LAPIC_TIMER_DCR, LAPIC_TIMER_DCR_DIV16);
+        lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED | LAPIC_TIMER_ONESHOT | LAPIC_TIMER_VECTOR);
+        lapic_write(LAPIC_TIMER_ICR, 0xFFFFFFFF);
+    }
+    tsc_start = rdtsc();
+
+    /* The output goes high when the count reaches zero */
+    while (!(inb(PIT_PORT_B) & PIT_B_OUT2)) {
+        if (++loops > CALIBRATE_MAX_LOOPS) {
+            outb(PIT_PORT_B, portb);
+            return -ETIMEDOUT;
+        }
+    }
+
+    *tsc_delta = rdtsc() - tsc_start;
+    *apic_delta = 0;
+    if (apic) {
+        *apic_delta = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CCR);
+        lapic_write(LAPIC_TIMER_ICR, 0);
+    }
+
+    outb(PIT_PORT_B, portb);
+
+    return 0;
+}
+
+/**
+ * Calibrate the TSC and the LAPIC timer and start using them
+ *
+ * Registers the TSC as the clock source and switches the high resolution
+ * timers to the LAPIC timer. Every CPU's LAPIC timer is assumed to run at
+ * the rate measured on the boot CPU.
+ */
+void arch_clocksource_init(void) {
+    u32 eax, ebx, ecx, edx;
+    u64 tsc_delta;
+    u32 apic_delta;
+    unsigned long flags;
+    int has_tsc, has_apic, ret;
+
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    has_tsc = (edx & CPUID_FEATURE_TSC) != 0;
+    has_apic = (edx & CPUID_FEATURE_APIC) && (lapic_read(LAPIC_SVR) & LAPIC_SVR_ENABLE);
+
+    if (!has_tsc && !has_apic) {
+        return;
+    }
+
+    local_irq_save(flags);
+    ret = timer_calibrate(has_apic, &tsc_delta, &apic_delta);
+    local_irq_restore(flags);
+
+    if (ret < 0) {
+        printk(KERN_WARNING "Timer: calibration against the PIT failed\n");
+        return;
+    }
+
+    if (has_tsc && tsc_delta != 0) {
+        u64 tsc_hz = tsc_delta * (1000 / CALIBRATE_MS);
+
+        tsc_khz = (u32)(tsc_hz / 1000);
+        clocksource_calc_mult_shift(&clocksource_tsc, tsc_hz);
+
+        /*
+         * Without an invariant TSC the rate may change with power states,
+         * rate it lower and keep processes on the system call
+         */
+        cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+        if (eax >= 0x80000007) {
+            cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+        } else {
+            edx = 0;
+        }
+        if (!(edx & CPUID_FEATURE_INVARIANT_TSC)) {
+            clocksource_tsc.rating = 200;
+            clocksource_tsc.vdso_clock_mode = VDSO_CLOCK_NONE;
+        }
+
+        clocksource_register(&clocksource_tsc);
+    }
+
+    if (has_apic && apic_delta != 0) {
+        lapic_timer_hz = apic_delta * (1000 / CALIBRATE_MS);
+        lapic_timer_mult = ((u64)lapic_timer_hz << 32) / NSEC_PER_SEC;
+
+        interrupt_register_handler(LAPIC_TIMER_VECTOR, lapic_timer_handler);
+        lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_ONESHOT | LAPIC_TIMER_VECTOR);
+
+        hrtimer_switch_to_hres();
+    }
+
+    printk(KERN_INFO "Timer: TSC %u kHz, LAPIC timer %u kHz\n", tsc_khz, lapic_timer_hz / 1000);
+}
+
+/**
+ * Program the LAPIC timer of this CPU to interrupt after a delay
+ *
+ * Delays over a second are shortened; the interrupt then finds nothing
+ * expired and programs the rest.
+ *
+ * @param delta_ns Delay in nanoseconds
+ * @return 0 on success, -ENODEV if the LAPIC timer is not calibrated
+ */
+int arch_clockevent_program(u64 delta_ns) {
+    u64 counts;
+
+    if (lapic_timer_mult == 0) {
+        return -ENODEV;
+    }
+
+    if (delta_ns > NSEC_PER_SEC) {
+        delta_ns = NSEC_PER_SEC;
+    }
+
+    counts = (delta_ns * lapic_timer_mult) >> 32;
+    if (counts < LAPIC_TIMER_MIN_COUNT) {
+        counts = LAPIC_TIMER_MIN_COUNT;
+    }
+    if (counts > 0xFFFFFFFF) {
+        counts = 0xFFFFFFFF;
+    }
+
+    /* Set up the vector and divider too, this may be the first use on this CPU */
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_ONESHOT | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_DCR, LAPIC_TIMER_DCR_DIV16);
+    lapic_write(LAPIC_TIMER_ICR, (u32)counts);
+
+    return 0;
+}
@@ -0,0 +1,158 @@
+/**
+ * vdso.c - x86 vDSO user code
+ *
+ * This file contains the code the kernel copies to the vDSO text page. It
+ * runs in user mode at VDSO_TEXT_ADDR, not where the kernel linked it, so
+ * everything here lives in the .vdso.text section and only calls within
+ * it. The data page is reached at its fixed address. There is no 64-bit
+ * division either, the kernel has no libgcc to link it from.
+ *
+ * When the clock source cannot be read from user mode, or the clock is not
+ * one kept in the data page, the code makes the system call instead.
+ */
+
+#include <horizon/types.h>
+#include <horizon/time.h>
+#include <horizon/syscall.h>
+#include <horizon/vdso.h>
+
+/* Place a function in the vDSO text */
+#define __vdso_text __attribute__((section(".vdso.text"), noinline))
+
+/* Data page, as user mode sees it */
+#define VDSO_DATA ((const struct vdso_data *)VDSO_DATA_ADDR)
+
+/**
+ * Make a system call with two arguments
+ *
+ * @param num System call number
+ * @param arg1 First argument
+ * @param arg2 Second argument
+ * @return System call result
+ */
+static long __vdso_text vdso_syscall2(long num, long arg1, long arg2) {
+    long ret;
+
+    __asm__ volatile("int $0x80"
+                     : "=a"(ret)
+                     : "a"(num), "b"(arg1), "c"(arg2)
+                     : "memory");
+
+    return ret;
+}
+
+/**
+ * Read the time from the data page
+ *
+ * @param real Nonzero for the real time, zero for the monotonic time
+ * @param ts Set to the time
+ * @return 0 on success, -1 if the clock source is not readable from here
+ */
+static int __vdso_text vdso_read(int real, struct timespec *ts) {
+    const struct vdso_data *vd = VDSO_DATA;
+    u32 seq, lo, hi;
+    u64 cycles, ns;
+    s64 sec;
+
+    do {
+        while ((seq = vd->seq.sequence) & 1) {
+            __asm__ volatile("pause" : : : "memory");
+        }
+        __sync_synchronize();
+
+        if (vd->clock_mode != VDSO_CLOCK_TSC) {
+            return -1;
+        }
+
+        __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+        cycles = (((u64)hi << 32) | lo) - vd->cycle_last;
+        ns = ((cycles & vd->mask) * vd->mult) >> vd->shift;
+
+        if (real) {
+            sec = vd->real_sec;
+            ns += vd->real_nsec;
+        } else {
+            sec = vd->mono_sec;
+            ns += vd->mono_nsec;
+        }
+
+        __sync_synchronize();
+    } while (vd->seq.sequence != seq);
+
+    /* The kernel updates every tick, so this loops once or twice */
+    while (ns >= (u64)NSEC_PER_SEC) {
+        ns -= NSEC_PER_SEC;
+        sec++;
+    }
+
+    ts->tv_sec = (time_t)sec;
+    ts->tv_nsec = (long)ns;
+
+    return 0;
+}
+
+/**
+ * Get the time of a clock
+ *
+ * @param clock Clock ID
+ * @param ts Set to the time
+ * @return 0 on success, negative error code on failure
+ */
+int __vdso_text __vdso_clock_gettime(clockid_t clock, struct timespec *ts) {
+    if (clock == CLOCK_MONOTONIC && vdso_read(0, ts) == 0) {
+        return 0;
+    }
+
+    if (clock == CLOCK_REALTIME && vdso_read(1, ts) == 0) {
+        return 0;
+    }
+
+    return (int)vdso_syscall2(SYS_CLOCK_GETTIME, clock, (long)ts);
+}
+
+/**
+ * Get the real time of day
+ *
+ * @param tv Set to the time if not NULL
+ * @param tz Set to the time zone if not NULL
+ * @return 0 on success, negative error code on failure
+ */
+int __vdso_text __vdso_gettimeofday(struct timeval *tv, struct timezone *tz) {
+    struct timespec ts;
+
+    if (tv != NULL) {
+        if (vdso_read(1, &ts) < 0) {
+            return (int)vdso_syscall2(SYS_GETTIMEOFDAY, (long)tv, (long)tz);
+        }
+
+        tv->tv_sec = ts.tv_sec;
+        tv->tv_usec = (u32)ts.tv_nsec / 1000;
+    }
+
+    if (tz != NULL) {
+        tz->tz_minuteswest = 0;
+        tz->tz_dsttime = 0;
+    }
+
+    return 0;
+}
+
+/**
+ * Get the real time in seconds
+ *
+ * @param t Set to the time if not NULL
+ * @return Seconds since the epoch
+ */
+time_t __vdso_text __vdso_time(time_t *t) {
+    struct timespec ts;
+
+    if (vdso_read(1, &ts) < 0) {
+        return (time_t)vdso_syscall2(SYS_TIME, (long)t, 0);
+    }
+
+    if (t != NULL) {
+        *t = ts.tv_sec;
+    }
+
+    return ts.tv_sec;
+}
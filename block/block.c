@@ -7,32 +7,52 @@
 #include <horizon/kernel.h>
 #include <horizon/types.h>
 #include <horizon/mm.h>
+#include <horizon/mm/pmm.h>
 #include <horizon/block.h>
+#include <horizon/elevator.h>
 #include <horizon/string.h>
+#include <horizon/percpu_rwsem.h>
 
 /* Block device list */
 static block_device_t *block_devices = NULL;
 
+/* Protects block_devices, lookups far outnumber registrations */
+static percpu_rw_semaphore_t block_devices_rwsem = PERCPU_RWSEM_INITIALIZER(block_devices_rwsem);
+
 /* Initialize the block device subsystem */
 void block_init(void)
 {
     /* Initialize the block device list */
     block_devices = NULL;
+    
+    /* Register the I/O schedulers */
+    elevator_init();
 }
 
 /* Register a block device */
 int block_register_device(block_device_t *dev)
 {
-    if (dev == NULL || dev->ops == NULL) {
+    if (dev == NULL || dev->ops == NULL || dev->sector_size == 0) {
         return -1;
     }
     
+    /* Set up the request queue */
+    request_queue_t *q = blk_init_queue(dev);
+    
+    if (q == NULL) {
+        return -1;
+    }
+    
+    percpu_down_write(&block_devices_rwsem);
+    
     /* Check if the device already exists */
     block_device_t *existing = block_devices;
     
     while (existing != NULL) {
         if (strcmp(existing->device.name, dev->device.name) == 0) {
             /* Device already exists */
+            percpu_up_write(&block_devices_rwsem);
+            blk_cleanup_queue(q);
             return -1;
         }
         
@@ -40,9 +60,12 @@ int block_register_device(block_device_t *dev)
     }
     
     /* Add to the block device list */
+    dev->queue = q;
     dev->next = block_devices;
     block_devices = dev;
     
+    percpu_up_write(&block_devices_rwsem);
+    
     return 0;
 }
 
@@ -53,6 +76,8 @@ int block_unregister_device(block_device_t *dev)
         return -1;
     }
     
+    percpu_down_write(&block_devices_rwsem);
+    
     /* Find the device in the list */
     block_device_t *current = block_devices;
     block_device_t *prev = NULL;
@@ -68,6 +93,12 @@ int block_unregister_device(block_device_t *dev)
                 prev->next = current->next;
             }
             
+            percpu_up_write(&block_devices_rwsem);
+            
+            /* Free the request queue, the device must be idle */
+            blk_cleanup_queue(dev->queue);
+            dev->queue = NULL;
+            
             return 0;
         }
         
@@ -75,6 +106,8 @@ int block_unregister_device(block_device_t *dev)
         current = current->next;
     }
     
+    percpu_up_write(&block_devices_rwsem);
+    
     /* Device not found */
     return -1;
 }
@@ -86,26 +119,100 @@ block_device_t *block_get_device(const char *name)
         return NULL;
     }
     
+    percpu_down_read(&block_devices_rwsem);
+    
     /* Find the device in the list */
     block_device_t *dev = block_devices;
     
     while (dev != NULL) {
         if (strcmp(dev->device.name, name) == 0) {
             /* Found the device */
-            return dev;
+            break;
         }
         
         dev = dev->next;
     }
     
-    /* Device not found */
-    return NULL;
+    percpu_up_read(&block_devices_rwsem);
+    
+    return dev;
+}
+
+/* Read or write a buffer with the synchronous operations of a device */
+static int block_rw_direct(block_device_t *dev, u64 sector, u32 count, void *buffer, u32 flags)
+{
+    if (flags & BIO_WRITE) {
+        if (dev->ops->write == NULL) {
+            return -1;
+        }
+        
+        return dev->ops->write(dev, sector, count, buffer);
+    }
+    
+    if (dev->ops->read == NULL) {
+        return -1;
+    }
+    
+    return dev->ops->read(dev, sector, count, buffer);
+}
+
+/* Read or write a buffer through the request queue of a device */
+static int block_rw(block_device_t *dev, u64 sector, u32 count, void *buffer, u32 flags)
+{
+    u32 size = count * dev->sector_size;
+    u32 offset = (u32)((unsigned long)buffer & (PAGE_SIZE - 1));
+    u32 nr_vecs = (offset + size + PAGE_SIZE - 1) / PAGE_SIZE;
+    
+    if (nr_vecs > 0xFFFF) {
+        return -1;
+    }
+    
+    bio_t *bio = bio_alloc((u16)nr_vecs);
+    
+    if (bio == NULL) {
+        return -1;
+    }
+    
+    bio->bi_bdev = dev;
+    bio->bi_sector = sector;
+    bio->bi_flags = flags;
+    
+    /* Map the buffer page by page */
+    u8 *p = buffer;
+    
+    while (size > 0) {
+        u32 len = PAGE_SIZE - offset;
+        
+        if (len > size) {
+            len = size;
+        }
+        
+        page_t *page = pmm_virt_to_page(p);
+        
+        /* Buffers outside the direct map have no page, do them synchronously */
+        if (page == NULL) {
+            bio_put(bio);
+            return block_rw_direct(dev, sector, count, buffer, flags);
+        }
+        
+        bio_add_page(bio, page, len, offset);
+        
+        p += len;
+        size -= len;
+        offset = 0;
+    }
+    
+    int ret = submit_bio_wait(bio);
+    
+    bio_put(bio);
+    
+    return ret < 0 ? -1 : 0;
 }
 
 /* Read from a block device */
 int block_read(block_device_t *dev, u64 sector, u32 count, void *buffer)
 {
-    if (dev == NULL || dev->ops == NULL || dev->ops->read == NULL || buffer == NULL) {
+    if (dev == NULL || dev->ops == NULL || buffer == NULL) {
         return -1;
     }
     
@@ -119,14 +226,19 @@ int block_read(block_device_t *dev, u64 sector, u32 count, void *buffer)
         return -1;
     }
     
-    /* Read from the device */
-    return dev->ops->read(dev, sector, count, buffer);
+    /* Devices that are not registered have no queue */
+    if (dev->queue == NULL) {
+        return block_rw_direct(dev, sector, count, buffer, 0);
+    }
+    
+    /* Read through the request queue */
+    return block_rw(dev, sector, count, buffer, 0);
 }
 
 /* Write to a block device */
 int block_write(block_device_t *dev, u64 sector, u32 count, const void *buffer)
 {
-    if (dev == NULL || dev->ops == NULL || dev->ops->write == NULL || buffer == NULL) {
+    if (dev == NULL || dev->ops == NULL || buffer == NULL) {
         return -1;
     }
     
@@ -140,8 +252,13 @@ int block_write(block_device_t *dev, u64 sector, u32 count, const void *buffer)
         return -1;
     }
     
-    /* Write to the device */
-    return dev->ops->write(dev, sector, count, buffer);
+    /* Devices that are not registered have no queue */
+    if (dev->queue == NULL) {
+        return block_rw_direct(dev, sector, count, (void *)buffer, BIO_WRITE);
+    }
+    
+    /* Write through the request queue */
+    return block_rw(dev, sector, count, (void *)buffer, BIO_WRITE);
 }
 
 /* Perform an I/O control operation on a block device */
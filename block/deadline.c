@@ -0,0 +1,232 @@
+/**
+ * deadline.c - Deadline I/O scheduler
+ *
+ * This file contains the deadline elevator. Requests are kept sorted by
+ * sector and started in batches that sweep across the disk, while a FIFO per
+ * direction with an expiry time bounds how long any request can be passed
+ * over. Reads are preferred over writes, since a task usually waits for
+ * them, but only a few times in a row while writes are waiting.
+ */
+
+#include <horizon/kernel.h>
+#include <horizon/types.h>
+#include <horizon/mm.h>
+#include <horizon/block.h>
+#include <horizon/elevator.h>
+#include <horizon/timer.h>
+
+/* Tunables */
+#define DEADLINE_READ_EXPIRE    500     /* Milliseconds a read or sync request may wait */
+#define DEADLINE_WRITE_EXPIRE   5000    /* Milliseconds a write may wait */
+#define DEADLINE_FIFO_BATCH     16      /* Requests started in sector order per batch */
+#define DEADLINE_WRITES_STARVED 2       /* Read batches started while writes wait */
+
+/* Directions */
+#define DD_READ     0
+#define DD_WRITE    1
+
+/* Deadline elevator data */
+typedef struct deadline_data {
+    rb_root_t sort_list[2];         /* Queued requests by sector, per direction */
+    list_head_t fifo_list[2];       /* Queued requests by deadline, per direction */
+    request_t *next_rq[2];          /* Next request of the batch, per direction */
+    u32 batching;                   /* Requests started in the current batch */
+    u32 starved;                    /* Read batches started while writes waited */
+} deadline_data_t;
+
+/* Get the direction of a request */
+static inline int deadline_dir(request_t *rq)
+{
+    return (rq->flags & BIO_WRITE) ? DD_WRITE : DD_READ;
+}
+
+/* Add a request to the sort tree of its direction */
+static void deadline_add_rb(deadline_data_t *dd, request_t *rq)
+{
+    rb_root_t *root = &dd->sort_list[deadline_dir(rq)];
+    rb_node_t **link = &root->rb_node;
+    rb_node_t *parent = NULL;
+    
+    while (*link != NULL) {
+        parent = *link;
+        
+        if (rq->sector < rb_entry(parent, request_t, rb_node)->sector) {
+            link = &parent->rb_left;
+        } else {
+            link = &parent->rb_right;
+        }
+    }
+    
+    rb_link_node(&rq->rb_node, parent, link);
+    rb_insert_color(&rq->rb_node, root);
+}
+
+/* Get the request after one in sector order */
+static request_t *deadline_latter(request_t *rq)
+{
+    rb_node_t *node = rb_next(&rq->rb_node);
+    
+    return node != NULL ? rb_entry(node, request_t, rb_node) : NULL;
+}
+
+/* Take a request off the lists */
+static void deadline_remove(deadline_data_t *dd, request_t *rq)
+{
+    int dir = deadline_dir(rq);
+    
+    if (dd->next_rq[dir] == rq) {
+        dd->next_rq[dir] = deadline_latter(rq);
+    }
+    
+    rb_erase(&rq->rb_node, &dd->sort_list[dir]);
+    rb_clear_node(&rq->rb_node);
+    list_del_init(&rq->fifo);
+}
+
+/* Check if the oldest request of a direction expired */
+static int deadline_expired(deadline_data_t *dd, int dir)
+{
+    if (list_empty(&dd->fifo_list[dir])) {
+        return 0;
+    }
+    
+    request_t *rq = list_first_entry(&dd->fifo_list[dir], request_t, fifo);
+    
+    return (s64)(timer_get_jiffies() - rq->deadline) >= 0;
+}
+
+/* Allocate the deadline elevator data */
+static void *deadline_init(request_queue_t *q)
+{
+    (void)q;
+    
+    deadline_data_t *dd = kmalloc(sizeof(deadline_data_t), MEM_KERNEL | MEM_ZERO);
+    
+    if (dd == NULL) {
+        return NULL;
+    }
+    
+    for (int dir = DD_READ; dir <= DD_WRITE; dir++) {
+        rb_init_root(&dd->sort_list[dir]);
+        list_init(&dd->fifo_list[dir]);
+    }
+    
+    return dd;
+}
+
+/* Free the deadline elevator data */
+static void deadline_exit(request_queue_t *q, void *data)
+{
+    (void)q;
+    
+    kfree(data);
+}
+
+/* Queue a request */
+static void deadline_add_request(request_queue_t *q, request_t *rq)
+{
+    deadline_data_t *dd = q->elevator_data;
+    int dir = deadline_dir(rq);
+    u32 expire = DEADLINE_WRITE_EXPIRE;
+    
+    /* Somebody waits for reads and sync writes */
+    if (dir == DD_READ || (rq->flags & BIO_SYNC)) {
+        expire = DEADLINE_READ_EXPIRE;
+    }
+    
+    deadline_add_rb(dd, rq);
+    
+    rq->deadline = timer_get_jiffies() + timer_msecs_to_jiffies(expire);
+    list_add_tail(&rq->fifo, &dd->fifo_list[dir]);
+}
+
+/* Resort a request whose first sector moved */
+static void deadline_merged(request_queue_t *q, request_t *rq)
+{
+    deadline_data_t *dd = q->elevator_data;
+    
+    rb_erase(&rq->rb_node, &dd->sort_list[deadline_dir(rq)]);
+    deadline_add_rb(dd, rq);
+}
+
+/* Drop a request joined to another one, keeping the earlier deadline */
+static void deadline_merge_requests(request_queue_t *q, request_t *rq, request_t *next)
+{
+    deadline_data_t *dd = q->elevator_data;
+    
+    if ((s64)(next->deadline - rq->deadline) < 0) {
+        list_del(&rq->fifo);
+        list_add(&rq->fifo, &next->fifo);
+        rq->deadline = next->deadline;
+    }
+    
+    deadline_remove(dd, next);
+}
+
+/* Pick the direction and first request of a new batch */
+static request_t *deadline_new_batch(deadline_data_t *dd)
+{
+    int reads = !list_empty(&dd->fifo_list[DD_READ]);
+    int writes = !list_empty(&dd->fifo_list[DD_WRITE]);
+    int dir;
+    
+    if (reads && (!writes || dd->starved++ < DEADLINE_WRITES_STARVED)) {
+        dir = DD_READ;
+    } else if (writes) {
+        dd->starved = 0;
+        dir = DD_WRITE;
+    } else {
+        return NULL;
+    }
+    
+    dd->batching = 0;
+    
+    /* Go back to the oldest request if it expired or the sweep ended */
+    if (deadline_expired(dd, dir) || dd->next_rq[dir] == NULL) {
+        return list_first_entry(&dd->fifo_list[dir], request_t, fifo);
+    }
+    
+    return dd->next_rq[dir];
+}
+
+/* Take the next request to start */
+static request_t *deadline_next_request(request_queue_t *q)
+{
+    deadline_data_t *dd = q->elevator_data;
+    
+    /* Keep going in sector order while the batch lasts */
+    request_t *rq = dd->next_rq[DD_WRITE] != NULL ? dd->next_rq[DD_WRITE] : dd->next_rq[DD_READ];
+    
+    if (rq == NULL || dd->batching >= DEADLINE_FIFO_BATCH) {
+        rq = deadline_new_batch(dd);
+        
+        if (rq == NULL) {
+            return NULL;
+        }
+    }
+    
+    int dir = deadline_dir(rq);
+    
+    dd->next_rq[DD_READ] = NULL;
+    dd->next_rq[DD_WRITE] = NULL;
+    dd->next_rq[dir] = deadline_latter(rq);
+    
+    deadline_remove(dd, rq);
+    dd->batching++;
+    
+    return rq;
+}
+
+/* Deadline elevator */
+elevator_type_t elevator_deadline = {
+    .name = "deadline",
+    .ops = {
+        .init = deadline_init,
+        .exit = deadline_exit,
+        .add_request = deadline_add_request,
+        .next_request = deadline_next_request,
+        .merged = deadline_merged,
+        .merge_requests = deadline_merge_requests,
+    },
+    .next = NULL,
+};
@@ -0,0 +1,198 @@
+/**
+ * elevator.c - Block I/O scheduler implementation
+ *
+ * This file contains the elevator registry, switching the elevator of a
+ * queue, and the noop elevator, which starts requests in the order they were
+ * queued and only relies on the merging done by the queue.
+ */
+
+#include <horizon/kernel.h>
+#include <horizon/types.h>
+#include <horizon/mm.h>
+#include <horizon/block.h>
+#include <horizon/elevator.h>
+#include <horizon/string.h>
+
+/* Registered elevators */
+static elevator_type_t *elevators = NULL;
+
+/* Protects elevators */
+static spinlock_t elevators_lock;
+
+/* Allocate the noop elevator data, a FIFO of requests */
+static void *noop_init(request_queue_t *q)
+{
+    (void)q;
+    
+    list_head_t *fifo = kmalloc(sizeof(list_head_t), MEM_KERNEL);
+    
+    if (fifo != NULL) {
+        list_init(fifo);
+    }
+    
+    return fifo;
+}
+
+/* Free the noop elevator data */
+static void noop_exit(request_queue_t *q, void *data)
+{
+    (void)q;
+    
+    kfree(data);
+}
+
+/* Queue a request at the end of the FIFO */
+static void noop_add_request(request_queue_t *q, request_t *rq)
+{
+    list_add_tail(&rq->queuelist, (list_head_t *)q->elevator_data);
+}
+
+/* Take the oldest request */
+static request_t *noop_next_request(request_queue_t *q)
+{
+    list_head_t *fifo = q->elevator_data;
+    
+    if (list_empty(fifo)) {
+        return NULL;
+    }
+    
+    request_t *rq = list_first_entry(fifo, request_t, queuelist);
+    list_del_init(&rq->queuelist);
+    
+    return rq;
+}
+
+/* Drop a request joined to another one */
+static void noop_merge_requests(request_queue_t *q, request_t *rq, request_t *next)
+{
+    (void)q;
+    (void)rq;
+    
+    list_del_init(&next->queuelist);
+}
+
+/* Noop elevator */
+elevator_type_t elevator_noop = {
+    .name = "noop",
+    .ops = {
+        .init = noop_init,
+        .exit = noop_exit,
+        .add_request = noop_add_request,
+        .next_request = noop_next_request,
+        .merged = NULL,
+        .merge_requests = noop_merge_requests,
+    },
+    .next = NULL,
+};
+
+/* Initialize the elevator registry with the built in elevators */
+void elevator_init(void)
+{
+    spin_lock_init(&elevators_lock);
+    elevators = NULL;
+    
+    elv_register(&elevator_noop);
+    elv_register(&elevator_deadline);
+    elv_register(&elevator_fair);
+}
+
+/* Register an elevator */
+int elv_register(elevator_type_t *e)
+{
+    if (e == NULL || e->name == NULL || e->ops.init == NULL || e->ops.exit == NULL ||
+        e->ops.add_request == NULL || e->ops.next_request == NULL || e->ops.merge_requests == NULL) {
+        return -1;
+    }
+    
+    spin_lock(&elevators_lock);
+    
+    /* Check if the name is taken */
+    for (elevator_type_t *existing = elevators; existing != NULL; existing = existing->next) {
+        if (strcmp(existing->name, e->name) == 0) {
+            spin_unlock(&elevators_lock);
+            return -1;
+        }
+    }
+    
+    e->next = elevators;
+    elevators = e;
+    
+    spin_unlock(&elevators_lock);
+    
+    return 0;
+}
+
+/* Find an elevator by name */
+elevator_type_t *elv_find(const char *name)
+{
+    if (name == NULL) {
+        return NULL;
+    }
+    
+    spin_lock(&elevators_lock);
+    
+    elevator_type_t *e = elevators;
+    
+    while (e != NULL && strcmp(e->name, name) != 0) {
+        e = e->next;
+    }
+    
+    spin_unlock(&elevators_lock);
+    
+    return e;
+}
+
+/* Switch the elevator of a queue */
+int elv_switch(request_queue_t *q, const char *name)
+{
+    unsigned long flags;
+    
+    if (q == NULL) {
+        return -1;
+    }
+    
+    elevator_type_t *e = elv_find(name);
+    
+    if (e == NULL) {
+        return -1;
+    }
+    
+    /* Allocate the new data first, the queue lock keeps interrupts off */
+    void *data = e->ops.init(q);
+    
+    if (data == NULL) {
+        return -1;
+    }
+    
+    blk_queue_lock(q, flags);
+    
+    if (q->elevator == e) {
+        blk_queue_unlock(q, flags);
+        e->ops.exit(q, data);
+        return 0;
+    }
+    
+    /* Requests of the old elevator are started before those of the new one */
+    request_t *rq;
+    
+    while ((rq = q->elevator->ops.next_request(q)) != NULL) {
+        list_del_init(&rq->hash_start);
+        list_del_init(&rq->hash_end);
+        list_add_tail(&rq->queuelist, &q->dispatch);
+        q->stats.queued--;
+    }
+    
+    elevator_type_t *old = q->elevator;
+    void *old_data = q->elevator_data;
+    
+    q->elevator = e;
+    q->elevator_data = data;
+    
+    blk_queue_unlock(q, flags);
+    
+    old->ops.exit(q, old_data);
+    
+    blk_run_queue(q);
+    
+    return 0;
+}
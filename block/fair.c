@@ -0,0 +1,143 @@
+/**
+ * fair.c - Fair queueing I/O scheduler
+ *
+ * This file contains the fair elevator. Requests are hashed by the process
+ * that submitted them into a fixed set of queues, which take turns starting
+ * a few requests each. A process streaming I/O can then not hold back the
+ * requests of the others for long. Processes that hash to the same queue
+ * share its turns.
+ */
+
+#include <horizon/kernel.h>
+#include <horizon/types.h>
+#include <horizon/mm.h>
+#include <horizon/block.h>
+#include <horizon/elevator.h>
+
+/* Tunables */
+#define FAIR_NR_QUEUES      16      /* Process queues, a power of two */
+#define FAIR_QUANTUM        4       /* Requests started from a queue per turn */
+
+/* Process queue */
+typedef struct fair_queue {
+    list_head_t requests;           /* Queued requests, oldest first */
+    list_head_t active;             /* Link in the list of queues with requests */
+    u32 served;                     /* Requests started in the current turn */
+} fair_queue_t;
+
+/* Fair elevator data */
+typedef struct fair_data {
+    fair_queue_t queues[FAIR_NR_QUEUES];    /* Process queues */
+    list_head_t active;             /* Queues with requests, in turn order */
+} fair_data_t;
+
+/* Get the queue of a process */
+static inline fair_queue_t *fair_queue(fair_data_t *fd, u32 pid)
+{
+    return &fd->queues[((pid * 2654435761U) >> 28) & (FAIR_NR_QUEUES - 1)];
+}
+
+/* Take a request off its queue, which leaves the turns when it empties */
+static void fair_remove(request_t *rq)
+{
+    fair_queue_t *fq = rq->elv_private;
+    
+    list_del_init(&rq->queuelist);
+    
+    if (list_empty(&fq->requests)) {
+        list_del_init(&fq->active);
+        fq->served = 0;
+    }
+}
+
+/* Allocate the fair elevator data */
+static void *fair_init(request_queue_t *q)
+{
+    (void)q;
+    
+    fair_data_t *fd = kmalloc(sizeof(fair_data_t), MEM_KERNEL | MEM_ZERO);
+    
+    if (fd == NULL) {
+        return NULL;
+    }
+    
+    for (int i = 0; i < FAIR_NR_QUEUES; i++) {
+        list_init(&fd->queues[i].requests);
+        list_init(&fd->queues[i].active);
+    }
+    
+    list_init(&fd->active);
+    
+    return fd;
+}
+
+/* Free the fair elevator data */
+static void fair_exit(request_queue_t *q, void *data)
+{
+    (void)q;
+    
+    kfree(data);
+}
+
+/* Queue a request on the queue of its process */
+static void fair_add_request(request_queue_t *q, request_t *rq)
+{
+    fair_data_t *fd = q->elevator_data;
+    fair_queue_t *fq = fair_queue(fd, rq->pid);
+    
+    /* A queue that had nothing to do waits for the next turn */
+    if (list_empty(&fq->requests)) {
+        list_add_tail(&fq->active, &fd->active);
+        fq->served = 0;
+    }
+    
+    list_add_tail(&rq->queuelist, &fq->requests);
+    rq->elv_private = fq;
+}
+
+/* Take the next request of the queue whose turn it is */
+static request_t *fair_next_request(request_queue_t *q)
+{
+    fair_data_t *fd = q->elevator_data;
+    
+    if (list_empty(&fd->active)) {
+        return NULL;
+    }
+    
+    fair_queue_t *fq = list_first_entry(&fd->active, fair_queue_t, active);
+    request_t *rq = list_first_entry(&fq->requests, request_t, queuelist);
+    
+    fair_remove(rq);
+    
+    /* Pass the turn on once the quantum is used up */
+    if (!list_empty(&fq->requests) && ++fq->served >= FAIR_QUANTUM) {
+        list_del(&fq->active);
+        list_add_tail(&fq->active, &fd->active);
+        fq->served = 0;
+    }
+    
+    return rq;
+}
+
+/* Drop a request joined to another one */
+static void fair_merge_requests(request_queue_t *q, request_t *rq, request_t *next)
+{
+    (void)q;
+    (void)rq;
+    
+    fair_remove(next);
+}
+
+/* Fair elevator */
+elevator_type_t elevator_fair = {
+    .name = "fair",
+    .ops = {
+        .init = fair_init,
+        .exit = fair_exit,
+        .add_request = fair_add_request,
+        .next_request = fair_next_request,
+        .merged = NULL,
+        .merge_requests = fair_merge_requests,
+    },
+    .next = NULL,
+};
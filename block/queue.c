@@ -0,0 +1,688 @@
+/**
+ * queue.c - Block request queue implementation
+ *
+ * This file contains the implementation of bios and request queues. Bios are
+ * merged into adjacent queued requests, handed to the elevator of the queue
+ * and started on the device while fewer than the queue depth are in flight.
+ * Drivers end requests with blk_end_request(), which completes the bios and
+ * starts the next requests. Drivers without a submit operation are driven
+ * through their synchronous read and write operations.
+ */
+
+#include <horizon/kernel.h>
+#include <horizon/types.h>
+#include <horizon/mm.h>
+#include <horizon/mm/pmm.h>
+#include <horizon/block.h>
+#include <horizon/elevator.h>
+#include <horizon/completion.h>
+#include <horizon/task.h>
+#include <horizon/string.h>
+#include <horizon/errno.h>
+
+/* Hash a sector into a merge hash bucket */
+static inline u32 blk_hash(u64 sector)
+{
+    return (u32)(sector ^ (sector >> 16)) & (BLK_HASH_SIZE - 1);
+}
+
+/* Add a queued request to the merge hashes */
+static void blk_rq_hash_add(request_queue_t *q, request_t *rq)
+{
+    list_add(&rq->hash_start, &q->hash_start[blk_hash(rq->sector)]);
+    list_add(&rq->hash_end, &q->hash_end[blk_hash(rq->sector + rq->nr_sectors)]);
+}
+
+/* Remove a request from the merge hashes */
+static void blk_rq_hash_del(request_t *rq)
+{
+    list_del_init(&rq->hash_start);
+    list_del_init(&rq->hash_end);
+}
+
+/* Find a queued request that starts at a sector */
+static request_t *blk_find_start(request_queue_t *q, u64 sector)
+{
+    request_t *rq;
+    
+    list_for_each_entry(rq, &q->hash_start[blk_hash(sector)], hash_start) {
+        if (rq->sector == sector) {
+            return rq;
+        }
+    }
+    
+    return NULL;
+}
+
+/* Find a queued request that ends right before a sector */
+static request_t *blk_find_end(request_queue_t *q, u64 sector)
+{
+    request_t *rq;
+    
+    list_for_each_entry(rq, &q->hash_end[blk_hash(sector)], hash_end) {
+        if (rq->sector + rq->nr_sectors == sector) {
+            return rq;
+        }
+    }
+    
+    return NULL;
+}
+
+/* Check if sectors going in a direction may be merged into a request */
+static int blk_rq_can_merge(request_queue_t *q, request_t *rq, u32 flags, u32 nr_sectors)
+{
+    if ((rq->flags & BIO_WRITE) != (flags & BIO_WRITE)) {
+        return 0;
+    }
+    
+    return rq->nr_sectors + nr_sectors <= q->max_sectors;
+}
+
+/* Join a queued request to the one before it, if they are adjacent */
+static void blk_try_merge(request_queue_t *q, request_t *rq, request_t *next)
+{
+    if (rq == NULL || next == NULL || rq == next) {
+        return;
+    }
+    
+    if (rq->sector + rq->nr_sectors != next->sector || !blk_rq_can_merge(q, rq, next->flags, next->nr_sectors)) {
+        return;
+    }
+    
+    blk_rq_hash_del(rq);
+    blk_rq_hash_del(next);
+    
+    /* Move the bios of next to the end of rq */
+    rq->biotail->bi_next = next->bio;
+    rq->biotail = next->biotail;
+    rq->nr_sectors += next->nr_sectors;
+    rq->flags |= next->flags & BIO_SYNC;
+    
+    blk_rq_hash_add(q, rq);
+    
+    /* The elevator takes next off its lists */
+    q->elevator->ops.merge_requests(q, rq, next);
+    
+    q->stats.request_merges++;
+    q->stats.queued--;
+    
+    kfree(next);
+}
+
+/* Set up a new request for a bio */
+static void blk_rq_init(request_queue_t *q, request_t *rq, bio_t *bio)
+{
+    list_init(&rq->queuelist);
+    list_init(&rq->fifo);
+    list_init(&rq->hash_start);
+    list_init(&rq->hash_end);
+    rb_clear_node(&rq->rb_node);
+    
+    rq->q = q;
+    rq->sector = bio->bi_sector;
+    rq->nr_sectors = bio_sectors(bio);
+    rq->flags = bio->bi_flags;
+    rq->pid = bio->bi_pid;
+    rq->deadline = 0;
+    rq->bio = bio;
+    rq->biotail = bio;
+    rq->elv_private = NULL;
+    rq->driver_data = NULL;
+}
+
+/* Queue a bio with the queue locked, returns 1 if the spare request was used */
+static int blk_queue_bio(request_queue_t *q, bio_t *bio, request_t *spare)
+{
+    u32 nr_sectors = bio_sectors(bio);
+    request_t *rq;
+    
+    q->stats.bios++;
+    
+    /* Append the bio to a request that ends where it starts */
+    rq = blk_find_end(q, bio->bi_sector);
+    
+    if (rq != NULL && blk_rq_can_merge(q, rq, bio->bi_flags, nr_sectors)) {
+        blk_rq_hash_del(rq);
+        
+        rq->biotail->bi_next = bio;
+        rq->biotail = bio;
+        rq->nr_sectors += nr_sectors;
+        rq->flags |= bio->bi_flags & BIO_SYNC;
+        
+        blk_rq_hash_add(q, rq);
+        q->stats.back_merges++;
+        
+        /* The request may now reach the next one */
+        blk_try_merge(q, rq, blk_find_start(q, rq->sector + rq->nr_sectors));
+        return 0;
+    }
+    
+    /* Prepend the bio to a request that starts where it ends */
+    rq = blk_find_start(q, bio->bi_sector + nr_sectors);
+    
+    if (rq != NULL && blk_rq_can_merge(q, rq, bio->bi_flags, nr_sectors)) {
+        blk_rq_hash_del(rq);
+        
+        bio->bi_next = rq->bio;
+        rq->bio = bio;
+        rq->sector = bio->bi_sector;
+        rq->nr_sectors += nr_sectors;
+        rq->flags |= bio->bi_flags & BIO_SYNC;
+        
+        blk_rq_hash_add(q, rq);
+        q->stats.front_merges++;
+        
+        /* The first sector changed, let the elevator resort it */
+        if (q->elevator->ops.merged != NULL) {
+            q->elevator->ops.merged(q, rq);
+        }
+        
+        /* The request may now reach the previous one */
+        blk_try_merge(q, blk_find_end(q, rq->sector), rq);
+        return 0;
+    }
+    
+    /* Queue a new request */
+    blk_rq_init(q, spare, bio);
+    blk_rq_hash_add(q, spare);
+    q->elevator->ops.add_request(q, spare);
+    q->stats.queued++;
+    
+    return 1;
+}
+
+/* Add a bio to its queue without starting requests */
+static void blk_queue_add(request_queue_t *q, bio_t *bio)
+{
+    unsigned long flags;
+    
+    /* Allocate the request up front, the queue lock keeps interrupts off */
+    request_t *spare = kmalloc(sizeof(request_t), MEM_KERNEL | MEM_ZERO);
+    
+    if (spare == NULL) {
+        bio_endio(bio, -ENOMEM);
+        return;
+    }
+    
+    blk_queue_lock(q, flags);
+    int used = blk_queue_bio(q, bio, spare);
+    blk_queue_unlock(q, flags);
+    
+    if (!used) {
+        kfree(spare);
+    }
+}
+
+/* Take the next request to start with the queue locked */
+static request_t *blk_take_request(request_queue_t *q)
+{
+    request_t *rq;
+    
+    /* Requests put back by the driver or left by an old elevator go first */
+    if (!list_empty(&q->dispatch)) {
+        rq = list_first_entry(&q->dispatch, request_t, queuelist);
+        list_del_init(&rq->queuelist);
+        return rq;
+    }
+    
+    rq = q->elevator->ops.next_request(q);
+    
+    if (rq != NULL) {
+        blk_rq_hash_del(rq);
+        q->stats.queued--;
+    }
+    
+    return rq;
+}
+
+/* Do a run of memory contiguous bytes through the synchronous operations of a device */
+static int blk_do_run(block_device_t *dev, int write, u64 *sector, u8 *buf, u32 len)
+{
+    u32 count = len / dev->sector_size;
+    int ret;
+    
+    if (len % dev->sector_size != 0) {
+        return -EIO;
+    }
+    
+    if (write) {
+        ret = dev->ops->write(dev, *sector, count, buf);
+    } else {
+        ret = dev->ops->read(dev, *sector, count, buf);
+    }
+    
+    if (ret < 0) {
+        return -EIO;
+    }
+    
+    *sector += count;
+    
+    return 0;
+}
+
+/* Do a request through the synchronous operations of a device */
+static int blk_do_request(block_device_t *dev, request_t *rq)
+{
+    int write = (rq->flags & BIO_WRITE) != 0;
+    u64 sector = rq->sector;
+    u8 *run = NULL;
+    u32 run_len = 0;
+    int ret;
+    
+    /* Segments that follow each other in memory are done in one call */
+    for (bio_t *bio = rq->bio; bio != NULL; bio = bio->bi_next) {
+        for (u16 i = 0; i < bio->bi_vcnt; i++) {
+            bio_vec_t *bv = &bio->bi_io_vec[i];
+            u8 *buf = pmm_page_to_virt(bv->bv_page);
+            
+            if (buf == NULL) {
+                return -EIO;
+            }
+            
+            buf += bv->bv_offset;
+            
+            if (run != NULL && buf == run + run_len) {
+                run_len += bv->bv_len;
+                continue;
+            }
+            
+            if (run != NULL && (ret = blk_do_run(dev, write, &sector, run, run_len)) < 0) {
+                return ret;
+            }
+            
+            run = buf;
+            run_len = bv->bv_len;
+        }
+    }
+    
+    if (run != NULL) {
+        return blk_do_run(dev, write, &sector, run, run_len);
+    }
+    
+    return 0;
+}
+
+/* Start a request on the device, returns -EBUSY if the driver is full */
+static int blk_start_request(request_queue_t *q, request_t *rq)
+{
+    block_device_t *dev = q->dev;
+    
+    if (dev->ops->submit != NULL) {
+        int ret = dev->ops->submit(dev, rq);
+        
+        if (ret == -EBUSY) {
+            return ret;
+        }
+        
+        if (ret < 0) {
+            blk_end_request(rq, ret);
+        }
+        
+        return 0;
+    }
+    
+    blk_end_request(rq, blk_do_request(dev, rq));
+    
+    return 0;
+}
+
+/* Rerun a queue whose idle driver refused a request */
+static void blk_delay_work(unsigned long data)
+{
+    blk_run_queue((request_queue_t *)data);
+}
+
+/* Start queued requests while the device has room for them */
+void blk_run_queue(request_queue_t *q)
+{
+    unsigned long flags;
+    request_t *rq;
+    
+    if (q == NULL) {
+        return;
+    }
+    
+    blk_queue_lock(q, flags);
+    
+    /* One caller starts requests at a time, the others make it look again */
+    if (q->running) {
+        q->rerun = 1;
+        blk_queue_unlock(q, flags);
+        return;
+    }
+    
+    q->running = 1;
+    
+    do {
+        q->rerun = 0;
+        
+        while (q->in_flight < q->depth && (rq = blk_take_request(q)) != NULL) {
+            q->in_flight++;
+            q->stats.dispatched++;
+            
+            blk_queue_unlock(q, flags);
+            int ret = blk_start_request(q, rq);
+            blk_queue_lock(q, flags);
+            
+            if (ret == -EBUSY) {
+                /* Retry when the driver ends one of its requests */
+                list_add(&rq->queuelist, &q->dispatch);
+                q->in_flight--;
+                q->stats.dispatched--;
+                
+                /* With nothing in flight no end will come, so retry after a delay */
+                if (q->in_flight == 0) {
+                    mod_timer(&q->delay_timer, timer_get_jiffies() + timer_msecs_to_jiffies(BLK_BUSY_DELAY) + 1);
+                }
+                
+                break;
+            }
+        }
+    } while (q->rerun);
+    
+    q->running = 0;
+    
+    blk_queue_unlock(q, flags);
+}
+
+/* End a started request, may be called from interrupt context */
+void blk_end_request(request_t *rq, int error)
+{
+    request_queue_t *q = rq->q;
+    bio_t *bio = rq->bio;
+    unsigned long flags;
+    
+    /* Complete the bios, their callbacks may free them */
+    while (bio != NULL) {
+        bio_t *next = bio->bi_next;
+        
+        bio->bi_next = NULL;
+        bio_endio(bio, error);
+        
+        bio = next;
+    }
+    
+    blk_queue_lock(q, flags);
+    q->in_flight--;
+    q->stats.completed++;
+    blk_queue_unlock(q, flags);
+    
+    kfree(rq);
+    
+    /* Keep the device busy */
+    blk_run_queue(q);
+}
+
+/* Allocate a bio with room for a number of segments */
+bio_t *bio_alloc(u16 nr_vecs)
+{
+    bio_t *bio = kmalloc(sizeof(bio_t) + nr_vecs * sizeof(bio_vec_t), MEM_KERNEL | MEM_ZERO);
+    
+    if (bio == NULL) {
+        return NULL;
+    }
+    
+    bio->bi_io_vec = (bio_vec_t *)(bio + 1);
+    bio->bi_max_vecs = nr_vecs;
+    
+    return bio;
+}
+
+/* Free a bio */
+void bio_put(bio_t *bio)
+{
+    kfree(bio);
+}
+
+/* Add part of a page to a bio, returns the number of bytes added */
+u32 bio_add_page(bio_t *bio, page_t *page, u32 len, u32 offset)
+{
+    if (bio == NULL || page == NULL || len == 0 || offset + len > PAGE_SIZE) {
+        return 0;
+    }
+    
+    /* Extend the last segment if the part follows it */
+    if (bio->bi_vcnt > 0) {
+        bio_vec_t *bv = &bio->bi_io_vec[bio->bi_vcnt - 1];
+        
+        if (bv->bv_page == page && bv->bv_offset + bv->bv_len == offset) {
+            bv->bv_len += len;
+            bio->bi_size += len;
+            return len;
+        }
+    }
+    
+    if (bio->bi_vcnt >= bio->bi_max_vecs) {
+        return 0;
+    }
+    
+    bio_vec_t *bv = &bio->bi_io_vec[bio->bi_vcnt++];
+    bv->bv_page = page;
+    bv->bv_len = len;
+    bv->bv_offset = offset;
+    bio->bi_size += len;
+    
+    return len;
+}
+
+/* Complete a bio */
+void bio_endio(bio_t *bio, int error)
+{
+    bio->bi_error = error;
+    
+    if (bio->bi_end_io != NULL) {
+        bio->bi_end_io(bio, error);
+    }
+}
+
+/* Bio completion callback that completes the completion in bi_private */
+void bio_end_io_completion(bio_t *bio, int error)
+{
+    (void)error;
+    
+    completion_complete((completion_t *)bio->bi_private);
+}
+
+/* Submit a bio, its callback runs when it ends */
+int submit_bio(bio_t *bio)
+{
+    if (bio == NULL || bio->bi_bdev == NULL || bio->bi_bdev->queue == NULL) {
+        return -EINVAL;
+    }
+    
+    block_device_t *dev = bio->bi_bdev;
+    
+    /* Check that the bio covers whole sectors of the device */
+    if (bio->bi_size == 0 || bio->bi_size % dev->sector_size != 0) {
+        return -EINVAL;
+    }
+    
+    if (bio->bi_sector >= dev->sector_count || bio->bi_sector + bio_sectors(bio) > dev->sector_count) {
+        return -EINVAL;
+    }
+    
+    /* Check that the device can do the I/O */
+    if (dev->ops->submit == NULL && (bio_data_dir(bio) ? dev->ops->write == NULL : dev->ops->read == NULL)) {
+        return -EOPNOTSUPP;
+    }
+    
+    bio->bi_next = NULL;
+    bio->bi_error = 0;
+    bio->bi_pid = current != NULL ? current->pid : 0;
+    
+    /* Hold the bio back while the task is plugged */
+    blk_plug_t *plug = current != NULL ? current->plug : NULL;
+    
+    if (plug != NULL) {
+        if (plug->tail != NULL) {
+            plug->tail->bi_next = bio;
+        } else {
+            plug->head = bio;
+        }
+        
+        plug->tail = bio;
+        
+        if (++plug->count >= BLK_PLUG_MAX) {
+            blk_flush_plug();
+        }
+        
+        return 0;
+    }
+    
+    blk_queue_add(dev->queue, bio);
+    blk_run_queue(dev->queue);
+    
+    return 0;
+}
+
+/* Submit a bio and wait for it to end */
+int submit_bio_wait(bio_t *bio)
+{
+    completion_t done;
+    
+    completion_init(&done);
+    
+    bio->bi_private = &done;
+    bio->bi_end_io = bio_end_io_completion;
+    bio->bi_flags |= BIO_SYNC;
+    
+    int ret = submit_bio(bio);
+    
+    if (ret < 0) {
+        return ret;
+    }
+    
+    /* Bios held by a plug must reach the device before sleeping */
+    blk_flush_plug();
+    
+    completion_wait(&done);
+    
+    return bio->bi_error;
+}
+
+/* Plug the current task, its bios are held until the plug is finished */
+void blk_start_plug(blk_plug_t *plug)
+{
+    plug->head = NULL;
+    plug->tail = NULL;
+    plug->count = 0;
+    
+    /* Nested plugs are folded into the outermost one */
+    if (current != NULL && current->plug == NULL) {
+        current->plug = plug;
+    }
+}
+
+/* Unplug the current task and submit its held bios */
+void blk_finish_plug(blk_plug_t *plug)
+{
+    if (current == NULL || current->plug != plug) {
+        return;
+    }
+    
+    blk_flush_plug();
+    current->plug = NULL;
+}
+
+/* Submit the bios held by the plug of the current task */
+void blk_flush_plug(void)
+{
+    blk_plug_t *plug = current != NULL ? current->plug : NULL;
+    
+    if (plug == NULL || plug->head == NULL) {
+        return;
+    }
+    
+    bio_t *bio = plug->head;
+    request_queue_t *last = NULL;
+    
+    plug->head = NULL;
+    plug->tail = NULL;
+    plug->count = 0;
+    
+    /* Queue every bio before starting requests, so they can be merged */
+    while (bio != NULL) {
+        bio_t *next = bio->bi_next;
+        request_queue_t *q = bio->bi_bdev->queue;
+        
+        if (last != NULL && last != q) {
+            blk_run_queue(last);
+        }
+        
+        bio->bi_next = NULL;
+        blk_queue_add(q, bio);
+        
+        last = q;
+        bio = next;
+    }
+    
+    blk_run_queue(last);
+}
+
+/* Allocate the request queue of a device */
+request_queue_t *blk_init_queue(block_device_t *dev)
+{
+    request_queue_t *q = kmalloc(sizeof(request_queue_t), MEM_KERNEL | MEM_ZERO);
+    
+    if (q == NULL) {
+        return NULL;
+    }
+    
+    spin_lock_init(&q->lock);
+    list_init(&q->dispatch);
+    
+    for (u32 i = 0; i < BLK_HASH_SIZE; i++) {
+        list_init(&q->hash_start[i]);
+        list_init(&q->hash_end[i]);
+    }
+    
+    q->dev = dev;
+    q->max_sectors = BLK_MAX_SECTORS;
+    q->depth = BLK_QUEUE_DEPTH;
+    
+    setup_timer(&q->delay_timer, blk_delay_work, (unsigned long)q);
+    
+    /* Start with the default elevator */
+    q->elevator = elv_find(ELV_DEFAULT);
+    
+    if (q->elevator == NULL) {
+        q->elevator = &elevator_noop;
+    }
+    
+    q->elevator_data = q->elevator->ops.init(q);
+    
+    if (q->elevator_data == NULL) {
+        kfree(q);
+        return NULL;
+    }
+    
+    return q;
+}
+
+/* Free the request queue of a device, it must be idle */
+void blk_cleanup_queue(request_queue_t *q)
+{
+    if (q == NULL) {
+        return;
+    }
+    
+    del_timer_sync(&q->delay_timer);
+    
+    q->elevator->ops.exit(q, q->elevator_data);
+    kfree(q);
+}
+
+/* Get the statistics of a request queue */
+void blk_queue_get_stats(request_queue_t *q, blk_queue_stats_t *stats)
+{
+    unsigned long flags;
+    
+    if (q == NULL || stats == NULL) {
+        return;
+    }
+    
+    blk_queue_lock(q, flags);
+    *stats = q->stats;
+    stats->in_flight = q->in_flight;
+    blk_queue_unlock(q, flags);
+}
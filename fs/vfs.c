@@ -191,6 +191,8 @@ file_t *fs_open(const char *path, u32 flags) {
         return NULL;
     }
 
+    INIT_LIST_HEAD(&file->f_ep_links);
+
     /* Copy the file name */
     u32 i;
     for (i = 0; i < 255 && path[i] != '\0'; i++) {
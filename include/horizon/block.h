@@ -2,6 +2,12 @@
  * block.h - Block device subsystem definitions
  * 
  * This file contains definitions for the block device subsystem.
+ *
+ * I/O is described by bios, each a run of sectors backed by a vector of page
+ * segments. Bios are queued on the request queue of their device, where
+ * adjacent ones are merged into requests and an elevator picks the order in
+ * which requests are started. Completion is reported through callbacks, so
+ * callers may keep many bios in flight and wait only when they need to.
  */
 
 #ifndef _KERNEL_BLOCK_H
@@ -9,6 +15,17 @@
 
 #include <horizon/types.h>
 #include <horizon/device.h>
+#include <horizon/list.h>
+#include <horizon/spinlock.h>
+#include <horizon/rbtree.h>
+#include <horizon/irqflags.h>
+#include <horizon/timer.h>
+#include <horizon/mm/page.h>
+
+struct block_device;
+struct request;
+struct request_queue;
+struct elevator_type;
 
 /* Block device operations */
 typedef struct block_device_ops {
@@ -18,6 +35,7 @@ typedef struct block_device_ops {
     int (*write)(struct block_device *dev, u64 sector, u32 count, const void *buffer);
     int (*ioctl)(struct block_device *dev, u32 request, void *arg);
     int (*flush)(struct block_device *dev);
+    int (*submit)(struct block_device *dev, struct request *rq);    /* Start a request, optional */
 } block_device_ops_t;
 
 /* Block device structure */
@@ -27,9 +45,135 @@ typedef struct block_device {
     u64 sector_count;               /* Number of sectors */
     block_device_ops_t *ops;        /* Block device operations */
     void *private_data;             /* Private data */
+    struct request_queue *queue;    /* Request queue */
     struct block_device *next;      /* Next block device in list */
 } block_device_t;
 
+/* Bio flags */
+#define BIO_WRITE           0x01    /* Write, otherwise read */
+#define BIO_SYNC            0x02    /* A caller waits for it, start before other I/O */
+
+/* Request queue defaults */
+#define BLK_HASH_SIZE       64      /* Merge hash buckets, a power of two */
+#define BLK_MAX_SECTORS     256     /* Largest request, in sectors */
+#define BLK_QUEUE_DEPTH     32      /* Requests started at once */
+#define BLK_PLUG_MAX        32      /* Bios held by a plug before it is flushed */
+#define BLK_BUSY_DELAY      3       /* Milliseconds before retrying a request an idle driver refused */
+
+/* Page segment of a bio */
+typedef struct bio_vec {
+    page_t *bv_page;                /* Page */
+    u32 bv_len;                     /* Length in bytes */
+    u32 bv_offset;                  /* Offset in the page */
+} bio_vec_t;
+
+struct bio;
+
+/* Bio completion callback, may run in interrupt context */
+typedef void (*bio_end_io_t)(struct bio *bio, int error);
+
+/* Block I/O descriptor */
+typedef struct bio {
+    struct bio *bi_next;            /* Next bio of a request or plug */
+    block_device_t *bi_bdev;        /* Device */
+    u64 bi_sector;                  /* First sector */
+    u32 bi_size;                    /* Size in bytes */
+    u32 bi_flags;                   /* Bio flags */
+    u32 bi_pid;                     /* Submitting process */
+    u16 bi_vcnt;                    /* Segments in use */
+    u16 bi_max_vecs;                /* Segments allocated */
+    bio_vec_t *bi_io_vec;           /* Segments */
+    bio_end_io_t bi_end_io;         /* Completion callback */
+    void *bi_private;               /* Data of the submitter */
+    int bi_error;                   /* Result, 0 or a negative error */
+} bio_t;
+
+/* Request, a run of adjacent bios started as one */
+typedef struct request {
+    list_head_t queuelist;          /* Link in the dispatch list or an elevator list */
+    list_head_t fifo;               /* Link in an elevator FIFO */
+    list_head_t hash_start;         /* Merge hash link, by first sector */
+    list_head_t hash_end;           /* Merge hash link, by sector after the last */
+    rb_node_t rb_node;              /* Link in an elevator sort tree */
+    struct request_queue *q;        /* Queue */
+    u64 sector;                     /* First sector */
+    u32 nr_sectors;                 /* Number of sectors */
+    u32 flags;                      /* Bio flags */
+    u32 pid;                        /* Process of the first bio */
+    u64 deadline;                   /* Jiffy by which it should be started */
+    bio_t *bio;                     /* First bio */
+    bio_t *biotail;                 /* Last bio */
+    void *elv_private;              /* Elevator data */
+    void *driver_data;              /* Driver data while started */
+} request_t;
+
+/* Request queue statistics */
+typedef struct blk_queue_stats {
+    u64 bios;                       /* Bios submitted */
+    u64 back_merges;                /* Bios appended to a request */
+    u64 front_merges;               /* Bios prepended to a request */
+    u64 request_merges;             /* Requests joined after a merge */
+    u64 dispatched;                 /* Requests started */
+    u64 completed;                  /* Requests ended */
+    u32 queued;                     /* Requests in the elevator */
+    u32 in_flight;                  /* Requests started and not ended */
+} blk_queue_stats_t;
+
+/* Request queue */
+typedef struct request_queue {
+    spinlock_t lock;                /* Protects the queue, taken with interrupts off */
+    block_device_t *dev;            /* Device */
+    struct elevator_type *elevator; /* Elevator */
+    void *elevator_data;            /* Elevator data */
+    list_head_t dispatch;           /* Requests to start before asking the elevator */
+    list_head_t hash_start[BLK_HASH_SIZE];  /* Queued requests, by first sector */
+    list_head_t hash_end[BLK_HASH_SIZE];    /* Queued requests, by sector after the last */
+    u32 max_sectors;                /* Largest request, in sectors */
+    u32 depth;                      /* Requests started at once */
+    u32 in_flight;                  /* Requests started and not ended */
+    int running;                    /* Someone is starting requests */
+    int rerun;                      /* Look for requests again before stopping */
+    struct timer_list delay_timer;  /* Reruns the queue after an idle driver refused a request */
+    blk_queue_stats_t stats;        /* Statistics */
+} request_queue_t;
+
+/* Plug, holds the bios of a task back so they can be merged */
+typedef struct blk_plug {
+    bio_t *head;                    /* First plugged bio */
+    bio_t *tail;                    /* Last plugged bio */
+    u32 count;                      /* Plugged bios */
+} blk_plug_t;
+
+/* Lock a request queue, interrupts stay off until it is unlocked */
+#define blk_queue_lock(q, flags) \
+    do { local_irq_save(flags); spin_lock(&(q)->lock); } while (0)
+
+/* Unlock a request queue */
+#define blk_queue_unlock(q, flags) \
+    do { spin_unlock(&(q)->lock); local_irq_restore(flags); } while (0)
+
+/**
+ * Get the number of sectors of a bio
+ *
+ * @param bio Bio
+ * @return Number of sectors
+ */
+static inline u32 bio_sectors(bio_t *bio)
+{
+    return bio->bi_size / bio->bi_bdev->sector_size;
+}
+
+/**
+ * Check if a bio writes
+ *
+ * @param bio Bio
+ * @return Nonzero for a write
+ */
+static inline int bio_data_dir(bio_t *bio)
+{
+    return (bio->bi_flags & BIO_WRITE) != 0;
+}
+
 /* Block device functions */
 void block_init(void);
 int block_register_device(block_device_t *dev);
@@ -40,4 +184,25 @@ int block_write(block_device_t *dev, u64 sector, u32 count, const void *buffer);
 int block_ioctl(block_device_t *dev, u32 request, void *arg);
 int block_flush(block_device_t *dev);
 
+/* Bio functions */
+bio_t *bio_alloc(u16 nr_vecs);
+void bio_put(bio_t *bio);
+u32 bio_add_page(bio_t *bio, page_t *page, u32 len, u32 offset);
+void bio_endio(bio_t *bio, int error);
+void bio_end_io_completion(bio_t *bio, int error);
+int submit_bio(bio_t *bio);
+int submit_bio_wait(bio_t *bio);
+
+/* Plug functions */
+void blk_start_plug(blk_plug_t *plug);
+void blk_finish_plug(blk_plug_t *plug);
+void blk_flush_plug(void);
+
+/* Request queue functions */
+request_queue_t *blk_init_queue(block_device_t *dev);
+void blk_cleanup_queue(request_queue_t *q);
+void blk_run_queue(request_queue_t *q);
+void blk_end_request(request_t *rq, int error);
+void blk_queue_get_stats(request_queue_t *q, blk_queue_stats_t *stats);
+
 #endif /* _KERNEL_BLOCK_H */
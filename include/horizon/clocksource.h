@@ -0,0 +1,52 @@
+/**
+ * clocksource.h - Horizon kernel clock source definitions
+ *
+ * This file contains definitions for clock sources and the timekeeping
+ * built on them. A clock source is a free-running counter; ktime_get()
+ * reads the best one registered and scales the cycles since the last tick
+ * to nanoseconds, so time advances smoothly between ticks instead of in
+ * jiffy steps.
+ */
+
+#ifndef _HORIZON_CLOCKSOURCE_H
+#define _HORIZON_CLOCKSOURCE_H
+
+#include <horizon/types.h>
+#include <horizon/list.h>
+
+/* Longest the timekeeping goes without a tick, bounds the scaling error */
+#define CLOCKSOURCE_MAX_IDLE_SEC    10
+
+/* Clock source */
+typedef struct clocksource {
+    const char *name;              /* Clock source name */
+    u64 (*read)(void);             /* Read the counter */
+    u64 mask;                      /* Bits the counter has, for wraparound */
+    u32 mult;                      /* Nanoseconds = (cycles * mult) >> shift */
+    u32 shift;
+    int rating;                    /* The highest rated clock source is used */
+    int vdso_clock_mode;           /* How user mode reads it, VDSO_CLOCK_* */
+    struct list_head list;         /* Link in the clock source list */
+} clocksource_t;
+
+/**
+ * Convert clock source cycles to nanoseconds
+ *
+ * @param cs Clock source
+ * @param cycles Cycles, no more than CLOCKSOURCE_MAX_IDLE_SEC worth
+ * @return Nanoseconds
+ */
+static inline u64 clocksource_cyc2ns(const clocksource_t *cs, u64 cycles) {
+    return (cycles * cs->mult) >> cs->shift;
+}
+
+/* Clock source functions */
+void clocksource_calc_mult_shift(clocksource_t *cs, u64 freq);
+int clocksource_register(clocksource_t *cs);
+const char *clocksource_current(void);
+
+/* Timekeeping functions */
+void timekeeping_init(void);
+void timekeeping_tick(void);
+
+#endif /* _HORIZON_CLOCKSOURCE_H */
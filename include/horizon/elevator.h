@@ -0,0 +1,47 @@
+/**
+ * elevator.h - Block I/O scheduler definitions
+ *
+ * This file contains definitions for elevators, the I/O schedulers of
+ * request queues. An elevator holds the queued requests of a queue and picks
+ * the next one to start. All operations except init and exit are called with
+ * the queue lock held and interrupts off, so they must not sleep.
+ */
+
+#ifndef _HORIZON_ELEVATOR_H
+#define _HORIZON_ELEVATOR_H
+
+#include <horizon/types.h>
+#include <horizon/block.h>
+
+/* Default elevator of new queues */
+#define ELV_DEFAULT         "deadline"
+
+/* Elevator operations */
+typedef struct elevator_ops {
+    void *(*init)(request_queue_t *q);                                      /* Allocate the elevator data */
+    void (*exit)(request_queue_t *q, void *data);                           /* Free the elevator data */
+    void (*add_request)(request_queue_t *q, request_t *rq);                 /* Queue a new request */
+    request_t *(*next_request)(request_queue_t *q);                         /* Take the request to start next */
+    void (*merged)(request_queue_t *q, request_t *rq);                      /* A bio was added to the front of a request */
+    void (*merge_requests)(request_queue_t *q, request_t *rq, request_t *next); /* Next was joined to rq, drop it */
+} elevator_ops_t;
+
+/* Elevator type */
+typedef struct elevator_type {
+    const char *name;               /* Name */
+    elevator_ops_t ops;             /* Operations */
+    struct elevator_type *next;     /* Next registered elevator */
+} elevator_type_t;
+
+/* Elevator functions */
+void elevator_init(void);
+int elv_register(elevator_type_t *e);
+elevator_type_t *elv_find(const char *name);
+int elv_switch(request_queue_t *q, const char *name);
+
+/* Built in elevators */
+extern elevator_type_t elevator_noop;
+extern elevator_type_t elevator_deadline;
+extern elevator_type_t elevator_fair;
+
+#endif /* _HORIZON_ELEVATOR_H */
@@ -111,6 +111,7 @@ typedef struct file {
     struct dentry *dentry;    /* Directory entry */
     void *fs_data;            /* File system specific data */
     struct file_operations *f_ops; /* File operations */
+    struct list_head f_ep_links; /* Epoll items watching this file */
 } file_t;
 
 /* Inode operations */
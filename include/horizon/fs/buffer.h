@@ -0,0 +1,104 @@
+/**
+ * buffer.h - Horizon kernel block buffer cache definitions
+ *
+ * This file contains definitions for the buffer cache. It keeps blocks of
+ * block devices in memory, keyed by device, block number and block size.
+ * Buffers are reference counted while in use, and the unused ones sit on an
+ * LRU list from which they are evicted when the cache is full. Dirty buffers
+ * are written back when they are synced or evicted.
+ */
+
+#ifndef _HORIZON_FS_BUFFER_H
+#define _HORIZON_FS_BUFFER_H
+
+#include <horizon/types.h>
+#include <horizon/list.h>
+#include <horizon/sync.h>
+
+/* Number of hash buckets, a power of two */
+#define BUFFER_HASH_SIZE    1024
+
+/* Default limit on the number of cached buffers */
+#define BUFFER_CACHE_MAX    2048
+
+/* Buffer state bits */
+#define BH_UPTODATE         0x01    /* Data matches the device, or is newer */
+#define BH_DIRTY            0x02    /* Data must be written back */
+
+/* Buffer head structure */
+typedef struct buffer_head {
+    struct list_head b_hash;        /* Hash bucket link */
+    struct list_head b_lru;         /* LRU link, only while unused */
+    void *b_bdev;                   /* Block device */
+    u32 b_blocknr;                  /* Block number */
+    u32 b_size;                     /* Block size */
+    u8 *b_data;                     /* Block data */
+    int b_count;                    /* References, under the cache lock */
+    volatile unsigned long b_state; /* State bits */
+    mutex_t b_lock;                 /* Serializes I/O and updates of the data */
+} buffer_head_t;
+
+/* Buffer cache statistics */
+typedef struct buffer_cache_stats {
+    u64 hits;                       /* Lookups that found the block cached */
+    u64 misses;                     /* Lookups that had to add a buffer */
+    u64 evictions;                  /* Unused buffers dropped to make room */
+    u64 reads;                      /* Blocks read from devices */
+    u64 writes;                     /* Blocks written back to devices */
+    u32 nr_buffers;                 /* Cached buffers */
+    u32 nr_dirty;                   /* Dirty buffers */
+    u32 max_buffers;                /* Limit on the cached buffers */
+} buffer_cache_stats_t;
+
+/**
+ * Check if a buffer matches the device
+ *
+ * @param bh Buffer head
+ * @return Nonzero if up to date
+ */
+static inline int buffer_uptodate(buffer_head_t *bh) {
+    return (bh->b_state & BH_UPTODATE) != 0;
+}
+
+/**
+ * Check if a buffer must be written back
+ *
+ * @param bh Buffer head
+ * @return Nonzero if dirty
+ */
+static inline int buffer_dirty(buffer_head_t *bh) {
+    return (bh->b_state & BH_DIRTY) != 0;
+}
+
+/**
+ * Lock a buffer against concurrent I/O and updates
+ *
+ * @param bh Buffer head
+ */
+static inline void lock_buffer(buffer_head_t *bh) {
+    mutex_lock(&bh->b_lock);
+}
+
+/**
+ * Unlock a buffer
+ *
+ * @param bh Buffer head
+ */
+static inline void unlock_buffer(buffer_head_t *bh) {
+    mutex_unlock(&bh->b_lock);
+}
+
+/* Buffer cache functions */
+void buffer_cache_init(void);
+void buffer_cache_set_max(u32 max_buffers);
+buffer_head_t *getblk(void *bdev, u32 block, u32 size);
+buffer_head_t *bread(void *bdev, u32 block, u32 size);
+void brelse(buffer_head_t *bh);
+void mark_buffer_dirty(buffer_head_t *bh);
+int sync_dirty_buffer(buffer_head_t *bh);
+int sync_blockdev(void *bdev);
+void invalidate_bdev(void *bdev);
+void buffer_cache_get_stats(buffer_cache_stats_t *stats);
+void buffer_cache_print_stats(void);
+
+#endif /* _HORIZON_FS_BUFFER_H */
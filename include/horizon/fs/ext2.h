@@ -9,10 +9,18 @@
 
 #include <horizon/types.h>
 #include <horizon/fs.h>
+#include <horizon/spinlock.h>
+#include <horizon/sync.h>
 
 /* Ext2 magic number */
 #define EXT2_MAGIC 0xEF53
 
+/* The superblock is the 1024 bytes at offset 1024, whatever the block size */
+#define EXT2_SUPER_SIZE  1024
+#define EXT2_SUPER_BLOCK 1
+
+struct buffer_head;
+
 /* Ext2 superblock structure */
 typedef struct ext2_superblock {
     u32 s_inodes_count;         /* Inodes count */
@@ -66,9 +74,24 @@ typedef struct ext2_superblock {
     u16 s_reserved_word_pad;
     u32 s_default_mount_opts;
     u32 s_first_meta_bg;        /* First metablock block group */
-    u32 s_reserved[190];        /* Padding to the end of the block */
+    u32 s_mkfs_time;            /* When the file system was created */
+    u32 s_jnl_blocks[17];       /* Backup of the journal inode */
+    u32 s_blocks_count_hi;      /* High 32 bits of the blocks count */
+    u32 s_r_blocks_count_hi;    /* High 32 bits of the reserved blocks count */
+    u32 s_free_blocks_hi;       /* High 32 bits of the free blocks count */
+    u16 s_min_extra_isize;      /* All inodes have at least this much extra space */
+    u16 s_want_extra_isize;     /* New inodes should reserve this much extra space */
+    u32 s_flags;                /* Miscellaneous flags */
+    u32 s_reserved[167];        /* Padding to the end of the block */
 } ext2_superblock_t;
 
+/* Ext2 compatible features */
+#define EXT2_FEATURE_COMPAT_DIR_INDEX 0x0020
+
+/* Ext2 superblock flags */
+#define EXT2_FLAGS_SIGNED_HASH   0x0001
+#define EXT2_FLAGS_UNSIGNED_HASH 0x0002
+
 /* Ext2 block group descriptor structure */
 typedef struct ext2_group_desc {
     u32 bg_block_bitmap;        /* Blocks bitmap block */
@@ -112,6 +135,62 @@ typedef struct ext2_dir_entry {
     char name[255];             /* File name */
 } ext2_dir_entry_t;
 
+/* Ext2 inode flags */
+#define EXT2_INDEX_FL    0x00001000 /* Directory has a hashed index */
+
+/* Directory index hash versions */
+#define EXT2_HASH_LEGACY            0
+#define EXT2_HASH_HALF_MD4          1
+#define EXT2_HASH_TEA               2
+#define EXT2_HASH_LEGACY_UNSIGNED   3
+#define EXT2_HASH_HALF_MD4_UNSIGNED 4
+#define EXT2_HASH_TEA_UNSIGNED      5
+
+/* Directory index limits */
+#define EXT2_DX_MAX_LEVELS  2       /* The root and one level of index nodes */
+#define EXT2_DX_CACHE_SIZE  16      /* Directory index roots cached per file system */
+
+/*
+ * Directory index root information. It follows the "." and ".." entries
+ * of the first block, inside the space of the ".." entry.
+ */
+typedef struct ext2_dx_root_info {
+    u32 reserved_zero;          /* Always zero */
+    u8  hash_version;           /* Hash version */
+    u8  info_length;            /* Length of this structure, 8 */
+    u8  indirect_levels;        /* Levels of index nodes below the root */
+    u8  unused_flags;
+} ext2_dx_root_info_t;
+
+/* Directory index entry, mapping the hashes from hash up to a block */
+typedef struct ext2_dx_entry {
+    u32 hash;                   /* Lowest hash, the low bit marks a collision */
+    u32 block;                  /* Logical block of the directory */
+} ext2_dx_entry_t;
+
+/* Count and limit, taking the place of the hash of the first entry */
+typedef struct ext2_dx_countlimit {
+    u16 limit;                  /* Entries that fit in the block */
+    u16 count;                  /* Entries in use */
+} ext2_dx_countlimit_t;
+
+/* Hash of a name, with the parameters to compute it */
+typedef struct ext2_dx_hash_info {
+    u32 hash;                   /* Major hash */
+    u32 minor_hash;             /* Minor hash */
+    u32 hash_version;           /* Hash version */
+    const u32 *seed;            /* Hash seed, NULL for the default */
+} ext2_dx_hash_info_t;
+
+/* Cached copy of the root of a directory index */
+typedef struct ext2_dx_root_cache {
+    u32 ino;                    /* Directory inode, 0 if unused */
+    u32 hash_version;           /* Hash version used by the directory */
+    u32 levels;                 /* Levels of index nodes below the root */
+    u32 count;                  /* Index entries in use */
+    ext2_dx_entry_t *entries;   /* Index entries, one block worth */
+} ext2_dx_root_cache_t;
+
 /* Ext2 file types */
 #define EXT2_FT_UNKNOWN  0
 #define EXT2_FT_REG_FILE 1
@@ -146,8 +225,10 @@ typedef struct ext2_dir_entry {
 
 /* Ext2 in-memory superblock */
 typedef struct ext2_sb_info {
-    ext2_superblock_t *s_es;           /* Ext2 superblock */
-    ext2_group_desc_t *s_group_desc;   /* Group descriptors */
+    ext2_superblock_t *s_es;           /* Ext2 superblock, in s_sbh */
+    struct buffer_head *s_sbh;         /* Buffer of the superblock */
+    struct buffer_head **s_group_desc; /* Buffers of the group descriptors */
+    u32 s_gdb_count;                   /* Number of group descriptor blocks */
     u32 s_block_size;                  /* Block size */
     u32 s_inodes_per_block;            /* Number of inodes per block */
     u32 s_blocks_per_group;            /* Number of blocks per group */
@@ -159,8 +240,30 @@ typedef struct ext2_sb_info {
     u32 s_first_ino;                   /* First non-reserved inode */
     u32 s_inode_size;                  /* Size of inode structure */
     void *s_blockdev;                  /* Block device */
+    spinlock_t s_lock;                 /* Protects the free counts of s_es and s_dirty_since */
+    u64 s_dirty_since;                 /* Jiffies of the oldest unwritten metadata change, 0 if none */
+    ext2_dx_root_cache_t s_dx_cache[EXT2_DX_CACHE_SIZE]; /* Cached directory index roots */
+    u32 s_dx_cache_next;               /* Next cached root to replace */
+    spinlock_t s_dx_lock;              /* Protects the cached directory index roots */
+    mutex_t s_dir_lock;                /* Serializes updates of indexed directories */
 } ext2_sb_info_t;
 
+/* Milliseconds metadata may stay dirty before the next change writes it back */
+#define EXT2_WRITEBACK_DELAY 5000
+
+/* Most blocks preallocated for a regular file after the one it asked for */
+#define EXT2_PREALLOC_BLOCKS 8
+
+/* Number of block mapping runs cached per inode */
+#define EXT2_MAP_CACHE_SIZE 4
+
+/* Run of contiguous logical blocks mapped to contiguous physical blocks */
+typedef struct ext2_map_run {
+    u32 lblk;                          /* First logical block */
+    u32 pblk;                          /* First physical block */
+    u32 len;                           /* Number of blocks, 0 if unused */
+} ext2_map_run_t;
+
 /* Ext2 in-memory inode */
 typedef struct ext2_inode_info {
     ext2_inode_t *i_e2i;               /* Ext2 inode */
@@ -174,6 +277,12 @@ typedef struct ext2_inode_info {
     u32 i_file_acl;                    /* File ACL */
     u32 i_dir_acl;                     /* Directory ACL */
     u32 i_dtime;                       /* Deletion time */
+    ext2_map_run_t i_map[EXT2_MAP_CACHE_SIZE]; /* Cached block mapping runs */
+    u32 i_map_next;                    /* Next run to replace */
+    u32 i_alloc_goal;                  /* Block after the last one allocated */
+    u32 i_prealloc_block;              /* First preallocated block */
+    u32 i_prealloc_count;              /* Number of preallocated blocks */
+    spinlock_t i_map_lock;             /* Protects the cached runs and the preallocation */
 } ext2_inode_info_t;
 
 /* Forward declarations for ext2 operations */
@@ -259,12 +368,17 @@ error_t ext2_statfs(struct super_block *sb, struct statfs *buf);
 error_t ext2_remount_fs(struct super_block *sb, int *flags);
 struct super_block *ext2_get_super(const char *dev, u32 flags);
 struct super_block *ext2_get_super_from_inode(struct inode *inode);
+void ext2_mark_super_dirty(struct super_block *sb);
 
 /* Ext2 utility functions */
 u32 ext2_get_block(struct inode *inode, u32 block);
+int ext2_get_blocks(struct inode *inode, u32 block, u32 max_blocks, u32 *phys);
+void ext2_map_invalidate(struct inode *inode);
 u32 ext2_alloc_block(struct inode *inode, u32 block);
 u32 ext2_new_block(struct inode *inode);
 int ext2_free_block(struct inode *inode, u32 block);
+void ext2_discard_prealloc(struct inode *inode);
+u32 ext2_find_next_zero_bit(const u8 *bitmap, u32 size, u32 offset);
 u32 ext2_new_inode(struct inode *dir);
 int ext2_free_inode(struct inode *dir, u32 ino);
 error_t ext2_add_entry(struct inode *dir, const char *name, u32 ino, file_type_t type);
@@ -272,5 +386,18 @@ error_t ext2_remove_entry(struct inode *dir, const char *name);
 int ext2_is_dir_empty(struct inode *dir);
 int ext2_read_block(ext2_sb_info_t *sb, u32 block, void *buffer);
 int ext2_write_block(ext2_sb_info_t *sb, u32 block, void *buffer);
+int ext2_read_super(ext2_sb_info_t *sb);
+void ext2_release_super(ext2_sb_info_t *sb);
+ext2_group_desc_t *ext2_get_group_desc(ext2_sb_info_t *sb, u32 group, struct buffer_head **bh);
+
+/* Ext2 directory index functions */
+void ext2_dirhash(const char *name, u32 len, ext2_dx_hash_info_t *hinfo);
+int ext2_dx_enabled(struct inode *dir, const char *name);
+int ext2_dx_find_entry(struct inode *dir, const char *name, u32 *ino);
+error_t ext2_dx_add_entry(struct inode *dir, const char *name, u32 ino, u8 file_type);
+error_t ext2_dx_remove_entry(struct inode *dir, const char *name);
+error_t ext2_dx_make_indexed(struct inode *dir, const char *name, u32 ino, u8 file_type);
+void ext2_dx_cache_invalidate(ext2_sb_info_t *sb, u32 ino);
+void ext2_dx_cache_release(ext2_sb_info_t *sb);
 
 #endif /* _HORIZON_FS_EXT2_H */
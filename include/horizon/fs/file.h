@@ -10,6 +10,8 @@
 
 #include <horizon/types.h>
 #include <horizon/list.h>
+#include <horizon/rwsem.h>
+#include <horizon/seqlock.h>
 
 /* File types */
 #define S_IFMT   0170000  /* Mask for file type */
@@ -81,6 +83,7 @@ struct dentry;
 struct vfsmount;
 struct super_block;
 struct file_system_type;
+struct poll_table_struct;
 
 /* File operations */
 typedef struct file_operations {
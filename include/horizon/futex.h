@@ -8,6 +8,7 @@
 #define _KERNEL_FUTEX_H
 
 #include <horizon/types.h>
+#include <horizon/time.h>
 
 /* Futex operations */
 #define FUTEX_WAIT              0
@@ -29,6 +30,38 @@
 #define FUTEX_CLOCK_REALTIME    256
 #define FUTEX_CMD_MASK          ~(FUTEX_PRIVATE_FLAG | FUTEX_CLOCK_REALTIME)
 
+/* Bitset that matches every waiter */
+#define FUTEX_BITSET_MATCH_ANY  0xffffffff
+
+/* FUTEX_WAKE_OP operations on the second futex */
+#define FUTEX_OP_SET            0       /* *uaddr2 = oparg */
+#define FUTEX_OP_ADD            1       /* *uaddr2 += oparg */
+#define FUTEX_OP_OR             2       /* *uaddr2 |= oparg */
+#define FUTEX_OP_ANDN           3       /* *uaddr2 &= ~oparg */
+#define FUTEX_OP_XOR            4       /* *uaddr2 ^= oparg */
+#define FUTEX_OP_OPARG_SHIFT    8       /* Use (1 << oparg) as the operand */
+
+/* FUTEX_WAKE_OP comparisons of the old value */
+#define FUTEX_OP_CMP_EQ         0       /* Wake if old == cmparg */
+#define FUTEX_OP_CMP_NE         1       /* Wake if old != cmparg */
+#define FUTEX_OP_CMP_LT         2       /* Wake if old < cmparg */
+#define FUTEX_OP_CMP_LE         3       /* Wake if old <= cmparg */
+#define FUTEX_OP_CMP_GT         4       /* Wake if old > cmparg */
+#define FUTEX_OP_CMP_GE         5       /* Wake if old >= cmparg */
+
+/* Encode a FUTEX_WAKE_OP operation */
+#define FUTEX_OP(op, oparg, cmp, cmparg) \
+    ((((op) & 0xf) << 28) | (((cmp) & 0xf) << 24) | (((oparg) & 0xfff) << 12) | ((cmparg) & 0xfff))
+
+/* PI futex word, the owner's TID and two flags */
+#define FUTEX_WAITERS           0x80000000  /* The kernel has waiters, unlock must enter it */
+#define FUTEX_OWNER_DIED        0x40000000  /* The owner exited without unlocking */
+#define FUTEX_TID_MASK          0x3fffffff  /* Owner thread ID */
+
+/* Number of futex hash buckets */
+#define FUTEX_HASH_BITS         8
+#define FUTEX_HASH_SIZE         (1 << FUTEX_HASH_BITS)
+
 /* Robust list head structure */
 struct robust_list {
     struct robust_list *next;
@@ -0,0 +1,27 @@
+/**
+ * irqflags.h - Horizon kernel local interrupt flag helpers
+ *
+ * This file contains helpers for saving, disabling and restoring
+ * interrupts on the local CPU.
+ */
+
+#ifndef _HORIZON_IRQFLAGS_H
+#define _HORIZON_IRQFLAGS_H
+
+#include <horizon/types.h>
+
+/* Save interrupt flags and disable interrupts */
+#define local_irq_save(flags) \
+    __asm__ volatile("pushf; pop %0; cli" : "=r" (flags) : : "memory")
+
+/* Restore interrupt flags */
+#define local_irq_restore(flags) \
+    __asm__ volatile("push %0; popf" : : "r" (flags) : "memory", "cc")
+
+/* Disable interrupts */
+#define local_irq_disable() __asm__ volatile("cli" : : : "memory")
+
+/* Enable interrupts */
+#define local_irq_enable() __asm__ volatile("sti" : : : "memory")
+
+#endif /* _HORIZON_IRQFLAGS_H */
@@ -58,16 +58,46 @@ static inline void list_del(list_head_t *entry)
     entry->prev = NULL;
 }
 
+/* Delete an entry from a list and reinitialize it */
+static inline void list_del_init(list_head_t *entry)
+{
+    entry->next->prev = entry->prev;
+    entry->prev->next = entry->next;
+    list_init(entry);
+}
+
 /* Check if a list is empty */
 static inline int list_empty(const list_head_t *head)
 {
     return head->next == head;
 }
 
+/* Join a list to the front of another, leaving the first one undefined */
+static inline void list_splice(const list_head_t *list, list_head_t *head)
+{
+    if (!list_empty(list)) {
+        list->next->prev = head;
+        list->prev->next = head->next;
+        head->next->prev = list->prev;
+        head->next = list->next;
+    }
+}
+
+/* Join a list to the front of another and reinitialize the first one */
+static inline void list_splice_init(list_head_t *list, list_head_t *head)
+{
+    list_splice(list, head);
+    list_init(list);
+}
+
 /* Get the container of a list entry */
 #define list_entry(ptr, type, member) \
     ((type *)((char *)(ptr) - offsetof(type, member)))
 
+/* Get the first entry of a non-empty list */
+#define list_first_entry(head, type, member) \
+    list_entry((head)->next, type, member)
+
 /* Iterate over a list */
 #define list_for_each(pos, head) \
     for (pos = (head)->next; pos != (head); pos = pos->next)
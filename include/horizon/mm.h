@@ -21,6 +21,8 @@
 #define MEM_USER       0x02    /* User memory */
 #define MEM_DMA        0x04    /* DMA-capable memory */
 #define MEM_ZERO       0x08    /* Zero memory */
+#define MEM_COLD       0x10    /* Cache-cold page is acceptable */
+#define MEM_HIGHMEM    0x20    /* High memory is acceptable */
 
 /* Memory protection flags */
 #define MEM_PROT_READ  0x01    /* Readable */
@@ -43,6 +45,7 @@ void *kmalloc(size_t size, u32 flags);
 void kfree(void *addr);
 void *vmalloc(size_t size);
 void vfree(void *addr);
+void mm_print_stats(void);
 
 /* Page fault functions */
 void page_fault_init(void);
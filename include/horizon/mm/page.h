@@ -49,6 +49,9 @@ typedef struct page {
     struct list_head lru;      /* LRU list */
     void *virtual;             /* Virtual address */
     void *private;             /* Private data */
+    struct slab_cache *slab_cache; /* Owning slab cache (PG_slab) */
+    struct slab *slab;         /* Owning slab (PG_slab) */
+    unsigned long nr_pages;    /* Pages in a large kmalloc block (PG_head) */
 } page_t;
 
 /* Page table entry */
@@ -11,6 +11,9 @@
 #include <horizon/types.h>
 #include <horizon/list.h>
 #include <horizon/mm/page.h>
+#include <horizon/spinlock.h>
+#include <horizon/config.h>
+#include <horizon/mm.h>
 
 /* Memory zone types */
 #define ZONE_DMA        0
@@ -18,6 +21,18 @@
 #define ZONE_HIGHMEM    2
 #define MAX_NR_ZONES    3
 
+/* Number of buddy orders */
+#define MAX_ORDER       11
+
+/* Zone boundaries in page frames */
+#define ZONE_DMA_END_PFN     ((16 * 1024 * 1024) / PAGE_SIZE)
+#define ZONE_NORMAL_END_PFN  ((896 * 1024 * 1024) / PAGE_SIZE)
+
+/* Zone watermarks */
+#define WMARK_MIN       0
+#define WMARK_LOW       1
+#define WMARK_HIGH      2
+
 /* Memory zone flags */
 #define ZONE_RECLAIM_LOCKED      (1 << 0)    /* Zone is locked for reclaim */
 #define ZONE_OOM_LOCKED          (1 << 1)    /* Zone is locked for OOM */
@@ -26,6 +41,42 @@
 #define ZONE_WRITEBACK           (1 << 4)    /* Zone has pages under writeback */
 #define ZONE_RECLAIM_ACTIVE      (1 << 5)    /* Zone is being reclaimed */
 
+/* Per-CPU page cache lists */
+#define PCP_HOT         0
+#define PCP_COLD        1
+#define PCP_NR_LISTS    2
+
+/* Default per-CPU page cache sizing */
+#define PCP_DEFAULT_BATCH   16
+#define PCP_DEFAULT_HIGH    (6 * PCP_DEFAULT_BATCH)
+
+/* Per-CPU page cache list */
+typedef struct per_cpu_pages {
+    unsigned int count;                   /* Number of pages on the list */
+    unsigned int high;                    /* Drain to the buddy lists above this */
+    unsigned int batch;                   /* Pages moved per refill or drain */
+    struct list_head list;                /* Cached order-0 pages */
+} per_cpu_pages_t;
+
+/* Per-CPU page cache */
+typedef struct per_cpu_pageset {
+    per_cpu_pages_t pcp[PCP_NR_LISTS];    /* Hot and cold lists */
+    unsigned long alloc_hit;              /* Allocations served from the cache */
+    unsigned long alloc_miss;             /* Allocations that needed a refill */
+    unsigned long free_hit;               /* Frees absorbed by the cache */
+    unsigned long free_drain;             /* Frees that triggered a drain */
+} per_cpu_pageset_t;
+
+/* Per-CPU page cache statistics */
+typedef struct pcp_stats {
+    unsigned long alloc_hit;              /* Allocations served from the cache */
+    unsigned long alloc_miss;             /* Allocations that needed a refill */
+    unsigned long free_hit;               /* Frees absorbed by the cache */
+    unsigned long free_drain;             /* Frees that triggered a drain */
+    unsigned int hot_count;               /* Pages on the hot list */
+    unsigned int cold_count;              /* Pages on the cold list */
+} pcp_stats_t;
+
 /* Memory zone structure */
 typedef struct zone {
     unsigned long flags;                  /* Zone flags */
@@ -52,10 +103,17 @@ typedef struct zone {
     unsigned long present_pages;          /* Number of present pages in zone */
     unsigned long managed_pages;          /* Number of managed pages in zone */
     char *name;                           /* Zone name */
-    struct list_head free_area[11];       /* Free areas (buddy system) */
+    struct list_head free_area[MAX_ORDER]; /* Free areas (buddy system) */
+    unsigned long nr_free[MAX_ORDER];     /* Free blocks per order */
+    unsigned long reclaim_wakeups;        /* Times reclaim was triggered */
+    unsigned long alloc_fallbacks;        /* Allocations served for a higher zone */
+    per_cpu_pageset_t pageset[CONFIG_NR_CPUS]; /* Per-CPU page caches */
     spinlock_t lock;                      /* Zone lock */
 } zone_t;
 
+/* Reclaim handler, returns the number of pages it freed */
+typedef unsigned long (*pmm_reclaim_fn_t)(zone_t *zone, unsigned int order, unsigned long nr_pages);
+
 /* Memory node structure */
 typedef struct pglist_data {
     zone_t node_zones[MAX_NR_ZONES];      /* Zones for this node */
@@ -73,6 +131,16 @@ void pmm_free_range(unsigned long start_pfn, unsigned long end_pfn);
 void pmm_reserve_range(unsigned long start_pfn, unsigned long end_pfn);
 page_t *pmm_alloc_pages(unsigned int order, unsigned int flags);
 void pmm_free_pages(page_t *page, unsigned int order);
+void pmm_free_cold_page(page_t *page);
+void pmm_drain_cpu_pages(int cpu);
+void pmm_drain_local_pages(void);
+int pmm_set_pcp_high(unsigned int high, unsigned int batch);
+int pmm_get_pcp_stats(int cpu, pcp_stats_t *stats);
+void pmm_print_pcp_stats(void);
+void pmm_set_reclaim_handler(pmm_reclaim_fn_t handler);
+int pmm_zone_watermark_ok(zone_t *zone, unsigned int order, unsigned long mark);
+zone_t *pmm_get_zone(int zone_id);
+void pmm_print_zone_stats(void);
 unsigned long pmm_get_free_pages(void);
 unsigned long pmm_get_total_pages(void);
 unsigned long pmm_get_reserved_pages(void);
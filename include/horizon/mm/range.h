@@ -0,0 +1,51 @@
+/**
+ * range.h - Horizon kernel contiguous range allocator definitions
+ *
+ * This file contains definitions for the contiguous range allocator used
+ * for kernel page and virtual address ranges.
+ */
+
+#ifndef _HORIZON_MM_RANGE_H
+#define _HORIZON_MM_RANGE_H
+
+#include <horizon/types.h>
+#include <horizon/rbtree.h>
+#include <horizon/spinlock.h>
+
+/* Free extent */
+typedef struct range_extent {
+    rb_node_t addr_node;            /* Node in the by-address tree */
+    rb_node_t size_node;            /* Node in the by-size tree */
+    unsigned long start;            /* First free unit */
+    unsigned long count;            /* Number of free units */
+    struct range_extent *next_free; /* Next unused extent in the pool */
+} range_extent_t;
+
+/* Range allocator */
+typedef struct range_allocator {
+    const char *name;               /* Allocator name */
+    unsigned long count;            /* Number of units managed */
+    unsigned long free;             /* Number of free units */
+    unsigned long nr_runs;          /* Runs of allocated units */
+    unsigned long max_extents;      /* Size of the extent pool */
+    u32 *bitmap;                    /* One bit per unit, set if allocated */
+    range_extent_t *pool;           /* Unused extents */
+    rb_root_t by_addr;              /* Free extents by start unit */
+    rb_root_t by_size;              /* Free extents by (count, start) */
+    spinlock_t lock;                /* Allocator lock */
+    unsigned long alloc_count;      /* Successful allocations */
+    unsigned long alloc_fail;       /* Failed allocations */
+    unsigned long merge_count;      /* Extents merged on free */
+} range_allocator_t;
+
+/* Range allocator functions */
+size_t range_meta_size(unsigned long count, unsigned long max_extents);
+int range_init(range_allocator_t *ra, const char *name, unsigned long count, unsigned long max_extents, void *meta);
+long range_alloc(range_allocator_t *ra, unsigned long count);
+int range_free(range_allocator_t *ra, unsigned long start, unsigned long count);
+int range_reserve(range_allocator_t *ra, unsigned long start, unsigned long count);
+unsigned long range_free_units(range_allocator_t *ra);
+unsigned long range_largest_free(range_allocator_t *ra);
+void range_print_stats(range_allocator_t *ra);
+
+#endif /* _HORIZON_MM_RANGE_H */
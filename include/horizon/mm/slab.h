@@ -10,12 +10,14 @@
 #include <horizon/types.h>
 #include <horizon/list.h>
 #include <horizon/spinlock.h>
+#include <horizon/config.h>
+#include <horizon/mm.h>
 
 /* Slab flags */
 #define SLAB_HWCACHE_ALIGN  0x00000001  /* Align on hardware cache lines */
 #define SLAB_CACHE_DMA      0x00000002  /* Use DMA memory */
 #define SLAB_PANIC          0x00000004  /* Panic on failure */
-#define SLAB_DESTROY_BY_RCU 0x00000008  /* Defer freeing slabs to RCU */
+#define SLAB_DESTROY_BY_RCU 0x00000008  /* Defer freeing slabs to RCU, freed objects stay type-stable */
 #define SLAB_POISON         0x00000010  /* Poison objects */
 #define SLAB_RED_ZONE       0x00000020  /* Add red zone */
 #define SLAB_NOLEAKTRACE    0x00000040  /* Don't trace leaks */
@@ -25,6 +27,18 @@
 #define SLAB_RECLAIM_ACCOUNT 0x00000400 /* Allow reclaim */
 #define SLAB_TEMPORARY      0x00000800  /* Temporary cache */
 
+/* Internal cache flags */
+#define SLAB_OFF_SLAB       0x80000000  /* Slab descriptor kept off-slab */
+
+/* Slab geometry */
+#define SLAB_MAX_ORDER      5           /* Largest slab, in page order */
+#define SLAB_OFF_SLAB_MIN   (PAGE_SIZE / 8) /* Objects this large keep descriptors off-slab */
+#define SLAB_COLOUR_ALIGN   64          /* Colour unit, one cache line */
+
+/* Per-CPU array cache sizing */
+#define SLAB_ARRAY_MAX      32          /* Largest per-CPU magazine */
+#define SLAB_SHARED_MAX     64          /* Largest shared depot */
+
 /* Slab object */
 typedef struct slab_object {
     struct slab_object *next;      /* Next free object */
@@ -34,11 +48,44 @@ typedef struct slab_object {
 typedef struct slab {
     struct list_head list;         /* List of slabs */
     void *start;                   /* Start of slab */
+    void *s_mem;                   /* First object, after the colour offset */
+    unsigned int colouroff;        /* Colour offset of this slab */
     unsigned int inuse;            /* Number of objects in use */
     unsigned int free;             /* Number of free objects */
     slab_object_t *freelist;       /* Free object list */
+    unsigned int order;            /* Pages, as a power of two */
+    struct rcu_head rcu;           /* Deferred free, SLAB_DESTROY_BY_RCU */
 } slab_t;
 
+/* Per-CPU array cache (magazine) */
+typedef struct array_cache {
+    unsigned int avail;            /* Number of cached objects */
+    unsigned int limit;            /* Capacity of entry[] in use */
+    unsigned int batchcount;       /* Objects moved per refill or flush */
+    unsigned long alloc_hit;       /* Allocations served from the magazine */
+    unsigned long alloc_miss;      /* Allocations that needed a refill */
+    unsigned long free_hit;        /* Frees absorbed by the magazine */
+    unsigned long free_miss;       /* Frees that needed a flush */
+    void *entry[SLAB_ARRAY_MAX];   /* Cached objects, LIFO */
+} array_cache_t;
+
+/* Shared object depot, refills and absorbs per-CPU magazines */
+typedef struct array_depot {
+    spinlock_t lock;               /* Depot lock */
+    unsigned int avail;            /* Number of cached objects */
+    unsigned int limit;            /* Capacity of entry[] in use */
+    void *entry[SLAB_SHARED_MAX];  /* Cached objects */
+} array_depot_t;
+
+/* Slab cache statistics */
+typedef struct slab_cache_stats {
+    unsigned long alloc_hit;       /* Allocations served from a magazine */
+    unsigned long alloc_miss;      /* Allocations that needed a refill */
+    unsigned long free_hit;        /* Frees absorbed by a magazine */
+    unsigned long free_miss;       /* Frees that needed a flush */
+    unsigned int cached;           /* Objects held in magazines and depot */
+} slab_cache_stats_t;
+
 /* Slab cache */
 typedef struct slab_cache {
     const char *name;              /* Cache name */
@@ -47,6 +94,10 @@ typedef struct slab_cache {
     size_t align;                  /* Object alignment */
     unsigned int flags;            /* Cache flags */
     unsigned int num;              /* Number of objects per slab */
+    unsigned int order;            /* Pages per slab, as a page order */
+    unsigned int colour;           /* Number of colours */
+    unsigned int colour_off;       /* Colour unit in bytes */
+    unsigned int colour_next;      /* Colour of the next slab */
     unsigned int total_objects;    /* Total number of objects */
     unsigned int total_slabs;      /* Total number of slabs */
     spinlock_t lock;               /* Cache lock */
@@ -55,6 +106,8 @@ typedef struct slab_cache {
     struct list_head slabs_free;   /* Free slabs */
     void (*ctor)(void *);          /* Object constructor */
     void (*dtor)(void *);          /* Object destructor */
+    array_depot_t shared;          /* Shared depot */
+    array_cache_t cpu_cache[CONFIG_NR_CPUS]; /* Per-CPU magazines */
 } slab_cache_t;
 
 /* Slab functions */
@@ -67,6 +120,10 @@ int slab_cache_shrink(slab_cache_t *cache);
 size_t slab_cache_size(slab_cache_t *cache);
 const char *slab_cache_name(slab_cache_t *cache);
 void slab_cache_info(slab_cache_t *cache, unsigned int *total_objects, unsigned int *total_slabs);
+void slab_cache_drain_cpu(slab_cache_t *cache, int cpu);
+void slab_drain_cpu(int cpu);
+int slab_cache_get_stats(slab_cache_t *cache, slab_cache_stats_t *stats);
+void slab_print_stats(void);
 
 /* General-purpose caches */
 extern slab_cache_t *kmalloc_caches[13];
@@ -77,5 +134,6 @@ void *kzalloc(size_t size, unsigned int flags);
 void *kcalloc(size_t n, size_t size, unsigned int flags);
 void *krealloc(void *ptr, size_t size, unsigned int flags);
 void kfree(void *ptr);
+size_t ksize(const void *ptr);
 
 #endif /* _HORIZON_MM_SLAB_H */
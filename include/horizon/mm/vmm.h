@@ -11,6 +11,7 @@
 #include <horizon/types.h>
 #include <horizon/list.h>
 #include <horizon/mm/page.h>
+#include <horizon/rwsem.h>
 
 /* Memory protection flags */
 #define PROT_NONE  0x0  /* No access */
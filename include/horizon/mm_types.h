@@ -10,18 +10,7 @@
 #include <horizon/types.h>
 #include <horizon/list.h>
 #include <horizon/spinlock.h>
-
-/* Red-black tree node */
-typedef struct rb_node {
-    u32 rb_parent_color;                  /* Parent and color */
-    struct rb_node *rb_right;             /* Right child */
-    struct rb_node *rb_left;              /* Left child */
-} rb_node_t;
-
-/* Red-black tree root */
-typedef struct rb_root {
-    rb_node_t *rb_node;                   /* Root node */
-} rb_root_t;
+#include <horizon/rbtree.h>
 
 /* Page protection */
 typedef u32 pgprot_t;
@@ -0,0 +1,77 @@
+/**
+ * percpu_rwsem.h - Horizon kernel per-CPU read-write semaphore definitions
+ *
+ * This file contains definitions for the per-CPU read-write semaphore, a
+ * reader-writer lock for read-mostly data. A reader only increments a
+ * counter of its own CPU, so readers on different CPUs never share a
+ * cache line. A writer blocks new readers, waits for the sum of the
+ * counters to drain to zero and only then enters, which makes writing
+ * expensive and reading nearly free.
+ */
+
+#ifndef _HORIZON_PERCPU_RWSEM_H
+#define _HORIZON_PERCPU_RWSEM_H
+
+#include <horizon/types.h>
+#include <horizon/config.h>
+#include <horizon/rwsem.h>
+#include <horizon/mm/cache.h>
+#include <horizon/smp.h>
+
+/* Longest a writer sleeps between checks for departed readers, in milliseconds */
+#define PERCPU_RWSEM_WAIT_MS    1
+
+/* Reader count of one CPU, alone in its cache line */
+typedef struct percpu_rw_count {
+    volatile int count;             /* Readers entered here minus readers left here */
+} __attribute__((aligned(CACHE_LINE_SIZE))) percpu_rw_count_t;
+
+/* Per-CPU read-write semaphore */
+typedef struct percpu_rw_semaphore {
+    percpu_rw_count_t read_count[CONFIG_NR_CPUS]; /* Only the sum is meaningful */
+    volatile int block;             /* Set while a writer is pending or active */
+    struct thread *volatile writer; /* Writer waiting for readers to drain */
+    struct rw_semaphore rw_sem;     /* Serializes writers, parks blocked readers */
+} percpu_rw_semaphore_t;
+
+/* Static initializer */
+#define PERCPU_RWSEM_INITIALIZER(name) { { { 0 } }, 0, NULL, RWSEM_INITIALIZER((name).rw_sem) }
+
+/* Per-CPU read-write semaphore functions */
+void percpu_init_rwsem(percpu_rw_semaphore_t *sem);
+void __percpu_down_read_slow(percpu_rw_semaphore_t *sem);
+void __percpu_up_read_slow(percpu_rw_semaphore_t *sem);
+void percpu_down_write(percpu_rw_semaphore_t *sem);
+void percpu_up_write(percpu_rw_semaphore_t *sem);
+
+/**
+ * Acquire a per-CPU read-write semaphore for reading
+ *
+ * @param sem Semaphore
+ */
+static inline void percpu_down_read(percpu_rw_semaphore_t *sem) {
+    /* The locked add also orders the count before the load of block */
+    __sync_fetch_and_add(&sem->read_count[smp_processor_id()].count, 1);
+
+    if (sem->block) {
+        __percpu_down_read_slow(sem);
+    }
+}
+
+/**
+ * Release a per-CPU read-write semaphore held for reading
+ *
+ * We may have moved CPU since percpu_down_read(), the counters only
+ * matter in sum.
+ *
+ * @param sem Semaphore
+ */
+static inline void percpu_up_read(percpu_rw_semaphore_t *sem) {
+    __sync_fetch_and_sub(&sem->read_count[smp_processor_id()].count, 1);
+
+    if (sem->block) {
+        __percpu_up_read_slow(sem);
+    }
+}
+
+#endif /* _HORIZON_PERCPU_RWSEM_H */
@@ -0,0 +1,49 @@
+/**
+ * poll.h - Horizon kernel poll definitions
+ *
+ * This file contains definitions for the poll tables that file poll
+ * operations register their wait queues with. By default the polling
+ * task is queued on each of them. A table with a queue callback, like the
+ * one epoll uses, installs its own wait queue entries instead.
+ */
+
+#ifndef _HORIZON_POLL_H
+#define _HORIZON_POLL_H
+
+#include <horizon/types.h>
+#include <horizon/list.h>
+#include <horizon/wait.h>
+
+struct file;
+struct poll_table_struct;
+
+/* Queue callback, called by poll_wait() for each wait queue of the file */
+typedef void (*poll_queue_proc)(struct file *file, wait_queue_head_t *wait, struct poll_table_struct *table);
+
+/* Poll table structure */
+struct poll_table_struct {
+    struct list_head wait_list;    /* Wait queues the task is on */
+    poll_queue_proc qproc;         /* Queue callback, NULL to queue the task */
+};
+
+/**
+ * Initialize a poll table with a queue callback
+ *
+ * @param table Poll table
+ * @param qproc Queue callback
+ */
+static inline void init_poll_funcptr(struct poll_table_struct *table, poll_queue_proc qproc) {
+    INIT_LIST_HEAD(&table->wait_list);
+    table->qproc = qproc;
+}
+
+/* Poll functions */
+void poll_init_table(struct poll_table_struct *table);
+void poll_wait(struct file *file, wait_queue_head_t *wait, struct poll_table_struct *table);
+void poll_free_table(struct poll_table_struct *table);
+unsigned int file_poll(struct file *file, struct poll_table_struct *wait);
+
+/* Epoll functions */
+void eventpoll_release(struct file *file);
+
+#endif /* _HORIZON_POLL_H */
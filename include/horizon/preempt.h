@@ -0,0 +1,92 @@
+/**
+ * preempt.h - Horizon kernel preemption control
+ *
+ * This file contains definitions for disabling preemption. While the
+ * count of a CPU is raised, the scheduler tick and waking threads do not
+ * switch away from the running thread, they only note that a switch is
+ * due. The switch happens when the count drops back to zero.
+ *
+ * Interrupts still arrive. A handler that raises the count drops it again
+ * before returning, so the count needs no atomic updates. Each update runs
+ * with interrupts disabled, so the thread cannot be preempted and moved to
+ * another CPU between reading its CPU id and writing the count.
+ */
+
+#ifndef _HORIZON_PREEMPT_H
+#define _HORIZON_PREEMPT_H
+
+#include <horizon/types.h>
+#include <horizon/config.h>
+#include <horizon/irqflags.h>
+#include <horizon/smp.h>
+
+/* Compiler barrier, keeps accesses inside a preempt-disabled section */
+#define preempt_barrier() __asm__ volatile("" ::: "memory")
+
+/* Per-CPU preemption state, CONFIG_NR_CPUS entries, in sched/preempt.c */
+extern volatile int preempt_counts[];
+extern volatile int preempt_resched[];
+
+/* Switch away for a preemption deferred while the count was raised */
+void preempt_schedule(void);
+
+/**
+ * Get the preemption count of the current CPU
+ *
+ * @return 0 if the running thread may be preempted
+ */
+static inline int preempt_count(void) {
+    unsigned long flags;
+    int count;
+
+    local_irq_save(flags);
+    count = preempt_counts[smp_processor_id()];
+    local_irq_restore(flags);
+
+    return count;
+}
+
+/**
+ * Disable preemption
+ */
+static inline void preempt_disable(void) {
+    unsigned long flags;
+
+    local_irq_save(flags);
+    preempt_counts[smp_processor_id()]++;
+    local_irq_restore(flags);
+    preempt_barrier();
+}
+
+/**
+ * Enable preemption without acting on a deferred preemption
+ */
+static inline void preempt_enable_no_resched(void) {
+    unsigned long flags;
+
+    preempt_barrier();
+    local_irq_save(flags);
+    preempt_counts[smp_processor_id()]--;
+    local_irq_restore(flags);
+}
+
+/**
+ * Enable preemption, switching away if a preemption was deferred
+ */
+static inline void preempt_enable(void) {
+    unsigned long flags;
+    int cpu;
+    int resched;
+
+    preempt_barrier();
+    local_irq_save(flags);
+    cpu = smp_processor_id();
+    resched = --preempt_counts[cpu] == 0 && preempt_resched[cpu];
+    local_irq_restore(flags);
+
+    if (resched) {
+        preempt_schedule();
+    }
+}
+
+#endif /* _HORIZON_PREEMPT_H */
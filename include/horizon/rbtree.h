@@ -0,0 +1,77 @@
+/**
+ * rbtree.h - Horizon kernel red-black tree definitions
+ *
+ * This file contains definitions for the intrusive red-black tree. Users
+ * embed an rb_node in their structure, walk the tree themselves to find
+ * the insertion point, then call rb_link_node() and rb_insert_color().
+ */
+
+#ifndef _HORIZON_RBTREE_H
+#define _HORIZON_RBTREE_H
+
+#include <horizon/types.h>
+#include <horizon/stddef.h>
+
+/* Node colors */
+#define RB_RED      0
+#define RB_BLACK    1
+
+/* Red-black tree node */
+typedef struct rb_node {
+    unsigned long rb_parent_color;        /* Parent and color */
+    struct rb_node *rb_right;             /* Right child */
+    struct rb_node *rb_left;              /* Left child */
+} rb_node_t;
+
+/* Red-black tree root */
+typedef struct rb_root {
+    rb_node_t *rb_node;                   /* Root node */
+} rb_root_t;
+
+/* Red-black tree root initializer */
+#define RB_ROOT { NULL }
+
+/* Get the parent of a node */
+#define rb_parent(r)    ((rb_node_t *)((r)->rb_parent_color & ~3UL))
+
+/* Get the color of a node */
+#define rb_color(r)     ((r)->rb_parent_color & 1)
+#define rb_is_red(r)    (!rb_color(r))
+#define rb_is_black(r)  rb_color(r)
+
+/* Check if a tree is empty */
+#define RB_EMPTY_ROOT(root) ((root)->rb_node == NULL)
+
+/* Check if a node is not in a tree (see rb_clear_node) */
+#define RB_EMPTY_NODE(node) ((node)->rb_parent_color == (unsigned long)(node))
+#define rb_clear_node(node) ((node)->rb_parent_color = (unsigned long)(node))
+
+/* Get the container of a tree node */
+#define rb_entry(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+
+/* Initialize a tree root */
+static inline void rb_init_root(rb_root_t *root)
+{
+    root->rb_node = NULL;
+}
+
+/* Link a new node at the position found by a tree walk */
+static inline void rb_link_node(rb_node_t *node, rb_node_t *parent, rb_node_t **link)
+{
+    node->rb_parent_color = (unsigned long)parent;
+    node->rb_left = NULL;
+    node->rb_right = NULL;
+    *link = node;
+}
+
+/* Red-black tree functions */
+void rb_insert_color(rb_node_t *node, rb_root_t *root);
+void rb_erase(rb_node_t *node, rb_root_t *root);
+rb_node_t *rb_first(const rb_root_t *root);
+rb_node_t *rb_last(const rb_root_t *root);
+rb_node_t *rb_next(const rb_node_t *node);
+rb_node_t *rb_prev(const rb_node_t *node);
+void rb_replace_node(rb_node_t *victim, rb_node_t *new, rb_root_t *root);
+
+#endif /* _HORIZON_RBTREE_H */
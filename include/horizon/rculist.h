@@ -0,0 +1,49 @@
+/**
+ * rculist.h - Horizon kernel RCU-protected linked list definitions
+ *
+ * This file contains variants of the list operations that readers may
+ * walk under rcu_read_lock() while an updater, serialized by its own lock,
+ * adds and removes entries. A removed entry keeps its next pointer so a
+ * reader standing on it can walk on, and must not be freed before a grace
+ * period has passed.
+ */
+
+#ifndef _KERNEL_RCULIST_H
+#define _KERNEL_RCULIST_H
+
+#include <horizon/list.h>
+#include <horizon/rcupdate.h>
+
+/* Add a new entry after the specified head */
+static inline void list_add_rcu(list_head_t *new, list_head_t *head)
+{
+    new->next = head->next;
+    new->prev = head;
+    rcu_assign_pointer(head->next, new);
+    new->next->prev = new;
+}
+
+/* Add a new entry before the specified head */
+static inline void list_add_tail_rcu(list_head_t *new, list_head_t *head)
+{
+    new->next = head;
+    new->prev = head->prev;
+    rcu_assign_pointer(head->prev->next, new);
+    head->prev = new;
+}
+
+/* Delete an entry from a list, readers on it can still walk on */
+static inline void list_del_rcu(list_head_t *entry)
+{
+    entry->next->prev = entry->prev;
+    entry->prev->next = entry->next;
+    entry->prev = NULL;
+}
+
+/* Iterate over a list of a given type under rcu_read_lock() */
+#define list_for_each_entry_rcu(pos, head, member) \
+    for (pos = list_entry(rcu_dereference((head)->next), typeof(*pos), member); \
+         &pos->member != (head); \
+         pos = list_entry(rcu_dereference(pos->member.next), typeof(*pos), member))
+
+#endif /* _KERNEL_RCULIST_H */
@@ -0,0 +1,59 @@
+/**
+ * rcupdate.h - Horizon kernel read-copy-update definitions
+ *
+ * This file contains definitions for read-copy-update (RCU). Readers of an
+ * RCU-protected structure take no lock and write no shared memory, they
+ * only keep preemption disabled. Updaters publish a new version with
+ * rcu_assign_pointer() and free the old one once every CPU has passed a
+ * quiescent state, a context switch or a tick outside a read-side section,
+ * after which no reader can still hold a reference to it.
+ */
+
+#ifndef _HORIZON_RCUPDATE_H
+#define _HORIZON_RCUPDATE_H
+
+#include <horizon/types.h>
+#include <horizon/preempt.h>
+
+/* Most callbacks one CPU runs per tick, the rest wait for the next one */
+#define RCU_BATCH_LIMIT     64
+
+/* Marks a pointer that readers follow under rcu_read_lock() */
+#define __rcu
+
+/**
+ * Enter an RCU read-side section
+ *
+ * Sections nest and must not sleep.
+ */
+static inline void rcu_read_lock(void) {
+    preempt_disable();
+}
+
+/**
+ * Leave an RCU read-side section
+ */
+static inline void rcu_read_unlock(void) {
+    preempt_enable();
+}
+
+/* Fetch an RCU-protected pointer once, for use inside a read-side section */
+#define rcu_dereference(p) (*(__typeof__(p) volatile *)&(p))
+
+/* Publish a pointer, ordering the initialization of what it points to first */
+#define rcu_assign_pointer(p, v) \
+    do { \
+        __sync_synchronize(); \
+        (p) = (v); \
+    } while (0)
+
+/* RCU functions */
+void rcu_init(void);
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head));
+void synchronize_rcu(void);
+void rcu_note_context_switch(int cpu);
+void rcu_check_callbacks(int cpu, int quiescent);
+int rcu_needs_cpu(int cpu);
+void rcu_print_stats(void);
+
+#endif /* _HORIZON_RCUPDATE_H */
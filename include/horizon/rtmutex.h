@@ -0,0 +1,78 @@
+/**
+ * rtmutex.h - Horizon kernel priority-inheriting mutex definitions
+ *
+ * This file contains definitions for the rt_mutex, a sleeping lock whose
+ * waiters are ordered by priority and whose owner inherits the priority
+ * of its most important waiter.
+ */
+
+#ifndef _HORIZON_RTMUTEX_H
+#define _HORIZON_RTMUTEX_H
+
+#include <horizon/types.h>
+#include <horizon/rbtree.h>
+#include <horizon/spinlock.h>
+
+/* Owner word flags */
+#define RT_MUTEX_HAS_WAITERS    1UL     /* Lock has waiters, unlock takes the slow path */
+#define RT_MUTEX_HANDOFF        2UL     /* A woken waiter lost the lock, hand it over next */
+#define RT_MUTEX_FLAGS          3UL
+
+/* Longest lock chain followed when propagating a boost */
+#define RT_MUTEX_MAX_CHAIN      64
+
+/* Forward declarations */
+struct thread;
+
+/* Priority-inheriting mutex */
+typedef struct rt_mutex {
+    volatile unsigned long owner;       /* Owning thread, or'ed with the RT_MUTEX_ flags */
+    spinlock_t wait_lock;               /* Protects the waiters and slow path owner changes */
+    rb_root_t waiters;                  /* Waiters by priority, FIFO within a level */
+    struct rt_mutex_waiter *top_waiter; /* Cached most important waiter */
+    u32 nr_waiters;                     /* Number of waiters */
+} rt_mutex_t;
+
+/* Waiter, lives on the waiting thread's stack */
+typedef struct rt_mutex_waiter {
+    rb_node_t tree_node;                /* Node in the lock's waiter tree */
+    rb_node_t pi_node;                  /* Node in the owner's pi_waiters tree while top waiter */
+    struct thread *thread;              /* Waiting thread */
+    struct rt_mutex *lock;              /* Lock waited on */
+    int prio;                           /* Priority the waiter is queued at */
+} rt_mutex_waiter_t;
+
+/* Static initializer */
+#define RT_MUTEX_INITIALIZER { 0, SPIN_LOCK_INITIALIZER, RB_ROOT, NULL, 0 }
+
+/**
+ * Get the owner of an rt_mutex
+ *
+ * @param lock Lock
+ * @return Owning thread, or NULL if the lock is free
+ */
+static inline struct thread *rt_mutex_owner(rt_mutex_t *lock) {
+    return (struct thread *)(lock->owner & ~RT_MUTEX_FLAGS);
+}
+
+/**
+ * Check if an rt_mutex is locked
+ *
+ * @param lock Lock
+ * @return 1 if locked, 0 if not
+ */
+static inline int rt_mutex_is_locked(rt_mutex_t *lock) {
+    return rt_mutex_owner(lock) != NULL;
+}
+
+/* rt_mutex functions */
+void rt_mutex_init(rt_mutex_t *lock);
+void rt_mutex_init_proxy_locked(rt_mutex_t *lock, struct thread *owner);
+int rt_mutex_lock(rt_mutex_t *lock);
+int rt_mutex_timed_lock(rt_mutex_t *lock, u64 ms);
+int rt_mutex_trylock(rt_mutex_t *lock);
+int rt_mutex_unlock(rt_mutex_t *lock);
+void rt_mutex_adjust_pi(struct thread *thread);
+void rt_mutex_print_stats(void);
+
+#endif /* _HORIZON_RTMUTEX_H */
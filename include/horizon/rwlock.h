@@ -2,6 +2,10 @@
  * rwlock.h - Horizon kernel read-write lock definitions
  * 
  * This file contains definitions for read-write locks.
+ *
+ * A waiting writer holds back new readers, so readers cannot starve it.
+ * For read-mostly data see percpu_rwsem.h, for read sections that sleep
+ * see rwsem.h.
  */
 
 #ifndef _HORIZON_RWLOCK_H
@@ -18,6 +22,7 @@ typedef struct rwlock {
     spinlock_t lock;               /* Spinlock for protection */
     int readers;                   /* Number of readers */
     int writer;                    /* Writer flag */
+    int writers_waiting;           /* Writers waiting for the lock */
 #ifdef CONFIG_DEBUG_RWLOCK
     const char *name;              /* Lock name */
     const char *file;              /* Source file */
@@ -31,12 +36,13 @@ typedef struct rwlock {
 
 /* Initialize a read-write lock */
 #ifdef CONFIG_DEBUG_RWLOCK
-#define RW_LOCK_INITIALIZER { SPIN_LOCK_INITIALIZER, 0, 0, NULL, NULL, 0, 0, 0, 0, 0 }
+#define RW_LOCK_INITIALIZER { SPIN_LOCK_INITIALIZER, 0, 0, 0, NULL, NULL, 0, 0, 0, 0, 0 }
 #define rwlock_init(lock, name) \
     do { \
-        spin_lock_init(&(lock)->lock, name "_spinlock"); \
+        spin_lock_init_named(&(lock)->lock, name "_spinlock"); \
         (lock)->readers = 0; \
         (lock)->writer = 0; \
+        (lock)->writers_waiting = 0; \
         (lock)->name = name; \
         (lock)->file = NULL; \
         (lock)->line = 0; \
@@ -46,12 +52,13 @@ typedef struct rwlock {
         (lock)->contention_count = 0; \
     } while (0)
 #else
-#define RW_LOCK_INITIALIZER { SPIN_LOCK_INITIALIZER, 0, 0 }
+#define RW_LOCK_INITIALIZER { SPIN_LOCK_INITIALIZER, 0, 0, 0 }
 #define rwlock_init(lock, name) \
     do { \
-        spin_lock_init(&(lock)->lock, name "_spinlock"); \
+        spin_lock_init_named(&(lock)->lock, name "_spinlock"); \
         (lock)->readers = 0; \
         (lock)->writer = 0; \
+        (lock)->writers_waiting = 0; \
     } while (0)
 #endif
 
@@ -0,0 +1,59 @@
+/**
+ * rwsem.h - Horizon kernel read-write semaphore definitions
+ *
+ * This file contains definitions for the read-write semaphore, a sleeping
+ * reader-writer lock for read sections that may block, such as walks of
+ * an address space's memory areas.
+ *
+ * Waiters queue in FIFO order and a queued writer stops new readers from
+ * taking the lock, so a steady stream of readers cannot starve writers.
+ */
+
+#ifndef _HORIZON_RWSEM_H
+#define _HORIZON_RWSEM_H
+
+#include <horizon/types.h>
+#include <horizon/list.h>
+#include <horizon/spinlock.h>
+
+/* Count word: readers times RWSEM_READER_BIAS, or'ed with the flags */
+#define RWSEM_WRITER_LOCKED     1L      /* A writer holds the lock */
+#define RWSEM_HAS_WAITERS       2L      /* Waiters are queued, lock and unlock take the slow path */
+#define RWSEM_FLAGS             3L
+#define RWSEM_READER_BIAS       4L
+
+/* Forward declarations */
+struct thread;
+
+/* Read-write semaphore */
+typedef struct rw_semaphore {
+    volatile long count;            /* Count word */
+    spinlock_t wait_lock;           /* Protects wait_list */
+    list_head_t wait_list;          /* Waiters, FIFO */
+    struct thread *owner;           /* Writer holding the lock */
+} rw_semaphore_t;
+
+/* Static initializer */
+#define RWSEM_INITIALIZER(name) { 0, SPIN_LOCK_INITIALIZER, LIST_HEAD_INIT((name).wait_list), NULL }
+
+/**
+ * Check if a read-write semaphore is held
+ *
+ * @param sem Semaphore
+ * @return 1 if held by readers or a writer, 0 if not
+ */
+static inline int rwsem_is_locked(struct rw_semaphore *sem) {
+    return (sem->count & ~RWSEM_HAS_WAITERS) != 0;
+}
+
+/* Read-write semaphore functions */
+void init_rwsem(struct rw_semaphore *sem);
+void down_read(struct rw_semaphore *sem);
+int down_read_trylock(struct rw_semaphore *sem);
+void up_read(struct rw_semaphore *sem);
+void down_write(struct rw_semaphore *sem);
+int down_write_trylock(struct rw_semaphore *sem);
+void up_write(struct rw_semaphore *sem);
+void downgrade_write(struct rw_semaphore *sem);
+
+#endif /* _HORIZON_RWSEM_H */
@@ -10,9 +10,12 @@
 #include <horizon/types.h>
 #include <horizon/list.h>
 #include <horizon/config.h>
+#include <horizon/rbtree.h>
+#include <horizon/spinlock.h>
 
 /* Include scheduler components */
 #include <horizon/sched/rt.h>
+#include <horizon/sched/fair.h>
 #include <horizon/sched/sched_domain.h>
 #include <horizon/sched/load_balance.h>
 
@@ -34,37 +37,82 @@ struct thread;
 
 /* Scheduler time slice */
 #define SCHED_TIMESLICE_DEFAULT 100  /* Default time slice in milliseconds */
+#define SCHED_TIMESLICE_RR      100  /* Round-robin time slice in milliseconds */
+
+/* Run queue priority levels, lower is more important */
+#define MAX_RT_PRIO     100                     /* Levels 0..99 are real-time */
+#define MAX_PRIO        140                     /* Levels 100..139 are time-sharing */
+#define PRIO_BITMAP_WORDS ((MAX_PRIO + 31) / 32)
+
+/* Priority array, one FIFO queue per priority level */
+typedef struct prio_array {
+    u32 nr_active;                        /* Number of queued threads */
+    u32 bitmap[PRIO_BITMAP_WORDS];        /* Bit set for each non-empty queue */
+    struct list_head queue[MAX_PRIO];     /* Per-priority queues */
+} prio_array_t;
 
 /* Scheduler run queue */
 typedef struct run_queue {
-    /* Run queue lock */
-    u32 lock;
+    /* Run queue lock, protects everything below and the queue links of its threads */
+    spinlock_t lock;
+
+    /* CPU the run queue belongs to */
+    u32 cpu;
+
+    /* Load tracking */
+    unsigned long load_avg;   /* Decayed load weight */
 
     /* Run queue statistics */
-    u32 nr_running;           /* Number of running threads */
+    u32 nr_running;           /* Number of queued threads, including the current one */
     u32 nr_switches;          /* Number of context switches */
     u64 nr_schedule;          /* Number of schedules */
+    u64 nr_array_swaps;       /* Number of active/expired swaps */
+    u64 nr_rt_schedule;       /* Number of real-time class picks */
+    u64 nr_rt_switches;       /* Number of switches to a real-time thread */
+    u64 nr_rt_preempts;       /* Number of those that preempted a runnable thread */
     u64 curr_timestamp;       /* Current timestamp */
     u64 last_timestamp;       /* Last timestamp */
 
-    /* Run queue lists */
-    struct list_head queue;   /* Run queue */
-    struct list_head expired; /* Expired queue */
-
     /* Run queue arrays */
-    struct list_head (*active)[SCHED_PRIO_MAX + 1];  /* Active array */
-    struct list_head arrays[2][SCHED_PRIO_MAX + 1]; /* Priority arrays */
+    prio_array_t *active;     /* Threads with time slice left */
+    prio_array_t *expired;    /* Threads that used up their time slice */
+    prio_array_t arrays[2];   /* Storage for the two arrays */
+
+    /* Fair class */
+    cfs_rq_t cfs;             /* Fair run queue */
 
     /* Run queue current */
     struct thread *curr;      /* Current thread */
     struct thread *idle;      /* Idle thread */
-    struct thread *head;      /* Head of the run queue */
-    struct thread *tail;      /* Tail of the run queue */
 
-    /* Run queue bitmap */
-    u64 bitmap;               /* Priority bitmap */
+    /* Sleeping threads */
+    rb_root_t sleepers;       /* Sleeping threads by wakeup time */
+    struct thread *next_sleeper; /* Sleeper with the earliest wakeup time */
+    u32 nr_sleeping;          /* Number of sleeping threads */
+    u64 nr_timed_wakeups;     /* Number of sleepers woken by their deadline */
+
+    /* Tickless idle */
+    int nohz_active;          /* Periodic tick is stopped */
+    u64 nr_nohz_idle;         /* Number of tickless idle periods */
+    u64 nohz_ticks_skipped;   /* Ticks not taken while tickless */
 } run_queue_t;
 
+/**
+ * Find the most important non-empty queue of a priority array
+ *
+ * @param array Priority array
+ * @return Priority level, or MAX_PRIO if the array is empty
+ */
+static inline int sched_find_first_prio(const prio_array_t *array) {
+    for (int i = 0; i < PRIO_BITMAP_WORDS; i++) {
+        if (array->bitmap[i] != 0) {
+            return i * 32 + __builtin_ctz(array->bitmap[i]);
+        }
+    }
+
+    return MAX_PRIO;
+}
+
 /* Scheduler functions */
 void sched_init(void);
 void sched_start(void);
@@ -75,8 +123,10 @@ void sched_schedule(void);
 void sched_add_thread(struct thread *thread);
 void sched_remove_thread(struct thread *thread);
 void sched_block_thread(struct thread *thread);
+void sched_block_thread_unlock(struct thread *thread, spinlock_t *lock);
 void sched_unblock_thread(struct thread *thread);
 void sched_sleep_thread(struct thread *thread, u64 ms);
+void sched_sleep_thread_unlock(struct thread *thread, u64 ms, spinlock_t *lock);
 void sched_wakeup_thread(struct thread *thread);
 void sched_set_priority(struct thread *thread, int priority);
 int sched_get_priority(struct thread *thread);
@@ -92,6 +142,21 @@ struct thread *sched_dequeue_thread(void);
 void sched_requeue_thread(struct thread *thread);
 void sched_check_preempt(struct thread *thread);
 void sched_check_expired(run_queue_t *rq);
+int sched_thread_prio(struct thread *thread);
+int sched_thread_normal_prio(struct thread *thread);
+void sched_prio_changed(struct thread *thread);
+u64 sched_next_wakeup(run_queue_t *rq);
+int sched_set_nice(struct thread *thread, int nice);
+int sched_migrate_thread(struct thread *thread, run_queue_t *dst);
+unsigned long sched_rq_load(run_queue_t *rq);
+void sched_set_nohz(int enable);
+void sched_rq_lock(run_queue_t *rq, unsigned long *flags);
+void sched_rq_unlock(run_queue_t *rq, unsigned long flags);
+run_queue_t *sched_thread_rq_lock(struct thread *thread, unsigned long *flags);
+void sched_double_lock(run_queue_t *rq1, run_queue_t *rq2);
+void sched_double_unlock(run_queue_t *rq1, run_queue_t *rq2);
+void sched_array_enqueue(prio_array_t *array, struct thread *thread, int head);
+void sched_array_dequeue(struct thread *thread);
 void sched_update_thread(struct thread *thread);
 void sched_update_priority(struct thread *thread);
 void sched_update_timeslice(struct thread *thread);
@@ -0,0 +1,85 @@
+/**
+ * fair.h - Horizon kernel fair scheduler definitions
+ *
+ * This file contains definitions for the fair scheduling class used by
+ * SCHED_NORMAL, SCHED_BATCH and SCHED_IDLE threads.
+ */
+
+#ifndef _HORIZON_SCHED_FAIR_H
+#define _HORIZON_SCHED_FAIR_H
+
+#include <horizon/types.h>
+#include <horizon/rbtree.h>
+
+/* Nice levels */
+#define NICE_MIN    -20
+#define NICE_MAX    19
+#define NICE_WIDTH  40
+
+/* Load weight of a nice 0 thread */
+#define NICE_0_LOAD 1024
+
+/* Load weight of a SCHED_IDLE thread */
+#define FAIR_IDLE_WEIGHT 3
+
+/* Fair scheduler tunables, in microseconds */
+#define FAIR_LATENCY_US             6000    /* Period in which every thread runs once */
+#define FAIR_MIN_GRANULARITY_US     750     /* Shortest slice before tick preemption */
+#define FAIR_WAKEUP_GRANULARITY_US  1000    /* Lead a waking thread needs to preempt */
+
+/* Forward declarations */
+struct thread;
+struct run_queue;
+
+/* Fair run queue */
+typedef struct cfs_rq {
+    rb_root_t timeline;             /* Queued threads by virtual runtime */
+    struct thread *leftmost;        /* Queued thread with the smallest virtual runtime */
+    struct thread *curr;            /* Running fair thread, kept out of the tree */
+    u64 min_vruntime;               /* Monotonic floor of the virtual runtimes */
+    u32 nr_running;                 /* Number of fair threads, including curr */
+    unsigned long load_weight;      /* Sum of the load weights */
+    u64 nr_preempt_tick;            /* Preemptions at the tick */
+    u64 nr_preempt_wakeup;          /* Preemptions by waking threads */
+} cfs_rq_t;
+
+/* Initialize a fair run queue */
+void fair_init_rq(cfs_rq_t *cfs);
+
+/* Check if a thread belongs to the fair class */
+int fair_is_fair(struct thread *thread);
+
+/* Enqueue a fair thread */
+void fair_enqueue(struct run_queue *rq, struct thread *thread);
+
+/* Dequeue a fair thread */
+void fair_dequeue(struct run_queue *rq, struct thread *thread);
+
+/* Move a queued fair thread to another run queue */
+void fair_migrate(struct run_queue *src, struct run_queue *dst, struct thread *thread);
+
+/* Pick the next fair thread to run */
+struct thread *fair_pick_next(struct run_queue *rq);
+
+/* Put the previous thread back before picking */
+void fair_put_prev(struct run_queue *rq, struct thread *prev);
+
+/* Make a thread the running fair thread */
+void fair_set_next(struct run_queue *rq, struct thread *next);
+
+/* Account the running thread at a tick, returns 1 if it should be preempted */
+int fair_tick(struct run_queue *rq, struct thread *curr);
+
+/* Check if a waking thread should preempt the running one */
+int fair_check_preempt(struct run_queue *rq, struct thread *curr, struct thread *thread);
+
+/* Yield the running fair thread */
+void fair_yield(struct run_queue *rq, struct thread *curr);
+
+/* Set the nice level of a thread */
+int fair_set_nice(struct thread *thread, int nice);
+
+/* Print fair scheduler statistics */
+void fair_print_stats(struct run_queue *rq);
+
+#endif /* _HORIZON_SCHED_FAIR_H */
@@ -9,6 +9,18 @@
 
 #include <horizon/types.h>
 
+/* Forward declarations */
+struct run_queue;
+
+/* Load average decay, each tick keeps 7/8 of the old average */
+#define LOAD_AVG_SHIFT          3
+
+/* Threads that ran more recently than this are cache hot, in microseconds */
+#define LB_MIGRATION_COST_US    500
+
+/* Maximum number of threads moved in one balance */
+#define LB_MAX_MOVES            32
+
 /* Initialize the load balancing subsystem */
 void load_balance_init(void);
 
@@ -30,6 +42,12 @@ int load_balance_check_imbalance(void);
 /* Balance the load between CPUs */
 int load_balance_run(void);
 
+/* Update the load average and rebalance due domains at a tick */
+void load_balance_tick(struct run_queue *rq);
+
+/* Pull work to a CPU that is about to go idle */
+int load_balance_newidle(struct run_queue *rq);
+
 /* Print load balancing statistics */
 void load_balance_print_stats(void);
 
@@ -39,6 +39,9 @@ int rt_set_prio_base(u32 prio_base);
 /* Check if a thread is real-time */
 int rt_is_realtime(struct thread *thread);
 
+/* Check if a thread has a real-time policy, ignoring inherited priority */
+int rt_policy_realtime(struct thread *thread);
+
 /* Check if a thread can preempt another thread */
 int rt_can_preempt(struct thread *thread, struct thread *current);
 
@@ -54,9 +57,12 @@ int rt_dequeue(struct run_queue *rq, struct thread *thread);
 /* Yield a real-time thread */
 int rt_yield(struct run_queue *rq, struct thread *thread);
 
-/* Boost a real-time thread's priority */
+/* Boost a thread's effective priority */
 int rt_boost(struct thread *thread, int boost);
 
+/* Drop a boost back to an inherited priority or the thread's own */
+int rt_deboost(struct thread *thread, int prio);
+
 /* Throttle a real-time thread */
 int rt_throttle(struct thread *thread, int throttle);
 
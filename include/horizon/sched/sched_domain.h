@@ -8,6 +8,7 @@
 #define _HORIZON_SCHED_DOMAIN_H
 
 #include <horizon/types.h>
+#include <horizon/config.h>
 
 /* Scheduler domain flags */
 #define SD_LOAD_BALANCE      0x00000001 /* Do load balancing on this domain */
@@ -24,6 +25,9 @@
 #define SD_OVERLAP           0x00000800 /* Domains overlap */
 #define SD_NUMA              0x00001000 /* Domain is NUMA */
 
+/* Logical CPUs sharing a core, adjacent CPU IDs are siblings */
+#define SD_CPUS_PER_CORE     2
+
 /* Forward declarations */
 struct sched_domain;
 struct sched_group;
@@ -44,8 +48,23 @@ typedef struct sched_domain {
     u32 busy_factor;        /* Busy factor */
     u32 imbalance_pct;      /* Imbalance percentage */
     u32 cache_nice_tries;   /* Cache nice tries */
+    int level;              /* Topology level, 0 is the lowest */
     int group_count;        /* Number of groups */
     struct sched_group groups[8]; /* Groups in this domain */
+
+    /* Balancing state */
+    u32 balance_interval;   /* Current balance interval in ticks */
+    u32 nr_balance_failed;  /* Consecutive balances that moved nothing */
+    u64 last_balance[CONFIG_NR_CPUS]; /* Tick each CPU last balanced */
+
+    /* Balancing statistics */
+    u64 lb_count;           /* Number of balance attempts */
+    u64 lb_balanced;        /* Attempts that found no imbalance */
+    u64 lb_moved;           /* Threads moved */
+    u64 lb_failed;          /* Attempts that found an imbalance but moved nothing */
+    u64 lb_hot_skipped;     /* Threads skipped for being cache hot */
+    u64 lb_affine_skipped;  /* Threads skipped for their affinity */
+    u64 lb_newidle;         /* Newly idle balance attempts */
 } sched_domain_t;
 
 /* Initialize the scheduler domains */
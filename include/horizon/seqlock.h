@@ -0,0 +1,155 @@
+/**
+ * seqlock.h - Horizon kernel sequence lock definitions
+ *
+ * This file contains definitions for sequence counters and sequence locks.
+ * A writer makes the sequence odd while it updates the data and even again
+ * when done. Readers take no lock and write no shared memory: they note the
+ * sequence, read the data, and retry if the sequence was odd or has moved.
+ * This suits small, often read, rarely written data like the timekeeping.
+ *
+ * Readers may spin while a writer is inside, so a writer must not be
+ * interrupted by a reader on the same CPU. Disable interrupts around the
+ * write side where interrupt handlers read.
+ */
+
+#ifndef _HORIZON_SEQLOCK_H
+#define _HORIZON_SEQLOCK_H
+
+#include <horizon/types.h>
+#include <horizon/spinlock.h>
+
+/* Sequence counter, writers serialize by other means */
+typedef struct seqcount {
+    volatile u32 sequence;         /* Odd while a write is in progress */
+} seqcount_t;
+
+/* Sequence lock, a sequence counter with a lock for the writers */
+typedef struct seqlock {
+    seqcount_t seqcount;           /* Sequence counter */
+    spinlock_t lock;               /* Serializes the writers */
+} seqlock_t;
+
+/* Static initializers */
+#define SEQCNT_ZERO                 { 0 }
+#define SEQLOCK_INITIALIZER         { SEQCNT_ZERO, SPIN_LOCK_INITIALIZER }
+
+/**
+ * Initialize a sequence counter
+ *
+ * @param s Sequence counter
+ */
+static inline void seqcount_init(seqcount_t *s) {
+    s->sequence = 0;
+}
+
+/**
+ * Begin a read-side section
+ *
+ * Waits out a writer in progress.
+ *
+ * @param s Sequence counter
+ * @return Sequence to pass to read_seqcount_retry()
+ */
+static inline u32 read_seqcount_begin(const seqcount_t *s) {
+    u32 seq;
+
+    while ((seq = s->sequence) & 1) {
+        __asm__ volatile("pause" : : : "memory");
+    }
+
+    /* Order the sequence read before the data reads */
+    __sync_synchronize();
+
+    return seq;
+}
+
+/**
+ * End a read-side section
+ *
+ * @param s Sequence counter
+ * @param start Sequence from read_seqcount_begin()
+ * @return Nonzero if a writer got in and the data must be read again
+ */
+static inline int read_seqcount_retry(const seqcount_t *s, u32 start) {
+    /* Order the data reads before the sequence read */
+    __sync_synchronize();
+
+    return s->sequence != start;
+}
+
+/**
+ * Begin a write-side section
+ *
+ * @param s Sequence counter
+ */
+static inline void write_seqcount_begin(seqcount_t *s) {
+    s->sequence++;
+
+    /* Order the odd sequence before the data writes */
+    __sync_synchronize();
+}
+
+/**
+ * End a write-side section
+ *
+ * @param s Sequence counter
+ */
+static inline void write_seqcount_end(seqcount_t *s) {
+    /* Order the data writes before the even sequence */
+    __sync_synchronize();
+
+    s->sequence++;
+}
+
+/**
+ * Initialize a sequence lock
+ *
+ * @param sl Sequence lock
+ */
+static inline void seqlock_init(seqlock_t *sl) {
+    seqcount_init(&sl->seqcount);
+    spin_lock_init(&sl->lock);
+}
+
+/**
+ * Begin a read-side section of a sequence lock
+ *
+ * @param sl Sequence lock
+ * @return Sequence to pass to read_seqretry()
+ */
+static inline u32 read_seqbegin(const seqlock_t *sl) {
+    return read_seqcount_begin(&sl->seqcount);
+}
+
+/**
+ * End a read-side section of a sequence lock
+ *
+ * @param sl Sequence lock
+ * @param start Sequence from read_seqbegin()
+ * @return Nonzero if the data must be read again
+ */
+static inline int read_seqretry(const seqlock_t *sl, u32 start) {
+    return read_seqcount_retry(&sl->seqcount, start);
+}
+
+/**
+ * Take a sequence lock for writing
+ *
+ * @param sl Sequence lock
+ */
+static inline void write_seqlock(seqlock_t *sl) {
+    spin_lock(&sl->lock);
+    write_seqcount_begin(&sl->seqcount);
+}
+
+/**
+ * Release a sequence lock taken for writing
+ *
+ * @param sl Sequence lock
+ */
+static inline void write_sequnlock(seqlock_t *sl) {
+    write_seqcount_end(&sl->seqcount);
+    spin_unlock(&sl->lock);
+}
+
+#endif /* _HORIZON_SEQLOCK_H */
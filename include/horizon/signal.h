@@ -9,6 +9,7 @@
 
 #include <horizon/types.h>
 #include <horizon/list.h>
+#include <horizon/time.h>
 
 /* Signal numbers (Linux compatible) */
 #define SIGHUP           1       /* Hangup */
@@ -63,17 +64,17 @@ typedef u64 sigset_t;
 #define SA_RESETHAND     0x80000000 /* Reset to SIG_DFL on entry to handler */
 #define SA_RESTORER      0x04000000 /* Used by C libraries to restore signal mask */
 
-/* Signal value */
-typedef union sigval {
-    int sival_int;              /* Integer value */
-    void *sival_ptr;            /* Pointer value */
-} sigval_t;
+/* Signal value, union sigval comes from time.h */
+typedef union sigval sigval_t;
+
+/* Signal information, defined below */
+struct siginfo;
 
 /* Signal action */
 typedef struct sigaction {
     union {
         void (*sa_handler)(int);                    /* Signal handler */
-        void (*sa_sigaction)(int, siginfo_t *, void *); /* Signal action */
+        void (*sa_sigaction)(int, struct siginfo *, void *); /* Signal action */
     } _u;
     sigset_t sa_mask;           /* Signal mask to apply */
     int sa_flags;               /* Signal flags */
@@ -237,6 +238,7 @@ int signal_handle(struct task_struct *task, int sig);
 int signal_handle_thread(struct thread *thread, int sig);
 int signal_mask(struct task_struct *task, int how, const sigset_t *set, sigset_t *oldset);
 int signal_mask_thread(struct thread *thread, int how, const sigset_t *set, sigset_t *oldset);
+int signal_swap_mask(const sigset_t *set, sigset_t *oldset);
 int signal_action(struct task_struct *task, int sig, const struct sigaction *act, struct sigaction *oldact);
 int signal_action_thread(struct thread *thread, int sig, const struct sigaction *act, struct sigaction *oldact);
 int signal_wait(struct task_struct *task, const sigset_t *set, siginfo_t *info);
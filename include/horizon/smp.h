@@ -9,6 +9,7 @@
 
 #include <horizon/types.h>
 #include <horizon/spinlock.h>
+#include <horizon/cpumask.h>
 
 /* Maximum number of CPUs */
 #define NR_CPUS 32
@@ -19,11 +20,6 @@
 #define CPU_DEAD        2  /* CPU is dead */
 #define CPU_DYING       3  /* CPU is dying */
 
-/* CPU mask */
-typedef struct cpumask {
-    unsigned long bits[NR_CPUS / (8 * sizeof(unsigned long))];
-} cpumask_t;
-
 /* Per-CPU data */
 struct percpu_data {
     int cpu_id;                    /* CPU ID */
@@ -51,9 +47,9 @@ struct percpu_data {
 };
 
 /* CPU mask operations */
-#define cpu_set(cpu, mask) ((mask)->bits[(cpu) / (8 * sizeof(unsigned long))] |= (1UL << ((cpu) % (8 * sizeof(unsigned long)))))
-#define cpu_clear(cpu, mask) ((mask)->bits[(cpu) / (8 * sizeof(unsigned long))] &= ~(1UL << ((cpu) % (8 * sizeof(unsigned long)))))
-#define cpu_isset(cpu, mask) ((mask)->bits[(cpu) / (8 * sizeof(unsigned long))] & (1UL << ((cpu) % (8 * sizeof(unsigned long)))))
+#define cpu_set(cpu, mask) ((mask)->bits[(cpu) / (8 * sizeof(u32))] |= (1U << ((cpu) % (8 * sizeof(u32)))))
+#define cpu_clear(cpu, mask) ((mask)->bits[(cpu) / (8 * sizeof(u32))] &= ~(1U << ((cpu) % (8 * sizeof(u32)))))
+#define cpu_isset(cpu, mask) ((mask)->bits[(cpu) / (8 * sizeof(u32))] & (1U << ((cpu) % (8 * sizeof(u32)))))
 #define cpu_test_and_set(cpu, mask) ({ \
     int __ret = cpu_isset(cpu, mask); \
     cpu_set(cpu, mask); \
@@ -70,7 +66,7 @@ struct percpu_data {
 #define cpus_empty(mask) ({ \
     int __ret = 1; \
     int __i; \
-    for (__i = 0; __i < NR_CPUS / (8 * sizeof(unsigned long)); __i++) { \
+    for (__i = 0; __i < NR_CPUS / (8 * sizeof(u32)); __i++) { \
         if ((mask).bits[__i] != 0) { \
             __ret = 0; \
             break; \
@@ -90,25 +86,25 @@ struct percpu_data {
 })
 #define cpus_complement(dst, src) ({ \
     int __i; \
-    for (__i = 0; __i < NR_CPUS / (8 * sizeof(unsigned long)); __i++) { \
+    for (__i = 0; __i < NR_CPUS / (8 * sizeof(u32)); __i++) { \
         (dst).bits[__i] = ~(src).bits[__i]; \
     } \
 })
 #define cpus_and(dst, src1, src2) ({ \
     int __i; \
-    for (__i = 0; __i < NR_CPUS / (8 * sizeof(unsigned long)); __i++) { \
+    for (__i = 0; __i < NR_CPUS / (8 * sizeof(u32)); __i++) { \
         (dst).bits[__i] = (src1).bits[__i] & (src2).bits[__i]; \
     } \
 })
 #define cpus_or(dst, src1, src2) ({ \
     int __i; \
-    for (__i = 0; __i < NR_CPUS / (8 * sizeof(unsigned long)); __i++) { \
+    for (__i = 0; __i < NR_CPUS / (8 * sizeof(u32)); __i++) { \
         (dst).bits[__i] = (src1).bits[__i] | (src2).bits[__i]; \
     } \
 })
 #define cpus_xor(dst, src1, src2) ({ \
     int __i; \
-    for (__i = 0; __i < NR_CPUS / (8 * sizeof(unsigned long)); __i++) { \
+    for (__i = 0; __i < NR_CPUS / (8 * sizeof(u32)); __i++) { \
         (dst).bits[__i] = (src1).bits[__i] ^ (src2).bits[__i]; \
     } \
 })
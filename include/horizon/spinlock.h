@@ -2,27 +2,67 @@
  * spinlock.h - Horizon kernel spinlock definitions
  *
  * This file contains definitions for spinlocks.
+ *
+ * Spinlocks are queued, so waiters get the lock in FIFO order. With few
+ * CPUs a ticket lock does this in one word. With more CPUs waiters queue
+ * MCS style on per-CPU nodes and each spins on its own node, so the lock's
+ * cache line is not hammered by every waiter.
+ *
+ * Plain spinlocks do not touch the interrupt flag, use spin_lock_irqsave()
+ * where an interrupt handler takes the same lock.
  */
 
 #ifndef _HORIZON_SPINLOCK_H
 #define _HORIZON_SPINLOCK_H
 
 #include <horizon/types.h>
+#include <horizon/config.h>
+#include <horizon/irqflags.h>
+
+/*
+ * Debug spinlocks record the owner and call site in the lock on every
+ * acquire, which costs a store to the lock's cache line each time.
+ * Define to enable.
+ */
+/* #define CONFIG_DEBUG_SPINLOCK */
+
+/* Per-class lock statistics in a side table, define to enable */
+/* #define CONFIG_LOCK_STAT */
+
+/* Largest CPU count that uses ticket locks */
+#define SPINLOCK_TICKET_MAX_CPUS    8
 
-/* Debug spinlocks */
-#define CONFIG_DEBUG_SPINLOCK
+#if CONFIG_NR_CPUS > SPINLOCK_TICKET_MAX_CPUS
+#define CONFIG_QUEUED_SPINLOCKS
+#endif
+
+/* Queued lock word: locked byte, then the tail of the MCS queue */
+#define QSPIN_LOCKED_MASK   0x000000ffU
+#define QSPIN_TAIL_SHIFT    16
+#define QSPIN_TAIL_IDX_BITS 2
+#define QSPIN_MAX_NESTING   (1 << QSPIN_TAIL_IDX_BITS)  /* Task, softirq, hardirq, NMI */
+
+/* Maximum number of lock classes */
+#define LOCK_CLASS_MAX      128
 
 /* Raw spinlock structure */
 typedef struct raw_spinlock {
-    volatile unsigned int lock;    /* Lock value */
+    union {
+        volatile u32 lock;          /* Lock word, zero when free */
+        struct {
+            volatile u16 owner;     /* Ticket being served */
+            volatile u16 next;      /* Next ticket to hand out */
+        } tickets;
+    };
+#ifdef CONFIG_LOCK_STAT
+    u16 lock_class;                 /* Index in the lock class table */
+#endif
 #ifdef CONFIG_DEBUG_SPINLOCK
     const char *name;              /* Lock name */
     const char *file;              /* Source file */
     int line;                      /* Source line */
     unsigned long owner;           /* Owner CPU */
     unsigned long owner_pc;        /* Owner PC */
-    unsigned int held_count;       /* Number of times held */
-    unsigned int contention_count; /* Number of contentions */
 #endif
 } raw_spinlock_t;
 
@@ -31,49 +71,151 @@ typedef struct spinlock {
     raw_spinlock_t raw_lock;       /* Raw spinlock */
 } spinlock_t;
 
+/* Lock class statistics, kept apart from the locks themselves */
+typedef struct lock_class {
+    const char *name;               /* Class name, NULL for a free slot */
+    u64 acquired;                   /* Acquisitions */
+    u64 contended;                  /* Acquisitions that had to wait */
+    u64 wait_spins;                 /* Spin iterations while waiting */
+    u64 max_wait_spins;             /* Longest wait in spin iterations */
+} lock_class_t;
+
 /* Initialize a raw spinlock */
 #ifdef CONFIG_DEBUG_SPINLOCK
-#define RAW_SPIN_LOCK_INITIALIZER { 0, NULL, NULL, 0, 0, 0, 0, 0 }
-#define raw_spin_lock_init(lock) \
+#define RAW_SPIN_LOCK_INITIALIZER { { 0 } }
+#define raw_spin_lock_init(l) \
     do { \
-        (lock)->lock = 0; \
-        (lock)->name = "unknown"; \
-        (lock)->file = NULL; \
-        (lock)->line = 0; \
-        (lock)->owner = 0; \
-        (lock)->owner_pc = 0; \
-        (lock)->held_count = 0; \
-        (lock)->contention_count = 0; \
+        (l)->lock = 0; \
+        (l)->name = "unknown"; \
+        (l)->file = NULL; \
+        (l)->line = 0; \
+        (l)->owner = 0; \
+        (l)->owner_pc = 0; \
+        raw_spin_lock_init_class(l, NULL); \
     } while (0)
 #else
-#define RAW_SPIN_LOCK_INITIALIZER { 0 }
-#define raw_spin_lock_init(lock) \
+#define RAW_SPIN_LOCK_INITIALIZER { { 0 } }
+#define raw_spin_lock_init(l) \
     do { \
-        (lock)->lock = 0; \
+        (l)->lock = 0; \
+        raw_spin_lock_init_class(l, NULL); \
     } while (0)
 #endif
 
+/* Put a lock in a statistics class, the default class for a NULL name */
+#ifdef CONFIG_LOCK_STAT
+#define raw_spin_lock_init_class(l, name_str) ((l)->lock_class = lock_class_register(name_str))
+#else
+#define raw_spin_lock_init_class(l, name_str) do { } while (0)
+#endif
+
 /* Initialize a spinlock */
 #define SPIN_LOCK_INITIALIZER { RAW_SPIN_LOCK_INITIALIZER }
-#define spin_lock_init(lock) do { raw_spin_lock_init(&(lock)->raw_lock); } while (0)
+#define spin_lock_init(l) do { raw_spin_lock_init(&(l)->raw_lock); } while (0)
 
 /* Initialize a spinlock with a name */
 #ifdef CONFIG_DEBUG_SPINLOCK
-#define spin_lock_init_named(lock, name_str) \
+#define spin_lock_init_named(l, name_str) \
+    do { \
+        raw_spin_lock_init(&(l)->raw_lock); \
+        (l)->raw_lock.name = (name_str); \
+        raw_spin_lock_init_class(&(l)->raw_lock, name_str); \
+    } while (0)
+#else
+#define spin_lock_init_named(l, name_str) \
     do { \
-        raw_spin_lock_init(&(lock)->raw_lock); \
-        (lock)->raw_lock.name = (name_str); \
+        raw_spin_lock_init(&(l)->raw_lock); \
+        raw_spin_lock_init_class(&(l)->raw_lock, name_str); \
     } while (0)
+#endif
+
+/* Contended path, out of line */
+void raw_spin_lock_slowpath(raw_spinlock_t *lock, u32 val);
+
+/* Lock statistics */
+#ifdef CONFIG_LOCK_STAT
+u16 lock_class_register(const char *name);
+void lock_stat_acquired(raw_spinlock_t *lock, u32 spins);
+#define lock_stat_acquire(lock) lock_stat_acquired(lock, 0)
+#else
+#define lock_stat_acquire(lock) do { } while (0)
+#endif
+int lock_stat_get(u16 lock_class, lock_class_t *stats);
+void lock_stat_print(void);
+void lock_stat_reset(void);
+
+/**
+ * Acquire a raw spinlock, fast path
+ *
+ * @param lock Raw spinlock to acquire
+ */
+static inline void __raw_spin_lock_fast(raw_spinlock_t *lock) {
+#ifdef CONFIG_QUEUED_SPINLOCKS
+    /* Free and nobody queued */
+    u32 val = __sync_val_compare_and_swap(&lock->lock, 0, 1);
+    if (val != 0) {
+        raw_spin_lock_slowpath(lock, val);
+        return;
+    }
+#else
+    /* Draw a ticket, ours is served at once if the lock was free */
+    u32 val = __sync_fetch_and_add(&lock->lock, 1U << 16);
+    if ((u16)(val >> 16) != (u16)val) {
+        raw_spin_lock_slowpath(lock, val);
+        return;
+    }
+#endif
+    lock_stat_acquire(lock);
+}
+
+/**
+ * Try to acquire a raw spinlock, fast path
+ *
+ * @param lock Raw spinlock to acquire
+ * @return 1 if lock acquired, 0 if not
+ */
+static inline int __raw_spin_trylock_fast(raw_spinlock_t *lock) {
+#ifdef CONFIG_QUEUED_SPINLOCKS
+    if (lock->lock != 0 || !__sync_bool_compare_and_swap(&lock->lock, 0, 1)) {
+        return 0;
+    }
 #else
-#define spin_lock_init_named(lock, name_str) spin_lock_init(lock)
+    u32 val = lock->lock;
+
+    /* Only take a ticket that is served right away */
+    if ((u16)(val >> 16) != (u16)val ||
+        !__sync_bool_compare_and_swap(&lock->lock, val, val + (1U << 16))) {
+        return 0;
+    }
 #endif
+    lock_stat_acquire(lock);
+    return 1;
+}
+
+/**
+ * Release a raw spinlock, fast path
+ *
+ * @param lock Raw spinlock to release
+ */
+static inline void __raw_spin_unlock_fast(raw_spinlock_t *lock) {
+    /* Order the critical section before the release */
+    __sync_synchronize();
+
+#ifdef CONFIG_QUEUED_SPINLOCKS
+    /* Only the owner writes the locked byte, the tail belongs to waiters */
+    *(volatile u8 *)&lock->lock = 0;
+#else
+    /* Serve the next ticket, only the owner writes this half */
+    lock->tickets.owner++;
+#endif
+}
 
 /* Acquire a raw spinlock */
 #ifdef CONFIG_DEBUG_SPINLOCK
 void __raw_spin_lock(raw_spinlock_t *lock, const char *file, int line);
 #define raw_spin_lock(lock) __raw_spin_lock(lock, __FILE__, __LINE__)
 #else
-void raw_spin_lock(raw_spinlock_t *lock);
+#define raw_spin_lock(lock) __raw_spin_lock_fast(lock)
 #endif
 
 /* Try to acquire a raw spinlock */
@@ -81,7 +223,7 @@ void raw_spin_lock(raw_spinlock_t *lock);
 int __raw_spin_trylock(raw_spinlock_t *lock, const char *file, int line);
 #define raw_spin_trylock(lock) __raw_spin_trylock(lock, __FILE__, __LINE__)
 #else
-int raw_spin_trylock(raw_spinlock_t *lock);
+#define raw_spin_trylock(lock) __raw_spin_trylock_fast(lock)
 #endif
 
 /* Release a raw spinlock */
@@ -89,7 +231,7 @@ int raw_spin_trylock(raw_spinlock_t *lock);
 void __raw_spin_unlock(raw_spinlock_t *lock, const char *file, int line);
 #define raw_spin_unlock(lock) __raw_spin_unlock(lock, __FILE__, __LINE__)
 #else
-void raw_spin_unlock(raw_spinlock_t *lock);
+#define raw_spin_unlock(lock) __raw_spin_unlock_fast(lock)
 #endif
 
 /* Acquire a spinlock */
@@ -101,6 +243,20 @@ void raw_spin_unlock(raw_spinlock_t *lock);
 /* Release a spinlock */
 #define spin_unlock(lock) raw_spin_unlock(&(lock)->raw_lock)
 
+/* Acquire a spinlock with local interrupts disabled, saving the flags */
+#define spin_lock_irqsave(lock, flags) \
+    do { \
+        local_irq_save(flags); \
+        spin_lock(lock); \
+    } while (0)
+
+/* Release a spinlock and restore the saved interrupt flags */
+#define spin_unlock_irqrestore(lock, flags) \
+    do { \
+        spin_unlock(lock); \
+        local_irq_restore(flags); \
+    } while (0)
+
 /* Check if a raw spinlock is locked */
 int raw_spin_is_locked(raw_spinlock_t *lock);
 
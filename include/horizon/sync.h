@@ -9,17 +9,38 @@
 
 #include <horizon/types.h>
 #include <horizon/list.h>
+#include <horizon/rtmutex.h>
 
 /* Forward declarations */
 struct thread;
 
-/* Mutex structure */
+/* Longest optimistic spin on a running owner, in polls of the owner word */
+#define MUTEX_SPIN_MAX 4096
+
+/* MCS queue node of an optimistic spinner, lives on the spinner's stack */
+typedef struct mutex_spin_node {
+    struct mutex_spin_node *volatile next; /* Next spinner in the queue */
+    volatile int locked;            /* Set by the predecessor when it is our turn */
+} mutex_spin_node_t;
+
+/* Mutex structure, waiters are served by priority and real-time ones boost the owner */
 typedef struct mutex {
-    volatile int locked;            /* Mutex is locked */
-    struct thread *owner;           /* Thread that owns the mutex */
-    list_head_t waiters;            /* Waiting threads */
+    rt_mutex_t base;                /* Owner word and sleeping waiters */
+    mutex_spin_node_t *volatile spin_tail; /* Tail of the queue of spinners */
 } mutex_t;
 
+/* Mutex contention statistics */
+typedef struct mutex_stats {
+    u64 fast;                       /* Uncontended acquisitions */
+    u64 spin_acquired;              /* Acquired while spinning on a running owner */
+    u64 spin_failed;                /* Spun, then had to sleep */
+    u64 slept;                      /* Acquired after sleeping */
+    u64 trylock_failed;             /* Failed trylocks */
+    u64 spin_polls;                 /* Polls of the owner word while spinning */
+    u64 wait_time;                  /* Time spent waiting in the slow path, in microseconds */
+    u64 max_wait_time;              /* Longest wait in the slow path, in microseconds */
+} mutex_stats_t;
+
 /* Semaphore structure */
 typedef struct sem {
     volatile int value;             /* Semaphore value */
@@ -53,6 +74,8 @@ int mutex_destroy(mutex_t *mutex);
 int mutex_lock(mutex_t *mutex);
 int mutex_trylock(mutex_t *mutex);
 int mutex_unlock(mutex_t *mutex);
+void mutex_get_stats(mutex_stats_t *stats);
+void mutex_print_stats(void);
 
 /* Semaphore functions */
 int sem_init(sem_t *sem, u32 value);
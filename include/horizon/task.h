@@ -80,6 +80,7 @@ typedef struct file {
     unsigned int f_count;          /* Reference count */
     struct file_operations *f_op;  /* File operations */
     void *private_data;            /* Private data */
+    struct list_head f_ep_links;   /* Epoll items watching this file */
 } file_t;
 
 /* File descriptor structure */
@@ -207,8 +208,9 @@ typedef struct task_struct {
     u32 thread_count;              /* Thread count */
 
     /* Process lists */
-    struct list_head tasks;        /* Task list */
+    struct list_head tasks;        /* Task list, walked under RCU */
     struct list_head thread_group; /* Thread group list */
+    struct rcu_head rcu;           /* Deferred free after leaving the task list */
 
     /* Process times */
     struct timespec start_time;    /* Start time */
@@ -222,6 +224,9 @@ typedef struct task_struct {
     /* Process CPU */
     int cpu;                       /* CPU */
     int on_cpu;                    /* On CPU */
+
+    /* Block I/O */
+    struct blk_plug *plug;         /* Plug holding back submitted bios */
 } task_struct_t;
 
 /* Task functions */
@@ -242,6 +247,7 @@ file_t *task_get_file(task_struct_t *task, unsigned int fd);
 int task_signal(task_struct_t *task, int sig);
 int task_signal_group(task_struct_t *task, int sig);
 int task_signal_all(int sig);
+void task_for_each(void (*fn)(task_struct_t *task, void *data), void *data);
 
 /* Thread-related task functions */
 thread_t *task_create_thread(task_struct_t *task, void *(*start_routine)(void *), void *arg, u32 flags);
@@ -9,6 +9,9 @@
 
 #include <horizon/types.h>
 #include <horizon/list.h>
+#include <horizon/rbtree.h>
+#include <horizon/atomic.h>
+#include <horizon/spinlock.h>
 #include <horizon/signal.h>
 #include <horizon/thread_context.h>
 
@@ -47,6 +50,14 @@
 #define THREAD_SCHED_IDLE         4   /* Idle scheduling */
 #define THREAD_SCHED_DEADLINE     5   /* Deadline scheduling */
 
+/* Thread CPU affinity */
+#define THREAD_CPUS_ALL           (~0ULL) /* May run on any CPU */
+
+/* Forward declarations */
+struct run_queue;
+struct prio_array;
+struct rt_mutex_waiter;
+
 /* Thread structure */
 typedef struct thread {
     /* Thread identification */
@@ -69,6 +80,8 @@ typedef struct thread {
     u64 system_time;                /* System time */
     u32 cpu;                        /* CPU */
     u32 on_cpu;                     /* On CPU */
+    u64 cpus_allowed;               /* Mask of CPUs the thread may run on */
+    u64 last_ran;                   /* Timestamp the thread last left a CPU */
 
     /* Thread context */
     void *kernel_stack;             /* Kernel stack */
@@ -78,6 +91,12 @@ typedef struct thread {
 
     /* Thread synchronization */
     void *blocked_on;               /* Object thread is blocked on */
+    struct thread *wake_next;       /* Next thread in a deferred wakeup list */
+    spinlock_t pi_lock;             /* Protects pi_waiters and pi_blocked_on */
+    struct rt_mutex_waiter *pi_blocked_on; /* rt_mutex waiter the thread is blocked on */
+    rb_root_t pi_waiters;           /* Top waiters of the rt_mutexes held, by priority */
+    int pi_prio;                    /* Inherited priority, valid while pi_boosted */
+    int pi_boosted;                 /* Running at an inherited priority */
     u64 wakeup_time;                /* Wakeup time */
 
     /* Thread signals */
@@ -90,6 +109,20 @@ typedef struct thread {
     list_head_t process_threads;    /* Process threads */
     struct thread *next;            /* Next thread in run queue */
     struct thread *prev;            /* Previous thread in run queue */
+    list_head_t sched_list;         /* Entry in a priority array queue */
+    struct prio_array *array;       /* Priority array the thread is queued on */
+    struct run_queue *rq;           /* Run queue the thread is queued on */
+    int sched_prio;                 /* Queue index while queued */
+    rb_node_t fair_node;            /* Node in the fair timeline */
+    int fair_on_rq;                 /* Queued in the fair class */
+    int nice;                       /* Nice level */
+    unsigned long load_weight;      /* Load weight from the nice level */
+    u64 vruntime;                   /* Weighted virtual runtime */
+    u64 exec_start;                 /* Start of the current accounting period */
+    u64 sum_exec_runtime;           /* Total time spent running */
+    u64 prev_sum_exec_runtime;      /* sum_exec_runtime when last picked */
+    rb_node_t sleep_node;           /* Node in the sleeper tree */
+    struct run_queue *sleep_rq;     /* Run queue whose sleeper tree holds the thread */
 
     /* Thread function */
     void *(*start_routine)(void *); /* Thread function */
@@ -106,6 +139,9 @@ typedef struct thread {
 
     /* Thread owner */
     struct task_struct *task;       /* Owner task */
+
+    /* Thread lifetime */
+    atomic_t usage;                 /* References, freed when the last is dropped */
 } thread_t;
 
 /* Thread functions */
@@ -117,6 +153,11 @@ int thread_detach(thread_t *thread);
 int thread_cancel(thread_t *thread);
 int thread_exit(void *retval);
 thread_t *thread_self(void);
+void thread_register(thread_t *thread);
+void thread_unregister(thread_t *thread);
+thread_t *thread_find(tid_t tid);
+void thread_get(thread_t *thread);
+void thread_put(thread_t *thread);
 int thread_yield(void);
 int thread_sleep(u64 ms);
 int thread_wakeup(thread_t *thread);
@@ -63,6 +63,51 @@ struct timeval {
     suseconds_t tv_usec;        /* Microseconds */
 };
 
+/* Nanoseconds, the kernel's internal time format */
+typedef s64 ktime_t;
+
+/* Time unit conversions */
+#define NSEC_PER_USEC           1000LL
+#define NSEC_PER_MSEC           1000000LL
+#define NSEC_PER_SEC            1000000000LL
+#define KTIME_MAX               ((ktime_t)(~0ULL >> 1))
+
+/**
+ * Make a ktime from seconds and nanoseconds
+ *
+ * @param secs Seconds
+ * @param nsecs Nanoseconds
+ * @return Time in nanoseconds
+ */
+static inline ktime_t ktime_set(s64 secs, unsigned long nsecs) {
+    return secs * NSEC_PER_SEC + (s64)nsecs;
+}
+
+/**
+ * Convert a timespec to a ktime
+ *
+ * @param ts Time
+ * @return Time in nanoseconds
+ */
+static inline ktime_t timespec_to_ktime(const struct timespec *ts) {
+    return ktime_set(ts->tv_sec, ts->tv_nsec);
+}
+
+/**
+ * Convert a non-negative ktime to a timespec
+ *
+ * @param kt Time in nanoseconds
+ * @return Time
+ */
+static inline struct timespec ktime_to_timespec(ktime_t kt) {
+    struct timespec ts;
+
+    ts.tv_sec = (time_t)((u64)kt / NSEC_PER_SEC);
+    ts.tv_nsec = (long)((u64)kt % NSEC_PER_SEC);
+
+    return ts;
+}
+
 struct timezone {
     int tz_minuteswest;         /* Minutes west of Greenwich */
     int tz_dsttime;             /* Type of DST correction */
@@ -104,6 +149,11 @@ struct timex {
     int:32; int:32; int:32;
 };
 
+/* Timekeeping functions */
+ktime_t ktime_get(void);
+ktime_t ktime_get_real(void);
+void ktime_set_real(ktime_t now);
+
 /* Time functions */
 time_t time_get(void);
 int time_set(time_t t);
@@ -11,6 +11,9 @@
 #include <horizon/types.h>
 #include <horizon/list.h>
 #include <horizon/time.h>
+#include <horizon/config.h>
+#include <horizon/spinlock.h>
+#include <horizon/rbtree.h>
 
 /* Timer ID type */
 typedef u32 timer_id_t;
@@ -30,64 +33,122 @@ typedef void (*timer_callback_t)(timer_id_t id, void *data);
 #define TIMER_FLAG_HIGH_RES    0x00000100  /* Timer is high resolution */
 #define TIMER_FLAG_NO_REQUEUE  0x00000200  /* Timer should not be requeued */
 
+/*
+ * Timer wheel geometry. The first level has a bucket per jiffy for the
+ * next TVR_SIZE jiffies, each further level a bucket per TVN_SIZE buckets
+ * of the level below. Five levels cover the whole unsigned long range.
+ */
+#define TVN_BITS        6
+#define TVR_BITS        8
+#define TVN_SIZE        (1 << TVN_BITS)
+#define TVR_SIZE        (1 << TVR_BITS)
+#define TVN_MASK        (TVN_SIZE - 1)
+#define TVR_MASK        (TVR_SIZE - 1)
+#define TVN_LEVELS      4
+
 /* Timer list */
 typedef struct timer_list {
-    struct list_head entry;        /* List entry */
-    unsigned long expires;         /* Expiration time */
+    struct list_head entry;        /* Bucket entry, next is NULL when not pending */
+    unsigned long expires;         /* Expiration time in jiffies */
     void (*function)(unsigned long);  /* Timer function */
     unsigned long data;            /* Timer data */
-    unsigned int flags;            /* Timer flags */
-    struct timer_base *base;       /* Timer base */
+    unsigned int flags;            /* TIMER_FLAG_DEFERRABLE, TIMER_FLAG_PINNED */
+    long slack;                    /* Jiffies the expiry may be rounded up by, -1 for automatic */
+    struct timer_base *base;       /* Timer base, NULL while moving between bases */
 } timer_list_t;
 
-/* Timer base */
+/* Timer base, one timer wheel per CPU */
 typedef struct timer_base {
     spinlock_t lock;               /* Base lock */
-    struct list_head timers;       /* List of timers */
-    unsigned long next_expiry;     /* Next expiry */
-    unsigned int active_timers;    /* Number of active timers */
-    unsigned int shutdown;         /* Shutdown flag */
+    struct timer_list *running_timer; /* Timer whose function is running */
+    unsigned long timer_jiffies;   /* Next jiffy to process */
+    unsigned int active_timers;    /* Number of pending timers */
+    unsigned int shutdown;         /* CPU is offline, timers go elsewhere */
+    int cpu;                       /* Owning CPU */
+    u64 nr_expired;                /* Timers run */
+    u64 nr_cascaded;               /* Timers moved down a level */
+    struct list_head tv1[TVR_SIZE];             /* Next TVR_SIZE jiffies */
+    struct list_head tvn[TVN_LEVELS][TVN_SIZE]; /* Further out, coarser */
 } timer_base_t;
 
+/* Set up a timer whose function takes the timer itself */
+#define timer_setup(timer, callback, timer_flags) \
+    do { \
+        setup_timer((timer), (void (*)(unsigned long))(callback), (unsigned long)(timer)); \
+        (timer)->flags |= (timer_flags); \
+    } while (0)
+
+/* High resolution timer clock bases */
+#define HRTIMER_BASE_MONOTONIC  0
+#define HRTIMER_BASE_REALTIME   1
+#define HRTIMER_MAX_CLOCK_BASES 2
+
+/* High resolution timer states */
+#define HRTIMER_STATE_INACTIVE  0x00  /* Timer is not queued */
+#define HRTIMER_STATE_ENQUEUED  0x01  /* Timer is queued on a base */
+
+/* Rounds of expired timers an interrupt runs before it gives up */
+#define HRTIMER_MAX_RETRIES     3
+
+/* High resolution timer modes */
+enum hrtimer_mode {
+    HRTIMER_MODE_ABS = 0x0,        /* Expiry is absolute */
+    HRTIMER_MODE_REL = 0x1,        /* Expiry is relative to now */
+    HRTIMER_MODE_PINNED = 0x2,     /* Timer stays on its CPU */
+    HRTIMER_MODE_ABS_PINNED = 0x2,
+    HRTIMER_MODE_REL_PINNED = 0x3,
+};
+
+/* High resolution timer restart values */
+enum hrtimer_restart {
+    HRTIMER_NORESTART,             /* Timer is not restarted */
+    HRTIMER_RESTART,               /* Timer is restarted */
+};
+
 /* High resolution timer */
 typedef struct hrtimer {
-    struct rb_node node;           /* Red-black tree node */
-    ktime_t expires;               /* Expiration time */
+    struct rb_node node;           /* Red-black tree node, sorted by expires */
+    ktime_t expires;               /* Latest expiry, in nanoseconds of the base's clock */
+    ktime_t softexpires;           /* Earliest expiry, expires minus the range */
     enum hrtimer_restart (*function)(struct hrtimer *);  /* Timer function */
-    struct hrtimer_clock_base *base;  /* Timer base */
-    unsigned long state;           /* Timer state */
-    unsigned int is_rel;           /* Is relative */
-    unsigned int is_soft;          /* Is soft */
-    unsigned int is_hard;          /* Is hard */
+    struct hrtimer_clock_base *base;  /* Timer base, NULL while moving between bases */
+    unsigned long state;           /* HRTIMER_STATE_* */
+    unsigned int is_rel;           /* Was started relative to now */
+    unsigned int is_pinned;        /* Stays on the CPU it was first started on */
 } hrtimer_t;
 
-/* High resolution timer clock base */
+/* High resolution timer clock base, one per clock and CPU */
 typedef struct hrtimer_clock_base {
     struct hrtimer_cpu_base *cpu_base;  /* CPU base */
     int index;                     /* Base index */
     clockid_t clockid;             /* Clock ID */
-    struct rb_root active;         /* Active timers */
-    struct rb_node *first;         /* First timer */
-    ktime_t resolution;            /* Base resolution */
-    ktime_t softirq_time;          /* Softirq time */
-    ktime_t offset;                /* Base offset */
+    struct rb_root active;         /* Queued timers */
+    struct rb_node *first;         /* Timer expiring first, cached */
+    ktime_t (*get_time)(void);     /* Read the clock */
 } hrtimer_clock_base_t;
 
 /* High resolution timer CPU base */
 typedef struct hrtimer_cpu_base {
-    raw_spinlock_t lock;           /* Base lock */
-    unsigned int active_bases;     /* Active bases */
-    unsigned int clock_was_set;    /* Clock was set */
-    unsigned int hres_active;      /* High resolution active */
-    unsigned int hang_detected;    /* Hang detected */
-    unsigned int nr_events;        /* Number of events */
-    unsigned int nr_retries;       /* Number of retries */
-    unsigned int nr_hangs;         /* Number of hangs */
-    unsigned int max_hang_time;    /* Maximum hang time */
-    ktime_t expires_next;          /* Next expiration */
+    spinlock_t lock;               /* Base lock */
+    int cpu;                       /* Owning CPU */
+    struct hrtimer *running;       /* Timer whose function is running */
+    unsigned int active_bases;     /* Bitmask of bases with queued timers */
+    unsigned int hres_active;      /* Driven by the one-shot clock event */
+    unsigned int hang_detected;    /* Last interrupt ran out of retries */
+    unsigned int nr_events;        /* Interrupts handled */
+    unsigned int nr_retries;       /* Rounds repeated as timers expired meanwhile */
+    unsigned int nr_hangs;         /* Interrupts that gave up */
+    u64 nr_expired;                /* Timers run */
+    ktime_t expires_next;          /* Time the clock event is programmed for */
     struct hrtimer_clock_base clock_base[HRTIMER_MAX_CLOCK_BASES];  /* Clock bases */
 } hrtimer_cpu_base_t;
 
+/* Sleeper woken by a high resolution timer */
+typedef struct hrtimer_sleeper {
+    struct hrtimer timer;          /* Timer */
+    struct thread *task;           /* Sleeping thread, NULL once woken */
+} hrtimer_sleeper_t;
+
 /* Timer information structure */
 typedef struct timer_info {
     timer_id_t id;              /* Timer ID */
@@ -96,19 +157,19 @@ typedef struct timer_info {
     u32 flags;                  /* Timer flags */
 } timer_info_t;
 
-/* High resolution timer restart values */
-enum hrtimer_restart {
-    HRTIMER_NORESTART,             /* Timer is not restarted */
-    HRTIMER_RESTART,               /* Timer is restarted */
-};
-
 /* Timer functions */
 void timer_init(void);
 void init_timer(struct timer_list *timer);
 void add_timer(struct timer_list *timer);
 int del_timer(struct timer_list *timer);
 int mod_timer(struct timer_list *timer, unsigned long expires);
+int del_timer_sync(struct timer_list *timer);
+void add_timer_on(struct timer_list *timer, int cpu);
+void set_timer_slack(struct timer_list *timer, long slack_jiffies);
 int timer_pending(const struct timer_list *timer);
+unsigned long timer_next_expiry(void);
+void timer_migrate_cpu(int cpu, int target);
+void timer_print_stats(void);
 void setup_timer(struct timer_list *timer, void (*function)(unsigned long), unsigned long data);
 void setup_timer_on_stack(struct timer_list *timer, void (*function)(unsigned long), unsigned long data);
 void destroy_timer_on_stack(struct timer_list *timer);
@@ -137,42 +198,59 @@ void timer_msleep(u64 msec);
 void timer_usleep(u64 usec);
 void timer_nsleep(u64 nsec);
 void timer_sleep_until(u64 timeout);
+void timer_account_ticks(u64 ticks);
+
+/* Architecture timer functions */
+void arch_timer_init(u32 frequency);
+void arch_timer_start(void);
+void arch_timer_stop(void);
+u64 arch_timer_read(void);
+void arch_timer_set_frequency(u32 frequency);
+u32 arch_timer_get_frequency(void);
+u32 arch_timer_set_oneshot(u32 ticks);
+u32 arch_timer_cancel_oneshot(void);
+void arch_clocksource_init(void);
+int arch_clockevent_program(u64 delta_ns);
 
 /* High resolution timer functions */
+void hrtimers_init(void);
 void hrtimer_init(struct hrtimer *timer, clockid_t clock_id, enum hrtimer_mode mode);
 int hrtimer_start(struct hrtimer *timer, ktime_t tim, const enum hrtimer_mode mode);
+int hrtimer_start_range_ns(struct hrtimer *timer, ktime_t tim, u64 range_ns, const enum hrtimer_mode mode);
 int hrtimer_cancel(struct hrtimer *timer);
 int hrtimer_try_to_cancel(struct hrtimer *timer);
-int hrtimer_restart(struct hrtimer *timer);
 ktime_t hrtimer_get_remaining(const struct hrtimer *timer);
 int hrtimer_get_res(const clockid_t which_clock, struct timespec *tp);
 int hrtimer_is_queued(struct hrtimer *timer);
 int hrtimer_active(const struct hrtimer *timer);
 int hrtimer_is_hres_active(struct hrtimer *timer);
 int hrtimer_callback_running(struct hrtimer *timer);
-int hrtimer_start_range_ns(struct hrtimer *timer, ktime_t tim, u64 range_ns, const enum hrtimer_mode mode);
-void hrtimer_init_sleeper(struct hrtimer_sleeper *sl, struct task_struct *task);
+void hrtimer_init_sleeper(struct hrtimer_sleeper *sl, struct thread *task);
 void hrtimer_set_expires(struct hrtimer *timer, ktime_t time);
 void hrtimer_set_expires_range_ns(struct hrtimer *timer, ktime_t time, u64 range_ns);
-void hrtimer_set_expires_tv64(struct hrtimer *timer, s64 time);
-void hrtimer_add_expires(struct hrtimer *timer, ktime_t time);
 void hrtimer_add_expires_ns(struct hrtimer *timer, u64 ns);
-void hrtimer_forward(struct hrtimer *timer, ktime_t now, ktime_t interval);
+u64 hrtimer_forward(struct hrtimer *timer, ktime_t now, ktime_t interval);
 u64 hrtimer_forward_now(struct hrtimer *timer, ktime_t interval);
-ktime_t hrtimer_expires_remaining(const struct hrtimer *timer);
 ktime_t hrtimer_cb_get_time(struct hrtimer *timer);
+void hrtimer_interrupt(void);
+void hrtimer_run_queues(void);
+ktime_t hrtimer_get_next_event(void);
+void hrtimer_switch_to_hres(void);
+void hrtimer_print_stats(void);
+int hrtimer_nanosleep(clockid_t clockid, ktime_t expires, const enum hrtimer_mode mode, ktime_t *remaining);
 int schedule_hrtimeout(ktime_t *expires, const enum hrtimer_mode mode);
 int schedule_hrtimeout_range(ktime_t *expires, u64 delta, const enum hrtimer_mode mode);
+int schedule_hrtimeout_range_unlock(ktime_t *expires, u64 delta, const enum hrtimer_mode mode, spinlock_t *lock);
 long schedule_timeout(long timeout);
 long schedule_timeout_interruptible(long timeout);
 long schedule_timeout_killable(long timeout);
 long schedule_timeout_uninterruptible(long timeout);
 
 /* Timer bases */
-extern struct timer_base timer_bases[NR_CPUS];
+extern struct timer_base timer_bases[CONFIG_NR_CPUS];
 
 /* High resolution timer bases */
-extern struct hrtimer_cpu_base hrtimer_bases[NR_CPUS];
+extern struct hrtimer_cpu_base hrtimer_bases[CONFIG_NR_CPUS];
 
 /* System timer */
 extern struct timer_list system_timer;
@@ -56,6 +56,12 @@ typedef enum {
 #define IPI_CALL_FUNC   2
 #define IPI_STOP        3
 
+/* RCU callback, embedded in objects freed after a grace period */
+struct rcu_head {
+    struct rcu_head *next;                  /* Next queued callback */
+    void (*func)(struct rcu_head *head);    /* Called after the grace period */
+};
+
 /* Seek constants */
 #define SEEK_SET        0
 #define SEEK_CUR        1
@@ -0,0 +1,79 @@
+/**
+ * vdso.h - Horizon kernel virtual dynamic shared object definitions
+ *
+ * This file contains definitions for the vDSO, two pages meant to be mapped
+ * read-only into every process. The data page holds a snapshot of the
+ * timekeeping that the kernel republishes every tick. The text page holds
+ * code that reads the snapshot and the TSC, so a process can get the
+ * monotonic and real time without a system call once the pages are mapped.
+ * Until vmm_map_page() fills in page tables, they are only reserved.
+ *
+ * Both pages sit at fixed addresses just below the kernel, unless the
+ * program has a segment there. A process finds the entry points as offsets
+ * from VDSO_TEXT_ADDR in the data page.
+ */
+
+#ifndef _HORIZON_VDSO_H
+#define _HORIZON_VDSO_H
+
+#include <horizon/types.h>
+#include <horizon/time.h>
+#include <horizon/seqlock.h>
+
+/* Where the vDSO is reserved in every process */
+#define VDSO_DATA_ADDR      0xBFFFE000UL
+#define VDSO_TEXT_ADDR      0xBFFFF000UL
+
+/* Layout version, bumped when struct vdso_data changes */
+#define VDSO_VERSION        1
+
+/* How the user code reads the clock */
+#define VDSO_CLOCK_NONE     0   /* Not readable from user mode, use the system call */
+#define VDSO_CLOCK_TSC      1   /* Read the TSC */
+
+/*
+ * Timekeeping snapshot, shared with user mode. The times at cycle_last are
+ * kept split in seconds and nanoseconds, so the user code adds the cycles
+ * since then without a 64-bit division.
+ */
+struct vdso_data {
+    seqcount_t seq;                /* Odd while the kernel updates the page */
+    u32 version;                   /* VDSO_VERSION */
+    u32 clock_mode;                /* VDSO_CLOCK_* */
+    u32 mult;                      /* Nanoseconds = (cycles * mult) >> shift */
+    u32 shift;
+    u64 cycle_last;                /* Clock source cycles at the last update */
+    u64 mask;                      /* Bits the counter has */
+    s64 mono_sec;                  /* Monotonic time at cycle_last */
+    s64 real_sec;                  /* Real time at cycle_last */
+    u32 mono_nsec;
+    u32 real_nsec;
+
+    /* Entry points, as offsets from VDSO_TEXT_ADDR */
+    u32 clock_gettime_offset;      /* int (clockid_t, struct timespec *) */
+    u32 gettimeofday_offset;       /* int (struct timeval *, struct timezone *) */
+    u32 time_offset;               /* time_t (time_t *) */
+};
+
+struct mm_struct;
+struct clocksource;
+
+/* Page the kernel writes the snapshot to, NULL before vdso_init() */
+extern struct vdso_data *vdso_data;
+
+/*
+ * User code, in the .vdso.text section. The section is copied to the text
+ * page as is, so the code must not call or reference anything outside it.
+ */
+extern char __vdso_text_start[];
+extern char __vdso_text_end[];
+int __vdso_clock_gettime(clockid_t clock, struct timespec *ts);
+int __vdso_gettimeofday(struct timeval *tv, struct timezone *tz);
+time_t __vdso_time(time_t *t);
+
+/* vDSO functions */
+void vdso_init(void);
+void vdso_update(struct clocksource *cs, u64 cycle_last, ktime_t mono, ktime_t real_offset);
+int vdso_map(struct mm_struct *mm);
+
+#endif /* _HORIZON_VDSO_H */
@@ -74,6 +74,7 @@ vm_context_t *vmm_create_context(void);
 void vmm_destroy_context(vm_context_t *context);
 void vmm_switch_context(vm_context_t *context);
 vm_context_t *vmm_get_current_context(void);
+vm_context_t *vmm_get_kernel_context(void);
 void *vmm_alloc_pages(vm_context_t *context, void *addr, u32 count, u32 flags);
 void vmm_free_pages(vm_context_t *context, void *addr, u32 count);
 int vmm_map_page(vm_context_t *context, void *virt, void *phys, u32 flags);
@@ -20,6 +20,7 @@
 #include <horizon/usb.h>
 #include <horizon/block.h>
 #include <horizon/crypto.h>
+#include <horizon/rcupdate.h>
 
 /* External functions */
 extern void capability_init(void);
@@ -65,6 +66,10 @@ void kernel_init(void) {
     early_console_print("Initializing scheduler...\n");
     sched_init();
 
+    /* Initialize RCU */
+    early_console_print("Initializing RCU...\n");
+    rcu_init();
+
     /* Initialize system calls */
     early_console_print("Initializing system calls...\n");
     syscall_init();
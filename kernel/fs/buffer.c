@@ -0,0 +1,504 @@
+/**
+ * buffer.c - Horizon kernel block buffer cache implementation
+ *
+ * This file contains the implementation of the buffer cache. A single lock
+ * protects the hash table, the LRU list, the reference counts and the
+ * statistics. It is never held across I/O; a buffer's own lock serializes
+ * its reads, write-backs and the updates of its data.
+ */
+
+#include <horizon/kernel.h>
+#include <horizon/types.h>
+#include <horizon/fs/buffer.h>
+#include <horizon/mm.h>
+#include <horizon/spinlock.h>
+#include <horizon/string.h>
+#include <horizon/printk.h>
+#include <horizon/errno.h>
+
+/* Define NULL if not defined */
+#ifndef NULL
+#define NULL ((void *)0)
+#endif
+
+/* Device I/O, the buffer cache is the only user left in the file systems */
+extern ssize_t device_read(void *dev, void *buffer, size_t size, u64 offset);
+extern ssize_t device_write(void *dev, const void *buffer, size_t size, u64 offset);
+
+/* Buffers looked at by one pass of the shrinker before it gives up */
+#define BUFFER_SHRINK_SCAN  32
+
+/* Hash table */
+static list_head_t buffer_hash[BUFFER_HASH_SIZE];
+
+/* Unused buffers, least recently used first */
+static list_head_t buffer_lru = LIST_HEAD_INIT(buffer_lru);
+
+/* Statistics, also holding the buffer counts and the limit */
+static buffer_cache_stats_t buffer_stats = { .max_buffers = BUFFER_CACHE_MAX };
+
+/* Buffer cache lock */
+static spinlock_t buffer_lock = SPIN_LOCK_INITIALIZER;
+
+/**
+ * Hash a device and block number
+ *
+ * @param bdev Block device
+ * @param block Block number
+ * @return Hash bucket
+ */
+static inline list_head_t *buffer_hashfn(void *bdev, u32 block) {
+    unsigned long key = ((unsigned long)bdev >> 4) ^ (block * 0x9E3779B1U);
+
+    return &buffer_hash[(key ^ (key >> 16)) & (BUFFER_HASH_SIZE - 1)];
+}
+
+/**
+ * Initialize the buffer cache
+ */
+void buffer_cache_init(void) {
+    for (int i = 0; i < BUFFER_HASH_SIZE; i++) {
+        list_init(&buffer_hash[i]);
+    }
+
+    printk(KERN_INFO "BUFFER: Initialized buffer cache, %u buffers max\n",
+           buffer_stats.max_buffers);
+}
+
+/**
+ * Set the limit on the number of cached buffers
+ *
+ * Buffers in use are never dropped, so the cache can grow past the limit
+ * while they are held. A lower limit is reached as buffers are released.
+ *
+ * @param max_buffers New limit
+ */
+void buffer_cache_set_max(u32 max_buffers) {
+    spin_lock(&buffer_lock);
+    buffer_stats.max_buffers = max_buffers > 0 ? max_buffers : 1;
+    spin_unlock(&buffer_lock);
+}
+
+/**
+ * Find a buffer and take a reference to it
+ *
+ * The caller must hold the cache lock.
+ *
+ * @param bdev Block device
+ * @param block Block number
+ * @param size Block size
+ * @return Buffer head, or NULL if not cached
+ */
+static buffer_head_t *buffer_lookup(void *bdev, u32 block, u32 size) {
+    list_head_t *bucket = buffer_hashfn(bdev, block);
+    buffer_head_t *bh;
+
+    list_for_each_entry(bh, bucket, b_hash) {
+        if (bh->b_bdev == bdev && bh->b_blocknr == block && bh->b_size == size) {
+            if (bh->b_count++ == 0) {
+                list_del_init(&bh->b_lru);
+            }
+            return bh;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Free a buffer that is no longer in the cache
+ *
+ * @param bh Buffer head
+ */
+static void buffer_free(buffer_head_t *bh) {
+    mutex_destroy(&bh->b_lock);
+    kfree(bh->b_data);
+    kfree(bh);
+}
+
+/**
+ * Set or clear the dirty bit and keep the dirty count
+ *
+ * The caller must hold the cache lock.
+ *
+ * @param bh Buffer head
+ * @param dirty Nonzero to set the bit, zero to clear it
+ * @return Nonzero if the bit was set before
+ */
+static int buffer_set_dirty(buffer_head_t *bh, int dirty) {
+    int was_dirty = buffer_dirty(bh);
+
+    if (dirty && !was_dirty) {
+        __sync_fetch_and_or(&bh->b_state, BH_DIRTY);
+        buffer_stats.nr_dirty++;
+    } else if (!dirty && was_dirty) {
+        __sync_fetch_and_and(&bh->b_state, ~BH_DIRTY);
+        buffer_stats.nr_dirty--;
+    }
+
+    return was_dirty;
+}
+
+/**
+ * Write a buffer back to its device
+ *
+ * The caller must hold the buffer lock.
+ *
+ * @param bh Buffer head
+ * @return 0 on success, negative error code on failure
+ */
+static int buffer_write(buffer_head_t *bh) {
+    u64 offset = (u64)bh->b_blocknr * bh->b_size;
+    ssize_t ret;
+
+    /* Cleaned first, an update while the data is written dirties it again */
+    spin_lock(&buffer_lock);
+    if (!buffer_set_dirty(bh, 0)) {
+        spin_unlock(&buffer_lock);
+        return 0;
+    }
+    buffer_stats.writes++;
+    spin_unlock(&buffer_lock);
+
+    ret = device_write(bh->b_bdev, bh->b_data, bh->b_size, offset);
+
+    if (ret != (ssize_t)bh->b_size) {
+        printk(KERN_ERR "BUFFER: Failed to write block %u\n", bh->b_blocknr);
+        spin_lock(&buffer_lock);
+        buffer_set_dirty(bh, 1);
+        spin_unlock(&buffer_lock);
+        return -EIO;
+    }
+
+    return 0;
+}
+
+/**
+ * Drop unused buffers until the cache is within its limit
+ *
+ * Clean buffers are dropped from the cold end of the LRU list. A dirty one
+ * is written back first and then goes to the hot end, where it is dropped
+ * on a later pass.
+ */
+static void buffer_shrink(void) {
+    for (int scanned = 0; scanned < BUFFER_SHRINK_SCAN; scanned++) {
+        buffer_head_t *bh;
+
+        spin_lock(&buffer_lock);
+
+        if (buffer_stats.nr_buffers <= buffer_stats.max_buffers || list_empty(&buffer_lru)) {
+            spin_unlock(&buffer_lock);
+            return;
+        }
+
+        bh = list_first_entry(&buffer_lru, buffer_head_t, b_lru);
+
+        if (buffer_dirty(bh)) {
+            /* Hold it across the write-back so that it stays cached */
+            bh->b_count++;
+            list_del_init(&bh->b_lru);
+            spin_unlock(&buffer_lock);
+
+            sync_dirty_buffer(bh);
+            brelse(bh);
+            continue;
+        }
+
+        list_del(&bh->b_hash);
+        list_del(&bh->b_lru);
+        buffer_stats.nr_buffers--;
+        buffer_stats.evictions++;
+
+        spin_unlock(&buffer_lock);
+
+        buffer_free(bh);
+    }
+}
+
+/**
+ * Get the buffer of a block, without reading it
+ *
+ * The buffer is not up to date unless it was cached already. Callers that
+ * overwrite the whole block can fill it and mark it up to date and dirty.
+ *
+ * @param bdev Block device
+ * @param block Block number
+ * @param size Block size
+ * @return Buffer head with a reference, or NULL on failure
+ */
+buffer_head_t *getblk(void *bdev, u32 block, u32 size) {
+    buffer_head_t *bh;
+    buffer_head_t *new;
+
+    spin_lock(&buffer_lock);
+    bh = buffer_lookup(bdev, block, size);
+    if (bh != NULL) {
+        buffer_stats.hits++;
+        spin_unlock(&buffer_lock);
+        return bh;
+    }
+    spin_unlock(&buffer_lock);
+
+    /* Allocated unlocked, then added unless someone else was faster */
+    new = kmalloc(sizeof(buffer_head_t), 0);
+    if (new == NULL) {
+        return NULL;
+    }
+
+    new->b_data = kmalloc(size, 0);
+    if (new->b_data == NULL) {
+        kfree(new);
+        return NULL;
+    }
+
+    new->b_bdev = bdev;
+    new->b_blocknr = block;
+    new->b_size = size;
+    new->b_count = 1;
+    new->b_state = 0;
+    list_init(&new->b_lru);
+    mutex_init(&new->b_lock);
+
+    spin_lock(&buffer_lock);
+
+    bh = buffer_lookup(bdev, block, size);
+    if (bh != NULL) {
+        buffer_stats.hits++;
+        spin_unlock(&buffer_lock);
+        buffer_free(new);
+        return bh;
+    }
+
+    list_add(&new->b_hash, buffer_hashfn(bdev, block));
+    buffer_stats.nr_buffers++;
+    buffer_stats.misses++;
+
+    spin_unlock(&buffer_lock);
+
+    buffer_shrink();
+
+    return new;
+}
+
+/**
+ * Get the buffer of a block, reading it if it is not cached
+ *
+ * @param bdev Block device
+ * @param block Block number
+ * @param size Block size
+ * @return Up to date buffer head with a reference, or NULL on failure
+ */
+buffer_head_t *bread(void *bdev, u32 block, u32 size) {
+    buffer_head_t *bh = getblk(bdev, block, size);
+    ssize_t ret;
+
+    if (bh == NULL || buffer_uptodate(bh)) {
+        return bh;
+    }
+
+    lock_buffer(bh);
+
+    /* Someone else may have read it while we waited */
+    if (!buffer_uptodate(bh)) {
+        ret = device_read(bdev, bh->b_data, size, (u64)block * size);
+
+        if (ret != (ssize_t)size) {
+            unlock_buffer(bh);
+            brelse(bh);
+            printk(KERN_ERR "BUFFER: Failed to read block %u\n", block);
+            return NULL;
+        }
+
+        __sync_fetch_and_or(&bh->b_state, BH_UPTODATE);
+
+        spin_lock(&buffer_lock);
+        buffer_stats.reads++;
+        spin_unlock(&buffer_lock);
+    }
+
+    unlock_buffer(bh);
+
+    return bh;
+}
+
+/**
+ * Release a reference to a buffer
+ *
+ * The last reference puts the buffer on the hot end of the LRU list.
+ *
+ * @param bh Buffer head, may be NULL
+ */
+void brelse(buffer_head_t *bh) {
+    if (bh == NULL) {
+        return;
+    }
+
+    spin_lock(&buffer_lock);
+
+    if (bh->b_count <= 0) {
+        spin_unlock(&buffer_lock);
+        printk(KERN_WARNING "BUFFER: Release of unused block %u\n", bh->b_blocknr);
+        return;
+    }
+
+    if (--bh->b_count == 0) {
+        list_add_tail(&bh->b_lru, &buffer_lru);
+    }
+
+    spin_unlock(&buffer_lock);
+}
+
+/**
+ * Mark a buffer as up to date and dirty
+ *
+ * @param bh Buffer head
+ */
+void mark_buffer_dirty(buffer_head_t *bh) {
+    __sync_fetch_and_or(&bh->b_state, BH_UPTODATE);
+
+    spin_lock(&buffer_lock);
+    buffer_set_dirty(bh, 1);
+    spin_unlock(&buffer_lock);
+}
+
+/**
+ * Write a buffer back now if it is dirty
+ *
+ * @param bh Buffer head
+ * @return 0 on success, negative error code on failure
+ */
+int sync_dirty_buffer(buffer_head_t *bh) {
+    int ret;
+
+    lock_buffer(bh);
+    ret = buffer_write(bh);
+    unlock_buffer(bh);
+
+    return ret;
+}
+
+/**
+ * Write back every dirty buffer of a device
+ *
+ * @param bdev Block device
+ * @return 0 on success, the first error otherwise
+ */
+int sync_blockdev(void *bdev) {
+    int err = 0;
+
+    for (int i = 0; i < BUFFER_HASH_SIZE; i++) {
+        buffer_head_t *bh;
+
+        spin_lock(&buffer_lock);
+
+restart:
+        list_for_each_entry(bh, &buffer_hash[i], b_hash) {
+            if (bh->b_bdev != bdev || !buffer_dirty(bh)) {
+                continue;
+            }
+
+            if (bh->b_count++ == 0) {
+                list_del_init(&bh->b_lru);
+            }
+            spin_unlock(&buffer_lock);
+
+            int ret = sync_dirty_buffer(bh);
+            if (ret < 0 && err == 0) {
+                err = ret;
+            }
+
+            brelse(bh);
+
+            /* The bucket may have changed, a written buffer is skipped now */
+            spin_lock(&buffer_lock);
+            if (ret < 0) {
+                break;
+            }
+            goto restart;
+        }
+
+        spin_unlock(&buffer_lock);
+    }
+
+    return err;
+}
+
+/**
+ * Drop the unused buffers of a device
+ *
+ * Called when a device goes away, after its buffers were synced. Dirty
+ * buffers are dropped without writing them back.
+ *
+ * @param bdev Block device
+ */
+void invalidate_bdev(void *bdev) {
+    u32 busy = 0;
+
+    for (int i = 0; i < BUFFER_HASH_SIZE; i++) {
+        buffer_head_t *bh;
+        buffer_head_t *next;
+
+        spin_lock(&buffer_lock);
+
+        list_for_each_entry_safe(bh, next, &buffer_hash[i], b_hash) {
+            if (bh->b_bdev != bdev) {
+                continue;
+            }
+
+            if (bh->b_count > 0) {
+                busy++;
+                continue;
+            }
+
+            buffer_set_dirty(bh, 0);
+            list_del(&bh->b_hash);
+            list_del(&bh->b_lru);
+            buffer_stats.nr_buffers--;
+
+            /* Nothing can find it any more */
+            spin_unlock(&buffer_lock);
+            buffer_free(bh);
+            spin_lock(&buffer_lock);
+        }
+
+        spin_unlock(&buffer_lock);
+    }
+
+    if (busy > 0) {
+        printk(KERN_WARNING "BUFFER: %u buffers still in use on invalidation\n", busy);
+    }
+}
+
+/**
+ * Get the buffer cache statistics
+ *
+ * @param stats Set to the statistics
+ */
+void buffer_cache_get_stats(buffer_cache_stats_t *stats) {
+    if (stats != NULL) {
+        spin_lock(&buffer_lock);
+        *stats = buffer_stats;
+        spin_unlock(&buffer_lock);
+    }
+}
+
+/**
+ * Print the buffer cache statistics
+ */
+void buffer_cache_print_stats(void) {
+    buffer_cache_stats_t stats;
+    u64 lookups;
+
+    buffer_cache_get_stats(&stats);
+    lookups = stats.hits + stats.misses;
+
+    printk(KERN_INFO "BUFFER: Hits: %llu\n", stats.hits);
+    printk(KERN_INFO "BUFFER: Misses: %llu\n", stats.misses);
+    printk(KERN_INFO "BUFFER: Hit rate: %u%%\n",
+           lookups > 0 ? (u32)(stats.hits * 100 / lookups) : 0);
+    printk(KERN_INFO "BUFFER: Evictions: %llu\n", stats.evictions);
+    printk(KERN_INFO "BUFFER: Device reads: %llu\n", stats.reads);
+    printk(KERN_INFO "BUFFER: Device writes: %llu\n", stats.writes);
+    printk(KERN_INFO "BUFFER: Buffers: %u of %u, %u dirty\n",
+           stats.nr_buffers, stats.max_buffers, stats.nr_dirty);
+}
@@ -240,16 +240,25 @@ error_t ext2_truncate(struct inode *inode, u64 size) {
     u32 old_blocks = (inode->size + block_size - 1) / block_size;
     u32 new_blocks = (size + block_size - 1) / block_size;
     
+    /* Give back the blocks preallocated for appending */
+    ext2_discard_prealloc(inode);
+    
     /* Check if we need to free blocks */
     if (new_blocks < old_blocks) {
-        /* Free the blocks */
-        for (u32 i = new_blocks; i < old_blocks; i++) {
-            /* Get the physical block number */
-            u32 phys_block = ext2_get_block(inode, i);
+        /* Free the blocks, a mapped run at a time */
+        for (u32 i = new_blocks; i < old_blocks; ) {
+            /* Get the physical blocks */
+            u32 phys_block;
+            int count = ext2_get_blocks(inode, i, old_blocks - i, &phys_block);
+            
+            if (count <= 0) {
+                i++;
+                continue;
+            }
             
-            if (phys_block != 0) {
+            for (int j = 0; j < count; j++, i++) {
                 /* Free the block */
-                ext2_free_block(inode, phys_block);
+                ext2_free_block(inode, phys_block + j);
                 
                 /* Clear the block pointer */
                 if (i < 12) {
@@ -260,6 +269,9 @@ error_t ext2_truncate(struct inode *inode, u64 size) {
                 }
             }
         }
+        
+        /* Forget the runs of the freed blocks */
+        ext2_map_invalidate(inode);
     }
     
     /* Set the new size */
@@ -269,13 +281,18 @@ error_t ext2_truncate(struct inode *inode, u64 size) {
     /* Calculate the new block count */
     u32 blocks = 0;
     
-    for (u32 i = 0; i < new_blocks; i++) {
-        /* Get the physical block number */
-        u32 phys_block = ext2_get_block(inode, i);
+    for (u32 i = 0; i < new_blocks; ) {
+        /* Get the physical blocks */
+        u32 phys_block;
+        int count = ext2_get_blocks(inode, i, new_blocks - i, &phys_block);
         
-        if (phys_block != 0) {
-            blocks++;
+        if (count <= 0) {
+            i++;
+            continue;
         }
+        
+        blocks += count;
+        i += count;
     }
     
     /* Set the new block count */
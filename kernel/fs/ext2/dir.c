@@ -255,9 +255,62 @@ error_t ext2_readdir_dir(file_t *file, struct dirent *dirent) {
     return 0;
 }
 
+/**
+ * Get the inode of a directory entry
+ * 
+ * @param sb Superblock
+ * @param ino Inode number of the entry
+ * @return Pointer to the inode, or NULL on failure
+ */
+static struct inode *ext2_lookup_inode(super_block_t *sb, u32 ino) {
+    inode_t *inode = kmalloc(sizeof(inode_t), 0);
+    
+    if (inode == NULL) {
+        printk(KERN_ERR "EXT2: Failed to allocate memory for inode\n");
+        return NULL;
+    }
+    
+    /* Initialize the inode */
+    memset(inode, 0, sizeof(inode_t));
+    
+    /* Set the inode number */
+    inode->inode_num = ino;
+    
+    /* Set the inode operations */
+    inode->i_ops = &ext2_inode_ops;
+    
+    /* Allocate memory for the Ext2 inode info */
+    ext2_inode_info_t *ei = kmalloc(sizeof(ext2_inode_info_t), 0);
+    
+    if (ei == NULL) {
+        printk(KERN_ERR "EXT2: Failed to allocate memory for Ext2 inode info\n");
+        kfree(inode);
+        return NULL;
+    }
+    
+    /* Initialize the Ext2 inode info */
+    memset(ei, 0, sizeof(ext2_inode_info_t));
+    spin_lock_init(&ei->i_map_lock);
+    
+    /* Set the Ext2 inode info */
+    inode->fs_data = ei;
+    
+    /* Read the inode */
+    if (ext2_read_inode(sb, inode) < 0) {
+        kfree(ei);
+        kfree(inode);
+        return NULL;
+    }
+    
+    return inode;
+}
+
 /**
  * Lookup a directory entry
  * 
+ * Indexed directories are searched through their hash index, others and
+ * ones whose index is broken block by block.
+ * 
  * @param dir Directory to look in
  * @param name Name to look for
  * @return Pointer to the inode, or NULL if not found
@@ -275,15 +328,26 @@ struct inode *ext2_lookup(struct inode *dir, const char *name) {
         return NULL;
     }
     
-    /* Get the Ext2 inode info */
-    ext2_inode_info_t *ei = (ext2_inode_info_t *)dir->fs_data;
-    
     /* Get the superblock */
     super_block_t *sb = dir->i_ops->get_super(dir);
     
     /* Get the Ext2 superblock info */
     ext2_sb_info_t *sbi = (ext2_sb_info_t *)sb->fs_data;
     
+    /* Use the index if the directory has one */
+    if (ext2_dx_enabled(dir, name)) {
+        u32 ino;
+        int ret = ext2_dx_find_entry(dir, name, &ino);
+        
+        if (ret == 0) {
+            return ext2_lookup_inode(sb, ino);
+        }
+        
+        if (ret != -EUCLEAN) {
+            return NULL;
+        }
+    }
+    
     /* Calculate the block size */
     u32 block_size = sbi->s_block_size;
     
@@ -333,53 +397,12 @@ struct inode *ext2_lookup(struct inode *dir, const char *name) {
             /* Check if the name matches */
             if (entry->name_len == strlen(name) && strncmp(entry->name, name, entry->name_len) == 0) {
                 /* Found the entry */
-                inode_t *inode = kmalloc(sizeof(inode_t), 0);
-                
-                if (inode == NULL) {
-                    printk(KERN_ERR "EXT2: Failed to allocate memory for inode\n");
-                    kfree(block_buffer);
-                    return NULL;
-                }
-                
-                /* Initialize the inode */
-                memset(inode, 0, sizeof(inode_t));
-                
-                /* Set the inode number */
-                inode->inode_num = entry->inode;
-                
-                /* Set the inode operations */
-                inode->i_ops = &ext2_inode_ops;
-                
-                /* Allocate memory for the Ext2 inode info */
-                ext2_inode_info_t *ei = kmalloc(sizeof(ext2_inode_info_t), 0);
-                
-                if (ei == NULL) {
-                    printk(KERN_ERR "EXT2: Failed to allocate memory for Ext2 inode info\n");
-                    kfree(inode);
-                    kfree(block_buffer);
-                    return NULL;
-                }
-                
-                /* Initialize the Ext2 inode info */
-                memset(ei, 0, sizeof(ext2_inode_info_t));
-                
-                /* Set the Ext2 inode info */
-                inode->fs_data = ei;
-                
-                /* Read the inode */
-                ret = ext2_read_inode(sb, inode);
-                
-                if (ret < 0) {
-                    kfree(ei);
-                    kfree(inode);
-                    kfree(block_buffer);
-                    return NULL;
-                }
+                u32 ino = entry->inode;
                 
                 /* Free the block buffer */
                 kfree(block_buffer);
                 
-                return inode;
+                return ext2_lookup_inode(sb, ino);
             }
             
             /* Skip to the next entry */
@@ -19,9 +19,40 @@
 #define NULL ((void *)0)
 #endif
 
+/**
+ * Get the Ext2 file type of a directory entry
+ * 
+ * @param type Type of the entry
+ * @return Ext2 file type
+ */
+static u8 ext2_dir_file_type(file_type_t type) {
+    switch (type) {
+        case FILE_TYPE_REGULAR:
+            return EXT2_FT_REG_FILE;
+        case FILE_TYPE_DIRECTORY:
+            return EXT2_FT_DIR;
+        case FILE_TYPE_SYMLINK:
+            return EXT2_FT_SYMLINK;
+        case FILE_TYPE_BLOCK_DEVICE:
+            return EXT2_FT_BLKDEV;
+        case FILE_TYPE_CHAR_DEVICE:
+            return EXT2_FT_CHRDEV;
+        case FILE_TYPE_PIPE:
+            return EXT2_FT_FIFO;
+        case FILE_TYPE_SOCKET:
+            return EXT2_FT_SOCK;
+        default:
+            return EXT2_FT_UNKNOWN;
+    }
+}
+
 /**
  * Add an entry to a directory
  * 
+ * Indexed directories get the entry in the leaf of its hash. A directory
+ * whose first and only block is full is converted to an indexed one, if
+ * the file system has the dir_index feature.
+ * 
  * @param dir Directory inode
  * @param name Name of the entry
  * @param ino Inode number of the entry
@@ -62,6 +93,21 @@ error_t ext2_add_entry(struct inode *dir, const char *name, u32 ino, file_type_t
     /* Get the Ext2 superblock info */
     ext2_sb_info_t *sbi = (ext2_sb_info_t *)sb->fs_data;
     
+    /* Use the index if the directory has one */
+    if (ext2_dx_enabled(dir, name)) {
+        error_t ret = ext2_dx_add_entry(dir, name, ino, ext2_dir_file_type(type));
+        
+        if (ret != -EUCLEAN) {
+            return ret;
+        }
+        
+        /* The index is broken, drop it and treat the directory as a plain one */
+        printk(KERN_WARNING "EXT2: Dropping the index of directory %u\n", dir->inode_num);
+        ((ext2_inode_info_t *)dir->fs_data)->i_flags &= ~EXT2_INDEX_FL;
+        ext2_dx_cache_invalidate(sbi, dir->inode_num);
+        ext2_write_inode(sb, dir);
+    }
+    
     /* Calculate the block size */
     u32 block_size = sbi->s_block_size;
     
@@ -145,27 +191,13 @@ error_t ext2_add_entry(struct inode *dir, const char *name, u32 ino, file_type_t
                     new_entry->inode = ino;
                     new_entry->rec_len = free_space;
                     new_entry->name_len = name_len;
-                    new_entry->file_type = type == FILE_TYPE_REGULAR ? EXT2_FT_REG_FILE :
-                                          type == FILE_TYPE_DIRECTORY ? EXT2_FT_DIR :
-                                          type == FILE_TYPE_SYMLINK ? EXT2_FT_SYMLINK :
-                                          type == FILE_TYPE_BLOCK_DEVICE ? EXT2_FT_BLKDEV :
-                                          type == FILE_TYPE_CHAR_DEVICE ? EXT2_FT_CHRDEV :
-                                          type == FILE_TYPE_PIPE ? EXT2_FT_FIFO :
-                                          type == FILE_TYPE_SOCKET ? EXT2_FT_SOCK :
-                                          EXT2_FT_UNKNOWN;
+                    new_entry->file_type = ext2_dir_file_type(type);
                     memcpy(new_entry->name, name, name_len);
                 } else {
                     /* Use the existing entry */
                     entry->inode = ino;
                     entry->name_len = name_len;
-                    entry->file_type = type == FILE_TYPE_REGULAR ? EXT2_FT_REG_FILE :
-                                      type == FILE_TYPE_DIRECTORY ? EXT2_FT_DIR :
-                                      type == FILE_TYPE_SYMLINK ? EXT2_FT_SYMLINK :
-                                      type == FILE_TYPE_BLOCK_DEVICE ? EXT2_FT_BLKDEV :
-                                      type == FILE_TYPE_CHAR_DEVICE ? EXT2_FT_CHRDEV :
-                                      type == FILE_TYPE_PIPE ? EXT2_FT_FIFO :
-                                      type == FILE_TYPE_SOCKET ? EXT2_FT_SOCK :
-                                      EXT2_FT_UNKNOWN;
+                    entry->file_type = ext2_dir_file_type(type);
                     memcpy(entry->name, name, name_len);
                 }
                 
@@ -194,7 +226,17 @@ error_t ext2_add_entry(struct inode *dir, const char *name, u32 ino, file_type_t
         }
     }
     
-    /* No free entry found, allocate a new block */
+    /* No free entry found, index the directory if it is outgrowing its first block */
+    if (num_blocks == 1) {
+        error_t ret = ext2_dx_make_indexed(dir, name, ino, ext2_dir_file_type(type));
+        
+        if (ret != -EOPNOTSUPP) {
+            kfree(block_buffer);
+            return ret;
+        }
+    }
+    
+    /* Allocate a new block */
     u32 phys_block = ext2_alloc_block(dir, num_blocks);
     
     if (phys_block == 0) {
@@ -210,14 +252,7 @@ error_t ext2_add_entry(struct inode *dir, const char *name, u32 ino, file_type_t
     entry->inode = ino;
     entry->rec_len = block_size;
     entry->name_len = name_len;
-    entry->file_type = type == FILE_TYPE_REGULAR ? EXT2_FT_REG_FILE :
-                      type == FILE_TYPE_DIRECTORY ? EXT2_FT_DIR :
-                      type == FILE_TYPE_SYMLINK ? EXT2_FT_SYMLINK :
-                      type == FILE_TYPE_BLOCK_DEVICE ? EXT2_FT_BLKDEV :
-                      type == FILE_TYPE_CHAR_DEVICE ? EXT2_FT_CHRDEV :
-                      type == FILE_TYPE_PIPE ? EXT2_FT_FIFO :
-                      type == FILE_TYPE_SOCKET ? EXT2_FT_SOCK :
-                      EXT2_FT_UNKNOWN;
+    entry->file_type = ext2_dir_file_type(type);
     memcpy(entry->name, name, name_len);
     
     /* Write the block */
@@ -279,6 +314,15 @@ error_t ext2_remove_entry(struct inode *dir, const char *name) {
     /* Get the Ext2 superblock info */
     ext2_sb_info_t *sbi = (ext2_sb_info_t *)sb->fs_data;
     
+    /* Use the index if the directory has one */
+    if (ext2_dx_enabled(dir, name)) {
+        error_t ret = ext2_dx_remove_entry(dir, name);
+        
+        if (ret != -EUCLEAN) {
+            return ret;
+        }
+    }
+    
     /* Calculate the block size */
     u32 block_size = sbi->s_block_size;
     
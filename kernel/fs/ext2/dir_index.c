@@ -0,0 +1,1234 @@
+/**
+ * dir_index.c - Ext2 hashed directory index
+ *
+ * This file contains the implementation of hashed directory indexes, in the
+ * format of the dir_index feature. The first block of an indexed directory
+ * holds "." and "..", followed by the root of a tree of index entries sorted
+ * by name hash. The leaves are ordinary directory blocks holding the names
+ * whose hashes fall in their range, so a lookup reads the index and a single
+ * leaf instead of the whole directory. To anything that walks the directory
+ * linearly, the index is just unused space. A directory is converted when it
+ * outgrows its first block.
+ */
+
+#include <horizon/kernel.h>
+#include <horizon/types.h>
+#include <horizon/fs.h>
+#include <horizon/fs/ext2.h>
+#include <horizon/fs/buffer.h>
+#include <horizon/mm.h>
+#include <horizon/printk.h>
+#include <horizon/errno.h>
+#include <horizon/string.h>
+
+/* Define NULL if not defined */
+#ifndef NULL
+#define NULL ((void *)0)
+#endif
+
+/* Offset of the root information, after the "." and ".." entries */
+#define EXT2_DX_ROOT_INFO_OFFSET 24
+
+/* Offset of the entries of an index node, after its empty directory entry */
+#define EXT2_DX_NODE_OFFSET 8
+
+/* Position a frame by searching for the hash of the path */
+#define EXT2_DX_SEARCH 0xFFFFFFFF
+
+/* Position in one level of a directory index */
+typedef struct ext2_dx_frame {
+    u32 lblk;                   /* Logical block of the index node */
+    u32 count;                  /* Entries in the node */
+    u32 limit;                  /* Entries that fit in the node */
+    u32 at;                     /* Entry followed */
+    u32 block;                  /* Logical block the entry points to */
+    u32 next_hash;              /* Hash of the entry after it, if any */
+} ext2_dx_frame_t;
+
+/* Path from the root of a directory index to a leaf */
+typedef struct ext2_dx_path {
+    ext2_dx_hash_info_t hinfo;  /* Hash of the name */
+    u32 levels;                 /* Levels of index nodes below the root */
+    ext2_dx_frame_t frames[EXT2_DX_MAX_LEVELS];
+} ext2_dx_path_t;
+
+/* Live entry of a leaf being split */
+typedef struct ext2_dx_map {
+    u32 hash;                   /* Hash of the name */
+    u16 offs;                   /* Offset in the leaf */
+    u16 size;                   /* Size of the entry */
+} ext2_dx_map_t;
+
+/**
+ * Get the space a directory entry needs
+ *
+ * The structure is padded, so its size cannot be used for the header.
+ *
+ * @param name_len Length of the name
+ * @return Size of the entry
+ */
+static inline u32 ext2_dx_rec_len(u32 name_len) {
+    return (offsetof(ext2_dir_entry_t, name) + name_len + 3) & ~3;
+}
+
+/**
+ * Get the Ext2 superblock info of a directory
+ *
+ * @param dir Directory inode
+ * @return Ext2 superblock info
+ */
+static inline ext2_sb_info_t *ext2_dx_sbi(struct inode *dir) {
+    super_block_t *sb = dir->i_ops->get_super(dir);
+    
+    return (ext2_sb_info_t *)sb->fs_data;
+}
+
+/**
+ * Get the root information of an index
+ *
+ * @param data First block of the directory
+ * @return Root information
+ */
+static inline ext2_dx_root_info_t *ext2_dx_root_info(u8 *data) {
+    return (ext2_dx_root_info_t *)(data + EXT2_DX_ROOT_INFO_OFFSET);
+}
+
+/**
+ * Get the entries of an index node
+ *
+ * @param data Block of the node
+ * @param level Level of the node, 0 for the root
+ * @return Index entries, the first one holding the count and limit
+ */
+static inline ext2_dx_entry_t *ext2_dx_node_entries(u8 *data, u32 level) {
+    if (level == 0) {
+        return (ext2_dx_entry_t *)(data + EXT2_DX_ROOT_INFO_OFFSET + ext2_dx_root_info(data)->info_length);
+    }
+    
+    return (ext2_dx_entry_t *)(data + EXT2_DX_NODE_OFFSET);
+}
+
+/**
+ * Get the number of entries that fit in the root
+ *
+ * @param sbi Ext2 superblock info
+ * @return Number of entries
+ */
+static inline u32 ext2_dx_root_limit(ext2_sb_info_t *sbi) {
+    return (sbi->s_block_size - EXT2_DX_ROOT_INFO_OFFSET - sizeof(ext2_dx_root_info_t)) / sizeof(ext2_dx_entry_t);
+}
+
+/**
+ * Get the number of entries that fit in an index node below the root
+ *
+ * @param sbi Ext2 superblock info
+ * @return Number of entries
+ */
+static inline u32 ext2_dx_node_limit(ext2_sb_info_t *sbi) {
+    return (sbi->s_block_size - EXT2_DX_NODE_OFFSET) / sizeof(ext2_dx_entry_t);
+}
+
+/**
+ * Read a block of a directory
+ *
+ * @param dir Directory inode
+ * @param lblk Logical block
+ * @return Buffer of the block, or NULL on failure
+ */
+static buffer_head_t *ext2_dx_bread(struct inode *dir, u32 lblk) {
+    ext2_sb_info_t *sbi = ext2_dx_sbi(dir);
+    u32 pblk = ext2_get_block(dir, lblk);
+    
+    if (pblk == 0) {
+        printk(KERN_ERR "EXT2: Hole at block %u of indexed directory %u\n", lblk, dir->inode_num);
+        return NULL;
+    }
+    
+    return bread(sbi->s_blockdev, pblk, sbi->s_block_size);
+}
+
+/**
+ * Add an empty block at the end of a directory
+ *
+ * The block holds a single unused entry spanning all of it, which is what
+ * both an empty leaf and an index node below the root start with.
+ *
+ * @param dir Directory inode
+ * @param lblk Where to store the logical block
+ * @return Buffer of the block, or NULL on failure
+ */
+static buffer_head_t *ext2_dx_append_block(struct inode *dir, u32 *lblk) {
+    super_block_t *sb = dir->i_ops->get_super(dir);
+    ext2_sb_info_t *sbi = (ext2_sb_info_t *)sb->fs_data;
+    u32 block_size = sbi->s_block_size;
+    
+    *lblk = dir->size / block_size;
+    
+    u32 pblk = ext2_alloc_block(dir, *lblk);
+    
+    if (pblk == 0) {
+        return NULL;
+    }
+    
+    buffer_head_t *bh = getblk(sbi->s_blockdev, pblk, block_size);
+    
+    if (bh == NULL) {
+        return NULL;
+    }
+    
+    lock_buffer(bh);
+    memset(bh->b_data, 0, block_size);
+    ((ext2_dir_entry_t *)bh->b_data)->rec_len = block_size;
+    mark_buffer_dirty(bh);
+    unlock_buffer(bh);
+    
+    /* Grow the directory over the block */
+    dir->size = (u64)(*lblk + 1) * block_size;
+    ext2_write_inode(sb, dir);
+    
+    return bh;
+}
+
+/**
+ * Find the cached root of a directory index
+ *
+ * Must be called with the cache lock held.
+ *
+ * @param sbi Ext2 superblock info
+ * @param ino Directory inode number
+ * @return Cached root, or NULL if not cached
+ */
+static ext2_dx_root_cache_t *ext2_dx_cache_find(ext2_sb_info_t *sbi, u32 ino) {
+    for (u32 i = 0; i < EXT2_DX_CACHE_SIZE; i++) {
+        if (sbi->s_dx_cache[i].ino == ino) {
+            return &sbi->s_dx_cache[i];
+        }
+    }
+    
+    return NULL;
+}
+
+/**
+ * Cache the root of a directory index
+ *
+ * Called with the buffer of the root locked, so that the cache always
+ * holds what the block holds.
+ *
+ * @param sbi Ext2 superblock info
+ * @param ino Directory inode number
+ * @param path Path with the hash version and levels of the index
+ * @param entries Root entries
+ * @param count Number of root entries
+ */
+static void ext2_dx_cache_store(ext2_sb_info_t *sbi, u32 ino, ext2_dx_path_t *path, ext2_dx_entry_t *entries, u32 count) {
+    ext2_dx_entry_t *spare = NULL;
+    ext2_dx_root_cache_t *rc;
+    
+    for (;;) {
+        spin_lock(&sbi->s_dx_lock);
+        
+        rc = ext2_dx_cache_find(sbi, ino);
+        
+        if (rc == NULL) {
+            /* Replace the cached roots in turn */
+            rc = &sbi->s_dx_cache[sbi->s_dx_cache_next];
+        }
+        
+        if (rc->entries != NULL || spare != NULL) {
+            break;
+        }
+        
+        /* Allocate the entries outside of the lock */
+        spin_unlock(&sbi->s_dx_lock);
+        
+        spare = kmalloc(sbi->s_block_size, 0);
+        
+        if (spare == NULL) {
+            return;
+        }
+    }
+    
+    if (rc->entries == NULL) {
+        rc->entries = spare;
+        spare = NULL;
+    }
+    
+    if (rc->ino != ino) {
+        sbi->s_dx_cache_next = (sbi->s_dx_cache_next + 1) % EXT2_DX_CACHE_SIZE;
+    }
+    
+    rc->ino = ino;
+    rc->hash_version = path->hinfo.hash_version;
+    rc->levels = path->levels;
+    rc->count = count;
+    memcpy(rc->entries, entries, count * sizeof(ext2_dx_entry_t));
+    
+    spin_unlock(&sbi->s_dx_lock);
+    
+    if (spare != NULL) {
+        kfree(spare);
+    }
+}
+
+/**
+ * Drop the cached root of a directory index
+ *
+ * @param sb Ext2 superblock info
+ * @param ino Directory inode number
+ */
+void ext2_dx_cache_invalidate(ext2_sb_info_t *sb, u32 ino) {
+    spin_lock(&sb->s_dx_lock);
+    
+    ext2_dx_root_cache_t *rc = ext2_dx_cache_find(sb, ino);
+    
+    if (rc != NULL) {
+        rc->ino = 0;
+    }
+    
+    spin_unlock(&sb->s_dx_lock);
+}
+
+/**
+ * Free the cached roots of directory indexes
+ *
+ * @param sb Ext2 superblock info
+ */
+void ext2_dx_cache_release(ext2_sb_info_t *sb) {
+    for (u32 i = 0; i < EXT2_DX_CACHE_SIZE; i++) {
+        if (sb->s_dx_cache[i].entries != NULL) {
+            kfree(sb->s_dx_cache[i].entries);
+        }
+        
+        sb->s_dx_cache[i].ino = 0;
+        sb->s_dx_cache[i].entries = NULL;
+    }
+}
+
+/**
+ * Check the root of a directory index
+ *
+ * @param dir Directory inode
+ * @param data First block of the directory
+ * @param hash_version Where to store the hash version to use
+ * @param levels Where to store the levels below the root
+ * @return 0 if the root is sane, -EUCLEAN if not
+ */
+static int ext2_dx_check_root(struct inode *dir, u8 *data, u32 *hash_version, u32 *levels) {
+    ext2_sb_info_t *sbi = ext2_dx_sbi(dir);
+    ext2_dx_root_info_t *info = ext2_dx_root_info(data);
+    
+    if (info->reserved_zero != 0 || info->hash_version > EXT2_HASH_TEA ||
+        info->info_length != sizeof(ext2_dx_root_info_t) || (info->unused_flags & 1) ||
+        info->indirect_levels >= EXT2_DX_MAX_LEVELS) {
+        printk(KERN_ERR "EXT2: Bad directory index root in inode %u\n", dir->inode_num);
+        return -EUCLEAN;
+    }
+    
+    ext2_dx_countlimit_t *cl = (ext2_dx_countlimit_t *)ext2_dx_node_entries(data, 0);
+    
+    if (cl->limit != ext2_dx_root_limit(sbi) || cl->count == 0 || cl->count > cl->limit) {
+        printk(KERN_ERR "EXT2: Bad directory index root in inode %u\n", dir->inode_num);
+        return -EUCLEAN;
+    }
+    
+    /* The same version hashes signed or unsigned characters, as the file system says */
+    *hash_version = info->hash_version;
+    
+    if (sbi->s_es->s_flags & EXT2_FLAGS_UNSIGNED_HASH) {
+        *hash_version += EXT2_HASH_LEGACY_UNSIGNED;
+    }
+    
+    *levels = info->indirect_levels;
+    
+    return 0;
+}
+
+/**
+ * Check an index node below the root
+ *
+ * @param dir Directory inode
+ * @param data Block of the node
+ * @return 0 if the node is sane, -EUCLEAN if not
+ */
+static int ext2_dx_check_node(struct inode *dir, u8 *data) {
+    ext2_dx_countlimit_t *cl = (ext2_dx_countlimit_t *)ext2_dx_node_entries(data, 1);
+    
+    if (cl->limit != ext2_dx_node_limit(ext2_dx_sbi(dir)) || cl->count == 0 || cl->count > cl->limit) {
+        printk(KERN_ERR "EXT2: Bad directory index node in inode %u\n", dir->inode_num);
+        return -EUCLEAN;
+    }
+    
+    return 0;
+}
+
+/**
+ * Position a frame on the entries of its node
+ *
+ * @param path Path
+ * @param frame Frame, with the count of the node set
+ * @param entries Entries of the node
+ * @param at Entry to follow, or EXT2_DX_SEARCH for the one covering the hash
+ */
+static void ext2_dx_position(ext2_dx_path_t *path, ext2_dx_frame_t *frame, ext2_dx_entry_t *entries, u32 at) {
+    if (at == EXT2_DX_SEARCH) {
+        /* Find the last entry whose hash is not above the one looked for */
+        u32 lo = 1;
+        u32 hi = frame->count;
+        
+        while (lo < hi) {
+            u32 mid = lo + (hi - lo) / 2;
+            
+            if (entries[mid].hash > path->hinfo.hash) {
+                hi = mid;
+            } else {
+                lo = mid + 1;
+            }
+        }
+        
+        at = lo - 1;
+    }
+    
+    frame->at = at;
+    frame->block = entries[at].block & 0x00FFFFFF;
+    frame->next_hash = at + 1 < frame->count ? entries[at + 1].hash : 0;
+}
+
+/**
+ * Read one level of the index into a path
+ *
+ * The root is taken from the cache when it is there. If a name is given,
+ * which only makes sense for the root, its hash is computed with the hash
+ * version the root asks for before searching.
+ *
+ * @param dir Directory inode
+ * @param path Path, filled down to the level above
+ * @param level Level to read
+ * @param at Entry to follow, or EXT2_DX_SEARCH for the one covering the hash
+ * @param name Name to hash, or NULL to keep the hash of the path
+ * @return 0 on success, negative error code on failure
+ */
+static int ext2_dx_read_frame(struct inode *dir, ext2_dx_path_t *path, u32 level, u32 at, const char *name) {
+    ext2_sb_info_t *sbi = ext2_dx_sbi(dir);
+    ext2_dx_frame_t *frame = &path->frames[level];
+    
+    frame->lblk = level == 0 ? 0 : path->frames[level - 1].block;
+    
+    if (level == 0) {
+        spin_lock(&sbi->s_dx_lock);
+        
+        ext2_dx_root_cache_t *rc = ext2_dx_cache_find(sbi, dir->inode_num);
+        
+        if (rc != NULL) {
+            path->levels = rc->levels;
+            
+            if (name != NULL) {
+                path->hinfo.hash_version = rc->hash_version;
+                ext2_dirhash(name, strlen(name), &path->hinfo);
+            }
+            
+            frame->count = rc->count;
+            frame->limit = ext2_dx_root_limit(sbi);
+            ext2_dx_position(path, frame, rc->entries, at);
+            
+            spin_unlock(&sbi->s_dx_lock);
+            
+            return 0;
+        }
+        
+        spin_unlock(&sbi->s_dx_lock);
+    }
+    
+    buffer_head_t *bh = ext2_dx_bread(dir, frame->lblk);
+    
+    if (bh == NULL) {
+        return -EIO;
+    }
+    
+    lock_buffer(bh);
+    
+    int ret;
+    u32 hash_version = 0;
+    
+    if (level == 0) {
+        ret = ext2_dx_check_root(dir, bh->b_data, &hash_version, &path->levels);
+    } else {
+        ret = ext2_dx_check_node(dir, bh->b_data);
+    }
+    
+    if (ret == 0) {
+        ext2_dx_entry_t *entries = ext2_dx_node_entries(bh->b_data, level);
+        ext2_dx_countlimit_t *cl = (ext2_dx_countlimit_t *)entries;
+        
+        if (level == 0 && name != NULL) {
+            path->hinfo.hash_version = hash_version;
+            ext2_dirhash(name, strlen(name), &path->hinfo);
+        }
+        
+        frame->count = cl->count;
+        frame->limit = cl->limit;
+        ext2_dx_position(path, frame, entries, at);
+        
+        if (level == 0) {
+            ext2_dx_cache_store(sbi, dir->inode_num, path, entries, cl->count);
+        }
+    }
+    
+    unlock_buffer(bh);
+    brelse(bh);
+    
+    return ret;
+}
+
+/**
+ * Walk the index down to the leaf covering a hash
+ *
+ * @param dir Directory inode
+ * @param path Path, with the hash set if name is NULL
+ * @param name Name to hash, or NULL to keep the hash of the path
+ * @return 0 on success, negative error code on failure
+ */
+static int ext2_dx_probe(struct inode *dir, ext2_dx_path_t *path, const char *name) {
+    int ret = ext2_dx_read_frame(dir, path, 0, EXT2_DX_SEARCH, name);
+    
+    for (u32 level = 1; ret == 0 && level <= path->levels; level++) {
+        ret = ext2_dx_read_frame(dir, path, level, EXT2_DX_SEARCH, NULL);
+    }
+    
+    return ret;
+}
+
+/**
+ * Move a path to the next leaf, if it continues the hash of the path
+ *
+ * Names with the same hash may spill over into the following leaves, whose
+ * index entries then have the low bit of the hash set.
+ *
+ * @param dir Directory inode
+ * @param path Path
+ * @return 1 if moved, 0 if there is no such leaf, negative error code on failure
+ */
+static int ext2_dx_next_leaf(struct inode *dir, ext2_dx_path_t *path) {
+    int level = path->levels;
+    
+    /* Find the lowest level that has an entry to the right */
+    while (level >= 0 && path->frames[level].at + 1 >= path->frames[level].count) {
+        level--;
+    }
+    
+    if (level < 0 || (path->frames[level].next_hash & ~1) != path->hinfo.hash) {
+        return 0;
+    }
+    
+    int ret = ext2_dx_read_frame(dir, path, level, path->frames[level].at + 1, NULL);
+    
+    /* Go down the left edge of the levels below */
+    for (u32 l = level + 1; ret == 0 && l <= path->levels; l++) {
+        ret = ext2_dx_read_frame(dir, path, l, 0, NULL);
+    }
+    
+    return ret < 0 ? ret : 1;
+}
+
+/**
+ * Initialize a path for a directory
+ *
+ * @param dir Directory inode
+ * @param path Path
+ */
+static void ext2_dx_path_init(struct inode *dir, ext2_dx_path_t *path) {
+    memset(path, 0, sizeof(ext2_dx_path_t));
+    path->hinfo.seed = ext2_dx_sbi(dir)->s_es->s_hash_seed;
+}
+
+/**
+ * Find a name in a leaf
+ *
+ * @param data Leaf block
+ * @param block_size Block size
+ * @param name Name
+ * @param len Length of the name
+ * @param prev Where to store the entry before it, may be NULL
+ * @return Entry, or NULL if not found
+ */
+static ext2_dir_entry_t *ext2_dx_find_in_leaf(u8 *data, u32 block_size, const char *name, u32 len, ext2_dir_entry_t **prev) {
+    ext2_dir_entry_t *last = NULL;
+    u32 offset = 0;
+    
+    while (offset < block_size) {
+        ext2_dir_entry_t *entry = (ext2_dir_entry_t *)(data + offset);
+        
+        /* Stop at a broken entry rather than walking off the block */
+        if (entry->rec_len < ext2_dx_rec_len(entry->name_len) || offset + entry->rec_len > block_size) {
+            break;
+        }
+        
+        if (entry->inode != 0 && entry->name_len == len && memcmp(entry->name, name, len) == 0) {
+            if (prev != NULL) {
+                *prev = last;
+            }
+            
+            return entry;
+        }
+        
+        last = entry;
+        offset += entry->rec_len;
+    }
+    
+    return NULL;
+}
+
+/**
+ * Insert a name into a leaf
+ *
+ * @param data Leaf block
+ * @param block_size Block size
+ * @param name Name
+ * @param len Length of the name
+ * @param ino Inode number
+ * @param file_type Ext2 file type
+ * @return 0 on success, -ENOSPC if the leaf is full, -EUCLEAN if it is broken
+ */
+static int ext2_dx_insert_leaf(u8 *data, u32 block_size, const char *name, u32 len, u32 ino, u8 file_type) {
+    u32 need = ext2_dx_rec_len(len);
+    u32 offset = 0;
+    
+    while (offset < block_size) {
+        ext2_dir_entry_t *entry = (ext2_dir_entry_t *)(data + offset);
+        
+        if (entry->rec_len < ext2_dx_rec_len(entry->name_len) || offset + entry->rec_len > block_size) {
+            return -EUCLEAN;
+        }
+        
+        u32 used = entry->inode != 0 ? ext2_dx_rec_len(entry->name_len) : 0;
+        
+        if (entry->rec_len >= used + need) {
+            if (used != 0) {
+                /* Split the entry */
+                ext2_dir_entry_t *new_entry = (ext2_dir_entry_t *)((u8 *)entry + used);
+                new_entry->rec_len = entry->rec_len - used;
+                entry->rec_len = used;
+                entry = new_entry;
+            }
+            
+            entry->inode = ino;
+            entry->name_len = len;
+            entry->file_type = file_type;
+            memcpy(entry->name, name, len);
+            
+            return 0;
+        }
+        
+        offset += entry->rec_len;
+    }
+    
+    return -ENOSPC;
+}
+
+/**
+ * Insert an entry into an index node
+ *
+ * @param dir Directory inode
+ * @param path Path, whose frame at the level has room
+ * @param level Level of the node
+ * @param hash Hash of the entry
+ * @param block Logical block of the entry
+ * @return 0 on success, negative error code on failure
+ */
+static int ext2_dx_insert_index(struct inode *dir, ext2_dx_path_t *path, u32 level, u32 hash, u32 block) {
+    ext2_dx_frame_t *frame = &path->frames[level];
+    buffer_head_t *bh = ext2_dx_bread(dir, frame->lblk);
+    
+    if (bh == NULL) {
+        return -EIO;
+    }
+    
+    lock_buffer(bh);
+    
+    ext2_dx_entry_t *entries = ext2_dx_node_entries(bh->b_data, level);
+    ext2_dx_countlimit_t *cl = (ext2_dx_countlimit_t *)entries;
+    u32 at = frame->at + 1;
+    
+    memmove(entries + at + 1, entries + at, (cl->count - at) * sizeof(ext2_dx_entry_t));
+    entries[at].hash = hash;
+    entries[at].block = block;
+    cl->count++;
+    frame->count = cl->count;
+    
+    mark_buffer_dirty(bh);
+    
+    if (level == 0) {
+        ext2_dx_cache_store(ext2_dx_sbi(dir), dir->inode_num, path, entries, cl->count);
+    }
+    
+    unlock_buffer(bh);
+    brelse(bh);
+    
+    return 0;
+}
+
+/**
+ * Make room for one more entry in the lowest index node of a path
+ *
+ * A full root gets a level of index nodes below it. A full node below the
+ * root is split in two, the upper half going to a new node added to the
+ * root. The path is walked again afterwards.
+ *
+ * @param dir Directory inode
+ * @param path Path
+ * @return 0 on success, negative error code on failure
+ */
+static int ext2_dx_make_room(struct inode *dir, ext2_dx_path_t *path) {
+    ext2_sb_info_t *sbi = ext2_dx_sbi(dir);
+    ext2_dx_frame_t *frame = &path->frames[path->levels];
+    
+    if (frame->count < frame->limit) {
+        return 0;
+    }
+    
+    if (path->levels == 0) {
+        /* Move the entries of the root to a new node below it */
+        u32 node_lblk;
+        buffer_head_t *node_bh = ext2_dx_append_block(dir, &node_lblk);
+        
+        if (node_bh == NULL) {
+            return -ENOSPC;
+        }
+        
+        buffer_head_t *root_bh = ext2_dx_bread(dir, 0);
+        
+        if (root_bh == NULL) {
+            brelse(node_bh);
+            return -EIO;
+        }
+        
+        lock_buffer(root_bh);
+        lock_buffer(node_bh);
+        
+        ext2_dx_entry_t *root_entries = ext2_dx_node_entries(root_bh->b_data, 0);
+        ext2_dx_entry_t *node_entries = ext2_dx_node_entries(node_bh->b_data, 1);
+        
+        memcpy(node_entries, root_entries, frame->count * sizeof(ext2_dx_entry_t));
+        ((ext2_dx_countlimit_t *)node_entries)->limit = ext2_dx_node_limit(sbi);
+        ((ext2_dx_countlimit_t *)node_entries)->count = frame->count;
+        
+        ((ext2_dx_countlimit_t *)root_entries)->count = 1;
+        root_entries[0].block = node_lblk;
+        ext2_dx_root_info(root_bh->b_data)->indirect_levels = 1;
+        path->levels = 1;
+        
+        mark_buffer_dirty(node_bh);
+        mark_buffer_dirty(root_bh);
+        ext2_dx_cache_store(sbi, dir->inode_num, path, root_entries, 1);
+        
+        unlock_buffer(node_bh);
+        unlock_buffer(root_bh);
+        brelse(node_bh);
+        brelse(root_bh);
+    } else {
+        /* Split the node, adding the new one to the root */
+        if (path->levels == 0 || path->frames[0].count >= path->frames[0].limit) {
+            printk(KERN_ERR "EXT2: Directory index of inode %u is full\n", dir->inode_num);
+            return -ENOSPC;
+        }
+        
+        u32 new_lblk;
+        buffer_head_t *new_bh = ext2_dx_append_block(dir, &new_lblk);
+        
+        if (new_bh == NULL) {
+            return -ENOSPC;
+        }
+        
+        buffer_head_t *bh = ext2_dx_bread(dir, frame->lblk);
+        
+        if (bh == NULL) {
+            brelse(new_bh);
+            return -EIO;
+        }
+        
+        lock_buffer(bh);
+        lock_buffer(new_bh);
+        
+        ext2_dx_entry_t *entries = ext2_dx_node_entries(bh->b_data, 1);
+        ext2_dx_entry_t *new_entries = ext2_dx_node_entries(new_bh->b_data, 1);
+        u32 keep = frame->count / 2;
+        u32 hash = entries[keep].hash;
+        
+        memcpy(new_entries, entries + keep, (frame->count - keep) * sizeof(ext2_dx_entry_t));
+        ((ext2_dx_countlimit_t *)new_entries)->limit = ext2_dx_node_limit(sbi);
+        ((ext2_dx_countlimit_t *)new_entries)->count = frame->count - keep;
+        ((ext2_dx_countlimit_t *)entries)->count = keep;
+        
+        mark_buffer_dirty(new_bh);
+        mark_buffer_dirty(bh);
+        
+        unlock_buffer(new_bh);
+        unlock_buffer(bh);
+        brelse(new_bh);
+        brelse(bh);
+        
+        int ret = ext2_dx_insert_index(dir, path, 0, hash, new_lblk);
+        
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    
+    /* The entries have moved, walk the index again */
+    return ext2_dx_probe(dir, path, NULL);
+}
+
+/**
+ * Copy entries of a leaf, packed, into a block
+ *
+ * @param dst Block to fill
+ * @param src Leaf block
+ * @param map Entries to copy, at least one
+ * @param count Number of entries
+ * @param block_size Block size
+ */
+static void ext2_dx_copy_entries(u8 *dst, u8 *src, ext2_dx_map_t *map, u32 count, u32 block_size) {
+    ext2_dir_entry_t *entry = NULL;
+    u32 offset = 0;
+    
+    for (u32 i = 0; i < count; i++) {
+        entry = (ext2_dir_entry_t *)(dst + offset);
+        memcpy(entry, src + map[i].offs, map[i].size);
+        entry->rec_len = map[i].size;
+        offset += map[i].size;
+    }
+    
+    /* The last entry takes the rest of the block */
+    entry->rec_len += block_size - offset;
+}
+
+/**
+ * Split the leaf of a path in two by hash
+ *
+ * The upper half of the names, in hash order, moves to a new leaf that is
+ * added to the index. If the names on both sides of the split share a
+ * hash, the new index entry is marked as continuing the previous leaf.
+ *
+ * @param dir Directory inode
+ * @param path Path to the full leaf
+ * @return 0 on success, negative error code on failure
+ */
+static int ext2_dx_split_leaf(struct inode *dir, ext2_dx_path_t *path) {
+    ext2_sb_info_t *sbi = ext2_dx_sbi(dir);
+    u32 block_size = sbi->s_block_size;
+    
+    /* Make sure the new leaf can be added to the index first */
+    int ret = ext2_dx_make_room(dir, path);
+    
+    if (ret < 0) {
+        return ret;
+    }
+    
+    ext2_dx_map_t *map = kmalloc((block_size / ext2_dx_rec_len(1)) * sizeof(ext2_dx_map_t), 0);
+    u8 *tmp = kmalloc(block_size, 0);
+    
+    if (map == NULL || tmp == NULL) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    
+    buffer_head_t *bh = ext2_dx_bread(dir, path->frames[path->levels].block);
+    
+    if (bh == NULL) {
+        ret = -EIO;
+        goto out;
+    }
+    
+    u32 new_lblk;
+    buffer_head_t *new_bh = ext2_dx_append_block(dir, &new_lblk);
+    
+    if (new_bh == NULL) {
+        brelse(bh);
+        ret = -ENOSPC;
+        goto out;
+    }
+    
+    lock_buffer(bh);
+    lock_buffer(new_bh);
+    
+    /* Collect the names of the leaf, sorted by hash */
+    u32 count = 0;
+    u32 offset = 0;
+    
+    while (offset < block_size) {
+        ext2_dir_entry_t *entry = (ext2_dir_entry_t *)(bh->b_data + offset);
+        
+        if (entry->rec_len < ext2_dx_rec_len(entry->name_len) || offset + entry->rec_len > block_size) {
+            ret = -EUCLEAN;
+            break;
+        }
+        
+        if (entry->inode != 0) {
+            ext2_dx_hash_info_t hinfo = path->hinfo;
+            ext2_dirhash(entry->name, entry->name_len, &hinfo);
+            
+            u32 i = count++;
+            
+            while (i > 0 && map[i - 1].hash > hinfo.hash) {
+                map[i] = map[i - 1];
+                i--;
+            }
+            
+            map[i].hash = hinfo.hash;
+            map[i].offs = offset;
+            map[i].size = ext2_dx_rec_len(entry->name_len);
+        }
+        
+        offset += entry->rec_len;
+    }
+    
+    u32 split_hash = 0;
+    
+    if (ret == 0 && count < 2) {
+        ret = -ENOSPC;
+    }
+    
+    if (ret == 0) {
+        /* Move names from the top until about half of the block has moved */
+        u32 split = count;
+        u32 moved = 0;
+        
+        while (split > 1 && moved + map[split - 1].size <= block_size / 2) {
+            split--;
+            moved += map[split].size;
+        }
+        
+        split_hash = map[split].hash;
+        
+        if (split_hash == map[split - 1].hash) {
+            split_hash |= 1;
+        }
+        
+        ext2_dx_copy_entries(new_bh->b_data, bh->b_data, map + split, count - split, block_size);
+        ext2_dx_copy_entries(tmp, bh->b_data, map, split, block_size);
+        memcpy(bh->b_data, tmp, block_size);
+        
+        mark_buffer_dirty(new_bh);
+        mark_buffer_dirty(bh);
+    }
+    
+    unlock_buffer(new_bh);
+    unlock_buffer(bh);
+    brelse(new_bh);
+    brelse(bh);
+    
+    if (ret == 0) {
+        ret = ext2_dx_insert_index(dir, path, path->levels, split_hash, new_lblk);
+    }
+    
+out:
+    if (map != NULL) {
+        kfree(map);
+    }
+    
+    if (tmp != NULL) {
+        kfree(tmp);
+    }
+    
+    return ret;
+}
+
+/**
+ * Check if a name is looked up through the index of a directory
+ *
+ * "." and ".." live in the first block, outside of the index.
+ *
+ * @param dir Directory inode
+ * @param name Name
+ * @return 1 if the index is used, 0 if the directory is searched linearly
+ */
+int ext2_dx_enabled(struct inode *dir, const char *name) {
+    ext2_inode_info_t *ei = (ext2_inode_info_t *)dir->fs_data;
+    ext2_sb_info_t *sbi = ext2_dx_sbi(dir);
+    
+    if (!(sbi->s_es->s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX) || !(ei->i_flags & EXT2_INDEX_FL)) {
+        return 0;
+    }
+    
+    return strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
+}
+
+/**
+ * Find a name in an indexed directory
+ *
+ * @param dir Directory inode
+ * @param name Name
+ * @param ino Where to store the inode number
+ * @return 0 on success, -ENOENT if not found, -EUCLEAN if the index is broken,
+ *         or another negative error code on failure
+ */
+int ext2_dx_find_entry(struct inode *dir, const char *name, u32 *ino) {
+    ext2_sb_info_t *sbi = ext2_dx_sbi(dir);
+    ext2_dx_path_t path;
+    u32 len = strlen(name);
+    
+    ext2_dx_path_init(dir, &path);
+    
+    int ret = ext2_dx_probe(dir, &path, name);
+    
+    while (ret >= 0) {
+        buffer_head_t *bh = ext2_dx_bread(dir, path.frames[path.levels].block);
+        
+        if (bh == NULL) {
+            return -EIO;
+        }
+        
+        lock_buffer(bh);
+        
+        ext2_dir_entry_t *entry = ext2_dx_find_in_leaf(bh->b_data, sbi->s_block_size, name, len, NULL);
+        
+        if (entry != NULL) {
+            *ino = entry->inode;
+        }
+        
+        unlock_buffer(bh);
+        brelse(bh);
+        
+        if (entry != NULL) {
+            return 0;
+        }
+        
+        ret = ext2_dx_next_leaf(dir, &path);
+        
+        if (ret == 0) {
+            return -ENOENT;
+        }
+    }
+    
+    return ret;
+}
+
+/**
+ * Add a name to an indexed directory
+ *
+ * @param dir Directory inode
+ * @param name Name
+ * @param ino Inode number
+ * @param file_type Ext2 file type
+ * @return 0 on success, -EUCLEAN if the index is broken, or another negative
+ *         error code on failure
+ */
+error_t ext2_dx_add_entry(struct inode *dir, const char *name, u32 ino, u8 file_type) {
+    ext2_sb_info_t *sbi = ext2_dx_sbi(dir);
+    ext2_dx_path_t path;
+    u32 len = strlen(name);
+    
+    ext2_dx_path_init(dir, &path);
+    
+    mutex_lock(&sbi->s_dir_lock);
+    
+    int ret = ext2_dx_probe(dir, &path, name);
+    
+    /* A split leaves room on both sides, so a second try always fits */
+    for (int tries = 0; ret == 0; tries++) {
+        buffer_head_t *bh = ext2_dx_bread(dir, path.frames[path.levels].block);
+        
+        if (bh == NULL) {
+            ret = -EIO;
+            break;
+        }
+        
+        lock_buffer(bh);
+        
+        ret = ext2_dx_insert_leaf(bh->b_data, sbi->s_block_size, name, len, ino, file_type);
+        
+        if (ret == 0) {
+            mark_buffer_dirty(bh);
+        }
+        
+        unlock_buffer(bh);
+        brelse(bh);
+        
+        if (ret != -ENOSPC || tries > 0) {
+            break;
+        }
+        
+        ret = ext2_dx_split_leaf(dir, &path);
+        
+        if (ret == 0) {
+            ret = ext2_dx_probe(dir, &path, NULL);
+        }
+    }
+    
+    mutex_unlock(&sbi->s_dir_lock);
+    
+    return ret;
+}
+
+/**
+ * Remove a name from an indexed directory
+ *
+ * Only the leaf changes, the index still covers the same hashes.
+ *
+ * @param dir Directory inode
+ * @param name Name
+ * @return 0 on success, -ENOENT if not found, -EUCLEAN if the index is broken,
+ *         or another negative error code on failure
+ */
+error_t ext2_dx_remove_entry(struct inode *dir, const char *name) {
+    ext2_sb_info_t *sbi = ext2_dx_sbi(dir);
+    ext2_dx_path_t path;
+    u32 len = strlen(name);
+    
+    ext2_dx_path_init(dir, &path);
+    
+    mutex_lock(&sbi->s_dir_lock);
+    
+    int ret = ext2_dx_probe(dir, &path, name);
+    
+    while (ret >= 0) {
+        buffer_head_t *bh = ext2_dx_bread(dir, path.frames[path.levels].block);
+        
+        if (bh == NULL) {
+            ret = -EIO;
+            break;
+        }
+        
+        lock_buffer(bh);
+        
+        ext2_dir_entry_t *prev = NULL;
+        ext2_dir_entry_t *entry = ext2_dx_find_in_leaf(bh->b_data, sbi->s_block_size, name, len, &prev);
+        
+        if (entry != NULL) {
+            if (prev != NULL) {
+                /* Merge with the previous entry */
+                prev->rec_len += entry->rec_len;
+            } else {
+                /* Mark the entry as free */
+                entry->inode = 0;
+            }
+            
+            mark_buffer_dirty(bh);
+        }
+        
+        unlock_buffer(bh);
+        brelse(bh);
+        
+        if (entry != NULL) {
+            ret = 0;
+            break;
+        }
+        
+        ret = ext2_dx_next_leaf(dir, &path);
+        
+        if (ret == 0) {
+            ret = -ENOENT;
+        }
+    }
+    
+    mutex_unlock(&sbi->s_dir_lock);
+    
+    return ret;
+}
+
+/**
+ * Convert a full single block directory to an indexed one and add a name
+ *
+ * The names after "." and ".." move to a new leaf, and the space they
+ * leave in the first block takes the root of the index.
+ *
+ * @param dir Directory inode
+ * @param name Name
+ * @param ino Inode number
+ * @param file_type Ext2 file type
+ * @return 0 on success, -EOPNOTSUPP if the directory cannot be indexed, or
+ *         another negative error code on failure
+ */
+error_t ext2_dx_make_indexed(struct inode *dir, const char *name, u32 ino, u8 file_type) {
+    super_block_t *sb = dir->i_ops->get_super(dir);
+    ext2_sb_info_t *sbi = (ext2_sb_info_t *)sb->fs_data;
+    ext2_inode_info_t *ei = (ext2_inode_info_t *)dir->fs_data;
+    u32 block_size = sbi->s_block_size;
+    
+    if (!(sbi->s_es->s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX) || dir->size != block_size ||
+        strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        return -EOPNOTSUPP;
+    }
+    
+    mutex_lock(&sbi->s_dir_lock);
+    
+    buffer_head_t *bh = ext2_dx_bread(dir, 0);
+    
+    if (bh == NULL) {
+        mutex_unlock(&sbi->s_dir_lock);
+        return -EIO;
+    }
+    
+    /* The block must start with "." and "..", followed by other names */
+    lock_buffer(bh);
+    
+    ext2_dir_entry_t *dot = (ext2_dir_entry_t *)bh->b_data;
+    ext2_dir_entry_t *dotdot = (ext2_dir_entry_t *)(bh->b_data + ext2_dx_rec_len(1));
+    u32 start = ext2_dx_rec_len(1) + dotdot->rec_len;
+    
+    int ok = dot->name_len == 1 && dot->name[0] == '.' && dot->rec_len == ext2_dx_rec_len(1) &&
+             dotdot->name_len == 2 && dotdot->name[0] == '.' && dotdot->name[1] == '.' &&
+             dotdot->rec_len >= ext2_dx_rec_len(2) && start < block_size;
+    
+    unlock_buffer(bh);
+    
+    if (!ok) {
+        brelse(bh);
+        mutex_unlock(&sbi->s_dir_lock);
+        return -EOPNOTSUPP;
+    }
+    
+    u32 leaf_lblk;
+    buffer_head_t *leaf_bh = ext2_dx_append_block(dir, &leaf_lblk);
+    
+    if (leaf_bh == NULL) {
+        brelse(bh);
+        mutex_unlock(&sbi->s_dir_lock);
+        return -ENOSPC;
+    }
+    
+    lock_buffer(bh);
+    lock_buffer(leaf_bh);
+    
+    /* Move the names to the leaf, the last one taking the freed space */
+    memcpy(leaf_bh->b_data, bh->b_data + start, block_size - start);
+    
+    ext2_dir_entry_t *entry = (ext2_dir_entry_t *)leaf_bh->b_data;
+    
+    while (entry->rec_len != 0 && (u8 *)entry + entry->rec_len < leaf_bh->b_data + block_size - start) {
+        entry = (ext2_dir_entry_t *)((u8 *)entry + entry->rec_len);
+    }
+    
+    entry->rec_len += start;
+    
+    /* Build the root, with a single entry for the leaf */
+    dotdot->rec_len = block_size - ext2_dx_rec_len(1);
+    memset(bh->b_data + EXT2_DX_ROOT_INFO_OFFSET, 0, block_size - EXT2_DX_ROOT_INFO_OFFSET);
+    
+    ext2_dx_root_info_t *info = ext2_dx_root_info(bh->b_data);
+    info->hash_version = sbi->s_es->s_def_hash_version <= EXT2_HASH_TEA ?
+                         sbi->s_es->s_def_hash_version : EXT2_HASH_HALF_MD4;
+    info->info_length = sizeof(ext2_dx_root_info_t);
+    
+    ext2_dx_entry_t *entries = ext2_dx_node_entries(bh->b_data, 0);
+    ((ext2_dx_countlimit_t *)entries)->limit = ext2_dx_root_limit(sbi);
+    ((ext2_dx_countlimit_t *)entries)->count = 1;
+    entries[0].block = leaf_lblk;
+    
+    mark_buffer_dirty(leaf_bh);
+    mark_buffer_dirty(bh);
+    
+    unlock_buffer(leaf_bh);
+    unlock_buffer(bh);
+    brelse(leaf_bh);
+    brelse(bh);
+    
+    /* A root cached for an earlier directory with this inode number is stale */
+    ext2_dx_cache_invalidate(sbi, dir->inode_num);
+    
+    ei->i_flags |= EXT2_INDEX_FL;
+    ext2_write_inode(sb, dir);
+    
+    mutex_unlock(&sbi->s_dir_lock);
+    
+    return ext2_dx_add_entry(dir, name, ino, file_type);
+}
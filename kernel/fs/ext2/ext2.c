@@ -8,6 +8,7 @@
 #include <horizon/types.h>
 #include <horizon/fs.h>
 #include <horizon/fs/ext2.h>
+#include <horizon/fs/buffer.h>
 #include <horizon/mm.h>
 #include <horizon/device.h>
 #include <horizon/printk.h>
@@ -79,38 +80,6 @@ static file_operations_t ext2_dir_ops = {
     .readdir = ext2_readdir_dir
 };
 
-/* Ext2 in-memory superblock */
-typedef struct ext2_sb_info {
-    ext2_superblock_t *s_es;           /* Ext2 superblock */
-    ext2_group_desc_t *s_group_desc;   /* Group descriptors */
-    u32 s_block_size;                  /* Block size */
-    u32 s_inodes_per_block;            /* Number of inodes per block */
-    u32 s_blocks_per_group;            /* Number of blocks per group */
-    u32 s_inodes_per_group;            /* Number of inodes per group */
-    u32 s_itb_per_group;               /* Number of inode table blocks per group */
-    u32 s_desc_per_block;              /* Number of group descriptors per block */
-    u32 s_groups_count;                /* Number of groups */
-    u32 s_first_data_block;            /* First data block */
-    u32 s_first_ino;                   /* First non-reserved inode */
-    u32 s_inode_size;                  /* Size of inode structure */
-    void *s_blockdev;                  /* Block device */
-} ext2_sb_info_t;
-
-/* Ext2 in-memory inode */
-typedef struct ext2_inode_info {
-    ext2_inode_t *i_e2i;               /* Ext2 inode */
-    u32 i_block_group;                 /* Block group */
-    u32 i_data[15];                    /* Data blocks */
-    u32 i_flags;                       /* Flags */
-    u32 i_faddr;                       /* Fragment address */
-    u8  i_frag_no;                     /* Fragment number */
-    u8  i_frag_size;                   /* Fragment size */
-    u16 i_state;                       /* State flags */
-    u32 i_file_acl;                    /* File ACL */
-    u32 i_dir_acl;                     /* Directory ACL */
-    u32 i_dtime;                       /* Deletion time */
-} ext2_inode_info_t;
-
 /**
  * Initialize the Ext2 file system
  *
@@ -131,85 +100,193 @@ int ext2_init(void) {
 }
 
 /**
- * Read a block from the device
+ * Read a block through the buffer cache
  *
  * @param sb Superblock
  * @param block Block number
  * @param buffer Buffer to read into
  * @return 0 on success, negative error code on failure
  */
-static int ext2_read_block(ext2_sb_info_t *sb, u32 block, void *buffer) {
-    /* Calculate the offset */
-    u64 offset = block * sb->s_block_size;
-
-    /* Read the block */
-    ssize_t ret = device_read(sb->s_blockdev, buffer, sb->s_block_size, offset);
+int ext2_read_block(ext2_sb_info_t *sb, u32 block, void *buffer) {
+    /* Get the block, reading it only if it is not cached */
+    buffer_head_t *bh = bread(sb->s_blockdev, block, sb->s_block_size);
 
-    if (ret != sb->s_block_size) {
+    if (bh == NULL) {
         printk(KERN_ERR "EXT2: Failed to read block %u\n", block);
         return -EIO;
     }
 
+    lock_buffer(bh);
+    memcpy(buffer, bh->b_data, sb->s_block_size);
+    unlock_buffer(bh);
+
+    brelse(bh);
+
     return 0;
 }
 
 /**
- * Write a block to the device
+ * Write a block through the buffer cache
+ *
+ * The block is written to the device before returning, the cached copy
+ * stays for the next read.
  *
  * @param sb Superblock
  * @param block Block number
  * @param buffer Buffer to write from
  * @return 0 on success, negative error code on failure
  */
-static int ext2_write_block(ext2_sb_info_t *sb, u32 block, void *buffer) {
-    /* Calculate the offset */
-    u64 offset = block * sb->s_block_size;
+int ext2_write_block(ext2_sb_info_t *sb, u32 block, void *buffer) {
+    /* The whole block is overwritten, so it is not read first */
+    buffer_head_t *bh = getblk(sb->s_blockdev, block, sb->s_block_size);
+
+    if (bh == NULL) {
+        printk(KERN_ERR "EXT2: Failed to get block %u\n", block);
+        return -ENOMEM;
+    }
+
+    lock_buffer(bh);
+    memcpy(bh->b_data, buffer, sb->s_block_size);
+    mark_buffer_dirty(bh);
+    unlock_buffer(bh);
 
     /* Write the block */
-    ssize_t ret = device_write(sb->s_blockdev, buffer, sb->s_block_size, offset);
+    int ret = sync_dirty_buffer(bh);
+
+    brelse(bh);
 
-    if (ret != sb->s_block_size) {
+    if (ret < 0) {
         printk(KERN_ERR "EXT2: Failed to write block %u\n", block);
-        return -EIO;
     }
 
-    return 0;
+    return ret;
 }
 
 /**
- * Read the superblock from the device
+ * Get a group descriptor
  *
  * @param sb Superblock info
- * @return 0 on success, negative error code on failure
+ * @param group Block group
+ * @param bh Set to the buffer holding the descriptor if not NULL
+ * @return Group descriptor, or NULL if the group does not exist
  */
-static int ext2_read_super(ext2_sb_info_t *sb) {
-    /* Allocate memory for the superblock */
-    sb->s_es = kmalloc(sizeof(ext2_superblock_t), 0);
+ext2_group_desc_t *ext2_get_group_desc(ext2_sb_info_t *sb, u32 group, struct buffer_head **bh) {
+    if (group >= sb->s_groups_count) {
+        printk(KERN_ERR "EXT2: Block group %u out of range\n", group);
+        return NULL;
+    }
 
-    if (sb->s_es == NULL) {
-        printk(KERN_ERR "EXT2: Failed to allocate memory for superblock\n");
-        return -ENOMEM;
+    /* The descriptor blocks stay cached and referenced while mounted */
+    buffer_head_t *gdb = sb->s_group_desc[group / sb->s_desc_per_block];
+
+    if (bh != NULL) {
+        *bh = gdb;
     }
 
+    return (ext2_group_desc_t *)gdb->b_data + group % sb->s_desc_per_block;
+}
+
+/**
+ * Read the superblock and the group descriptors from the device
+ *
+ * Their buffers are held until ext2_release_super(). The superblock info
+ * must have the block device set.
+ *
+ * @param sb Superblock info
+ * @return 0 on success, negative error code on failure
+ */
+int ext2_read_super(ext2_sb_info_t *sb) {
     /* Read the superblock */
-    ssize_t ret = device_read(sb->s_blockdev, sb->s_es, sizeof(ext2_superblock_t), 1024);
+    sb->s_sbh = bread(sb->s_blockdev, EXT2_SUPER_BLOCK, EXT2_SUPER_SIZE);
 
-    if (ret != sizeof(ext2_superblock_t)) {
+    if (sb->s_sbh == NULL) {
         printk(KERN_ERR "EXT2: Failed to read superblock\n");
-        kfree(sb->s_es);
         return -EIO;
     }
 
+    sb->s_es = (ext2_superblock_t *)sb->s_sbh->b_data;
+    spin_lock_init(&sb->s_lock);
+    sb->s_dirty_since = 0;
+    spin_lock_init(&sb->s_dx_lock);
+    mutex_init(&sb->s_dir_lock);
+
     /* Check the magic number */
     if (sb->s_es->s_magic != EXT2_MAGIC) {
         printk(KERN_ERR "EXT2: Invalid magic number: 0x%04x\n", sb->s_es->s_magic);
-        kfree(sb->s_es);
+        ext2_release_super(sb);
         return -EINVAL;
     }
 
+    /* Calculate file system parameters */
+    sb->s_block_size = 1024 << sb->s_es->s_log_block_size;
+    sb->s_inodes_per_block = sb->s_block_size / sb->s_es->s_inode_size;
+    sb->s_blocks_per_group = sb->s_es->s_blocks_per_group;
+    sb->s_inodes_per_group = sb->s_es->s_inodes_per_group;
+    sb->s_itb_per_group = sb->s_inodes_per_group / sb->s_inodes_per_block;
+    sb->s_desc_per_block = sb->s_block_size / sizeof(ext2_group_desc_t);
+    sb->s_groups_count = (sb->s_es->s_blocks_count - sb->s_es->s_first_data_block + sb->s_blocks_per_group - 1) / sb->s_blocks_per_group;
+    sb->s_first_data_block = sb->s_es->s_first_data_block;
+    sb->s_first_ino = sb->s_es->s_first_ino;
+    sb->s_inode_size = sb->s_es->s_inode_size;
+
+    /* Read the group descriptors */
+    u32 gdesc_blocks = (sb->s_groups_count + sb->s_desc_per_block - 1) / sb->s_desc_per_block;
+    u32 gdesc_block = sb->s_first_data_block + 1;
+
+    sb->s_group_desc = kmalloc(gdesc_blocks * sizeof(buffer_head_t *), 0);
+
+    if (sb->s_group_desc == NULL) {
+        printk(KERN_ERR "EXT2: Failed to allocate memory for group descriptors\n");
+        ext2_release_super(sb);
+        return -ENOMEM;
+    }
+
+    for (sb->s_gdb_count = 0; sb->s_gdb_count < gdesc_blocks; sb->s_gdb_count++) {
+        buffer_head_t *bh = bread(sb->s_blockdev, gdesc_block + sb->s_gdb_count, sb->s_block_size);
+
+        if (bh == NULL) {
+            printk(KERN_ERR "EXT2: Failed to read group descriptors\n");
+            ext2_release_super(sb);
+            return -EIO;
+        }
+
+        sb->s_group_desc[sb->s_gdb_count] = bh;
+    }
+
     return 0;
 }
 
+/**
+ * Write back and release the superblock and group descriptor buffers
+ *
+ * Also drops the cached blocks of the device, which must not be in use
+ * by anything else any more.
+ *
+ * @param sb Superblock info
+ */
+void ext2_release_super(ext2_sb_info_t *sb) {
+    ext2_dx_cache_release(sb);
+    
+    if (sb->s_group_desc != NULL) {
+        for (u32 i = 0; i < sb->s_gdb_count; i++) {
+            brelse(sb->s_group_desc[i]);
+        }
+
+        kfree(sb->s_group_desc);
+        sb->s_group_desc = NULL;
+        sb->s_gdb_count = 0;
+    }
+
+    if (sb->s_sbh != NULL) {
+        brelse(sb->s_sbh);
+        sb->s_sbh = NULL;
+        sb->s_es = NULL;
+    }
+
+    sync_blockdev(sb->s_blockdev);
+    invalidate_bdev(sb->s_blockdev);
+}
+
 /**
  * Mount an Ext2 file system
  *
@@ -240,7 +317,7 @@ int ext2_mount(const char *dev, const char *dir, u32 flags) {
     memset(sb, 0, sizeof(ext2_sb_info_t));
     sb->s_blockdev = blockdev;
 
-    /* Read the superblock */
+    /* Read the superblock and the group descriptors */
     int ret = ext2_read_super(sb);
 
     if (ret < 0) {
@@ -249,54 +326,12 @@ int ext2_mount(const char *dev, const char *dir, u32 flags) {
         return ret;
     }
 
-    /* Calculate file system parameters */
-    sb->s_block_size = 1024 << sb->s_es->s_log_block_size;
-    sb->s_inodes_per_block = sb->s_block_size / sb->s_es->s_inode_size;
-    sb->s_blocks_per_group = sb->s_es->s_blocks_per_group;
-    sb->s_inodes_per_group = sb->s_es->s_inodes_per_group;
-    sb->s_itb_per_group = sb->s_inodes_per_group / sb->s_inodes_per_block;
-    sb->s_desc_per_block = sb->s_block_size / sizeof(ext2_group_desc_t);
-    sb->s_groups_count = (sb->s_es->s_blocks_count - sb->s_es->s_first_data_block + sb->s_blocks_per_group - 1) / sb->s_blocks_per_group;
-    sb->s_first_data_block = sb->s_es->s_first_data_block;
-    sb->s_first_ino = sb->s_es->s_first_ino;
-    sb->s_inode_size = sb->s_es->s_inode_size;
-
-    /* Read the group descriptors */
-    u32 gdesc_blocks = (sb->s_groups_count + sb->s_desc_per_block - 1) / sb->s_desc_per_block;
-    u32 gdesc_size = gdesc_blocks * sb->s_block_size;
-
-    sb->s_group_desc = kmalloc(gdesc_size, 0);
-
-    if (sb->s_group_desc == NULL) {
-        printk(KERN_ERR "EXT2: Failed to allocate memory for group descriptors\n");
-        kfree(sb->s_es);
-        device_close(blockdev);
-        kfree(sb);
-        return -ENOMEM;
-    }
-
-    /* Read the group descriptors */
-    u32 gdesc_block = sb->s_first_data_block + 1;
-
-    for (u32 i = 0; i < gdesc_blocks; i++) {
-        ret = ext2_read_block(sb, gdesc_block + i, (u8 *)sb->s_group_desc + i * sb->s_block_size);
-
-        if (ret < 0) {
-            kfree(sb->s_group_desc);
-            kfree(sb->s_es);
-            device_close(blockdev);
-            kfree(sb);
-            return ret;
-        }
-    }
-
     /* Create a superblock */
     super_block_t *super = kmalloc(sizeof(super_block_t), 0);
 
     if (super == NULL) {
         printk(KERN_ERR "EXT2: Failed to allocate memory for VFS superblock\n");
-        kfree(sb->s_group_desc);
-        kfree(sb->s_es);
+        ext2_release_super(sb);
         device_close(blockdev);
         kfree(sb);
         return -ENOMEM;
@@ -319,8 +354,7 @@ int ext2_mount(const char *dev, const char *dir, u32 flags) {
     if (ret < 0) {
         printk(KERN_ERR "EXT2: Failed to mount file system\n");
         kfree(super);
-        kfree(sb->s_group_desc);
-        kfree(sb->s_es);
+        ext2_release_super(sb);
         device_close(blockdev);
         kfree(sb);
         return ret;
@@ -357,9 +391,8 @@ int ext2_unmount(const char *dir) {
         return ret;
     }
 
-    /* Free the resources */
-    kfree(sb->s_group_desc);
-    kfree(sb->s_es);
+    /* Write back and drop the cached blocks, then free the resources */
+    ext2_release_super(sb);
     device_close(sb->s_blockdev);
     kfree(sb);
     kfree(super);
@@ -8,6 +8,7 @@
 #include <horizon/types.h>
 #include <horizon/fs.h>
 #include <horizon/fs/ext2.h>
+#include <horizon/fs/buffer.h>
 #include <horizon/mm.h>
 #include <horizon/device.h>
 #include <horizon/printk.h>
@@ -58,7 +59,9 @@ error_t ext2_open_file(file_t *file, u32 flags) {
  * @return 0 on success, negative error code on failure
  */
 error_t ext2_close(file_t *file) {
-    /* Nothing to do */
+    /* Give back the blocks preallocated for appending */
+    ext2_discard_prealloc(file->inode);
+    
     return 0;
 }
 
@@ -120,10 +123,24 @@ ssize_t ext2_read(file_t *file, void *buffer, size_t size) {
     
     /* Read the blocks */
     size_t bytes_read = 0;
+    u32 run_phys = 0;
+    u32 run_left = 0;
     
     for (u32 block_num = start_block; block_num <= end_block; block_num++) {
+        /* Map the next run of blocks once the current one is used up */
+        if (run_left == 0) {
+            int count = ext2_get_blocks(file->inode, block_num, end_block - block_num + 1, &run_phys);
+            
+            run_left = count > 0 ? (u32)count : 1;
+        }
+        
         /* Get the physical block number */
-        u32 phys_block = ext2_get_block(file->inode, block_num);
+        u32 phys_block = run_phys;
+        
+        if (run_phys != 0) {
+            run_phys++;
+        }
+        run_left--;
         
         if (phys_block == 0) {
             /* Sparse file, fill with zeros */
@@ -339,6 +356,16 @@ error_t ext2_fsync(file_t *file) {
     /* Get the superblock */
     super_block_t *sb = file->dentry->inode->i_ops->get_super(file->dentry->inode);
     
-    /* Write the inode */
-    return ext2_write_inode(sb, file->inode);
+    /* Get the Ext2 superblock info */
+    ext2_sb_info_t *sbi = (ext2_sb_info_t *)sb->fs_data;
+    
+    /* Update the inode in its buffer */
+    error_t ret = ext2_write_inode(sb, file->inode);
+    
+    if (ret < 0) {
+        return ret;
+    }
+    
+    /* Write back the inode table, bitmaps and descriptors of the device */
+    return sync_blockdev(sbi->s_blockdev);
 }
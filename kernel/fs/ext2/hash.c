@@ -0,0 +1,249 @@
+/**
+ * hash.c - Ext2 directory index hash functions
+ *
+ * This file contains the name hashes used by hashed directory indexes. They
+ * must match the ones of the dir_index feature bit for bit, so that indexes
+ * written by other implementations can be read and the other way around.
+ */
+
+#include <horizon/kernel.h>
+#include <horizon/types.h>
+#include <horizon/fs.h>
+#include <horizon/fs/ext2.h>
+#include <horizon/string.h>
+
+/* Define NULL if not defined */
+#ifndef NULL
+#define NULL ((void *)0)
+#endif
+
+/* Hash that stands for the end of the directory, never returned for a name */
+#define EXT2_HTREE_EOF 0x7FFFFFFFU
+
+/* TEA key schedule constant */
+#define TEA_DELTA 0x9E3779B9
+
+/* Half MD4 round functions and constants */
+#define MD4_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MD4_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define MD4_H(x, y, z) ((x) ^ (y) ^ (z))
+#define MD4_ROUND(f, a, b, c, d, x, s) \
+    (a += f(b, c, d) + (x), a = (a << (s)) | (a >> (32 - (s))))
+#define MD4_K1 0
+#define MD4_K2 013240474631UL
+#define MD4_K3 015666365641UL
+
+/**
+ * Mix a block of a name into a TEA hash
+ *
+ * @param buf Hash state
+ * @param in Block of the name
+ */
+static void ext2_tea_transform(u32 buf[4], const u32 in[4]) {
+    u32 sum = 0;
+    u32 b0 = buf[0], b1 = buf[1];
+    u32 a = in[0], b = in[1], c = in[2], d = in[3];
+    
+    for (int n = 0; n < 16; n++) {
+        sum += TEA_DELTA;
+        b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+        b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+    }
+    
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+/**
+ * Mix a block of a name into a half MD4 hash
+ *
+ * @param buf Hash state
+ * @param in Block of the name
+ */
+static void ext2_half_md4_transform(u32 buf[4], const u32 in[8]) {
+    u32 a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+    
+    /* Round 1 */
+    MD4_ROUND(MD4_F, a, b, c, d, in[0] + MD4_K1, 3);
+    MD4_ROUND(MD4_F, d, a, b, c, in[1] + MD4_K1, 7);
+    MD4_ROUND(MD4_F, c, d, a, b, in[2] + MD4_K1, 11);
+    MD4_ROUND(MD4_F, b, c, d, a, in[3] + MD4_K1, 19);
+    MD4_ROUND(MD4_F, a, b, c, d, in[4] + MD4_K1, 3);
+    MD4_ROUND(MD4_F, d, a, b, c, in[5] + MD4_K1, 7);
+    MD4_ROUND(MD4_F, c, d, a, b, in[6] + MD4_K1, 11);
+    MD4_ROUND(MD4_F, b, c, d, a, in[7] + MD4_K1, 19);
+    
+    /* Round 2 */
+    MD4_ROUND(MD4_G, a, b, c, d, in[1] + MD4_K2, 3);
+    MD4_ROUND(MD4_G, d, a, b, c, in[3] + MD4_K2, 5);
+    MD4_ROUND(MD4_G, c, d, a, b, in[5] + MD4_K2, 9);
+    MD4_ROUND(MD4_G, b, c, d, a, in[7] + MD4_K2, 13);
+    MD4_ROUND(MD4_G, a, b, c, d, in[0] + MD4_K2, 3);
+    MD4_ROUND(MD4_G, d, a, b, c, in[2] + MD4_K2, 5);
+    MD4_ROUND(MD4_G, c, d, a, b, in[4] + MD4_K2, 9);
+    MD4_ROUND(MD4_G, b, c, d, a, in[6] + MD4_K2, 13);
+    
+    /* Round 3 */
+    MD4_ROUND(MD4_H, a, b, c, d, in[3] + MD4_K3, 3);
+    MD4_ROUND(MD4_H, d, a, b, c, in[7] + MD4_K3, 9);
+    MD4_ROUND(MD4_H, c, d, a, b, in[2] + MD4_K3, 11);
+    MD4_ROUND(MD4_H, b, c, d, a, in[6] + MD4_K3, 15);
+    MD4_ROUND(MD4_H, a, b, c, d, in[1] + MD4_K3, 3);
+    MD4_ROUND(MD4_H, d, a, b, c, in[5] + MD4_K3, 9);
+    MD4_ROUND(MD4_H, c, d, a, b, in[0] + MD4_K3, 11);
+    MD4_ROUND(MD4_H, b, c, d, a, in[4] + MD4_K3, 15);
+    
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+/**
+ * Compute the legacy hash of a name
+ *
+ * @param name Name
+ * @param len Length of the name
+ * @param is_unsigned Whether the characters of the name are unsigned
+ * @return Hash
+ */
+static u32 ext2_legacy_hash(const char *name, u32 len, int is_unsigned) {
+    u32 hash, hash0 = 0x12A3FE2D, hash1 = 0x37ABE8F9;
+    
+    for (u32 i = 0; i < len; i++) {
+        int c = is_unsigned ? (int)(unsigned char)name[i] : (int)(signed char)name[i];
+        
+        hash = hash1 + (hash0 ^ (u32)(c * 7152373));
+        
+        if (hash & 0x80000000) {
+            hash -= 0x7FFFFFFF;
+        }
+        
+        hash1 = hash0;
+        hash0 = hash;
+    }
+    
+    return hash0 << 1;
+}
+
+/**
+ * Pack the start of a name into hash input words
+ *
+ * Words past the end of the name are filled with a pad derived from the
+ * length.
+ *
+ * @param name Name
+ * @param len Remaining length of the name
+ * @param buf Words to fill
+ * @param num Number of words
+ * @param is_unsigned Whether the characters of the name are unsigned
+ */
+static void ext2_str2hashbuf(const char *name, u32 len, u32 *buf, int num, int is_unsigned) {
+    u32 pad = len | (len << 8);
+    pad |= pad << 16;
+    
+    u32 val = pad;
+    
+    if (len > (u32)num * 4) {
+        len = num * 4;
+    }
+    
+    for (u32 i = 0; i < len; i++) {
+        int c = is_unsigned ? (int)(unsigned char)name[i] : (int)(signed char)name[i];
+        
+        val = (u32)c + (val << 8);
+        
+        if ((i % 4) == 3) {
+            *buf++ = val;
+            val = pad;
+            num--;
+        }
+    }
+    
+    if (--num >= 0) {
+        *buf++ = val;
+    }
+    
+    while (--num >= 0) {
+        *buf++ = pad;
+    }
+}
+
+/**
+ * Compute the directory index hash of a name
+ *
+ * The hash version and the seed are taken from hinfo, the major and minor
+ * hashes are stored back into it. The low bit of the major hash is always
+ * clear, it marks collisions in the index.
+ *
+ * @param name Name
+ * @param len Length of the name
+ * @param hinfo Hash information
+ */
+void ext2_dirhash(const char *name, u32 len, ext2_dx_hash_info_t *hinfo) {
+    u32 hash = 0;
+    u32 minor_hash = 0;
+    u32 in[8];
+    int is_unsigned = 0;
+    
+    /* Start from the default seed, unless one is set */
+    u32 buf[4] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476 };
+    
+    if (hinfo->seed != NULL) {
+        for (int i = 0; i < 4; i++) {
+            if (hinfo->seed[i] != 0) {
+                memcpy(buf, hinfo->seed, sizeof(buf));
+                break;
+            }
+        }
+    }
+    
+    switch (hinfo->hash_version) {
+        case EXT2_HASH_LEGACY_UNSIGNED:
+            is_unsigned = 1;
+            /* Fall through */
+        case EXT2_HASH_LEGACY:
+            hash = ext2_legacy_hash(name, len, is_unsigned);
+            break;
+        
+        case EXT2_HASH_HALF_MD4_UNSIGNED:
+            is_unsigned = 1;
+            /* Fall through */
+        case EXT2_HASH_HALF_MD4:
+            for (const char *p = name; len > 0; p += 32) {
+                ext2_str2hashbuf(p, len, in, 8, is_unsigned);
+                ext2_half_md4_transform(buf, in);
+                len = len > 32 ? len - 32 : 0;
+            }
+            
+            hash = buf[1];
+            minor_hash = buf[2];
+            break;
+        
+        case EXT2_HASH_TEA_UNSIGNED:
+            is_unsigned = 1;
+            /* Fall through */
+        case EXT2_HASH_TEA:
+            for (const char *p = name; len > 0; p += 16) {
+                ext2_str2hashbuf(p, len, in, 4, is_unsigned);
+                ext2_tea_transform(buf, in);
+                len = len > 16 ? len - 16 : 0;
+            }
+            
+            hash = buf[0];
+            minor_hash = buf[1];
+            break;
+        
+        default:
+            break;
+    }
+    
+    hash &= ~1;
+    
+    if (hash == (EXT2_HTREE_EOF << 1)) {
+        hash = (EXT2_HTREE_EOF - 1) << 1;
+    }
+    
+    hinfo->hash = hash;
+    hinfo->minor_hash = minor_hash;
+}
@@ -8,6 +8,7 @@
 #include <horizon/types.h>
 #include <horizon/fs.h>
 #include <horizon/fs/ext2.h>
+#include <horizon/fs/buffer.h>
 #include <horizon/mm.h>
 #include <horizon/device.h>
 #include <horizon/printk.h>
@@ -17,8 +18,6 @@
 
 /* External declarations */
 extern struct inode_operations ext2_inode_ops;
-extern int ext2_read_block(ext2_sb_info_t *sb, u32 block, void *buffer);
-extern int ext2_write_block(ext2_sb_info_t *sb, u32 block, void *buffer);
 
 /* Define NULL if not defined */
 #ifndef NULL
@@ -52,6 +51,7 @@ struct inode *ext2_alloc_inode(struct super_block *sb) {
     /* Initialize the inode */
     memset(inode, 0, sizeof(inode_t));
     memset(ei, 0, sizeof(ext2_inode_info_t));
+    spin_lock_init(&ei->i_map_lock);
 
     /* Set the inode operations */
     inode->i_ops = &ext2_inode_ops;
@@ -73,6 +73,11 @@ void ext2_destroy_inode(struct super_block *sb, struct inode *inode) {
     if (inode->fs_data != NULL) {
         ext2_inode_info_t *ei = (ext2_inode_info_t *)inode->fs_data;
 
+        /* Give back the blocks preallocated for appending */
+        if (ei->i_prealloc_count != 0) {
+            ext2_discard_prealloc(inode);
+        }
+
         if (ei->i_e2i != NULL) {
             kfree(ei->i_e2i);
         }
@@ -104,26 +109,24 @@ error_t ext2_read_inode(struct super_block *sb, struct inode *inode) {
     /* Calculate the index within the block group */
     u32 index = (inode->inode_num - 1) % sbi->s_inodes_per_group;
 
+    /* Get the group descriptor */
+    ext2_group_desc_t *gdp = ext2_get_group_desc(sbi, block_group, NULL);
+
+    if (gdp == NULL) {
+        return -EIO;
+    }
+
     /* Calculate the block containing the inode */
-    u32 block = sbi->s_group_desc[block_group].bg_inode_table + (index * sbi->s_inode_size) / sbi->s_block_size;
+    u32 block = gdp->bg_inode_table + (index * sbi->s_inode_size) / sbi->s_block_size;
 
     /* Calculate the offset within the block */
     u32 offset = (index * sbi->s_inode_size) % sbi->s_block_size;
 
-    /* Allocate memory for the block */
-    void *buffer = kmalloc(sbi->s_block_size, 0);
+    /* Read the block of the inode table */
+    buffer_head_t *bh = bread(sbi->s_blockdev, block, sbi->s_block_size);
 
-    if (buffer == NULL) {
-        printk(KERN_ERR "EXT2: Failed to allocate memory for block\n");
-        return -ENOMEM;
-    }
-
-    /* Read the block */
-    int ret = ext2_read_block(sbi, block, buffer);
-
-    if (ret < 0) {
-        kfree(buffer);
-        return ret;
+    if (bh == NULL) {
+        return -EIO;
     }
 
     /* Allocate memory for the Ext2 inode */
@@ -131,15 +134,17 @@ error_t ext2_read_inode(struct super_block *sb, struct inode *inode) {
 
     if (ei->i_e2i == NULL) {
         printk(KERN_ERR "EXT2: Failed to allocate memory for Ext2 inode\n");
-        kfree(buffer);
+        brelse(bh);
         return -ENOMEM;
     }
 
     /* Copy the inode */
-    memcpy(ei->i_e2i, (u8 *)buffer + offset, sizeof(ext2_inode_t));
+    lock_buffer(bh);
+    memcpy(ei->i_e2i, bh->b_data + offset, sizeof(ext2_inode_t));
+    unlock_buffer(bh);
 
-    /* Free the buffer */
-    kfree(buffer);
+    /* Release the block */
+    brelse(bh);
 
     /* Set the inode fields */
     inode->type = (ei->i_e2i->i_mode & EXT2_S_IFMT) == EXT2_S_IFREG ? FILE_TYPE_REGULAR :
@@ -197,26 +202,24 @@ error_t ext2_write_inode(struct super_block *sb, struct inode *inode) {
     /* Calculate the index within the block group */
     u32 index = (inode->inode_num - 1) % sbi->s_inodes_per_group;
 
+    /* Get the group descriptor */
+    ext2_group_desc_t *gdp = ext2_get_group_desc(sbi, block_group, NULL);
+
+    if (gdp == NULL) {
+        return -EIO;
+    }
+
     /* Calculate the block containing the inode */
-    u32 block = sbi->s_group_desc[block_group].bg_inode_table + (index * sbi->s_inode_size) / sbi->s_block_size;
+    u32 block = gdp->bg_inode_table + (index * sbi->s_inode_size) / sbi->s_block_size;
 
     /* Calculate the offset within the block */
     u32 offset = (index * sbi->s_inode_size) % sbi->s_block_size;
 
-    /* Allocate memory for the block */
-    void *buffer = kmalloc(sbi->s_block_size, 0);
+    /* Read the block of the inode table */
+    buffer_head_t *bh = bread(sbi->s_blockdev, block, sbi->s_block_size);
 
-    if (buffer == NULL) {
-        printk(KERN_ERR "EXT2: Failed to allocate memory for block\n");
-        return -ENOMEM;
-    }
-
-    /* Read the block */
-    int ret = ext2_read_block(sbi, block, buffer);
-
-    if (ret < 0) {
-        kfree(buffer);
-        return ret;
+    if (bh == NULL) {
+        return -EIO;
     }
 
     /* Update the Ext2 inode */
@@ -248,16 +251,16 @@ error_t ext2_write_inode(struct super_block *sb, struct inode *inode) {
     ei->i_e2i->i_dir_acl = ei->i_dir_acl;
     ei->i_e2i->i_dtime = ei->i_dtime;
 
-    /* Copy the inode to the buffer */
-    memcpy((u8 *)buffer + offset, ei->i_e2i, sizeof(ext2_inode_t));
+    /* Copy the inode to the buffer, the other inodes of the block stay as cached */
+    lock_buffer(bh);
+    memcpy(bh->b_data + offset, ei->i_e2i, sizeof(ext2_inode_t));
+    mark_buffer_dirty(bh);
+    unlock_buffer(bh);
 
-    /* Write the block */
-    ret = ext2_write_block(sbi, block, buffer);
+    /* Release the block, it is written back with the other metadata on sync */
+    brelse(bh);
 
-    /* Free the buffer */
-    kfree(buffer);
-
-    return ret;
+    return 0;
 }
 
 /**
@@ -8,6 +8,7 @@
 #include <horizon/types.h>
 #include <horizon/fs.h>
 #include <horizon/fs/ext2.h>
+#include <horizon/fs/buffer.h>
 #include <horizon/mm.h>
 #include <horizon/device.h>
 #include <horizon/printk.h>
@@ -38,9 +39,6 @@ u32 ext2_new_inode(struct inode *dir) {
     /* Get the Ext2 superblock info */
     ext2_sb_info_t *sbi = (ext2_sb_info_t *)sb->fs_data;
     
-    /* Calculate the block size */
-    u32 block_size = sbi->s_block_size;
-    
     /* Check if there are any free inodes */
     if (sbi->s_es->s_free_inodes_count == 0) {
         printk(KERN_ERR "EXT2: No free inodes\n");
@@ -50,82 +48,67 @@ u32 ext2_new_inode(struct inode *dir) {
     /* Get the Ext2 inode info */
     ext2_inode_info_t *ei = (ext2_inode_info_t *)dir->fs_data;
     
-    /* Try to allocate an inode in the same block group as the directory */
-    u32 group = ei->i_block_group;
-    
-    /* Check if there are any free inodes in this group */
-    if (sbi->s_group_desc[group].bg_free_inodes_count == 0) {
-        /* Try to find a group with free inodes */
-        for (u32 i = 0; i < sbi->s_groups_count; i++) {
-            if (sbi->s_group_desc[i].bg_free_inodes_count > 0) {
-                group = i;
-                break;
-            }
+    /* Try the directory's block group first, then the following ones */
+    for (u32 n = 0; n < sbi->s_groups_count; n++) {
+        u32 group = (ei->i_block_group + n) % sbi->s_groups_count;
+        
+        /* Get the group descriptor */
+        buffer_head_t *gd_bh;
+        ext2_group_desc_t *gdp = ext2_get_group_desc(sbi, group, &gd_bh);
+        
+        /* Skip groups without a descriptor and full groups without reading their bitmap */
+        if (gdp == NULL || gdp->bg_free_inodes_count == 0) {
+            continue;
         }
         
-        /* Check if we found a group */
-        if (sbi->s_group_desc[group].bg_free_inodes_count == 0) {
-            printk(KERN_ERR "EXT2: No free inodes\n");
+        /* Read the inode bitmap */
+        buffer_head_t *bitmap_bh = bread(sbi->s_blockdev, gdp->bg_inode_bitmap, sbi->s_block_size);
+        
+        if (bitmap_bh == NULL) {
             return 0;
         }
-    }
-    
-    /* Allocate memory for the inode bitmap */
-    u8 *bitmap = kmalloc(block_size, 0);
-    
-    if (bitmap == NULL) {
-        printk(KERN_ERR "EXT2: Failed to allocate memory for inode bitmap\n");
-        return 0;
-    }
-    
-    /* Read the inode bitmap */
-    int ret = ext2_read_block(sbi, sbi->s_group_desc[group].bg_inode_bitmap, bitmap);
-    
-    if (ret < 0) {
-        kfree(bitmap);
-        return 0;
-    }
-    
-    /* Find a free inode */
-    for (u32 i = 0; i < sbi->s_inodes_per_group; i++) {
-        /* Check if the inode is free */
-        if (!(bitmap[i / 8] & (1 << (i % 8)))) {
-            /* Mark the inode as used */
-            bitmap[i / 8] |= (1 << (i % 8));
-            
-            /* Write the inode bitmap */
-            ret = ext2_write_block(sbi, sbi->s_group_desc[group].bg_inode_bitmap, bitmap);
-            
-            if (ret < 0) {
-                kfree(bitmap);
-                return 0;
-            }
-            
-            /* Free the bitmap */
-            kfree(bitmap);
-            
-            /* Update the group descriptor */
-            sbi->s_group_desc[group].bg_free_inodes_count--;
-            
-            /* Update the superblock */
-            sbi->s_es->s_free_inodes_count--;
-            
-            /* Write the superblock */
-            ret = ext2_write_super(sb);
-            
-            if (ret < 0) {
-                return 0;
-            }
-            
-            /* Calculate the inode number */
-            u32 ino = group * sbi->s_inodes_per_group + i + 1;
-            
-            return ino;
+        
+        u8 *bitmap = bitmap_bh->b_data;
+        
+        /* The bitmap is updated in place, under its buffer lock */
+        lock_buffer(bitmap_bh);
+        
+        /* Find a free inode */
+        u32 i = ext2_find_next_zero_bit(bitmap, sbi->s_inodes_per_group, 0);
+        
+        if (i >= sbi->s_inodes_per_group) {
+            unlock_buffer(bitmap_bh);
+            brelse(bitmap_bh);
+            continue;
         }
+        
+        /* Mark the inode as used, the bitmap is written back later */
+        bitmap[i / 8] |= (1 << (i % 8));
+        mark_buffer_dirty(bitmap_bh);
+        unlock_buffer(bitmap_bh);
+        brelse(bitmap_bh);
+        
+        /* Update the group descriptor */
+        lock_buffer(gd_bh);
+        gdp->bg_free_inodes_count--;
+        mark_buffer_dirty(gd_bh);
+        unlock_buffer(gd_bh);
+        
+        /* Update the superblock */
+        spin_lock(&sbi->s_lock);
+        sbi->s_es->s_free_inodes_count--;
+        spin_unlock(&sbi->s_lock);
+        
+        ext2_mark_super_dirty(sb);
+        
+        /* Calculate the inode number */
+        u32 ino = group * sbi->s_inodes_per_group + i + 1;
+        
+        return ino;
     }
     
     /* No free inodes found */
-    kfree(bitmap);
+    printk(KERN_ERR "EXT2: No free inodes\n");
     
     return 0;
 }
@@ -150,61 +133,60 @@ int ext2_free_inode(struct inode *dir, u32 ino) {
     /* Get the Ext2 superblock info */
     ext2_sb_info_t *sbi = (ext2_sb_info_t *)sb->fs_data;
     
-    /* Calculate the block size */
-    u32 block_size = sbi->s_block_size;
-    
     /* Calculate the block group */
     u32 group = (ino - 1) / sbi->s_inodes_per_group;
     
     /* Calculate the index within the block group */
     u32 index = (ino - 1) % sbi->s_inodes_per_group;
     
-    /* Allocate memory for the inode bitmap */
-    u8 *bitmap = kmalloc(block_size, 0);
+    /* Get the group descriptor */
+    buffer_head_t *gd_bh;
+    ext2_group_desc_t *gdp = ext2_get_group_desc(sbi, group, &gd_bh);
     
-    if (bitmap == NULL) {
-        printk(KERN_ERR "EXT2: Failed to allocate memory for inode bitmap\n");
-        return -ENOMEM;
+    if (gdp == NULL) {
+        return -EINVAL;
     }
     
     /* Read the inode bitmap */
-    int ret = ext2_read_block(sbi, sbi->s_group_desc[group].bg_inode_bitmap, bitmap);
+    buffer_head_t *bitmap_bh = bread(sbi->s_blockdev, gdp->bg_inode_bitmap, sbi->s_block_size);
     
-    if (ret < 0) {
-        kfree(bitmap);
-        return ret;
+    if (bitmap_bh == NULL) {
+        return -EIO;
     }
     
+    u8 *bitmap = bitmap_bh->b_data;
+    
+    lock_buffer(bitmap_bh);
+    
     /* Check if the inode is already free */
     if (!(bitmap[index / 8] & (1 << (index % 8)))) {
-        kfree(bitmap);
+        unlock_buffer(bitmap_bh);
+        brelse(bitmap_bh);
         return 0;
     }
     
-    /* Mark the inode as free */
+    /* Mark the inode as free, the bitmap is written back later */
     bitmap[index / 8] &= ~(1 << (index % 8));
+    mark_buffer_dirty(bitmap_bh);
+    unlock_buffer(bitmap_bh);
     
-    /* Write the inode bitmap */
-    ret = ext2_write_block(sbi, sbi->s_group_desc[group].bg_inode_bitmap, bitmap);
-    
-    if (ret < 0) {
-        kfree(bitmap);
-        return ret;
-    }
-    
-    /* Free the bitmap */
-    kfree(bitmap);
+    /* Release the bitmap */
+    brelse(bitmap_bh);
     
     /* Update the group descriptor */
-    sbi->s_group_desc[group].bg_free_inodes_count++;
+    lock_buffer(gd_bh);
+    gdp->bg_free_inodes_count++;
+    mark_buffer_dirty(gd_bh);
+    unlock_buffer(gd_bh);
     
     /* Update the superblock */
+    spin_lock(&sbi->s_lock);
     sbi->s_es->s_free_inodes_count++;
+    spin_unlock(&sbi->s_lock);
     
-    /* Write the superblock */
-    ret = ext2_write_super(sb);
+    ext2_mark_super_dirty(sb);
     
-    return ret;
+    return 0;
 }
 
 /**
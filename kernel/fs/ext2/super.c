@@ -8,11 +8,13 @@
 #include <horizon/types.h>
 #include <horizon/fs.h>
 #include <horizon/fs/ext2.h>
+#include <horizon/fs/buffer.h>
 #include <horizon/mm.h>
 #include <horizon/device.h>
 #include <horizon/printk.h>
 #include <horizon/errno.h>
 #include <horizon/string.h>
+#include <horizon/timer.h>
 
 /* Define NULL if not defined */
 #ifndef NULL
@@ -29,16 +31,9 @@ error_t ext2_put_super(struct super_block *sb) {
     /* Get the Ext2 superblock info */
     ext2_sb_info_t *sbi = (ext2_sb_info_t *)sb->fs_data;
     
-    /* Free the resources */
+    /* Write back and drop the cached blocks, then free the resources */
     if (sbi != NULL) {
-        if (sbi->s_group_desc != NULL) {
-            kfree(sbi->s_group_desc);
-        }
-        
-        if (sbi->s_es != NULL) {
-            kfree(sbi->s_es);
-        }
-        
+        ext2_release_super(sbi);
         kfree(sbi);
     }
     
@@ -58,25 +53,18 @@ error_t ext2_write_super(struct super_block *sb) {
     /* Get the Ext2 superblock info */
     ext2_sb_info_t *sbi = (ext2_sb_info_t *)sb->fs_data;
     
-    /* Write the superblock */
-    ssize_t ret = device_write(sbi->s_blockdev, sbi->s_es, sizeof(ext2_superblock_t), 1024);
+    /* Write back the superblock with the rest of the dirty metadata */
+    spin_lock(&sbi->s_lock);
+    sbi->s_dirty_since = 0;
+    spin_unlock(&sbi->s_lock);
     
-    if (ret != sizeof(ext2_superblock_t)) {
-        printk(KERN_ERR "EXT2: Failed to write superblock\n");
-        return -EIO;
-    }
+    mark_buffer_dirty(sbi->s_sbh);
     
-    /* Write the group descriptors */
-    u32 gdesc_blocks = (sbi->s_groups_count + sbi->s_desc_per_block - 1) / sbi->s_desc_per_block;
-    u32 gdesc_block = sbi->s_first_data_block + 1;
-    
-    for (u32 i = 0; i < gdesc_blocks; i++) {
-        ret = ext2_write_block(sbi, gdesc_block + i, (u8 *)sbi->s_group_desc + i * sbi->s_block_size);
-        
-        if (ret < 0) {
-            printk(KERN_ERR "EXT2: Failed to write group descriptors\n");
-            return ret;
-        }
+    int ret = sync_blockdev(sbi->s_blockdev);
+    
+    if (ret < 0) {
+        printk(KERN_ERR "EXT2: Failed to write superblock\n");
+        return ret;
     }
     
     /* Update the VFS superblock */
@@ -86,6 +74,43 @@ error_t ext2_write_super(struct super_block *sb) {
     return 0;
 }
 
+/**
+ * Mark the superblock dirty after a change of the free counts
+ * 
+ * The superblock and the group descriptors are written back in batches,
+ * with the bitmaps, by ext2_write_super(), fsync and unmount. A change
+ * made more than EXT2_WRITEBACK_DELAY after the oldest unwritten one also
+ * writes the batch back. Must be called without spinlocks or buffer locks
+ * held.
+ * 
+ * @param sb Superblock
+ */
+void ext2_mark_super_dirty(struct super_block *sb) {
+    /* Get the Ext2 superblock info */
+    ext2_sb_info_t *sbi = (ext2_sb_info_t *)sb->fs_data;
+    u64 now = timer_get_jiffies();
+    int flush = 0;
+    
+    mark_buffer_dirty(sbi->s_sbh);
+    
+    /* Update the VFS superblock */
+    sb->free_blocks = sbi->s_es->s_free_blocks_count;
+    sb->free_inodes = sbi->s_es->s_free_inodes_count;
+    
+    /* Start the window at the first change, flush once it has run out */
+    spin_lock(&sbi->s_lock);
+    if (sbi->s_dirty_since == 0) {
+        sbi->s_dirty_since = now ? now : 1;
+    } else if (now - sbi->s_dirty_since >= timer_msecs_to_jiffies(EXT2_WRITEBACK_DELAY)) {
+        flush = 1;
+    }
+    spin_unlock(&sbi->s_lock);
+    
+    if (flush) {
+        ext2_write_super(sb);
+    }
+}
+
 /**
  * Get file system statistics
  * 
@@ -162,7 +187,7 @@ struct super_block *ext2_get_super(const char *dev, u32 flags) {
     memset(sb, 0, sizeof(ext2_sb_info_t));
     sb->s_blockdev = blockdev;
     
-    /* Read the superblock */
+    /* Read the superblock and the group descriptors */
     int ret = ext2_read_super(sb);
     
     if (ret < 0) {
@@ -171,54 +196,12 @@ struct super_block *ext2_get_super(const char *dev, u32 flags) {
         return NULL;
     }
     
-    /* Calculate file system parameters */
-    sb->s_block_size = 1024 << sb->s_es->s_log_block_size;
-    sb->s_inodes_per_block = sb->s_block_size / sb->s_es->s_inode_size;
-    sb->s_blocks_per_group = sb->s_es->s_blocks_per_group;
-    sb->s_inodes_per_group = sb->s_es->s_inodes_per_group;
-    sb->s_itb_per_group = sb->s_inodes_per_group / sb->s_inodes_per_block;
-    sb->s_desc_per_block = sb->s_block_size / sizeof(ext2_group_desc_t);
-    sb->s_groups_count = (sb->s_es->s_blocks_count - sb->s_es->s_first_data_block + sb->s_blocks_per_group - 1) / sb->s_blocks_per_group;
-    sb->s_first_data_block = sb->s_es->s_first_data_block;
-    sb->s_first_ino = sb->s_es->s_first_ino;
-    sb->s_inode_size = sb->s_es->s_inode_size;
-    
-    /* Read the group descriptors */
-    u32 gdesc_blocks = (sb->s_groups_count + sb->s_desc_per_block - 1) / sb->s_desc_per_block;
-    u32 gdesc_size = gdesc_blocks * sb->s_block_size;
-    
-    sb->s_group_desc = kmalloc(gdesc_size, 0);
-    
-    if (sb->s_group_desc == NULL) {
-        printk(KERN_ERR "EXT2: Failed to allocate memory for group descriptors\n");
-        kfree(sb->s_es);
-        device_close(blockdev);
-        kfree(sb);
-        return NULL;
-    }
-    
-    /* Read the group descriptors */
-    u32 gdesc_block = sb->s_first_data_block + 1;
-    
-    for (u32 i = 0; i < gdesc_blocks; i++) {
-        ret = ext2_read_block(sb, gdesc_block + i, (u8 *)sb->s_group_desc + i * sb->s_block_size);
-        
-        if (ret < 0) {
-            kfree(sb->s_group_desc);
-            kfree(sb->s_es);
-            device_close(blockdev);
-            kfree(sb);
-            return NULL;
-        }
-    }
-    
     /* Create a superblock */
     super_block_t *super = kmalloc(sizeof(super_block_t), 0);
     
     if (super == NULL) {
         printk(KERN_ERR "EXT2: Failed to allocate memory for VFS superblock\n");
-        kfree(sb->s_group_desc);
-        kfree(sb->s_es);
+        ext2_release_super(sb);
         device_close(blockdev);
         kfree(sb);
         return NULL;
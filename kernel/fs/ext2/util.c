@@ -8,6 +8,7 @@
 #include <horizon/types.h>
 #include <horizon/fs.h>
 #include <horizon/fs/ext2.h>
+#include <horizon/fs/buffer.h>
 #include <horizon/mm.h>
 #include <horizon/device.h>
 #include <horizon/printk.h>
@@ -20,27 +21,202 @@
 #endif
 
 /**
- * Get the physical block number for a logical block
+ * Read an entry of an indirect block
  * 
- * @param inode Inode
+ * @param sbi Ext2 superblock info
+ * @param block Indirect block number
+ * @param index Index of the entry
+ * @return Block number in the entry, or 0 if not allocated or on failure
+ */
+static u32 ext2_read_indirect(ext2_sb_info_t *sbi, u32 block, u32 index) {
+    if (block == 0) {
+        return 0;
+    }
+    
+    /* Read the indirect block, usually from the cache */
+    buffer_head_t *bh = bread(sbi->s_blockdev, block, sbi->s_block_size);
+    
+    if (bh == NULL) {
+        return 0;
+    }
+    
+    u32 entry = ((u32 *)bh->b_data)[index];
+    
+    brelse(bh);
+    
+    return entry;
+}
+
+/**
+ * Set an entry of an indirect block
+ * 
+ * @param sbi Ext2 superblock info
+ * @param block Indirect block number
+ * @param index Index of the entry
+ * @param value Block number to store
+ * @return 0 on success, negative error code on failure
+ */
+static int ext2_write_indirect(ext2_sb_info_t *sbi, u32 block, u32 index, u32 value) {
+    /* Read the indirect block */
+    buffer_head_t *bh = bread(sbi->s_blockdev, block, sbi->s_block_size);
+    
+    if (bh == NULL) {
+        return -EIO;
+    }
+    
+    /* Update the entry in place, it is written back on sync */
+    lock_buffer(bh);
+    ((u32 *)bh->b_data)[index] = value;
+    mark_buffer_dirty(bh);
+    unlock_buffer(bh);
+    
+    brelse(bh);
+    
+    return 0;
+}
+
+/**
+ * Look up a logical block in the cached mapping runs
+ * 
+ * The caller must hold the mapping lock.
+ * 
+ * @param ei Ext2 inode info
  * @param block Logical block number
- * @return Physical block number, or 0 if not allocated
+ * @param max_blocks Most blocks to map
+ * @param phys Set to the first physical block
+ * @return Number of contiguous blocks mapped, 0 if not cached
  */
-u32 ext2_get_block(struct inode *inode, u32 block) {
+static u32 ext2_map_lookup(ext2_inode_info_t *ei, u32 block, u32 max_blocks, u32 *phys) {
+    for (int i = 0; i < EXT2_MAP_CACHE_SIZE; i++) {
+        ext2_map_run_t *run = &ei->i_map[i];
+        
+        if (run->len != 0 && block >= run->lblk && block - run->lblk < run->len) {
+            u32 offset = block - run->lblk;
+            u32 count = run->len - offset;
+            
+            *phys = run->pblk + offset;
+            
+            return count < max_blocks ? count : max_blocks;
+        }
+    }
+    
+    return 0;
+}
+
+/**
+ * Add a mapping run to the cache
+ * 
+ * A run that continues a cached one, as appends and sequential lookups
+ * find them, extends it. Otherwise it replaces the cached runs it overlaps,
+ * or the oldest one.
+ * 
+ * @param ei Ext2 inode info
+ * @param block First logical block
+ * @param phys First physical block
+ * @param count Number of blocks
+ */
+static void ext2_map_insert(ext2_inode_info_t *ei, u32 block, u32 phys, u32 count) {
+    ext2_map_run_t *slot = NULL;
+    
+    spin_lock(&ei->i_map_lock);
+    
+    for (int i = 0; i < EXT2_MAP_CACHE_SIZE; i++) {
+        ext2_map_run_t *run = &ei->i_map[i];
+        
+        if (run->len == 0) {
+            continue;
+        }
+        
+        /* Extend a run this one continues */
+        if (run->lblk + run->len == block && run->pblk + run->len == phys) {
+            run->len += count;
+            spin_unlock(&ei->i_map_lock);
+            return;
+        }
+        
+        /* Drop runs this one overlaps, they are older */
+        if (block < run->lblk + run->len && run->lblk < block + count) {
+            run->len = 0;
+            if (slot == NULL) {
+                slot = run;
+            }
+        }
+    }
+    
+    if (slot == NULL) {
+        slot = &ei->i_map[ei->i_map_next];
+        ei->i_map_next = (ei->i_map_next + 1) % EXT2_MAP_CACHE_SIZE;
+    }
+    
+    slot->lblk = block;
+    slot->pblk = phys;
+    slot->len = count;
+    
+    spin_unlock(&ei->i_map_lock);
+}
+
+/**
+ * Drop the cached mapping runs of an inode
+ * 
+ * Called when blocks of the inode are freed.
+ * 
+ * @param inode Inode
+ */
+void ext2_map_invalidate(struct inode *inode) {
+    ext2_inode_info_t *ei = (ext2_inode_info_t *)inode->fs_data;
+    
+    spin_lock(&ei->i_map_lock);
+    
+    for (int i = 0; i < EXT2_MAP_CACHE_SIZE; i++) {
+        ei->i_map[i].len = 0;
+    }
+    
+    ei->i_map_next = 0;
+    
+    spin_unlock(&ei->i_map_lock);
+}
+
+/**
+ * Map a range of logical blocks
+ * 
+ * Maps the run of contiguous physical blocks starting at a logical block,
+ * reading at most one block of block numbers per level of indirection. The
+ * run ends at a hole, a discontinuity, the end of the block of block
+ * numbers or max_blocks, whichever comes first.
+ * 
+ * @param inode Inode
+ * @param block First logical block
+ * @param max_blocks Most blocks to map
+ * @param phys Set to the first physical block, 0 for a hole
+ * @return Number of blocks mapped, 0 for a hole or on failure
+ */
+int ext2_get_blocks(struct inode *inode, u32 block, u32 max_blocks, u32 *phys) {
     /* Get the Ext2 inode info */
     ext2_inode_info_t *ei = (ext2_inode_info_t *)inode->fs_data;
     
+    *phys = 0;
+    
+    if (max_blocks == 0) {
+        return 0;
+    }
+    
+    /* Check the cached runs first */
+    spin_lock(&ei->i_map_lock);
+    u32 count = ext2_map_lookup(ei, block, max_blocks, phys);
+    spin_unlock(&ei->i_map_lock);
+    
+    if (count > 0) {
+        return count;
+    }
+    
     /* Get the superblock */
     super_block_t *sb = inode->i_ops->get_super(inode);
     
     /* Get the Ext2 superblock info */
     ext2_sb_info_t *sbi = (ext2_sb_info_t *)sb->fs_data;
     
-    /* Calculate the block size */
-    u32 block_size = sbi->s_block_size;
-    
     /* Calculate the number of blocks per indirect block */
-    u32 blocks_per_indirect = block_size / sizeof(u32);
+    u32 blocks_per_indirect = sbi->s_block_size / sizeof(u32);
     
     /* Calculate the number of blocks per double indirect block */
     u32 blocks_per_double_indirect = blocks_per_indirect * blocks_per_indirect;
@@ -48,207 +224,420 @@ u32 ext2_get_block(struct inode *inode, u32 block) {
     /* Calculate the number of blocks per triple indirect block */
     u32 blocks_per_triple_indirect = blocks_per_indirect * blocks_per_double_indirect;
     
-    /* Check if the block is a direct block */
-    if (block < 12) {
-        return ei->i_data[block];
-    }
-    
-    /* Check if the block is in the indirect block */
-    block -= 12;
-    
-    if (block < blocks_per_indirect) {
-        /* Get the indirect block */
-        u32 indirect_block = ei->i_data[12];
-        
-        if (indirect_block == 0) {
+    /* Find the array of block numbers holding the block */
+    buffer_head_t *bh = NULL;
+    u32 *entries;
+    u32 index;
+    u32 limit;
+    u32 rel = block;
+    
+    if (rel < 12) {
+        /* Direct block */
+        entries = ei->i_data;
+        index = rel;
+        limit = 12;
+    } else {
+        u32 leaf;
+        
+        rel -= 12;
+        
+        if (rel < blocks_per_indirect) {
+            /* In the indirect block */
+            leaf = ei->i_data[12];
+        } else if ((rel -= blocks_per_indirect) < blocks_per_double_indirect) {
+            /* In the double indirect block */
+            leaf = ext2_read_indirect(sbi, ei->i_data[13], rel / blocks_per_indirect);
+        } else if ((rel -= blocks_per_double_indirect) < blocks_per_triple_indirect) {
+            /* In the triple indirect block */
+            u32 double_indirect_block = ext2_read_indirect(sbi, ei->i_data[14], rel / blocks_per_double_indirect);
+            
+            leaf = ext2_read_indirect(sbi, double_indirect_block,
+                                      (rel % blocks_per_double_indirect) / blocks_per_indirect);
+        } else {
+            /* Block number is too large */
             return 0;
         }
         
-        /* Allocate memory for the indirect block */
-        u32 *indirect_buffer = kmalloc(block_size, 0);
-        
-        if (indirect_buffer == NULL) {
-            printk(KERN_ERR "EXT2: Failed to allocate memory for indirect block\n");
+        if (leaf == 0) {
             return 0;
         }
         
-        /* Read the indirect block */
-        int ret = ext2_read_block(sbi, indirect_block, indirect_buffer);
+        /* Read the block of block numbers once for the whole run */
+        bh = bread(sbi->s_blockdev, leaf, sbi->s_block_size);
         
-        if (ret < 0) {
-            kfree(indirect_buffer);
+        if (bh == NULL) {
             return 0;
         }
         
-        /* Get the physical block number */
-        u32 phys_block = indirect_buffer[block];
-        
-        /* Free the indirect buffer */
-        kfree(indirect_buffer);
-        
-        return phys_block;
+        entries = (u32 *)bh->b_data;
+        index = rel % blocks_per_indirect;
+        limit = blocks_per_indirect;
     }
     
-    /* Check if the block is in the double indirect block */
-    block -= blocks_per_indirect;
+    /* Collect the run of contiguous physical blocks */
+    u32 first = entries[index];
     
-    if (block < blocks_per_double_indirect) {
-        /* Get the double indirect block */
-        u32 double_indirect_block = ei->i_data[13];
-        
-        if (double_indirect_block == 0) {
-            return 0;
-        }
-        
-        /* Calculate the indices */
-        u32 indirect_index = block / blocks_per_indirect;
-        u32 block_index = block % blocks_per_indirect;
-        
-        /* Allocate memory for the double indirect block */
-        u32 *double_indirect_buffer = kmalloc(block_size, 0);
-        
-        if (double_indirect_buffer == NULL) {
-            printk(KERN_ERR "EXT2: Failed to allocate memory for double indirect block\n");
-            return 0;
-        }
-        
-        /* Read the double indirect block */
-        int ret = ext2_read_block(sbi, double_indirect_block, double_indirect_buffer);
-        
-        if (ret < 0) {
-            kfree(double_indirect_buffer);
-            return 0;
-        }
-        
-        /* Get the indirect block */
-        u32 indirect_block = double_indirect_buffer[indirect_index];
+    if (first != 0) {
+        count = 1;
         
-        /* Free the double indirect buffer */
-        kfree(double_indirect_buffer);
-        
-        if (indirect_block == 0) {
-            return 0;
+        while (count < max_blocks && index + count < limit && entries[index + count] == first + count) {
+            count++;
         }
+    }
+    
+    brelse(bh);
+    
+    if (count == 0) {
+        return 0;
+    }
+    
+    ext2_map_insert(ei, block, first, count);
+    
+    *phys = first;
+    
+    return count;
+}
+
+/**
+ * Get the physical block number for a logical block
+ * 
+ * The whole run around the block is mapped and cached, so that the blocks
+ * after it are found without reading the indirect blocks again.
+ * 
+ * @param inode Inode
+ * @param block Logical block number
+ * @return Physical block number, or 0 if not allocated
+ */
+u32 ext2_get_block(struct inode *inode, u32 block) {
+    u32 phys;
+    
+    if (ext2_get_blocks(inode, block, 0xFFFFFFFF, &phys) <= 0) {
+        return 0;
+    }
+    
+    return phys;
+}
+
+/**
+ * Find the next zero bit in a bitmap
+ * 
+ * Scans 32 bits at a time. The bitmap must be readable in whole words up
+ * to size, as block bitmaps in their buffers are.
+ * 
+ * @param bitmap Bitmap
+ * @param size Number of bits
+ * @param offset Bit to start at
+ * @return Zero bit, or size if there is none
+ */
+u32 ext2_find_next_zero_bit(const u8 *bitmap, u32 size, u32 offset) {
+    const u32 *words = (const u32 *)bitmap;
+    
+    while (offset < size) {
+        /* Treat the bits before the offset as set */
+        u32 word = words[offset / 32] | ((1U << (offset % 32)) - 1);
         
-        /* Allocate memory for the indirect block */
-        u32 *indirect_buffer = kmalloc(block_size, 0);
-        
-        if (indirect_buffer == NULL) {
-            printk(KERN_ERR "EXT2: Failed to allocate memory for indirect block\n");
-            return 0;
+        if (word != 0xFFFFFFFF) {
+            u32 bit = (offset & ~31U) + __builtin_ctz(~word);
+            
+            return bit < size ? bit : size;
         }
         
-        /* Read the indirect block */
-        ret = ext2_read_block(sbi, indirect_block, indirect_buffer);
-        
-        if (ret < 0) {
-            kfree(indirect_buffer);
-            return 0;
+        offset = (offset | 31) + 1;
+    }
+    
+    return size;
+}
+
+/**
+ * Find a goal for a new block of an inode
+ * 
+ * @param inode Inode
+ * @param block Logical block number the block is for
+ * @return Physical block to try first
+ */
+static u32 ext2_find_goal(struct inode *inode, u32 block) {
+    /* Get the Ext2 inode info */
+    ext2_inode_info_t *ei = (ext2_inode_info_t *)inode->fs_data;
+    
+    /* Get the Ext2 superblock info */
+    ext2_sb_info_t *sbi = (ext2_sb_info_t *)inode->i_ops->get_super(inode)->fs_data;
+    
+    u32 phys;
+    
+    /* Right after the block before it, as appends and sequential writes go */
+    if (block > 0 && ext2_get_blocks(inode, block - 1, 1, &phys) > 0) {
+        return phys + 1;
+    }
+    
+    /* Right after the last block allocated */
+    if (ei->i_alloc_goal != 0) {
+        return ei->i_alloc_goal;
+    }
+    
+    /* The start of the inode's block group */
+    return ei->i_block_group * sbi->s_blocks_per_group + sbi->s_first_data_block;
+}
+
+/**
+ * Free a run of blocks in one block group
+ * 
+ * The bitmap and free counts are updated in their buffers and written
+ * back later.
+ * 
+ * @param sb Superblock
+ * @param block First physical block
+ * @param count Number of blocks
+ * @return 0 on success, negative error code on failure
+ */
+static int ext2_free_blocks(super_block_t *sb, u32 block, u32 count) {
+    /* Get the Ext2 superblock info */
+    ext2_sb_info_t *sbi = (ext2_sb_info_t *)sb->fs_data;
+    
+    if (block < sbi->s_first_data_block || block + count > sbi->s_es->s_blocks_count) {
+        printk(KERN_ERR "EXT2: Freeing blocks %u-%u out of range\n", block, block + count - 1);
+        return -EINVAL;
+    }
+    
+    /* Calculate the block group */
+    u32 group = (block - sbi->s_first_data_block) / sbi->s_blocks_per_group;
+    
+    /* Calculate the block index within the group */
+    u32 index = (block - sbi->s_first_data_block) % sbi->s_blocks_per_group;
+    
+    if (index + count > sbi->s_blocks_per_group) {
+        printk(KERN_ERR "EXT2: Freeing blocks %u-%u across groups\n", block, block + count - 1);
+        return -EINVAL;
+    }
+    
+    /* Get the block group */
+    buffer_head_t *gd_bh;
+    ext2_group_desc_t *group_desc = ext2_get_group_desc(sbi, group, &gd_bh);
+    
+    if (group_desc == NULL) {
+        return -EINVAL;
+    }
+    
+    /* Read the block bitmap */
+    buffer_head_t *bitmap_bh = bread(sbi->s_blockdev, group_desc->bg_block_bitmap, sbi->s_block_size);
+    
+    if (bitmap_bh == NULL) {
+        return -EIO;
+    }
+    
+    u8 *bitmap = bitmap_bh->b_data;
+    u32 freed = 0;
+    
+    lock_buffer(bitmap_bh);
+    
+    for (u32 i = index; i < index + count; i++) {
+        /* Blocks already free are left alone */
+        if (bitmap[i / 8] & (1 << (i % 8))) {
+            bitmap[i / 8] &= ~(1 << (i % 8));
+            freed++;
         }
+    }
+    
+    if (freed > 0) {
+        mark_buffer_dirty(bitmap_bh);
+    }
+    
+    unlock_buffer(bitmap_bh);
+    brelse(bitmap_bh);
+    
+    if (freed == 0) {
+        return 0;
+    }
+    
+    /* Update the group descriptor */
+    lock_buffer(gd_bh);
+    group_desc->bg_free_blocks_count += freed;
+    mark_buffer_dirty(gd_bh);
+    unlock_buffer(gd_bh);
+    
+    /* Update the superblock */
+    spin_lock(&sbi->s_lock);
+    sbi->s_es->s_free_blocks_count += freed;
+    spin_unlock(&sbi->s_lock);
+    
+    ext2_mark_super_dirty(sb);
+    
+    return 0;
+}
+
+/**
+ * Give back the blocks preallocated for an inode
+ * 
+ * Called when the file is closed, truncated or its inode destroyed.
+ * 
+ * @param inode Inode
+ */
+void ext2_discard_prealloc(struct inode *inode) {
+    /* Get the Ext2 inode info */
+    ext2_inode_info_t *ei = (ext2_inode_info_t *)inode->fs_data;
+    
+    if (ei == NULL) {
+        return;
+    }
+    
+    /* Take the window */
+    spin_lock(&ei->i_map_lock);
+    u32 block = ei->i_prealloc_block;
+    u32 count = ei->i_prealloc_count;
+    ei->i_prealloc_count = 0;
+    spin_unlock(&ei->i_map_lock);
+    
+    if (count > 0) {
+        ext2_free_blocks(inode->i_ops->get_super(inode), block, count);
+    }
+}
+
+/**
+ * Allocate a new block as close to a goal as possible
+ * 
+ * A block at the goal comes from the inode's preallocation window if
+ * there is one. Otherwise the goal's block group is searched from the
+ * goal on, then the following groups, skipping full ones by their free
+ * counts. Regular files get the free blocks after the new one
+ * preallocated, so that appends stay contiguous without searching again.
+ * 
+ * @param inode Inode
+ * @param goal Physical block to try first
+ * @return Physical block number, or 0 on failure
+ */
+static u32 ext2_new_block_goal(struct inode *inode, u32 goal) {
+    /* Get the Ext2 inode info */
+    ext2_inode_info_t *ei = (ext2_inode_info_t *)inode->fs_data;
+    
+    /* Get the superblock */
+    super_block_t *sb = inode->i_ops->get_super(inode);
+    
+    /* Get the Ext2 superblock info */
+    ext2_sb_info_t *sbi = (ext2_sb_info_t *)sb->fs_data;
+    
+    /* Take the block from the preallocation window if it is the goal */
+    spin_lock(&ei->i_map_lock);
+    
+    if (ei->i_prealloc_count != 0 && ei->i_prealloc_block == goal) {
+        u32 phys = ei->i_prealloc_block++;
         
-        /* Get the physical block number */
-        u32 phys_block = indirect_buffer[block_index];
+        ei->i_prealloc_count--;
+        ei->i_alloc_goal = phys + 1;
         
-        /* Free the indirect buffer */
-        kfree(indirect_buffer);
+        spin_unlock(&ei->i_map_lock);
         
-        return phys_block;
+        return phys;
     }
     
-    /* Check if the block is in the triple indirect block */
-    block -= blocks_per_double_indirect;
+    spin_unlock(&ei->i_map_lock);
     
-    if (block < blocks_per_triple_indirect) {
-        /* Get the triple indirect block */
-        u32 triple_indirect_block = ei->i_data[14];
-        
-        if (triple_indirect_block == 0) {
-            return 0;
-        }
-        
-        /* Calculate the indices */
-        u32 double_indirect_index = block / blocks_per_double_indirect;
-        u32 indirect_index = (block % blocks_per_double_indirect) / blocks_per_indirect;
-        u32 block_index = block % blocks_per_indirect;
+    /* The file is not written where the window is any more */
+    ext2_discard_prealloc(inode);
+    
+    /* Check if there are any free blocks */
+    if (sbi->s_es->s_free_blocks_count == 0) {
+        printk(KERN_ERR "EXT2: No free blocks\n");
+        return 0;
+    }
+    
+    if (goal < sbi->s_first_data_block || goal >= sbi->s_es->s_blocks_count) {
+        goal = sbi->s_first_data_block;
+    }
+    
+    u32 goal_group = (goal - sbi->s_first_data_block) / sbi->s_blocks_per_group;
+    
+    for (u32 n = 0; n < sbi->s_groups_count; n++) {
+        u32 group = (goal_group + n) % sbi->s_groups_count;
         
-        /* Allocate memory for the triple indirect block */
-        u32 *triple_indirect_buffer = kmalloc(block_size, 0);
+        /* Get the block group */
+        buffer_head_t *gd_bh;
+        ext2_group_desc_t *group_desc = ext2_get_group_desc(sbi, group, &gd_bh);
         
-        if (triple_indirect_buffer == NULL) {
-            printk(KERN_ERR "EXT2: Failed to allocate memory for triple indirect block\n");
-            return 0;
+        /* Skip groups without a descriptor and full groups without reading their bitmap */
+        if (group_desc == NULL || group_desc->bg_free_blocks_count == 0) {
+            continue;
         }
         
-        /* Read the triple indirect block */
-        int ret = ext2_read_block(sbi, triple_indirect_block, triple_indirect_buffer);
+        /* The last group may be shorter than the others */
+        u32 group_first = group * sbi->s_blocks_per_group + sbi->s_first_data_block;
+        u32 group_size = sbi->s_es->s_blocks_count - group_first;
         
-        if (ret < 0) {
-            kfree(triple_indirect_buffer);
-            return 0;
+        if (group_size > sbi->s_blocks_per_group) {
+            group_size = sbi->s_blocks_per_group;
         }
         
-        /* Get the double indirect block */
-        u32 double_indirect_block = triple_indirect_buffer[double_indirect_index];
-        
-        /* Free the triple indirect buffer */
-        kfree(triple_indirect_buffer);
+        /* Read the block bitmap */
+        buffer_head_t *bitmap_bh = bread(sbi->s_blockdev, group_desc->bg_block_bitmap, sbi->s_block_size);
         
-        if (double_indirect_block == 0) {
+        if (bitmap_bh == NULL) {
             return 0;
         }
         
-        /* Allocate memory for the double indirect block */
-        u32 *double_indirect_buffer = kmalloc(block_size, 0);
+        u8 *bitmap = bitmap_bh->b_data;
         
-        if (double_indirect_buffer == NULL) {
-            printk(KERN_ERR "EXT2: Failed to allocate memory for double indirect block\n");
-            return 0;
-        }
+        /* The bitmap is updated in place, under its buffer lock */
+        lock_buffer(bitmap_bh);
         
-        /* Read the double indirect block */
-        ret = ext2_read_block(sbi, double_indirect_block, double_indirect_buffer);
+        /* Search from the goal, then from the start of its group */
+        u32 start = n == 0 ? goal - group_first : 0;
+        u32 bit = ext2_find_next_zero_bit(bitmap, group_size, start);
         
-        if (ret < 0) {
-            kfree(double_indirect_buffer);
-            return 0;
+        if (bit >= group_size && start > 0) {
+            bit = ext2_find_next_zero_bit(bitmap, start, 0);
+            
+            if (bit >= start) {
+                bit = group_size;
+            }
         }
         
-        /* Get the indirect block */
-        u32 indirect_block = double_indirect_buffer[indirect_index];
+        if (bit >= group_size) {
+            unlock_buffer(bitmap_bh);
+            brelse(bitmap_bh);
+            continue;
+        }
         
-        /* Free the double indirect buffer */
-        kfree(double_indirect_buffer);
+        /* Mark the block as used */
+        bitmap[bit / 8] |= (1 << (bit % 8));
+        u32 count = 1;
         
-        if (indirect_block == 0) {
-            return 0;
+        /* Preallocate the free blocks right after it */
+        if (inode->type == FILE_TYPE_REGULAR) {
+            while (count <= EXT2_PREALLOC_BLOCKS && bit + count < group_size &&
+                   !(bitmap[(bit + count) / 8] & (1 << ((bit + count) % 8)))) {
+                bitmap[(bit + count) / 8] |= (1 << ((bit + count) % 8));
+                count++;
+            }
         }
         
-        /* Allocate memory for the indirect block */
-        u32 *indirect_buffer = kmalloc(block_size, 0);
+        mark_buffer_dirty(bitmap_bh);
+        unlock_buffer(bitmap_bh);
+        brelse(bitmap_bh);
         
-        if (indirect_buffer == NULL) {
-            printk(KERN_ERR "EXT2: Failed to allocate memory for indirect block\n");
-            return 0;
-        }
+        /* Update the group descriptor */
+        lock_buffer(gd_bh);
+        group_desc->bg_free_blocks_count -= count;
+        mark_buffer_dirty(gd_bh);
+        unlock_buffer(gd_bh);
         
-        /* Read the indirect block */
-        ret = ext2_read_block(sbi, indirect_block, indirect_buffer);
+        /* Update the superblock */
+        spin_lock(&sbi->s_lock);
+        sbi->s_es->s_free_blocks_count -= count;
+        spin_unlock(&sbi->s_lock);
         
-        if (ret < 0) {
-            kfree(indirect_buffer);
-            return 0;
-        }
+        ext2_mark_super_dirty(sb);
         
-        /* Get the physical block number */
-        u32 phys_block = indirect_buffer[block_index];
+        /* Calculate the physical block number */
+        u32 phys_block = group_first + bit;
         
-        /* Free the indirect buffer */
-        kfree(indirect_buffer);
+        spin_lock(&ei->i_map_lock);
+        ei->i_alloc_goal = phys_block + 1;
+        ei->i_prealloc_block = phys_block + 1;
+        ei->i_prealloc_count = count - 1;
+        spin_unlock(&ei->i_map_lock);
         
         return phys_block;
     }
     
-    /* Block number is too large */
+    /* No free blocks found */
     return 0;
 }
 
@@ -281,8 +670,8 @@ u32 ext2_alloc_block(struct inode *inode, u32 block) {
     /* Calculate the number of blocks per triple indirect block */
     u32 blocks_per_triple_indirect = blocks_per_indirect * blocks_per_double_indirect;
     
-    /* Allocate a new block */
-    u32 phys_block = ext2_new_block(inode);
+    /* Allocate a new block, close to the one before it */
+    u32 phys_block = ext2_new_block_goal(inode, ext2_find_goal(inode, block));
     
     if (phys_block == 0) {
         return 0;
@@ -291,10 +680,13 @@ u32 ext2_alloc_block(struct inode *inode, u32 block) {
     /* Check if the block is a direct block */
     if (block < 12) {
         ei->i_data[block] = phys_block;
+        ext2_map_insert(ei, block, phys_block, 1);
         return phys_block;
     }
     
     /* Check if the block is in the indirect block */
+    u32 lblock = block;
+    
     block -= 12;
     
     if (block < blocks_per_indirect) {
@@ -310,67 +702,35 @@ u32 ext2_alloc_block(struct inode *inode, u32 block) {
                 return 0;
             }
             
-            /* Set the indirect block */
-            ei->i_data[12] = indirect_block;
-            
-            /* Clear the indirect block */
-            u32 *indirect_buffer = kmalloc(block_size, 0);
+            /* Clear the indirect block, without reading it first */
+            buffer_head_t *bh = getblk(sbi->s_blockdev, indirect_block, block_size);
             
-            if (indirect_buffer == NULL) {
-                printk(KERN_ERR "EXT2: Failed to allocate memory for indirect block\n");
+            if (bh == NULL) {
+                printk(KERN_ERR "EXT2: Failed to get indirect block\n");
                 ext2_free_block(inode, phys_block);
                 ext2_free_block(inode, indirect_block);
                 return 0;
             }
             
-            memset(indirect_buffer, 0, block_size);
-            
-            /* Write the indirect block */
-            int ret = ext2_write_block(sbi, indirect_block, indirect_buffer);
+            lock_buffer(bh);
+            memset(bh->b_data, 0, block_size);
+            mark_buffer_dirty(bh);
+            unlock_buffer(bh);
             
-            if (ret < 0) {
-                kfree(indirect_buffer);
-                ext2_free_block(inode, phys_block);
-                ext2_free_block(inode, indirect_block);
-                return 0;
-            }
+            brelse(bh);
             
-            /* Free the indirect buffer */
-            kfree(indirect_buffer);
-        }
-        
-        /* Allocate memory for the indirect block */
-        u32 *indirect_buffer = kmalloc(block_size, 0);
-        
-        if (indirect_buffer == NULL) {
-            printk(KERN_ERR "EXT2: Failed to allocate memory for indirect block\n");
-            ext2_free_block(inode, phys_block);
-            return 0;
-        }
-        
-        /* Read the indirect block */
-        int ret = ext2_read_block(sbi, indirect_block, indirect_buffer);
-        
-        if (ret < 0) {
-            kfree(indirect_buffer);
-            ext2_free_block(inode, phys_block);
-            return 0;
+            /* Set the indirect block */
+            ei->i_data[12] = indirect_block;
         }
         
         /* Set the physical block number */
-        indirect_buffer[block] = phys_block;
-        
-        /* Write the indirect block */
-        ret = ext2_write_block(sbi, indirect_block, indirect_buffer);
-        
-        if (ret < 0) {
-            kfree(indirect_buffer);
+        if (ext2_write_indirect(sbi, indirect_block, block, phys_block) < 0) {
             ext2_free_block(inode, phys_block);
             return 0;
         }
         
-        /* Free the indirect buffer */
-        kfree(indirect_buffer);
+        /* The block filled a hole, so the cached runs stay valid */
+        ext2_map_insert(ei, lblock, phys_block, 1);
         
         return phys_block;
     }
@@ -391,91 +751,7 @@ u32 ext2_alloc_block(struct inode *inode, u32 block) {
  * @return Physical block number, or 0 on failure
  */
 u32 ext2_new_block(struct inode *inode) {
-    /* Get the superblock */
-    super_block_t *sb = inode->i_ops->get_super(inode);
-    
-    /* Get the Ext2 superblock info */
-    ext2_sb_info_t *sbi = (ext2_sb_info_t *)sb->fs_data;
-    
-    /* Calculate the block size */
-    u32 block_size = sbi->s_block_size;
-    
-    /* Check if there are any free blocks */
-    if (sbi->s_es->s_free_blocks_count == 0) {
-        printk(KERN_ERR "EXT2: No free blocks\n");
-        return 0;
-    }
-    
-    /* Find a block group with free blocks */
-    for (u32 i = 0; i < sbi->s_groups_count; i++) {
-        /* Get the block group */
-        ext2_group_desc_t *group = &sbi->s_group_desc[i];
-        
-        /* Check if there are any free blocks */
-        if (group->bg_free_blocks_count == 0) {
-            continue;
-        }
-        
-        /* Allocate memory for the block bitmap */
-        u8 *bitmap = kmalloc(block_size, 0);
-        
-        if (bitmap == NULL) {
-            printk(KERN_ERR "EXT2: Failed to allocate memory for block bitmap\n");
-            return 0;
-        }
-        
-        /* Read the block bitmap */
-        int ret = ext2_read_block(sbi, group->bg_block_bitmap, bitmap);
-        
-        if (ret < 0) {
-            kfree(bitmap);
-            return 0;
-        }
-        
-        /* Find a free block */
-        for (u32 j = 0; j < sbi->s_blocks_per_group; j++) {
-            /* Check if the block is free */
-            if (!(bitmap[j / 8] & (1 << (j % 8)))) {
-                /* Mark the block as used */
-                bitmap[j / 8] |= (1 << (j % 8));
-                
-                /* Write the block bitmap */
-                ret = ext2_write_block(sbi, group->bg_block_bitmap, bitmap);
-                
-                if (ret < 0) {
-                    kfree(bitmap);
-                    return 0;
-                }
-                
-                /* Free the bitmap */
-                kfree(bitmap);
-                
-                /* Update the group descriptor */
-                group->bg_free_blocks_count--;
-                
-                /* Update the superblock */
-                sbi->s_es->s_free_blocks_count--;
-                
-                /* Write the superblock */
-                ret = ext2_write_super(sb);
-                
-                if (ret < 0) {
-                    return 0;
-                }
-                
-                /* Calculate the physical block number */
-                u32 phys_block = i * sbi->s_blocks_per_group + j + sbi->s_first_data_block;
-                
-                return phys_block;
-            }
-        }
-        
-        /* Free the bitmap */
-        kfree(bitmap);
-    }
-    
-    /* No free blocks found */
-    return 0;
+    return ext2_new_block_goal(inode, ext2_find_goal(inode, 0));
 }
 
 /**
@@ -486,68 +762,8 @@ u32 ext2_new_block(struct inode *inode) {
  * @return 0 on success, negative error code on failure
  */
 int ext2_free_block(struct inode *inode, u32 block) {
-    /* Get the superblock */
-    super_block_t *sb = inode->i_ops->get_super(inode);
-    
-    /* Get the Ext2 superblock info */
-    ext2_sb_info_t *sbi = (ext2_sb_info_t *)sb->fs_data;
-    
-    /* Calculate the block size */
-    u32 block_size = sbi->s_block_size;
-    
-    /* Calculate the block group */
-    u32 group = (block - sbi->s_first_data_block) / sbi->s_blocks_per_group;
-    
-    /* Calculate the block index within the group */
-    u32 index = (block - sbi->s_first_data_block) % sbi->s_blocks_per_group;
-    
-    /* Get the block group */
-    ext2_group_desc_t *group_desc = &sbi->s_group_desc[group];
-    
-    /* Allocate memory for the block bitmap */
-    u8 *bitmap = kmalloc(block_size, 0);
-    
-    if (bitmap == NULL) {
-        printk(KERN_ERR "EXT2: Failed to allocate memory for block bitmap\n");
-        return -ENOMEM;
-    }
-    
-    /* Read the block bitmap */
-    int ret = ext2_read_block(sbi, group_desc->bg_block_bitmap, bitmap);
-    
-    if (ret < 0) {
-        kfree(bitmap);
-        return ret;
-    }
-    
-    /* Check if the block is already free */
-    if (!(bitmap[index / 8] & (1 << (index % 8)))) {
-        kfree(bitmap);
-        return 0;
-    }
-    
-    /* Mark the block as free */
-    bitmap[index / 8] &= ~(1 << (index % 8));
-    
-    /* Write the block bitmap */
-    ret = ext2_write_block(sbi, group_desc->bg_block_bitmap, bitmap);
-    
-    if (ret < 0) {
-        kfree(bitmap);
-        return ret;
-    }
-    
-    /* Free the bitmap */
-    kfree(bitmap);
-    
-    /* Update the group descriptor */
-    group_desc->bg_free_blocks_count++;
-    
-    /* Update the superblock */
-    sbi->s_es->s_free_blocks_count++;
-    
-    /* Write the superblock */
-    ret = ext2_write_super(sb);
+    /* The block may be in a cached run */
+    ext2_map_invalidate(inode);
     
-    return ret;
+    return ext2_free_blocks(inode->i_ops->get_super(inode), block, 1);
 }
@@ -10,6 +10,7 @@
 #include <horizon/fs/file.h>
 #include <horizon/mm.h>
 #include <horizon/string.h>
+#include <horizon/poll.h>
 
 /* Define NULL if not defined */
 #ifndef NULL
@@ -34,6 +35,7 @@ int file_open(const char *pathname, int flags, mode_t mode, file_t **file) {
     (*file)->f_flags = flags;
     (*file)->f_mode = mode;
     (*file)->f_pos = 0;
+    INIT_LIST_HEAD(&(*file)->f_ep_links);
     
     /* Open the file */
     struct path path;
@@ -77,6 +79,9 @@ int file_close(file_t *file) {
         return -1;
     }
     
+    /* Stop any epoll instances watching the file */
+    eventpoll_release(file);
+    
     /* Call the release operation if available */
     if (file->f_op && file->f_op->release) {
         file->f_op->release(file->f_inode, file);
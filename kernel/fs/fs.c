@@ -8,6 +8,7 @@
 #include <horizon/types.h>
 #include <horizon/fs.h>
 #include <horizon/fs/ext2.h>
+#include <horizon/fs/buffer.h>
 #include <horizon/mm.h>
 #include <horizon/string.h>
 #include <horizon/spinlock.h>
@@ -65,6 +66,9 @@ void fs_init(void) {
     memset(mounts, 0, sizeof(mounts));
     mount_count = 0;
 
+    /* Initialize the buffer cache, before the file systems using it */
+    buffer_cache_init();
+
     /* Initialize the ext2 file system */
     ext2_init();
 
@@ -505,6 +509,8 @@ file_t *fs_open(const char *path, u32 flags) {
         return NULL;
     }
 
+    INIT_LIST_HEAD(&file->f_ep_links);
+
     /* Set the file name */
     strncpy(file->name, path, 255);
     file->name[255] = '\0';
@@ -12,6 +12,7 @@
 #include <horizon/mm.h>
 #include <horizon/string.h>
 #include <horizon/task.h>
+#include <horizon/percpu_rwsem.h>
 
 /* Define NULL if not defined */
 #ifndef NULL
@@ -28,6 +29,9 @@ typedef struct mnt_namespace {
 /* Current mount namespace */
 static struct mnt_namespace *current_namespace = NULL;
 
+/* Protects current_namespace and the mount lists, lookups far outnumber mounts */
+static percpu_rw_semaphore_t mount_rwsem = PERCPU_RWSEM_INITIALIZER(mount_rwsem);
+
 /* Initialize the mount namespace */
 void mount_init(void) {
     /* Create the initial mount namespace */
@@ -80,6 +84,7 @@ struct mnt_namespace *clone_mnt_ns(struct mnt_namespace *old_ns) {
     
     /* Clone the mounts */
     struct list_head *pos;
+    percpu_down_read(&mount_rwsem);
     list_for_each(pos, &old_ns->list) {
         struct vfsmount *old_mnt = list_entry(pos, struct vfsmount, mnt_list);
         
@@ -89,6 +94,7 @@ struct mnt_namespace *clone_mnt_ns(struct mnt_namespace *old_ns) {
         if (new_mnt == NULL) {
             /* Free the new namespace */
             /* This would be implemented with actual namespace freeing */
+            percpu_up_read(&mount_rwsem);
             return NULL;
         }
         
@@ -109,6 +115,7 @@ struct mnt_namespace *clone_mnt_ns(struct mnt_namespace *old_ns) {
             new_ns->root = new_mnt;
         }
     }
+    percpu_up_read(&mount_rwsem);
     
     return new_ns;
 }
@@ -129,6 +136,7 @@ void free_mnt_ns(struct mnt_namespace *ns) {
     
     /* Free the mounts */
     struct list_head *pos, *n;
+    percpu_down_write(&mount_rwsem);
     list_for_each_safe(pos, n, &ns->list) {
         struct vfsmount *mnt = list_entry(pos, struct vfsmount, mnt_list);
         
@@ -141,6 +149,7 @@ void free_mnt_ns(struct mnt_namespace *ns) {
         }
         kfree(mnt);
     }
+    percpu_up_write(&mount_rwsem);
     
     /* Free the namespace */
     kfree(ns);
@@ -161,11 +170,14 @@ void set_mnt_ns(struct mnt_namespace *ns) {
     ns->count++;
     
     /* Set the current namespace */
-    if (current_namespace != NULL) {
-        free_mnt_ns(current_namespace);
-    }
-    
+    percpu_down_write(&mount_rwsem);
+    struct mnt_namespace *old_ns = current_namespace;
     current_namespace = ns;
+    percpu_up_write(&mount_rwsem);
+    
+    if (old_ns != NULL) {
+        free_mnt_ns(old_ns);
+    }
 }
 
 /* Find a mount by device name */
@@ -176,14 +188,17 @@ struct vfsmount *find_mnt_by_dev_name(const char *dev_name) {
     
     /* Iterate over the mounts */
     struct list_head *pos;
+    percpu_down_read(&mount_rwsem);
     list_for_each(pos, &current_namespace->list) {
         struct vfsmount *mnt = list_entry(pos, struct vfsmount, mnt_list);
         
         /* Check the device name */
         if (mnt->mnt_devname && strcmp(mnt->mnt_devname, dev_name) == 0) {
+            percpu_up_read(&mount_rwsem);
             return mnt;
         }
     }
+    percpu_up_read(&mount_rwsem);
     
     return NULL;
 }
@@ -196,14 +211,17 @@ struct vfsmount *find_mnt_by_mountpoint(struct dentry *mountpoint) {
     
     /* Iterate over the mounts */
     struct list_head *pos;
+    percpu_down_read(&mount_rwsem);
     list_for_each(pos, &current_namespace->list) {
         struct vfsmount *mnt = list_entry(pos, struct vfsmount, mnt_list);
         
         /* Check the mount point */
         if (mnt->mnt_mountpoint == mountpoint) {
+            percpu_up_read(&mount_rwsem);
             return mnt;
         }
     }
+    percpu_up_read(&mount_rwsem);
     
     return NULL;
 }
@@ -214,6 +232,8 @@ void add_mnt_to_namespace(struct vfsmount *mnt) {
         return;
     }
     
+    percpu_down_write(&mount_rwsem);
+    
     /* Add the mount to the namespace */
     list_add(&mnt->mnt_list, &current_namespace->list);
     
@@ -221,6 +241,8 @@ void add_mnt_to_namespace(struct vfsmount *mnt) {
     if (current_namespace->root == NULL) {
         current_namespace->root = mnt;
     }
+    
+    percpu_up_write(&mount_rwsem);
 }
 
 /* Remove a mount from the namespace */
@@ -229,6 +251,8 @@ void remove_mnt_from_namespace(struct vfsmount *mnt) {
         return;
     }
     
+    percpu_down_write(&mount_rwsem);
+    
     /* Remove the mount from the namespace */
     list_del(&mnt->mnt_list);
     
@@ -236,6 +260,8 @@ void remove_mnt_from_namespace(struct vfsmount *mnt) {
     if (current_namespace->root == mnt) {
         current_namespace->root = NULL;
     }
+    
+    percpu_up_write(&mount_rwsem);
 }
 
 /* Mount a file system */
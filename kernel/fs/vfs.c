@@ -184,6 +184,7 @@ int vfs_open(const struct path *path, struct file **filp, int flags, umode_t mod
     file->f_flags = flags;
     file->f_mode = mode;
     file->f_pos = 0;
+    INIT_LIST_HEAD(&file->f_ep_links);
     
     /* Open the file */
     int error = 0;
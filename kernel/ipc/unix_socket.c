@@ -11,6 +11,8 @@
 #include <horizon/mm.h>
 #include <horizon/string.h>
 #include <horizon/net.h>
+#include <horizon/rculist.h>
+#include <horizon/stddef.h>
 
 /* Define NULL if not defined */
 #ifndef NULL
@@ -43,22 +45,23 @@ struct unix_message {
 
 /* Unix socket */
 struct unix_socket {
-    struct list_head list;          /* List of Unix sockets */
+    struct list_head list;          /* List of Unix sockets, lookups walk it under RCU */
     int type;                       /* Socket type */
     int state;                      /* Socket state */
-    struct unix_address *address;   /* Socket address */
+    struct unix_address *address;   /* Socket address, read under RCU */
     struct unix_socket *peer;       /* Peer socket */
     struct list_head messages;      /* List of messages */
     struct wait_queue_head wait_read;  /* Wait queue for readers */
     struct wait_queue_head wait_write; /* Wait queue for writers */
     struct mutex mutex;             /* Mutex */
-    int refcount;                   /* Reference count */
+    volatile int refcount;          /* Reference count */
+    struct rcu_head rcu;            /* Deferred free after leaving the list */
 };
 
 /* List of Unix sockets */
 static LIST_HEAD(unix_socket_list);
 
-/* Unix socket mutex */
+/* Unix socket mutex, serializes changes to the list */
 static struct mutex unix_socket_mutex;
 
 /**
@@ -99,14 +102,30 @@ struct unix_socket *unix_socket_create(int type) {
     mutex_init(&sock->mutex);
     sock->refcount = 1;
     
-    /* Add the Unix socket to the list */
+    /* Publish the Unix socket on the list */
     mutex_lock(&unix_socket_mutex);
-    list_add(&sock->list, &unix_socket_list);
+    list_add_rcu(&sock->list, &unix_socket_list);
     mutex_unlock(&unix_socket_mutex);
     
     return sock;
 }
 
+/**
+ * Free a Unix socket after a grace period
+ * 
+ * @param head RCU head of the socket
+ */
+static void unix_socket_free_rcu(struct rcu_head *head) {
+    struct unix_socket *sock = container_of(head, struct unix_socket, rcu);
+    
+    /* Lookups compare against the address, so it goes with the socket */
+    if (sock->address != NULL) {
+        kfree(sock->address);
+    }
+    
+    kfree(sock);
+}
+
 /**
  * Destroy a Unix socket
  * 
@@ -118,47 +137,59 @@ void unix_socket_destroy(struct unix_socket *sock) {
         return;
     }
     
-    /* Lock the mutex */
+    /* Drop our reference, the last one frees the socket */
+    if (__sync_sub_and_fetch(&sock->refcount, 1) != 0) {
+        return;
+    }
+    
+    /* Remove the socket from the list, lookups may still see it */
     mutex_lock(&unix_socket_mutex);
+    list_del_rcu(&sock->list);
+    mutex_unlock(&unix_socket_mutex);
     
-    /* Decrement the reference count */
-    sock->refcount--;
+    /* Free all messages, nobody else holds a reference */
+    struct unix_message *msg, *tmp;
     
-    /* Check if the socket should be freed */
-    if (sock->refcount == 0) {
-        /* Remove the socket from the list */
-        list_del(&sock->list);
+    list_for_each_entry_safe(msg, tmp, &sock->messages, list) {
+        /* Remove the message from the list */
+        list_del(&msg->list);
         
-        /* Free the address */
-        if (sock->address != NULL) {
-            kfree(sock->address);
-        }
+        /* Free the message data */
+        kfree(msg->data);
         
-        /* Free all messages */
-        struct unix_message *msg, *tmp;
-        
-        list_for_each_entry_safe(msg, tmp, &sock->messages, list) {
-            /* Remove the message from the list */
-            list_del(&msg->list);
-            
-            /* Free the message data */
-            kfree(msg->data);
-            
-            /* Free the message */
-            kfree(msg);
+        /* Free the message */
+        kfree(msg);
+    }
+    
+    /* Free the socket once lookups in progress are done with it */
+    call_rcu(&sock->rcu, unix_socket_free_rcu);
+}
+
+/**
+ * Take a reference to a Unix socket unless it is being destroyed
+ * 
+ * @param sock The Unix socket
+ * @return 1 if a reference was taken, 0 if the count already hit zero
+ */
+static int unix_socket_get_not_zero(struct unix_socket *sock) {
+    int count = sock->refcount;
+    
+    while (count != 0) {
+        if (__sync_bool_compare_and_swap(&sock->refcount, count, count + 1)) {
+            return 1;
         }
-        
-        /* Free the socket */
-        kfree(sock);
+        count = sock->refcount;
     }
     
-    /* Unlock the mutex */
-    mutex_unlock(&unix_socket_mutex);
+    return 0;
 }
 
 /**
  * Find a Unix socket by address
  * 
+ * Takes no lock, the caller gets a reference to drop with
+ * unix_socket_destroy().
+ * 
  * @param addr The socket address
  * @param len The address length
  * @return The Unix socket, or NULL if not found
@@ -172,19 +203,23 @@ struct unix_socket *unix_socket_find(const char *addr, int len) {
     /* Find the Unix socket */
     struct unix_socket *sock;
     
-    mutex_lock(&unix_socket_mutex);
+    rcu_read_lock();
     
-    list_for_each_entry(sock, &unix_socket_list, list) {
-        if (sock->address != NULL && sock->address->len == len && memcmp(sock->address->name, addr, len) == 0) {
-            /* Increment the reference count */
-            sock->refcount++;
+    list_for_each_entry_rcu(sock, &unix_socket_list, list) {
+        struct unix_address *address = rcu_dereference(sock->address);
+        
+        if (address != NULL && address->len == len && memcmp(address->name, addr, len) == 0) {
+            /* A socket on its way out does not count */
+            if (!unix_socket_get_not_zero(sock)) {
+                continue;
+            }
             
-            mutex_unlock(&unix_socket_mutex);
+            rcu_read_unlock();
             return sock;
         }
     }
     
-    mutex_unlock(&unix_socket_mutex);
+    rcu_read_unlock();
     
     return NULL;
 }
@@ -213,7 +248,10 @@ int unix_socket_bind(struct unix_socket *sock, const char *addr, int len) {
     }
     
     /* Check if the address is already in use */
-    if (unix_socket_find(addr, len) != NULL) {
+    struct unix_socket *other = unix_socket_find(addr, len);
+    
+    if (other != NULL) {
+        unix_socket_destroy(other);
         mutex_unlock(&sock->mutex);
         return -1;
     }
@@ -230,8 +268,8 @@ int unix_socket_bind(struct unix_socket *sock, const char *addr, int len) {
     address->len = len;
     memcpy(address->name, addr, len);
     
-    /* Set the address */
-    sock->address = address;
+    /* Publish the address to lookups */
+    rcu_assign_pointer(sock->address, address);
     
     /* Unlock the mutex */
     mutex_unlock(&sock->mutex);
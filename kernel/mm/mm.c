@@ -11,6 +11,9 @@
 #include <horizon/mm/vmm.h>
 #include <horizon/mm/page.h>
 #include <horizon/mm/swap.h>
+#include <horizon/rbtree.h>
+#include <horizon/spinlock.h>
+#include <horizon/string.h>
 #include <horizon/printk.h>
 #include <horizon/errno.h>
 
@@ -19,6 +22,23 @@
 #define NULL ((void *)0)
 #endif
 
+/* Maximum number of live vmalloc areas */
+#define VMALLOC_MAX_AREAS 1024
+
+/* vmalloc area */
+typedef struct vmalloc_area {
+    rb_node_t node;                 /* Node in the area tree */
+    unsigned long addr;             /* Start address */
+    u32 pages;                      /* Number of pages */
+    struct vmalloc_area *next_free; /* Next unused area */
+} vmalloc_area_t;
+
+/* vmalloc areas, keyed by start address */
+static vmalloc_area_t vmalloc_areas[VMALLOC_MAX_AREAS];
+static vmalloc_area_t *vmalloc_free_areas = NULL;
+static rb_root_t vmalloc_tree = RB_ROOT;
+static spinlock_t vmalloc_lock;
+
 /**
  * Initialize the memory management subsystem
  */
@@ -26,6 +46,13 @@ void mm_init(void) {
     /* Initialize the physical memory manager */
     pmm_init();
 
+    /* Chain the vmalloc area descriptors */
+    spin_lock_init(&vmalloc_lock);
+    for (u32 i = VMALLOC_MAX_AREAS; i > 0; i--) {
+        vmalloc_areas[i - 1].next_free = vmalloc_free_areas;
+        vmalloc_free_areas = &vmalloc_areas[i - 1];
+    }
+
     /* Initialize the virtual memory manager */
     vmm_init();
 
@@ -65,21 +92,71 @@ void mm_init(void) {
     printk(KERN_INFO "MM: Initialized memory management subsystem\n");
 }
 
+/**
+ * Free a run of pages as naturally aligned buddy blocks
+ *
+ * @param page First page of the run
+ * @param count Number of pages
+ */
+static void mm_free_page_run(page_t *page, u32 count) {
+    unsigned long pfn = pmm_page_to_pfn(page);
+    unsigned long end = pfn + count;
+
+    while (pfn < end) {
+        unsigned int order = 0;
+
+        /* Largest block that is aligned at pfn and fits in the run */
+        while (order + 1 < MAX_ORDER &&
+               (pfn & ((1UL << (order + 1)) - 1)) == 0 &&
+               pfn + (1UL << (order + 1)) <= end) {
+            order++;
+        }
+
+        pmm_free_pages(pmm_pfn_to_page(pfn), order);
+        pfn += 1UL << order;
+    }
+}
+
 /**
  * Allocate pages
  *
+ * The run comes from the buddy allocator as one block of the next power
+ * of two, and the unused tail goes straight back, so exactly count pages
+ * stay allocated.
+ *
  * @param count Number of pages to allocate
  * @param flags Allocation flags
  * @return Pointer to the allocated pages, or NULL on failure
  */
 void *mm_alloc_pages(u32 count, u32 flags) {
+    unsigned int order = 0;
+    page_t *page;
+
+    if (count == 0) {
+        return NULL;
+    }
+
+    /* Find the smallest order that holds the run */
+    while ((1U << order) < count) {
+        order++;
+    }
+
+    if (order >= MAX_ORDER) {
+        return NULL;
+    }
+
     /* Allocate pages */
-    page_t *page = page_alloc(count);
+    page = pmm_alloc_pages(order, flags);
 
     if (page == NULL) {
         return NULL;
     }
 
+    /* Give back the tail beyond count */
+    if ((1U << order) > count) {
+        mm_free_page_run(pmm_pfn_to_page(pmm_page_to_pfn(page) + count), (1U << order) - count);
+    }
+
     /* Convert the page to a virtual address */
     void *addr = pmm_page_to_virt(page);
 
@@ -98,11 +175,19 @@ void *mm_alloc_pages(u32 count, u32 flags) {
  * @param count Number of pages to free
  */
 void mm_free_pages(void *addr, u32 count) {
+    if (addr == NULL || count == 0) {
+        return;
+    }
+
     /* Convert the virtual address to a page */
     page_t *page = pmm_virt_to_page(addr);
 
+    if (page == NULL) {
+        return;
+    }
+
     /* Free the pages */
-    page_free(page, count);
+    mm_free_page_run(page, count);
 }
 
 /**
@@ -136,23 +221,91 @@ void kfree(void *addr) {
     mm_free_pages(addr, 1);
 }
 
+/**
+ * Find a vmalloc area by start address
+ *
+ * @param addr Start address
+ * @return The area, or NULL if none starts at addr
+ */
+static vmalloc_area_t *vmalloc_find_area(unsigned long addr) {
+    rb_node_t *node = vmalloc_tree.rb_node;
+
+    while (node != NULL) {
+        vmalloc_area_t *area = rb_entry(node, vmalloc_area_t, node);
+
+        if (addr < area->addr) {
+            node = node->rb_left;
+        } else if (addr > area->addr) {
+            node = node->rb_right;
+        } else {
+            return area;
+        }
+    }
+
+    return NULL;
+}
+
 /**
  * Allocate virtual memory
  *
+ * This layer has no kernel page-table interface, so areas are backed by
+ * directly mapped pages; the area tree records their size for vfree.
+ *
  * @param size Size to allocate
  * @return Pointer to the allocated memory, or NULL on failure
  */
 void *vmalloc(size_t size) {
+    vmalloc_area_t *area;
+    rb_node_t **link, *parent = NULL;
+
+    if (size == 0) {
+        return NULL;
+    }
+
     /* Calculate the number of pages needed */
     u32 count = (size + PAGE_SIZE - 1) / PAGE_SIZE;
 
+    /* Get an area descriptor */
+    spin_lock(&vmalloc_lock);
+    area = vmalloc_free_areas;
+    if (area != NULL) {
+        vmalloc_free_areas = area->next_free;
+    }
+    spin_unlock(&vmalloc_lock);
+
+    if (area == NULL) {
+        return NULL;
+    }
+
     /* Allocate pages */
     void *addr = mm_alloc_pages(count, MEM_KERNEL);
 
     if (addr == NULL) {
+        spin_lock(&vmalloc_lock);
+        area->next_free = vmalloc_free_areas;
+        vmalloc_free_areas = area;
+        spin_unlock(&vmalloc_lock);
         return NULL;
     }
 
+    area->addr = (unsigned long)addr;
+    area->pages = count;
+
+    /* Insert the area into the tree */
+    spin_lock(&vmalloc_lock);
+    link = &vmalloc_tree.rb_node;
+    while (*link != NULL) {
+        parent = *link;
+        if (area->addr < rb_entry(parent, vmalloc_area_t, node)->addr) {
+            link = &parent->rb_left;
+        } else {
+            link = &parent->rb_right;
+        }
+    }
+    rb_link_node(&area->node, parent, link);
+    rb_insert_color(&area->node, &vmalloc_tree);
+    spin_unlock(&vmalloc_lock);
+
     return addr;
 }
 
@@ -162,6 +315,30 @@ void *vmalloc(size_t size) {
  * @param addr Address to free
  */
 void vfree(void *addr) {
+    vmalloc_area_t *area;
+
+    if (addr == NULL) {
+        return;
+    }
+
+    /* Look up and unlink the area */
+    spin_lock(&vmalloc_lock);
+    area = vmalloc_find_area((unsigned long)addr);
+    if (area != NULL) {
+        rb_erase(&area->node, &vmalloc_tree);
+    }
+    spin_unlock(&vmalloc_lock);
+
+    if (area == NULL) {
+        printk(KERN_WARNING "MM: vfree of unknown address %p\n", addr);
+        return;
+    }
+
     /* Free the pages */
-    mm_free_pages(addr, 1);
+    mm_free_pages(addr, area->pages);
+
+    spin_lock(&vmalloc_lock);
+    area->next_free = vmalloc_free_areas;
+    vmalloc_free_areas = area;
+    spin_unlock(&vmalloc_lock);
 }
@@ -2,6 +2,8 @@
  * pmm.c - Horizon kernel physical memory manager implementation
  * 
  * This file contains the implementation of the physical memory manager.
+ * Memory is split into DMA, Normal and HighMem zones, each with its own
+ * buddy free lists, lock, watermarks and per-CPU page caches.
  */
 
 #include <horizon/kernel.h>
@@ -10,9 +12,12 @@
 #include <horizon/mm/pmm.h>
 #include <horizon/mm/page.h>
 #include <horizon/spinlock.h>
+#include <horizon/irqflags.h>
+#include <horizon/smp.h>
 #include <horizon/list.h>
 #include <horizon/string.h>
 #include <horizon/printk.h>
+#include <horizon/errno.h>
 
 /* Define NULL if not defined */
 #ifndef NULL
@@ -38,39 +43,117 @@ typedef struct memory_map_entry {
 static memory_map_entry_t *memory_map = NULL;
 static u32 memory_map_entries = 0;
 
-/* Memory zones */
-static zone_t zones[MAX_NR_ZONES];
-
 /* Memory node */
 static pglist_data_t pgdat;
 
+/* Memory zones, owned by the node */
+static zone_t *const zones = pgdat.node_zones;
+
 /* Page frame array */
 static page_t *page_frames = NULL;
 static u32 page_frames_count = 0;
 
-/* Buddy system free lists */
-static list_head_t free_area[11];
-
-/* Physical memory manager lock */
-static spinlock_t pmm_lock = SPIN_LOCK_INITIALIZER;
+/* Reclaim handler, called when a zone falls below its low watermark */
+static pmm_reclaim_fn_t reclaim_handler = NULL;
 
 /* Physical memory statistics */
 static u64 total_pages = 0;
-static u64 free_pages = 0;
 static u64 reserved_pages = 0;
 
+/* Zone boundaries */
+static const unsigned long zone_end_pfn[MAX_NR_ZONES] = {
+    ZONE_DMA_END_PFN, ZONE_NORMAL_END_PFN, ~0UL
+};
+
+/**
+ * Get the zone index of a page frame number
+ * 
+ * @param pfn Page frame number
+ * @return Zone index
+ */
+static inline int pfn_zone_idx(unsigned long pfn) {
+    if (pfn < ZONE_DMA_END_PFN) {
+        return ZONE_DMA;
+    } else if (pfn < ZONE_NORMAL_END_PFN) {
+        return ZONE_NORMAL;
+    }
+    
+    return ZONE_HIGHMEM;
+}
+
+/**
+ * Get the highest zone an allocation may be served from
+ * 
+ * @param flags Allocation flags
+ * @return Zone index to start the fallback walk at
+ */
+static inline int flags_to_zone_idx(unsigned int flags) {
+    if (flags & MEM_DMA) {
+        return ZONE_DMA;
+    } else if (flags & MEM_HIGHMEM) {
+        return ZONE_HIGHMEM;
+    }
+    
+    return ZONE_NORMAL;
+}
+
+/**
+ * Initialize the per-CPU page caches of a zone
+ * 
+ * @param zone Zone to initialize
+ */
+static void zone_pcp_init(zone_t *zone) {
+    for (int cpu = 0; cpu < CONFIG_NR_CPUS; cpu++) {
+        per_cpu_pageset_t *pset = &zone->pageset[cpu];
+        
+        memset(pset, 0, sizeof(per_cpu_pageset_t));
+        
+        for (int i = 0; i < PCP_NR_LISTS; i++) {
+            list_init(&pset->pcp[i].list);
+        }
+        
+        pset->pcp[PCP_HOT].batch = PCP_DEFAULT_BATCH;
+        pset->pcp[PCP_HOT].high = PCP_DEFAULT_HIGH;
+        pset->pcp[PCP_COLD].batch = PCP_DEFAULT_BATCH / 2;
+        pset->pcp[PCP_COLD].high = PCP_DEFAULT_BATCH;
+    }
+}
+
+/**
+ * Set up the watermarks of a zone from its managed pages
+ * 
+ * @param zone Zone to set up
+ */
+static void zone_setup_watermarks(zone_t *zone) {
+    /* Keep roughly 1/128 of the zone as an emergency reserve */
+    unsigned long min = zone->managed_pages / 128;
+    
+    if (min < 16 && zone->managed_pages >= 64) {
+        min = 16;
+    }
+    
+    zone->watermark[WMARK_MIN] = min;
+    zone->watermark[WMARK_LOW] = min + min / 4;
+    zone->watermark[WMARK_HIGH] = min + min / 2;
+}
+
 /**
  * Initialize the physical memory manager
  */
 void pmm_init(void) {
+    /* Initialize the memory node */
+    memset(&pgdat, 0, sizeof(pglist_data_t));
+    pgdat.node_id = 0;
+    
     /* Initialize the memory zones */
     for (int i = 0; i < MAX_NR_ZONES; i++) {
-        memset(&zones[i], 0, sizeof(zone_t));
         spin_lock_init(&zones[i].lock);
         
-        for (int j = 0; j < 11; j++) {
+        for (int j = 0; j < MAX_ORDER; j++) {
             list_init(&zones[i].free_area[j]);
         }
+        
+        zone_pcp_init(&zones[i]);
     }
     
     /* Set zone names */
@@ -78,18 +161,6 @@ void pmm_init(void) {
     zones[ZONE_NORMAL].name = "Normal";
     zones[ZONE_HIGHMEM].name = "HighMem";
     
-    /* Initialize the memory node */
-    memset(&pgdat, 0, sizeof(pglist_data_t));
-    pgdat.node_id = 0;
-    pgdat.node_zones[ZONE_DMA] = zones[ZONE_DMA];
-    pgdat.node_zones[ZONE_NORMAL] = zones[ZONE_NORMAL];
-    pgdat.node_zones[ZONE_HIGHMEM] = zones[ZONE_HIGHMEM];
-    
-    /* Initialize the buddy system free lists */
-    for (int i = 0; i < 11; i++) {
-        list_init(&free_area[i]);
-    }
-    
     /* Get the memory map from the bootloader */
     /* This would be implemented with actual memory map getting */
     /* For now, just create a simple memory map */
@@ -114,17 +185,22 @@ void pmm_init(void) {
     memory_map[2].length = 0x2000000; /* 32 MB */
     memory_map[2].type = MEMORY_MAP_AVAILABLE;
     
-    /* Calculate the total memory */
+    /* Calculate the total memory and the highest page frame */
     u64 total_memory = 0;
+    u64 max_addr = 0;
     
     for (u32 i = 0; i < memory_map_entries; i++) {
         if (memory_map[i].type == MEMORY_MAP_AVAILABLE) {
             total_memory += memory_map[i].length;
         }
+        
+        if (memory_map[i].base + memory_map[i].length > max_addr) {
+            max_addr = memory_map[i].base + memory_map[i].length;
+        }
     }
     
-    /* Calculate the number of pages */
-    page_frames_count = total_memory / PAGE_SIZE;
+    /* The page frame array covers every frame up to the end of memory */
+    page_frames_count = max_addr / PAGE_SIZE;
     
     /* Allocate the page frame array */
     page_frames = kmalloc(sizeof(page_t) * page_frames_count, MEM_KERNEL | MEM_ZERO);
@@ -148,6 +224,25 @@ void pmm_init(void) {
         page_frames[i].private = NULL;
     }
     
+    /* Set up the zone spans */
+    for (int i = 0; i < MAX_NR_ZONES; i++) {
+        unsigned long start = (i == 0) ? 0 : zone_end_pfn[i - 1];
+        unsigned long end = zone_end_pfn[i];
+        
+        if (start > page_frames_count) {
+            start = page_frames_count;
+        }
+        if (end > page_frames_count) {
+            end = page_frames_count;
+        }
+        
+        zones[i].start_pfn = start;
+        zones[i].spanned_pages = end - start;
+    }
+    
+    pgdat.node_start_pfn = 0;
+    pgdat.node_spanned_pages = page_frames_count;
+    
     /* Initialize the memory map */
     for (u32 i = 0; i < memory_map_entries; i++) {
         if (memory_map[i].type == MEMORY_MAP_AVAILABLE) {
@@ -157,16 +252,265 @@ void pmm_init(void) {
         }
     }
     
+    /* Set up the watermarks now that the zones are populated */
+    for (int i = 0; i < MAX_NR_ZONES; i++) {
+        zone_setup_watermarks(&zones[i]);
+        pgdat.node_present_pages += zones[i].present_pages;
+    }
+    
     /* Print memory information */
     printk(KERN_INFO "PMM: Total memory: %llu MB\n", total_memory / (1024 * 1024));
     printk(KERN_INFO "PMM: Total pages: %llu\n", total_pages);
-    printk(KERN_INFO "PMM: Free pages: %llu\n", free_pages);
+    printk(KERN_INFO "PMM: Free pages: %lu\n", pmm_get_free_pages());
     printk(KERN_INFO "PMM: Reserved pages: %llu\n", reserved_pages);
+    pmm_print_zone_stats();
+}
+
+/**
+ * Return a block to its zone's free lists, merging with free buddies
+ * 
+ * The caller must hold zone->lock. The block must not cross a zone boundary.
+ * 
+ * @param zone Zone owning the block
+ * @param page First page of the block
+ * @param order Page order
+ */
+static void __pmm_buddy_free(zone_t *zone, page_t *page, unsigned int order) {
+    /* Get the page frame number */
+    unsigned long pfn = pmm_page_to_pfn(page);
+    unsigned long zone_end = zone->start_pfn + zone->spanned_pages;
+    
+    /* Account the pages before merging changes the order */
+    zone->nr_free_pages += (1UL << order);
+    
+    /* Try to merge with buddies */
+    while (order < MAX_ORDER - 1) {
+        /* Calculate the buddy page frame number */
+        unsigned long buddy_pfn = pfn ^ (1UL << order);
+        
+        /* Buddies never straddle a zone boundary */
+        if (buddy_pfn < zone->start_pfn || buddy_pfn >= zone_end) {
+            break;
+        }
+        
+        /* Get the buddy page */
+        page_t *buddy = &page_frames[buddy_pfn];
+        
+        /* Check if the buddy is free and has the same order */
+        if (!page_test_flags(buddy, (1 << PG_buddy)) || buddy->order != order) {
+            break;
+        }
+        
+        /* Remove the buddy from the free list */
+        list_del(&buddy->list);
+        zone->nr_free[order]--;
+        
+        /* Clear the buddy flag */
+        page_clear_flags(buddy, (1 << PG_buddy));
+        
+        /* The merged block starts at the lower of the two */
+        if (buddy_pfn < pfn) {
+            pfn = buddy_pfn;
+            page = buddy;
+        }
+        
+        /* Increment the order */
+        order++;
+    }
+    
+    /* Set the page as free */
+    page_set_flags(page, (1 << PG_buddy));
+    page->order = order;
+    
+    /* Add the page to the free list */
+    list_add(&page->list, &zone->free_area[order]);
+    zone->nr_free[order]++;
+}
+
+/**
+ * Take a block from a zone's free lists
+ * 
+ * The caller must hold zone->lock.
+ * 
+ * @param zone Zone to allocate from
+ * @param order Page order
+ * @return Pointer to the first page of the block, or NULL if none is free
+ */
+static page_t *__pmm_buddy_alloc(zone_t *zone, unsigned int order) {
+    /* Find the smallest free block that fits */
+    for (unsigned int current_order = order; current_order < MAX_ORDER; current_order++) {
+        /* Check if there are free blocks of the current order */
+        if (list_empty(&zone->free_area[current_order])) {
+            continue;
+        }
+        
+        /* Get the first free block */
+        page_t *page = list_entry(zone->free_area[current_order].next, page_t, list);
+        
+        /* Remove the block from the free list */
+        list_del(&page->list);
+        zone->nr_free[current_order]--;
+        
+        /* Clear the buddy flag */
+        page_clear_flags(page, (1 << PG_buddy));
+        
+        /* Split the block, returning the upper halves */
+        while (current_order > order) {
+            /* Decrement the order */
+            current_order--;
+            
+            /* Calculate the buddy page */
+            page_t *buddy = &page_frames[pmm_page_to_pfn(page) + (1UL << current_order)];
+            
+            /* Set the buddy as free */
+            page_set_flags(buddy, (1 << PG_buddy));
+            buddy->order = current_order;
+            
+            /* Add the buddy to the free list */
+            list_add(&buddy->list, &zone->free_area[current_order]);
+            zone->nr_free[current_order]++;
+        }
+        
+        /* Set the page order */
+        page->order = order;
+        
+        /* Decrement the free pages counter */
+        zone->nr_free_pages -= (1UL << order);
+        
+        return page;
+    }
+    
+    return NULL;
+}
+
+/**
+ * Pull a single page out of whatever free block contains it
+ * 
+ * The caller must hold zone->lock.
+ * 
+ * @param zone Zone owning the page
+ * @param pfn Page frame number to isolate
+ * @return 1 if the page was free and is now isolated, 0 otherwise
+ */
+static int __pmm_isolate_pfn(zone_t *zone, unsigned long pfn) {
+    /* Find the free block containing the page */
+    for (unsigned int order = 0; order < MAX_ORDER; order++) {
+        unsigned long head_pfn = pfn & ~((1UL << order) - 1);
+        
+        if (head_pfn < zone->start_pfn) {
+            break;
+        }
+        
+        page_t *head = &page_frames[head_pfn];
+        
+        if (!page_test_flags(head, (1 << PG_buddy)) || head->order != order) {
+            continue;
+        }
+        
+        /* Take the whole block off its list */
+        list_del(&head->list);
+        zone->nr_free[order]--;
+        page_clear_flags(head, (1 << PG_buddy));
+        
+        /* Give back every half that does not contain the page */
+        while (order > 0) {
+            order--;
+            
+            unsigned long half = 1UL << order;
+            page_t *rest;
+            
+            if (pfn >= head_pfn + half) {
+                rest = &page_frames[head_pfn];
+                head_pfn += half;
+            } else {
+                rest = &page_frames[head_pfn + half];
+            }
+            
+            page_set_flags(rest, (1 << PG_buddy));
+            rest->order = order;
+            list_add(&rest->list, &zone->free_area[order]);
+            zone->nr_free[order]++;
+        }
+        
+        zone->nr_free_pages--;
+        
+        return 1;
+    }
+    
+    return 0;
+}
+
+/**
+ * Free a range of page frames into their zones as maximal buddy blocks
+ * 
+ * @param start_pfn Start page frame number
+ * @param end_pfn End page frame number
+ */
+static void pmm_free_pfn_range(unsigned long start_pfn, unsigned long end_pfn) {
+    unsigned long pfn = start_pfn;
+    unsigned long irq_flags;
+    
+    while (pfn < end_pfn) {
+        zone_t *zone = &zones[pfn_zone_idx(pfn)];
+        unsigned long limit = zone->start_pfn + zone->spanned_pages;
+        unsigned int order = MAX_ORDER - 1;
+        
+        if (limit > end_pfn) {
+            limit = end_pfn;
+        }
+        
+        /* Use the largest naturally aligned block that fits */
+        while (order > 0 && ((pfn & ((1UL << order) - 1)) != 0 || pfn + (1UL << order) > limit)) {
+            order--;
+        }
+        
+        spin_lock_irqsave(&zone->lock, irq_flags);
+        __pmm_buddy_free(zone, &page_frames[pfn], order);
+        spin_unlock_irqrestore(&zone->lock, irq_flags);
+        
+        pfn += 1UL << order;
+    }
+}
+
+/**
+ * Free the pages of a range that are not reserved
+ * 
+ * Each run of unreserved pages is freed as maximal buddy blocks, while
+ * reserved pages stay out of the free lists.
+ * 
+ * @param start_pfn Start page frame number
+ * @param end_pfn End page frame number
+ */
+static void pmm_free_unreserved(unsigned long start_pfn, unsigned long end_pfn) {
+    unsigned long pfn = start_pfn;
+    
+    while (pfn < end_pfn) {
+        unsigned long run_end;
+        
+        /* Skip reserved pages */
+        if (page_test_flags(&page_frames[pfn], (1 << PG_reserved))) {
+            pfn++;
+            continue;
+        }
+        
+        /* Find the end of the run */
+        for (run_end = pfn + 1; run_end < end_pfn; run_end++) {
+            if (page_test_flags(&page_frames[run_end], (1 << PG_reserved))) {
+                break;
+            }
+        }
+        
+        pmm_free_pfn_range(pfn, run_end);
+        pfn = run_end;
+    }
 }
 
 /**
  * Initialize the memory map
  * 
+ * The range is handed to the buddy allocator in maximal aligned blocks so
+ * that high-order allocations work straight after boot.
+ * 
  * @param start_pfn Start page frame number
  * @param end_pfn End page frame number
  */
@@ -176,34 +520,40 @@ void pmm_init_memmap(unsigned long start_pfn, unsigned long end_pfn) {
         return;
     }
     
-    /* Initialize the memory map */
+    /* Clamp to the page frame array */
+    if (end_pfn > page_frames_count) {
+        end_pfn = page_frames_count;
+    }
+    
+    /* Account the pages to their zones */
     for (unsigned long pfn = start_pfn; pfn < end_pfn; pfn++) {
-        /* Check if the page frame is valid */
-        if (pfn >= page_frames_count) {
-            break;
-        }
-        
-        /* Initialize the page frame */
-        page_t *page = &page_frames[pfn];
+        zone_t *zone = &zones[pfn_zone_idx(pfn)];
         
-        /* Clear the page flags */
-        page->flags = 0;
+        zone->present_pages++;
+        zone->nr_pages++;
+        total_pages++;
         
-        /* Set the page as free */
-        page_set_flags(page, (1 << PG_buddy));
+        /* An overlapping map entry may already have reserved the page */
+        if (page_test_flags(&page_frames[pfn], (1 << PG_reserved))) {
+            continue;
+        }
         
-        /* Add the page to the free list */
-        list_add(&page->list, &free_area[0]);
+        /* Clear the page flags */
+        page_frames[pfn].flags = 0;
         
-        /* Increment the free pages counter */
-        free_pages++;
-        total_pages++;
+        zone->managed_pages++;
     }
+    
+    /* Free the range into the buddy lists */
+    pmm_free_unreserved(start_pfn, end_pfn);
 }
 
 /**
  * Free a range of page frames
  * 
+ * The pages must have been allocated by the caller. Reserved pages in the
+ * range are skipped, they never go back to the free lists.
+ * 
  * @param start_pfn Start page frame number
  * @param end_pfn End page frame number
  */
@@ -213,34 +563,13 @@ void pmm_free_range(unsigned long start_pfn, unsigned long end_pfn) {
         return;
     }
     
-    /* Free the range */
-    for (unsigned long pfn = start_pfn; pfn < end_pfn; pfn++) {
-        /* Check if the page frame is valid */
-        if (pfn >= page_frames_count) {
-            break;
-        }
-        
-        /* Get the page frame */
-        page_t *page = &page_frames[pfn];
-        
-        /* Check if the page is reserved */
-        if (page_test_flags(page, (1 << PG_reserved))) {
-            /* Clear the reserved flag */
-            page_clear_flags(page, (1 << PG_reserved));
-            
-            /* Decrement the reserved pages counter */
-            reserved_pages--;
-            
-            /* Set the page as free */
-            page_set_flags(page, (1 << PG_buddy));
-            
-            /* Add the page to the free list */
-            list_add(&page->list, &free_area[0]);
-            
-            /* Increment the free pages counter */
-            free_pages++;
-        }
+    /* Clamp to the page frame array */
+    if (end_pfn > page_frames_count) {
+        end_pfn = page_frames_count;
     }
+    
+    /* Free the range */
+    pmm_free_unreserved(start_pfn, end_pfn);
 }
 
 /**
@@ -250,106 +579,334 @@ void pmm_free_range(unsigned long start_pfn, unsigned long end_pfn) {
  * @param end_pfn End page frame number
  */
 void pmm_reserve_range(unsigned long start_pfn, unsigned long end_pfn) {
+    unsigned long irq_flags;
+    
     /* Check parameters */
     if (start_pfn >= end_pfn) {
         return;
     }
     
     /* Reserve the range */
-    for (unsigned long pfn = start_pfn; pfn < end_pfn; pfn++) {
-        /* Check if the page frame is valid */
-        if (pfn >= page_frames_count) {
-            break;
-        }
-        
+    for (unsigned long pfn = start_pfn; pfn < end_pfn && pfn < page_frames_count; pfn++) {
         /* Get the page frame */
         page_t *page = &page_frames[pfn];
+        zone_t *zone = &zones[pfn_zone_idx(pfn)];
         
-        /* Check if the page is free */
-        if (page_test_flags(page, (1 << PG_buddy))) {
-            /* Clear the buddy flag */
-            page_clear_flags(page, (1 << PG_buddy));
-            
-            /* Remove the page from the free list */
-            list_del(&page->list);
-            
-            /* Decrement the free pages counter */
-            free_pages--;
+        /* Skip pages that are already reserved */
+        if (page_test_flags(page, (1 << PG_reserved))) {
+            continue;
+        }
+        
+        /* Split the page out of its free block, if it is free */
+        spin_lock_irqsave(&zone->lock, irq_flags);
+        if (__pmm_isolate_pfn(zone, pfn)) {
+            zone->managed_pages--;
         }
+        spin_unlock_irqrestore(&zone->lock, irq_flags);
         
         /* Set the page as reserved */
         page_set_flags(page, (1 << PG_reserved));
         
         /* Increment the reserved pages counter */
         reserved_pages++;
+        zone->nr_reserved_pages++;
     }
 }
 
+/**
+ * Check whether a zone can serve an allocation without dropping below a mark
+ * 
+ * Free blocks smaller than the requested order do not count, since they
+ * cannot satisfy it.
+ * 
+ * @param zone Zone to check
+ * @param order Page order
+ * @param mark Watermark in pages
+ * @return 1 if the allocation may proceed, 0 otherwise
+ */
+int pmm_zone_watermark_ok(zone_t *zone, unsigned int order, unsigned long mark) {
+    long free_pages = (long)zone->nr_free_pages - (1L << order) + 1;
+    long min = (long)mark;
+    
+    if (free_pages <= min) {
+        return 0;
+    }
+    
+    for (unsigned int o = 0; o < order; o++) {
+        /* Lower-order blocks are useless for this allocation */
+        free_pages -= (long)zone->nr_free[o] << o;
+        
+        /* Require fewer higher-order blocks */
+        min >>= 1;
+        
+        if (free_pages <= min) {
+            return 0;
+        }
+    }
+    
+    return 1;
+}
+
+/**
+ * Kick reclaim for a zone that dropped below its low watermark
+ * 
+ * @param zone Zone to reclaim from
+ * @param order Order of the allocation that triggered reclaim
+ * @return Number of pages reclaimed
+ */
+static unsigned long zone_wakeup_reclaim(zone_t *zone, unsigned int order) {
+    unsigned long reclaimed = 0;
+    unsigned long irq_flags;
+    
+    /* Only one reclaimer per zone at a time */
+    spin_lock_irqsave(&zone->lock, irq_flags);
+    if (zone->flags & ZONE_RECLAIM_ACTIVE) {
+        spin_unlock_irqrestore(&zone->lock, irq_flags);
+        return 0;
+    }
+    zone->flags |= ZONE_RECLAIM_ACTIVE;
+    zone->reclaim_wakeups++;
+    spin_unlock_irqrestore(&zone->lock, irq_flags);
+    
+    /* Reclaim up to the high watermark */
+    if (reclaim_handler != NULL && zone->nr_free_pages < zone->watermark[WMARK_HIGH]) {
+        reclaimed = reclaim_handler(zone, order, zone->watermark[WMARK_HIGH] - zone->nr_free_pages);
+    }
+    
+    spin_lock_irqsave(&zone->lock, irq_flags);
+    zone->flags &= ~ZONE_RECLAIM_ACTIVE;
+    spin_unlock_irqrestore(&zone->lock, irq_flags);
+    
+    return reclaimed;
+}
+
+/**
+ * Move a batch of order-0 pages from a zone's buddy lists onto a per-CPU list
+ * 
+ * @param zone Zone to refill from
+ * @param pcp Per-CPU list to refill
+ * @return Number of pages moved
+ */
+static unsigned int pcp_refill(zone_t *zone, per_cpu_pages_t *pcp) {
+    unsigned int moved = 0;
+    unsigned long irq_flags;
+    
+    /* Lock the zone once for the whole batch */
+    spin_lock_irqsave(&zone->lock, irq_flags);
+    
+    while (moved < pcp->batch) {
+        page_t *page = __pmm_buddy_alloc(zone, 0);
+        
+        if (page == NULL) {
+            break;
+        }
+        
+        /* Keep the batch in allocation order */
+        list_add_tail(&page->list, &pcp->list);
+        moved++;
+    }
+    
+    spin_unlock_irqrestore(&zone->lock, irq_flags);
+    
+    pcp->count += moved;
+    
+    return moved;
+}
+
+/**
+ * Return pages from the tail of a per-CPU list to a zone's buddy lists
+ * 
+ * @param zone Zone owning the list
+ * @param pcp Per-CPU list to drain
+ * @param count Maximum number of pages to return
+ */
+static void pcp_drain(zone_t *zone, per_cpu_pages_t *pcp, unsigned int count) {
+    unsigned long irq_flags;
+    
+    /* Lock the zone once for the whole batch */
+    spin_lock_irqsave(&zone->lock, irq_flags);
+    
+    while (count > 0 && pcp->count > 0) {
+        /* The tail holds the coldest pages */
+        page_t *page = list_entry(pcp->list.prev, page_t, list);
+        
+        list_del(&page->list);
+        pcp->count--;
+        count--;
+        
+        __pmm_buddy_free(zone, page, 0);
+    }
+    
+    spin_unlock_irqrestore(&zone->lock, irq_flags);
+}
+
+/**
+ * Allocate a single page through a zone's per-CPU page cache
+ * 
+ * @param zone Zone to allocate from
+ * @param flags Allocation flags
+ * @return Pointer to the allocated page, or NULL on failure
+ */
+static page_t *pcp_alloc_page(zone_t *zone, unsigned int flags) {
+    unsigned long irq_flags;
+    page_t *page = NULL;
+    
+    /* Keep this CPU's lists stable against interrupts */
+    local_irq_save(irq_flags);
+    
+    per_cpu_pageset_t *pset = &zone->pageset[smp_processor_id()];
+    per_cpu_pages_t *pcp = &pset->pcp[(flags & MEM_COLD) ? PCP_COLD : PCP_HOT];
+    
+    if (pcp->count == 0) {
+        /* Miss, refill a whole batch under one acquisition of the zone lock */
+        pset->alloc_miss++;
+        pcp_refill(zone, pcp);
+    } else {
+        pset->alloc_hit++;
+    }
+    
+    if (pcp->count > 0) {
+        page = list_entry(pcp->list.next, page_t, list);
+        list_del(&page->list);
+        pcp->count--;
+        page->order = 0;
+    }
+    
+    local_irq_restore(irq_flags);
+    
+    return page;
+}
+
+/**
+ * Free a single page through its zone's per-CPU page cache
+ * 
+ * @param page Page to free
+ * @param cold Non-zero to queue the page on the cold list
+ */
+static void pcp_free_page(page_t *page, int cold) {
+    unsigned long irq_flags;
+    zone_t *zone = pmm_page_zone(page);
+    
+    local_irq_save(irq_flags);
+    
+    per_cpu_pageset_t *pset = &zone->pageset[smp_processor_id()];
+    per_cpu_pages_t *pcp = &pset->pcp[cold ? PCP_COLD : PCP_HOT];
+    
+    /* Hot pages go to the head so the next allocation reuses them */
+    if (cold) {
+        list_add_tail(&page->list, &pcp->list);
+    } else {
+        list_add(&page->list, &pcp->list);
+    }
+    pcp->count++;
+    
+    /* Drain a batch once the list grows past the high watermark */
+    if (pcp->count >= pcp->high) {
+        pset->free_drain++;
+        pcp_drain(zone, pcp, pcp->batch);
+    } else {
+        pset->free_hit++;
+    }
+    
+    local_irq_restore(irq_flags);
+}
+
+/**
+ * Try to allocate from a single zone
+ * 
+ * @param zone Zone to allocate from
+ * @param order Page order
+ * @param flags Allocation flags
+ * @return Pointer to the allocated page, or NULL on failure
+ */
+static page_t *zone_alloc_pages(zone_t *zone, unsigned int order, unsigned int flags) {
+    unsigned long irq_flags;
+    page_t *page;
+    
+    /* Single pages come from the per-CPU cache */
+    if (order == 0) {
+        return pcp_alloc_page(zone, flags);
+    }
+    
+    /* Lock the zone */
+    spin_lock_irqsave(&zone->lock, irq_flags);
+    
+    /* Find a free block of the requested size */
+    page = __pmm_buddy_alloc(zone, order);
+    
+    /* Unlock the zone */
+    spin_unlock_irqrestore(&zone->lock, irq_flags);
+    
+    return page;
+}
+
 /**
  * Allocate pages
  * 
+ * Zones are tried from the highest one the flags allow down to DMA
+ * (HighMem, Normal, DMA). A first pass respects the low watermarks and
+ * kicks reclaim for zones below them; a second pass may dip down to the
+ * min watermarks.
+ * 
  * @param order Page order
  * @param flags Allocation flags
  * @return Pointer to the allocated page, or NULL on failure
  */
 page_t *pmm_alloc_pages(unsigned int order, unsigned int flags) {
+    int high_zone;
+    page_t *page;
+    
     /* Check parameters */
-    if (order > 10) {
+    if (order >= MAX_ORDER) {
         return NULL;
     }
     
-    /* Lock the physical memory manager */
-    spin_lock(&pmm_lock);
+    high_zone = flags_to_zone_idx(flags);
     
-    /* Find a free block of the requested size */
-    page_t *page = NULL;
-    unsigned int current_order = order;
-    
-    while (current_order <= 10) {
-        /* Check if there are free blocks of the current order */
-        if (!list_empty(&free_area[current_order])) {
-            /* Get the first free block */
-            page = list_entry(free_area[current_order].next, page_t, list);
-            
-            /* Remove the block from the free list */
-            list_del(&page->list);
-            
-            /* Clear the buddy flag */
-            page_clear_flags(page, (1 << PG_buddy));
-            
-            /* Split the block if necessary */
-            while (current_order > order) {
-                /* Decrement the order */
-                current_order--;
-                
-                /* Calculate the buddy page */
-                page_t *buddy = &page_frames[pmm_page_to_pfn(page) + (1 << current_order)];
-                
-                /* Set the buddy as free */
-                page_set_flags(buddy, (1 << PG_buddy));
-                
-                /* Add the buddy to the free list */
-                list_add(&buddy->list, &free_area[current_order]);
-            }
-            
-            /* Set the page order */
-            page->order = order;
-            
-            /* Decrement the free pages counter */
-            free_pages -= (1 << order);
-            
-            break;
+    /* First pass, stay above the low watermarks */
+    for (int i = high_zone; i >= 0; i--) {
+        zone_t *zone = &zones[i];
+        
+        if (zone->managed_pages == 0) {
+            continue;
+        }
+        
+        if (!pmm_zone_watermark_ok(zone, order, zone->watermark[WMARK_LOW])) {
+            zone_wakeup_reclaim(zone, order);
+            continue;
         }
         
-        /* Try the next order */
-        current_order++;
+        page = zone_alloc_pages(zone, order, flags);
+        if (page != NULL) {
+            if (i != high_zone) {
+                zone->alloc_fallbacks++;
+            }
+            return page;
+        }
     }
     
-    /* Unlock the physical memory manager */
-    spin_unlock(&pmm_lock);
+    /* Second pass, dip into the reserves down to the min watermarks */
+    for (int i = high_zone; i >= 0; i--) {
+        zone_t *zone = &zones[i];
+        
+        if (zone->managed_pages == 0) {
+            continue;
+        }
+        
+        if (!pmm_zone_watermark_ok(zone, order, zone->watermark[WMARK_MIN])) {
+            continue;
+        }
+        
+        page = zone_alloc_pages(zone, order, flags);
+        if (page != NULL) {
+            if (i != high_zone) {
+                zone->alloc_fallbacks++;
+            }
+            return page;
+        }
+    }
     
-    /* Return the allocated page */
-    return page;
+    return NULL;
 }
 
 /**
@@ -360,67 +917,221 @@ page_t *pmm_alloc_pages(unsigned int order, unsigned int flags) {
  */
 void pmm_free_pages(page_t *page, unsigned int order) {
     /* Check parameters */
-    if (page == NULL || order > 10) {
+    if (page == NULL || order >= MAX_ORDER) {
         return;
     }
     
-    /* Lock the physical memory manager */
-    spin_lock(&pmm_lock);
+    /* Single pages go back to the per-CPU cache */
+    if (order == 0) {
+        pcp_free_page(page, 0);
+        return;
+    }
     
-    /* Get the page frame number */
-    unsigned long pfn = pmm_page_to_pfn(page);
+    zone_t *zone = pmm_page_zone(page);
+    unsigned long irq_flags;
     
-    /* Set the page as free */
-    page_set_flags(page, (1 << PG_buddy));
+    /* Lock the zone */
+    spin_lock_irqsave(&zone->lock, irq_flags);
     
-    /* Set the page order */
-    page->order = order;
+    /* Return the block to the buddy lists */
+    __pmm_buddy_free(zone, page, order);
     
-    /* Increment the free pages counter */
-    free_pages += (1 << order);
+    /* Unlock the zone */
+    spin_unlock_irqrestore(&zone->lock, irq_flags);
+}
+
+/**
+ * Free a single page that is not expected to be cache-hot
+ * 
+ * @param page Page to free
+ */
+void pmm_free_cold_page(page_t *page) {
+    /* Check parameters */
+    if (page == NULL) {
+        return;
+    }
     
-    /* Try to merge with buddies */
-    while (order < 10) {
-        /* Calculate the buddy page frame number */
-        unsigned long buddy_pfn = pfn ^ (1 << order);
-        
-        /* Check if the buddy is valid */
-        if (buddy_pfn >= page_frames_count) {
-            break;
+    pcp_free_page(page, 1);
+}
+
+/**
+ * Drain all per-CPU cached pages of a CPU back to the buddy lists
+ * 
+ * Called for the local CPU, or for a CPU that is going offline and can no
+ * longer touch its own lists.
+ * 
+ * @param cpu CPU whose caches to drain
+ */
+void pmm_drain_cpu_pages(int cpu) {
+    unsigned long irq_flags;
+    
+    /* Check parameters */
+    if (cpu < 0 || cpu >= CONFIG_NR_CPUS) {
+        return;
+    }
+    
+    local_irq_save(irq_flags);
+    
+    for (int z = 0; z < MAX_NR_ZONES; z++) {
+        for (int i = 0; i < PCP_NR_LISTS; i++) {
+            per_cpu_pages_t *pcp = &zones[z].pageset[cpu].pcp[i];
+            pcp_drain(&zones[z], pcp, pcp->count);
         }
+    }
+    
+    local_irq_restore(irq_flags);
+}
+
+/**
+ * Drain the local CPU's cached pages back to the buddy lists
+ */
+void pmm_drain_local_pages(void) {
+    pmm_drain_cpu_pages(smp_processor_id());
+}
+
+/**
+ * Drain the cached pages of the CPU running a cross-CPU call
+ * 
+ * @param info Unused
+ */
+static void pmm_drain_pages_call(void *info) {
+    (void)info;
+    
+    pmm_drain_local_pages();
+}
+
+/**
+ * Set the per-CPU page cache watermark and batch size
+ * 
+ * The hot list uses the given values; the cold list is kept at a third of
+ * the high watermark since cold pages are rarely reused immediately.
+ * 
+ * @param high Number of cached pages above which a CPU drains a batch
+ * @param batch Number of pages moved per refill or drain
+ * @return 0 on success, or a negative error code
+ */
+int pmm_set_pcp_high(unsigned int high, unsigned int batch) {
+    /* Check parameters */
+    if (batch == 0 || high < batch) {
+        return -EINVAL;
+    }
+    
+    for (int z = 0; z < MAX_NR_ZONES; z++) {
+        for (int cpu = 0; cpu < CONFIG_NR_CPUS; cpu++) {
+            per_cpu_pages_t *hot = &zones[z].pageset[cpu].pcp[PCP_HOT];
+            per_cpu_pages_t *cold = &zones[z].pageset[cpu].pcp[PCP_COLD];
+            
+            hot->high = high;
+            hot->batch = batch;
+            cold->batch = (batch / 2) ? (batch / 2) : 1;
+            cold->high = (high / 3 > cold->batch) ? high / 3 : cold->batch;
+        }
+    }
+    
+    /* Trim the lists of every CPU to the new watermark right away */
+    smp_call_function(pmm_drain_pages_call, NULL, 1);
+    pmm_drain_local_pages();
+    
+    return 0;
+}
+
+/**
+ * Get the per-CPU page cache statistics of a CPU, summed over all zones
+ * 
+ * @param cpu CPU to query
+ * @param stats Statistics to fill in
+ * @return 0 on success, or a negative error code
+ */
+int pmm_get_pcp_stats(int cpu, pcp_stats_t *stats) {
+    /* Check parameters */
+    if (cpu < 0 || cpu >= CONFIG_NR_CPUS || stats == NULL) {
+        return -EINVAL;
+    }
+    
+    memset(stats, 0, sizeof(pcp_stats_t));
+    
+    for (int z = 0; z < MAX_NR_ZONES; z++) {
+        per_cpu_pageset_t *pset = &zones[z].pageset[cpu];
         
-        /* Get the buddy page */
-        page_t *buddy = &page_frames[buddy_pfn];
-        
-        /* Check if the buddy is free and has the same order */
-        if (!page_test_flags(buddy, (1 << PG_buddy)) || buddy->order != order) {
-            break;
+        stats->alloc_hit += pset->alloc_hit;
+        stats->alloc_miss += pset->alloc_miss;
+        stats->free_hit += pset->free_hit;
+        stats->free_drain += pset->free_drain;
+        stats->hot_count += pset->pcp[PCP_HOT].count;
+        stats->cold_count += pset->pcp[PCP_COLD].count;
+    }
+    
+    return 0;
+}
+
+/**
+ * Print the per-CPU page cache statistics
+ */
+void pmm_print_pcp_stats(void) {
+    pcp_stats_t stats;
+    
+    printk(KERN_INFO "PMM: Per-CPU page cache statistics\n");
+    
+    for (int cpu = 0; cpu < CONFIG_NR_CPUS; cpu++) {
+        if (!smp_cpu_online(cpu)) {
+            continue;
         }
         
-        /* Remove the buddy from the free list */
-        list_del(&buddy->list);
+        pmm_get_pcp_stats(cpu, &stats);
         
-        /* Clear the buddy flag */
-        page_clear_flags(buddy, (1 << PG_buddy));
+        printk(KERN_INFO "  CPU%d: hit=%lu miss=%lu free=%lu drain=%lu hot=%u cold=%u\n",
+               cpu, stats.alloc_hit, stats.alloc_miss, stats.free_hit,
+               stats.free_drain, stats.hot_count, stats.cold_count);
+    }
+}
+
+/**
+ * Set the handler called to reclaim pages from a zone under pressure
+ * 
+ * @param handler Reclaim handler, or NULL to disable reclaim
+ */
+void pmm_set_reclaim_handler(pmm_reclaim_fn_t handler) {
+    reclaim_handler = handler;
+}
+
+/**
+ * Get a zone by index
+ * 
+ * @param zone_id Zone index
+ * @return Zone, or NULL if the index is invalid
+ */
+zone_t *pmm_get_zone(int zone_id) {
+    /* Check parameters */
+    if (zone_id < 0 || zone_id >= MAX_NR_ZONES) {
+        return NULL;
+    }
+    
+    return &zones[zone_id];
+}
+
+/**
+ * Print per-zone free block counts and watermarks
+ */
+void pmm_print_zone_stats(void) {
+    for (int i = 0; i < MAX_NR_ZONES; i++) {
+        zone_t *zone = &zones[i];
         
-        /* Merge with the buddy */
-        if (buddy_pfn < pfn) {
-            pfn = buddy_pfn;
-            page = buddy;
+        if (zone->present_pages == 0) {
+            continue;
         }
         
-        /* Increment the order */
-        order++;
+        printk(KERN_INFO "PMM: Zone %s: free=%lu managed=%lu min=%lu low=%lu high=%lu reclaim=%lu fallback=%lu\n",
+               zone->name, zone->nr_free_pages, zone->managed_pages,
+               zone->watermark[WMARK_MIN], zone->watermark[WMARK_LOW],
+               zone->watermark[WMARK_HIGH], zone->reclaim_wakeups,
+               zone->alloc_fallbacks);
         
-        /* Set the new order */
-        page->order = order;
+        printk(KERN_INFO "PMM:   blocks:");
+        for (int order = 0; order < MAX_ORDER; order++) {
+            printk(" %lu", zone->nr_free[order]);
+        }
+        printk("\n");
     }
-    
-    /* Add the page to the free list */
-    list_add(&page->list, &free_area[order]);
-    
-    /* Unlock the physical memory manager */
-    spin_unlock(&pmm_lock);
 }
 
 /**
@@ -429,7 +1140,18 @@ void pmm_free_pages(page_t *page, unsigned int order) {
  * @return Number of free pages
  */
 unsigned long pmm_get_free_pages(void) {
-    return free_pages;
+    unsigned long free = 0;
+    
+    for (int z = 0; z < MAX_NR_ZONES; z++) {
+        free += zones[z].nr_free_pages;
+        
+        /* Pages parked on the per-CPU lists are still free */
+        for (int cpu = 0; cpu < CONFIG_NR_CPUS; cpu++) {
+            free += zones[z].pageset[cpu].pcp[PCP_HOT].count + zones[z].pageset[cpu].pcp[PCP_COLD].count;
+        }
+    }
+    
+    return free;
 }
 
 /**
@@ -456,7 +1178,7 @@ unsigned long pmm_get_reserved_pages(void) {
  * @return Number of used pages
  */
 unsigned long pmm_get_used_pages(void) {
-    return total_pages - free_pages;
+    return total_pages - pmm_get_free_pages();
 }
 
 /**
@@ -607,13 +1329,7 @@ zone_t *pmm_page_zone(page_t *page) {
     unsigned long pfn = pmm_page_to_pfn(page);
     
     /* Determine the zone */
-    if (pfn < 16 * 1024 * 1024 / PAGE_SIZE) {
-        return &zones[ZONE_DMA];
-    } else if (pfn < 896 * 1024 * 1024 / PAGE_SIZE) {
-        return &zones[ZONE_NORMAL];
-    } else {
-        return &zones[ZONE_HIGHMEM];
-    }
+    return &zones[pfn_zone_idx(pfn)];
 }
 
 /**
@@ -21,12 +21,28 @@
 #define NULL ((void *)0)
 #endif
 
+/* x86 two-level paging, both levels hold 1024 entries */
+#define PDE_PRESENT     0x001   /* Page directory entry is present */
+#define PDE_WRITE       0x002   /* Page directory entry is writable */
+#define PDE_USER        0x004   /* Page directory entry is user-accessible */
+#define PTE_PRESENT     0x001   /* Page table entry is present */
+#define PTE_WRITE       0x002   /* Page table entry is writable */
+#define PTE_USER        0x004   /* Page table entry is user-accessible */
+#define PTE_ADDR_MASK   0xFFFFF000UL
+#define PTRS_PER_TABLE  1024
+#define PGD_INDEX(addr) (((addr) >> 22) & (PTRS_PER_TABLE - 1))
+#define PTE_INDEX(addr) (((addr) >> PAGE_SHIFT) & (PTRS_PER_TABLE - 1))
+
 /* Virtual memory manager lock */
 static spinlock_t vmm_lock = SPIN_LOCK_INITIALIZER;
 
 /* List of all memory descriptors */
 static list_head_t mm_list;
 
+/* Locked halves of mmap and munmap, also used by mremap */
+static void *vmm_mmap_locked(mm_struct_t *mm, void *addr, unsigned long size, unsigned long vm_flags, unsigned long flags, struct file *file, unsigned long offset);
+static void vmm_munmap_locked(mm_struct_t *mm, unsigned long start, unsigned long end);
+
 /**
  * Initialize the virtual memory manager
  */
@@ -59,8 +75,8 @@ mm_struct_t *vmm_create_mm(void) {
     /* Initialize the memory descriptor */
     memset(mm, 0, sizeof(mm_struct_t));
 
-    /* Initialize the page global directory */
-    mm->pgd = kmalloc(sizeof(pgd_t) * 1024, 0);
+    /* The page global directory must fill a page of its own */
+    mm->pgd = pmm_alloc_page(MEM_KERNEL);
 
     if (mm->pgd == NULL) {
         kfree(mm);
@@ -68,7 +84,7 @@ mm_struct_t *vmm_create_mm(void) {
     }
 
     /* Initialize the page global directory */
-    memset(mm->pgd, 0, sizeof(pgd_t) * 1024);
+    memset(mm->pgd, 0, sizeof(pgd_t) * PTRS_PER_TABLE);
 
     /* Initialize the reference counts */
     atomic_set(&mm->mm_users, 1);
@@ -76,6 +92,7 @@ mm_struct_t *vmm_create_mm(void) {
 
     /* Initialize the locks */
     spin_lock_init(&mm->page_table_lock);
+    init_rwsem(&mm->mmap_sem);
 
     /* Add the memory descriptor to the list */
     spin_lock(&vmm_lock);
@@ -120,9 +137,14 @@ void vmm_destroy_mm(mm_struct_t *mm) {
         vma = next;
     }
 
-    /* Free the page global directory */
+    /* Free the page tables and the page global directory */
     if (mm->pgd != NULL) {
-        kfree(mm->pgd);
+        for (int i = 0; i < PTRS_PER_TABLE; i++) {
+            if (mm->pgd[i].pgd & PDE_PRESENT) {
+                pmm_free_page(pmm_phys_to_virt(mm->pgd[i].pgd & PTE_ADDR_MASK));
+            }
+        }
+        pmm_free_page(mm->pgd);
     }
 
     /* Free the memory descriptor */
@@ -293,29 +315,83 @@ vm_area_struct_t *vmm_find_vma(mm_struct_t *mm, unsigned long addr) {
     return NULL;
 }
 
+/**
+ * Find the page table entry of an address
+ *
+ * The caller must hold mm->page_table_lock.
+ *
+ * @param mm Memory descriptor
+ * @param addr Virtual address
+ * @return Pointer to the entry, or NULL if the address has no page table
+ */
+static pte_t *vmm_find_pte(mm_struct_t *mm, unsigned long addr) {
+    pgd_t *pgd = &mm->pgd[PGD_INDEX(addr)];
+
+    if (!(pgd->pgd & PDE_PRESENT)) {
+        return NULL;
+    }
+
+    return (pte_t *)pmm_phys_to_virt(pgd->pgd & PTE_ADDR_MASK) + PTE_INDEX(addr);
+}
+
 /**
  * Map a page
  *
  * @param mm Memory descriptor
  * @param addr Virtual address
  * @param page Page to map
- * @param flags Flags
- * @return 0 on success, negative error code on failure
+ * @param flags VM_* flags of the area, VM_WRITE makes the page writable
+ * @return 0 on success, -EEXIST if the address is already mapped, other negative error code on failure
  */
 int vmm_map_page(mm_struct_t *mm, unsigned long addr, page_t *page, unsigned long flags) {
+    pte_t *table = NULL;
+
     /* Check parameters */
-    if (mm == NULL || page == NULL) {
+    if (mm == NULL || mm->pgd == NULL || page == NULL) {
         return -EINVAL;
     }
 
     /* Align the address to a page boundary */
     addr = addr & ~(PAGE_SIZE - 1);
 
-    /* Find the page table entry */
-    pte_t *pte = NULL;
+    /* Allocate a missing page table before taking the lock */
+    if (!(mm->pgd[PGD_INDEX(addr)].pgd & PDE_PRESENT)) {
+        table = pmm_alloc_page(MEM_KERNEL);
+        if (table == NULL) {
+            return -ENOMEM;
+        }
+        memset(table, 0, sizeof(pte_t) * PTRS_PER_TABLE);
+    }
 
-    /* This would be implemented with actual page table traversal */
-    /* For now, just return success */
+    spin_lock(&mm->page_table_lock);
+
+    /* Install the page table, unless someone else did meanwhile */
+    pte_t *pte = vmm_find_pte(mm, addr);
+    if (pte == NULL) {
+        if (table == NULL) {
+            spin_unlock(&mm->page_table_lock);
+            return vmm_map_page(mm, addr, page, flags);
+        }
+
+        mm->pgd[PGD_INDEX(addr)].pgd = pmm_virt_to_phys(table) | PDE_PRESENT | PDE_WRITE | PDE_USER;
+        table = NULL;
+        pte = vmm_find_pte(mm, addr);
+    }
+
+    if (pte->pte & PTE_PRESENT) {
+        spin_unlock(&mm->page_table_lock);
+        pmm_free_page(table);
+        return -EEXIST;
+    }
+
+    /* Not-present entries are never cached, so no TLB flush is needed */
+    pte->pte = (pmm_page_to_pfn(page) << PAGE_SHIFT) | PTE_PRESENT | PTE_USER |
+               ((flags & VM_WRITE) ? PTE_WRITE : 0);
+
+    spin_unlock(&mm->page_table_lock);
+
+    /* Lost the race to install the table */
+    pmm_free_page(table);
 
     return 0;
 }
@@ -323,24 +399,37 @@ int vmm_map_page(mm_struct_t *mm, unsigned long addr, page_t *page, unsigned lon
 /**
  * Unmap a page
  *
+ * Only the TLB of this CPU is flushed.
+ *
  * @param mm Memory descriptor
  * @param addr Virtual address
  * @return 0 on success, negative error code on failure
  */
 int vmm_unmap_page(mm_struct_t *mm, unsigned long addr) {
     /* Check parameters */
-    if (mm == NULL) {
+    if (mm == NULL || mm->pgd == NULL) {
         return -EINVAL;
     }
 
     /* Align the address to a page boundary */
     addr = addr & ~(PAGE_SIZE - 1);
 
+    spin_lock(&mm->page_table_lock);
+
     /* Find the page table entry */
-    pte_t *pte = NULL;
+    pte_t *pte = vmm_find_pte(mm, addr);
+
+    if (pte == NULL || !(pte->pte & PTE_PRESENT)) {
+        spin_unlock(&mm->page_table_lock);
+        return -EFAULT;
+    }
+
+    pte->pte = 0;
+
+    spin_unlock(&mm->page_table_lock);
 
-    /* This would be implemented with actual page table traversal */
-    /* For now, just return success */
+    /* Drop a stale translation */
+    __asm__ volatile("invlpg (%0)" : : "r"(addr) : "memory");
 
     return 0;
 }
@@ -353,21 +442,25 @@ int vmm_unmap_page(mm_struct_t *mm, unsigned long addr) {
  * @return Pointer to the page, or NULL if not mapped
  */
 page_t *vmm_get_page(mm_struct_t *mm, unsigned long addr) {
+    page_t *page = NULL;
+
     /* Check parameters */
-    if (mm == NULL) {
+    if (mm == NULL || mm->pgd == NULL) {
         return NULL;
     }
 
-    /* Align the address to a page boundary */
-    addr = addr & ~(PAGE_SIZE - 1);
+    spin_lock(&mm->page_table_lock);
 
     /* Find the page table entry */
-    pte_t *pte = NULL;
+    pte_t *pte = vmm_find_pte(mm, addr);
 
-    /* This would be implemented with actual page table traversal */
-    /* For now, just return NULL */
+    if (pte != NULL && (pte->pte & PTE_PRESENT)) {
+        page = pmm_pfn_to_page(pte->pte >> PAGE_SHIFT);
+    }
 
-    return NULL;
+    spin_unlock(&mm->page_table_lock);
+
+    return page;
 }
 
 /**
@@ -384,33 +477,41 @@ int vmm_handle_fault(mm_struct_t *mm, unsigned long addr, unsigned long error_co
         return -EINVAL;
     }
 
+    /* Keep the memory areas stable, page_alloc() may sleep */
+    down_read(&mm->mmap_sem);
+
     /* Find the virtual memory area */
     vm_area_struct_t *vma = vmm_find_vma(mm, addr);
 
     if (vma == NULL) {
         /* No virtual memory area found */
+        up_read(&mm->mmap_sem);
         return -EFAULT;
     }
 
     /* Check if the address is in the virtual memory area */
     if (addr < vma->vm_start) {
         /* Address is not in the virtual memory area */
+        up_read(&mm->mmap_sem);
         return -EFAULT;
     }
 
     /* Check if the virtual memory area has the required permissions */
     if ((error_code & 2) && !(vma->vm_flags & VM_WRITE)) {
         /* Write access to a read-only page */
+        up_read(&mm->mmap_sem);
         return -EFAULT;
     }
 
     if ((error_code & 4) && !(vma->vm_flags & VM_EXEC)) {
         /* Execute access to a non-executable page */
+        up_read(&mm->mmap_sem);
         return -EFAULT;
     }
 
     if (!(error_code & 1) && !(vma->vm_flags & VM_READ)) {
         /* Read access to a non-readable page */
+        up_read(&mm->mmap_sem);
         return -EFAULT;
     }
 
@@ -419,16 +520,19 @@ int vmm_handle_fault(mm_struct_t *mm, unsigned long addr, unsigned long error_co
 
     if (page == NULL) {
         /* Failed to allocate a page */
+        up_read(&mm->mmap_sem);
         return -ENOMEM;
     }
 
     /* Map the page */
     int ret = vmm_map_page(mm, addr, page, vma->vm_flags);
 
+    up_read(&mm->mmap_sem);
+
     if (ret < 0) {
-        /* Failed to map the page */
+        /* Failed to map the page, or a racing fault mapped it first */
         page_free(page, 0);
-        return ret;
+        return ret == -EEXIST ? 0 : ret;
     }
 
     return 0;
@@ -500,6 +604,26 @@ void *vmm_mmap(mm_struct_t *mm, void *addr, unsigned long size, unsigned long pr
         vm_flags |= VM_NORESERVE;
     }
 
+    down_write(&mm->mmap_sem);
+    addr = vmm_mmap_locked(mm, addr, size, vm_flags, flags, file, offset);
+    up_write(&mm->mmap_sem);
+
+    return addr;
+}
+
+/**
+ * Map memory with mmap_sem held for writing
+ *
+ * @param mm Memory descriptor
+ * @param addr Page aligned address hint
+ * @param size Page aligned size of the mapping
+ * @param vm_flags Virtual memory area flags
+ * @param flags Mapping flags
+ * @param file File to map, or NULL for anonymous mapping
+ * @param offset Offset into the file
+ * @return Mapped address on success, NULL on failure
+ */
+static void *vmm_mmap_locked(mm_struct_t *mm, void *addr, unsigned long size, unsigned long vm_flags, unsigned long flags, struct file *file, unsigned long offset) {
     /* Check if we need to find an address */
     if (addr == NULL || (flags & MAP_FIXED) == 0) {
         /* Find a free region */
@@ -568,11 +692,22 @@ int vmm_munmap(mm_struct_t *mm, void *addr, unsigned long size) {
     /* Align the size to a page boundary */
     size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
 
-    /* Find all virtual memory areas in the range */
-    unsigned long start = (unsigned long)addr;
-    unsigned long end = start + size;
-
     /* Lock the memory descriptor */
+    down_write(&mm->mmap_sem);
+    vmm_munmap_locked(mm, (unsigned long)addr, (unsigned long)addr + size);
+    up_write(&mm->mmap_sem);
+
+    return 0;
+}
+
+/**
+ * Unmap memory with mmap_sem held for writing
+ *
+ * @param mm Memory descriptor
+ * @param start Page aligned start of the range
+ * @param end Page aligned end of the range
+ */
+static void vmm_munmap_locked(mm_struct_t *mm, unsigned long start, unsigned long end) {
     spin_lock(&mm->page_table_lock);
 
     /* Find the first virtual memory area */
@@ -647,8 +782,6 @@ int vmm_munmap(mm_struct_t *mm, void *addr, unsigned long size) {
 
     /* Unlock the memory descriptor */
     spin_unlock(&mm->page_table_lock);
-
-    return 0;
 }
 
 /**
@@ -670,6 +803,7 @@ int vmm_brk(mm_struct_t *mm, unsigned long brk) {
     }
 
     /* Lock the memory descriptor */
+    down_write(&mm->mmap_sem);
     spin_lock(&mm->page_table_lock);
 
     /* Calculate the old and new sizes */
@@ -689,6 +823,7 @@ int vmm_brk(mm_struct_t *mm, unsigned long brk) {
                 /* Virtual memory area can be extended */
                 mm->brk = brk;
                 spin_unlock(&mm->page_table_lock);
+                up_write(&mm->mmap_sem);
                 return brk;
             }
         }
@@ -698,8 +833,11 @@ int vmm_brk(mm_struct_t *mm, unsigned long brk) {
 
         if (vma == NULL) {
             /* Failed to create a virtual memory area */
+            unsigned long old_brk = mm->brk;
+
             spin_unlock(&mm->page_table_lock);
-            return mm->brk;
+            up_write(&mm->mmap_sem);
+            return old_brk;
         }
     } else if (new_size < old_size) {
         /* Find all virtual memory areas in the range */
@@ -782,6 +920,7 @@ int vmm_brk(mm_struct_t *mm, unsigned long brk) {
 
     /* Unlock the memory descriptor */
     spin_unlock(&mm->page_table_lock);
+    up_write(&mm->mmap_sem);
 
     return brk;
 }
@@ -827,6 +966,7 @@ int vmm_mprotect(mm_struct_t *mm, void *addr, unsigned long size, unsigned long
     unsigned long end = start + size;
 
     /* Lock the memory descriptor */
+    down_write(&mm->mmap_sem);
     spin_lock(&mm->page_table_lock);
 
     /* Find the first virtual memory area */
@@ -863,6 +1003,7 @@ int vmm_mprotect(mm_struct_t *mm, void *addr, unsigned long size, unsigned long
 
     /* Unlock the memory descriptor */
     spin_unlock(&mm->page_table_lock);
+    up_write(&mm->mmap_sem);
 
     return 0;
 }
@@ -900,15 +1041,14 @@ void *vmm_mremap(mm_struct_t *mm, void *old_addr, unsigned long old_size, unsign
         return old_addr;
     }
 
+    /* Lock the memory descriptor for the whole move */
+    down_write(&mm->mmap_sem);
+
     /* Check if the new size is smaller than the old size */
     if (new_size < old_size) {
         /* Shrink the mapping */
-        int ret = vmm_munmap(mm, (void *)((unsigned long)old_addr + new_size), old_size - new_size);
-
-        if (ret < 0) {
-            /* Failed to shrink the mapping */
-            return NULL;
-        }
+        vmm_munmap_locked(mm, (unsigned long)old_addr + new_size, (unsigned long)old_addr + old_size);
+        up_write(&mm->mmap_sem);
 
         return old_addr;
     }
@@ -967,6 +1107,7 @@ void *vmm_mremap(mm_struct_t *mm, void *old_addr, unsigned long old_size, unsign
             mm->stack_vm += (new_size - old_size) / PAGE_SIZE;
         }
 
+        up_write(&mm->mmap_sem);
         return old_addr;
     }
 
@@ -975,22 +1116,19 @@ create_new:
     if (flags & MREMAP_FIXED) {
         /* Check if a new address was specified */
         if (new_addr == NULL) {
+            up_write(&mm->mmap_sem);
             return NULL;
         }
 
         /* Unmap the new region */
-        int ret = vmm_munmap(mm, new_addr, new_size);
-
-        if (ret < 0) {
-            /* Failed to unmap the new region */
-            return NULL;
-        }
+        vmm_munmap_locked(mm, (unsigned long)new_addr, (unsigned long)new_addr + new_size);
     } else {
         /* Find a new address */
-        new_addr = vmm_mmap(mm, NULL, new_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, NULL, 0);
+        new_addr = vmm_mmap_locked(mm, NULL, new_size, VM_READ | VM_MAYREAD | VM_WRITE | VM_MAYWRITE, MAP_PRIVATE | MAP_ANONYMOUS, NULL, 0);
 
         if (new_addr == NULL) {
             /* Failed to find a new address */
+            up_write(&mm->mmap_sem);
             return NULL;
         }
     }
@@ -999,13 +1137,9 @@ create_new:
     memcpy(new_addr, old_addr, old_size);
 
     /* Unmap the old mapping */
-    int ret = vmm_munmap(mm, old_addr, old_size);
+    vmm_munmap_locked(mm, (unsigned long)old_addr, (unsigned long)old_addr + old_size);
 
-    if (ret < 0) {
-        /* Failed to unmap the old mapping */
-        vmm_munmap(mm, new_addr, new_size);
-        return NULL;
-    }
+    up_write(&mm->mmap_sem);
 
     return new_addr;
 }
@@ -1035,6 +1169,7 @@ int vmm_mlock(mm_struct_t *mm, void *addr, unsigned long size) {
     unsigned long end = start + size;
 
     /* Lock the memory descriptor */
+    down_write(&mm->mmap_sem);
     spin_lock(&mm->page_table_lock);
 
     /* Find the first virtual memory area */
@@ -1070,6 +1205,7 @@ int vmm_mlock(mm_struct_t *mm, void *addr, unsigned long size) {
 
     /* Unlock the memory descriptor */
     spin_unlock(&mm->page_table_lock);
+    up_write(&mm->mmap_sem);
 
     return 0;
 }
@@ -1099,6 +1235,7 @@ int vmm_munlock(mm_struct_t *mm, void *addr, unsigned long size) {
     unsigned long end = start + size;
 
     /* Lock the memory descriptor */
+    down_write(&mm->mmap_sem);
     spin_lock(&mm->page_table_lock);
 
     /* Find the first virtual memory area */
@@ -1134,6 +1271,7 @@ int vmm_munlock(mm_struct_t *mm, void *addr, unsigned long size) {
 
     /* Unlock the memory descriptor */
     spin_unlock(&mm->page_table_lock);
+    up_write(&mm->mmap_sem);
 
     return 0;
 }
@@ -1152,6 +1290,7 @@ int vmm_mlockall(mm_struct_t *mm, unsigned long flags) {
     }
 
     /* Lock the memory descriptor */
+    down_write(&mm->mmap_sem);
     spin_lock(&mm->page_table_lock);
 
     /* Find the first virtual memory area */
@@ -1177,6 +1316,7 @@ int vmm_mlockall(mm_struct_t *mm, unsigned long flags) {
 
     /* Unlock the memory descriptor */
     spin_unlock(&mm->page_table_lock);
+    up_write(&mm->mmap_sem);
 
     return 0;
 }
@@ -1194,6 +1334,7 @@ int vmm_munlockall(mm_struct_t *mm) {
     }
 
     /* Lock the memory descriptor */
+    down_write(&mm->mmap_sem);
     spin_lock(&mm->page_table_lock);
 
     /* Find the first virtual memory area */
@@ -1219,6 +1360,7 @@ int vmm_munlockall(mm_struct_t *mm) {
 
     /* Unlock the memory descriptor */
     spin_unlock(&mm->page_table_lock);
+    up_write(&mm->mmap_sem);
 
     return 0;
 }
@@ -1249,6 +1391,7 @@ int vmm_madvise(mm_struct_t *mm, void *addr, unsigned long size, unsigned long a
     unsigned long end = start + size;
 
     /* Lock the memory descriptor */
+    down_read(&mm->mmap_sem);
     spin_lock(&mm->page_table_lock);
 
     /* Find the first virtual memory area */
@@ -1284,6 +1427,7 @@ int vmm_madvise(mm_struct_t *mm, void *addr, unsigned long size, unsigned long a
                 default:
                     /* Invalid advice */
                     spin_unlock(&mm->page_table_lock);
+                    up_read(&mm->mmap_sem);
                     return -EINVAL;
             }
         }
@@ -1298,6 +1442,7 @@ int vmm_madvise(mm_struct_t *mm, void *addr, unsigned long size, unsigned long a
 
     /* Unlock the memory descriptor */
     spin_unlock(&mm->page_table_lock);
+    up_read(&mm->mmap_sem);
 
     return 0;
 }
@@ -1328,6 +1473,7 @@ int vmm_msync(mm_struct_t *mm, void *addr, unsigned long size, unsigned long fla
     unsigned long end = start + size;
 
     /* Lock the memory descriptor */
+    down_read(&mm->mmap_sem);
     spin_lock(&mm->page_table_lock);
 
     /* Find the first virtual memory area */
@@ -1356,6 +1502,7 @@ int vmm_msync(mm_struct_t *mm, void *addr, unsigned long size, unsigned long fla
 
     /* Unlock the memory descriptor */
     spin_unlock(&mm->page_table_lock);
+    up_read(&mm->mmap_sem);
 
     return 0;
 }
@@ -1388,8 +1535,8 @@ int vmm_mincore(mm_struct_t *mm, void *addr, unsigned long size, unsigned char *
     unsigned long start = (unsigned long)addr;
     unsigned long end = start + size;
 
-    /* Lock the memory descriptor */
-    spin_lock(&mm->page_table_lock);
+    /* Lock the memory descriptor, walkers only read the area list */
+    down_read(&mm->mmap_sem);
 
     /* Initialize the vector */
     for (unsigned long i = 0; i < nr_pages; i++) {
@@ -1429,7 +1576,7 @@ int vmm_mincore(mm_struct_t *mm, void *addr, unsigned long size, unsigned char *
     }
 
     /* Unlock the memory descriptor */
-    spin_unlock(&mm->page_table_lock);
+    up_read(&mm->mmap_sem);
 
     return 0;
 }
@@ -1,7 +1,18 @@
 /**
  * epoll.c - Horizon kernel epoll implementation
- * 
+ *
  * This file contains the implementation of the epoll system call.
+ *
+ * Each watched file gets a wait queue entry of the epoll instance, put on
+ * its wait queues through poll_wait() when it is added. A wakeup on the
+ * file moves its item to the instance's ready list, so epoll_wait() only
+ * looks at the items that had something happen, not at every one watched.
+ * Level triggered items go back on the list after being reported, and
+ * drop off once a poll finds nothing; edge triggered ones wait for the
+ * next wakeup.
+ *
+ * Items are kept in a tree keyed by (file, fd). An instance lives as long
+ * as its file; closing a watched file removes it from every instance.
  */
 
 #include <horizon/kernel.h>
@@ -10,6 +21,18 @@
 #include <horizon/fs/vfs.h>
 #include <horizon/mm.h>
 #include <horizon/string.h>
+#include <horizon/poll.h>
+#include <horizon/wait.h>
+#include <horizon/sync.h>
+#include <horizon/rbtree.h>
+#include <horizon/spinlock.h>
+#include <horizon/irqflags.h>
+#include <horizon/sched.h>
+#include <horizon/time.h>
+#include <horizon/timer.h>
+#include <horizon/thread.h>
+#include <horizon/signal.h>
+#include <horizon/errno.h>
 
 /* Define NULL if not defined */
 #ifndef NULL
@@ -29,20 +52,24 @@
 #define EPOLLWRBAND     0x0200  /* Priority data may be written */
 #define EPOLLMSG        0x0400  /* A message is available */
 #define EPOLLRDHUP      0x2000  /* Stream socket peer closed connection */
-#define EPOLLWAKEUP     (1 << 29) /* Epoll event: disable system suspend */
-#define EPOLLONESHOT    (1 << 30) /* Epoll event: one shot */
-#define EPOLLET         (1 << 31) /* Epoll event: edge triggered */
+#define EPOLLEXCLUSIVE  (1U << 28) /* Epoll event: wake one of the instances watching the file */
+#define EPOLLWAKEUP     (1U << 29) /* Epoll event: disable system suspend */
+#define EPOLLONESHOT    (1U << 30) /* Epoll event: one shot */
+#define EPOLLET         (1U << 31) /* Epoll event: edge triggered */
+
+/* Flags that change how an item is reported, not events */
+#define EP_PRIVATE_BITS (EPOLLWAKEUP | EPOLLONESHOT | EPOLLET | EPOLLEXCLUSIVE)
+
+/* Events an exclusive item may ask for */
+#define EPOLLEXCLUSIVE_OK_BITS (EPOLLIN | EPOLLOUT | EPOLLERR | EPOLLHUP | EPOLLWAKEUP | EPOLLET | EPOLLEXCLUSIVE)
 
 /* Epoll operation */
 #define EPOLL_CTL_ADD   1       /* Add a file descriptor to the interface */
 #define EPOLL_CTL_DEL   2       /* Remove a file descriptor from the interface */
 #define EPOLL_CTL_MOD   3       /* Change file descriptor epoll_event structure */
 
-/* Epoll event structure */
-struct epoll_event {
-    uint32_t events;    /* Epoll events */
-    epoll_data_t data;  /* User data variable */
-};
+/* Deepest nesting of epoll instances watching each other */
+#define EPOLL_MAX_NESTS 4
 
 /* Epoll data structure */
 typedef union epoll_data {
@@ -52,152 +79,589 @@ typedef union epoll_data {
     uint64_t u64;       /* 64-bit integer */
 } epoll_data_t;
 
+/* Epoll event structure */
+struct epoll_event {
+    uint32_t events;    /* Epoll events */
+    epoll_data_t data;  /* User data variable */
+};
+
+struct epoll;
+
 /* Epoll item structure */
 struct epoll_item {
-    struct list_head list;      /* List of epoll items */
+    struct rb_node node;        /* Node in the instance's item tree */
+    struct list_head rdllink;   /* Link in the ready list, empty when not on it */
+    struct list_head fllink;    /* Link in the watched file's f_ep_links */
+    struct list_head pwqlist;   /* Wait queue entries on the watched file */
+    struct epoll *ep;           /* Instance the item belongs to */
     int fd;                     /* File descriptor */
     file_t *file;               /* File */
     struct epoll_event event;   /* Epoll event */
 };
 
-/* Epoll structure */
-struct epoll {
-    struct list_head items;     /* List of epoll items */
-    struct wait_queue_head wait; /* Wait queue */
-    struct mutex mutex;         /* Mutex */
+/* Wait queue entry an item has on one of the watched file's wait queues */
+struct epoll_pwq {
+    struct list_head list;      /* Link in the item's pwqlist */
+    wait_queue_entry_t wait;    /* Entry on the file's wait queue */
+    wait_queue_head_t *whead;   /* Wait queue the entry is on */
+    struct epoll_item *item;    /* Item to make ready */
 };
 
-/* Maximum number of epoll instances */
-#define MAX_EPOLL 1024
+/* Poll table installing an item's wait queue entries */
+struct epoll_pqueue {
+    struct poll_table_struct pt; /* Poll table passed to the file */
+    struct epoll_item *item;    /* Item being added */
+    int nwait;                  /* Entries installed, -1 if one could not be */
+};
 
-/* Epoll instances */
-static struct epoll *epoll_table[MAX_EPOLL];
+/* Epoll structure */
+struct epoll {
+    struct mutex mutex;         /* Serializes epoll_ctl() and the harvesting */
+    spinlock_t lock;            /* Protects the ready list */
+    struct list_head rdllist;   /* Items with events pending */
+    rb_root_t items;            /* Items, by file and fd */
+    wait_queue_head_t wq;       /* Threads in epoll_wait() */
+    wait_queue_head_t poll_wait; /* Pollers of the epoll file itself */
+    file_t *file;               /* File of the instance */
+};
 
-/* Epoll mutex */
+/* Protects the f_ep_links of all files and the nesting of instances */
 static struct mutex epoll_mutex;
 
+/* Epoll file operations, defined below */
+static const struct file_operations epoll_fops;
+
 /**
  * Initialize the epoll subsystem
  */
 void epoll_init(void) {
     /* Initialize the mutex */
     mutex_init(&epoll_mutex);
-    
-    /* Initialize the epoll instances */
-    for (int i = 0; i < MAX_EPOLL; i++) {
-        epoll_table[i] = NULL;
+}
+
+/**
+ * Check whether a file is an epoll instance
+ *
+ * @param file The file
+ * @return Nonzero if it is
+ */
+static int is_epoll_file(file_t *file) {
+    return file->f_op == &epoll_fops;
+}
+
+/**
+ * Compare an item's key with a file and fd
+ *
+ * @param item The item
+ * @param file The file
+ * @param fd The file descriptor
+ * @return Negative, zero or positive as the key sorts before, at or after
+ */
+static int ep_cmp(struct epoll_item *item, file_t *file, int fd) {
+    if (file != item->file) {
+        return (unsigned long)file < (unsigned long)item->file ? -1 : 1;
+    }
+
+    return fd - item->fd;
+}
+
+/**
+ * Find an item in the tree
+ *
+ * @param ep The epoll instance, its mutex held
+ * @param file The file
+ * @param fd The file descriptor
+ * @return The item, or NULL
+ */
+static struct epoll_item *ep_find(struct epoll *ep, file_t *file, int fd) {
+    struct rb_node *node = ep->items.rb_node;
+
+    while (node != NULL) {
+        struct epoll_item *item = rb_entry(node, struct epoll_item, node);
+        int cmp = ep_cmp(item, file, fd);
+
+        if (cmp < 0) {
+            node = node->rb_left;
+        } else if (cmp > 0) {
+            node = node->rb_right;
+        } else {
+            return item;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Insert an item into the tree
+ *
+ * @param ep The epoll instance, its mutex held
+ * @param item The item, not in the tree
+ */
+static void ep_insert_item(struct epoll *ep, struct epoll_item *item) {
+    struct rb_node **link = &ep->items.rb_node;
+    struct rb_node *parent = NULL;
+
+    while (*link != NULL) {
+        parent = *link;
+
+        if (ep_cmp(rb_entry(parent, struct epoll_item, node), item->file, item->fd) < 0) {
+            link = &parent->rb_left;
+        } else {
+            link = &parent->rb_right;
+        }
+    }
+
+    rb_link_node(&item->node, parent, link);
+    rb_insert_color(&item->node, &ep->items);
+}
+
+/**
+ * Put an item on the ready list and wake the waiters
+ *
+ * @param ep The epoll instance
+ * @param item The item
+ */
+static void ep_set_ready(struct epoll *ep, struct epoll_item *item) {
+    unsigned long flags;
+
+    local_irq_save(flags);
+    spin_lock(&ep->lock);
+
+    if (list_empty(&item->rdllink)) {
+        list_add_tail(&item->rdllink, &ep->rdllist);
+    }
+
+    spin_unlock(&ep->lock);
+    local_irq_restore(flags);
+
+    wake_up(&ep->wq);
+    wake_up(&ep->poll_wait);
+}
+
+/**
+ * Wait queue callback of a watched file
+ *
+ * Runs under the file's wait queue lock, possibly from an interrupt.
+ *
+ * @param wq_entry The entry of the item
+ * @param mode The wakeup mode
+ * @param sync The wakeup flags
+ * @param key The wakeup key
+ * @return 1 for an exclusive item, so the file stops waking others
+ */
+static int ep_poll_callback(wait_queue_entry_t *wq_entry, unsigned mode, int sync, void *key) {
+    struct epoll_pwq *pwq = container_of(wq_entry, struct epoll_pwq, wait);
+    struct epoll_item *item = pwq->item;
+
+    (void)mode;
+    (void)sync;
+    (void)key;
+
+    /* A one shot item is disabled until rearmed with EPOLL_CTL_MOD */
+    if (!(item->event.events & ~EP_PRIVATE_BITS)) {
+        return 0;
+    }
+
+    ep_set_ready(item->ep, item);
+
+    return (item->event.events & EPOLLEXCLUSIVE) ? 1 : 0;
+}
+
+/**
+ * Queue callback of the poll table, installs an entry on a wait queue
+ *
+ * @param file The watched file
+ * @param whead The wait queue
+ * @param table The poll table
+ */
+static void ep_ptable_queue_proc(file_t *file, wait_queue_head_t *whead, struct poll_table_struct *table) {
+    struct epoll_pqueue *epq = container_of(table, struct epoll_pqueue, pt);
+    struct epoll_item *item = epq->item;
+    struct epoll_pwq *pwq = kmalloc(sizeof(struct epoll_pwq), MEM_KERNEL | MEM_ZERO);
+    int flags = 0;
+
+    (void)file;
+
+    if (pwq == NULL) {
+        epq->nwait = -1;
+        return;
+    }
+
+    if (epq->nwait >= 0) {
+        epq->nwait++;
+    }
+
+    if (item->event.events & EPOLLEXCLUSIVE) {
+        flags |= WQ_FLAG_EXCLUSIVE;
+    }
+
+    wait_queue_entry_init(&pwq->wait, flags, item, ep_poll_callback);
+    pwq->whead = whead;
+    pwq->item = item;
+    list_add_tail(&pwq->list, &item->pwqlist);
+
+    wait_queue_add(whead, &pwq->wait);
+}
+
+/**
+ * Take an item off its file's wait queues
+ *
+ * Once done no callback for the item is running or can start.
+ *
+ * @param item The item
+ */
+static void ep_unregister_pollwait(struct epoll_item *item) {
+    struct epoll_pwq *pwq, *tmp;
+
+    list_for_each_entry_safe(pwq, tmp, &item->pwqlist, list) {
+        wait_queue_remove(pwq->whead, &pwq->wait);
+        list_del(&pwq->list);
+        kfree(pwq);
     }
 }
 
+/**
+ * Remove an item from an instance and free it
+ *
+ * @param ep The epoll instance, its mutex and epoll_mutex held
+ * @param item The item
+ */
+static void ep_remove(struct epoll *ep, struct epoll_item *item) {
+    unsigned long flags;
+
+    ep_unregister_pollwait(item);
+
+    list_del(&item->fllink);
+    rb_erase(&item->node, &ep->items);
+
+    local_irq_save(flags);
+    spin_lock(&ep->lock);
+    if (!list_empty(&item->rdllink)) {
+        list_del_init(&item->rdllink);
+    }
+    spin_unlock(&ep->lock);
+    local_irq_restore(flags);
+
+    kfree(item);
+}
+
+/**
+ * Check that watching an instance does not close a loop or nest too deep
+ *
+ * @param ep The instance that would watch
+ * @param target The instance to be watched
+ * @param depth Nesting depth of target
+ * @return 0 if fine, negative error code otherwise
+ */
+static int ep_loop_check(struct epoll *ep, struct epoll *target, int depth) {
+    struct rb_node *node;
+
+    if (target == ep) {
+        return -ELOOP;
+    }
+
+    if (depth > EPOLL_MAX_NESTS) {
+        return -EINVAL;
+    }
+
+    for (node = rb_first(&target->items); node != NULL; node = rb_next(node)) {
+        struct epoll_item *item = rb_entry(node, struct epoll_item, node);
+
+        if (is_epoll_file(item->file)) {
+            int ret = ep_loop_check(ep, item->file->private_data, depth + 1);
+
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Add an item to an instance
+ *
+ * @param ep The epoll instance, its mutex and epoll_mutex held
+ * @param event The event
+ * @param file The file to watch
+ * @param fd The file descriptor
+ * @return 0 on success, or a negative error code
+ */
+static int ep_insert(struct epoll *ep, struct epoll_event *event, file_t *file, int fd) {
+    struct epoll_item *item = kmalloc(sizeof(struct epoll_item), MEM_KERNEL | MEM_ZERO);
+    struct epoll_pqueue epq;
+    unsigned int revents;
+
+    if (item == NULL) {
+        return -ENOMEM;
+    }
+
+    INIT_LIST_HEAD(&item->rdllink);
+    INIT_LIST_HEAD(&item->pwqlist);
+    item->ep = ep;
+    item->fd = fd;
+    item->file = file;
+    memcpy(&item->event, event, sizeof(struct epoll_event));
+
+    list_add_tail(&item->fllink, &file->f_ep_links);
+    ep_insert_item(ep, item);
+
+    /* Install the wait queue entries and see what is pending already */
+    init_poll_funcptr(&epq.pt, ep_ptable_queue_proc);
+    epq.item = item;
+    epq.nwait = 0;
+    revents = file_poll(file, &epq.pt);
+
+    if (epq.nwait < 0) {
+        ep_remove(ep, item);
+        return -ENOMEM;
+    }
+
+    if (revents & item->event.events) {
+        ep_set_ready(ep, item);
+    }
+
+    return 0;
+}
+
+/**
+ * Change the events of an item
+ *
+ * @param ep The epoll instance, its mutex held
+ * @param item The item
+ * @param event The event
+ * @return 0 on success
+ */
+static int ep_modify(struct epoll *ep, struct epoll_item *item, struct epoll_event *event) {
+    item->event.events = event->events;
+    item->event.data = event->data;
+
+    /* Events already pending are not signalled again, look for them */
+    if (file_poll(item->file, NULL) & item->event.events) {
+        ep_set_ready(ep, item);
+    }
+
+    return 0;
+}
+
+/**
+ * Report the ready items
+ *
+ * @param ep The epoll instance, its mutex held
+ * @param events The events
+ * @param maxevents The maximum number of events
+ * @return The number of events reported
+ */
+static int ep_send_events(struct epoll *ep, struct epoll_event *events, int maxevents) {
+    struct list_head txlist;
+    unsigned long flags;
+    int count = 0;
+
+    INIT_LIST_HEAD(&txlist);
+
+    /* Take the ready list, wakeups from here on start a new one */
+    local_irq_save(flags);
+    spin_lock(&ep->lock);
+    list_splice_init(&ep->rdllist, &txlist);
+    spin_unlock(&ep->lock);
+    local_irq_restore(flags);
+
+    while (count < maxevents) {
+        struct epoll_item *item;
+        unsigned int revents;
+
+        /* The callback looks at rdllink under the lock, so take it there */
+        local_irq_save(flags);
+        spin_lock(&ep->lock);
+        if (list_empty(&txlist)) {
+            spin_unlock(&ep->lock);
+            local_irq_restore(flags);
+            break;
+        }
+        item = list_first_entry(&txlist, struct epoll_item, rdllink);
+        list_del_init(&item->rdllink);
+        spin_unlock(&ep->lock);
+        local_irq_restore(flags);
+
+        /* Woken for events the item does not watch, or gone by now */
+        revents = file_poll(item->file, NULL) & item->event.events;
+        if (revents == 0) {
+            continue;
+        }
+
+        events[count].events = revents;
+        events[count].data = item->event.data;
+        count++;
+
+        if (item->event.events & EPOLLONESHOT) {
+            /* Disabled until rearmed */
+            item->event.events &= EP_PRIVATE_BITS;
+        } else if (!(item->event.events & EPOLLET)) {
+            /* Level triggered, stays ready until a poll finds nothing */
+            local_irq_save(flags);
+            spin_lock(&ep->lock);
+            if (list_empty(&item->rdllink)) {
+                list_add_tail(&item->rdllink, &ep->rdllist);
+            }
+            spin_unlock(&ep->lock);
+            local_irq_restore(flags);
+        }
+    }
+
+    /* What did not fit goes back to the front for the next call */
+    local_irq_save(flags);
+    spin_lock(&ep->lock);
+    list_splice(&txlist, &ep->rdllist);
+    spin_unlock(&ep->lock);
+    local_irq_restore(flags);
+
+    return count;
+}
+
+/**
+ * Check whether an instance has items ready
+ *
+ * @param ep The epoll instance
+ * @return Nonzero if so
+ */
+static int ep_events_available(struct epoll *ep) {
+    unsigned long flags;
+    int ret;
+
+    local_irq_save(flags);
+    spin_lock(&ep->lock);
+    ret = !list_empty(&ep->rdllist);
+    spin_unlock(&ep->lock);
+    local_irq_restore(flags);
+
+    return ret;
+}
+
+/**
+ * Wake a thread in epoll_wait()
+ *
+ * Called with the wait queue locked. A thread that is not blocked yet
+ * sees the flag before it blocks.
+ *
+ * @param wq_entry The entry of the thread
+ * @param mode The wakeup mode
+ * @param sync The wakeup flags
+ * @param key The wakeup key
+ * @return 1 if the thread was woken by this call
+ */
+static int ep_wake_function(wait_queue_entry_t *wq_entry, unsigned mode, int sync, void *key) {
+    (void)mode;
+    (void)sync;
+    (void)key;
+
+    if (wq_entry->flags & WQ_FLAG_WOKEN) {
+        return 0;
+    }
+
+    wq_entry->flags |= WQ_FLAG_WOKEN;
+    sched_unblock_thread(wq_entry->private);
+
+    return 1;
+}
+
+/**
+ * Get the epoll instance of a file descriptor
+ *
+ * @param epfd The epoll file descriptor
+ * @return The epoll instance, or NULL
+ */
+static struct epoll *ep_get(int epfd) {
+    file_t *epfile = process_get_file(task_current(), epfd);
+
+    if (epfile == NULL || !is_epoll_file(epfile)) {
+        return NULL;
+    }
+
+    return epfile->private_data;
+}
+
 /**
  * Create an epoll instance
- * 
+ *
  * @param size The size hint
  * @return The file descriptor, or a negative error code
  */
 int epoll_create(int size) {
     /* Check parameters */
     if (size <= 0) {
-        return -1;
+        return -EINVAL;
     }
-    
-    /* Lock the mutex */
-    mutex_lock(&epoll_mutex);
-    
-    /* Find a free epoll instance */
-    int id = -1;
-    
-    for (int i = 0; i < MAX_EPOLL; i++) {
-        if (epoll_table[i] == NULL) {
-            id = i;
-            break;
-        }
-    }
-    
-    /* Check if we found a free epoll instance */
-    if (id == -1) {
-        mutex_unlock(&epoll_mutex);
-        return -1;
-    }
-    
+
     /* Allocate a new epoll instance */
     struct epoll *ep = kmalloc(sizeof(struct epoll), MEM_KERNEL | MEM_ZERO);
-    
+
     if (ep == NULL) {
-        mutex_unlock(&epoll_mutex);
-        return -1;
+        return -ENOMEM;
     }
-    
+
     /* Initialize the epoll instance */
-    INIT_LIST_HEAD(&ep->items);
-    init_waitqueue_head(&ep->wait);
     mutex_init(&ep->mutex);
-    
-    /* Set the epoll instance */
-    epoll_table[id] = ep;
-    
-    /* Unlock the mutex */
-    mutex_unlock(&epoll_mutex);
-    
-    /* Create a file descriptor */
+    spin_lock_init(&ep->lock);
+    INIT_LIST_HEAD(&ep->rdllist);
+    rb_init_root(&ep->items);
+    wait_queue_init(&ep->wq);
+    wait_queue_init(&ep->poll_wait);
+
+    /* Create a file descriptor, the instance lives as long as the file */
     file_t *file;
     int fd = file_anon_fd(ep, &file);
-    
+
     if (fd < 0) {
-        /* Lock the mutex */
-        mutex_lock(&epoll_mutex);
-        
-        /* Free the epoll instance */
-        epoll_table[id] = NULL;
         kfree(ep);
-        
-        /* Unlock the mutex */
-        mutex_unlock(&epoll_mutex);
-        
-        return -1;
+        return fd;
     }
-    
+
+    file->f_op = &epoll_fops;
+    ep->file = file;
+
     return fd;
 }
 
 /**
  * Create an epoll instance
- * 
+ *
  * @param flags The flags
  * @return The file descriptor, or a negative error code
  */
 int epoll_create1(int flags) {
     /* Check parameters */
     if (flags & ~(O_CLOEXEC)) {
-        return -1;
+        return -EINVAL;
     }
-    
+
     /* Create an epoll instance */
     int fd = epoll_create(1);
-    
+
     if (fd < 0) {
         return fd;
     }
-    
+
     /* Set the flags */
     if (flags & O_CLOEXEC) {
         /* Get the file */
         file_t *file = process_get_file(task_current(), fd);
-        
+
         if (file == NULL) {
-            return -1;
+            return -EBADF;
         }
-        
+
         /* Set the close-on-exec flag */
         file->f_flags |= O_CLOEXEC;
     }
-    
+
     return fd;
 }
 
 /**
  * Control an epoll instance
- * 
+ *
  * @param epfd The epoll file descriptor
  * @param op The operation
  * @param fd The file descriptor
@@ -207,229 +671,205 @@ int epoll_create1(int flags) {
 int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event) {
     /* Check parameters */
     if (op != EPOLL_CTL_ADD && op != EPOLL_CTL_DEL && op != EPOLL_CTL_MOD) {
-        return -1;
+        return -EINVAL;
     }
-    
+
     if (op != EPOLL_CTL_DEL && event == NULL) {
-        return -1;
-    }
-    
-    /* Get the epoll file */
-    file_t *epfile = process_get_file(task_current(), epfd);
-    
-    if (epfile == NULL) {
-        return -1;
+        return -EFAULT;
     }
-    
+
     /* Get the epoll instance */
-    struct epoll *ep = epfile->private_data;
-    
+    struct epoll *ep = ep_get(epfd);
+
     if (ep == NULL) {
-        return -1;
+        return -EBADF;
     }
-    
+
     /* Get the file */
     file_t *file = process_get_file(task_current(), fd);
-    
+
     if (file == NULL) {
-        return -1;
+        return -EBADF;
+    }
+
+    /* An instance cannot watch itself, nor files without a poll operation */
+    if (file == ep->file || file->f_op == NULL || file->f_op->poll == NULL) {
+        return -EPERM;
+    }
+
+    /* Exclusive wakeups are for plain files and a few events only */
+    if (op != EPOLL_CTL_DEL && (event->events & EPOLLEXCLUSIVE)) {
+        if (op == EPOLL_CTL_MOD || is_epoll_file(file) ||
+            (event->events & ~EPOLLEXCLUSIVE_OK_BITS)) {
+            return -EINVAL;
+        }
+    }
+
+    /* Adding and removing change the file's links, and maybe the nesting */
+    int full_check = op != EPOLL_CTL_MOD;
+
+    if (full_check) {
+        mutex_lock(&epoll_mutex);
     }
-    
+
     /* Lock the mutex */
     mutex_lock(&ep->mutex);
-    
+
     /* Find the epoll item */
-    struct epoll_item *item;
-    int found = 0;
-    
-    list_for_each_entry(item, &ep->items, list) {
-        if (item->fd == fd) {
-            found = 1;
-            break;
-        }
-    }
-    
+    struct epoll_item *item = ep_find(ep, file, fd);
+
     /* Perform the operation */
     int ret = 0;
-    
+
     switch (op) {
         case EPOLL_CTL_ADD:
             /* Check if the item already exists */
-            if (found) {
-                ret = -1;
+            if (item != NULL) {
+                ret = -EEXIST;
                 break;
             }
-            
-            /* Allocate a new epoll item */
-            item = kmalloc(sizeof(struct epoll_item), MEM_KERNEL | MEM_ZERO);
-            
-            if (item == NULL) {
-                ret = -1;
-                break;
+
+            /* Watching another instance must not make a loop */
+            if (is_epoll_file(file)) {
+                ret = ep_loop_check(ep, file->private_data, 1);
+                if (ret < 0) {
+                    break;
+                }
             }
-            
-            /* Initialize the epoll item */
-            item->fd = fd;
-            item->file = file;
-            memcpy(&item->event, event, sizeof(struct epoll_event));
-            
-            /* Add the epoll item to the list */
-            list_add_tail(&item->list, &ep->items);
+
+            ret = ep_insert(ep, event, file, fd);
             break;
-        
+
         case EPOLL_CTL_DEL:
             /* Check if the item exists */
-            if (!found) {
-                ret = -1;
+            if (item == NULL) {
+                ret = -ENOENT;
                 break;
             }
-            
-            /* Remove the epoll item from the list */
-            list_del(&item->list);
-            
-            /* Free the epoll item */
-            kfree(item);
+
+            ep_remove(ep, item);
             break;
-        
+
         case EPOLL_CTL_MOD:
             /* Check if the item exists */
-            if (!found) {
-                ret = -1;
+            if (item == NULL) {
+                ret = -ENOENT;
                 break;
             }
-            
-            /* Update the epoll item */
-            memcpy(&item->event, event, sizeof(struct epoll_event));
+
+            /* An exclusive item cannot be modified */
+            if (item->event.events & EPOLLEXCLUSIVE) {
+                ret = -EINVAL;
+                break;
+            }
+
+            ret = ep_modify(ep, item, event);
             break;
     }
-    
+
     /* Unlock the mutex */
     mutex_unlock(&ep->mutex);
-    
+
+    if (full_check) {
+        mutex_unlock(&epoll_mutex);
+    }
+
     return ret;
 }
 
 /**
  * Wait for events on an epoll instance
- * 
+ *
  * @param epfd The epoll file descriptor
  * @param events The events
  * @param maxevents The maximum number of events
- * @param timeout The timeout
+ * @param timeout The timeout in milliseconds, negative to wait forever
  * @return The number of ready file descriptors, or a negative error code
  */
 int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout) {
     /* Check parameters */
     if (events == NULL || maxevents <= 0) {
-        return -1;
+        return -EINVAL;
     }
-    
-    /* Get the epoll file */
-    file_t *epfile = process_get_file(task_current(), epfd);
-    
-    if (epfile == NULL) {
-        return -1;
-    }
-    
+
     /* Get the epoll instance */
-    struct epoll *ep = epfile->private_data;
-    
+    struct epoll *ep = ep_get(epfd);
+
     if (ep == NULL) {
-        return -1;
+        return -EBADF;
     }
-    
-    /* Initialize the poll table */
-    struct poll_table_struct table;
-    poll_init_table(&table);
-    
-    /* Lock the mutex */
-    mutex_lock(&ep->mutex);
-    
-    /* Poll all files */
-    int count = 0;
-    struct epoll_item *item;
-    
-    list_for_each_entry(item, &ep->items, list) {
-        /* Poll the file */
-        unsigned int mask = file_poll(item->file, &table);
-        
-        /* Check if the file is ready */
-        if (mask & item->event.events) {
-            /* Set the events */
-            events[count].events = mask & item->event.events;
-            events[count].data = item->event.data;
-            
-            /* Increment the count */
-            count++;
-            
-            /* Check if we have reached the maximum number of events */
-            if (count >= maxevents) {
-                break;
-            }
-        }
+
+    /* The timeout is absolute, so wakeups without events do not extend it */
+    ktime_t expires = 0;
+
+    if (timeout > 0) {
+        expires = ktime_get() + (ktime_t)timeout * NSEC_PER_MSEC;
     }
-    
-    /* Check if any files are ready */
-    if (count > 0 || timeout == 0) {
-        /* Free the poll table */
-        poll_free_table(&table);
-        
-        /* Unlock the mutex */
+
+    for (;;) {
+        wait_queue_entry_t wait;
+        unsigned long flags;
+        int count, ret = -EINTR;
+
+        /* Report what is ready */
+        mutex_lock(&ep->mutex);
+        count = ep_send_events(ep, events, maxevents);
         mutex_unlock(&ep->mutex);
-        
-        return count;
-    }
-    
-    /* Unlock the mutex */
-    mutex_unlock(&ep->mutex);
-    
-    /* Wait for events */
-    if (timeout < 0) {
-        /* Wait indefinitely */
-        schedule();
-    } else {
-        /* Wait for the timeout */
-        schedule_timeout(timeout);
-    }
-    
-    /* Free the poll table */
-    poll_free_table(&table);
-    
-    /* Lock the mutex */
-    mutex_lock(&ep->mutex);
-    
-    /* Poll all files again */
-    count = 0;
-    
-    list_for_each_entry(item, &ep->items, list) {
-        /* Poll the file */
-        unsigned int mask = file_poll(item->file, NULL);
-        
-        /* Check if the file is ready */
-        if (mask & item->event.events) {
-            /* Set the events */
-            events[count].events = mask & item->event.events;
-            events[count].data = item->event.data;
-            
-            /* Increment the count */
-            count++;
-            
-            /* Check if we have reached the maximum number of events */
-            if (count >= maxevents) {
-                break;
+
+        if (count > 0) {
+            /* More left than fit, let another waiter have them */
+            if (ep_events_available(ep)) {
+                wake_up(&ep->wq);
             }
+            return count;
+        }
+
+        if (timeout == 0) {
+            return 0;
+        }
+
+        /* A signal that is not blocked ends the wait */
+        if (signal_pending_thread(thread_self())) {
+            return -EINTR;
+        }
+
+        /* Waiters are exclusive, one wakeup takes one thread off */
+        wait_queue_entry_init(&wait, WQ_FLAG_EXCLUSIVE, thread_self(), ep_wake_function);
+        wait_queue_add(&ep->wq, &wait);
+
+        /*
+         * Events that arrive from here on wake us through the wait queue.
+         * Check the woken flag under its lock and drop the lock only once
+         * blocked, so a wakeup on another CPU is not lost.
+         */
+        local_irq_save(flags);
+        if (!ep_events_available(ep)) {
+            spin_lock(&ep->wq.lock);
+            if (wait.flags & WQ_FLAG_WOKEN) {
+                spin_unlock(&ep->wq.lock);
+            } else {
+                ret = schedule_hrtimeout_range_unlock(timeout < 0 ? NULL : &expires, 0, HRTIMER_MODE_ABS,
+                                                      &ep->wq.lock);
+            }
+        }
+        local_irq_restore(flags);
+
+        wait_queue_remove(&ep->wq, &wait);
+
+        /* Timed out, report anything that came in at the last moment */
+        if (ret == 0) {
+            mutex_lock(&ep->mutex);
+            count = ep_send_events(ep, events, maxevents);
+            mutex_unlock(&ep->mutex);
+
+            return count;
         }
     }
-    
-    /* Unlock the mutex */
-    mutex_unlock(&ep->mutex);
-    
-    return count;
 }
 
 /**
  * Wait for events on an epoll instance with a timeout
- * 
+ *
  * @param epfd The epoll file descriptor
  * @param events The events
  * @param maxevents The maximum number of events
@@ -438,75 +878,118 @@ int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
  * @return The number of ready file descriptors, or a negative error code
  */
 int epoll_pwait(int epfd, struct epoll_event *events, int maxevents, int timeout, const sigset_t *sigmask) {
+    sigset_t oldmask, mask;
+
+    /* Wait with the given signals blocked instead */
+    if (sigmask != NULL) {
+        signal_swap_mask(sigmask, &oldmask);
+    }
+
     /* Wait for events */
-    return epoll_wait(epfd, events, maxevents, timeout);
+    int ret = epoll_wait(epfd, events, maxevents, timeout);
+
+    if (sigmask != NULL) {
+        signal_swap_mask(&oldmask, &mask);
+    }
+
+    return ret;
 }
 
 /**
  * Close an epoll instance
- * 
+ *
  * @param epfd The epoll file descriptor
  * @return 0 on success, or a negative error code
  */
 int epoll_close(int epfd) {
     /* Get the epoll file */
     file_t *epfile = process_get_file(task_current(), epfd);
-    
-    if (epfile == NULL) {
-        return -1;
+
+    if (epfile == NULL || !is_epoll_file(epfile)) {
+        return -EBADF;
     }
-    
-    /* Get the epoll instance */
-    struct epoll *ep = epfile->private_data;
-    
-    if (ep == NULL) {
-        return -1;
+
+    /* Close the file, its release frees the instance */
+    return file_close(epfile);
+}
+
+/**
+ * Remove a file being closed from every instance watching it
+ *
+ * @param file The file
+ */
+void eventpoll_release(file_t *file) {
+    struct epoll_item *item, *tmp;
+
+    /* Never watched */
+    if (list_empty(&file->f_ep_links)) {
+        return;
     }
-    
-    /* Lock the mutex */
+
     mutex_lock(&epoll_mutex);
-    
-    /* Find the epoll instance */
-    int id = -1;
-    
-    for (int i = 0; i < MAX_EPOLL; i++) {
-        if (epoll_table[i] == ep) {
-            id = i;
-            break;
-        }
-    }
-    
-    /* Check if we found the epoll instance */
-    if (id != -1) {
-        /* Free the epoll instance */
-        epoll_table[id] = NULL;
+
+    list_for_each_entry_safe(item, tmp, &file->f_ep_links, fllink) {
+        struct epoll *ep = item->ep;
+
+        mutex_lock(&ep->mutex);
+        ep_remove(ep, item);
+        mutex_unlock(&ep->mutex);
     }
-    
-    /* Unlock the mutex */
+
     mutex_unlock(&epoll_mutex);
-    
-    /* Lock the epoll mutex */
+}
+
+/**
+ * Poll an epoll instance, for instances watching it
+ *
+ * @param file The file
+ * @param wait The poll table
+ * @return The poll mask
+ */
+static unsigned int epoll_poll(file_t *file, struct poll_table_struct *wait) {
+    struct epoll *ep = file->private_data;
+
+    poll_wait(file, &ep->poll_wait, wait);
+
+    return ep_events_available(ep) ? (EPOLLIN | EPOLLRDNORM) : 0;
+}
+
+/**
+ * Release an epoll instance
+ *
+ * @param inode The inode
+ * @param file The file
+ * @return 0 on success
+ */
+static int epoll_release(inode_t *inode, file_t *file) {
+    struct epoll *ep = file->private_data;
+    struct rb_node *node;
+
+    (void)inode;
+
+    if (ep == NULL) {
+        return 0;
+    }
+
+    mutex_lock(&epoll_mutex);
     mutex_lock(&ep->mutex);
-    
-    /* Free all epoll items */
-    struct epoll_item *item, *tmp;
-    
-    list_for_each_entry_safe(item, tmp, &ep->items, list) {
-        /* Remove the epoll item from the list */
-        list_del(&item->list);
-        
-        /* Free the epoll item */
-        kfree(item);
-    }
-    
-    /* Unlock the epoll mutex */
+
+    /* Take every item off its file */
+    while ((node = rb_first(&ep->items)) != NULL) {
+        ep_remove(ep, rb_entry(node, struct epoll_item, node));
+    }
+
     mutex_unlock(&ep->mutex);
-    
-    /* Free the epoll instance */
+    mutex_unlock(&epoll_mutex);
+
+    file->private_data = NULL;
     kfree(ep);
-    
-    /* Close the file */
-    file_close(epfile);
-    
+
     return 0;
 }
+
+/* Epoll file operations */
+static const struct file_operations epoll_fops = {
+    .poll = epoll_poll,
+    .release = epoll_release,
+};
@@ -10,6 +10,7 @@
 #include <horizon/fs/vfs.h>
 #include <horizon/mm.h>
 #include <horizon/string.h>
+#include <horizon/poll.h>
 
 /* Define NULL if not defined */
 #ifndef NULL
@@ -38,11 +39,6 @@ struct pollfd {
     short revents;      /* Returned events */
 };
 
-/* Poll table structure */
-struct poll_table_struct {
-    struct list_head wait_list;  /* List of wait queues */
-};
-
 /* Poll wait structure */
 struct poll_wait {
     struct list_head list;       /* List of poll waits */
@@ -55,8 +51,8 @@ struct poll_wait {
  * @param table The poll table
  */
 void poll_init_table(struct poll_table_struct *table) {
-    /* Initialize the wait list */
-    INIT_LIST_HEAD(&table->wait_list);
+    /* Initialize the wait list, queueing the task itself */
+    init_poll_funcptr(table, NULL);
 }
 
 /**
@@ -72,6 +68,12 @@ void poll_wait(file_t *file, struct wait_queue_head *wait, struct poll_table_str
         return;
     }
     
+    /* Let the table install its own wait queue entry */
+    if (table->qproc != NULL) {
+        table->qproc(file, wait, table);
+        return;
+    }
+    
     /* Allocate a new poll wait */
     struct poll_wait *pw = kmalloc(sizeof(struct poll_wait), MEM_KERNEL | MEM_ZERO);
     
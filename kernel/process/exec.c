@@ -11,6 +11,7 @@
 #include <horizon/mm.h>
 #include <horizon/fs/vfs.h>
 #include <horizon/string.h>
+#include <horizon/vdso.h>
 
 /* Define NULL if not defined */
 #ifndef NULL
@@ -210,6 +211,9 @@ int process_load_elf(task_struct_t *task, file_t *file) {
         }
     }
     
+    /* The vDSO is optional, the program falls back to the system calls */
+    vdso_map(task->mm);
+    
     return 0;
 }
 
@@ -9,6 +9,7 @@
 #include <horizon/process.h>
 #include <horizon/sched.h>
 #include <horizon/task.h>
+#include <horizon/thread.h>
 #include <horizon/string.h>
 
 /* Define NULL if not defined */
@@ -38,6 +39,60 @@ void process_sched_init(void) {
     /* Initialize the process scheduling subsystem */
 }
 
+/**
+ * Apply a nice level to every thread of a task
+ *
+ * @param task Task to update
+ * @param nice Nice level
+ */
+static void process_apply_nice(task_struct_t *task, int nice) {
+    thread_t *thread;
+
+    /* The fair scheduler weighs each thread by its nice level */
+    list_for_each_entry(thread, &task->threads, process_threads) {
+        sched_set_nice(thread, nice);
+    }
+}
+
+/* Tasks matched by setpriority() */
+struct process_prio_match {
+    int which;                      /* PRIO_PGRP or PRIO_USER */
+    u32 who;                        /* Process group or user ID */
+    int nice;                       /* Nice level to set */
+};
+
+/**
+ * Set the nice level of a task
+ *
+ * @param task Task to update
+ * @param nice Nice level
+ */
+static void process_set_nice(task_struct_t *task, int nice) {
+    /* Set the priority */
+    task->static_prio = 120 + nice;
+
+    /* Recalculate the dynamic priority */
+    task->prio = task->static_prio;
+
+    /* Reweight the threads */
+    process_apply_nice(task, nice);
+}
+
+/**
+ * Set the nice level of a task if setpriority() matched it
+ *
+ * @param task Task to check
+ * @param data Match, a struct process_prio_match
+ */
+static void process_set_nice_match(task_struct_t *task, void *data) {
+    struct process_prio_match *match = data;
+
+    if ((match->which == PRIO_PGRP && task->pgid == match->who) ||
+        (match->which == PRIO_USER && task->uid == match->who)) {
+        process_set_nice(task, match->nice);
+    }
+}
+
 /* Change process priority */
 int process_nice(int inc) {
     /* Get the current task */
@@ -60,11 +115,8 @@ int process_nice(int inc) {
         new_nice = PRIO_MAX;
     }
     
-    /* Set the new priority */
-    task->static_prio = 120 + new_nice;
-    
-    /* Recalculate the dynamic priority */
-    task->prio = task->static_prio;
+    /* Set the new priority and reweight the threads */
+    process_set_nice(task, new_nice);
     
     return new_nice;
 }
@@ -141,6 +193,7 @@ int process_setpriority(int which, int who, int prio) {
     
     /* Get the task */
     task_struct_t *task = NULL;
+    struct process_prio_match match;
     
     switch (which) {
         case PRIO_PROCESS:
@@ -158,11 +211,8 @@ int process_setpriority(int which, int who, int prio) {
                 return -1;
             }
             
-            /* Set the priority */
-            task->static_prio = 120 + prio;
-            
-            /* Recalculate the dynamic priority */
-            task->prio = task->static_prio;
+            /* Set the priority and reweight the threads */
+            process_set_nice(task, prio);
             break;
         
         case PRIO_PGRP:
@@ -174,7 +224,10 @@ int process_setpriority(int which, int who, int prio) {
             }
             
             /* Set the priority for all tasks in the process group */
-            task_set_prio_by_pgid(who, 120 + prio);
+            match.which = PRIO_PGRP;
+            match.who = who;
+            match.nice = prio;
+            task_for_each(process_set_nice_match, &match);
             break;
         
         case PRIO_USER:
@@ -186,7 +239,10 @@ int process_setpriority(int which, int who, int prio) {
             }
             
             /* Set the priority for all tasks for the user */
-            task_set_prio_by_uid(who, 120 + prio);
+            match.which = PRIO_USER;
+            match.who = who;
+            match.nice = prio;
+            task_for_each(process_set_nice_match, &match);
             break;
     }
     
@@ -0,0 +1,377 @@
+/**
+ * rcupdate.c - Horizon kernel read-copy-update implementation
+ *
+ * This file contains the implementation of classic RCU. Grace periods are
+ * numbered batches. When a batch starts, every CPU taking part is marked
+ * in cpumask, and each clears its bit from its tick once it has passed a
+ * quiescent state since it noticed the batch. The batch completes when
+ * the mask is empty.
+ *
+ * Callbacks queue on the CPU that called call_rcu(). They wait on nxtlist
+ * until the CPU moves them to curlist, tagged with the batch after the one
+ * in progress, since that one may have started before they were queued.
+ * Once that batch completes they move to donelist and run from the tick.
+ */
+
+#include <horizon/kernel.h>
+#include <horizon/types.h>
+#include <horizon/rcupdate.h>
+#include <horizon/sched.h>
+#include <horizon/thread.h>
+#include <horizon/spinlock.h>
+#include <horizon/irqflags.h>
+#include <horizon/printk.h>
+#include <horizon/stddef.h>
+
+/* Global grace period state */
+typedef struct rcu_ctrlblk {
+    volatile long cur;              /* Batch in progress, or the last one */
+    volatile long completed;        /* Last completed batch */
+    int next_pending;               /* Callbacks wait for a batch after cur */
+    volatile unsigned long cpumask; /* CPUs still to pass a quiescent state in cur */
+    unsigned long online;           /* CPUs taking part in grace periods */
+    u64 nr_batches;                 /* Completed batches */
+    spinlock_t lock;                /* Protects all of the above */
+} rcu_ctrlblk_t;
+
+/* Per-CPU state, only touched by its own CPU */
+typedef struct rcu_data {
+    long quiescbatch;               /* Batch we look for a quiescent state in */
+    int passed_quiesc;              /* Passed one since quiescbatch started */
+    int qs_pending;                 /* quiescbatch still needs one from us */
+    long batch;                     /* Batch curlist waits for */
+    struct rcu_head *nxtlist;       /* Queued, not yet waiting for a batch */
+    struct rcu_head **nxttail;
+    struct rcu_head *curlist;       /* Waiting for batch */
+    struct rcu_head **curtail;
+    struct rcu_head *donelist;      /* Ready to run */
+    struct rcu_head **donetail;
+    long qlen;                      /* Callbacks on all three lists */
+    u64 nr_queued;                  /* Callbacks queued */
+    u64 nr_invoked;                 /* Callbacks run */
+} rcu_data_t;
+
+/* Waiter of synchronize_rcu(), lives on the waiting thread's stack */
+typedef struct rcu_synchronize {
+    struct rcu_head head;           /* Queued callback */
+    struct thread *thread;          /* Waiting thread */
+    volatile int done;              /* Set once the grace period is over */
+} rcu_synchronize_t;
+
+/* RCU state */
+static rcu_ctrlblk_t rcu_ctrlblk;
+static rcu_data_t rcu_datas[CONFIG_NR_CPUS];
+
+/**
+ * Start the next batch if one is wanted and none is in progress
+ *
+ * The caller must hold the control block lock.
+ */
+static void rcu_start_batch(void) {
+    if (!rcu_ctrlblk.next_pending || rcu_ctrlblk.completed != rcu_ctrlblk.cur) {
+        return;
+    }
+
+    rcu_ctrlblk.next_pending = 0;
+
+    /* A CPU that sees the new number must also see its bit */
+    rcu_ctrlblk.cpumask = rcu_ctrlblk.online;
+    __sync_synchronize();
+    rcu_ctrlblk.cur++;
+}
+
+/**
+ * Record a quiescent state of a CPU in the current batch
+ *
+ * The caller must hold the control block lock.
+ *
+ * @param cpu CPU
+ */
+static void rcu_cpu_quiet(int cpu) {
+    rcu_ctrlblk.cpumask &= ~(1UL << cpu);
+
+    if (rcu_ctrlblk.cpumask == 0) {
+        /* Last one, the batch is over */
+        rcu_ctrlblk.completed = rcu_ctrlblk.cur;
+        rcu_ctrlblk.nr_batches++;
+        rcu_start_batch();
+    }
+}
+
+/**
+ * Report a quiescent state of this CPU if the current batch needs one
+ *
+ * @param cpu CPU
+ * @param rdp Per-CPU state of the CPU
+ */
+static void rcu_check_quiescent_state(int cpu, rcu_data_t *rdp) {
+    if (rdp->quiescbatch != rcu_ctrlblk.cur) {
+        /* A new batch started, only quiescent states from now on count */
+        rdp->quiescbatch = rcu_ctrlblk.cur;
+        rdp->qs_pending = 1;
+        rdp->passed_quiesc = 0;
+        return;
+    }
+
+    if (!rdp->qs_pending || !rdp->passed_quiesc) {
+        return;
+    }
+
+    rdp->qs_pending = 0;
+
+    spin_lock(&rcu_ctrlblk.lock);
+    if (rdp->quiescbatch == rcu_ctrlblk.cur && (rcu_ctrlblk.cpumask & (1UL << cpu))) {
+        rcu_cpu_quiet(cpu);
+    }
+    spin_unlock(&rcu_ctrlblk.lock);
+}
+
+/**
+ * Run callbacks whose grace period is over
+ *
+ * @param rdp Per-CPU state of this CPU
+ */
+static void rcu_do_batch(rcu_data_t *rdp) {
+    struct rcu_head *list = rdp->donelist;
+    int count = 0;
+
+    while (list != NULL && count < RCU_BATCH_LIMIT) {
+        struct rcu_head *next = list->next;
+
+        list->func(list);
+        list = next;
+        count++;
+    }
+
+    /* The rest run on the next tick */
+    rdp->donelist = list;
+    if (list == NULL) {
+        rdp->donetail = &rdp->donelist;
+    }
+
+    rdp->qlen -= count;
+    rdp->nr_invoked += count;
+}
+
+/**
+ * Advance the callbacks of this CPU through the batches
+ *
+ * @param cpu CPU
+ * @param rdp Per-CPU state of the CPU
+ */
+static void rcu_process_callbacks(int cpu, rcu_data_t *rdp) {
+    unsigned long flags;
+
+    /* The batch curlist waited for is over */
+    if (rdp->curlist != NULL && rcu_ctrlblk.completed - rdp->batch >= 0) {
+        *rdp->donetail = rdp->curlist;
+        rdp->donetail = rdp->curtail;
+        rdp->curlist = NULL;
+        rdp->curtail = &rdp->curlist;
+    }
+
+    /* Let queued callbacks wait for a batch */
+    if (rdp->nxtlist != NULL && rdp->curlist == NULL) {
+        local_irq_save(flags);
+        rdp->curlist = rdp->nxtlist;
+        rdp->curtail = rdp->nxttail;
+        rdp->nxtlist = NULL;
+        rdp->nxttail = &rdp->nxtlist;
+        local_irq_restore(flags);
+
+        spin_lock(&rcu_ctrlblk.lock);
+
+        /* The batch in progress may predate the callbacks, wait for the next */
+        rdp->batch = rcu_ctrlblk.cur + 1;
+        if (!rcu_ctrlblk.next_pending) {
+            rcu_ctrlblk.next_pending = 1;
+            rcu_start_batch();
+        }
+
+        spin_unlock(&rcu_ctrlblk.lock);
+    }
+
+    rcu_check_quiescent_state(cpu, rdp);
+
+    if (rdp->donelist != NULL) {
+        rcu_do_batch(rdp);
+    }
+}
+
+/**
+ * Initialize the per-CPU state of a CPU
+ *
+ * @param rdp Per-CPU state
+ */
+static void rcu_init_data(rcu_data_t *rdp) {
+    rdp->quiescbatch = rcu_ctrlblk.completed;
+    rdp->passed_quiesc = 0;
+    rdp->qs_pending = 0;
+    rdp->batch = 0;
+    rdp->nxtlist = NULL;
+    rdp->nxttail = &rdp->nxtlist;
+    rdp->curlist = NULL;
+    rdp->curtail = &rdp->curlist;
+    rdp->donelist = NULL;
+    rdp->donetail = &rdp->donelist;
+    rdp->qlen = 0;
+    rdp->nr_queued = 0;
+    rdp->nr_invoked = 0;
+}
+
+/**
+ * Initialize RCU
+ *
+ * Other CPUs join grace periods from their first tick.
+ */
+void rcu_init(void) {
+    rcu_ctrlblk.cur = 0;
+    rcu_ctrlblk.completed = 0;
+    rcu_ctrlblk.next_pending = 0;
+    rcu_ctrlblk.cpumask = 0;
+    rcu_ctrlblk.online = 1UL << smp_processor_id();
+    rcu_ctrlblk.nr_batches = 0;
+    spin_lock_init_named(&rcu_ctrlblk.lock, "rcu_ctrlblk");
+
+    for (int cpu = 0; cpu < CONFIG_NR_CPUS; cpu++) {
+        rcu_init_data(&rcu_datas[cpu]);
+    }
+}
+
+/**
+ * Queue a callback to run after a grace period
+ *
+ * Every read-side section in progress when call_rcu() is called has ended
+ * by the time the callback runs. Callbacks run from the tick and must not
+ * sleep.
+ *
+ * @param head Callback head, embedded in the object to free
+ * @param func Callback
+ */
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head)) {
+    unsigned long flags;
+
+    head->func = func;
+    head->next = NULL;
+
+    local_irq_save(flags);
+
+    rcu_data_t *rdp = &rcu_datas[smp_processor_id()];
+    *rdp->nxttail = head;
+    rdp->nxttail = &head->next;
+    rdp->qlen++;
+    rdp->nr_queued++;
+
+    local_irq_restore(flags);
+}
+
+/**
+ * Wake a thread waiting in synchronize_rcu()
+ *
+ * @param head Callback head of the waiter
+ */
+static void rcu_wakeme_after_gp(struct rcu_head *head) {
+    rcu_synchronize_t *rs = container_of(head, rcu_synchronize_t, head);
+
+    rs->done = 1;
+    sched_unblock_thread(rs->thread);
+}
+
+/**
+ * Wait for a grace period
+ *
+ * Returns once every read-side section in progress at the call has ended.
+ * Must not be called from a read-side section.
+ */
+void synchronize_rcu(void) {
+    rcu_synchronize_t rs;
+    unsigned long flags;
+
+    rs.thread = thread_self();
+    rs.done = 0;
+
+    local_irq_save(flags);
+
+    call_rcu(&rs.head, rcu_wakeme_after_gp);
+
+    /* Interrupts stay off until we are off the run queue */
+    while (!rs.done) {
+        sched_block_thread(rs.thread);
+    }
+
+    local_irq_restore(flags);
+}
+
+/**
+ * Note a context switch on a CPU
+ *
+ * @param cpu CPU
+ */
+void rcu_note_context_switch(int cpu) {
+    rcu_datas[cpu].passed_quiesc = 1;
+}
+
+/**
+ * RCU work of the scheduler tick
+ *
+ * @param cpu CPU
+ * @param quiescent Nonzero if the tick interrupted no read-side section
+ */
+void rcu_check_callbacks(int cpu, int quiescent) {
+    rcu_data_t *rdp = &rcu_datas[cpu];
+
+    /* Join grace periods from the first tick on, starting with the next batch */
+    if (!(rcu_ctrlblk.online & (1UL << cpu))) {
+        spin_lock(&rcu_ctrlblk.lock);
+        rcu_ctrlblk.online |= 1UL << cpu;
+        rdp->quiescbatch = rcu_ctrlblk.cur;
+        spin_unlock(&rcu_ctrlblk.lock);
+    }
+
+    if (quiescent) {
+        rdp->passed_quiesc = 1;
+    }
+
+    rcu_process_callbacks(cpu, rdp);
+}
+
+/**
+ * Check if a CPU still needs its tick for RCU
+ *
+ * A CPU with callbacks must keep ticking to move them through the batches
+ * and run them, and one the current batch waits for must tick to report
+ * its quiescent state, or the grace period never ends.
+ *
+ * @param cpu CPU
+ * @return Nonzero if the tick must not be stopped
+ */
+int rcu_needs_cpu(int cpu) {
+    rcu_data_t *rdp = &rcu_datas[cpu];
+
+    /* Callbacks wait for a batch or to run */
+    if (rdp->qlen != 0) {
+        return 1;
+    }
+
+    /* The current batch waits for this CPU */
+    return (rcu_ctrlblk.cpumask & (1UL << cpu)) != 0;
+}
+
+/**
+ * Print RCU statistics
+ */
+void rcu_print_stats(void) {
+    printk(KERN_INFO "RCU: batch %ld, completed %ld, %llu batches\n",
+           rcu_ctrlblk.cur, rcu_ctrlblk.completed, rcu_ctrlblk.nr_batches);
+
+    for (int cpu = 0; cpu < CONFIG_NR_CPUS; cpu++) {
+        rcu_data_t *rdp = &rcu_datas[cpu];
+
+        if (rdp->nr_queued == 0) {
+            continue;
+        }
+
+        printk(KERN_INFO "  CPU %d: queued %llu, invoked %llu, pending %ld\n",
+               cpu, rdp->nr_queued, rdp->nr_invoked, rdp->qlen);
+    }
+}
@@ -24,8 +24,8 @@ void __read_lock(rwlock_t *lock, const char *file, int line) {
     /* Acquire the spinlock */
     spin_lock(&lock->lock);
     
-    /* Wait for any writers to finish */
-    while (lock->writer) {
+    /* Wait for any writers to finish, waiting writers go first */
+    while (lock->writer || lock->writers_waiting) {
         contended = 1;
         spin_unlock(&lock->lock);
         __asm__ volatile("pause");
@@ -55,8 +55,8 @@ void read_lock(rwlock_t *lock) {
     /* Acquire the spinlock */
     spin_lock(&lock->lock);
     
-    /* Wait for any writers to finish */
-    while (lock->writer) {
+    /* Wait for any writers to finish, waiting writers go first */
+    while (lock->writer || lock->writers_waiting) {
         spin_unlock(&lock->lock);
         __asm__ volatile("pause");
         spin_lock(&lock->lock);
@@ -85,8 +85,8 @@ int __read_trylock(rwlock_t *lock, const char *file, int line) {
     /* Acquire the spinlock */
     spin_lock(&lock->lock);
     
-    /* Check if there are any writers */
-    if (!lock->writer) {
+    /* Check if there are any writers, waiting ones included */
+    if (!lock->writer && !lock->writers_waiting) {
         /* Increment reader count */
         lock->readers++;
         
@@ -112,8 +112,8 @@ int read_trylock(rwlock_t *lock) {
     /* Acquire the spinlock */
     spin_lock(&lock->lock);
     
-    /* Check if there are any writers */
-    if (!lock->writer) {
+    /* Check if there are any writers, waiting ones included */
+    if (!lock->writer && !lock->writers_waiting) {
         /* Increment reader count */
         lock->readers++;
         ret = 1;
@@ -182,13 +182,15 @@ void __write_lock(rwlock_t *lock, const char *file, int line) {
     /* Acquire the spinlock */
     spin_lock(&lock->lock);
     
-    /* Wait for any readers or writers to finish */
+    /* Wait for any readers or writers to finish, holding off new readers */
+    lock->writers_waiting++;
     while (lock->readers > 0 || lock->writer) {
         contended = 1;
         spin_unlock(&lock->lock);
         __asm__ volatile("pause");
         spin_lock(&lock->lock);
     }
+    lock->writers_waiting--;
     
     /* Set writer flag */
     lock->writer = 1;
@@ -213,12 +215,14 @@ void write_lock(rwlock_t *lock) {
     /* Acquire the spinlock */
     spin_lock(&lock->lock);
     
-    /* Wait for any readers or writers to finish */
+    /* Wait for any readers or writers to finish, holding off new readers */
+    lock->writers_waiting++;
     while (lock->readers > 0 || lock->writer) {
         spin_unlock(&lock->lock);
         __asm__ volatile("pause");
         spin_lock(&lock->lock);
     }
+    lock->writers_waiting--;
     
     /* Set writer flag */
     lock->writer = 1;
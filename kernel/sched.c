@@ -12,18 +12,38 @@
 #include <horizon/mm.h>
 #include <horizon/string.h>
 #include <horizon/time.h>
+#include <horizon/timer.h>
+#include <horizon/rbtree.h>
+#include <horizon/rtmutex.h>
+#include <horizon/preempt.h>
+#include <horizon/rcupdate.h>
 #include <horizon/console.h>
 #include <horizon/errno.h>
 #include <horizon/thread_context.h>
 #include <horizon/sched/config.h>
 #include <horizon/stddef.h>
+#include <horizon/irqflags.h>
+#include <horizon/block.h>
 
 /* Define constants */
 #define UINT32_MAX 0xFFFFFFFF
 
+/* What a thread that was just queued does to the current thread */
+#define SCHED_PREEMPT_NONE      0   /* Keep running the current thread */
+#define SCHED_PREEMPT_RESCHED   1   /* Switch, once preemption is enabled */
+#define SCHED_PREEMPT_NOW       2   /* Switch, the current thread is idle or left the queue */
+
 /* Scheduler run queues */
 struct run_queue run_queues[CONFIG_NR_CPUS];
 
+/* Stop the periodic tick while idle */
+static int sched_nohz_enabled = 1;
+
+/* Run queue primitives, called with the run queue lock held */
+static void sched_rq_enqueue(struct run_queue *rq, struct thread *thread);
+static void sched_rq_remove(struct run_queue *rq, struct thread *thread);
+static int sched_wake_locked(struct run_queue *rq, struct thread *thread, u32 state);
+
 /* Scheduler initialization */
 void sched_init(void) {
     /* Initialize run queues */
@@ -32,19 +52,34 @@ void sched_init(void) {
 
         /* Initialize run queue */
         memset(rq, 0, sizeof(struct run_queue));
+        spin_lock_init(&rq->lock);
+        rq->cpu = i;
+
+        /* Initialize the priority arrays */
+        for (int a = 0; a < 2; a++) {
+            for (int prio = 0; prio < MAX_PRIO; prio++) {
+                INIT_LIST_HEAD(&rq->arrays[a].queue[prio]);
+            }
+        }
+        rq->active = &rq->arrays[0];
+        rq->expired = &rq->arrays[1];
+
+        /* Initialize the fair run queue */
+        fair_init_rq(&rq->cfs);
 
-        /* Initialize run queue lists */
-        INIT_LIST_HEAD(&rq->queue);
-        INIT_LIST_HEAD(&rq->expired);
+        /* Initialize the sleeper tree */
+        rb_init_root(&rq->sleepers);
+        rq->next_sleeper = NULL;
 
         /* Initialize run queue statistics */
         rq->nr_running = 0;
         rq->nr_switches = 0;
         rq->nr_schedule = 0;
+        rq->nr_rt_schedule = 0;
+        rq->nr_rt_switches = 0;
+        rq->nr_rt_preempts = 0;
         rq->curr_timestamp = get_timestamp();
         rq->last_timestamp = rq->curr_timestamp;
-        rq->head = NULL;
-        rq->tail = NULL;
     }
 
     /* Create idle thread */
@@ -102,6 +137,297 @@ void sched_stop(void) {
     preempt_disable();
 }
 
+/**
+ * Lock a run queue
+ *
+ * Interrupts stay disabled while the lock is held.
+ *
+ * @param rq Run queue
+ * @param flags Saved interrupt state
+ */
+void sched_rq_lock(struct run_queue *rq, unsigned long *flags) {
+    local_irq_save(*flags);
+    spin_lock(&rq->lock);
+}
+
+/**
+ * Unlock a run queue
+ *
+ * @param rq Run queue
+ * @param flags Interrupt state saved by the lock
+ */
+void sched_rq_unlock(struct run_queue *rq, unsigned long flags) {
+    spin_unlock(&rq->lock);
+    local_irq_restore(flags);
+}
+
+/**
+ * Get the run queue a thread belongs to
+ *
+ * A queued thread belongs to the run queue it is on and a sleeping thread
+ * to the one whose sleeper tree holds it. Any other thread is queued on
+ * the current CPU when it wakes up.
+ *
+ * @param thread Thread
+ * @return Run queue
+ */
+static struct run_queue *sched_thread_rq(struct thread *thread) {
+    if (thread->rq != NULL) {
+        return thread->rq;
+    }
+
+    if (thread->sleep_rq != NULL) {
+        return thread->sleep_rq;
+    }
+
+    return this_rq();
+}
+
+/**
+ * Lock the run queue a thread belongs to
+ *
+ * The lock is taken again if the thread moved to another run queue while
+ * waiting for it.
+ *
+ * @param thread Thread
+ * @param flags Saved interrupt state
+ * @return Locked run queue
+ */
+struct run_queue *sched_thread_rq_lock(struct thread *thread, unsigned long *flags) {
+    while (1) {
+        struct run_queue *rq = sched_thread_rq(thread);
+
+        sched_rq_lock(rq, flags);
+        if (rq == sched_thread_rq(thread)) {
+            return rq;
+        }
+        sched_rq_unlock(rq, *flags);
+    }
+}
+
+/**
+ * Lock two run queues in CPU order
+ *
+ * Interrupts must be disabled. Both may be the same run queue.
+ *
+ * @param rq1 First run queue
+ * @param rq2 Second run queue
+ */
+void sched_double_lock(struct run_queue *rq1, struct run_queue *rq2) {
+    if (rq1 == rq2) {
+        spin_lock(&rq1->lock);
+    } else if (rq1->cpu < rq2->cpu) {
+        spin_lock(&rq1->lock);
+        spin_lock(&rq2->lock);
+    } else {
+        spin_lock(&rq2->lock);
+        spin_lock(&rq1->lock);
+    }
+}
+
+/**
+ * Unlock two run queues
+ *
+ * @param rq1 First run queue
+ * @param rq2 Second run queue
+ */
+void sched_double_unlock(struct run_queue *rq1, struct run_queue *rq2) {
+    spin_unlock(&rq1->lock);
+    if (rq1 != rq2) {
+        spin_unlock(&rq2->lock);
+    }
+}
+
+/**
+ * Add a thread to the sleeper tree
+ *
+ * @param rq Run queue
+ * @param thread Thread to add, with wakeup_time set
+ */
+static void sched_sleeper_insert(struct run_queue *rq, struct thread *thread) {
+    rb_node_t **link = &rq->sleepers.rb_node;
+    rb_node_t *parent = NULL;
+    int leftmost = 1;
+
+    /* Equal deadlines go right so they wake in the order they slept */
+    while (*link != NULL) {
+        struct thread *entry = rb_entry(*link, struct thread, sleep_node);
+
+        parent = *link;
+        if (thread->wakeup_time < entry->wakeup_time) {
+            link = &parent->rb_left;
+        } else {
+            link = &parent->rb_right;
+            leftmost = 0;
+        }
+    }
+
+    rb_link_node(&thread->sleep_node, parent, link);
+    rb_insert_color(&thread->sleep_node, &rq->sleepers);
+
+    /* Keep the earliest deadline at hand */
+    if (leftmost) {
+        rq->next_sleeper = thread;
+    }
+
+    thread->sleep_rq = rq;
+    rq->nr_sleeping++;
+}
+
+/**
+ * Remove a thread from the sleeper tree
+ *
+ * @param thread Thread to remove
+ */
+static void sched_sleeper_remove(struct thread *thread) {
+    struct run_queue *rq = thread->sleep_rq;
+
+    if (rq == NULL) {
+        return;
+    }
+
+    /* Advance the cached earliest sleeper */
+    if (rq->next_sleeper == thread) {
+        rb_node_t *next = rb_next(&thread->sleep_node);
+        rq->next_sleeper = (next != NULL) ? rb_entry(next, struct thread, sleep_node) : NULL;
+    }
+
+    rb_erase(&thread->sleep_node, &rq->sleepers);
+    thread->sleep_rq = NULL;
+    rq->nr_sleeping--;
+}
+
+/**
+ * Wake every sleeper whose deadline has passed
+ *
+ * Only the earliest deadline is looked at when nothing is due. The run
+ * queue lock must be held.
+ *
+ * @param rq Run queue
+ * @return SCHED_PREEMPT_* action for sched_preempt()
+ */
+static int sched_wake_sleepers(struct run_queue *rq) {
+    int action = SCHED_PREEMPT_NONE;
+
+    while (rq->next_sleeper != NULL && rq->next_sleeper->wakeup_time <= rq->curr_timestamp) {
+        rq->nr_timed_wakeups++;
+
+        int wake = sched_wake_locked(rq, rq->next_sleeper, THREAD_STATE_SLEEPING);
+        if (wake > action) {
+            action = wake;
+        }
+    }
+
+    return action;
+}
+
+/**
+ * Get the earliest sleeper wakeup time
+ *
+ * @param rq Run queue
+ * @return Wakeup time in microseconds, or 0 if no thread is sleeping
+ */
+u64 sched_next_wakeup(struct run_queue *rq) {
+    if (rq == NULL || rq->next_sleeper == NULL) {
+        return 0;
+    }
+
+    return rq->next_sleeper->wakeup_time;
+}
+
+/**
+ * Enable or disable tickless idle
+ *
+ * @param enable 1 to stop the tick while idle, 0 to keep it running
+ */
+void sched_set_nohz(int enable) {
+    sched_nohz_enabled = enable ? 1 : 0;
+}
+
+/**
+ * Stop the periodic tick before the idle thread halts
+ *
+ * The timer is programmed to fire at the earliest sleeper, timer or high
+ * resolution timer deadline, or as late as the hardware allows if there is
+ * none. The tick keeps running while RCU needs this CPU. The run queue lock
+ * must be held with interrupts disabled.
+ *
+ * @param rq Run queue
+ */
+static void sched_nohz_enter(struct run_queue *rq) {
+    u32 freq = timer_get_frequency();
+    u64 ticks = (u64)-1;
+
+    /* Only when idle, with nothing runnable */
+    if (!sched_nohz_enabled || rq->nohz_active || freq == 0 ||
+        rq->active->nr_active != 0 || rq->expired->nr_active != 0) {
+        return;
+    }
+
+    /* RCU callbacks and grace periods are driven by the tick */
+    if (rcu_needs_cpu(rq->cpu)) {
+        return;
+    }
+
+    /* Sleep until the earliest deadline */
+    if (rq->next_sleeper != NULL) {
+        u64 now = get_timestamp();
+        u64 deadline = rq->next_sleeper->wakeup_time;
+
+        if (deadline <= now) {
+            return;
+        }
+        ticks = ((deadline - now) * freq) / 1000000;
+    }
+
+    /* Wake for the next timer as well, deferrable ones wait for us */
+    unsigned long timer_ticks = timer_next_expiry();
+    if (timer_ticks < ticks) {
+        ticks = timer_ticks;
+    }
+
+    /* Timers run from the tick must not be late either */
+    ktime_t hrtimer_ns = hrtimer_get_next_event();
+    if (hrtimer_ns != KTIME_MAX) {
+        u64 hrtimer_ticks = ((u64)hrtimer_ns / NSEC_PER_USEC * freq) / 1000000;
+
+        if (hrtimer_ticks < ticks) {
+            ticks = hrtimer_ticks;
+        }
+    }
+
+    /* Not worth stopping the tick for a single tick */
+    if (ticks <= 1) {
+        return;
+    }
+
+    if (arch_timer_set_oneshot(ticks > 0xFFFFFFFF ? 0xFFFFFFFF : (u32)ticks) != 0) {
+        rq->nohz_active = 1;
+        rq->nr_nohz_idle++;
+    }
+}
+
+/**
+ * Restart the periodic tick after the idle thread wakes up
+ *
+ * Interrupts must be disabled.
+ *
+ * @param rq Run queue
+ */
+static void sched_nohz_exit(struct run_queue *rq) {
+    u32 ticks;
+
+    if (!rq->nohz_active) {
+        return;
+    }
+    rq->nohz_active = 0;
+
+    /* The one-shot may already have fired and restarted the tick */
+    ticks = arch_timer_cancel_oneshot();
+    timer_account_ticks(ticks);
+    rq->nohz_ticks_skipped += ticks;
+}
+
 /**
  * Idle thread function
  *
@@ -109,38 +435,156 @@ void sched_stop(void) {
  * It should never return.
  */
 void sched_idle_thread(void) {
+    /* Get current run queue */
+    struct run_queue *rq = this_rq();
+
     /* Enable interrupts */
     sti();
 
     /* Loop forever */
     while (1) {
+        /* Stop the tick until the next wakeup if nothing can run */
+        cli();
+        spin_lock(&rq->lock);
+        sched_nohz_enter(rq);
+        spin_unlock(&rq->lock);
+        sti();
+
         /* Execute the HLT instruction to save power */
         cpu_halt();
+
+        /* Catch up on the ticks that were skipped */
+        cli();
+        sched_nohz_exit(rq);
+        sti();
     }
 
     /* Never reached */
 }
 
+/**
+ * Check if a thread is on the run queue
+ *
+ * @param thread Thread to check
+ * @return 1 if the thread is queued in either class, 0 if not
+ */
+static inline int sched_thread_queued(struct thread *thread) {
+    return thread->array != NULL || thread->fair_on_rq;
+}
+
+/**
+ * Pick the most important queued thread
+ *
+ * @param rq Run queue
+ * @return Thread, or NULL if nothing is queued
+ */
+static struct thread *sched_pick_next(struct run_queue *rq) {
+    /* Start a new round once every thread has used its slice */
+    sched_check_expired(rq);
+
+    int prio = sched_find_first_prio(rq->active);
+    if (prio >= MAX_PRIO) {
+        return NULL;
+    }
+
+    return list_entry(rq->active->queue[prio].next, struct thread, sched_list);
+}
+
+/**
+ * Pick the next thread to run from the scheduling classes
+ *
+ * @param rq Run queue
+ * @return Thread, or NULL if nothing is queued
+ */
+static struct thread *sched_pick_class(struct run_queue *rq) {
+    /* Real-time threads always come first */
+    struct thread *next = rt_schedule(rq);
+
+    /* If no real-time thread is available, get a fair thread */
+    if (next == NULL) {
+        next = fair_pick_next(rq);
+    }
+
+    /* Then any other level of the priority array */
+    if (next == NULL) {
+        next = sched_pick_next(rq);
+    }
+
+    return next;
+}
+
+/**
+ * Switch away from the running thread, or defer while preemption is off
+ *
+ * @param rq Run queue of the current CPU
+ */
+static void sched_resched_curr(struct run_queue *rq) {
+    if (preempt_counts[rq->cpu] != 0) {
+        /* preempt_enable() switches once the count drops */
+        preempt_resched[rq->cpu] = 1;
+        return;
+    }
+
+    sched_schedule();
+}
+
+/**
+ * Act on the result of sched_preempt_check()
+ *
+ * The run queue lock must not be held.
+ *
+ * @param rq Run queue of the current CPU
+ * @param action SCHED_PREEMPT_* action
+ */
+static void sched_preempt(struct run_queue *rq, int action) {
+    if (action == SCHED_PREEMPT_NOW) {
+        sched_schedule();
+    } else if (action == SCHED_PREEMPT_RESCHED) {
+        sched_resched_curr(rq);
+    }
+}
+
 /**
  * Scheduler tick
  *
  * This function is called by the timer interrupt handler.
  */
 void sched_tick(void) {
+    unsigned long flags;
+
     /* Get current run queue */
     struct run_queue *rq = this_rq();
 
+    /* Lock the run queue */
+    sched_rq_lock(rq, &flags);
+
     /* Update timestamp */
     rq->curr_timestamp = get_timestamp();
 
+    /* Wake sleepers whose deadline has passed, switching once unlocked */
+    int action = sched_wake_sleepers(rq);
+
+    /* The balancer locks this run queue together with the busiest one */
+    sched_rq_unlock(rq, flags);
+
+    /* Track the load and rebalance when a domain is due */
+    load_balance_tick(rq);
+
     /* Get current thread */
     struct thread *curr = rq->curr;
 
+    /* Outside a read-side section the CPU is in a quiescent state */
+    rcu_check_callbacks(rq->cpu, preempt_counts[rq->cpu] == 0 || curr == rq->idle);
+
     /* Check if current thread is idle */
     if (curr == rq->idle) {
+        sched_preempt(rq, action);
         return;
     }
 
+    /* Lock the run queue */
+    sched_rq_lock(rq, &flags);
+
     /* Handle real-time scheduling policies */
     if (curr->policy == SCHED_FIFO) {
         /* FIFO threads run until they yield or block */
@@ -154,62 +598,63 @@ void sched_tick(void) {
         /* Check if time slice expired */
         if (curr->time_slice == 0) {
             /* Reset time slice */
-            curr->time_slice = 100; /* 100ms time slice for RR tasks */
+            curr->time_slice = SCHED_TIMESLICE_RR;
 
-            /* Requeue thread (move to end of its priority queue) */
+            /* Move to the end of its priority queue */
             sched_requeue_thread(curr);
 
             /* Schedule */
-            sched_schedule();
+            if (action == SCHED_PREEMPT_NONE) {
+                action = SCHED_PREEMPT_RESCHED;
+            }
         }
     } else {
-        /* Normal scheduling policies */
-        if (curr->time_slice > 0) {
-            curr->time_slice--;
-        }
-
-        /* Check if thread time slice expired */
-        if (curr->time_slice == 0) {
-            /* Reset time slice */
-            curr->time_slice = SCHED_TIMESLICE_DEFAULT;
-
-            /* Requeue thread */
-            sched_requeue_thread(curr);
-
+        /* Fair threads run until they have had their share of the period */
+        if (fair_tick(rq, curr) && action == SCHED_PREEMPT_NONE) {
             /* Schedule */
-            sched_schedule();
-        }
-    }
-
-    /* Check for sleeping threads that need to be woken up */
-    struct thread *thread = rq->head;
-    struct thread *next;
-
-    while (thread != NULL) {
-        /* Save next thread before potentially removing this one */
-        next = thread->next;
-
-        /* Check if thread is sleeping */
-        if (thread->state == THREAD_STATE_SLEEPING) {
-            /* Check if thread wakeup time has passed */
-            if (rq->curr_timestamp >= thread->wakeup_time) {
-                /* Wake up thread */
-                sched_wakeup_thread(thread);
-            }
+            action = SCHED_PREEMPT_RESCHED;
         }
-
-        /* Move to next thread */
-        thread = next;
     }
 
     /* Update statistics */
     sched_update_statistics(rq);
+
+    /* Unlock the run queue */
+    sched_rq_unlock(rq, flags);
+
+    /* Switch now that the lock is dropped */
+    sched_preempt(rq, action);
 }
 
 /**
  * Yield the CPU
  */
 void sched_yield(void) {
+    unsigned long flags;
+
+    /* Get current run queue */
+    struct run_queue *rq = this_rq();
+
+    /* Lock the run queue */
+    sched_rq_lock(rq, &flags);
+
+    /* Get current thread */
+    struct thread *curr = rq->curr;
+
+    /* Let threads of the same priority run first */
+    if (curr != rq->idle && sched_thread_queued(curr)) {
+        if (curr->fair_on_rq) {
+            fair_yield(rq, curr);
+        } else if (rt_is_realtime(curr)) {
+            rt_yield(rq, curr);
+        } else {
+            sched_requeue_thread(curr);
+        }
+    }
+
+    /* Unlock the run queue */
+    sched_rq_unlock(rq, flags);
+
     /* Schedule */
     sched_schedule();
 }
@@ -217,7 +662,10 @@ void sched_yield(void) {
 /**
  * Schedule
  *
- * This function selects the next thread to run.
+ * This function selects the next thread to run. Real-time threads stay
+ * queued while they run and are picked from the priority array with a
+ * bitmap scan in O(1). Otherwise the fair thread with the smallest
+ * virtual runtime runs.
  */
 void sched_schedule(void) {
     /* Disable interrupts */
@@ -226,21 +674,35 @@ void sched_schedule(void) {
     /* Get current run queue */
     struct run_queue *rq = this_rq();
 
+    /* Lock the run queue */
+    spin_lock(&rq->lock);
+
     /* Update statistics */
     rq->nr_schedule++;
 
+    /* A context switch is a quiescent state, unless inside a read-side section */
+    if (preempt_counts[rq->cpu] == 0) {
+        rcu_note_context_switch(rq->cpu);
+    }
+
     /* Get current thread */
     struct thread *curr = rq->curr;
 
-    /* Try to find a real-time thread first */
-    struct thread *next = NULL;
+    /* A running fair thread goes back on the timeline to compete */
+    fair_put_prev(rq, curr);
 
-    /* Check for real-time tasks using the RT scheduler */
-    next = rt_schedule(rq);
+    /* Pick from the scheduling classes */
+    struct thread *next = sched_pick_class(rq);
 
-    /* If no real-time thread is available, get a normal thread */
+    /* Before going idle, try to pull work from a busier CPU */
     if (next == NULL) {
-        next = sched_dequeue_thread();
+        /* The balancer locks this run queue together with the busiest one */
+        spin_unlock(&rq->lock);
+        load_balance_newidle(rq);
+        spin_lock(&rq->lock);
+
+        /* Look again, a thread may also have been woken meanwhile */
+        next = sched_pick_class(rq);
     }
 
     /* If no thread is ready, use idle thread */
@@ -248,52 +710,40 @@ void sched_schedule(void) {
         next = rq->idle;
     }
 
-    /* If current thread is still running, requeue it */
-    if (curr != rq->idle && curr->state == THREAD_STATE_RUNNING) {
-        /* For FIFO tasks, only requeue if they're yielding or blocking */
-        if (curr->policy != SCHED_FIFO || curr->state != THREAD_STATE_RUNNING) {
-            /* Requeue thread */
-            sched_requeue_thread(curr);
-        }
+    /* A fair thread leaves the timeline while it runs */
+    if (next->fair_on_rq) {
+        fair_set_next(rq, next);
     }
 
-    /* Check if the next thread can preempt the current thread */
+    /* Switch if a different thread won */
     if (curr != next) {
-        /* Real-time threads can always preempt non-real-time threads */
-        int can_preempt = 0;
-
-        if (rt_is_realtime(next)) {
-            if (!rt_is_realtime(curr)) {
-                /* Real-time thread preempting non-real-time thread */
-                can_preempt = 1;
-            } else {
-                /* Both are real-time, check priorities */
-                can_preempt = rt_can_preempt(next, curr);
-            }
-        } else if (curr->policy == SCHED_FIFO && curr->state == THREAD_STATE_RUNNING) {
-            /* FIFO threads can't be preempted by non-real-time threads */
-            can_preempt = 0;
-        } else {
-            /* Normal preemption rules */
-            can_preempt = 1;
+        /* Update statistics */
+        rq->nr_switches++;
+
+        /* Remember when the thread left the CPU, for cache hotness */
+        curr->last_ran = get_timestamp();
+
+        /* Set thread state */
+        if (curr->state == THREAD_STATE_RUNNING) {
+            curr->state = THREAD_STATE_READY;
         }
+        next->state = THREAD_STATE_RUNNING;
 
-        if (can_preempt) {
-            /* Update statistics */
-            rq->nr_switches++;
+        /* Optimistic mutex spinners watch this to see if the owner runs */
+        curr->on_cpu = 0;
+        next->on_cpu = 1;
 
-            /* Set thread state */
-            if (curr->state == THREAD_STATE_RUNNING) {
-                curr->state = THREAD_STATE_READY;
-            }
-            next->state = THREAD_STATE_RUNNING;
+        /* Set current thread */
+        rq->curr = next;
 
-            /* Set current thread */
-            rq->curr = next;
+        /* The next thread does not expect the lock to be held */
+        spin_unlock(&rq->lock);
 
-            /* Switch context */
-            sched_context_switch(curr, next);
-        }
+        /* Switch context */
+        sched_context_switch(curr, next);
+    } else {
+        /* Unlock the run queue */
+        spin_unlock(&rq->lock);
     }
 
     /* Enable interrupts */
@@ -306,36 +756,26 @@ void sched_schedule(void) {
  * @param thread Thread to add
  */
 void sched_add_thread(struct thread *thread) {
+    unsigned long flags;
+
     /* Check parameters */
     if (thread == NULL) {
         return;
     }
 
-    /* Get run queue */
-    struct run_queue *rq = this_rq();
-
     /* Check thread state */
-    if (thread->state != THREAD_STATE_READY) {
+    if (thread->state != THREAD_STATE_READY && thread->state != THREAD_STATE_RUNNING) {
         return;
     }
 
-    /* Add thread to the end of the run queue */
-    if (rq->tail == NULL) {
-        /* Empty queue */
-        rq->head = thread;
-        rq->tail = thread;
-        thread->next = NULL;
-        thread->prev = NULL;
-    } else {
-        /* Add to the end of the queue */
-        thread->prev = rq->tail;
-        thread->next = NULL;
-        rq->tail->next = thread;
-        rq->tail = thread;
-    }
+    /* Lock the run queue */
+    struct run_queue *rq = sched_thread_rq_lock(thread, &flags);
 
-    /* Update statistics */
-    rq->nr_running++;
+    /* Add thread to its class */
+    sched_rq_enqueue(rq, thread);
+
+    /* Unlock the run queue */
+    sched_rq_unlock(rq, flags);
 }
 
 /**
@@ -344,37 +784,21 @@ void sched_add_thread(struct thread *thread) {
  * @param thread Thread to remove
  */
 void sched_remove_thread(struct thread *thread) {
+    unsigned long flags;
+
     /* Check parameters */
     if (thread == NULL) {
         return;
     }
 
-    /* Get run queue */
-    struct run_queue *rq = this_rq();
+    /* Lock the run queue */
+    struct run_queue *rq = sched_thread_rq_lock(thread, &flags);
 
-    /* Remove thread from run queue */
-    if (thread->prev != NULL) {
-        thread->prev->next = thread->next;
-    } else {
-        /* Thread is the head of the queue */
-        rq->head = thread->next;
-    }
-
-    if (thread->next != NULL) {
-        thread->next->prev = thread->prev;
-    } else {
-        /* Thread is the tail of the queue */
-        rq->tail = thread->prev;
-    }
-
-    /* Clear thread links */
-    thread->next = NULL;
-    thread->prev = NULL;
+    /* Remove thread from its class */
+    sched_rq_remove(rq, thread);
 
-    /* Update statistics */
-    if (rq->nr_running > 0) {
-        rq->nr_running--;
-    }
+    /* Unlock the run queue */
+    sched_rq_unlock(rq, flags);
 }
 
 /**
@@ -383,16 +807,47 @@ void sched_remove_thread(struct thread *thread) {
  * @param thread Thread to block
  */
 void sched_block_thread(struct thread *thread) {
+    sched_block_thread_unlock(thread, NULL);
+}
+
+/**
+ * Block a thread and drop the lock of the condition it waits for
+ *
+ * The thread is blocked before the lock is dropped, so a waker that takes
+ * the lock afterwards always finds it blocked and queues it again.
+ *
+ * @param thread Thread to block
+ * @param lock Held lock to drop, or NULL
+ */
+void sched_block_thread_unlock(struct thread *thread, spinlock_t *lock) {
+    unsigned long flags;
+
     /* Check parameters */
     if (thread == NULL) {
         return;
     }
 
+    /* Bios held back by a plug must not wait for the task to run again */
+    if (thread == this_rq()->curr) {
+        blk_flush_plug();
+    }
+
+    /* Lock the run queue */
+    struct run_queue *rq = sched_thread_rq_lock(thread, &flags);
+
     /* Set thread state */
     thread->state = THREAD_STATE_BLOCKED;
 
     /* Remove thread from run queue */
-    sched_remove_thread(thread);
+    sched_rq_remove(rq, thread);
+
+    /* Wakers may look now */
+    if (lock != NULL) {
+        spin_unlock(lock);
+    }
+
+    /* Unlock the run queue */
+    sched_rq_unlock(rq, flags);
 
     /* If thread is current thread, schedule */
     if (thread == this_rq()->curr) {
@@ -406,46 +861,78 @@ void sched_block_thread(struct thread *thread) {
  * @param thread Thread to unblock
  */
 void sched_unblock_thread(struct thread *thread) {
+    unsigned long flags;
+
     /* Check parameters */
     if (thread == NULL) {
         return;
     }
 
-    /* Check thread state */
-    if (thread->state != THREAD_STATE_BLOCKED) {
-        return;
-    }
+    /* Lock the run queue */
+    struct run_queue *rq = sched_thread_rq_lock(thread, &flags);
 
-    /* Set thread state */
-    thread->state = THREAD_STATE_READY;
+    /* Queue the thread if it is still blocked */
+    int action = sched_wake_locked(rq, thread, THREAD_STATE_BLOCKED);
 
-    /* Add thread to run queue */
-    sched_add_thread(thread);
+    /* Unlock the run queue */
+    sched_rq_unlock(rq, flags);
 
     /* Check preemption */
-    sched_check_preempt(thread);
+    sched_preempt(rq, action);
+}
+
+/**
+ * Sleep a thread
+ *
+ * @param thread Thread to sleep
+ * @param ms Time to sleep in milliseconds
+ */
+void sched_sleep_thread(struct thread *thread, u64 ms) {
+    sched_sleep_thread_unlock(thread, ms, NULL);
 }
 
 /**
- * Sleep a thread
+ * Sleep a thread and drop the lock of the condition it waits for
+ *
+ * Like sched_block_thread_unlock(), with a timeout.
  *
  * @param thread Thread to sleep
  * @param ms Time to sleep in milliseconds
+ * @param lock Held lock to drop, or NULL
  */
-void sched_sleep_thread(struct thread *thread, u64 ms) {
+void sched_sleep_thread_unlock(struct thread *thread, u64 ms, spinlock_t *lock) {
+    unsigned long flags;
+
     /* Check parameters */
     if (thread == NULL) {
         return;
     }
 
+    /* Bios held back by a plug must not wait for the task to run again */
+    if (thread == this_rq()->curr) {
+        blk_flush_plug();
+    }
+
+    /* Lock the run queue */
+    struct run_queue *rq = sched_thread_rq_lock(thread, &flags);
+
     /* Set thread state */
     thread->state = THREAD_STATE_SLEEPING;
 
     /* Set wakeup time */
     thread->wakeup_time = get_timestamp() + ms * 1000;
 
-    /* Remove thread from run queue */
-    sched_remove_thread(thread);
+    /* Move thread from the run queue to the sleeper tree of the same CPU */
+    sched_rq_remove(rq, thread);
+    sched_sleeper_insert(rq, thread);
+
+    /* Wakers may look now */
+    if (lock != NULL) {
+        spin_unlock(lock);
+    }
+
+    /* Unlock the run queue */
+    sched_rq_unlock(rq, flags);
 
     /* If thread is current thread, schedule */
     if (thread == this_rq()->curr) {
@@ -459,24 +946,24 @@ void sched_sleep_thread(struct thread *thread, u64 ms) {
  * @param thread Thread to wake up
  */
 void sched_wakeup_thread(struct thread *thread) {
+    unsigned long flags;
+
     /* Check parameters */
     if (thread == NULL) {
         return;
     }
 
-    /* Check thread state */
-    if (thread->state != THREAD_STATE_SLEEPING) {
-        return;
-    }
+    /* Lock the run queue whose sleeper tree holds the thread */
+    struct run_queue *rq = sched_thread_rq_lock(thread, &flags);
 
-    /* Set thread state */
-    thread->state = THREAD_STATE_READY;
+    /* Queue the thread if it is still sleeping */
+    int action = sched_wake_locked(rq, thread, THREAD_STATE_SLEEPING);
 
-    /* Add thread to run queue */
-    sched_add_thread(thread);
+    /* Unlock the run queue */
+    sched_rq_unlock(rq, flags);
 
     /* Check preemption */
-    sched_check_preempt(thread);
+    sched_preempt(rq, action);
 }
 
 /**
@@ -492,7 +979,7 @@ void sched_set_priority(struct thread *thread, int priority) {
     }
 
     /* Check priority range */
-    if (priority < THREAD_PRIO_IDLE || priority > THREAD_PRIO_REALTIME) {
+    if (priority < 0 || priority >= MAX_PRIO) {
         return;
     }
 
@@ -521,6 +1008,33 @@ int sched_get_priority(struct thread *thread) {
     return thread->priority;
 }
 
+/**
+ * Set thread nice level
+ *
+ * @param thread Thread to set nice level
+ * @param nice Nice level
+ * @return 0 on success, negative error code on failure
+ */
+int sched_set_nice(struct thread *thread, int nice) {
+    unsigned long flags;
+
+    /* Check parameters */
+    if (thread == NULL) {
+        return -EINVAL;
+    }
+
+    /* Lock the run queue */
+    struct run_queue *rq = sched_thread_rq_lock(thread, &flags);
+
+    /* Reweight the thread on the fair timeline */
+    int ret = fair_set_nice(thread, nice);
+
+    /* Unlock the run queue */
+    sched_rq_unlock(rq, flags);
+
+    return ret;
+}
+
 /**
  * Set thread scheduling policy
  *
@@ -547,7 +1061,7 @@ void sched_set_policy(struct thread *thread, u32 policy) {
         thread->time_slice = UINT32_MAX;
     } else if (policy == SCHED_RR) {
         /* Round-robin threads get a fixed time slice */
-        thread->time_slice = 100; /* 100ms time slice */
+        thread->time_slice = SCHED_TIMESLICE_RR;
     } else {
         /* Normal threads get the default time slice */
         thread->time_slice = SCHED_TIMESLICE_DEFAULT;
@@ -612,6 +1126,9 @@ u64 sched_get_timeslice(struct thread *thread) {
  * @param cpu CPU
  */
 void sched_set_affinity(struct thread *thread, u32 cpu) {
+    unsigned long flags;
+    struct run_queue *src;
+
     /* Check parameters */
     if (thread == NULL) {
         return;
@@ -622,8 +1139,36 @@ void sched_set_affinity(struct thread *thread, u32 cpu) {
         return;
     }
 
-    /* Set CPU */
-    thread->cpu = cpu;
+    /* Get destination run queue */
+    struct run_queue *dst = &run_queues[cpu];
+
+    /* Lock both run queues, again if the thread moved meanwhile */
+    while (1) {
+        src = sched_thread_rq(thread);
+
+        local_irq_save(flags);
+        sched_double_lock(src, dst);
+        if (src == sched_thread_rq(thread)) {
+            break;
+        }
+        sched_double_unlock(src, dst);
+        local_irq_restore(flags);
+    }
+
+    /* Pin the thread to the CPU */
+    thread->cpus_allowed = 1ULL << cpu;
+
+    /* Move a waiting thread over now, a running one moves when it next queues */
+    if (sched_thread_queued(thread) && src != dst && thread != src->curr) {
+        sched_migrate_thread(thread, dst);
+    } else {
+        /* Set CPU */
+        thread->cpu = cpu;
+    }
+
+    /* Unlock the run queues */
+    sched_double_unlock(src, dst);
+    local_irq_restore(flags);
 }
 
 /**
@@ -659,67 +1204,291 @@ void sched_switch(struct thread *prev, struct thread *next) {
 }
 
 /**
- * Enqueue a thread
+ * Get the queue index of a thread, ignoring inherited priority
+ *
+ * Real-time threads use their priority directly and always sort ahead of
+ * time-sharing threads, whose dynamic priority is kept in the upper band.
+ *
+ * @param thread Thread
+ * @return Priority level in [0, MAX_PRIO)
+ */
+int sched_thread_normal_prio(struct thread *thread) {
+    int prio;
+
+    if (rt_policy_realtime(thread)) {
+        prio = thread->priority;
+        if (prio < 0) {
+            prio = 0;
+        } else if (prio >= MAX_RT_PRIO) {
+            prio = MAX_RT_PRIO - 1;
+        }
+    } else {
+        prio = thread->dynamic_priority;
+        if (prio < MAX_RT_PRIO) {
+            prio = MAX_RT_PRIO;
+        } else if (prio >= MAX_PRIO) {
+            prio = MAX_PRIO - 1;
+        }
+    }
+
+    return prio;
+}
+
+/**
+ * Get the queue index of a thread
+ *
+ * A thread holding an rt_mutex runs at the priority of its most important
+ * waiter when that is higher than its own.
+ *
+ * @param thread Thread
+ * @return Priority level in [0, MAX_PRIO)
+ */
+int sched_thread_prio(struct thread *thread) {
+    int prio = sched_thread_normal_prio(thread);
+
+    /* An inherited priority only ever raises the thread */
+    if (thread->pi_boosted && thread->pi_prio < prio) {
+        prio = thread->pi_prio;
+    }
+
+    return prio;
+}
+
+/**
+ * Requeue a thread whose effective priority changed
+ *
+ * Inheriting or dropping a real-time priority moves the thread between
+ * the fair class and the priority arrays, also while it is running. The
+ * run queue lock of the thread must be held.
+ *
+ * @param thread Thread
+ */
+void sched_prio_changed(struct thread *thread) {
+    if (thread == NULL || !sched_thread_queued(thread)) {
+        return;
+    }
+
+    if (thread->fair_on_rq != fair_is_fair(thread)) {
+        /* Move it to the class of its new priority */
+        struct run_queue *rq = thread->rq;
+        sched_rq_remove(rq, thread);
+        sched_rq_enqueue(rq, thread);
+    } else if (thread->array != NULL) {
+        /* Move it to its new level */
+        prio_array_t *array = thread->array;
+        sched_array_dequeue(thread);
+        sched_array_enqueue(array, thread, 0);
+    }
+}
+
+/**
+ * Queue a thread on a priority array
+ *
+ * @param array Priority array
+ * @param thread Thread to queue
+ * @param head Non-zero to queue at the head of its level instead of the tail
+ */
+void sched_array_enqueue(prio_array_t *array, struct thread *thread, int head) {
+    int prio = sched_thread_prio(thread);
+
+    if (head) {
+        list_add(&thread->sched_list, &array->queue[prio]);
+    } else {
+        list_add_tail(&thread->sched_list, &array->queue[prio]);
+    }
+
+    /* Mark the level as non-empty */
+    array->bitmap[prio / 32] |= 1U << (prio % 32);
+    array->nr_active++;
+
+    thread->array = array;
+    thread->sched_prio = prio;
+}
+
+/**
+ * Remove a thread from its priority array
+ *
+ * @param thread Thread to remove
+ */
+void sched_array_dequeue(struct thread *thread) {
+    prio_array_t *array = thread->array;
+    int prio = thread->sched_prio;
+
+    if (array == NULL) {
+        return;
+    }
+
+    list_del(&thread->sched_list);
+
+    /* Clear the level once its last thread leaves */
+    if (list_empty(&array->queue[prio])) {
+        array->bitmap[prio / 32] &= ~(1U << (prio % 32));
+    }
+    array->nr_active--;
+
+    thread->array = NULL;
+}
+
+/**
+ * Queue a thread on a run queue
  *
+ * The run queue lock must be held.
+ *
+ * @param rq Run queue
  * @param thread Thread to enqueue
  */
-void sched_enqueue_thread(struct thread *thread) {
-    /* Check parameters */
-    if (thread == NULL) {
+static void sched_rq_enqueue(struct run_queue *rq, struct thread *thread) {
+    if (sched_thread_queued(thread)) {
         return;
     }
 
-    /* Get run queue */
-    struct run_queue *rq = this_rq();
+    thread->rq = rq;
 
-    /* Add thread to the end of the run queue */
-    if (rq->tail == NULL) {
-        /* Empty queue */
-        rq->head = thread;
-        rq->tail = thread;
-        thread->next = NULL;
-        thread->prev = NULL;
+    if (fair_is_fair(thread)) {
+        /* Place the thread on the fair timeline */
+        fair_enqueue(rq, thread);
     } else {
-        /* Add to the end of the queue */
-        thread->prev = rq->tail;
-        thread->next = NULL;
-        rq->tail->next = thread;
-        rq->tail = thread;
+        /* Add thread to the tail of its level in the active array */
+        sched_array_enqueue(rq->active, thread, 0);
     }
 
     /* Update statistics */
     rq->nr_running++;
 }
 
+/**
+ * Take a thread off its run queue
+ *
+ * The run queue lock must be held.
+ *
+ * @param rq Run queue of the thread
+ * @param thread Thread to remove
+ */
+static void sched_rq_remove(struct run_queue *rq, struct thread *thread) {
+    if (!sched_thread_queued(thread)) {
+        return;
+    }
+
+    /* Remove thread from its class */
+    if (thread->fair_on_rq) {
+        fair_dequeue(rq, thread);
+    } else {
+        sched_array_dequeue(thread);
+    }
+    thread->rq = NULL;
+
+    /* Update statistics */
+    if (rq->nr_running > 0) {
+        rq->nr_running--;
+    }
+}
+
+/**
+ * Check if a thread that was just queued should preempt the current thread
+ *
+ * Only the current CPU is preempted, a thread queued elsewhere waits for
+ * that CPU to schedule. The run queue lock must be held.
+ *
+ * @param rq Run queue the thread is queued on
+ * @param thread Thread to check
+ * @return SCHED_PREEMPT_* action for sched_preempt()
+ */
+static int sched_preempt_check(struct run_queue *rq, struct thread *thread) {
+    if (rq != this_rq()) {
+        return SCHED_PREEMPT_NONE;
+    }
+
+    /* Get current thread */
+    struct thread *curr = rq->curr;
+
+    /* Check if current thread is idle or no longer queued */
+    if (curr == rq->idle || !sched_thread_queued(curr)) {
+        return SCHED_PREEMPT_NOW;
+    }
+
+    if (thread->array != NULL) {
+        /* Real-time threads preempt fair threads and less important levels */
+        if (curr->fair_on_rq || thread->sched_prio < curr->sched_prio) {
+            return SCHED_PREEMPT_RESCHED;
+        }
+    } else if (thread->fair_on_rq && curr->fair_on_rq) {
+        /* Fair threads preempt once they lag far enough behind */
+        if (fair_check_preempt(rq, curr, thread)) {
+            return SCHED_PREEMPT_RESCHED;
+        }
+    }
+
+    return SCHED_PREEMPT_NONE;
+}
+
+/**
+ * Queue a blocked or sleeping thread again
+ *
+ * The run queue lock of the thread must be held.
+ *
+ * @param rq Run queue of the thread
+ * @param thread Thread to wake
+ * @param state State the thread must still be in
+ * @return SCHED_PREEMPT_* action for sched_preempt()
+ */
+static int sched_wake_locked(struct run_queue *rq, struct thread *thread, u32 state) {
+    /* Check thread state */
+    if (thread->state != state) {
+        return SCHED_PREEMPT_NONE;
+    }
+
+    /* Take thread off the sleeper tree, early wakeups included */
+    if (state == THREAD_STATE_SLEEPING) {
+        sched_sleeper_remove(thread);
+    }
+
+    /* Set thread state */
+    thread->state = THREAD_STATE_READY;
+
+    /* Add thread to run queue */
+    sched_rq_enqueue(rq, thread);
+
+    return sched_preempt_check(rq, thread);
+}
+
+/**
+ * Enqueue a thread
+ *
+ * The run queue lock of the current CPU must be held.
+ *
+ * @param thread Thread to enqueue
+ */
+void sched_enqueue_thread(struct thread *thread) {
+    /* Check parameters */
+    if (thread == NULL) {
+        return;
+    }
+
+    /* Queue it on the current CPU */
+    sched_rq_enqueue(this_rq(), thread);
+}
+
 /**
  * Dequeue a thread
  *
+ * Removes the most important queued thread from the run queue. The run
+ * queue lock of the current CPU must be held.
+ *
  * @return Thread, or NULL if no thread is ready
  */
 struct thread *sched_dequeue_thread(void) {
     /* Get run queue */
     struct run_queue *rq = this_rq();
 
-    /* Check if run queue is empty */
-    if (rq->head == NULL) {
-        return NULL;
-    }
-
     /* Get the highest priority thread */
-    struct thread *thread = rq->head;
+    struct thread *thread = sched_pick_next(rq);
 
-    /* Remove from the run queue */
-    if (thread->next != NULL) {
-        rq->head = thread->next;
-        thread->next->prev = NULL;
-    } else {
-        rq->head = NULL;
-        rq->tail = NULL;
+    if (thread == NULL) {
+        return NULL;
     }
 
-    /* Clear thread links */
-    thread->next = NULL;
-    thread->prev = NULL;
+    /* Remove from the run queue */
+    sched_rq_remove(rq, thread);
 
     return thread;
 }
@@ -727,6 +1496,10 @@ struct thread *sched_dequeue_thread(void) {
 /**
  * Requeue a thread
  *
+ * Moves a queued thread to the tail of its priority level, or queues it
+ * if it was not on the run queue. The run queue lock of the thread must be
+ * held.
+ *
  * @param thread Thread to requeue
  */
 void sched_requeue_thread(struct thread *thread) {
@@ -735,23 +1508,21 @@ void sched_requeue_thread(struct thread *thread) {
         return;
     }
 
-    /* Get run queue */
-    struct run_queue *rq = this_rq();
+    /* Queue it if it is not queued yet */
+    if (!sched_thread_queued(thread)) {
+        sched_enqueue_thread(thread);
+        return;
+    }
 
-    /* Add thread to the end of the run queue */
-    if (rq->tail == NULL) {
-        /* Empty queue */
-        rq->head = thread;
-        rq->tail = thread;
-        thread->next = NULL;
-        thread->prev = NULL;
-    } else {
-        /* Add to the end of the queue */
-        thread->prev = rq->tail;
-        thread->next = NULL;
-        rq->tail->next = thread;
-        rq->tail = thread;
+    /* Fair threads are ordered by virtual runtime, not by arrival */
+    if (thread->fair_on_rq) {
+        return;
     }
+
+    /* Move to the tail of its level, picking up any priority change */
+    prio_array_t *array = thread->array;
+    sched_array_dequeue(thread);
+    sched_array_enqueue(array, thread, 0);
 }
 
 /**
@@ -760,51 +1531,96 @@ void sched_requeue_thread(struct thread *thread) {
  * @param thread Thread to check
  */
 void sched_check_preempt(struct thread *thread) {
+    unsigned long flags;
+
     /* Check parameters */
     if (thread == NULL) {
         return;
     }
 
-    /* Get run queue */
-    struct run_queue *rq = this_rq();
+    /* Lock the run queue */
+    struct run_queue *rq = sched_thread_rq_lock(thread, &flags);
 
-    /* Get current thread */
-    struct thread *curr = rq->curr;
+    /* Check against the current thread */
+    int action = sched_preempt_check(rq, thread);
 
-    /* Check if current thread is idle */
-    if (curr == rq->idle) {
-        /* Schedule */
-        sched_schedule();
-        return;
+    /* Unlock the run queue */
+    sched_rq_unlock(rq, flags);
+
+    /* Schedule */
+    sched_preempt(rq, action);
+}
+
+/**
+ * Move a queued thread to another run queue
+ *
+ * Fair threads keep their virtual runtime relative to min_vruntime, so
+ * they neither gain nor lose their place by changing queues. Both run
+ * queue locks must be held, see sched_double_lock().
+ *
+ * @param thread Thread to move
+ * @param dst Destination run queue
+ * @return 0 on success, negative error code on failure
+ */
+int sched_migrate_thread(struct thread *thread, run_queue_t *dst) {
+    /* Check parameters */
+    if (thread == NULL || dst == NULL || !sched_thread_queued(thread)) {
+        return -EINVAL;
     }
 
-    /* Handle real-time preemption */
-    if (rt_is_realtime(thread)) {
-        if (!rt_is_realtime(curr)) {
-            /* Real-time thread can always preempt non-real-time thread */
-            sched_schedule();
-            return;
-        } else {
-            /* Both are real-time, check priorities */
-            if (rt_can_preempt(thread, curr)) {
-                sched_schedule();
-                return;
-            }
-        }
-    } else if (curr->policy == SCHED_FIFO && curr->state == THREAD_STATE_RUNNING) {
-        /* Non-real-time thread cannot preempt a running FIFO thread */
-        return;
+    /* Get source run queue */
+    struct run_queue *src = thread->rq;
+
+    /* The running thread and threads already there stay put */
+    if (src == dst || thread == src->curr) {
+        return -EBUSY;
     }
 
-    /* Normal preemption rules */
-    if (thread->dynamic_priority < curr->dynamic_priority) {
-        /* Schedule */
-        sched_schedule();
+    /* The CPU must be in the thread's affinity mask */
+    if (!(thread->cpus_allowed & (1ULL << dst->cpu))) {
+        return -EINVAL;
+    }
+
+    if (thread->fair_on_rq) {
+        /* Move along the timelines */
+        fair_migrate(src, dst, thread);
+    } else {
+        /* Move to the same level of the destination array */
+        sched_array_dequeue(thread);
+        sched_array_enqueue(dst->active, thread, 0);
+    }
+
+    thread->rq = dst;
+    thread->cpu = dst->cpu;
+
+    /* Update statistics */
+    src->nr_running--;
+    dst->nr_running++;
+
+    return 0;
+}
+
+/**
+ * Get the instantaneous load of a run queue
+ *
+ * Fair threads count with their load weight and real-time threads as a
+ * nice 0 thread each.
+ *
+ * @param rq Run queue
+ * @return Load weight
+ */
+unsigned long sched_rq_load(run_queue_t *rq) {
+    /* Check parameters */
+    if (rq == NULL) {
+        return 0;
     }
+
+    return rq->cfs.load_weight +
+           (unsigned long)(rq->active->nr_active + rq->expired->nr_active) * NICE_0_LOAD;
 }
 
 /**
- * Check if the active array is empty
+ * Swap the active and expired arrays once the active array is empty
  *
  * @param rq Run queue
  */
@@ -814,8 +1630,16 @@ void sched_check_expired(struct run_queue *rq) {
         return;
     }
 
-    /* For now, we don't have a separate expired queue */
-    /* In a real implementation, we would swap active and expired queues */
+    /* Nothing to do while threads still have time slice left */
+    if (rq->active->nr_active != 0 || rq->expired->nr_active == 0) {
+        return;
+    }
+
+    /* Start a new round */
+    prio_array_t *array = rq->active;
+    rq->active = rq->expired;
+    rq->expired = array;
+    rq->nr_array_swaps++;
 }
 
 /**
@@ -824,11 +1648,16 @@ void sched_check_expired(struct run_queue *rq) {
  * @param thread Thread to update
  */
 void sched_update_thread(struct thread *thread) {
+    unsigned long flags;
+
     /* Check parameters */
     if (thread == NULL) {
         return;
     }
 
+    /* Lock the run queue */
+    struct run_queue *rq = sched_thread_rq_lock(thread, &flags);
+
     /* Update priority */
     sched_update_priority(thread);
 
@@ -840,6 +1669,31 @@ void sched_update_thread(struct thread *thread) {
 
     /* Update affinity */
     sched_update_affinity(thread);
+
+    /* Move a queued thread to where its new priority belongs */
+    if (sched_thread_queued(thread)) {
+        if (thread->fair_on_rq && fair_is_fair(thread)) {
+            /* Pick up the weight of a SCHED_IDLE change */
+            fair_set_nice(thread, thread->nice);
+        } else if (thread->fair_on_rq != fair_is_fair(thread)) {
+            /* The policy changed class, so move it to the other one */
+            sched_rq_remove(rq, thread);
+            sched_rq_enqueue(rq, thread);
+        } else if (thread->array != NULL) {
+            /* Move a queued thread to its new level */
+            prio_array_t *array = thread->array;
+            sched_array_dequeue(thread);
+            sched_array_enqueue(array, thread, 0);
+        }
+    }
+
+    /* Unlock the run queue */
+    sched_rq_unlock(rq, flags);
+
+    /* Carry the new priority down the chain of locks it waits on, which locks run queues itself */
+    if (thread->pi_blocked_on != NULL) {
+        rt_mutex_adjust_pi(thread);
+    }
 }
 
 /**
@@ -909,7 +1763,7 @@ void sched_update_policy(struct thread *thread) {
             /* Round-robin threads have real-time priority */
             thread->static_priority = THREAD_PRIO_REALTIME;
             /* Round-robin threads get a fixed time slice */
-            thread->time_slice = 100; /* 100ms time slice */
+            thread->time_slice = SCHED_TIMESLICE_RR;
             break;
         case SCHED_BATCH:
             /* Batch threads have low priority */
@@ -982,6 +1836,13 @@ void sched_print_statistics(void) {
     console_printf("  Running threads: %u\n", rq->nr_running);
     console_printf("  Context switches: %u\n", rq->nr_switches);
     console_printf("  Schedules: %llu\n", rq->nr_schedule);
+    console_printf("  Array swaps: %llu\n", rq->nr_array_swaps);
+    console_printf("  Sleeping threads: %u\n", rq->nr_sleeping);
+    console_printf("  Timed wakeups: %llu\n", rq->nr_timed_wakeups);
+    console_printf("  Tickless idle periods: %llu (%llu ticks skipped)\n", rq->nr_nohz_idle, rq->nohz_ticks_skipped);
+
+    /* Print fair scheduler statistics */
+    fair_print_stats(rq);
 }
 
 /**
@@ -1008,12 +1869,22 @@ void sched_print_runqueue(void) {
         console_printf("  Idle thread: None\n");
     }
 
-    /* Print run queue */
-    console_printf("  Run queue:\n");
-    struct thread *thread = rq->head;
-    while (thread != NULL) {
-        console_printf("    Thread %u (PID %u)\n", thread->tid, thread->pid);
-        thread = thread->next;
+    /* Print both priority arrays */
+    for (int a = 0; a < 2; a++) {
+        prio_array_t *array = (a == 0) ? rq->active : rq->expired;
+
+        console_printf("  %s array (%u threads):\n", (a == 0) ? "Active" : "Expired", array->nr_active);
+        for (int prio = 0; prio < MAX_PRIO; prio++) {
+            struct thread *thread;
+
+            if (!(array->bitmap[prio / 32] & (1U << (prio % 32)))) {
+                continue;
+            }
+
+            list_for_each_entry(thread, &array->queue[prio], sched_list) {
+                console_printf("    [%d] Thread %u (PID %u)\n", prio, thread->tid, thread->pid);
+            }
+        }
     }
 }
 
@@ -0,0 +1,546 @@
+/**
+ * fair.c - Horizon kernel fair scheduler implementation
+ *
+ * This file contains the implementation of the fair scheduling class.
+ * Each thread accumulates virtual runtime, its real runtime scaled by
+ * NICE_0_LOAD over its load weight, and the thread with the smallest
+ * virtual runtime runs next. Queued threads are kept in a red-black tree
+ * ordered by virtual runtime with the leftmost node cached.
+ */
+
+#include <horizon/kernel.h>
+#include <horizon/types.h>
+#include <horizon/sched.h>
+#include <horizon/sched/fair.h>
+#include <horizon/thread.h>
+#include <horizon/time.h>
+#include <horizon/rbtree.h>
+#include <horizon/printk.h>
+#include <horizon/errno.h>
+#include <horizon/stddef.h>
+
+/*
+ * Load weight of each nice level. Every step changes the weight by about
+ * 25%, so one nice level is worth about 10% of CPU time against a peer.
+ */
+static const unsigned long fair_prio_to_weight[NICE_WIDTH] = {
+    /* -20 */ 88761, 71755, 56483, 46273, 36291,
+    /* -15 */ 29154, 23254, 18705, 14949, 11916,
+    /* -10 */  9548,  7620,  6100,  4904,  3906,
+    /*  -5 */  3121,  2501,  1991,  1586,  1277,
+    /*   0 */  1024,   820,   655,   526,   423,
+    /*   5 */   335,   272,   215,   172,   137,
+    /*  10 */   110,    87,    70,    56,    45,
+    /*  15 */    36,    29,    23,    18,    15,
+};
+
+/**
+ * Initialize a fair run queue
+ *
+ * @param cfs Fair run queue
+ */
+void fair_init_rq(cfs_rq_t *cfs) {
+    rb_init_root(&cfs->timeline);
+    cfs->leftmost = NULL;
+    cfs->curr = NULL;
+    cfs->min_vruntime = 0;
+    cfs->nr_running = 0;
+    cfs->load_weight = 0;
+    cfs->nr_preempt_tick = 0;
+    cfs->nr_preempt_wakeup = 0;
+}
+
+/**
+ * Check if a thread belongs to the fair class
+ *
+ * @param thread Thread to check
+ * @return 1 if the thread is scheduled by the fair class, 0 if not
+ */
+int fair_is_fair(struct thread *thread) {
+    return thread != NULL && !rt_is_realtime(thread);
+}
+
+/**
+ * Get the load weight of a thread
+ *
+ * @param thread Thread
+ * @return Load weight
+ */
+static unsigned long fair_thread_weight(struct thread *thread) {
+    int nice = thread->nice;
+
+    /* SCHED_IDLE threads only soak up otherwise idle time */
+    if (thread->policy == SCHED_IDLE) {
+        return FAIR_IDLE_WEIGHT;
+    }
+
+    if (nice < NICE_MIN) {
+        nice = NICE_MIN;
+    } else if (nice > NICE_MAX) {
+        nice = NICE_MAX;
+    }
+
+    return fair_prio_to_weight[nice - NICE_MIN];
+}
+
+/**
+ * Scale a real time delta to virtual time for a thread
+ *
+ * @param delta Real time delta in microseconds
+ * @param thread Thread
+ * @return Virtual time delta
+ */
+static u64 fair_calc_delta(u64 delta, struct thread *thread) {
+    if (thread->load_weight == NICE_0_LOAD || thread->load_weight == 0) {
+        return delta;
+    }
+
+    return (delta * NICE_0_LOAD) / thread->load_weight;
+}
+
+/**
+ * Advance min_vruntime, it never moves backwards
+ *
+ * @param cfs Fair run queue
+ */
+static void fair_update_min_vruntime(cfs_rq_t *cfs) {
+    u64 vruntime = cfs->min_vruntime;
+
+    if (cfs->curr != NULL && cfs->curr->fair_on_rq) {
+        vruntime = cfs->curr->vruntime;
+    }
+
+    if (cfs->leftmost != NULL) {
+        if (cfs->curr == NULL || !cfs->curr->fair_on_rq ||
+            (s64)(cfs->leftmost->vruntime - vruntime) < 0) {
+            vruntime = cfs->leftmost->vruntime;
+        }
+    }
+
+    if ((s64)(vruntime - cfs->min_vruntime) > 0) {
+        cfs->min_vruntime = vruntime;
+    }
+}
+
+/**
+ * Insert a thread into the timeline
+ *
+ * @param cfs Fair run queue
+ * @param thread Thread to insert
+ */
+static void fair_tree_insert(cfs_rq_t *cfs, struct thread *thread) {
+    rb_node_t **link = &cfs->timeline.rb_node;
+    rb_node_t *parent = NULL;
+    int leftmost = 1;
+
+    /* Equal virtual runtimes go right, so peers take turns */
+    while (*link != NULL) {
+        struct thread *entry = rb_entry(*link, struct thread, fair_node);
+
+        parent = *link;
+        if ((s64)(thread->vruntime - entry->vruntime) < 0) {
+            link = &parent->rb_left;
+        } else {
+            link = &parent->rb_right;
+            leftmost = 0;
+        }
+    }
+
+    rb_link_node(&thread->fair_node, parent, link);
+    rb_insert_color(&thread->fair_node, &cfs->timeline);
+
+    if (leftmost) {
+        cfs->leftmost = thread;
+    }
+}
+
+/**
+ * Remove a thread from the timeline
+ *
+ * @param cfs Fair run queue
+ * @param thread Thread to remove
+ */
+static void fair_tree_erase(cfs_rq_t *cfs, struct thread *thread) {
+    if (cfs->leftmost == thread) {
+        rb_node_t *next = rb_next(&thread->fair_node);
+        cfs->leftmost = (next != NULL) ? rb_entry(next, struct thread, fair_node) : NULL;
+    }
+
+    rb_erase(&thread->fair_node, &cfs->timeline);
+}
+
+/**
+ * Charge the running thread for the time since it was last accounted
+ *
+ * @param cfs Fair run queue
+ */
+static void fair_update_curr(cfs_rq_t *cfs) {
+    struct thread *curr = cfs->curr;
+    u64 now, delta;
+
+    if (curr == NULL) {
+        return;
+    }
+
+    now = get_timestamp();
+    if (now <= curr->exec_start) {
+        return;
+    }
+
+    delta = now - curr->exec_start;
+    curr->exec_start = now;
+
+    curr->sum_exec_runtime += delta;
+    curr->vruntime += fair_calc_delta(delta, curr);
+
+    fair_update_min_vruntime(cfs);
+}
+
+/**
+ * Get the real time slice a thread is due in the current period
+ *
+ * The period stretches once there are too many threads to give each the
+ * minimum granularity, and is split in proportion to load weight.
+ *
+ * @param cfs Fair run queue
+ * @param thread Thread
+ * @return Slice in microseconds
+ */
+static u64 fair_slice(cfs_rq_t *cfs, struct thread *thread) {
+    u64 period = FAIR_LATENCY_US;
+
+    if (cfs->nr_running > FAIR_LATENCY_US / FAIR_MIN_GRANULARITY_US) {
+        period = (u64)cfs->nr_running * FAIR_MIN_GRANULARITY_US;
+    }
+
+    if (cfs->load_weight == 0) {
+        return period;
+    }
+
+    return (period * thread->load_weight) / cfs->load_weight;
+}
+
+/**
+ * Place a thread on the timeline as it joins the run queue
+ *
+ * New threads start one slice behind min_vruntime so forking cannot be
+ * used to grab CPU time. Threads waking from sleep get up to half a
+ * latency period of credit, but never run ahead of their own past.
+ *
+ * @param cfs Fair run queue
+ * @param thread Thread to place
+ */
+static void fair_place_thread(cfs_rq_t *cfs, struct thread *thread) {
+    u64 vruntime = cfs->min_vruntime;
+
+    if (thread->sum_exec_runtime == 0) {
+        /* Start debit for new threads */
+        vruntime += fair_calc_delta(fair_slice(cfs, thread), thread);
+    } else {
+        /* Sleeper credit */
+        vruntime -= FAIR_LATENCY_US / 2;
+    }
+
+    /* Sleeping must not wind the clock back */
+    if ((s64)(thread->vruntime - vruntime) > 0) {
+        vruntime = thread->vruntime;
+    }
+
+    thread->vruntime = vruntime;
+}
+
+/**
+ * Enqueue a fair thread
+ *
+ * @param rq Run queue to enqueue on
+ * @param thread Thread to enqueue
+ */
+void fair_enqueue(struct run_queue *rq, struct thread *thread) {
+    cfs_rq_t *cfs = &rq->cfs;
+
+    /* Check if the thread is already queued */
+    if (thread->fair_on_rq) {
+        return;
+    }
+
+    /* Bring min_vruntime up to date before placing */
+    fair_update_curr(cfs);
+
+    thread->load_weight = fair_thread_weight(thread);
+    cfs->load_weight += thread->load_weight;
+    cfs->nr_running++;
+
+    fair_place_thread(cfs, thread);
+
+    /* The running thread stays out of the tree */
+    if (thread != cfs->curr) {
+        fair_tree_insert(cfs, thread);
+    }
+    thread->fair_on_rq = 1;
+}
+
+/**
+ * Dequeue a fair thread
+ *
+ * @param rq Run queue to dequeue from
+ * @param thread Thread to dequeue
+ */
+void fair_dequeue(struct run_queue *rq, struct thread *thread) {
+    cfs_rq_t *cfs = &rq->cfs;
+
+    /* Check if the thread is queued */
+    if (!thread->fair_on_rq) {
+        return;
+    }
+
+    /* Charge the running thread before it leaves */
+    fair_update_curr(cfs);
+
+    if (thread != cfs->curr) {
+        fair_tree_erase(cfs, thread);
+    }
+    thread->fair_on_rq = 0;
+
+    cfs->load_weight -= thread->load_weight;
+    cfs->nr_running--;
+
+    fair_update_min_vruntime(cfs);
+}
+
+/**
+ * Move a queued fair thread to another run queue
+ *
+ * The virtual runtime is carried over relative to min_vruntime, since
+ * the two timelines advance independently.
+ *
+ * @param src Run queue the thread is queued on
+ * @param dst Run queue to move it to
+ * @param thread Thread to move
+ */
+void fair_migrate(struct run_queue *src, struct run_queue *dst, struct thread *thread) {
+    /* The running thread cannot move */
+    if (!thread->fair_on_rq || thread == src->cfs.curr) {
+        return;
+    }
+
+    fair_dequeue(src, thread);
+
+    /* Rebase onto the destination timeline */
+    thread->vruntime = thread->vruntime - src->cfs.min_vruntime + dst->cfs.min_vruntime;
+
+    fair_enqueue(dst, thread);
+}
+
+/**
+ * Pick the next fair thread to run
+ *
+ * fair_put_prev() must have been called for the previous thread.
+ *
+ * @param rq Run queue
+ * @return Thread with the smallest virtual runtime, or NULL if none
+ */
+struct thread *fair_pick_next(struct run_queue *rq) {
+    return rq->cfs.leftmost;
+}
+
+/**
+ * Put the previous thread back before picking
+ *
+ * @param rq Run queue
+ * @param prev Previous thread
+ */
+void fair_put_prev(struct run_queue *rq, struct thread *prev) {
+    cfs_rq_t *cfs = &rq->cfs;
+
+    if (cfs->curr != prev || prev == NULL) {
+        return;
+    }
+
+    fair_update_curr(cfs);
+
+    /* Still runnable, so it competes again */
+    if (prev->fair_on_rq) {
+        fair_tree_insert(cfs, prev);
+    }
+
+    cfs->curr = NULL;
+}
+
+/**
+ * Make a thread the running fair thread
+ *
+ * @param rq Run queue
+ * @param next Thread about to run
+ */
+void fair_set_next(struct run_queue *rq, struct thread *next) {
+    cfs_rq_t *cfs = &rq->cfs;
+
+    if (!next->fair_on_rq || cfs->curr == next) {
+        return;
+    }
+
+    /* The running thread is kept out of the tree */
+    fair_tree_erase(cfs, next);
+    cfs->curr = next;
+
+    /* Start a new slice */
+    next->exec_start = get_timestamp();
+    next->prev_sum_exec_runtime = next->sum_exec_runtime;
+}
+
+/**
+ * Account the running thread at a tick
+ *
+ * @param rq Run queue
+ * @param curr Running thread
+ * @return 1 if the thread should be preempted, 0 if not
+ */
+int fair_tick(struct run_queue *rq, struct thread *curr) {
+    cfs_rq_t *cfs = &rq->cfs;
+    u64 ideal, ran;
+
+    if (cfs->curr != curr) {
+        return 0;
+    }
+
+    fair_update_curr(cfs);
+
+    /* Preempt once the thread has had its share of the period */
+    ideal = fair_slice(cfs, curr);
+    ran = curr->sum_exec_runtime - curr->prev_sum_exec_runtime;
+    if (ran > ideal) {
+        cfs->nr_preempt_tick++;
+        return 1;
+    }
+
+    /* Always allow at least the minimum granularity */
+    if (ran < FAIR_MIN_GRANULARITY_US || cfs->leftmost == NULL) {
+        return 0;
+    }
+
+    /* Preempt if the leftmost thread has fallen a full slice behind */
+    if ((s64)(curr->vruntime - cfs->leftmost->vruntime) > (s64)ideal) {
+        cfs->nr_preempt_tick++;
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Check if a waking thread should preempt the running one
+ *
+ * @param rq Run queue
+ * @param curr Running thread
+ * @param thread Waking thread
+ * @return 1 if the waking thread should preempt, 0 if not
+ */
+int fair_check_preempt(struct run_queue *rq, struct thread *curr, struct thread *thread) {
+    cfs_rq_t *cfs = &rq->cfs;
+    u64 gran;
+
+    if (cfs->curr != curr || !thread->fair_on_rq) {
+        return 0;
+    }
+
+    /* Anything preempts an idle-policy thread */
+    if (curr->policy == SCHED_IDLE && thread->policy != SCHED_IDLE) {
+        cfs->nr_preempt_wakeup++;
+        return 1;
+    }
+
+    /* Batch and idle-policy threads do not preempt on wakeup */
+    if (thread->policy == SCHED_BATCH || thread->policy == SCHED_IDLE) {
+        return 0;
+    }
+
+    fair_update_curr(cfs);
+
+    /* The waker must be ahead by more than the wakeup granularity */
+    gran = fair_calc_delta(FAIR_WAKEUP_GRANULARITY_US, thread);
+    if ((s64)(curr->vruntime - thread->vruntime) > (s64)gran) {
+        cfs->nr_preempt_wakeup++;
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Yield the running fair thread
+ *
+ * Moves the thread behind every other queued thread.
+ *
+ * @param rq Run queue
+ * @param curr Running thread
+ */
+void fair_yield(struct run_queue *rq, struct thread *curr) {
+    cfs_rq_t *cfs = &rq->cfs;
+    rb_node_t *last;
+
+    if (cfs->curr != curr) {
+        return;
+    }
+
+    fair_update_curr(cfs);
+
+    last = rb_last(&cfs->timeline);
+    if (last != NULL) {
+        struct thread *rightmost = rb_entry(last, struct thread, fair_node);
+
+        if ((s64)(rightmost->vruntime - curr->vruntime) >= 0) {
+            curr->vruntime = rightmost->vruntime + 1;
+        }
+    }
+}
+
+/**
+ * Set the nice level of a thread
+ *
+ * @param thread Thread to change
+ * @param nice New nice level
+ * @return 0 on success, negative error code on failure
+ */
+int fair_set_nice(struct thread *thread, int nice) {
+    /* Check parameters */
+    if (thread == NULL || nice < NICE_MIN || nice > NICE_MAX) {
+        return -EINVAL;
+    }
+
+    /* Unqueued threads pick up the weight when they are enqueued */
+    if (!thread->fair_on_rq || thread->rq == NULL) {
+        thread->nice = nice;
+        thread->load_weight = fair_thread_weight(thread);
+        return 0;
+    }
+
+    cfs_rq_t *cfs = &thread->rq->cfs;
+
+    /* Charge the old weight up to now */
+    if (cfs->curr == thread) {
+        fair_update_curr(cfs);
+    }
+
+    /* Swap the weight, the virtual runtime carries over */
+    cfs->load_weight -= thread->load_weight;
+    thread->nice = nice;
+    thread->load_weight = fair_thread_weight(thread);
+    cfs->load_weight += thread->load_weight;
+
+    return 0;
+}
+
+/**
+ * Print fair scheduler statistics
+ *
+ * @param rq Run queue
+ */
+void fair_print_stats(struct run_queue *rq) {
+    cfs_rq_t *cfs = &rq->cfs;
+
+    printk(KERN_INFO "FAIR: Running: %u\n", cfs->nr_running);
+    printk(KERN_INFO "FAIR: Load weight: %lu\n", cfs->load_weight);
+    printk(KERN_INFO "FAIR: Min vruntime: %llu\n", cfs->min_vruntime);
+    printk(KERN_INFO "FAIR: Tick preemptions: %llu\n", cfs->nr_preempt_tick);
+    printk(KERN_INFO "FAIR: Wakeup preemptions: %llu\n", cfs->nr_preempt_wakeup);
+}
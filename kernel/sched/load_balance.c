@@ -1,18 +1,28 @@
 /**
  * load_balance.c - Horizon kernel load balancing implementation
- * 
+ *
  * This file contains the implementation of CPU load balancing.
+ *
+ * Each run queue keeps a decayed average of its load weight. Balancing
+ * walks the scheduler domains of a CPU bottom-up, compares the load of
+ * the groups at each level and pulls threads from the busiest CPU of the
+ * busiest group. Cache-cold threads move first, and a CPU that is about
+ * to run its idle thread tries to pull a thread before it does.
  */
 
 #include <horizon/kernel.h>
 #include <horizon/types.h>
 #include <horizon/sched.h>
+#include <horizon/sched/sched_domain.h>
 #include <horizon/thread.h>
 #include <horizon/task.h>
 #include <horizon/mm.h>
 #include <horizon/spinlock.h>
+#include <horizon/time.h>
+#include <horizon/timer.h>
 #include <horizon/printk.h>
 #include <horizon/errno.h>
+#include <horizon/irqflags.h>
 
 /* Define NULL if not defined */
 #ifndef NULL
@@ -25,15 +35,24 @@ static u64 load_balance_moves = 0;
 static u64 load_balance_failed = 0;
 static u64 load_balance_skipped = 0;
 static u64 load_balance_imbalance = 0;
+static u64 load_balance_newidle_count = 0;
+static u64 load_balance_newidle_pulls = 0;
 
-/* Load balancing lock */
+/* Load balancing parameters lock */
 static spinlock_t load_balance_lock = SPIN_LOCK_INITIALIZER;
 
 /* Load balancing parameters */
 static int load_balance_enabled = 1;
-static u64 load_balance_interval = 1000; /* 1 second */
-static u64 load_balance_threshold = 25; /* 25% imbalance */
-static u64 load_balance_last_time = 0;
+static u64 load_balance_interval = 64; /* Longest balance interval in ticks */
+static u64 load_balance_threshold = 10; /* Minimum imbalance in percent */
+
+/* Load statistics of a scheduler group */
+typedef struct lb_group_stats {
+    unsigned long load;     /* Sum of the CPU loads */
+    unsigned long avg_load; /* Load per CPU */
+    u32 nr_running;         /* Number of threads */
+    u32 nr_cpus;            /* Number of CPUs */
+} lb_group_stats_t;
 
 /**
  * Initialize the load balancing subsystem
@@ -45,19 +64,20 @@ void load_balance_init(void) {
     load_balance_failed = 0;
     load_balance_skipped = 0;
     load_balance_imbalance = 0;
+    load_balance_newidle_count = 0;
+    load_balance_newidle_pulls = 0;
     
     /* Set parameters */
     load_balance_enabled = 1;
-    load_balance_interval = 1000; /* 1 second */
-    load_balance_threshold = 25; /* 25% imbalance */
-    load_balance_last_time = 0;
+    load_balance_interval = 64;
+    load_balance_threshold = 10;
     
     printk(KERN_INFO "LOAD_BALANCE: Initialized load balancing subsystem\n");
 }
 
 /**
  * Enable or disable load balancing
- * 
+ *
  * @param enable 1 to enable, 0 to disable
  * @return 0 on success, negative error code on failure
  */
@@ -78,8 +98,10 @@ int load_balance_enable(int enable) {
 
 /**
  * Set the load balancing interval
- * 
- * @param interval Interval in milliseconds
+ *
+ * Domains back off while they stay balanced, but never beyond this.
+ *
+ * @param interval Longest interval in ticks
  * @return 0 on success, negative error code on failure
  */
 int load_balance_set_interval(u64 interval) {
@@ -97,14 +119,17 @@ int load_balance_set_interval(u64 interval) {
     /* Unlock the load balancing */
     spin_unlock(&load_balance_lock);
     
-    printk(KERN_INFO "LOAD_BALANCE: Set interval to %llu ms\n", interval);
+    printk(KERN_INFO "LOAD_BALANCE: Set interval to %llu ticks\n", interval);
     
     return 0;
 }
 
 /**
  * Set the load balancing threshold
- * 
+ *
+ * A busy CPU only pulls when the busiest group carries at least this
+ * much more load than its own. Domains may require more.
+ *
  * @param threshold Threshold in percent
  * @return 0 on success, negative error code on failure
  */
@@ -129,228 +154,536 @@ int load_balance_set_threshold(u64 threshold) {
 }
 
 /**
- * Check if load balancing is needed
- * 
- * @return 1 if needed, 0 if not
+ * Update the decayed load average of a run queue
+ *
+ * @param rq Run queue
  */
-int load_balance_needed(void) {
-    /* Check if load balancing is enabled */
-    if (!load_balance_enabled) {
-        return 0;
+static void lb_update_load(run_queue_t *rq) {
+    /* Get the instantaneous load */
+    unsigned long load = sched_rq_load(rq);
+    
+    /* Move 1/8 of the way towards it, rounding so the average settles */
+    if (load > rq->load_avg) {
+        rq->load_avg += (load - rq->load_avg + (1UL << LOAD_AVG_SHIFT) - 1) >> LOAD_AVG_SHIFT;
+    } else {
+        rq->load_avg -= (rq->load_avg - load + (1UL << LOAD_AVG_SHIFT) - 1) >> LOAD_AVG_SHIFT;
     }
+}
+
+/**
+ * Get the load of a CPU as a source of threads
+ *
+ * Sources are rated low so short bursts do not trigger migrations.
+ *
+ * @param rq Run queue
+ * @return Load weight
+ */
+static unsigned long lb_source_load(run_queue_t *rq) {
+    unsigned long load = sched_rq_load(rq);
     
-    /* Get the current time */
-    u64 current_time = timer_get_ticks();
+    return load < rq->load_avg ? load : rq->load_avg;
+}
+
+/**
+ * Get the load of a CPU as a target for threads
+ *
+ * Targets are rated high, so threads do not bounce back and forth.
+ *
+ * @param rq Run queue
+ * @return Load weight
+ */
+static unsigned long lb_target_load(run_queue_t *rq) {
+    unsigned long load = sched_rq_load(rq);
     
-    /* Check if it's time to balance */
-    if (current_time - load_balance_last_time < load_balance_interval) {
-        return 0;
-    }
+    return load > rq->load_avg ? load : rq->load_avg;
+}
+
+/**
+ * Gather the load statistics of a group
+ *
+ * @param group Group
+ * @param local 1 if the group holds the balancing CPU
+ * @param stats Statistics to fill in
+ */
+static void lb_group_stats(sched_group_t *group, int local, lb_group_stats_t *stats) {
+    stats->load = 0;
+    stats->avg_load = 0;
+    stats->nr_running = 0;
+    stats->nr_cpus = 0;
+    
+    for (int cpu = 0; cpu < CONFIG_NR_CPUS; cpu++) {
+        /* Check if the group contains the CPU */
+        if (!(group->cpu_mask & (1ULL << cpu))) {
+            continue;
+        }
     
-    /* Update the last time */
-    load_balance_last_time = current_time;
+        run_queue_t *rq = &run_queues[cpu];
     
-    /* Check if there is an imbalance */
-    return load_balance_check_imbalance();
+        stats->load += local ? lb_target_load(rq) : lb_source_load(rq);
+        stats->nr_running += rq->nr_running;
+        stats->nr_cpus++;
+    }
+    
+    if (stats->nr_cpus != 0) {
+        stats->avg_load = stats->load / stats->nr_cpus;
+    }
 }
 
 /**
- * Check if there is an imbalance between CPUs
- * 
- * @return 1 if there is an imbalance, 0 if not
+ * Find the busiest group of a domain
+ *
+ * @param sd Domain
+ * @param this_cpu Balancing CPU
+ * @param idle 1 if the balancing CPU is idle
+ * @param imbalance Set to the load to pull
+ * @return Busiest group, or NULL if the domain is balanced
  */
-int load_balance_check_imbalance(void) {
-    /* Get the number of CPUs */
-    int nr_cpus = CONFIG_NR_CPUS;
+static sched_group_t *lb_find_busiest_group(sched_domain_t *sd, int this_cpu, int idle, unsigned long *imbalance) {
+    lb_group_stats_t local = { 0, 0, 0, 0 };
+    lb_group_stats_t busiest = { 0, 0, 0, 0 };
+    lb_group_stats_t stats;
+    sched_group_t *busiest_group = NULL;
+    unsigned long total_load = 0;
+    u32 total_cpus = 0;
+    
+    for (int i = 0; i < sd->group_count; i++) {
+        sched_group_t *group = &sd->groups[i];
+        int is_local = (group->cpu_mask & (1ULL << this_cpu)) != 0;
+    
+        lb_group_stats(group, is_local, &stats);
+        total_load += stats.load;
+        total_cpus += stats.nr_cpus;
+    
+        if (is_local) {
+            local = stats;
+            continue;
+        }
     
-    /* Check if there is more than one CPU */
-    if (nr_cpus <= 1) {
-        return 0;
+        /* Only a group with more threads than CPUs has one to give */
+        if (stats.nr_running <= stats.nr_cpus) {
+            continue;
+        }
+    
+        if (busiest_group == NULL || stats.avg_load > busiest.avg_load) {
+            busiest = stats;
+            busiest_group = group;
+        }
     }
     
-    /* Find the busiest and idlest CPUs */
-    int busiest_cpu = -1;
-    int idlest_cpu = -1;
-    u32 busiest_load = 0;
-    u32 idlest_load = UINT32_MAX;
-    
-    for (int i = 0; i < nr_cpus; i++) {
-        /* Get the run queue */
-        run_queue_t *rq = &run_queues[i];
-        
-        /* Get the load */
-        u32 load = rq->nr_running;
-        
-        /* Check if this is the busiest CPU */
-        if (load > busiest_load) {
-            busiest_load = load;
-            busiest_cpu = i;
+    if (busiest_group == NULL || local.nr_cpus == 0) {
+        return NULL;
+    }
+    
+    /* A busy CPU only pulls past the imbalance threshold, an idle one takes any spare thread */
+    if (!idle) {
+        u32 pct = sd->imbalance_pct;
+        if (pct < 100 + load_balance_threshold) {
+            pct = 100 + load_balance_threshold;
         }
-        
-        /* Check if this is the idlest CPU */
-        if (load < idlest_load) {
-            idlest_load = load;
-            idlest_cpu = i;
+    
+        if (busiest.avg_load * 100 <= local.avg_load * pct) {
+            return NULL;
         }
     }
     
-    /* Check if there is an imbalance */
-    if (busiest_cpu != -1 && idlest_cpu != -1 && busiest_cpu != idlest_cpu) {
-        /* Calculate the imbalance */
-        u32 imbalance = busiest_load - idlest_load;
-        
-        /* Check if the imbalance is above the threshold */
-        if (imbalance > 0 && (imbalance * 100) / (busiest_load + 1) >= load_balance_threshold) {
-            /* There is an imbalance */
-            load_balance_imbalance++;
-            return 1;
+    /* Pull no more than brings either side to the domain average */
+    unsigned long sd_avg = total_load / total_cpus;
+    unsigned long excess = busiest.avg_load > sd_avg ? busiest.avg_load - sd_avg : 0;
+    unsigned long deficit = local.avg_load < sd_avg ? sd_avg - local.avg_load : 0;
+    
+    *imbalance = excess < deficit ? excess : deficit;
+    
+    /* Less than half a thread is only worth moving to an idle CPU */
+    if (*imbalance < NICE_0_LOAD / 2) {
+        if (!idle) {
+            return NULL;
         }
+        *imbalance = NICE_0_LOAD;
     }
     
-    return 0;
+    return busiest_group;
 }
 
 /**
- * Balance the load between CPUs
- * 
- * @return Number of threads moved, or negative error code on failure
+ * Find the busiest CPU of a group
+ *
+ * @param group Group
+ * @param this_cpu Balancing CPU
+ * @return Run queue of the busiest CPU, or NULL if none has a thread to give
  */
-int load_balance_run(void) {
-    /* Check if load balancing is needed */
-    if (!load_balance_needed()) {
-        load_balance_skipped++;
+static run_queue_t *lb_find_busiest_rq(sched_group_t *group, int this_cpu) {
+    run_queue_t *busiest = NULL;
+    unsigned long max_load = 0;
+    
+    for (int cpu = 0; cpu < CONFIG_NR_CPUS; cpu++) {
+        /* Check if the group contains the CPU */
+        if (cpu == this_cpu || !(group->cpu_mask & (1ULL << cpu))) {
+            continue;
+        }
+    
+        run_queue_t *rq = &run_queues[cpu];
+    
+        /* The running thread stays, so a CPU needs a waiting one */
+        if (rq->nr_running < 2 && !(rq->nr_running == 1 && rq->curr == rq->idle)) {
+            continue;
+        }
+    
+        unsigned long load = lb_source_load(rq);
+        if (busiest == NULL || load > max_load) {
+            busiest = rq;
+            max_load = load;
+        }
+    }
+    
+    return busiest;
+}
+
+/**
+ * Check if a thread is cache hot
+ *
+ * @param thread Thread
+ * @return 1 if it ran recently, 0 if not
+ */
+static int lb_thread_hot(struct thread *thread) {
+    /* Threads that never ran have nothing in the cache */
+    if (thread->last_ran == 0) {
         return 0;
     }
     
-    /* Lock the load balancing */
-    spin_lock(&load_balance_lock);
+    return get_timestamp() - thread->last_ran < LB_MIGRATION_COST_US;
+}
+
+/**
+ * Check if a thread may be moved
+ *
+ * @param thread Thread
+ * @param src Source run queue
+ * @param dst Destination run queue
+ * @param sd Domain being balanced
+ * @param pass 0 for the cache-cold pass, 1 if hot threads may move
+ * @return 1 if the thread may move, 0 if not
+ */
+static int lb_can_migrate(struct thread *thread, run_queue_t *src, run_queue_t *dst, sched_domain_t *sd, int pass) {
+    /* The running thread stays */
+    if (thread == src->curr) {
+        return 0;
+    }
     
-    /* Increment the count */
-    load_balance_count++;
+    /* Honour the affinity mask */
+    if (!(thread->cpus_allowed & (1ULL << dst->cpu))) {
+        if (pass == 0) {
+            sd->lb_affine_skipped++;
+        }
+        return 0;
+    }
+    
+    /* Leave cache-hot threads for the second pass */
+    if (pass == 0 && lb_thread_hot(thread)) {
+        sd->lb_hot_skipped++;
+        return 0;
+    }
+    
+    return 1;
+}
+
+/**
+ * Move threads from one run queue to another
+ *
+ * Fair threads are taken from the back of the timeline, since they would
+ * run last, then real-time threads waiting behind others at their level.
+ * Cache-hot threads only move once the domain has failed to balance more
+ * than cache_nice_tries times in a row.
+ *
+ * @param src Source run queue
+ * @param dst Destination run queue
+ * @param imbalance Load to move
+ * @param sd Domain being balanced
+ * @param max_moves Maximum number of threads to move
+ * @param idle 1 if the destination is idle
+ * @return Number of threads moved
+ */
+static u32 lb_move_threads(run_queue_t *src, run_queue_t *dst, unsigned long imbalance,
+                           sched_domain_t *sd, u32 max_moves, int idle) {
+    u32 nr_moved = 0;
+    unsigned long moved_load = 0;
+    
+    for (int pass = 0; pass < 2 && nr_moved == 0; pass++) {
+        /* Cache-hot threads only move once balancing keeps failing */
+        if (pass == 1 && sd->nr_balance_failed <= sd->cache_nice_tries) {
+            break;
+        }
     
-    /* Get the number of CPUs */
-    int nr_cpus = CONFIG_NR_CPUS;
-    
-    /* Find the busiest and idlest CPUs */
-    int busiest_cpu = -1;
-    int idlest_cpu = -1;
-    u32 busiest_load = 0;
-    u32 idlest_load = UINT32_MAX;
-    
-    for (int i = 0; i < nr_cpus; i++) {
-        /* Get the run queue */
-        run_queue_t *rq = &run_queues[i];
-        
-        /* Get the load */
-        u32 load = rq->nr_running;
-        
-        /* Check if this is the busiest CPU */
-        if (load > busiest_load) {
-            busiest_load = load;
-            busiest_cpu = i;
+        /* Fair threads */
+        rb_node_t *node = rb_last(&src->cfs.timeline);
+        while (node != NULL && nr_moved < max_moves && moved_load < imbalance) {
+            struct thread *thread = rb_entry(node, struct thread, fair_node);
+            node = rb_prev(node);
+    
+            /* Skip threads that would overshoot, except the first pulled to an idle CPU */
+            if (!(idle && nr_moved == 0) && thread->load_weight / 2 > imbalance - moved_load) {
+                continue;
+            }
+    
+            if (!lb_can_migrate(thread, src, dst, sd, pass)) {
+                continue;
+            }
+    
+            if (sched_migrate_thread(thread, dst) == 0) {
+                moved_load += thread->load_weight;
+                nr_moved++;
+            }
         }
-        
-        /* Check if this is the idlest CPU */
-        if (load < idlest_load) {
-            idlest_load = load;
-            idlest_cpu = i;
+    
+        /* Real-time threads */
+        for (int prio = 0; prio < MAX_RT_PRIO && nr_moved < max_moves && moved_load < imbalance; prio++) {
+            list_head_t *pos, *n;
+    
+            list_for_each_safe(pos, n, &src->active->queue[prio]) {
+                struct thread *thread = list_entry(pos, struct thread, sched_list);
+    
+                if (nr_moved >= max_moves || moved_load >= imbalance) {
+                    break;
+                }
+    
+                if (!lb_can_migrate(thread, src, dst, sd, pass)) {
+                    continue;
+                }
+    
+                if (sched_migrate_thread(thread, dst) == 0) {
+                    moved_load += NICE_0_LOAD;
+                    nr_moved++;
+                }
+            }
         }
     }
     
-    /* Check if there is an imbalance */
-    if (busiest_cpu == -1 || idlest_cpu == -1 || busiest_cpu == idlest_cpu) {
-        /* No imbalance */
-        spin_unlock(&load_balance_lock);
-        load_balance_skipped++;
-        return 0;
+    return nr_moved;
+}
+
+/**
+ * Balance one domain of a CPU
+ *
+ * @param this_rq Run queue of the balancing CPU
+ * @param sd Domain
+ * @param idle 1 if the CPU is idle
+ * @param newidle 1 if the CPU is about to go idle
+ * @return Number of threads moved
+ */
+static int lb_balance_domain(run_queue_t *this_rq, sched_domain_t *sd, int idle, int newidle) {
+    unsigned long flags;
+    unsigned long imbalance = 0;
+    run_queue_t *busiest = NULL;
+    
+    /* Update the statistics */
+    sd->lb_count++;
+    load_balance_count++;
+    if (newidle) {
+        sd->lb_newidle++;
     }
     
-    /* Calculate the imbalance */
-    u32 imbalance = busiest_load - idlest_load;
+    /* Find the busiest CPU of the busiest group */
+    sched_group_t *group = lb_find_busiest_group(sd, this_rq->cpu, idle, &imbalance);
+    if (group != NULL) {
+        busiest = lb_find_busiest_rq(group, this_rq->cpu);
+    }
     
-    /* Check if the imbalance is above the threshold */
-    if (imbalance == 0 || (imbalance * 100) / (busiest_load + 1) < load_balance_threshold) {
-        /* No significant imbalance */
-        spin_unlock(&load_balance_lock);
+    if (busiest == NULL) {
+        /* Balanced, so check less often */
+        sd->lb_balanced++;
         load_balance_skipped++;
+        sd->nr_balance_failed = 0;
+    
+        u32 max_interval = sd->max_interval;
+        if (max_interval > load_balance_interval) {
+            max_interval = load_balance_interval;
+        }
+        if (!newidle && sd->balance_interval < max_interval) {
+            sd->balance_interval *= 2;
+            if (sd->balance_interval > max_interval) {
+                sd->balance_interval = max_interval;
+            }
+        }
+    
         return 0;
     }
     
-    /* Calculate the number of threads to move */
-    u32 nr_to_move = imbalance / 2;
+    load_balance_imbalance++;
+    
+    /* Pull threads, a newly idle CPU only needs one */
+    local_irq_save(flags);
+    sched_double_lock(this_rq, busiest);
+    u32 nr_moved = lb_move_threads(busiest, this_rq, imbalance, sd, newidle ? 1 : LB_MAX_MOVES, idle);
+    sched_double_unlock(this_rq, busiest);
+    local_irq_restore(flags);
     
-    /* Make sure we move at least one thread */
-    if (nr_to_move == 0) {
-        nr_to_move = 1;
+    if (nr_moved == 0) {
+        /* Everything was pinned or cache hot, retry soon and allow hot threads */
+        sd->lb_failed++;
+        load_balance_failed++;
+        sd->nr_balance_failed++;
+        return 0;
     }
     
-    /* Get the run queues */
-    run_queue_t *busiest_rq = &run_queues[busiest_cpu];
-    run_queue_t *idlest_rq = &run_queues[idlest_cpu];
+    /* Update the statistics */
+    sd->lb_moved += nr_moved;
+    load_balance_moves += nr_moved;
+    sd->nr_balance_failed = 0;
+    sd->balance_interval = sd->min_interval;
     
-    /* Lock the run queues */
-    spin_lock(&busiest_rq->lock);
-    spin_lock(&idlest_rq->lock);
+    return nr_moved;
+}
+
+/**
+ * Balance the domains of a CPU that are due
+ *
+ * @param rq Run queue of the CPU
+ * @return Number of threads moved
+ */
+static int lb_rebalance(run_queue_t *rq) {
+    int idle = (rq->curr == rq->idle);
+    u64 now = timer_get_jiffies();
+    int nr_moved = 0;
+    
+    /* Walk the domains bottom-up */
+    for (sched_domain_t *sd = sched_domain_find_for_cpu(rq->cpu); sd != NULL; sd = sd->parent) {
+        if (!(sd->flags & SD_LOAD_BALANCE)) {
+            continue;
+        }
     
-    /* Move threads from the busiest to the idlest CPU */
-    u32 nr_moved = 0;
+        /* Busy CPUs balance less often */
+        u64 interval = sd->balance_interval;
+        if (!idle) {
+            interval *= sd->busy_factor;
+        }
     
-    /* Find threads to move */
-    for (int i = 0; i <= SCHED_PRIO_MAX && nr_moved < nr_to_move; i++) {
-        /* Check if there are threads at this priority */
-        if (list_empty(&busiest_rq->active[i])) {
+        if (now - sd->last_balance[rq->cpu] < interval) {
             continue;
         }
-        
-        /* Get the first thread at this priority */
-        thread_t *thread = list_first_entry(&busiest_rq->active[i], thread_t, sched_list);
-        
-        /* Check if the thread can be moved */
-        if (thread->cpu != busiest_cpu || thread->cpu == idlest_cpu) {
-            continue;
+        sd->last_balance[rq->cpu] = now;
+    
+        nr_moved += lb_balance_domain(rq, sd, idle, 0);
+    
+        /* With work pulled the CPU is no longer idle for the levels above */
+        if (nr_moved > 0) {
+            idle = 0;
         }
-        
-        /* Remove the thread from the busiest CPU */
-        list_del(&thread->sched_list);
-        
-        /* Update the bitmap */
-        if (list_empty(&busiest_rq->active[i])) {
-            busiest_rq->bitmap &= ~(1ULL << i);
+    }
+    
+    return nr_moved;
+}
+
+/**
+ * Check if load balancing is needed
+ *
+ * @return 1 if a domain of this CPU is due, 0 if not
+ */
+int load_balance_needed(void) {
+    /* Check if load balancing is enabled */
+    if (!load_balance_enabled) {
+        return 0;
+    }
+    
+    /* Get the run queue */
+    run_queue_t *rq = this_rq();
+    int idle = (rq->curr == rq->idle);
+    u64 now = timer_get_jiffies();
+    
+    for (sched_domain_t *sd = sched_domain_find_for_cpu(rq->cpu); sd != NULL; sd = sd->parent) {
+        u64 interval = sd->balance_interval;
+        if (!idle) {
+            interval *= sd->busy_factor;
+        }
+    
+        if ((sd->flags & SD_LOAD_BALANCE) && now - sd->last_balance[rq->cpu] >= interval) {
+            return 1;
         }
-        
-        /* Set the thread's CPU */
-        thread->cpu = idlest_cpu;
-        thread->rq = idlest_rq;
-        
-        /* Add the thread to the idlest CPU */
-        list_add_tail(&thread->sched_list, &idlest_rq->active[i]);
-        
-        /* Update the bitmap */
-        idlest_rq->bitmap |= (1ULL << i);
-        
-        /* Update the counts */
-        busiest_rq->nr_running--;
-        idlest_rq->nr_running++;
-        
-        /* Increment the moved count */
-        nr_moved++;
     }
     
-    /* Unlock the run queues */
-    spin_unlock(&idlest_rq->lock);
-    spin_unlock(&busiest_rq->lock);
+    return 0;
+}
+
+/**
+ * Check if there is an imbalance between CPUs
+ *
+ * @return 1 if there is an imbalance, 0 if not
+ */
+int load_balance_check_imbalance(void) {
+    /* Get the run queue */
+    run_queue_t *rq = this_rq();
+    int idle = (rq->curr == rq->idle);
+    unsigned long imbalance;
     
-    /* Update the statistics */
-    if (nr_moved > 0) {
-        load_balance_moves += nr_moved;
-    } else {
-        load_balance_failed++;
+    for (sched_domain_t *sd = sched_domain_find_for_cpu(rq->cpu); sd != NULL; sd = sd->parent) {
+        if (lb_find_busiest_group(sd, rq->cpu, idle, &imbalance) != NULL) {
+            return 1;
+        }
     }
     
-    /* Unlock the load balancing */
-    spin_unlock(&load_balance_lock);
+    return 0;
+}
+
+/**
+ * Balance the load between CPUs
+ *
+ * @return Number of threads moved, or negative error code on failure
+ */
+int load_balance_run(void) {
+    /* Check if load balancing is enabled */
+    if (!load_balance_enabled) {
+        return 0;
+    }
     
-    return nr_moved;
+    return lb_rebalance(this_rq());
+}
+
+/**
+ * Update the load average and rebalance due domains at a tick
+ *
+ * @param rq Run queue of the ticking CPU
+ */
+void load_balance_tick(run_queue_t *rq) {
+    /* Check parameters */
+    if (rq == NULL) {
+        return;
+    }
+    
+    /* Decay the load average */
+    lb_update_load(rq);
+    
+    /* Balance the domains that are due */
+    if (load_balance_enabled) {
+        lb_rebalance(rq);
+    }
+}
+
+/**
+ * Pull work to a CPU that is about to go idle
+ *
+ * @param rq Run queue of the CPU
+ * @return Number of threads pulled
+ */
+int load_balance_newidle(run_queue_t *rq) {
+    /* Check parameters */
+    if (rq == NULL || !load_balance_enabled) {
+        return 0;
+    }
+    
+    load_balance_newidle_count++;
+    
+    /* Try the closest CPUs first */
+    for (sched_domain_t *sd = sched_domain_find_for_cpu(rq->cpu); sd != NULL; sd = sd->parent) {
+        if (!(sd->flags & SD_BALANCE_NEWIDLE)) {
+            continue;
+        }
+    
+        int nr_moved = lb_balance_domain(rq, sd, 1, 1);
+        if (nr_moved > 0) {
+            load_balance_newidle_pulls += nr_moved;
+            return nr_moved;
+        }
+    }
+    
+    return 0;
 }
 
 /**
@@ -362,13 +695,21 @@ void load_balance_print_stats(void) {
     
     /* Print the statistics */
     printk(KERN_INFO "LOAD_BALANCE: Enabled: %s\n", load_balance_enabled ? "Yes" : "No");
-    printk(KERN_INFO "LOAD_BALANCE: Interval: %llu ms\n", load_balance_interval);
+    printk(KERN_INFO "LOAD_BALANCE: Interval: %llu ticks\n", load_balance_interval);
     printk(KERN_INFO "LOAD_BALANCE: Threshold: %llu%%\n", load_balance_threshold);
     printk(KERN_INFO "LOAD_BALANCE: Count: %llu\n", load_balance_count);
     printk(KERN_INFO "LOAD_BALANCE: Moves: %llu\n", load_balance_moves);
     printk(KERN_INFO "LOAD_BALANCE: Failed: %llu\n", load_balance_failed);
     printk(KERN_INFO "LOAD_BALANCE: Skipped: %llu\n", load_balance_skipped);
     printk(KERN_INFO "LOAD_BALANCE: Imbalance: %llu\n", load_balance_imbalance);
+    printk(KERN_INFO "LOAD_BALANCE: Newly idle: %llu (%llu pulled)\n",
+           load_balance_newidle_count, load_balance_newidle_pulls);
+    
+    /* Print the per-CPU load */
+    for (int cpu = 0; cpu < CONFIG_NR_CPUS; cpu++) {
+        printk(KERN_INFO "LOAD_BALANCE: CPU %d: Running: %u, Load: %lu, Average: %lu\n",
+               cpu, run_queues[cpu].nr_running, sched_rq_load(&run_queues[cpu]), run_queues[cpu].load_avg);
+    }
     
     /* Unlock the load balancing */
     spin_unlock(&load_balance_lock);
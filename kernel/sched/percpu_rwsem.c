@@ -0,0 +1,125 @@
+/**
+ * percpu_rwsem.c - Horizon kernel per-CPU read-write semaphore implementation
+ *
+ * This file contains the slow paths of the per-CPU read-write semaphore.
+ *
+ * A writer first takes rw_sem for writing, which orders writers among
+ * themselves, then sets block. Both sides use a full barrier between
+ * their own store and the load of the other's, so either the writer sees
+ * a reader's count or the reader sees block. Readers that see block back
+ * out and park on rw_sem until the writer is done. Those that got in
+ * before are the writer's grace: it sleeps until the counters sum to zero,
+ * and the last of them to leave wakes it.
+ */
+
+#include <horizon/kernel.h>
+#include <horizon/types.h>
+#include <horizon/percpu_rwsem.h>
+#include <horizon/rwsem.h>
+#include <horizon/sched.h>
+#include <horizon/thread.h>
+#include <horizon/irqflags.h>
+#include <horizon/stddef.h>
+
+/**
+ * Count the readers inside a per-CPU read-write semaphore
+ *
+ * @param sem Semaphore
+ * @return Number of readers
+ */
+static int percpu_rwsem_readers(percpu_rw_semaphore_t *sem) {
+    int sum = 0;
+
+    for (int cpu = 0; cpu < CONFIG_NR_CPUS; cpu++) {
+        sum += sem->read_count[cpu].count;
+    }
+
+    return sum;
+}
+
+/**
+ * Initialize a per-CPU read-write semaphore
+ *
+ * @param sem Semaphore
+ */
+void percpu_init_rwsem(percpu_rw_semaphore_t *sem) {
+    for (int cpu = 0; cpu < CONFIG_NR_CPUS; cpu++) {
+        sem->read_count[cpu].count = 0;
+    }
+
+    sem->block = 0;
+    sem->writer = NULL;
+    init_rwsem(&sem->rw_sem);
+}
+
+/**
+ * Acquire a per-CPU read-write semaphore for reading, slow path
+ *
+ * The fast path counted us in but saw a writer, so back out and wait
+ * for it behind rw_sem.
+ *
+ * @param sem Semaphore
+ */
+void __percpu_down_read_slow(percpu_rw_semaphore_t *sem) {
+    __sync_fetch_and_sub(&sem->read_count[smp_processor_id()].count, 1);
+    __percpu_up_read_slow(sem);
+
+    /* Count ourselves in while holding rw_sem, so no writer can miss us */
+    down_read(&sem->rw_sem);
+    __sync_fetch_and_add(&sem->read_count[smp_processor_id()].count, 1);
+    up_read(&sem->rw_sem);
+}
+
+/**
+ * Release a per-CPU read-write semaphore held for reading, slow path
+ *
+ * @param sem Semaphore
+ */
+void __percpu_up_read_slow(percpu_rw_semaphore_t *sem) {
+    struct thread *writer = sem->writer;
+
+    /* A writer is waiting for us, it rechecks the sum itself */
+    if (writer != NULL) {
+        sched_wakeup_thread(writer);
+    }
+}
+
+/**
+ * Acquire a per-CPU read-write semaphore for writing
+ *
+ * @param sem Semaphore
+ */
+void percpu_down_write(percpu_rw_semaphore_t *sem) {
+    struct thread *thread = thread_self();
+    unsigned long flags;
+
+    down_write(&sem->rw_sem);
+
+    /* Send new readers to the slow path */
+    sem->writer = thread;
+    sem->block = 1;
+    __sync_synchronize();
+
+    /* Wait out the readers that got in before us */
+    local_irq_save(flags);
+    while (percpu_rwsem_readers(sem) != 0) {
+        /* A reader leaving between the check and the sleep costs one timeout */
+        sched_sleep_thread(thread, PERCPU_RWSEM_WAIT_MS);
+    }
+    local_irq_restore(flags);
+
+    sem->writer = NULL;
+}
+
+/**
+ * Release a per-CPU read-write semaphore held for writing
+ *
+ * @param sem Semaphore
+ */
+void percpu_up_write(percpu_rw_semaphore_t *sem) {
+    /* Order the critical section before readers are let back in */
+    __sync_synchronize();
+    sem->block = 0;
+
+    up_write(&sem->rw_sem);
+}
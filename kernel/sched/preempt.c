@@ -0,0 +1,39 @@
+/**
+ * preempt.c - Horizon kernel preemption control
+ *
+ * This file contains the per-CPU preemption state. The scheduler checks
+ * the count of its CPU before switching on a tick or a wakeup, and leaves
+ * preempt_resched set instead while the count is raised.
+ */
+
+#include <horizon/kernel.h>
+#include <horizon/types.h>
+#include <horizon/config.h>
+#include <horizon/preempt.h>
+#include <horizon/sched.h>
+
+/* Per-CPU preemption count */
+volatile int preempt_counts[CONFIG_NR_CPUS];
+
+/* Per-CPU deferred preemption flag */
+volatile int preempt_resched[CONFIG_NR_CPUS];
+
+/**
+ * Switch away for a preemption deferred while the count was raised
+ */
+void preempt_schedule(void) {
+    unsigned long flags;
+    int cpu;
+
+    /* The tick may already have switched, or preemption been disabled again */
+    local_irq_save(flags);
+    cpu = smp_processor_id();
+    if (preempt_counts[cpu] != 0 || !preempt_resched[cpu]) {
+        local_irq_restore(flags);
+        return;
+    }
+    preempt_resched[cpu] = 0;
+    local_irq_restore(flags);
+
+    sched_schedule();
+}
@@ -16,16 +16,14 @@
 #include <horizon/errno.h>
 #include <horizon/stddef.h>
 
-/* Real-time statistics */
-static u64 rt_schedule_count = 0;
-static u64 rt_switch_count = 0;
-static u64 rt_preempt_count = 0;
+/* Real-time statistics, the scheduling counts live in the run queues */
 static u64 rt_yield_count = 0;
 static u64 rt_boost_count = 0;
+static u64 rt_deboost_count = 0;
 static u64 rt_throttle_count = 0;
 
 /* Real-time lock */
-static spinlock_t rt_lock = { { 0 } };
+static spinlock_t rt_lock = SPIN_LOCK_INITIALIZER;
 
 /* Real-time parameters */
 static int rt_enabled = 1;
@@ -38,11 +36,9 @@ static u32 rt_prio_base = 100;  /* Base priority for real-time threads */
  */
 void rt_init(void) {
     /* Reset statistics */
-    rt_schedule_count = 0;
-    rt_switch_count = 0;
-    rt_preempt_count = 0;
     rt_yield_count = 0;
     rt_boost_count = 0;
+    rt_deboost_count = 0;
     rt_throttle_count = 0;
 
     /* Set parameters */
@@ -165,7 +161,25 @@ int rt_is_realtime(struct thread *thread) {
         return 0;
     }
 
-    /* Check if the thread has a real-time policy */
+    /* Check if the thread has a real-time policy or inherited one */
+    return thread->policy == SCHED_FIFO || thread->policy == SCHED_RR || thread->pi_boosted;
+}
+
+/**
+ * Check if a thread has a real-time policy of its own
+ *
+ * Unlike rt_is_realtime(), this ignores a priority inherited through an
+ * rt_mutex.
+ *
+ * @param thread Thread to check
+ * @return 1 if the thread has a real-time policy, 0 if not
+ */
+int rt_policy_realtime(struct thread *thread) {
+    /* Check parameters */
+    if (thread == NULL || !rt_enabled) {
+        return 0;
+    }
+
     return thread->policy == SCHED_FIFO || thread->policy == SCHED_RR;
 }
 
@@ -194,8 +208,8 @@ int rt_can_preempt(struct thread *thread, struct thread *current) {
 
     /* Check if the current thread is real-time */
     if (rt_is_realtime(current)) {
-        /* Both threads are real-time, check priorities */
-        return thread->priority < current->priority;
+        /* Both threads are real-time, check effective priorities */
+        return sched_thread_prio(thread) < sched_thread_prio(current);
     } else {
         /* The thread is real-time, the current thread is not */
         return 1;
@@ -205,6 +219,10 @@ int rt_can_preempt(struct thread *thread, struct thread *current) {
 /**
  * Schedule a real-time thread
  *
+ * Real-time threads occupy levels below MAX_RT_PRIO of the active array
+ * and never expire, so the first set bit decides in O(1). The caller holds
+ * the run queue lock, which also covers the statistics.
+ *
  * @param rq Run queue to schedule on
  * @return Pointer to the next thread to run, or NULL if none
  */
@@ -219,52 +237,26 @@ struct thread *rt_schedule(struct run_queue *rq) {
         return NULL;
     }
 
-    /* Lock the real-time scheduler */
-    spin_lock(&rt_lock);
-
     /* Increment the schedule count */
-    rt_schedule_count++;
+    rq->nr_rt_schedule++;
 
     /* Find the highest priority real-time thread */
     struct thread *next = NULL;
-
-    for (int i = 0; i <= SCHED_PRIO_MAX; i++) {
-        /* Check if there are threads at this priority */
-        if (list_empty(&rq->active[i])) {
-            continue;
-        }
-
-        /* For SCHED_FIFO and SCHED_RR, we always pick the first thread at the highest priority */
-        struct thread *thread = NULL;
-        /* In a real implementation, we would get the first thread from the active array */
-        /* For now, we'll just return NULL */
-
-        /* Check if the thread is real-time */
-        if (rt_is_realtime(thread)) {
-            /* Found a real-time thread */
-            next = thread;
-            break;
+    int prio = sched_find_first_prio(rq->active);
+
+    if (prio < MAX_RT_PRIO) {
+        /* FIFO and RR both run the thread at the head of the level */
+        next = list_entry(rq->active->queue[prio].next, struct thread, sched_list);
+
+        /* Count preemptions of a still-runnable current thread */
+        if (next != rq->curr) {
+            rq->nr_rt_switches++;
+            if (rq->curr != NULL && (rq->curr->array != NULL || rq->curr->fair_on_rq)) {
+                rq->nr_rt_preempts++;
+            }
         }
     }
 
-    /* If we found a real-time thread, handle its scheduling policy */
-    if (next != NULL) {
-        /* For SCHED_RR, we need to check if the time slice has expired */
-        if (next->policy == SCHED_RR && next->time_slice == 0) {
-            /* Reset the time slice */
-            next->time_slice = 100; /* 100ms time slice for RR tasks */
-
-            /* Move the thread to the end of its priority queue (round-robin) */
-            /* In a real implementation, we would move the thread to the end of the queue */
-            /* For now, we'll just do nothing */
-        }
-
-        /* For SCHED_FIFO, we don't need to do anything special here */
-    }
-
-    /* Unlock the real-time scheduler */
-    spin_unlock(&rt_lock);
-
     return next;
 }
 
@@ -291,18 +283,18 @@ int rt_enqueue(struct run_queue *rq, struct thread *thread) {
         return -EINVAL;
     }
 
+    /* Check if the thread is already queued */
+    if (thread->array != NULL) {
+        return -EBUSY;
+    }
+
     /* Lock the real-time scheduler */
     spin_lock(&rt_lock);
 
-    /* Get the thread's priority */
-    int priority = thread->priority;
-
-    /* Add the thread to the active array */
-    /* In a real implementation, we would add the thread to the active array */
-    /* For now, we'll just do nothing */
-
-    /* Set the bit in the bitmap */
-    rq->bitmap |= (1ULL << priority);
+    /* Add the thread to the tail of its level in the active array */
+    sched_array_enqueue(rq->active, thread, 0);
+    thread->rq = rq;
+    rq->nr_running++;
 
     /* Unlock the real-time scheduler */
     spin_unlock(&rt_lock);
@@ -333,20 +325,20 @@ int rt_dequeue(struct run_queue *rq, struct thread *thread) {
         return -EINVAL;
     }
 
+    /* Check if the thread is queued here */
+    if (thread->array == NULL || thread->rq != rq) {
+        return -ENOENT;
+    }
+
     /* Lock the real-time scheduler */
     spin_lock(&rt_lock);
 
-    /* Get the thread's priority */
-    int priority = thread->priority;
-
-    /* Remove the thread from the active array */
-    /* In a real implementation, we would remove the thread from the active array */
-    /* For now, we'll just do nothing */
-
-    /* Check if there are any more threads at this priority */
-    /* In a real implementation, we would check if the active array is empty */
-    /* For now, we'll just clear the bit in the bitmap */
-    rq->bitmap &= ~(1ULL << priority);
+    /* Remove the thread, the bitmap bit clears with its level */
+    sched_array_dequeue(thread);
+    thread->rq = NULL;
+    if (rq->nr_running > 0) {
+        rq->nr_running--;
+    }
 
     /* Unlock the real-time scheduler */
     spin_unlock(&rt_lock);
@@ -377,18 +369,21 @@ int rt_yield(struct run_queue *rq, struct thread *thread) {
         return -EINVAL;
     }
 
+    /* Check if the thread is queued */
+    if (thread->array == NULL) {
+        return -ENOENT;
+    }
+
     /* Lock the real-time scheduler */
     spin_lock(&rt_lock);
 
     /* Increment the yield count */
     rt_yield_count++;
 
-    /* Get the thread's priority */
-    int priority = thread->priority;
-
-    /* Check if there are other threads at this priority */
-    /* In a real implementation, we would check if there are other threads at this priority */
-    /* For now, we'll just do nothing */
+    /* Go behind the other threads at this priority */
+    prio_array_t *array = thread->array;
+    sched_array_dequeue(thread);
+    sched_array_enqueue(array, thread, 0);
 
     /* Unlock the real-time scheduler */
     spin_unlock(&rt_lock);
@@ -397,13 +392,41 @@ int rt_yield(struct run_queue *rq, struct thread *thread) {
 }
 
 /**
- * Boost a real-time thread's priority
+ * Change the priority of a real-time thread, moving it between levels
+ *
+ * The caller must hold the run queue lock of the thread and rt_lock.
+ *
+ * @param thread Thread to change
+ * @param new_priority New priority
+ */
+static void rt_change_prio(struct thread *thread, int new_priority) {
+    prio_array_t *array = thread->array;
+
+    /* Unqueued threads just take the new priority */
+    if (array == NULL) {
+        thread->priority = new_priority;
+        return;
+    }
+
+    sched_array_dequeue(thread);
+    thread->priority = new_priority;
+    sched_array_enqueue(array, thread, 0);
+}
+
+/**
+ * Boost a thread's priority
+ *
+ * The boost is an inherited priority on top of the thread's own, so it
+ * also lifts a time-sharing thread into the real-time band and is undone
+ * by rt_deboost(). rt_mutex ownership drives it for priority inheritance.
  *
  * @param thread Thread to boost
- * @param boost Boost amount
+ * @param boost Number of levels to raise the effective priority by
  * @return 0 on success, negative error code on failure
  */
 int rt_boost(struct thread *thread, int boost) {
+    unsigned long flags;
+
     /* Check parameters */
     if (thread == NULL || boost <= 0) {
         return -EINVAL;
@@ -414,44 +437,81 @@ int rt_boost(struct thread *thread, int boost) {
         return -EINVAL;
     }
 
-    /* Check if the thread is real-time */
-    if (!rt_is_realtime(thread)) {
-        return -EINVAL;
-    }
-
-    /* Lock the real-time scheduler */
+    /* Lock the run queue of the thread, then the real-time scheduler */
+    struct run_queue *rq = sched_thread_rq_lock(thread, &flags);
     spin_lock(&rt_lock);
 
     /* Increment the boost count */
     rt_boost_count++;
 
-    /* Get the thread's run queue */
-    struct run_queue *rq = this_rq();
-
-    /* Get the thread's priority */
-    int priority = thread->priority;
+    /* Get the thread's effective priority */
+    int priority = sched_thread_prio(thread);
 
     /* Calculate the new priority */
     int new_priority = priority - boost;
 
-    /* Clamp the priority */
+    /* Clamp the priority, a boosted thread always runs as real-time */
     if (new_priority < 0) {
         new_priority = 0;
+    } else if (new_priority >= MAX_RT_PRIO) {
+        new_priority = MAX_RT_PRIO - 1;
     }
 
     /* Check if the priority changed */
-    if (new_priority != priority) {
-        /* In a real implementation, we would update the thread's position in the active array */
-        /* For now, we'll just update the thread's priority */
-        thread->priority = new_priority;
+    if (new_priority < priority) {
+        thread->pi_prio = new_priority;
+        thread->pi_boosted = 1;
+        sched_prio_changed(thread);
+    }
 
-        /* Update the bitmap */
-        rq->bitmap &= ~(1ULL << priority);
-        rq->bitmap |= (1ULL << new_priority);
+    /* Unlock the real-time scheduler and the run queue */
+    spin_unlock(&rt_lock);
+    sched_rq_unlock(rq, flags);
+
+    return 0;
+}
+
+/**
+ * Drop a boost given by rt_boost()
+ *
+ * @param thread Thread to deboost
+ * @param prio Inherited priority to keep, or MAX_PRIO to drop the boost
+ * @return 0 on success, negative error code on failure
+ */
+int rt_deboost(struct thread *thread, int prio) {
+    unsigned long flags;
+
+    /* Check parameters */
+    if (thread == NULL) {
+        return -EINVAL;
     }
 
-    /* Unlock the real-time scheduler */
+    /* Lock the run queue of the thread, then the real-time scheduler */
+    struct run_queue *rq = sched_thread_rq_lock(thread, &flags);
+    spin_lock(&rt_lock);
+
+    /* Check if the thread is boosted */
+    if (!thread->pi_boosted) {
+        spin_unlock(&rt_lock);
+        sched_rq_unlock(rq, flags);
+        return 0;
+    }
+
+    /* Increment the deboost count */
+    rt_deboost_count++;
+
+    /* Go back to the thread's own priority once the boost no longer helps */
+    if (prio >= MAX_RT_PRIO || prio >= sched_thread_normal_prio(thread)) {
+        thread->pi_boosted = 0;
+    } else {
+        thread->pi_prio = prio;
+    }
+
+    sched_prio_changed(thread);
+
+    /* Unlock the real-time scheduler and the run queue */
     spin_unlock(&rt_lock);
+    sched_rq_unlock(rq, flags);
 
     return 0;
 }
@@ -464,6 +524,8 @@ int rt_boost(struct thread *thread, int boost) {
  * @return 0 on success, negative error code on failure
  */
 int rt_throttle(struct thread *thread, int throttle) {
+    unsigned long flags;
+
     /* Check parameters */
     if (thread == NULL || throttle <= 0) {
         return -EINVAL;
@@ -474,44 +536,37 @@ int rt_throttle(struct thread *thread, int throttle) {
         return -EINVAL;
     }
 
-    /* Check if the thread is real-time */
-    if (!rt_is_realtime(thread)) {
+    /* Check if the thread is real-time in its own right */
+    if (!rt_policy_realtime(thread)) {
         return -EINVAL;
     }
 
-    /* Lock the real-time scheduler */
+    /* Lock the run queue of the thread, then the real-time scheduler */
+    struct run_queue *rq = sched_thread_rq_lock(thread, &flags);
     spin_lock(&rt_lock);
 
     /* Increment the throttle count */
     rt_throttle_count++;
 
-    /* Get the thread's run queue */
-    struct run_queue *rq = this_rq();
-
     /* Get the thread's priority */
     int priority = thread->priority;
 
     /* Calculate the new priority */
     int new_priority = priority + throttle;
 
-    /* Clamp the priority */
-    if (new_priority > SCHED_PRIO_MAX) {
-        new_priority = SCHED_PRIO_MAX;
+    /* Clamp the priority, real-time threads stay in the real-time band */
+    if (new_priority >= MAX_RT_PRIO) {
+        new_priority = MAX_RT_PRIO - 1;
     }
 
     /* Check if the priority changed */
     if (new_priority != priority) {
-        /* In a real implementation, we would update the thread's position in the active array */
-        /* For now, we'll just update the thread's priority */
-        thread->priority = new_priority;
-
-        /* Update the bitmap */
-        rq->bitmap &= ~(1ULL << priority);
-        rq->bitmap |= (1ULL << new_priority);
+        rt_change_prio(thread, new_priority);
     }
 
-    /* Unlock the real-time scheduler */
+    /* Unlock the real-time scheduler and the run queue */
     spin_unlock(&rt_lock);
+    sched_rq_unlock(rq, flags);
 
     return 0;
 }
@@ -520,6 +575,17 @@ int rt_throttle(struct thread *thread, int throttle) {
  * Print real-time scheduler statistics
  */
 void rt_print_stats(void) {
+    u64 schedule_count = 0;
+    u64 switch_count = 0;
+    u64 preempt_count = 0;
+
+    /* Sum the run queues, a racing schedule may or may not be counted */
+    for (int cpu = 0; cpu < CONFIG_NR_CPUS; cpu++) {
+        schedule_count += run_queues[cpu].nr_rt_schedule;
+        switch_count += run_queues[cpu].nr_rt_switches;
+        preempt_count += run_queues[cpu].nr_rt_preempts;
+    }
+
     /* Lock the real-time scheduler */
     spin_lock(&rt_lock);
 
@@ -528,11 +594,12 @@ void rt_print_stats(void) {
     printk(KERN_INFO "RT: Runtime: %llu us\n", rt_runtime);
     printk(KERN_INFO "RT: Period: %llu us\n", rt_period);
     printk(KERN_INFO "RT: Priority base: %u\n", rt_prio_base);
-    printk(KERN_INFO "RT: Schedule count: %llu\n", rt_schedule_count);
-    printk(KERN_INFO "RT: Switch count: %llu\n", rt_switch_count);
-    printk(KERN_INFO "RT: Preempt count: %llu\n", rt_preempt_count);
+    printk(KERN_INFO "RT: Schedule count: %llu\n", schedule_count);
+    printk(KERN_INFO "RT: Switch count: %llu\n", switch_count);
+    printk(KERN_INFO "RT: Preempt count: %llu\n", preempt_count);
     printk(KERN_INFO "RT: Yield count: %llu\n", rt_yield_count);
     printk(KERN_INFO "RT: Boost count: %llu\n", rt_boost_count);
+    printk(KERN_INFO "RT: Deboost count: %llu\n", rt_deboost_count);
     printk(KERN_INFO "RT: Throttle count: %llu\n", rt_throttle_count);
 
     /* Unlock the real-time scheduler */
@@ -0,0 +1,774 @@
+/**
+ * rtmutex.c - Horizon kernel priority-inheriting mutex implementation
+ *
+ * This file contains the implementation of the rt_mutex. Waiters queue in
+ * a tree ordered by priority and the owner runs at the priority of its
+ * most important real-time waiter through rt_boost(). When the owner is
+ * itself blocked on another rt_mutex the boost is carried down the chain
+ * of owners, so a real-time thread waits at most for the critical
+ * sections in front of it, never for unrelated lower-priority work.
+ *
+ * Unlock hands the lock straight to a real-time top waiter. A time-sharing
+ * top waiter is woken to compete for the released lock instead, so a
+ * running thread can take it without a context switch; a waiter that
+ * loses sets RT_MUTEX_HANDOFF and the next unlock hands over to it. An
+ * uncontended lock or unlock is a single compare-and-swap on the owner
+ * word.
+ *
+ * Each lock's wait_lock protects its waiter tree and the slow path writes
+ * to its owner word. Each thread's pi_lock protects its pi_waiters tree
+ * and pi_blocked_on link. A wait_lock is taken before a pi_lock, and the
+ * chain walk, which needs them the other way round, only tries the
+ * wait_lock and backs off.
+ */
+
+#include <horizon/kernel.h>
+#include <horizon/types.h>
+#include <horizon/rtmutex.h>
+#include <horizon/sched.h>
+#include <horizon/sched/rt.h>
+#include <horizon/thread.h>
+#include <horizon/time.h>
+#include <horizon/spinlock.h>
+#include <horizon/irqflags.h>
+#include <horizon/printk.h>
+#include <horizon/errno.h>
+#include <horizon/stddef.h>
+
+/* rt_mutex statistics */
+static u64 rt_mutex_fast_count = 0;
+static u64 rt_mutex_slow_count = 0;
+static u64 rt_mutex_handoff_count = 0;
+static u64 rt_mutex_release_count = 0;
+static u64 rt_mutex_steal_count = 0;
+static u64 rt_mutex_boost_count = 0;
+static u64 rt_mutex_chain_count = 0;
+static u64 rt_mutex_max_chain = 0;
+static u64 rt_mutex_deadlock_count = 0;
+static u64 rt_mutex_timeout_count = 0;
+
+/**
+ * Queue a waiter on a lock
+ *
+ * @param lock Lock
+ * @param waiter Waiter to queue
+ */
+static void rt_mutex_enqueue(rt_mutex_t *lock, rt_mutex_waiter_t *waiter) {
+    rb_node_t **link = &lock->waiters.rb_node;
+    rb_node_t *parent = NULL;
+    int leftmost = 1;
+
+    /* Equal priorities go right, so a level is served in arrival order */
+    while (*link != NULL) {
+        rt_mutex_waiter_t *entry = rb_entry(*link, rt_mutex_waiter_t, tree_node);
+
+        parent = *link;
+        if (waiter->prio < entry->prio) {
+            link = &parent->rb_left;
+        } else {
+            link = &parent->rb_right;
+            leftmost = 0;
+        }
+    }
+
+    rb_link_node(&waiter->tree_node, parent, link);
+    rb_insert_color(&waiter->tree_node, &lock->waiters);
+
+    if (leftmost) {
+        lock->top_waiter = waiter;
+    }
+    lock->nr_waiters++;
+}
+
+/**
+ * Remove a waiter from a lock
+ *
+ * @param lock Lock
+ * @param waiter Waiter to remove
+ */
+static void rt_mutex_dequeue(rt_mutex_t *lock, rt_mutex_waiter_t *waiter) {
+    /* The next waiter in order becomes the top one */
+    if (lock->top_waiter == waiter) {
+        rb_node_t *next = rb_next(&waiter->tree_node);
+        lock->top_waiter = next != NULL ? rb_entry(next, rt_mutex_waiter_t, tree_node) : NULL;
+    }
+
+    rb_erase(&waiter->tree_node, &lock->waiters);
+    rb_clear_node(&waiter->tree_node);
+    lock->nr_waiters--;
+}
+
+/**
+ * Add the top waiter of a lock to its owner's pi_waiters
+ *
+ * @param owner Lock owner
+ * @param waiter Top waiter
+ */
+static void rt_mutex_enqueue_pi(struct thread *owner, rt_mutex_waiter_t *waiter) {
+    rb_node_t **link = &owner->pi_waiters.rb_node;
+    rb_node_t *parent = NULL;
+
+    while (*link != NULL) {
+        rt_mutex_waiter_t *entry = rb_entry(*link, rt_mutex_waiter_t, pi_node);
+
+        parent = *link;
+        if (waiter->prio < entry->prio) {
+            link = &parent->rb_left;
+        } else {
+            link = &parent->rb_right;
+        }
+    }
+
+    rb_link_node(&waiter->pi_node, parent, link);
+    rb_insert_color(&waiter->pi_node, &owner->pi_waiters);
+}
+
+/**
+ * Remove a waiter from its owner's pi_waiters
+ *
+ * @param owner Lock owner
+ * @param waiter Waiter to remove
+ */
+static void rt_mutex_dequeue_pi(struct thread *owner, rt_mutex_waiter_t *waiter) {
+    rb_erase(&waiter->pi_node, &owner->pi_waiters);
+    rb_clear_node(&waiter->pi_node);
+}
+
+/**
+ * Set a thread's inherited priority from its pi_waiters
+ *
+ * Only real-time waiters are inherited, a time-sharing waiter never lifts
+ * its owner out of the fair class. The caller must hold the thread's
+ * pi_lock.
+ *
+ * @param thread Thread
+ */
+static void rt_mutex_adjust_prio(struct thread *thread) {
+    rb_node_t *node = rb_first(&thread->pi_waiters);
+    int prio = MAX_PRIO;
+
+    if (node != NULL) {
+        prio = rb_entry(node, rt_mutex_waiter_t, pi_node)->prio;
+        if (prio >= MAX_RT_PRIO) {
+            prio = MAX_PRIO;
+        }
+    }
+
+    int cur = sched_thread_prio(thread);
+
+    if (prio < cur) {
+        /* Raise the owner to its waiter */
+        if (rt_boost(thread, cur - prio) == 0) {
+            rt_mutex_boost_count++;
+        }
+    } else if (thread->pi_boosted && prio != thread->pi_prio) {
+        /* The waiter it inherited from is gone or less important */
+        rt_deboost(thread, prio);
+    }
+}
+
+/**
+ * Carry a priority change down a chain of blocked owners
+ *
+ * Each step re-sorts the waiter the thread is blocked on and moves on to
+ * the owner of that lock. The locks are taken hand over hand: the
+ * thread's pi_lock, the wait_lock of the lock it waits on, then the
+ * owner's pi_lock before the wait_lock is dropped, so the owner cannot
+ * unlock and go away in between.
+ *
+ * The walk stops as soon as a priority does not change, and never goes
+ * deeper than RT_MUTEX_MAX_CHAIN. Looking for a deadlock it follows the
+ * whole chain instead.
+ *
+ * The caller must hold no rt_mutex locks, have interrupts disabled and
+ * keep the first thread from exiting.
+ *
+ * @param thread First thread whose priority may have changed
+ * @param orig Thread that just queued a waiter, to look for a cycle back
+ *             to it, or NULL
+ * @return 0, or -EDEADLK if the chain leads back to orig or is too long
+ */
+static int rt_mutex_adjust_chain(struct thread *thread, struct thread *orig) {
+    struct thread *held = NULL;
+    u64 depth = 0;
+    int ret = 0;
+
+    rt_mutex_chain_count++;
+
+    spin_lock(&thread->pi_lock);
+
+    for (;;) {
+        rt_mutex_adjust_prio(thread);
+
+        rt_mutex_waiter_t *waiter = thread->pi_blocked_on;
+        if (waiter == NULL) {
+            break;
+        }
+
+        /* Nothing changes further down if the waiter keeps its place */
+        int prio = sched_thread_prio(thread);
+        if (waiter->prio == prio && orig == NULL) {
+            break;
+        }
+
+        rt_mutex_t *lock = waiter->lock;
+
+        /* Against the lock order, so back off while it is busy */
+        if (!spin_trylock(&lock->wait_lock)) {
+            spin_unlock(&thread->pi_lock);
+            spin_lock(&thread->pi_lock);
+            continue;
+        }
+
+        if (++depth > RT_MUTEX_MAX_CHAIN) {
+            /* A chain this long is treated as a deadlock to bound the walk */
+            spin_unlock(&lock->wait_lock);
+            ret = orig != NULL ? -EDEADLK : 0;
+            break;
+        }
+
+        rt_mutex_waiter_t *old_top = lock->top_waiter;
+
+        if (waiter->prio != prio) {
+            rt_mutex_dequeue(lock, waiter);
+            waiter->prio = prio;
+            rt_mutex_enqueue(lock, waiter);
+        }
+
+        spin_unlock(&thread->pi_lock);
+
+        struct thread *owner = rt_mutex_owner(lock);
+        if (owner == NULL || owner == orig) {
+            spin_unlock(&lock->wait_lock);
+            ret = owner != NULL ? -EDEADLK : 0;
+            thread = NULL;
+            break;
+        }
+
+        spin_lock(&owner->pi_lock);
+
+        /* Keep the owner's pi_waiters on the top waiter of the lock */
+        if (lock->top_waiter != old_top || waiter == old_top) {
+            rt_mutex_dequeue_pi(owner, old_top);
+            rt_mutex_enqueue_pi(owner, lock->top_waiter);
+        }
+
+        /* The pi_lock is dropped when backing off, so hold on to the owner */
+        thread_get(owner);
+        spin_unlock(&lock->wait_lock);
+        if (held != NULL) {
+            thread_put(held);
+        }
+        held = thread = owner;
+    }
+
+    if (thread != NULL) {
+        spin_unlock(&thread->pi_lock);
+    }
+
+    if (held != NULL) {
+        thread_put(held);
+    }
+
+    if (depth > rt_mutex_max_chain) {
+        rt_mutex_max_chain = depth;
+    }
+
+    return ret;
+}
+
+/**
+ * Take a free lock
+ *
+ * A queued waiter may always take a free lock. Any other thread may only
+ * take it from waiters that are not more important than itself.
+ *
+ * The caller must hold the wait_lock and have set RT_MUTEX_HAS_WAITERS,
+ * which keeps the owner from leaving through the fast path meanwhile.
+ *
+ * @param lock Lock
+ * @param thread Thread taking the lock
+ * @param waiter Thread's waiter if it is queued, or NULL
+ * @return 1 if the lock was taken, 0 if not
+ */
+static int rt_mutex_try_to_take(rt_mutex_t *lock, struct thread *thread, rt_mutex_waiter_t *waiter) {
+    if (rt_mutex_owner(lock) != NULL) {
+        return 0;
+    }
+
+    spin_lock(&thread->pi_lock);
+
+    if (waiter != NULL) {
+        rt_mutex_dequeue(lock, waiter);
+        thread->pi_blocked_on = NULL;
+    } else if (lock->top_waiter != NULL) {
+        if (lock->top_waiter->prio < sched_thread_prio(thread)) {
+            spin_unlock(&thread->pi_lock);
+            return 0;
+        }
+        rt_mutex_steal_count++;
+    }
+
+    /* Nobody else writes the word while the flag is set and we hold the lock */
+    lock->owner = (unsigned long)thread | (lock->top_waiter != NULL ? RT_MUTEX_HAS_WAITERS : 0);
+
+    /* The new owner inherits from the remaining waiters */
+    if (lock->top_waiter != NULL) {
+        rt_mutex_enqueue_pi(thread, lock->top_waiter);
+        rt_mutex_adjust_prio(thread);
+    }
+
+    spin_unlock(&thread->pi_lock);
+
+    return 1;
+}
+
+/**
+ * Wake a thread that waits on a lock
+ *
+ * @param thread Thread to wake
+ */
+static void rt_mutex_wake(struct thread *thread) {
+    /* Timed waiters sleep, the others block */
+    if (thread->state == THREAD_STATE_SLEEPING) {
+        sched_wakeup_thread(thread);
+    } else {
+        sched_unblock_thread(thread);
+    }
+}
+
+/**
+ * Take a waiter off a lock it gave up on
+ *
+ * The caller must hold the wait_lock. If the owner loses what it
+ * inherited from the waiter, it is returned with a reference held in
+ * boost, for the caller to carry the change down its chain once the
+ * wait_lock is dropped.
+ *
+ * @param lock Lock
+ * @param waiter Waiter to remove
+ * @param boost Set to the owner whose chain needs adjusting, or NULL
+ * @return Thread to wake to compete for a released lock, or NULL
+ */
+static struct thread *rt_mutex_remove_waiter(rt_mutex_t *lock, rt_mutex_waiter_t *waiter, struct thread **boost) {
+    struct thread *owner = rt_mutex_owner(lock);
+    int was_top = lock->top_waiter == waiter;
+
+    *boost = NULL;
+
+    spin_lock(&waiter->thread->pi_lock);
+    rt_mutex_dequeue(lock, waiter);
+    waiter->thread->pi_blocked_on = NULL;
+    spin_unlock(&waiter->thread->pi_lock);
+
+    /* Let the owner unlock through the fast path again */
+    if (lock->top_waiter == NULL) {
+        __sync_fetch_and_and(&lock->owner, ~RT_MUTEX_FLAGS);
+    }
+
+    if (!was_top) {
+        return NULL;
+    }
+
+    /* We may have been woken for a released lock, so pass that on */
+    if (owner == NULL) {
+        return lock->top_waiter != NULL ? lock->top_waiter->thread : NULL;
+    }
+
+    /* The owner now inherits from the next waiter, if any */
+    spin_lock(&owner->pi_lock);
+    rt_mutex_dequeue_pi(owner, waiter);
+    if (lock->top_waiter != NULL) {
+        rt_mutex_enqueue_pi(owner, lock->top_waiter);
+    }
+    spin_unlock(&owner->pi_lock);
+
+    thread_get(owner);
+    *boost = owner;
+
+    return NULL;
+}
+
+/**
+ * Lock an rt_mutex, slow path
+ *
+ * @param lock Lock
+ * @param timed 1 if ms bounds the wait
+ * @param ms Longest time to wait in milliseconds
+ * @return 0 on success, negative error code on failure
+ */
+static int rt_mutex_slowlock(rt_mutex_t *lock, int timed, u64 ms) {
+    struct thread *thread = thread_self();
+    struct thread *wake = NULL;
+    struct thread *boost = NULL;
+    rt_mutex_waiter_t waiter;
+    unsigned long flags;
+    u64 deadline = timed ? get_timestamp() + ms * 1000 : 0;
+    int woken = 0;
+    int ret = 0;
+
+    local_irq_save(flags);
+    spin_lock(&lock->wait_lock);
+
+    /* Force the owner into the slow unlock path, then look again */
+    __sync_fetch_and_or(&lock->owner, RT_MUTEX_HAS_WAITERS);
+
+    if (rt_mutex_try_to_take(lock, thread, NULL)) {
+        spin_unlock(&lock->wait_lock);
+        local_irq_restore(flags);
+        return 0;
+    }
+
+    struct thread *owner = rt_mutex_owner(lock);
+
+    /* Refuse to wait on ourselves, or not at all */
+    if (owner == thread || (timed && ms == 0)) {
+        if (lock->top_waiter == NULL) {
+            __sync_fetch_and_and(&lock->owner, ~RT_MUTEX_FLAGS);
+        }
+
+        if (owner == thread) {
+            rt_mutex_deadlock_count++;
+            ret = -EDEADLK;
+        } else {
+            rt_mutex_timeout_count++;
+            ret = -ETIMEDOUT;
+        }
+
+        spin_unlock(&lock->wait_lock);
+        local_irq_restore(flags);
+        return ret;
+    }
+
+    rt_mutex_slow_count++;
+
+    /* Queue at our current priority */
+    waiter.thread = thread;
+    waiter.lock = lock;
+    rb_clear_node(&waiter.pi_node);
+
+    spin_lock(&thread->pi_lock);
+    waiter.prio = sched_thread_prio(thread);
+    rt_mutex_waiter_t *old_top = lock->top_waiter;
+    rt_mutex_enqueue(lock, &waiter);
+    thread->pi_blocked_on = &waiter;
+    spin_unlock(&thread->pi_lock);
+
+    /* A new top waiter is what the owner inherits from */
+    if (owner != NULL) {
+        spin_lock(&owner->pi_lock);
+        if (lock->top_waiter == &waiter) {
+            if (old_top != NULL) {
+                rt_mutex_dequeue_pi(owner, old_top);
+            }
+            rt_mutex_enqueue_pi(owner, &waiter);
+        }
+        spin_unlock(&owner->pi_lock);
+
+        /* Boost the chain and refuse to wait on ourselves through it */
+        thread_get(owner);
+        spin_unlock(&lock->wait_lock);
+        int deadlock = rt_mutex_adjust_chain(owner, thread);
+        thread_put(owner);
+        spin_lock(&lock->wait_lock);
+
+        if (deadlock && rt_mutex_owner(lock) != thread) {
+            wake = rt_mutex_remove_waiter(lock, &waiter, &boost);
+            rt_mutex_deadlock_count++;
+            ret = -EDEADLK;
+            goto out;
+        }
+    }
+
+    /* Wait until the lock is handed to us or we win it once released */
+    while (rt_mutex_owner(lock) != thread) {
+        u64 now = 0;
+
+        /* It may have been released while the chain was walked */
+        if (rt_mutex_try_to_take(lock, thread, &waiter)) {
+            break;
+        }
+
+        /* Someone took it while we were waking up, so ask for it next time */
+        if (woken) {
+            __sync_fetch_and_or(&lock->owner, RT_MUTEX_HANDOFF);
+        }
+
+        if (timed) {
+            now = get_timestamp();
+            if (now >= deadline) {
+                wake = rt_mutex_remove_waiter(lock, &waiter, &boost);
+                rt_mutex_timeout_count++;
+                ret = -ETIMEDOUT;
+                break;
+            }
+        }
+
+        /* Drop the lock only once we are off the run queue, so no wakeup is lost */
+        if (timed) {
+            sched_sleep_thread_unlock(thread, (deadline - now + 999) / 1000, &lock->wait_lock);
+        } else {
+            sched_block_thread_unlock(thread, &lock->wait_lock);
+        }
+
+        spin_lock(&lock->wait_lock);
+        woken = 1;
+    }
+
+out:
+    spin_unlock(&lock->wait_lock);
+
+    /* The owner no longer inherits from us */
+    if (boost != NULL) {
+        rt_mutex_adjust_chain(boost, NULL);
+        thread_put(boost);
+    }
+
+    local_irq_restore(flags);
+
+    if (wake != NULL) {
+        rt_mutex_wake(wake);
+    }
+
+    return ret;
+}
+
+/**
+ * Initialize an rt_mutex
+ *
+ * @param lock Lock to initialize
+ */
+void rt_mutex_init(rt_mutex_t *lock) {
+    lock->owner = 0;
+    spin_lock_init(&lock->wait_lock);
+    rb_init_root(&lock->waiters);
+    lock->top_waiter = NULL;
+    lock->nr_waiters = 0;
+}
+
+/**
+ * Initialize an rt_mutex that is already owned
+ *
+ * Used when the lock was taken without the kernel seeing it, as with a PI
+ * futex locked in user space.
+ *
+ * @param lock Lock to initialize
+ * @param owner Thread holding the lock
+ */
+void rt_mutex_init_proxy_locked(rt_mutex_t *lock, struct thread *owner) {
+    rt_mutex_init(lock);
+    lock->owner = (unsigned long)owner;
+}
+
+/**
+ * Lock an rt_mutex
+ *
+ * @param lock Lock
+ * @return 0 on success, -EDEADLK if the lock chain leads back to the caller
+ */
+int rt_mutex_lock(rt_mutex_t *lock) {
+    /* Check parameters */
+    if (lock == NULL) {
+        return -EINVAL;
+    }
+
+    /* Uncontended */
+    if (__sync_bool_compare_and_swap(&lock->owner, 0, (unsigned long)thread_self())) {
+        rt_mutex_fast_count++;
+        return 0;
+    }
+
+    return rt_mutex_slowlock(lock, 0, 0);
+}
+
+/**
+ * Lock an rt_mutex, giving up after a timeout
+ *
+ * @param lock Lock
+ * @param ms Longest time to wait in milliseconds
+ * @return 0 on success, -ETIMEDOUT or -EDEADLK on failure
+ */
+int rt_mutex_timed_lock(rt_mutex_t *lock, u64 ms) {
+    /* Check parameters */
+    if (lock == NULL) {
+        return -EINVAL;
+    }
+
+    /* Uncontended */
+    if (__sync_bool_compare_and_swap(&lock->owner, 0, (unsigned long)thread_self())) {
+        rt_mutex_fast_count++;
+        return 0;
+    }
+
+    return rt_mutex_slowlock(lock, 1, ms);
+}
+
+/**
+ * Try to lock an rt_mutex
+ *
+ * A lock released to its waiters can still be taken by a thread at least
+ * as important as them.
+ *
+ * @param lock Lock
+ * @return 0 on success, -EBUSY if the lock is owned
+ */
+int rt_mutex_trylock(rt_mutex_t *lock) {
+    struct thread *thread = thread_self();
+    unsigned long flags;
+    int ret = -EBUSY;
+
+    /* Check parameters */
+    if (lock == NULL) {
+        return -EINVAL;
+    }
+
+    if (__sync_bool_compare_and_swap(&lock->owner, 0, (unsigned long)thread)) {
+        rt_mutex_fast_count++;
+        return 0;
+    }
+
+    /* Owned, no need to look closer */
+    if (rt_mutex_owner(lock) != NULL) {
+        return -EBUSY;
+    }
+
+    local_irq_save(flags);
+    spin_lock(&lock->wait_lock);
+
+    __sync_fetch_and_or(&lock->owner, RT_MUTEX_HAS_WAITERS);
+
+    if (rt_mutex_try_to_take(lock, thread, NULL)) {
+        ret = 0;
+    } else if (lock->top_waiter == NULL) {
+        __sync_fetch_and_and(&lock->owner, ~RT_MUTEX_FLAGS);
+    }
+
+    spin_unlock(&lock->wait_lock);
+    local_irq_restore(flags);
+
+    return ret;
+}
+
+/**
+ * Unlock an rt_mutex
+ *
+ * A real-time top waiter, or one that asked for it with RT_MUTEX_HANDOFF,
+ * becomes the owner before it runs, so it cannot be overtaken. Any other
+ * top waiter is woken to compete for the released lock.
+ *
+ * @param lock Lock
+ * @return 0 on success, -EPERM if the caller does not own the lock
+ */
+int rt_mutex_unlock(rt_mutex_t *lock) {
+    struct thread *thread = thread_self();
+    struct thread *next = NULL;
+    unsigned long flags;
+
+    /* Check parameters */
+    if (lock == NULL) {
+        return -EINVAL;
+    }
+
+    /* Uncontended */
+    if (__sync_bool_compare_and_swap(&lock->owner, (unsigned long)thread, 0)) {
+        return 0;
+    }
+
+    local_irq_save(flags);
+    spin_lock(&lock->wait_lock);
+
+    if (rt_mutex_owner(lock) != thread) {
+        spin_unlock(&lock->wait_lock);
+        local_irq_restore(flags);
+        return -EPERM;
+    }
+
+    rt_mutex_waiter_t *waiter = lock->top_waiter;
+
+    if (waiter == NULL) {
+        /* The waiters gave up before we got here */
+        lock->owner = 0;
+    } else if (waiter->prio < MAX_RT_PRIO || (lock->owner & RT_MUTEX_HANDOFF)) {
+        next = waiter->thread;
+
+        /* We no longer inherit from this lock */
+        spin_lock(&thread->pi_lock);
+        rt_mutex_dequeue_pi(thread, waiter);
+        spin_unlock(&thread->pi_lock);
+
+        /* Hand over, the new owner inherits from the remaining waiters */
+        spin_lock(&next->pi_lock);
+        rt_mutex_dequeue(lock, waiter);
+        next->pi_blocked_on = NULL;
+        lock->owner = (unsigned long)next | (lock->top_waiter != NULL ? RT_MUTEX_HAS_WAITERS : 0);
+        if (lock->top_waiter != NULL) {
+            rt_mutex_enqueue_pi(next, lock->top_waiter);
+            rt_mutex_adjust_prio(next);
+        }
+        spin_unlock(&next->pi_lock);
+
+        rt_mutex_handoff_count++;
+    } else {
+        next = waiter->thread;
+
+        /* Release, the waiter stays queued and competes once it runs */
+        spin_lock(&thread->pi_lock);
+        rt_mutex_dequeue_pi(thread, waiter);
+        spin_unlock(&thread->pi_lock);
+        lock->owner = RT_MUTEX_HAS_WAITERS;
+
+        rt_mutex_release_count++;
+    }
+
+    spin_unlock(&lock->wait_lock);
+
+    /* Drop what we inherited through this lock */
+    spin_lock(&thread->pi_lock);
+    rt_mutex_adjust_prio(thread);
+    spin_unlock(&thread->pi_lock);
+
+    local_irq_restore(flags);
+
+    /* Wake the next owner, which may preempt us now that we are deboosted */
+    if (next != NULL) {
+        rt_mutex_wake(next);
+    }
+
+    return 0;
+}
+
+/**
+ * Propagate a priority change of a blocked thread
+ *
+ * Called when the priority of a thread waiting on an rt_mutex changes,
+ * so the owners in front of it pick up the new priority.
+ *
+ * @param thread Thread whose priority changed
+ */
+void rt_mutex_adjust_pi(struct thread *thread) {
+    unsigned long flags;
+
+    if (thread == NULL) {
+        return;
+    }
+
+    local_irq_save(flags);
+    rt_mutex_adjust_chain(thread, NULL);
+    local_irq_restore(flags);
+}
+
+/**
+ * Print rt_mutex statistics
+ */
+void rt_mutex_print_stats(void) {
+    printk(KERN_INFO "RTMUTEX: Fast path acquisitions: %llu\n", rt_mutex_fast_count);
+    printk(KERN_INFO "RTMUTEX: Slow path acquisitions: %llu\n", rt_mutex_slow_count);
+    printk(KERN_INFO "RTMUTEX: Handoffs: %llu\n", rt_mutex_handoff_count);
+    printk(KERN_INFO "RTMUTEX: Releases to waiters: %llu\n", rt_mutex_release_count);
+    printk(KERN_INFO "RTMUTEX: Steals: %llu\n", rt_mutex_steal_count);
+    printk(KERN_INFO "RTMUTEX: Priority boosts: %llu\n", rt_mutex_boost_count);
+    printk(KERN_INFO "RTMUTEX: Chain walks: %llu\n", rt_mutex_chain_count);
+    printk(KERN_INFO "RTMUTEX: Longest chain: %llu\n", rt_mutex_max_chain);
+    printk(KERN_INFO "RTMUTEX: Deadlocks refused: %llu\n", rt_mutex_deadlock_count);
+    printk(KERN_INFO "RTMUTEX: Timeouts: %llu\n", rt_mutex_timeout_count);
+}
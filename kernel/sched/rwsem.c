@@ -0,0 +1,284 @@
+/**
+ * rwsem.c - Horizon kernel read-write semaphore implementation
+ *
+ * This file contains the implementation of the read-write semaphore. An
+ * uncontended down or up is a single compare-and-swap on the count word.
+ * Once anyone waits, RWSEM_HAS_WAITERS sends every lock and unlock through
+ * the wait queue, which grants the lock in FIFO order: a run of readers at
+ * the head is let in together, and a writer at the head holds back the
+ * readers queued behind it.
+ */
+
+#include <horizon/kernel.h>
+#include <horizon/types.h>
+#include <horizon/rwsem.h>
+#include <horizon/sched.h>
+#include <horizon/thread.h>
+#include <horizon/spinlock.h>
+#include <horizon/irqflags.h>
+#include <horizon/list.h>
+#include <horizon/stddef.h>
+
+/* Waiter types */
+#define RWSEM_WAITING_FOR_READ  0
+#define RWSEM_WAITING_FOR_WRITE 1
+
+/* Waiter, lives on the waiting thread's stack */
+typedef struct rwsem_waiter {
+    list_head_t list;               /* Link in the wait list */
+    struct thread *thread;          /* Waiting thread */
+    int type;                       /* RWSEM_WAITING_FOR_ */
+    volatile int granted;           /* Set once the lock is ours */
+} rwsem_waiter_t;
+
+/**
+ * Grant the lock to a waiter and wake it
+ *
+ * The caller must hold wait_lock, the waiter does not touch its entry
+ * again until it has taken wait_lock itself.
+ *
+ * @param waiter Waiter
+ */
+static void rwsem_wake_waiter(rwsem_waiter_t *waiter) {
+    struct thread *thread = waiter->thread;
+
+    list_del(&waiter->list);
+    waiter->granted = 1;
+
+    if (thread != thread_self()) {
+        sched_unblock_thread(thread);
+    }
+}
+
+/**
+ * Grant the lock to waiters at the head of the queue
+ *
+ * The caller must hold wait_lock. While waiters are queued the fast paths
+ * cannot take the lock, so the count only drops under our feet.
+ *
+ * @param sem Semaphore
+ */
+static void rwsem_grant(struct rw_semaphore *sem) {
+    while (!list_empty(&sem->wait_list)) {
+        rwsem_waiter_t *waiter = list_entry(sem->wait_list.next, rwsem_waiter_t, list);
+        long count = sem->count;
+
+        if (waiter->type == RWSEM_WAITING_FOR_WRITE) {
+            /* A writer needs the lock to itself */
+            if (count & ~RWSEM_HAS_WAITERS) {
+                break;
+            }
+
+            __sync_fetch_and_or(&sem->count, RWSEM_WRITER_LOCKED);
+            sem->owner = waiter->thread;
+            rwsem_wake_waiter(waiter);
+            break;
+        }
+
+        /* Readers share with readers only */
+        if (count & RWSEM_WRITER_LOCKED) {
+            break;
+        }
+
+        __sync_fetch_and_add(&sem->count, RWSEM_READER_BIAS);
+        rwsem_wake_waiter(waiter);
+    }
+
+    /* Let the fast paths back in */
+    if (list_empty(&sem->wait_list)) {
+        __sync_fetch_and_and(&sem->count, ~RWSEM_HAS_WAITERS);
+    }
+}
+
+/**
+ * Wait for a read-write semaphore
+ *
+ * @param sem Semaphore
+ * @param type RWSEM_WAITING_FOR_READ or RWSEM_WAITING_FOR_WRITE
+ */
+static void rwsem_down_slowpath(struct rw_semaphore *sem, int type) {
+    struct thread *thread = thread_self();
+    rwsem_waiter_t waiter;
+    unsigned long flags;
+
+    waiter.thread = thread;
+    waiter.type = type;
+    waiter.granted = 0;
+
+    local_irq_save(flags);
+    spin_lock(&sem->wait_lock);
+
+    /* Queue behind everyone, then grant in case the holders already left */
+    __sync_fetch_and_or(&sem->count, RWSEM_HAS_WAITERS);
+    list_add_tail(&waiter.list, &sem->wait_list);
+    rwsem_grant(sem);
+
+    while (!waiter.granted) {
+        /* Drop wait_lock only once we are off the run queue, so no grant is lost */
+        sched_block_thread_unlock(thread, &sem->wait_lock);
+
+        spin_lock(&sem->wait_lock);
+    }
+
+    spin_unlock(&sem->wait_lock);
+    local_irq_restore(flags);
+}
+
+/**
+ * Wake waiters after the lock was released, slow path
+ *
+ * @param sem Semaphore
+ */
+static void rwsem_wake(struct rw_semaphore *sem) {
+    unsigned long flags;
+
+    local_irq_save(flags);
+    spin_lock(&sem->wait_lock);
+
+    rwsem_grant(sem);
+
+    spin_unlock(&sem->wait_lock);
+    local_irq_restore(flags);
+}
+
+/**
+ * Initialize a read-write semaphore
+ *
+ * @param sem Semaphore
+ */
+void init_rwsem(struct rw_semaphore *sem) {
+    sem->count = 0;
+    spin_lock_init(&sem->wait_lock);
+    list_init(&sem->wait_list);
+    sem->owner = NULL;
+}
+
+/**
+ * Acquire a read-write semaphore for reading
+ *
+ * @param sem Semaphore
+ */
+void down_read(struct rw_semaphore *sem) {
+    long count = sem->count;
+
+    /* No writer and nobody queued */
+    while (!(count & RWSEM_FLAGS)) {
+        if (__sync_bool_compare_and_swap(&sem->count, count, count + RWSEM_READER_BIAS)) {
+            return;
+        }
+        count = sem->count;
+    }
+
+    rwsem_down_slowpath(sem, RWSEM_WAITING_FOR_READ);
+}
+
+/**
+ * Try to acquire a read-write semaphore for reading
+ *
+ * Fails while a writer is queued, like down_read() would wait.
+ *
+ * @param sem Semaphore
+ * @return 1 if acquired, 0 if not
+ */
+int down_read_trylock(struct rw_semaphore *sem) {
+    long count = sem->count;
+
+    while (!(count & RWSEM_FLAGS)) {
+        if (__sync_bool_compare_and_swap(&sem->count, count, count + RWSEM_READER_BIAS)) {
+            return 1;
+        }
+        count = sem->count;
+    }
+
+    return 0;
+}
+
+/**
+ * Release a read-write semaphore held for reading
+ *
+ * @param sem Semaphore
+ */
+void up_read(struct rw_semaphore *sem) {
+    long count = __sync_sub_and_fetch(&sem->count, RWSEM_READER_BIAS);
+
+    /* Last reader out with waiters queued */
+    if (count == RWSEM_HAS_WAITERS) {
+        rwsem_wake(sem);
+    }
+}
+
+/**
+ * Acquire a read-write semaphore for writing
+ *
+ * @param sem Semaphore
+ */
+void down_write(struct rw_semaphore *sem) {
+    if (__sync_bool_compare_and_swap(&sem->count, 0, RWSEM_WRITER_LOCKED)) {
+        sem->owner = thread_self();
+        return;
+    }
+
+    rwsem_down_slowpath(sem, RWSEM_WAITING_FOR_WRITE);
+}
+
+/**
+ * Try to acquire a read-write semaphore for writing
+ *
+ * @param sem Semaphore
+ * @return 1 if acquired, 0 if not
+ */
+int down_write_trylock(struct rw_semaphore *sem) {
+    if (__sync_bool_compare_and_swap(&sem->count, 0, RWSEM_WRITER_LOCKED)) {
+        sem->owner = thread_self();
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Release a read-write semaphore held for writing
+ *
+ * @param sem Semaphore
+ */
+void up_write(struct rw_semaphore *sem) {
+    sem->owner = NULL;
+
+    if (__sync_bool_compare_and_swap(&sem->count, RWSEM_WRITER_LOCKED, 0)) {
+        return;
+    }
+
+    /* Waiters are queued, release under wait_lock so none is missed */
+    unsigned long flags;
+
+    local_irq_save(flags);
+    spin_lock(&sem->wait_lock);
+
+    __sync_fetch_and_and(&sem->count, ~RWSEM_WRITER_LOCKED);
+    rwsem_grant(sem);
+
+    spin_unlock(&sem->wait_lock);
+    local_irq_restore(flags);
+}
+
+/**
+ * Turn a write hold into a read hold
+ *
+ * Readers at the head of the queue are let in with us, a queued writer
+ * still waits for all of us.
+ *
+ * @param sem Semaphore held for writing
+ */
+void downgrade_write(struct rw_semaphore *sem) {
+    unsigned long flags;
+
+    local_irq_save(flags);
+    spin_lock(&sem->wait_lock);
+
+    sem->owner = NULL;
+    __sync_fetch_and_add(&sem->count, RWSEM_READER_BIAS - RWSEM_WRITER_LOCKED);
+    rwsem_grant(sem);
+
+    spin_unlock(&sem->wait_lock);
+    local_irq_restore(flags);
+}
@@ -20,8 +20,8 @@
 #define NULL ((void *)0)
 #endif
 
-/* Maximum number of domains */
-#define MAX_DOMAINS 8
+/* Maximum number of domains, one per core plus the levels above */
+#define MAX_DOMAINS (CONFIG_NR_CPUS + 1)
 
 /* Maximum number of groups per domain */
 #define MAX_GROUPS 8
@@ -33,8 +33,47 @@ static int domain_count = 0;
 /* Domain lock */
 static spinlock_t domain_lock = SPIN_LOCK_INITIALIZER;
 
+/**
+ * Set up a domain's tunables
+ *
+ * @param domain Domain to set up
+ * @param parent Parent domain
+ * @param flags Domain flags
+ * @param level Topology level
+ */
+static void sched_domain_setup(sched_domain_t *domain, sched_domain_t *parent, u32 flags, int level) {
+    domain->id = domain - domains;
+    domain->parent = parent;
+    domain->flags = flags;
+    domain->level = level;
+    domain->group_count = 0;
+
+    if (flags & SD_SHARE_CPUPOWER) {
+        /* Siblings share caches, so balance often and ignore cache hotness */
+        domain->min_interval = 1;
+        domain->max_interval = 4;
+        domain->busy_factor = 16;
+        domain->imbalance_pct = 110;
+        domain->cache_nice_tries = 0;
+    } else {
+        /* Moving between cores loses the cache, so be more reluctant */
+        domain->min_interval = 4;
+        domain->max_interval = 64;
+        domain->busy_factor = 32;
+        domain->imbalance_pct = 125;
+        domain->cache_nice_tries = 1;
+    }
+
+    domain->balance_interval = domain->min_interval;
+}
+
 /**
  * Initialize the scheduler domains
+ *
+ * Builds a core level, whose groups are the sibling CPUs of one core,
+ * below a package level whose groups are the cores. Balancing walks the
+ * levels bottom-up, so threads move between siblings before they move
+ * between cores.
  */
 void sched_domain_init(void) {
     /* Reset the domains */
@@ -50,32 +89,65 @@ void sched_domain_init(void) {
         return;
     }
     
-    /* Create a single domain for all CPUs */
-    sched_domain_t *domain = &domains[0];
-    domain->id = 0;
-    domain->parent = NULL;
-    domain->flags = SD_LOAD_BALANCE | SD_BALANCE_NEWIDLE | SD_WAKE_AFFINE;
-    domain->min_interval = 1;
-    domain->max_interval = 100;
-    domain->busy_factor = 32;
-    domain->imbalance_pct = 125;
-    domain->cache_nice_tries = 1;
-    
-    /* Create a single group for all CPUs */
-    sched_group_t *group = &domain->groups[0];
-    group->id = 0;
-    group->cpu_mask = 0;
-    
-    /* Add all CPUs to the group */
-    for (int i = 0; i < nr_cpus; i++) {
-        group->cpu_mask |= (1ULL << i);
+    /* Get the number of cores */
+    int nr_cores = (nr_cpus + SD_CPUS_PER_CORE - 1) / SD_CPUS_PER_CORE;
+    
+    /* A single core needs only the core level */
+    if (nr_cores == 1) {
+        sched_domain_t *domain = &domains[0];
+        sched_domain_setup(domain, NULL, SD_LOAD_BALANCE | SD_BALANCE_NEWIDLE | SD_WAKE_AFFINE |
+                           SD_SHARE_CPUPOWER | SD_SHARE_PKG_RESOURCES, 0);
+        
+        for (int cpu = 0; cpu < nr_cpus && domain->group_count < MAX_GROUPS; cpu++) {
+            domain->groups[domain->group_count].id = domain->group_count;
+            domain->groups[domain->group_count].cpu_mask = 1ULL << cpu;
+            domain->group_count++;
+        }
+        
+        domain_count = 1;
+        printk(KERN_INFO "SCHED_DOMAIN: Initialized scheduler domains\n");
+        return;
     }
     
-    /* Set the group count */
-    domain->group_count = 1;
+    /* The package level follows the core domains, so lookups find cores first */
+    sched_domain_t *top = &domains[nr_cores];
+    sched_domain_setup(top, NULL, SD_LOAD_BALANCE | SD_BALANCE_NEWIDLE | SD_WAKE_AFFINE |
+                       SD_SHARE_PKG_RESOURCES, 1);
+    
+    /* Spread the cores over the package groups */
+    int cores_per_group = (nr_cores + MAX_GROUPS - 1) / MAX_GROUPS;
+    
+    for (int core = 0; core < nr_cores; core++) {
+        /* Get the CPUs of this core */
+        u64 core_mask = 0;
+        for (int cpu = core * SD_CPUS_PER_CORE; cpu < (core + 1) * SD_CPUS_PER_CORE && cpu < nr_cpus; cpu++) {
+            core_mask |= 1ULL << cpu;
+        }
+        
+        /* Create the core domain, with one group per sibling */
+        sched_domain_t *domain = &domains[core];
+        sched_domain_setup(domain, top, SD_LOAD_BALANCE | SD_BALANCE_NEWIDLE | SD_WAKE_AFFINE |
+                           SD_SHARE_CPUPOWER | SD_SHARE_PKG_RESOURCES, 0);
+        
+        for (int cpu = 0; cpu < nr_cpus; cpu++) {
+            if (core_mask & (1ULL << cpu)) {
+                domain->groups[domain->group_count].id = domain->group_count;
+                domain->groups[domain->group_count].cpu_mask = 1ULL << cpu;
+                domain->group_count++;
+            }
+        }
+        
+        /* Add the core to its package group */
+        int group = core / cores_per_group;
+        if (group >= top->group_count) {
+            top->groups[group].id = group;
+            top->group_count = group + 1;
+        }
+        top->groups[group].cpu_mask |= core_mask;
+    }
     
     /* Set the domain count */
-    domain_count = 1;
+    domain_count = nr_cores + 1;
     
     printk(KERN_INFO "SCHED_DOMAIN: Initialized scheduler domains\n");
 }
@@ -100,15 +172,8 @@ sched_domain_t *sched_domain_create(sched_domain_t *parent, u32 flags) {
     
     /* Create the domain */
     sched_domain_t *domain = &domains[domain_count];
-    domain->id = domain_count;
-    domain->parent = parent;
-    domain->flags = flags;
-    domain->min_interval = 1;
-    domain->max_interval = 100;
-    domain->busy_factor = 32;
-    domain->imbalance_pct = 125;
-    domain->cache_nice_tries = 1;
-    domain->group_count = 0;
+    memset(domain, 0, sizeof(sched_domain_t));
+    sched_domain_setup(domain, parent, flags, 0);
     
     /* Increment the domain count */
     domain_count++;
@@ -303,8 +368,12 @@ void sched_domain_print(void) {
     for (int i = 0; i < domain_count; i++) {
         sched_domain_t *domain = &domains[i];
         
-        printk(KERN_INFO "SCHED_DOMAIN: Domain %d: Groups: %d, Flags: 0x%08x\n",
-               domain->id, domain->group_count, domain->flags);
+        printk(KERN_INFO "SCHED_DOMAIN: Domain %d: Level: %d, Groups: %d, Flags: 0x%08x\n",
+               domain->id, domain->level, domain->group_count, domain->flags);
+        printk(KERN_INFO "SCHED_DOMAIN: Domain %d: Interval: %u, Balances: %llu, Balanced: %llu, Failed: %llu\n",
+               domain->id, domain->balance_interval, domain->lb_count, domain->lb_balanced, domain->lb_failed);
+        printk(KERN_INFO "SCHED_DOMAIN: Domain %d: Moved: %llu, Hot skipped: %llu, Affine skipped: %llu, Newly idle: %llu\n",
+               domain->id, domain->lb_moved, domain->lb_hot_skipped, domain->lb_affine_skipped, domain->lb_newidle);
         
         /* Print each group */
         for (int j = 0; j < domain->group_count; j++) {
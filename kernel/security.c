@@ -10,7 +10,7 @@
 #include <horizon/types.h>
 #include <horizon/stddef.h>
 #include <horizon/security.h>
-#include <horizon/spinlock.h>
+#include <horizon/percpu_rwsem.h>
 #include <horizon/list.h>
 #include <horizon/mm.h>
 #include <horizon/errno.h>
@@ -20,24 +20,15 @@
 /* Security module list */
 static security_module_t *security_modules = NULL;
 
-/* Security lock */
-static spinlock_t security_lock = { { 0 } };
+/* Protects the module list, every security hook reads it */
+static percpu_rw_semaphore_t security_rwsem = PERCPU_RWSEM_INITIALIZER(security_rwsem);
 
 /**
  * Initialize security subsystem
  */
 void security_init(void) {
     /* Initialize lock */
-    security_lock.raw_lock.lock = 0;
-#ifdef CONFIG_DEBUG_SPINLOCK
-    security_lock.raw_lock.name = "security_lock";
-    security_lock.raw_lock.file = NULL;
-    security_lock.raw_lock.line = 0;
-    security_lock.raw_lock.owner = 0;
-    security_lock.raw_lock.owner_pc = 0;
-    security_lock.raw_lock.held_count = 0;
-    security_lock.raw_lock.contention_count = 0;
-#endif
+    percpu_init_rwsem(&security_rwsem);
 }
 
 /**
@@ -55,13 +46,13 @@ int security_register_module(security_module_t *module) {
     }
 
     /* Register module */
-    spin_lock(&security_lock);
+    percpu_down_write(&security_rwsem);
 
     /* Check if module already exists */
     curr = security_modules;
     while (curr != NULL) {
         if (strcmp(curr->name, module->name) == 0) {
-            spin_unlock(&security_lock);
+            percpu_up_write(&security_rwsem);
             return -EEXIST;
         }
         curr = curr->next;
@@ -84,7 +75,7 @@ int security_register_module(security_module_t *module) {
         module->next = NULL;
     }
 
-    spin_unlock(&security_lock);
+    percpu_up_write(&security_rwsem);
 
     return 0;
 }
@@ -104,7 +95,7 @@ int security_unregister_module(security_module_t *module) {
     }
 
     /* Unregister module */
-    spin_lock(&security_lock);
+    percpu_down_write(&security_rwsem);
 
     /* Find module in list */
     curr = security_modules;
@@ -117,14 +108,14 @@ int security_unregister_module(security_module_t *module) {
             } else {
                 prev->next = curr->next;
             }
-            spin_unlock(&security_lock);
+            percpu_up_write(&security_rwsem);
             return 0;
         }
         prev = curr;
         curr = curr->next;
     }
 
-    spin_unlock(&security_lock);
+    percpu_up_write(&security_rwsem);
 
     /* Module not found */
     return -ENOENT;
@@ -182,7 +173,7 @@ int security_task_create(security_context_t *parent, security_context_t *child)
     memcpy(child, parent, sizeof(security_context_t));
 
     /* Call security modules */
-    spin_lock(&security_lock);
+    percpu_down_read(&security_rwsem);
     module = security_modules;
     while (module != NULL) {
         if (module->ops != NULL && module->ops->task_create != NULL) {
@@ -193,7 +184,7 @@ int security_task_create(security_context_t *parent, security_context_t *child)
         }
         module = module->next;
     }
-    spin_unlock(&security_lock);
+    percpu_up_read(&security_rwsem);
 
     return ret;
 }
@@ -215,7 +206,7 @@ int security_task_setuid(security_context_t *context, u32 uid) {
     }
 
     /* Call security modules */
-    spin_lock(&security_lock);
+    percpu_down_read(&security_rwsem);
     module = security_modules;
     while (module != NULL) {
         if (module->ops != NULL && module->ops->task_setuid != NULL) {
@@ -226,7 +217,7 @@ int security_task_setuid(security_context_t *context, u32 uid) {
         }
         module = module->next;
     }
-    spin_unlock(&security_lock);
+    percpu_up_read(&security_rwsem);
 
     /* Set user ID */
     if (ret == 0) {
@@ -253,7 +244,7 @@ int security_task_setgid(security_context_t *context, u32 gid) {
     }
 
     /* Call security modules */
-    spin_lock(&security_lock);
+    percpu_down_read(&security_rwsem);
     module = security_modules;
     while (module != NULL) {
         if (module->ops != NULL && module->ops->task_setgid != NULL) {
@@ -264,7 +255,7 @@ int security_task_setgid(security_context_t *context, u32 gid) {
         }
         module = module->next;
     }
-    spin_unlock(&security_lock);
+    percpu_up_read(&security_rwsem);
 
     /* Set group ID */
     if (ret == 0) {
@@ -291,7 +282,7 @@ int security_task_kill(security_context_t *context, u32 pid) {
     }
 
     /* Call security modules */
-    spin_lock(&security_lock);
+    percpu_down_read(&security_rwsem);
     module = security_modules;
     while (module != NULL) {
         if (module->ops != NULL && module->ops->task_kill != NULL) {
@@ -302,7 +293,7 @@ int security_task_kill(security_context_t *context, u32 pid) {
         }
         module = module->next;
     }
-    spin_unlock(&security_lock);
+    percpu_up_read(&security_rwsem);
 
     return ret;
 }
@@ -325,7 +316,7 @@ int security_file_open(security_context_t *context, const char *path, u32 flags)
     }
 
     /* Call security modules */
-    spin_lock(&security_lock);
+    percpu_down_read(&security_rwsem);
     module = security_modules;
     while (module != NULL) {
         if (module->ops != NULL && module->ops->file_open != NULL) {
@@ -336,7 +327,7 @@ int security_file_open(security_context_t *context, const char *path, u32 flags)
         }
         module = module->next;
     }
-    spin_unlock(&security_lock);
+    percpu_up_read(&security_rwsem);
 
     return ret;
 }
@@ -359,7 +350,7 @@ int security_file_permission(security_context_t *context, const char *path, u32
     }
 
     /* Call security modules */
-    spin_lock(&security_lock);
+    percpu_down_read(&security_rwsem);
     module = security_modules;
     while (module != NULL) {
         if (module->ops != NULL && module->ops->file_permission != NULL) {
@@ -370,7 +361,7 @@ int security_file_permission(security_context_t *context, const char *path, u32
         }
         module = module->next;
     }
-    spin_unlock(&security_lock);
+    percpu_up_read(&security_rwsem);
 
     return ret;
 }
@@ -394,7 +385,7 @@ int security_file_chown(security_context_t *context, const char *path, u32 uid,
     }
 
     /* Call security modules */
-    spin_lock(&security_lock);
+    percpu_down_read(&security_rwsem);
     module = security_modules;
     while (module != NULL) {
         if (module->ops != NULL && module->ops->file_chown != NULL) {
@@ -405,7 +396,7 @@ int security_file_chown(security_context_t *context, const char *path, u32 uid,
         }
         module = module->next;
     }
-    spin_unlock(&security_lock);
+    percpu_up_read(&security_rwsem);
 
     return ret;
 }
@@ -428,7 +419,7 @@ int security_file_chmod(security_context_t *context, const char *path, u32 mode)
     }
 
     /* Call security modules */
-    spin_lock(&security_lock);
+    percpu_down_read(&security_rwsem);
     module = security_modules;
     while (module != NULL) {
         if (module->ops != NULL && module->ops->file_chmod != NULL) {
@@ -439,7 +430,7 @@ int security_file_chmod(security_context_t *context, const char *path, u32 mode)
         }
         module = module->next;
     }
-    spin_unlock(&security_lock);
+    percpu_up_read(&security_rwsem);
 
     return ret;
 }
@@ -462,7 +453,7 @@ int security_ipc_permission(security_context_t *context, u32 key, u32 mask) {
     }
 
     /* Call security modules */
-    spin_lock(&security_lock);
+    percpu_down_read(&security_rwsem);
     module = security_modules;
     while (module != NULL) {
         if (module->ops != NULL && module->ops->ipc_permission != NULL) {
@@ -473,7 +464,7 @@ int security_ipc_permission(security_context_t *context, u32 key, u32 mask) {
         }
         module = module->next;
     }
-    spin_unlock(&security_lock);
+    percpu_up_read(&security_rwsem);
 
     return ret;
 }
@@ -680,7 +671,7 @@ int security_path_truncate(const struct path *path) {
     }
 
     /* Call security modules */
-    spin_lock(&security_lock);
+    percpu_down_read(&security_rwsem);
     module = security_modules;
     while (module != NULL) {
         if (module->ops != NULL && module->ops->path_truncate != NULL) {
@@ -691,7 +682,7 @@ int security_path_truncate(const struct path *path) {
         }
         module = module->next;
     }
-    spin_unlock(&security_lock);
+    percpu_up_read(&security_rwsem);
 
     return ret;
 }
@@ -715,7 +706,7 @@ int security_path_mknod(const struct path *dir, struct dentry *dentry, umode_t m
     }
 
     /* Call security modules */
-    spin_lock(&security_lock);
+    percpu_down_read(&security_rwsem);
     module = security_modules;
     while (module != NULL) {
         if (module->ops != NULL && module->ops->path_mknod != NULL) {
@@ -726,7 +717,7 @@ int security_path_mknod(const struct path *dir, struct dentry *dentry, umode_t m
         }
         module = module->next;
     }
-    spin_unlock(&security_lock);
+    percpu_up_read(&security_rwsem);
 
     return ret;
 }
@@ -749,7 +740,7 @@ int security_path_mkdir(const struct path *dir, struct dentry *dentry, umode_t m
     }
 
     /* Call security modules */
-    spin_lock(&security_lock);
+    percpu_down_read(&security_rwsem);
     module = security_modules;
     while (module != NULL) {
         if (module->ops != NULL && module->ops->path_mkdir != NULL) {
@@ -760,7 +751,7 @@ int security_path_mkdir(const struct path *dir, struct dentry *dentry, umode_t m
         }
         module = module->next;
     }
-    spin_unlock(&security_lock);
+    percpu_up_read(&security_rwsem);
 
     return ret;
 }
@@ -782,7 +773,7 @@ int security_path_rmdir(const struct path *dir, struct dentry *dentry) {
     }
 
     /* Call security modules */
-    spin_lock(&security_lock);
+    percpu_down_read(&security_rwsem);
     module = security_modules;
     while (module != NULL) {
         if (module->ops != NULL && module->ops->path_rmdir != NULL) {
@@ -793,7 +784,7 @@ int security_path_rmdir(const struct path *dir, struct dentry *dentry) {
         }
         module = module->next;
     }
-    spin_unlock(&security_lock);
+    percpu_up_read(&security_rwsem);
 
     return ret;
 }
@@ -815,7 +806,7 @@ int security_path_unlink(const struct path *dir, struct dentry *dentry) {
     }
 
     /* Call security modules */
-    spin_lock(&security_lock);
+    percpu_down_read(&security_rwsem);
     module = security_modules;
     while (module != NULL) {
         if (module->ops != NULL && module->ops->path_unlink != NULL) {
@@ -826,7 +817,7 @@ int security_path_unlink(const struct path *dir, struct dentry *dentry) {
         }
         module = module->next;
     }
-    spin_unlock(&security_lock);
+    percpu_up_read(&security_rwsem);
 
     return ret;
 }
@@ -849,7 +840,7 @@ int security_path_symlink(const struct path *dir, struct dentry *dentry, const c
     }
 
     /* Call security modules */
-    spin_lock(&security_lock);
+    percpu_down_read(&security_rwsem);
     module = security_modules;
     while (module != NULL) {
         if (module->ops != NULL && module->ops->path_symlink != NULL) {
@@ -860,7 +851,7 @@ int security_path_symlink(const struct path *dir, struct dentry *dentry, const c
         }
         module = module->next;
     }
-    spin_unlock(&security_lock);
+    percpu_up_read(&security_rwsem);
 
     return ret;
 }
@@ -883,7 +874,7 @@ int security_path_link(struct dentry *old_dentry, const struct path *new_dir, st
     }
 
     /* Call security modules */
-    spin_lock(&security_lock);
+    percpu_down_read(&security_rwsem);
     module = security_modules;
     while (module != NULL) {
         if (module->ops != NULL && module->ops->path_link != NULL) {
@@ -894,7 +885,7 @@ int security_path_link(struct dentry *old_dentry, const struct path *new_dir, st
         }
         module = module->next;
     }
-    spin_unlock(&security_lock);
+    percpu_up_read(&security_rwsem);
 
     return ret;
 }
@@ -919,7 +910,7 @@ int security_path_rename(const struct path *old_dir, struct dentry *old_dentry,
     }
 
     /* Call security modules */
-    spin_lock(&security_lock);
+    percpu_down_read(&security_rwsem);
     module = security_modules;
     while (module != NULL) {
         if (module->ops != NULL && module->ops->path_rename != NULL) {
@@ -930,7 +921,7 @@ int security_path_rename(const struct path *old_dir, struct dentry *old_dentry,
         }
         module = module->next;
     }
-    spin_unlock(&security_lock);
+    percpu_up_read(&security_rwsem);
 
     return ret;
 }
@@ -952,7 +943,7 @@ int security_path_chmod(const struct path *path, umode_t mode) {
     }
 
     /* Call security modules */
-    spin_lock(&security_lock);
+    percpu_down_read(&security_rwsem);
     module = security_modules;
     while (module != NULL) {
         if (module->ops != NULL && module->ops->path_chmod != NULL) {
@@ -963,7 +954,7 @@ int security_path_chmod(const struct path *path, umode_t mode) {
         }
         module = module->next;
     }
-    spin_unlock(&security_lock);
+    percpu_up_read(&security_rwsem);
 
     return ret;
 }
@@ -986,7 +977,7 @@ int security_path_chown(const struct path *path, uid_t uid, gid_t gid) {
     }
 
     /* Call security modules */
-    spin_lock(&security_lock);
+    percpu_down_read(&security_rwsem);
     module = security_modules;
     while (module != NULL) {
         if (module->ops != NULL && module->ops->path_chown != NULL) {
@@ -997,7 +988,7 @@ int security_path_chown(const struct path *path, uid_t uid, gid_t gid) {
         }
         module = module->next;
     }
-    spin_unlock(&security_lock);
+    percpu_up_read(&security_rwsem);
 
     return ret;
 }
@@ -1018,7 +1009,7 @@ int security_path_chroot(const struct path *path) {
     }
 
     /* Call security modules */
-    spin_lock(&security_lock);
+    percpu_down_read(&security_rwsem);
     module = security_modules;
     while (module != NULL) {
         if (module->ops != NULL && module->ops->path_chroot != NULL) {
@@ -1029,7 +1020,7 @@ int security_path_chroot(const struct path *path) {
         }
         module = module->next;
     }
-    spin_unlock(&security_lock);
+    percpu_up_read(&security_rwsem);
 
     return ret;
 }
@@ -694,3 +694,28 @@ int signal_pause(void) {
 
     return -1; /* Always returns -1 with errno set to EINTR */
 }
+
+/**
+ * Replace the signal mask of the current thread
+ *
+ * Used by calls that wait with a mask given by the caller, like
+ * epoll_pwait(), to set it and put the old one back afterwards.
+ *
+ * @param set New signal mask
+ * @param oldset Old signal mask
+ * @return 0 on success, -1 on failure
+ */
+int signal_swap_mask(const sigset_t *set, sigset_t *oldset) {
+    /* Get the current thread */
+    thread_t *thread = thread_self();
+
+    if (thread == NULL || set == NULL || oldset == NULL) {
+        return -1;
+    }
+
+    /* Swap the masks */
+    *oldset = thread->signal_mask;
+    thread->signal_mask = *set;
+
+    return 0;
+}
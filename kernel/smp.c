@@ -12,10 +12,13 @@
 #include <horizon/smp.h>
 #include <horizon/spinlock.h>
 #include <horizon/mm.h>
+#include <horizon/mm/pmm.h>
+#include <horizon/mm/slab.h>
 #include <horizon/sched.h>
 #include <horizon/task.h>
 #include <horizon/interrupt.h>
 #include <horizon/errno.h>
+#include <horizon/timer.h>
 
 /* IPI types */
 #define IPI_CALL_FUNC   0
@@ -32,7 +35,7 @@ cpumask_t cpu_present_mask;
 cpumask_t cpu_active_mask;
 
 /* SMP lock */
-static spinlock_t smp_lock = { { 0 } };
+static spinlock_t smp_lock = SPIN_LOCK_INITIALIZER;
 
 /* Boot CPU ID */
 static int boot_cpu_id = 0;
@@ -59,7 +62,7 @@ typedef struct {
 static smp_call_t *cpu_call_queue[NR_CPUS];
 
 /* CPU call lock */
-static spinlock_t cpu_call_lock = { { 0 } };
+static spinlock_t cpu_call_lock = SPIN_LOCK_INITIALIZER;
 
 /**
  * Initialize SMP
@@ -462,6 +465,18 @@ void smp_handle_stop_ipi(void) {
     cpu_clear(cpu, &cpu_online_mask);
     cpu_clear(cpu, &cpu_active_mask);
 
+    /* Give cached objects and page frames back before going away */
+    slab_drain_cpu(cpu);
+    pmm_drain_cpu_pages(cpu);
+
+    /* Hand pending timers to a CPU that stays online */
+    for (int target = 0; target < NR_CPUS; target++) {
+        if (cpu_isset(target, &cpu_online_mask)) {
+            timer_migrate_cpu(cpu, target);
+            break;
+        }
+    }
+
     /* Halt CPU */
     for (;;) {
         arch_cpu_halt();
@@ -7,118 +7,241 @@
 #include <horizon/kernel.h>
 #include <horizon/types.h>
 #include <horizon/spinlock.h>
-#include <horizon/sched.h>
+#include <horizon/smp.h>
+#include <horizon/preempt.h>
+#include <horizon/string.h>
+#include <horizon/errno.h>
 #include <horizon/printk.h>
 
+#ifdef CONFIG_LOCK_STAT
+/* Lock class table, slot 0 is the default class */
+static lock_class_t lock_classes[LOCK_CLASS_MAX] = {
+    { "default", 0, 0, 0, 0 }
+};
+#endif
+
 /**
- * Acquire a raw spinlock with debugging
+ * Relax the CPU while spinning
+ */
+static inline void spin_cpu_relax(void) {
+    __asm__ volatile("pause" ::: "memory");
+}
+
+#ifdef CONFIG_QUEUED_SPINLOCKS
+/* MCS queue node */
+typedef struct qspin_node {
+    struct qspin_node *volatile next;   /* Next waiter in the queue */
+    volatile int locked;                /* Set when we are the queue head */
+} qspin_node_t;
+
+/* Per-CPU queue nodes, one per nesting level */
+static qspin_node_t qspin_nodes[CONFIG_NR_CPUS][QSPIN_MAX_NESTING];
+static int qspin_nesting[CONFIG_NR_CPUS];
+
+/**
+ * Encode a queue node as a lock word tail
+ *
+ * @param cpu CPU owning the node
+ * @param idx Nesting level of the node
+ * @return Tail bits, never zero
+ */
+static inline u32 qspin_encode_tail(int cpu, int idx) {
+    return (((u32)(cpu + 1) << QSPIN_TAIL_IDX_BITS) | (u32)idx) << QSPIN_TAIL_SHIFT;
+}
+
+/**
+ * Decode a lock word tail to its queue node
+ *
+ * @param tail Tail bits
+ * @return Queue node
+ */
+static inline qspin_node_t *qspin_decode_tail(u32 tail) {
+    u32 t = tail >> QSPIN_TAIL_SHIFT;
+
+    return &qspin_nodes[(t >> QSPIN_TAIL_IDX_BITS) - 1][t & (QSPIN_MAX_NESTING - 1)];
+}
+
+/**
+ * Acquire a contended raw spinlock
+ *
+ * Waiters queue on per-CPU nodes and each spins on its own node. Only the
+ * queue head watches the lock word, so a release touches one waiter.
  *
  * @param lock Raw spinlock to acquire
- * @param file Source file
- * @param line Source line
+ * @param val Lock word seen by the fast path
  */
-#ifdef CONFIG_DEBUG_SPINLOCK
-void __raw_spin_lock(raw_spinlock_t *lock, const char *file, int line) {
-    unsigned int contended = 0;
-    unsigned long flags;
+void raw_spin_lock_slowpath(raw_spinlock_t *lock, u32 val) {
+    int cpu;
+    int idx;
+    qspin_node_t *node;
+    u32 tail;
+    u32 old;
+    u32 spins = 0;
 
-    /* Save interrupt flags and disable interrupts */
-    __asm__ volatile("pushf; pop %0; cli" : "=r" (flags));
+    (void)val;
 
-    /* Check if the lock is already held by us */
-    if (lock->owner == 0 && lock->lock == 1) {
-        printk(KERN_WARNING "Spinlock %s already locked at %s:%d\n",
-               lock->name ? lock->name : "unknown",
-               lock->file ? lock->file : "unknown",
-               lock->line);
+    /* Stay on this CPU while one of its queue nodes is in use */
+    preempt_disable();
+    cpu = smp_processor_id();
+    idx = qspin_nesting[cpu];
+
+    /* Out of nodes, spin on the lock word until it is free */
+    if (idx >= QSPIN_MAX_NESTING) {
+        while (!__sync_bool_compare_and_swap(&lock->lock, 0, 1)) {
+            spin_cpu_relax();
+            spins++;
+        }
+        goto stat;
     }
 
-    /* Try to acquire the lock */
-    while (__sync_lock_test_and_set(&lock->lock, 1) != 0) {
-        /* Lock is held by someone else */
-        contended = 1;
+    qspin_nesting[cpu]++;
+    node = &qspin_nodes[cpu][idx];
+    tail = qspin_encode_tail(cpu, idx);
 
-        /* Pause to prevent excessive bus contention */
-        __asm__ volatile("pause");
+    node->next = NULL;
+    node->locked = 0;
+
+    /* Publish our node as the new tail, keeping the locked byte */
+    do {
+        old = lock->lock;
+    } while (!__sync_bool_compare_and_swap(&lock->lock, old,
+                                           (old & QSPIN_LOCKED_MASK) | tail));
+
+    /* Link behind the previous tail and wait to become the head */
+    if (old & ~QSPIN_LOCKED_MASK) {
+        qspin_node_t *prev = qspin_decode_tail(old & ~QSPIN_LOCKED_MASK);
+
+        prev->next = node;
+        while (!node->locked) {
+            spin_cpu_relax();
+            spins++;
+        }
     }
 
-    /* We now hold the lock */
-    lock->file = file;
-    lock->line = line;
-    lock->owner = 0; /* TODO: Get current CPU */
-    lock->owner_pc = (unsigned long)__builtin_return_address(0);
-    lock->held_count++;
+    /* At the head, wait for the owner to release */
+    while (lock->lock & QSPIN_LOCKED_MASK) {
+        spin_cpu_relax();
+        spins++;
+    }
 
-    /* Update contention count */
-    if (contended) {
-        lock->contention_count++;
+    /* Take the lock, clearing the tail if nobody queued behind us */
+    for (;;) {
+        old = lock->lock;
+        if ((old & ~QSPIN_LOCKED_MASK) != tail) {
+            __sync_fetch_and_or(&lock->lock, 1);
+            break;
+        }
+        if (__sync_bool_compare_and_swap(&lock->lock, old, 1)) {
+            goto out;
+        }
     }
 
-    /* Restore interrupt flags */
-    __asm__ volatile("push %0; popf" : : "r" (flags));
+    /* Make the next waiter the head */
+    while (node->next == NULL) {
+        spin_cpu_relax();
+    }
+    node->next->locked = 1;
+
+out:
+    qspin_nesting[cpu]--;
+
+stat:
+#ifdef CONFIG_LOCK_STAT
+    lock_stat_acquired(lock, spins);
+#else
+    (void)spins;
+#endif
+
+    /* We hold the lock now, a deferred preemption waits for a later enable */
+    preempt_enable_no_resched();
 }
 #else
-void raw_spin_lock(raw_spinlock_t *lock) {
-    /* Disable interrupts */
-    __asm__ volatile("cli");
+/**
+ * Acquire a contended raw spinlock
+ *
+ * The fast path already drew our ticket, wait for it to be served. The
+ * spin backs off in proportion to the number of waiters ahead of us.
+ *
+ * @param lock Raw spinlock to acquire
+ * @param val Lock word seen by the fast path
+ */
+void raw_spin_lock_slowpath(raw_spinlock_t *lock, u32 val) {
+    u16 ticket = (u16)(val >> 16);
+    u32 spins = 0;
 
-    /* Try to acquire the lock */
-    while (__sync_lock_test_and_set(&lock->lock, 1) != 0) {
-        /* Pause to prevent excessive bus contention */
-        __asm__ volatile("pause");
+    for (;;) {
+        u16 ahead = (u16)(ticket - lock->tickets.owner);
+        u16 i;
+
+        if (ahead == 0) {
+            break;
+        }
+
+        for (i = 0; i < ahead; i++) {
+            spin_cpu_relax();
+        }
+        spins += ahead;
     }
+
+    /* Order the critical section after the acquire */
+    __sync_synchronize();
+
+#ifdef CONFIG_LOCK_STAT
+    lock_stat_acquired(lock, spins);
+#else
+    (void)spins;
+#endif
 }
 #endif
 
+#ifdef CONFIG_DEBUG_SPINLOCK
 /**
- * Try to acquire a raw spinlock with debugging
+ * Acquire a raw spinlock with debugging
  *
  * @param lock Raw spinlock to acquire
  * @param file Source file
  * @param line Source line
- * @return 1 if lock acquired, 0 if not
  */
-#ifdef CONFIG_DEBUG_SPINLOCK
-int __raw_spin_trylock(raw_spinlock_t *lock, const char *file, int line) {
-    unsigned long flags;
-
-    /* Save interrupt flags and disable interrupts */
-    __asm__ volatile("pushf; pop %0; cli" : "=r" (flags));
+void __raw_spin_lock(raw_spinlock_t *lock, const char *file, int line) {
+    int cpu = smp_processor_id();
 
-    /* Try to acquire the lock */
-    if (__sync_lock_test_and_set(&lock->lock, 1) != 0) {
-        /* Lock is held by someone else */
-        __asm__ volatile("push %0; popf" : : "r" (flags));
-        return 0;
+    /* Check if the lock is already held by us */
+    if (raw_spin_is_locked(lock) && lock->file != NULL && lock->owner == (unsigned long)cpu) {
+        printk(KERN_WARNING "Spinlock %s already locked at %s:%d\n",
+               lock->name ? lock->name : "unknown",
+               lock->file, lock->line);
     }
 
+    __raw_spin_lock_fast(lock);
+
     /* We now hold the lock */
     lock->file = file;
     lock->line = line;
-    lock->owner = 0; /* TODO: Get current CPU */
+    lock->owner = cpu;
     lock->owner_pc = (unsigned long)__builtin_return_address(0);
-    lock->held_count++;
-
-    /* Restore interrupt flags */
-    __asm__ volatile("push %0; popf" : : "r" (flags));
-
-    return 1;
 }
-#else
-int raw_spin_trylock(raw_spinlock_t *lock) {
-    /* Disable interrupts */
-    __asm__ volatile("cli");
-
-    /* Try to acquire the lock */
-    if (__sync_lock_test_and_set(&lock->lock, 1) != 0) {
-        /* Lock is held by someone else */
-        __asm__ volatile("sti");
+
+/**
+ * Try to acquire a raw spinlock with debugging
+ *
+ * @param lock Raw spinlock to acquire
+ * @param file Source file
+ * @param line Source line
+ * @return 1 if lock acquired, 0 if not
+ */
+int __raw_spin_trylock(raw_spinlock_t *lock, const char *file, int line) {
+    if (!__raw_spin_trylock_fast(lock)) {
         return 0;
     }
 
+    /* We now hold the lock */
+    lock->file = file;
+    lock->line = line;
+    lock->owner = smp_processor_id();
+    lock->owner_pc = (unsigned long)__builtin_return_address(0);
+
     return 1;
 }
-#endif
 
 /**
  * Release a raw spinlock with debugging
@@ -127,24 +250,17 @@ int raw_spin_trylock(raw_spinlock_t *lock) {
  * @param file Source file
  * @param line Source line
  */
-#ifdef CONFIG_DEBUG_SPINLOCK
 void __raw_spin_unlock(raw_spinlock_t *lock, const char *file, int line) {
-    unsigned long flags;
-
-    /* Save interrupt flags and disable interrupts */
-    __asm__ volatile("pushf; pop %0; cli" : "=r" (flags));
-
     /* Check if the lock is not held */
-    if (lock->lock == 0) {
+    if (!raw_spin_is_locked(lock)) {
         printk(KERN_WARNING "Spinlock %s not locked at %s:%d\n",
                lock->name ? lock->name : "unknown",
                file, line);
-        __asm__ volatile("push %0; popf" : : "r" (flags));
         return;
     }
 
     /* Check if the lock is held by someone else */
-    if (lock->owner != 0 /* TODO: Get current CPU */) {
+    if (lock->owner != (unsigned long)smp_processor_id()) {
         printk(KERN_WARNING "Spinlock %s held by CPU %lu at %s:%d, unlocking at %s:%d\n",
                lock->name ? lock->name : "unknown",
                lock->owner,
@@ -160,18 +276,7 @@ void __raw_spin_unlock(raw_spinlock_t *lock, const char *file, int line) {
     lock->owner_pc = 0;
 
     /* Release the lock */
-    __sync_lock_release(&lock->lock);
-
-    /* Restore interrupt flags */
-    __asm__ volatile("push %0; popf" : : "r" (flags));
-}
-#else
-void raw_spin_unlock(raw_spinlock_t *lock) {
-    /* Release the lock */
-    __sync_lock_release(&lock->lock);
-
-    /* Enable interrupts */
-    __asm__ volatile("sti");
+    __raw_spin_unlock_fast(lock);
 }
 #endif
 
@@ -182,5 +287,134 @@ void raw_spin_unlock(raw_spinlock_t *lock) {
  * @return 1 if locked, 0 if not
  */
 int raw_spin_is_locked(raw_spinlock_t *lock) {
-    return lock->lock != 0;
+#ifdef CONFIG_QUEUED_SPINLOCKS
+    return (lock->lock & QSPIN_LOCKED_MASK) != 0;
+#else
+    u32 val = lock->lock;
+
+    return (u16)(val >> 16) != (u16)val;
+#endif
+}
+
+#ifdef CONFIG_LOCK_STAT
+/**
+ * Register a lock class
+ *
+ * Locks initialized with the same name share a class.
+ *
+ * @param name Class name, NULL for the default class
+ * @return Class index, the default class if the table is full
+ */
+u16 lock_class_register(const char *name) {
+    u16 i;
+
+    if (name == NULL) {
+        return 0;
+    }
+
+    for (i = 1; i < LOCK_CLASS_MAX; i++) {
+        const char *cur = lock_classes[i].name;
+
+        /* Claim a free slot */
+        if (cur == NULL &&
+            __sync_bool_compare_and_swap(&lock_classes[i].name, NULL, name)) {
+            return i;
+        }
+
+        cur = lock_classes[i].name;
+        if (cur == name || strcmp(cur, name) == 0) {
+            return i;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Account a lock acquisition to its class
+ *
+ * Counters are updated without atomics, they are approximate under
+ * contention but cost nothing on the lock itself.
+ *
+ * @param lock Lock acquired
+ * @param spins Spin iterations spent waiting, 0 if uncontended
+ */
+void lock_stat_acquired(raw_spinlock_t *lock, u32 spins) {
+    lock_class_t *class = &lock_classes[lock->lock_class < LOCK_CLASS_MAX ? lock->lock_class : 0];
+
+    class->acquired++;
+
+    if (spins == 0) {
+        return;
+    }
+
+    class->contended++;
+    class->wait_spins += spins;
+    if (spins > class->max_wait_spins) {
+        class->max_wait_spins = spins;
+    }
+}
+#endif
+
+/**
+ * Get the statistics of a lock class
+ *
+ * @param lock_class Class index
+ * @param stats Statistics to fill in
+ * @return 0 on success, negative error code on failure
+ */
+int lock_stat_get(u16 lock_class, lock_class_t *stats) {
+#ifdef CONFIG_LOCK_STAT
+    if (stats == NULL || lock_class >= LOCK_CLASS_MAX || lock_classes[lock_class].name == NULL) {
+        return -EINVAL;
+    }
+
+    *stats = lock_classes[lock_class];
+    return 0;
+#else
+    (void)lock_class;
+    (void)stats;
+    return -ENOSYS;
+#endif
+}
+
+/**
+ * Print lock class statistics
+ */
+void lock_stat_print(void) {
+#ifdef CONFIG_LOCK_STAT
+    u16 i;
+
+    printk(KERN_INFO "Lock statistics:\n");
+
+    for (i = 0; i < LOCK_CLASS_MAX; i++) {
+        lock_class_t *class = &lock_classes[i];
+
+        if (class->name == NULL || class->acquired == 0) {
+            continue;
+        }
+
+        printk(KERN_INFO "  %s: acquired %llu, contended %llu, wait spins %llu, max %llu\n",
+               class->name, class->acquired, class->contended,
+               class->wait_spins, class->max_wait_spins);
+    }
+#else
+    printk(KERN_INFO "Lock statistics disabled\n");
+#endif
+}
+
+/**
+ * Reset lock class statistics
+ */
+void lock_stat_reset(void) {
+#ifdef CONFIG_LOCK_STAT
+    u16 i;
+
+    for (i = 0; i < LOCK_CLASS_MAX; i++) {
+        lock_classes[i].acquired = 0;
+        lock_classes[i].contended = 0;
+        lock_classes[i].wait_spins = 0;
+        lock_classes[i].max_wait_spins = 0;
+    }
+#endif
 }
@@ -2,16 +2,33 @@
  * futex.c - Horizon kernel futex-related system calls
  *
  * This file contains the implementation of futex-related system calls.
+ *
+ * Waiters are kept in a hash table keyed on the futex they wait on, so
+ * waking only looks at the waiters of that address. Private futexes are
+ * keyed on (mm, address). Shared futexes in a file mapping are keyed on
+ * (file, offset), so processes that share the mapping meet even when it
+ * sits at different addresses.
+ *
+ * PI futexes hold the owner's TID in the futex word. Once a thread has to
+ * wait, the futex gets a PI state with an rt_mutex owned by the holder,
+ * and the waiters block on that, boosting the holder.
  */
 
 #include <horizon/kernel.h>
 #include <horizon/types.h>
 #include <horizon/syscall.h>
 #include <horizon/futex.h>
+#include <horizon/mm.h>
 #include <horizon/task.h>
 #include <horizon/thread.h>
 #include <horizon/sched.h>
-#include <horizon/mm.h>
+#include <horizon/rtmutex.h>
+#include <horizon/time.h>
+#include <horizon/list.h>
+#include <horizon/spinlock.h>
+#include <horizon/rwsem.h>
+#include <horizon/irqflags.h>
+#include <horizon/uaccess.h>
 #include <horizon/errno.h>
 
 /* Define NULL if not defined */
@@ -19,128 +36,929 @@
 #define NULL ((void *)0)
 #endif
 
-/* Futex operations */
-#define FUTEX_WAIT              0
-#define FUTEX_WAKE              1
-#define FUTEX_FD                2
-#define FUTEX_REQUEUE           3
-#define FUTEX_CMP_REQUEUE       4
-#define FUTEX_WAKE_OP           5
-#define FUTEX_LOCK_PI           6
-#define FUTEX_UNLOCK_PI         7
-#define FUTEX_TRYLOCK_PI        8
-#define FUTEX_WAIT_BITSET       9
-#define FUTEX_WAKE_BITSET       10
-#define FUTEX_WAIT_REQUEUE_PI   11
-#define FUTEX_CMP_REQUEUE_PI    12
-
-/* Futex flags */
-#define FUTEX_PRIVATE_FLAG      128
-#define FUTEX_CLOCK_REALTIME    256
+/* Futex key */
+typedef struct futex_key {
+    void *object;               /* mm for private futexes, file for shared ones */
+    unsigned long offset;       /* Address, or byte offset within the file */
+} futex_key_t;
+
+/* Hash bucket */
+typedef struct futex_bucket {
+    spinlock_t lock;            /* Protects the chain */
+    list_head_t chain;          /* Waiters hashed to this bucket */
+    u32 nr_waiters;             /* Number of waiters, checked before locking */
+    list_head_t pi_states;      /* PI states of futexes hashed to this bucket */
+} futex_bucket_t;
+
+/* Waiter, lives on the waiting thread's stack */
+typedef struct futex_q {
+    list_head_t list;           /* Entry in the bucket chain */
+    futex_bucket_t *bucket;     /* Bucket the waiter is on, changed by requeue */
+    thread_t *thread;           /* Waiting thread */
+    futex_key_t key;            /* Futex waited on */
+    u32 bitset;                 /* Wakeups this waiter accepts */
+    volatile int woken;         /* Set under the bucket lock once dequeued by a waker */
+} futex_q_t;
+
+/* PI state of a futex with kernel waiters */
+typedef struct futex_pi_state {
+    list_head_t list;           /* Entry in the bucket's PI state list */
+    futex_key_t key;            /* Futex */
+    rt_mutex_t lock;            /* Kernel side of the futex, owned by its holder */
+    thread_t *owner;            /* Holder it was set up for, referenced until freed */
+    u32 refcount;               /* Threads using the state */
+} futex_pi_state_t;
+
+/* Futex hash table */
+static futex_bucket_t futex_queues[FUTEX_HASH_SIZE];
+
+/**
+ * Get the hash bucket of a key
+ *
+ * @param key Futex key
+ * @return Hash bucket
+ */
+static futex_bucket_t *futex_hash(const futex_key_t *key) {
+    u32 hash = (u32)((unsigned long)key->object >> 3) * 0x9E3779B1U;
+    hash ^= (u32)(key->offset >> 2) * 0x85EBCA6BU;
+
+    return &futex_queues[hash >> (32 - FUTEX_HASH_BITS)];
+}
+
+/**
+ * Compare two futex keys
+ *
+ * @param a First key
+ * @param b Second key
+ * @return 1 if they name the same futex, 0 if not
+ */
+static inline int futex_match(const futex_key_t *a, const futex_key_t *b) {
+    return a->object == b->object && a->offset == b->offset;
+}
+
+/**
+ * Build the key of a futex
+ *
+ * @param uaddr User address of the futex
+ * @param private 1 if the futex is private to the process
+ * @param key Key to fill in
+ * @return 0 on success, negative error code on failure
+ */
+static int futex_get_key(int *uaddr, int private, futex_key_t *key) {
+    unsigned long addr = (unsigned long)uaddr;
+
+    /* Futexes are naturally aligned 32-bit words */
+    if (addr == 0 || (addr % sizeof(int)) != 0) {
+        return -EINVAL;
+    }
+
+    /* Default to the address space */
+    task_struct_t *task = task_current();
+    key->object = task->mm;
+    key->offset = addr;
+
+    if (private || task->mm == NULL) {
+        return 0;
+    }
+
+    /* Shared file mappings are keyed on the file, keep the VMA list stable */
+    down_read(&task->mm->mmap_sem);
+
+    vm_area_struct_t *vma = vmm_find_vma(task->mm, addr);
+    if (vma == NULL) {
+        up_read(&task->mm->mmap_sem);
+        return -EFAULT;
+    }
+
+    if ((vma->vm_flags & VM_SHARED) && vma->vm_file != NULL) {
+        key->object = vma->vm_file;
+        key->offset = (vma->vm_pgoff << PAGE_SHIFT) + (addr - vma->vm_start);
+    }
+
+    up_read(&task->mm->mmap_sem);
+
+    return 0;
+}
+
+/**
+ * Convert a futex timeout to milliseconds from now
+ *
+ * @param timeout User timeout
+ * @param absolute 1 if the timeout is an absolute time
+ * @param realtime 1 if an absolute timeout is on CLOCK_REALTIME
+ * @param ms Set to the time left, rounded up
+ * @return 0 on success, negative error code on failure
+ */
+static int futex_timeout_ms(const struct timespec *timeout, int absolute, int realtime, u64 *ms) {
+    struct timespec ts;
+
+    if (copy_from_user(&ts, timeout, sizeof(ts)) != 0) {
+        return -EFAULT;
+    }
+
+    /* time_t is unsigned here, a negative user value shows up as a huge one */
+    if ((long)ts.tv_sec < 0 || ts.tv_nsec < 0 || ts.tv_nsec >= 1000000000L) {
+        return -EINVAL;
+    }
+
+    /* Turn an absolute time into the time left */
+    if (absolute) {
+        struct timespec now;
+        time_clock_gettime(realtime ? CLOCK_REALTIME : CLOCK_MONOTONIC, &now);
+
+        if (ts.tv_sec < now.tv_sec || (ts.tv_sec == now.tv_sec && ts.tv_nsec <= now.tv_nsec)) {
+            *ms = 0;
+            return 0;
+        }
+
+        ts.tv_sec -= now.tv_sec;
+        ts.tv_nsec -= now.tv_nsec;
+        if (ts.tv_nsec < 0) {
+            ts.tv_sec--;
+            ts.tv_nsec += 1000000000L;
+        }
+    }
+
+    *ms = (u64)ts.tv_sec * 1000 + (ts.tv_nsec + 999999) / 1000000;
+
+    return 0;
+}
+
+/**
+ * Lock the bucket a waiter is on
+ *
+ * A requeue may move the waiter while we wait for the lock, so check the
+ * bucket again once it is held.
+ *
+ * @param q Waiter
+ * @return Locked bucket
+ */
+static futex_bucket_t *futex_lock_q(futex_q_t *q) {
+    for (;;) {
+        futex_bucket_t *hb = q->bucket;
+
+        spin_lock(&hb->lock);
+        if (hb == q->bucket) {
+            return hb;
+        }
+        spin_unlock(&hb->lock);
+    }
+}
+
+/**
+ * Lock two buckets in address order
+ *
+ * @param hb1 First bucket
+ * @param hb2 Second bucket
+ */
+static void futex_double_lock(futex_bucket_t *hb1, futex_bucket_t *hb2) {
+    if (hb1 > hb2) {
+        futex_bucket_t *tmp = hb1;
+        hb1 = hb2;
+        hb2 = tmp;
+    }
+
+    spin_lock(&hb1->lock);
+    if (hb1 != hb2) {
+        spin_lock(&hb2->lock);
+    }
+}
+
+/**
+ * Unlock two buckets
+ *
+ * @param hb1 First bucket
+ * @param hb2 Second bucket
+ */
+static void futex_double_unlock(futex_bucket_t *hb1, futex_bucket_t *hb2) {
+    spin_unlock(&hb1->lock);
+    if (hb1 != hb2) {
+        spin_unlock(&hb2->lock);
+    }
+}
+
+/**
+ * Dequeue a waiter and add its thread to a wakeup list
+ *
+ * The threads are woken once the bucket locks are dropped, so a woken
+ * thread never runs into a lock its waker still holds.
+ *
+ * @param q Waiter, its bucket must be locked
+ * @param wake_list Deferred wakeup list
+ */
+static void futex_mark_woken(futex_q_t *q, thread_t **wake_list) {
+    list_del(&q->list);
+    q->bucket->nr_waiters--;
+
+    /* Keep the thread alive until futex_wake_up() is done with it */
+    thread_get(q->thread);
+    q->thread->wake_next = *wake_list;
+    *wake_list = q->thread;
+
+    /* The waiter may return once it sees this, so q is not touched again */
+    q->woken = 1;
+}
+
+/**
+ * Wake the threads of a wakeup list
+ *
+ * Drops the references taken by futex_mark_woken().
+ *
+ * @param wake_list Deferred wakeup list
+ */
+static void futex_wake_up(thread_t *wake_list) {
+    while (wake_list != NULL) {
+        thread_t *thread = wake_list;
+        wake_list = thread->wake_next;
+        thread->wake_next = NULL;
+
+        /* Timed waiters sleep, the others block */
+        if (thread->state == THREAD_STATE_SLEEPING) {
+            sched_wakeup_thread(thread);
+        } else {
+            sched_unblock_thread(thread);
+        }
+
+        thread_put(thread);
+    }
+}
+
+/**
+ * Wake waiters of a key from a locked bucket
+ *
+ * @param hb Locked bucket
+ * @param key Futex key
+ * @param nr_wake Maximum number of waiters to wake
+ * @param bitset Wakeup bitset
+ * @param wake_list Deferred wakeup list
+ * @return Number of waiters woken
+ */
+static int futex_wake_locked(futex_bucket_t *hb, const futex_key_t *key, int nr_wake, u32 bitset, thread_t **wake_list) {
+    list_head_t *pos, *n;
+    int count = 0;
+
+    list_for_each_safe(pos, n, &hb->chain) {
+        futex_q_t *q = list_entry(pos, futex_q_t, list);
+
+        if (count >= nr_wake) {
+            break;
+        }
+
+        if (!futex_match(&q->key, key) || !(q->bitset & bitset)) {
+            continue;
+        }
+
+        futex_mark_woken(q, wake_list);
+        count++;
+    }
+
+    return count;
+}
 
 /* Futex wait system call */
-static int futex_wait(int *uaddr, int val, struct timespec *timeout) {
-    /* Check if the futex value matches */
-    if (*uaddr != val) {
-        return -EAGAIN;
+static int futex_wait(int *uaddr, int flags, int val, struct timespec *timeout, u32 bitset, int absolute) {
+    futex_q_t q;
+    u64 ms = 0;
+    u64 deadline = 0;
+    unsigned long irq_flags;
+    int cur;
+
+    /* A waiter must accept some wakeup */
+    if (bitset == 0) {
+        return -EINVAL;
+    }
+
+    /* Work out how long to wait */
+    if (timeout != NULL) {
+        int ret = futex_timeout_ms(timeout, absolute, flags & FUTEX_CLOCK_REALTIME, &ms);
+        if (ret < 0) {
+            return ret;
+        }
+        deadline = get_timestamp() + ms * 1000;
+    }
+
+    /* Find the bucket */
+    int ret = futex_get_key(uaddr, flags & FUTEX_PRIVATE_FLAG, &q.key);
+    if (ret < 0) {
+        return ret;
     }
 
-    /* Block the thread */
     thread_t *thread = thread_self();
-    thread->futex_addr = uaddr;
-    thread->futex_val = val;
+    q.thread = thread;
+    q.bitset = bitset;
+    q.woken = 0;
+    q.bucket = futex_hash(&q.key);
 
-    /* Add the thread to the futex wait queue */
-    /* This would be implemented with a proper futex wait queue */
-    /* For now, just block the thread */
-    sched_block_thread(thread);
+    /* Keep interrupts off while the bucket is locked */
+    local_irq_save(irq_flags);
+    spin_lock(&q.bucket->lock);
 
-    /* Thread has been woken up */
-    thread->futex_addr = NULL;
+    /*
+     * Count the waiter before reading the value. A waker that changed the
+     * value and then finds no waiters in futex_wake() knows this read
+     * will see the change.
+     */
+    q.bucket->nr_waiters++;
+    __sync_synchronize();
 
-    return 0;
+    /* Only sleep if the value is still the one user space saw */
+    if (copy_from_user(&cur, uaddr, sizeof(int)) != 0) {
+        ret = -EFAULT;
+    } else if (cur != val) {
+        ret = -EAGAIN;
+    } else if (timeout != NULL && ms == 0) {
+        ret = -ETIMEDOUT;
+    }
+
+    if (ret < 0) {
+        q.bucket->nr_waiters--;
+        spin_unlock(&q.bucket->lock);
+        local_irq_restore(irq_flags);
+        return ret;
+    }
+
+    /* Queue the waiter */
+    list_add_tail(&q.list, &q.bucket->chain);
+
+    /*
+     * Sleep until woken, the timeout passes or a signal arrives. The bucket
+     * is unlocked once the thread is off the run queue, so a waker always
+     * finds it waiting.
+     */
+    if (timeout != NULL) {
+        sched_sleep_thread_unlock(thread, ms, &q.bucket->lock);
+    } else {
+        sched_block_thread_unlock(thread, &q.bucket->lock);
+    }
+
+    local_irq_restore(irq_flags);
+
+    /* A waker dequeues the waiter, otherwise take it off ourselves */
+    futex_bucket_t *hb = futex_lock_q(&q);
+    ret = 0;
+
+    if (!q.woken) {
+        list_del(&q.list);
+        hb->nr_waiters--;
+        ret = (timeout != NULL && get_timestamp() >= deadline) ? -ETIMEDOUT : -EINTR;
+    }
+
+    spin_unlock(&hb->lock);
+
+    return ret;
 }
 
 /* Futex wake system call */
-static int futex_wake(int *uaddr, int val) {
-    /* Wake up threads waiting on the futex */
-    int count = 0;
+static int futex_wake(int *uaddr, int flags, int nr_wake, u32 bitset) {
+    futex_key_t key;
+    thread_t *wake_list = NULL;
 
-    /* Find threads waiting on the futex */
-    /* This would be implemented with a proper futex wait queue */
-    /* For now, just wake up all threads */
-    thread_t *thread;
-    list_for_each_entry(thread, &task_current()->threads, process_threads) {
-        if (thread->futex_addr == uaddr) {
-            /* Wake up the thread */
-            sched_unblock_thread(thread);
-            count++;
+    /* A wakeup must match some waiter */
+    if (bitset == 0) {
+        return -EINVAL;
+    }
 
-            /* Check if we've woken up enough threads */
-            if (count >= val) {
-                break;
+    int ret = futex_get_key(uaddr, flags & FUTEX_PRIVATE_FLAG, &key);
+    if (ret < 0) {
+        return ret;
+    }
+
+    futex_bucket_t *hb = futex_hash(&key);
+
+    /* Nobody is waiting, so skip the lock, a waiter counted later sees the new value */
+    __sync_synchronize();
+    if (hb->nr_waiters == 0) {
+        return 0;
+    }
+
+    spin_lock(&hb->lock);
+    int count = futex_wake_locked(hb, &key, nr_wake, bitset, &wake_list);
+    spin_unlock(&hb->lock);
+
+    futex_wake_up(wake_list);
+
+    return count;
+}
+
+/* Futex requeue system call */
+static int futex_requeue(int *uaddr, int flags, int *uaddr2, int nr_wake, int nr_requeue, int *cmpval) {
+    futex_key_t key1, key2;
+    thread_t *wake_list = NULL;
+    list_head_t *pos, *n;
+    int woken = 0;
+    int requeued = 0;
+
+    if (nr_wake < 0 || nr_requeue < 0) {
+        return -EINVAL;
+    }
+
+    int ret = futex_get_key(uaddr, flags & FUTEX_PRIVATE_FLAG, &key1);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = futex_get_key(uaddr2, flags & FUTEX_PRIVATE_FLAG, &key2);
+    if (ret < 0) {
+        return ret;
+    }
+
+    futex_bucket_t *hb1 = futex_hash(&key1);
+    futex_bucket_t *hb2 = futex_hash(&key2);
+
+    futex_double_lock(hb1, hb2);
+
+    /* FUTEX_CMP_REQUEUE only goes ahead if the value has not changed */
+    if (cmpval != NULL) {
+        int cur;
+
+        if (copy_from_user(&cur, uaddr, sizeof(int)) != 0) {
+            futex_double_unlock(hb1, hb2);
+            return -EFAULT;
+        }
+
+        if (cur != *cmpval) {
+            futex_double_unlock(hb1, hb2);
+            return -EAGAIN;
+        }
+    }
+
+    list_for_each_safe(pos, n, &hb1->chain) {
+        futex_q_t *q = list_entry(pos, futex_q_t, list);
+
+        if (!futex_match(&q->key, &key1)) {
+            continue;
+        }
+
+        if (woken < nr_wake) {
+            /* Wake the first waiters */
+            futex_mark_woken(q, &wake_list);
+            woken++;
+        } else if (requeued < nr_requeue) {
+            /* Move the rest to the second futex without waking them */
+            q->key = key2;
+            if (hb1 != hb2) {
+                list_del(&q->list);
+                hb1->nr_waiters--;
+                list_add_tail(&q->list, &hb2->chain);
+                hb2->nr_waiters++;
+                q->bucket = hb2;
             }
+            requeued++;
+        } else {
+            break;
+        }
+    }
+
+    futex_double_unlock(hb1, hb2);
+
+    futex_wake_up(wake_list);
+
+    return woken + requeued;
+}
+
+/**
+ * Apply a FUTEX_WAKE_OP operation to the second futex
+ *
+ * @param uaddr User address of the second futex
+ * @param encoded Encoded operation
+ * @return 1 if the comparison holds, 0 if not, negative error code on failure
+ */
+static int futex_atomic_op(int *uaddr, u32 encoded) {
+    int op = (encoded >> 28) & 0xf;
+    int cmp = (encoded >> 24) & 0xf;
+    int oparg = (int)(encoded << 8) >> 20;
+    int cmparg = (int)(encoded << 20) >> 20;
+    int old, new;
+
+    /* The operand may be a shift count */
+    if (op & FUTEX_OP_OPARG_SHIFT) {
+        if (oparg < 0 || oparg > 31) {
+            return -EINVAL;
         }
+        oparg = 1 << oparg;
+        op &= ~FUTEX_OP_OPARG_SHIFT;
+    }
+
+    if (!access_ok(VERIFY_WRITE, uaddr, sizeof(int))) {
+        return -EFAULT;
     }
 
+    /* Update the word atomically against user space */
+    do {
+        old = *(volatile int *)uaddr;
+
+        switch (op) {
+            case FUTEX_OP_SET:
+                new = oparg;
+                break;
+            case FUTEX_OP_ADD:
+                new = old + oparg;
+                break;
+            case FUTEX_OP_OR:
+                new = old | oparg;
+                break;
+            case FUTEX_OP_ANDN:
+                new = old & ~oparg;
+                break;
+            case FUTEX_OP_XOR:
+                new = old ^ oparg;
+                break;
+            default:
+                return -ENOSYS;
+        }
+    } while (__sync_val_compare_and_swap(uaddr, old, new) != old);
+
+    /* Compare the old value */
+    switch (cmp) {
+        case FUTEX_OP_CMP_EQ:
+            return old == cmparg;
+        case FUTEX_OP_CMP_NE:
+            return old != cmparg;
+        case FUTEX_OP_CMP_LT:
+            return old < cmparg;
+        case FUTEX_OP_CMP_LE:
+            return old <= cmparg;
+        case FUTEX_OP_CMP_GT:
+            return old > cmparg;
+        case FUTEX_OP_CMP_GE:
+            return old >= cmparg;
+        default:
+            return -ENOSYS;
+    }
+}
+
+/* Futex wake operation system call */
+static int futex_wake_op(int *uaddr, int flags, int *uaddr2, int nr_wake, int nr_wake2, u32 encoded) {
+    futex_key_t key1, key2;
+    thread_t *wake_list = NULL;
+
+    int ret = futex_get_key(uaddr, flags & FUTEX_PRIVATE_FLAG, &key1);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = futex_get_key(uaddr2, flags & FUTEX_PRIVATE_FLAG, &key2);
+    if (ret < 0) {
+        return ret;
+    }
+
+    futex_bucket_t *hb1 = futex_hash(&key1);
+    futex_bucket_t *hb2 = futex_hash(&key2);
+
+    futex_double_lock(hb1, hb2);
+
+    /* Update the second futex */
+    int cond = futex_atomic_op(uaddr2, encoded);
+    if (cond < 0) {
+        futex_double_unlock(hb1, hb2);
+        return cond;
+    }
+
+    /* Wake the first futex, and the second if the old value matched */
+    int count = futex_wake_locked(hb1, &key1, nr_wake, FUTEX_BITSET_MATCH_ANY, &wake_list);
+    if (cond) {
+        count += futex_wake_locked(hb2, &key2, nr_wake2, FUTEX_BITSET_MATCH_ANY, &wake_list);
+    }
+
+    futex_double_unlock(hb1, hb2);
+
+    futex_wake_up(wake_list);
+
     return count;
 }
 
-/* Futex system call */
-long sys_futex(long uaddr, long op, long val, long timeout, long uaddr2, long val3) {
-    /* Fast user-space locking */
-    int cmd = op & 0xf;
+/**
+ * Find the PI state of a futex
+ *
+ * @param hb Locked bucket
+ * @param key Futex key
+ * @return PI state, or NULL if the futex has none
+ */
+static futex_pi_state_t *futex_find_pi_state(futex_bucket_t *hb, const futex_key_t *key) {
+    futex_pi_state_t *ps;
 
-    /* Check if the futex address is valid */
-    if (uaddr == 0) {
-        return -EINVAL;
+    list_for_each_entry(ps, &hb->pi_states, list) {
+        if (futex_match(&ps->key, key)) {
+            return ps;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Drop a reference to a PI state
+ *
+ * @param ps PI state, its bucket must be locked
+ */
+static void futex_put_pi_state(futex_pi_state_t *ps) {
+    /* The last user leaves no waiters behind on the rt_mutex */
+    if (--ps->refcount == 0) {
+        list_del(&ps->list);
+        thread_put(ps->owner);
+        kfree(ps);
+    }
+}
+
+/**
+ * Compare and exchange a futex word
+ *
+ * @param uaddr User address of the futex
+ * @param old Expected value
+ * @param new New value
+ * @param cur Set to the value found
+ * @return 0 on success, negative error code on failure
+ */
+static int futex_cmpxchg_value(int *uaddr, u32 old, u32 new, u32 *cur) {
+    if (!access_ok(VERIFY_WRITE, uaddr, sizeof(u32))) {
+        return -EFAULT;
+    }
+
+    *cur = __sync_val_compare_and_swap((volatile u32 *)uaddr, old, new);
+
+    return 0;
+}
+
+/* Futex lock with priority inheritance system call */
+static int futex_lock_pi(int *uaddr, int flags, struct timespec *timeout, int trylock) {
+    futex_key_t key;
+    futex_pi_state_t *ps;
+    futex_pi_state_t *new_ps = NULL;
+    unsigned long irq_flags;
+    u64 ms = 0;
+    u32 uval, cur;
+    int ret;
+
+    /* The timeout is an absolute CLOCK_REALTIME time */
+    if (timeout != NULL) {
+        ret = futex_timeout_ms(timeout, 1, 1, &ms);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    ret = futex_get_key(uaddr, flags & FUTEX_PRIVATE_FLAG, &key);
+    if (ret < 0) {
+        return ret;
+    }
+
+    thread_t *thread = thread_self();
+    u32 tid = thread->tid & FUTEX_TID_MASK;
+    futex_bucket_t *hb = futex_hash(&key);
+
+    /* Allocate up front, the state is set up under the bucket lock */
+    if (!trylock) {
+        new_ps = kmalloc(sizeof(futex_pi_state_t), MEM_KERNEL | MEM_ZERO);
+        if (new_ps == NULL) {
+            return -ENOMEM;
+        }
+    }
+
+    local_irq_save(irq_flags);
+    spin_lock(&hb->lock);
+
+    for (;;) {
+        if (copy_from_user(&uval, uaddr, sizeof(u32)) != 0) {
+            ret = -EFAULT;
+            goto out_unlock;
+        }
+
+        ps = futex_find_pi_state(hb, &key);
+
+        if ((uval & FUTEX_TID_MASK) == tid) {
+            ret = -EDEADLK;
+            goto out_unlock;
+        }
+
+        /* Free with nobody queued in the kernel, so take it as user space would */
+        if ((uval & FUTEX_TID_MASK) == 0 && ps == NULL) {
+            ret = futex_cmpxchg_value(uaddr, uval, tid, &cur);
+            if (ret < 0 || cur == uval) {
+                goto out_unlock;
+            }
+            continue;
+        }
+
+        if (trylock) {
+            ret = -EAGAIN;
+            goto out_unlock;
+        }
+
+        /* Make the holder come to the kernel to unlock */
+        if (!(uval & FUTEX_WAITERS)) {
+            ret = futex_cmpxchg_value(uaddr, uval, uval | FUTEX_WAITERS, &cur);
+            if (ret < 0) {
+                goto out_unlock;
+            }
+            if (cur != uval) {
+                continue;
+            }
+        }
+
+        break;
+    }
+
+    /* The first waiter gives the holder a kernel-side lock */
+    if (ps == NULL) {
+        /* Keep the holder around while the PI chain walk may boost it */
+        thread_t *owner = thread_find(uval & FUTEX_TID_MASK);
+        if (owner == NULL) {
+            ret = -ESRCH;
+            goto out_unlock;
+        }
+
+        ps = new_ps;
+        new_ps = NULL;
+        ps->key = key;
+        ps->owner = owner;
+        rt_mutex_init_proxy_locked(&ps->lock, owner);
+        list_add_tail(&ps->list, &hb->pi_states);
+    }
+
+    ps->refcount++;
+    spin_unlock(&hb->lock);
+    local_irq_restore(irq_flags);
+
+    /* Wait in priority order, boosting the holder */
+    if (timeout != NULL) {
+        ret = rt_mutex_timed_lock(&ps->lock, ms);
+    } else {
+        ret = rt_mutex_lock(&ps->lock);
+    }
+
+    local_irq_save(irq_flags);
+    spin_lock(&hb->lock);
+
+    /* Publish ourselves as the holder, flagged while others still use the state */
+    if (ret == 0) {
+        u32 nval = tid;
+        if (ps->refcount > 1 || ps->lock.nr_waiters != 0) {
+            nval |= FUTEX_WAITERS;
+        }
+
+        do {
+            if (copy_from_user(&uval, uaddr, sizeof(u32)) != 0) {
+                ret = -EFAULT;
+                break;
+            }
+            ret = futex_cmpxchg_value(uaddr, uval, nval, &cur);
+        } while (ret == 0 && cur != uval);
+    }
+
+    futex_put_pi_state(ps);
+
+out_unlock:
+    spin_unlock(&hb->lock);
+    local_irq_restore(irq_flags);
+
+    if (new_ps != NULL) {
+        kfree(new_ps);
+    }
+
+    return ret;
+}
+
+/* Futex unlock with priority inheritance system call */
+static int futex_unlock_pi(int *uaddr, int flags) {
+    futex_key_t key;
+    unsigned long irq_flags;
+    u32 uval, cur;
+
+    int ret = futex_get_key(uaddr, flags & FUTEX_PRIVATE_FLAG, &key);
+    if (ret < 0) {
+        return ret;
+    }
+
+    u32 tid = thread_self()->tid & FUTEX_TID_MASK;
+    futex_bucket_t *hb = futex_hash(&key);
+
+    local_irq_save(irq_flags);
+    spin_lock(&hb->lock);
+
+    for (;;) {
+        if (copy_from_user(&uval, uaddr, sizeof(u32)) != 0) {
+            ret = -EFAULT;
+            goto out_unlock;
+        }
+
+        /* Only the holder may unlock */
+        if ((uval & FUTEX_TID_MASK) != tid) {
+            ret = -EPERM;
+            goto out_unlock;
+        }
+
+        futex_pi_state_t *ps = futex_find_pi_state(hb, &key);
+
+        if (ps == NULL) {
+            /* Nobody waits in the kernel any more */
+            ret = futex_cmpxchg_value(uaddr, uval, 0, &cur);
+            if (ret < 0 || cur == uval) {
+                goto out_unlock;
+            }
+            continue;
+        }
+
+        /*
+         * Leave the word ownerless but flagged until the new holder
+         * publishes itself, so nobody takes it behind the waiters' backs.
+         */
+        ret = futex_cmpxchg_value(uaddr, uval, FUTEX_WAITERS, &cur);
+        if (ret < 0) {
+            goto out_unlock;
+        }
+        if (cur != uval) {
+            continue;
+        }
+
+        /* Hand the rt_mutex over outside the bucket lock, the wakeup may switch */
+        ps->refcount++;
+        spin_unlock(&hb->lock);
+        local_irq_restore(irq_flags);
+
+        ret = rt_mutex_unlock(&ps->lock);
+
+        local_irq_save(irq_flags);
+        spin_lock(&hb->lock);
+        futex_put_pi_state(ps);
+        goto out_unlock;
+    }
+
+out_unlock:
+    spin_unlock(&hb->lock);
+    local_irq_restore(irq_flags);
+
+    return ret;
+}
+
+/**
+ * Perform a futex operation
+ *
+ * For the requeue and wake-op commands the timeout argument carries a
+ * second count, as in the system call ABI.
+ *
+ * @param uaddr User address of the futex
+ * @param op Operation and flags
+ * @param val Operation argument
+ * @param timeout Timeout, or second count
+ * @param uaddr2 User address of the second futex
+ * @param val3 Third argument
+ * @return Operation result, or negative error code on failure
+ */
+int futex_futex(int *uaddr, int op, int val, struct timespec *timeout, int *uaddr2, int val3) {
+    int cmd = op & FUTEX_CMD_MASK;
+    int flags = op & (FUTEX_PRIVATE_FLAG | FUTEX_CLOCK_REALTIME);
+    int val2 = (int)(long)timeout;
+
+    /* Only absolute waits can use the real-time clock */
+    if ((flags & FUTEX_CLOCK_REALTIME) && cmd != FUTEX_WAIT_BITSET) {
+        return -ENOSYS;
     }
 
     /* Process the futex operation */
     switch (cmd) {
         case FUTEX_WAIT:
-            /* Wait on a futex */
-            return futex_wait((int *)uaddr, val, (struct timespec *)timeout);
+            /* Wait on a futex, relative timeout */
+            return futex_wait(uaddr, flags, val, timeout, FUTEX_BITSET_MATCH_ANY, 0);
+
+        case FUTEX_WAIT_BITSET:
+            /* Wait on a futex with bitset, absolute timeout */
+            return futex_wait(uaddr, flags, val, timeout, (u32)val3, 1);
 
         case FUTEX_WAKE:
             /* Wake up threads waiting on a futex */
-            return futex_wake((int *)uaddr, val);
+            return futex_wake(uaddr, flags, val, FUTEX_BITSET_MATCH_ANY);
 
-        case FUTEX_FD:
-            /* Create a file descriptor for a futex */
-            return -ENOSYS;
+        case FUTEX_WAKE_BITSET:
+            /* Wake up threads waiting on a futex with bitset */
+            return futex_wake(uaddr, flags, val, (u32)val3);
 
         case FUTEX_REQUEUE:
             /* Requeue threads waiting on a futex */
-            return -ENOSYS;
+            return futex_requeue(uaddr, flags, uaddr2, val, val2, NULL);
 
         case FUTEX_CMP_REQUEUE:
             /* Requeue threads waiting on a futex with compare */
-            return -ENOSYS;
+            return futex_requeue(uaddr, flags, uaddr2, val, val2, &val3);
 
         case FUTEX_WAKE_OP:
             /* Wake up threads waiting on a futex with operation */
+            return futex_wake_op(uaddr, flags, uaddr2, val, val2, (u32)val3);
+
+        case FUTEX_FD:
+            /* Create a file descriptor for a futex */
             return -ENOSYS;
 
         case FUTEX_LOCK_PI:
             /* Lock a futex with priority inheritance */
-            return -ENOSYS;
+            return futex_lock_pi(uaddr, flags, timeout, 0);
 
         case FUTEX_UNLOCK_PI:
             /* Unlock a futex with priority inheritance */
-            return -ENOSYS;
+            return futex_unlock_pi(uaddr, flags);
 
         case FUTEX_TRYLOCK_PI:
             /* Try to lock a futex with priority inheritance */
-            return -ENOSYS;
-
-        case FUTEX_WAIT_BITSET:
-            /* Wait on a futex with bitset */
-            return -ENOSYS;
-
-        case FUTEX_WAKE_BITSET:
-            /* Wake up threads waiting on a futex with bitset */
-            return -ENOSYS;
+            return futex_lock_pi(uaddr, flags, NULL, 1);
 
         case FUTEX_WAIT_REQUEUE_PI:
             /* Wait on a futex and requeue with priority inheritance */
@@ -156,8 +974,21 @@ long sys_futex(long uaddr, long op, long val, long timeout, long uaddr2, long va
     }
 }
 
+/* Futex system call */
+long sys_futex(long uaddr, long op, long val, long timeout, long uaddr2, long val3) {
+    /* Fast user-space locking */
+    return futex_futex((int *)uaddr, op, val, (struct timespec *)timeout, (int *)uaddr2, val3);
+}
+
 /* Initialize futex-related system calls */
 void futex_syscalls_init(void) {
+    /* Initialize the hash table */
+    for (int i = 0; i < FUTEX_HASH_SIZE; i++) {
+        INIT_LIST_HEAD(&futex_queues[i].chain);
+        INIT_LIST_HEAD(&futex_queues[i].pi_states);
+        futex_queues[i].nr_waiters = 0;
+    }
+
     /* Register futex-related system calls */
     syscall_register(SYS_FUTEX, sys_futex);
 }
@@ -74,17 +74,8 @@ long sys_nanosleep(long req, long rem, long arg3, long arg4, long arg5, long arg
         return -EINVAL;
     }
 
-    /* Sleep */
-    unsigned long timeout = tp->tv_sec * 1000 + tp->tv_nsec / 1000000;
-    schedule_timeout_interruptible(timeout);
-
-    /* Set the remaining time */
-    if (rmtp != NULL) {
-        rmtp->tv_sec = 0;
-        rmtp->tv_nsec = 0;
-    }
-
-    return 0;
+    /* Sleep on a high resolution timer */
+    return time_clock_nanosleep(CLOCK_MONOTONIC, 0, tp, rmtp);
 }
 
 /* Time system call */
@@ -113,13 +104,8 @@ long sys_clock_gettime(long clockid, long tp, long arg3, long arg4, long arg5, l
     /* Get the time */
     switch (clockid) {
         case CLOCK_REALTIME:
-            tsp->tv_sec = time_get_seconds();
-            tsp->tv_nsec = time_get_nanoseconds();
-            break;
         case CLOCK_MONOTONIC:
-            tsp->tv_sec = time_get_monotonic_seconds();
-            tsp->tv_nsec = time_get_monotonic_nanoseconds();
-            break;
+            return time_clock_gettime(clockid, tsp);
         case CLOCK_PROCESS_CPUTIME_ID:
             tsp->tv_sec = task_current()->utime / 1000000000;
             tsp->tv_nsec = task_current()->utime % 1000000000;
@@ -186,9 +172,7 @@ long sys_clock_getres(long clockid, long res, long arg3, long arg4, long arg5, l
     switch (clockid) {
         case CLOCK_REALTIME:
         case CLOCK_MONOTONIC:
-            resp->tv_sec = 0;
-            resp->tv_nsec = 1; /* 1 nanosecond resolution */
-            break;
+            return time_clock_getres(clockid, resp) < 0 ? -EINVAL : 0;
         case CLOCK_PROCESS_CPUTIME_ID:
         case CLOCK_THREAD_CPUTIME_ID:
             resp->tv_sec = 0;
@@ -212,17 +196,8 @@ long sys_clock_nanosleep(long clockid, long flags, long req, long rem, long arg5
         return -EINVAL;
     }
 
-    /* Sleep */
-    unsigned long timeout = tp->tv_sec * 1000 + tp->tv_nsec / 1000000;
-    schedule_timeout_interruptible(timeout);
-
-    /* Set the remaining time */
-    if (rmtp != NULL) {
-        rmtp->tv_sec = 0;
-        rmtp->tv_nsec = 0;
-    }
-
-    return 0;
+    /* Sleep on a high resolution timer */
+    return time_clock_nanosleep(clockid, flags, tp, rmtp);
 }
 
 /* Initialize time-related system calls */
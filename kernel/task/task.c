@@ -14,6 +14,8 @@
 #include <horizon/printk.h>
 #include <horizon/errno.h>
 #include <horizon/spinlock.h>
+#include <horizon/rculist.h>
+#include <horizon/stddef.h>
 
 /* Define NULL if not defined */
 #ifndef NULL
@@ -52,10 +54,10 @@ typedef struct thread {
     struct list_head list;         /* List entry */
 } thread_t;
 
-/* Task list */
+/* Task list, readers walk it under RCU */
 static list_head_t task_list;
 
-/* Task lock */
+/* Task lock, serializes changes to the task list */
 static spinlock_t task_lock = SPIN_LOCK_INITIALIZER;
 
 /* Next PID */
@@ -214,9 +216,9 @@ task_struct_t *task_create(const char *name) {
     /* Add the task to the parent's children */
     list_add(&task->sibling, &current->children);
 
-    /* Add the task to the task list */
+    /* Publish the task on the task list */
     spin_lock(&task_lock);
-    list_add(&task->tasks, &task_list);
+    list_add_rcu(&task->tasks, &task_list);
     spin_unlock(&task_lock);
 
     printk(KERN_INFO "TASK: Created task '%s' (PID %d)\n", task->comm, task->pid);
@@ -224,6 +226,15 @@ task_struct_t *task_create(const char *name) {
     return task;
 }
 
+/**
+ * Free a task after a grace period
+ *
+ * @param head RCU head of the task
+ */
+static void task_free_rcu(struct rcu_head *head) {
+    kfree(container_of(head, task_struct_t, rcu));
+}
+
 /**
  * Destroy a task
  *
@@ -254,9 +265,9 @@ int task_destroy(task_struct_t *task) {
         }
     }
 
-    /* Remove the task from the task list */
+    /* Remove the task from the task list, lookups may still see it */
     spin_lock(&task_lock);
-    list_del(&task->tasks);
+    list_del_rcu(&task->tasks);
     spin_unlock(&task_lock);
 
     /* Remove the task from the parent's children */
@@ -287,8 +298,8 @@ int task_destroy(task_struct_t *task) {
         kfree(task->stack);
     }
 
-    /* Free the task */
-    kfree(task);
+    /* Free the task once lookups in progress are done with it */
+    call_rcu(&task->rcu, task_free_rcu);
 
     return 0;
 }
@@ -311,20 +322,18 @@ task_struct_t *task_current(void) {
 task_struct_t *task_get(u32 pid) {
     task_struct_t *task = NULL;
 
-    /* Lock the task list */
-    spin_lock(&task_lock);
+    rcu_read_lock();
 
     /* Find the task */
-    list_for_each_entry(task, &task_list, tasks) {
+    list_for_each_entry_rcu(task, &task_list, tasks) {
         if (task->pid == pid) {
             /* Found the task */
-            spin_unlock(&task_lock);
+            rcu_read_unlock();
             return task;
         }
     }
 
-    /* Unlock the task list */
-    spin_unlock(&task_lock);
+    rcu_read_unlock();
 
     return NULL;
 }
@@ -611,13 +620,33 @@ int task_signal_all(int sig) {
 
     /* Send the signal to all tasks */
     task_struct_t *task;
-    list_for_each_entry(task, &task_list, tasks) {
+    rcu_read_lock();
+    list_for_each_entry_rcu(task, &task_list, tasks) {
         task_signal(task, sig);
     }
+    rcu_read_unlock();
 
     return 0;
 }
 
+/**
+ * Call a function for every task
+ *
+ * The task list is walked under RCU, so the function must not sleep.
+ *
+ * @param fn Function to call
+ * @param data Argument passed to the function
+ */
+void task_for_each(void (*fn)(task_struct_t *task, void *data), void *data) {
+    task_struct_t *task;
+
+    rcu_read_lock();
+    list_for_each_entry_rcu(task, &task_list, tasks) {
+        fn(task, data);
+    }
+    rcu_read_unlock();
+}
+
 /**
  * Create a thread in a task
  *
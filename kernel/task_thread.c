@@ -89,6 +89,12 @@ thread_t *task_create_thread(task_struct_t *task, void *(*start_routine)(void *)
     INIT_LIST_HEAD(&thread->thread_list);
     INIT_LIST_HEAD(&thread->process_threads);
     
+    spin_lock_init(&thread->pi_lock);
+    
+    /* The joiner, or the thread itself once detached, holds the first reference */
+    atomic_set(&thread->usage, 1);
+    thread_register(thread);
+    
     /* Add thread to task */
     task->thread_count++;
     list_add(&thread->process_threads, &task->threads);
@@ -125,12 +131,12 @@ int task_exit_thread(task_struct_t *task, thread_t *thread, void *retval) {
     /* Remove thread from scheduler */
     sched_remove_thread(thread);
     
-    /* If thread is detached, free resources */
+    /* Nobody finds the thread by TID from here on */
+    thread_unregister(thread);
+    
+    /* If thread is detached, drop its own reference */
     if (thread->flags & THREAD_DETACHED) {
-        /* Free thread resources */
-        kfree(thread->context);
-        kfree(thread->kernel_stack);
-        kfree(thread);
+        thread_put(thread);
     }
     
     return 0;
@@ -167,10 +173,8 @@ int task_join_thread(task_struct_t *task, thread_t *thread, void **retval) {
             *retval = thread->retval;
         }
         
-        /* Free thread resources */
-        kfree(thread->context);
-        kfree(thread->kernel_stack);
-        kfree(thread);
+        /* Drop the joiner's reference */
+        thread_put(thread);
         
         return 0;
     }
@@ -186,10 +190,8 @@ int task_join_thread(task_struct_t *task, thread_t *thread, void **retval) {
         *retval = thread->retval;
     }
     
-    /* Free thread resources */
-    kfree(thread->context);
-    kfree(thread->kernel_stack);
-    kfree(thread);
+    /* Drop the joiner's reference */
+    thread_put(thread);
     
     return 0;
 }
@@ -12,6 +12,8 @@
 #include <horizon/string.h>
 #include <horizon/sched.h>
 #include <horizon/time.h>
+#include <horizon/spinlock.h>
+#include <horizon/irqflags.h>
 
 /* Thread ID counter */
 static u32 next_tid = 1;
@@ -22,6 +24,12 @@ static u32 next_tsd_key = 1;
 /* Thread-specific data key destructors */
 static void (*tsd_destructors[256])(void *);
 
+/* Live threads, for lookups by TID */
+static list_head_t thread_all = LIST_HEAD_INIT(thread_all);
+
+/* Protects thread_all */
+static spinlock_t thread_all_lock = SPIN_LOCK_INITIALIZER;
+
 /* Thread initialization */
 void thread_init(void) {
     /* Initialize thread-specific data destructors */
@@ -50,6 +58,12 @@ void thread_init(void) {
             INIT_LIST_HEAD(&main_thread->thread_list);
             INIT_LIST_HEAD(&main_thread->process_threads);
             
+            spin_lock_init(&main_thread->pi_lock);
+            
+            /* The task holds the first reference */
+            atomic_set(&main_thread->usage, 1);
+            thread_register(main_thread);
+            
             /* Add thread to task */
             current_task->main_thread = main_thread;
             current_task->thread_count = 1;
@@ -89,6 +103,7 @@ thread_t *thread_create(void *(*start_routine)(void *), void *arg, u32 flags) {
     thread->dynamic_priority = THREAD_PRIO_NORMAL;
     thread->policy = THREAD_SCHED_OTHER;
     thread->time_slice = 100; /* 100 ms */
+    thread->cpus_allowed = THREAD_CPUS_ALL;
     thread->start_time = get_timestamp();
     thread->start_routine = start_routine;
     thread->arg = arg;
@@ -134,6 +149,12 @@ thread_t *thread_create(void *(*start_routine)(void *), void *arg, u32 flags) {
     INIT_LIST_HEAD(&thread->thread_list);
     INIT_LIST_HEAD(&thread->process_threads);
     
+    spin_lock_init(&thread->pi_lock);
+    
+    /* The joiner, or the thread itself once detached, holds the first reference */
+    atomic_set(&thread->usage, 1);
+    thread_register(thread);
+    
     /* Add thread to task */
     task_struct_t *task = task_current();
     task->thread_count++;
@@ -191,10 +212,8 @@ int thread_join(thread_t *thread, void **retval) {
             *retval = thread->retval;
         }
         
-        /* Free thread resources */
-        kfree(thread->context);
-        kfree(thread->kernel_stack);
-        kfree(thread);
+        /* Drop the joiner's reference */
+        thread_put(thread);
         
         return 0;
     }
@@ -210,10 +229,8 @@ int thread_join(thread_t *thread, void **retval) {
         *retval = thread->retval;
     }
     
-    /* Free thread resources */
-    kfree(thread->context);
-    kfree(thread->kernel_stack);
-    kfree(thread);
+    /* Drop the joiner's reference */
+    thread_put(thread);
     
     return 0;
 }
@@ -291,12 +308,12 @@ int thread_exit(void *retval) {
     /* Remove thread from scheduler */
     sched_remove_thread(thread);
     
-    /* If thread is detached, free resources */
+    /* Nobody finds the thread by TID from here on */
+    thread_unregister(thread);
+    
+    /* If thread is detached, drop its own reference */
     if (thread->flags & THREAD_DETACHED) {
-        /* Free thread resources */
-        kfree(thread->context);
-        kfree(thread->kernel_stack);
-        kfree(thread);
+        thread_put(thread);
     }
     
     /* Switch to next thread */
@@ -319,6 +336,92 @@ thread_t *thread_self(void) {
     return task_current_thread(task);
 }
 
+/**
+ * Make a thread visible to thread_find()
+ * 
+ * @param thread Thread
+ */
+void thread_register(thread_t *thread) {
+    unsigned long flags;
+    
+    local_irq_save(flags);
+    spin_lock(&thread_all_lock);
+    list_add_tail(&thread->thread_list, &thread_all);
+    spin_unlock(&thread_all_lock);
+    local_irq_restore(flags);
+}
+
+/**
+ * Hide an exiting thread from thread_find()
+ * 
+ * @param thread Thread
+ */
+void thread_unregister(thread_t *thread) {
+    unsigned long flags;
+    
+    local_irq_save(flags);
+    spin_lock(&thread_all_lock);
+    list_del_init(&thread->thread_list);
+    spin_unlock(&thread_all_lock);
+    local_irq_restore(flags);
+}
+
+/**
+ * Find a live thread by TID in any task
+ * 
+ * The thread cannot be freed while the caller holds the reference taken
+ * here, which it drops with thread_put().
+ * 
+ * @param tid Thread ID
+ * @return Thread with a reference held, or NULL if not found
+ */
+thread_t *thread_find(tid_t tid) {
+    thread_t *thread;
+    thread_t *found = NULL;
+    unsigned long flags;
+    
+    local_irq_save(flags);
+    spin_lock(&thread_all_lock);
+    
+    list_for_each_entry(thread, &thread_all, thread_list) {
+        if (thread->tid == tid) {
+            thread_get(thread);
+            found = thread;
+            break;
+        }
+    }
+    
+    spin_unlock(&thread_all_lock);
+    local_irq_restore(flags);
+    
+    return found;
+}
+
+/**
+ * Take a reference to a thread
+ * 
+ * @param thread Thread
+ */
+void thread_get(thread_t *thread) {
+    atomic_inc(&thread->usage);
+}
+
+/**
+ * Drop a reference to a thread, freeing it with the last one
+ * 
+ * @param thread Thread
+ */
+void thread_put(thread_t *thread) {
+    if (thread == NULL || atomic_dec_return(&thread->usage) != 0) {
+        return;
+    }
+    
+    /* Free thread resources */
+    kfree(thread->context);
+    kfree(thread->kernel_stack);
+    kfree(thread);
+}
+
 /**
  * Yield the CPU
  * 
@@ -341,17 +444,8 @@ int thread_sleep(u64 ms) {
     /* Get current thread */
     thread_t *thread = thread_self();
     
-    /* Set wakeup time */
-    thread->wakeup_time = get_timestamp() + ms * 1000;
-    
-    /* Set thread state */
-    thread->state = THREAD_STATE_SLEEPING;
-    
-    /* Remove thread from scheduler */
-    sched_remove_thread(thread);
-    
-    /* Switch to next thread */
-    sched_yield();
+    /* Queue the thread on the sleeper tree and switch to the next thread */
+    sched_sleep_thread(thread, ms);
     
     return 0;
 }
@@ -373,11 +467,8 @@ int thread_wakeup(thread_t *thread) {
         return -EINVAL;
     }
     
-    /* Wake up thread */
-    thread->state = THREAD_STATE_READY;
-    
-    /* Add thread to scheduler */
-    sched_add_thread(thread);
+    /* Take the thread off the sleeper tree and make it runnable */
+    sched_wakeup_thread(thread);
     
     return 0;
 }
@@ -482,8 +573,8 @@ int thread_set_affinity(thread_t *thread, u32 cpu) {
         return -EINVAL;
     }
     
-    /* Set CPU */
-    thread->cpu = cpu;
+    /* Pin the thread to the CPU */
+    sched_set_affinity(thread, cpu);
     
     return 0;
 }
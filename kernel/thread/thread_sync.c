@@ -9,17 +9,183 @@
 #include <horizon/task.h>
 #include <horizon/thread.h>
 #include <horizon/sync.h>
+#include <horizon/rtmutex.h>
 #include <horizon/sched.h>
 #include <horizon/mm.h>
 #include <horizon/spinlock.h>
 #include <horizon/printk.h>
+#include <horizon/string.h>
+#include <horizon/irqflags.h>
+#include <horizon/time.h>
 #include <horizon/errno.h>
+#include <horizon/config.h>
+#include <horizon/smp.h>
+#include <horizon/mm/cache.h>
 
 /* Define NULL if not defined */
 #ifndef NULL
 #define NULL ((void *)0)
 #endif
 
+/* Mutex contention statistics of one CPU, on a cache line of its own */
+typedef struct mutex_cpu_stats {
+    mutex_stats_t stats;
+} __attribute__((aligned(CACHE_LINE_SIZE))) mutex_cpu_stats_t;
+
+/* Per-CPU mutex contention statistics, summed when read */
+static mutex_cpu_stats_t mutex_stats[CONFIG_NR_CPUS];
+
+/* Count in this CPU's statistics, interrupts off so the CPU cannot change */
+#define mutex_stat_add(field, n) \
+    do { \
+        unsigned long __flags; \
+        local_irq_save(__flags); \
+        mutex_stats[smp_processor_id()].stats.field += (n); \
+        local_irq_restore(__flags); \
+    } while (0)
+
+/**
+ * Count an acquisition that slept in this CPU's statistics
+ * 
+ * @param waited Time spent waiting, in microseconds
+ */
+static void mutex_stat_slept(u64 waited) {
+    unsigned long flags;
+    
+    local_irq_save(flags);
+    
+    mutex_stats_t *stats = &mutex_stats[smp_processor_id()].stats;
+    stats->slept++;
+    stats->wait_time += waited;
+    if (waited > stats->max_wait_time) {
+        stats->max_wait_time = waited;
+    }
+    
+    local_irq_restore(flags);
+}
+
+/**
+ * Relax the CPU while spinning
+ */
+static inline void mutex_cpu_relax(void) {
+    __asm__ volatile("pause" ::: "memory");
+}
+
+/**
+ * Check if spinning on a mutex owner can pay off
+ * 
+ * Only an owner running on another CPU can release the mutex while we
+ * spin. One that sleeps or waits for our CPU cannot.
+ * 
+ * @param owner Mutex owner
+ * @param thread Spinning thread
+ * @return 1 if the owner is running elsewhere, 0 if not
+ */
+static inline int mutex_owner_running(thread_t *owner, thread_t *thread) {
+    return owner != NULL && owner != thread && owner->on_cpu;
+}
+
+/**
+ * Join the queue of spinners
+ * 
+ * Spinners queue MCS style and each polls its own node, so only the head
+ * of the queue polls the owner word and the lock's cache line does not
+ * bounce between every spinning CPU.
+ * 
+ * @param mutex Mutex
+ * @param node Our queue node
+ */
+static void mutex_spin_lock(mutex_t *mutex, mutex_spin_node_t *node) {
+    node->next = NULL;
+    node->locked = 0;
+    
+    /* Append ourselves, an empty queue makes us the head */
+    mutex_spin_node_t *prev = __sync_lock_test_and_set(&mutex->spin_tail, node);
+    if (prev == NULL) {
+        return;
+    }
+    
+    prev->next = node;
+    
+    /* Wait for our predecessor to pass the head on */
+    while (!node->locked) {
+        mutex_cpu_relax();
+    }
+}
+
+/**
+ * Leave the queue of spinners
+ * 
+ * @param mutex Mutex
+ * @param node Our queue node
+ */
+static void mutex_spin_unlock(mutex_t *mutex, mutex_spin_node_t *node) {
+    if (node->next == NULL) {
+        /* Nobody behind us */
+        if (__sync_bool_compare_and_swap(&mutex->spin_tail, node, NULL)) {
+            return;
+        }
+        
+        /* A successor is linking itself in */
+        while (node->next == NULL) {
+            mutex_cpu_relax();
+        }
+    }
+    
+    node->next->locked = 1;
+}
+
+/**
+ * Spin on a running mutex owner
+ * 
+ * A short critical section is over sooner than a block and wakeup would
+ * take, so wait for the owner as long as it runs on another CPU. Spinning
+ * stops once a starved waiter has been promised the mutex.
+ * 
+ * @param mutex Mutex
+ * @param thread Current thread
+ * @return 1 if the mutex was acquired, 0 if we spun in vain, -1 if we did not spin
+ */
+static int mutex_optimistic_spin(mutex_t *mutex, thread_t *thread) {
+    mutex_spin_node_t node;
+    unsigned long flags;
+    int acquired = 0;
+    u32 polls;
+    
+    /* Nothing to wait for unless the owner runs */
+    if (!mutex_owner_running(rt_mutex_owner(&mutex->base), thread)) {
+        return -1;
+    }
+    
+    /* A spinner preempted in the queue would hold up everybody behind it */
+    local_irq_save(flags);
+    mutex_spin_lock(mutex, &node);
+    
+    for (polls = 0; polls < MUTEX_SPIN_MAX; polls++) {
+        unsigned long word = mutex->base.owner;
+        thread_t *owner = (thread_t *)(word & ~RT_MUTEX_FLAGS);
+        
+        if (owner == NULL) {
+            /* Released, race the woken waiter for it */
+            if (rt_mutex_trylock(&mutex->base) == 0) {
+                acquired = 1;
+                break;
+            }
+        } else if ((word & RT_MUTEX_HANDOFF) || !mutex_owner_running(owner, thread)) {
+            /* Promised to a waiter, or the owner stopped running */
+            break;
+        }
+        
+        mutex_cpu_relax();
+    }
+    
+    mutex_spin_unlock(mutex, &node);
+    mutex_stats[smp_processor_id()].stats.spin_polls += polls;
+    local_irq_restore(flags);
+    
+    return acquired;
+}
+
 /**
  * Initialize a mutex
  * 
@@ -33,9 +199,8 @@ int mutex_init(mutex_t *mutex) {
     }
     
     /* Initialize the mutex */
-    mutex->locked = 0;
-    mutex->owner = NULL;
-    list_init(&mutex->waiters);
+    rt_mutex_init(&mutex->base);
+    mutex->spin_tail = NULL;
     
     return 0;
 }
@@ -53,12 +218,12 @@ int mutex_destroy(mutex_t *mutex) {
     }
     
     /* Check if the mutex is locked */
-    if (mutex->locked) {
+    if (rt_mutex_is_locked(&mutex->base)) {
         return -EBUSY;
     }
     
     /* Check if there are waiters */
-    if (!list_empty(&mutex->waiters)) {
+    if (mutex->base.nr_waiters != 0) {
         return -EBUSY;
     }
     
@@ -68,6 +233,11 @@ int mutex_destroy(mutex_t *mutex) {
 /**
  * Lock a mutex
  * 
+ * The uncontended case is a single compare-and-swap. Under contention we
+ * spin while the owner runs on another CPU, then sleep. Sleeping waiters
+ * queue by priority, and a real-time waiter lends its priority to the
+ * owner until the mutex is handed over.
+ * 
  * @param mutex Mutex to lock
  * @return 0 on success, negative error code on failure
  */
@@ -80,26 +250,32 @@ int mutex_lock(mutex_t *mutex) {
     /* Get the current thread */
     thread_t *thread = thread_self();
     
-    /* Try to lock the mutex */
-    if (__sync_bool_compare_and_swap(&mutex->locked, 0, 1)) {
-        /* Mutex was unlocked, now it's locked */
-        mutex->owner = thread;
+    /* Uncontended */
+    if (__sync_bool_compare_and_swap(&mutex->base.owner, 0, (unsigned long)thread)) {
+        mutex_stat_add(fast, 1);
         return 0;
     }
     
-    /* Check if the mutex is already owned by this thread */
-    if (mutex->owner == thread) {
-        return -EDEADLK;
+    /* Wait for a running owner without leaving the CPU */
+    int spun = mutex_optimistic_spin(mutex, thread);
+    if (spun > 0) {
+        mutex_stat_add(spin_acquired, 1);
+        return 0;
+    }
+    if (spun == 0) {
+        mutex_stat_add(spin_failed, 1);
     }
     
-    /* Add the thread to the waiters list */
-    list_add_tail(&thread->wait_list, &mutex->waiters);
+    /* Sleep, -EDEADLK if we would wait on ourselves */
+    u64 start = get_timestamp();
+    int ret = rt_mutex_lock(&mutex->base);
+    u64 waited = get_timestamp() - start;
     
-    /* Block the thread */
-    sched_block_thread(thread);
+    if (ret == 0) {
+        mutex_stat_slept(waited);
+    }
     
-    /* When the thread is woken up, the mutex is locked */
-    return 0;
+    return ret;
 }
 
 /**
@@ -114,18 +290,15 @@ int mutex_trylock(mutex_t *mutex) {
         return -EINVAL;
     }
     
-    /* Get the current thread */
-    thread_t *thread = thread_self();
-    
     /* Try to lock the mutex */
-    if (__sync_bool_compare_and_swap(&mutex->locked, 0, 1)) {
-        /* Mutex was unlocked, now it's locked */
-        mutex->owner = thread;
-        return 0;
+    int ret = rt_mutex_trylock(&mutex->base);
+    if (ret == 0) {
+        mutex_stat_add(fast, 1);
+    } else {
+        mutex_stat_add(trylock_failed, 1);
     }
     
-    /* Mutex is already locked */
-    return -EBUSY;
+    return ret;
 }
 
 /**
@@ -140,34 +313,58 @@ int mutex_unlock(mutex_t *mutex) {
         return -EINVAL;
     }
     
-    /* Get the current thread */
-    thread_t *thread = thread_self();
-    
-    /* Check if the mutex is owned by this thread */
-    if (mutex->owner != thread) {
-        return -EPERM;
+    /* Release or hand over the mutex, dropping any boost */
+    return rt_mutex_unlock(&mutex->base);
+}
+
+/**
+ * Get mutex contention statistics
+ * 
+ * @param stats Filled in with the statistics
+ */
+void mutex_get_stats(mutex_stats_t *stats) {
+    if (stats == NULL) {
+        return;
     }
     
-    /* Check if there are waiters */
-    if (!list_empty(&mutex->waiters)) {
-        /* Get the first waiter */
-        thread_t *waiter = list_first_entry(&mutex->waiters, thread_t, wait_list);
-        
-        /* Remove the waiter from the list */
-        list_del(&waiter->wait_list);
-        
-        /* Set the new owner */
-        mutex->owner = waiter;
+    memset(stats, 0, sizeof(*stats));
+    
+    /* Sum the CPUs, a racing update may or may not be counted */
+    for (int cpu = 0; cpu < CONFIG_NR_CPUS; cpu++) {
+        const mutex_stats_t *s = &mutex_stats[cpu].stats;
         
-        /* Wake up the waiter */
-        sched_unblock_thread(waiter);
-    } else {
-        /* No waiters, just unlock the mutex */
-        mutex->owner = NULL;
-        mutex->locked = 0;
+        stats->fast += s->fast;
+        stats->spin_acquired += s->spin_acquired;
+        stats->spin_failed += s->spin_failed;
+        stats->slept += s->slept;
+        stats->trylock_failed += s->trylock_failed;
+        stats->spin_polls += s->spin_polls;
+        stats->wait_time += s->wait_time;
+        if (s->max_wait_time > stats->max_wait_time) {
+            stats->max_wait_time = s->max_wait_time;
+        }
     }
+}
+
+/**
+ * Print mutex contention statistics
+ */
+void mutex_print_stats(void) {
+    mutex_stats_t stats;
     
-    return 0;
+    mutex_get_stats(&stats);
+    
+    printk(KERN_INFO "MUTEX: Fast acquisitions: %llu\n", stats.fast);
+    printk(KERN_INFO "MUTEX: Acquired by spinning: %llu\n", stats.spin_acquired);
+    printk(KERN_INFO "MUTEX: Spun then slept: %llu\n", stats.spin_failed);
+    printk(KERN_INFO "MUTEX: Acquired after sleeping: %llu\n", stats.slept);
+    printk(KERN_INFO "MUTEX: Failed trylocks: %llu\n", stats.trylock_failed);
+    printk(KERN_INFO "MUTEX: Spin polls: %llu\n", stats.spin_polls);
+    printk(KERN_INFO "MUTEX: Total wait: %llu us\n", stats.wait_time);
+    printk(KERN_INFO "MUTEX: Longest wait: %llu us\n", stats.max_wait_time);
+    
+    /* The sleeping side */
+    rt_mutex_print_stats();
 }
 
 /**
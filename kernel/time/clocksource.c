@@ -0,0 +1,281 @@
+/**
+ * clocksource.c - Horizon kernel clock source and timekeeping implementation
+ *
+ * This file contains the implementation of the timekeeping. The monotonic
+ * time is kept as the nanoseconds up to the clock source cycle read at the
+ * last tick. A reader adds the cycles since then, scaled by the clock
+ * source's mult and shift. Each tick folds the elapsed cycles into the
+ * base, so the scaled delta stays small enough not to overflow.
+ *
+ * The jiffies clock source is always there. Better ones, like the TSC,
+ * take over once registered, and the time continues from where the old
+ * one left it.
+ *
+ * The timekeeper is under a sequence lock, so reading the time takes no
+ * lock. Every update is also published to the vDSO data page, from which
+ * processes read the time without a system call.
+ */
+
+#include <horizon/kernel.h>
+#include <horizon/types.h>
+#include <horizon/clocksource.h>
+#include <horizon/time.h>
+#include <horizon/timer.h>
+#include <horizon/seqlock.h>
+#include <horizon/vdso.h>
+#include <horizon/irqflags.h>
+#include <horizon/printk.h>
+#include <horizon/list.h>
+#include <horizon/errno.h>
+
+/* Timekeeping state */
+typedef struct timekeeper {
+    clocksource_t *clock;          /* Clock source in use */
+    u64 cycle_last;                /* Cycles at the last update */
+    ktime_t mono;                  /* Monotonic time at cycle_last */
+    ktime_t real_offset;           /* Real time minus monotonic time */
+    seqlock_t lock;                /* Protects all of the above */
+} timekeeper_t;
+
+/* Registered clock sources */
+static list_head_t clocksource_list = LIST_HEAD_INIT(clocksource_list);
+
+/* Timekeeper */
+static timekeeper_t timekeeper = { NULL, 0, 0, 0, SEQLOCK_INITIALIZER };
+
+/**
+ * Read the jiffies counter
+ *
+ * @return Jiffies
+ */
+static u64 clocksource_jiffies_read(void) {
+    return timer_get_jiffies();
+}
+
+/* Jiffies clock source, the fallback */
+static clocksource_t clocksource_jiffies = {
+    .name = "jiffies",
+    .read = clocksource_jiffies_read,
+    .mask = ~0ULL,
+    .rating = 1,
+    .vdso_clock_mode = VDSO_CLOCK_NONE,
+};
+
+/**
+ * Compute the scaling of a clock source
+ *
+ * Picks the largest shift for which CLOCKSOURCE_MAX_IDLE_SEC worth of
+ * cycles still scale without overflowing 64 bits.
+ *
+ * @param cs Clock source
+ * @param freq Counter frequency in Hz
+ */
+void clocksource_calc_mult_shift(clocksource_t *cs, u64 freq) {
+    u64 tmp;
+    u32 sft, sftacc = 32;
+
+    /* Bits left over by the largest cycle count we scale */
+    tmp = ((u64)CLOCKSOURCE_MAX_IDLE_SEC * freq) >> 32;
+    while (tmp) {
+        tmp >>= 1;
+        sftacc--;
+    }
+
+    /* Most precise mult that fits in those bits */
+    for (sft = 32; sft > 0; sft--) {
+        tmp = (u64)NSEC_PER_SEC << sft;
+        tmp += freq / 2;
+        tmp /= freq;
+        if ((tmp >> sftacc) == 0) {
+            break;
+        }
+    }
+
+    cs->mult = (u32)tmp;
+    cs->shift = sft;
+}
+
+/**
+ * Fold the cycles since the last update into the monotonic time
+ *
+ * The caller must hold the timekeeper lock for writing.
+ *
+ * @return Monotonic time now
+ */
+static ktime_t timekeeping_forward(void) {
+    clocksource_t *cs = timekeeper.clock;
+    u64 now = cs->read();
+    u64 delta = (now - timekeeper.cycle_last) & cs->mask;
+
+    timekeeper.cycle_last = now;
+    timekeeper.mono += clocksource_cyc2ns(cs, delta);
+
+    return timekeeper.mono;
+}
+
+/**
+ * Publish the timekeeper to the vDSO
+ *
+ * The caller must hold the timekeeper lock for writing.
+ */
+static void timekeeping_update(void) {
+    vdso_update(timekeeper.clock, timekeeper.cycle_last, timekeeper.mono,
+                timekeeper.real_offset);
+}
+
+/**
+ * Initialize the timekeeping on the jiffies clock source
+ */
+void timekeeping_init(void) {
+    unsigned long flags;
+
+    clocksource_calc_mult_shift(&clocksource_jiffies, timer_get_frequency());
+
+    local_irq_save(flags);
+    write_seqlock(&timekeeper.lock);
+
+    list_add(&clocksource_jiffies.list, &clocksource_list);
+    timekeeper.clock = &clocksource_jiffies;
+    timekeeper.cycle_last = clocksource_jiffies.read();
+    timekeeping_update();
+
+    write_sequnlock(&timekeeper.lock);
+    local_irq_restore(flags);
+}
+
+/**
+ * Register a clock source, switching to it if it is the best
+ *
+ * @param cs Clock source, with mult and shift set
+ * @return 0 on success, negative error code on failure
+ */
+int clocksource_register(clocksource_t *cs) {
+    unsigned long flags;
+
+    if (cs == NULL || cs->read == NULL || cs->mult == 0) {
+        return -EINVAL;
+    }
+
+    local_irq_save(flags);
+    write_seqlock(&timekeeper.lock);
+
+    list_add_tail(&cs->list, &clocksource_list);
+
+    /* Switch over, the new clock counts on from the time reached so far */
+    if (timekeeper.clock == NULL || cs->rating > timekeeper.clock->rating) {
+        if (timekeeper.clock != NULL) {
+            timekeeping_forward();
+        }
+        timekeeper.clock = cs;
+        timekeeper.cycle_last = cs->read();
+        timekeeping_update();
+    }
+
+    write_sequnlock(&timekeeper.lock);
+    local_irq_restore(flags);
+
+    printk(KERN_INFO "Clocksource: registered %s (rating %d), using %s\n",
+           cs->name, cs->rating, clocksource_current());
+
+    return 0;
+}
+
+/**
+ * Get the name of the clock source in use
+ *
+ * @return Clock source name
+ */
+const char *clocksource_current(void) {
+    return timekeeper.clock != NULL ? timekeeper.clock->name : "none";
+}
+
+/**
+ * Fold the elapsed time into the timekeeping, called every tick
+ */
+void timekeeping_tick(void) {
+    unsigned long flags;
+
+    local_irq_save(flags);
+    write_seqlock(&timekeeper.lock);
+
+    if (timekeeper.clock != NULL) {
+        timekeeping_forward();
+        timekeeping_update();
+    }
+
+    write_sequnlock(&timekeeper.lock);
+    local_irq_restore(flags);
+}
+
+/**
+ * Read the timekeeper
+ *
+ * @param offset Set to the real time minus the monotonic time if not NULL
+ * @return Monotonic time
+ */
+static ktime_t timekeeping_read(ktime_t *offset) {
+    ktime_t now, real_offset;
+    u32 seq;
+
+    do {
+        seq = read_seqbegin(&timekeeper.lock);
+
+        now = 0;
+        if (timekeeper.clock != NULL) {
+            clocksource_t *cs = timekeeper.clock;
+            u64 delta = (cs->read() - timekeeper.cycle_last) & cs->mask;
+
+            now = timekeeper.mono + clocksource_cyc2ns(cs, delta);
+        }
+        real_offset = timekeeper.real_offset;
+    } while (read_seqretry(&timekeeper.lock, seq));
+
+    if (offset != NULL) {
+        *offset = real_offset;
+    }
+
+    return now;
+}
+
+/**
+ * Get the monotonic time
+ *
+ * @return Nanoseconds since boot
+ */
+ktime_t ktime_get(void) {
+    return timekeeping_read(NULL);
+}
+
+/**
+ * Get the real time
+ *
+ * @return Nanoseconds since the epoch
+ */
+ktime_t ktime_get_real(void) {
+    ktime_t offset;
+    ktime_t mono = timekeeping_read(&offset);
+
+    return mono + offset;
+}
+
+/**
+ * Set the real time
+ *
+ * @param now Nanoseconds since the epoch
+ */
+void ktime_set_real(ktime_t now) {
+    unsigned long flags;
+
+    local_irq_save(flags);
+    write_seqlock(&timekeeper.lock);
+
+    if (timekeeper.clock != NULL) {
+        timekeeper.real_offset = now - timekeeping_forward();
+    } else {
+        timekeeper.real_offset = now;
+    }
+    timekeeping_update();
+
+    write_sequnlock(&timekeeper.lock);
+    local_irq_restore(flags);
+}
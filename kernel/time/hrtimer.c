@@ -0,0 +1,930 @@
+/**
+ * hrtimer.c - Horizon kernel high resolution timer implementation
+ *
+ * This file contains the implementation of the high resolution timers.
+ * Every CPU keeps a red-black tree of queued timers for each clock, sorted
+ * by expiry in nanoseconds, with the earliest one cached. Once the
+ * architecture has a one-shot clock event, the CPU programs it for the
+ * earliest expiry and runs the expired timers from its interrupt, so they
+ * fire between ticks. Until then they run from the tick.
+ *
+ * A timer may be given a range: it can run anywhere from softexpires to
+ * expires. The tree is sorted by expires, and an interrupt runs every timer
+ * whose softexpires has passed, so timers with overlapping ranges share an
+ * interrupt.
+ */
+
+#include <horizon/kernel.h>
+#include <horizon/types.h>
+#include <horizon/time.h>
+#include <horizon/timer.h>
+#include <horizon/rbtree.h>
+#include <horizon/spinlock.h>
+#include <horizon/irqflags.h>
+#include <horizon/smp.h>
+#include <horizon/thread.h>
+#include <horizon/signal.h>
+#include <horizon/sched.h>
+#include <horizon/errno.h>
+#include <horizon/printk.h>
+
+/* Shortest interval a periodic timer is forwarded by */
+#define HRTIMER_MIN_INTERVAL_NS     NSEC_PER_USEC
+
+/* Longest an interrupt that ran out of retries backs off for */
+#define HRTIMER_MAX_HANG_NS         (100 * NSEC_PER_MSEC)
+
+/* Per-CPU high resolution timer bases */
+struct hrtimer_cpu_base hrtimer_bases[CONFIG_NR_CPUS];
+
+/**
+ * Get the clock base index of a clock
+ *
+ * @param clock_id Clock ID
+ * @return Clock base index
+ */
+static int hrtimer_clockid_to_base(clockid_t clock_id) {
+    return clock_id == CLOCK_REALTIME ? HRTIMER_BASE_REALTIME : HRTIMER_BASE_MONOTONIC;
+}
+
+/**
+ * Initialize the high resolution timer bases
+ */
+void hrtimers_init(void) {
+    for (int cpu = 0; cpu < CONFIG_NR_CPUS; cpu++) {
+        hrtimer_cpu_base_t *cpu_base = &hrtimer_bases[cpu];
+
+        spin_lock_init_named(&cpu_base->lock, "hrtimer_base");
+        cpu_base->cpu = cpu;
+        cpu_base->running = NULL;
+        cpu_base->active_bases = 0;
+        cpu_base->hres_active = 0;
+        cpu_base->hang_detected = 0;
+        cpu_base->nr_events = 0;
+        cpu_base->nr_retries = 0;
+        cpu_base->nr_hangs = 0;
+        cpu_base->nr_expired = 0;
+        cpu_base->expires_next = KTIME_MAX;
+
+        for (int i = 0; i < HRTIMER_MAX_CLOCK_BASES; i++) {
+            hrtimer_clock_base_t *base = &cpu_base->clock_base[i];
+
+            base->cpu_base = cpu_base;
+            base->index = i;
+            rb_init_root(&base->active);
+            base->first = NULL;
+        }
+
+        cpu_base->clock_base[HRTIMER_BASE_MONOTONIC].clockid = CLOCK_MONOTONIC;
+        cpu_base->clock_base[HRTIMER_BASE_MONOTONIC].get_time = ktime_get;
+        cpu_base->clock_base[HRTIMER_BASE_REALTIME].clockid = CLOCK_REALTIME;
+        cpu_base->clock_base[HRTIMER_BASE_REALTIME].get_time = ktime_get_real;
+    }
+}
+
+/**
+ * Initialize a high resolution timer
+ *
+ * @param timer Timer
+ * @param clock_id CLOCK_MONOTONIC or CLOCK_REALTIME
+ * @param mode HRTIMER_MODE_PINNED keeps the timer on this CPU
+ */
+void hrtimer_init(struct hrtimer *timer, clockid_t clock_id, enum hrtimer_mode mode) {
+    hrtimer_cpu_base_t *cpu_base = &hrtimer_bases[smp_processor_id()];
+
+    rb_clear_node(&timer->node);
+    timer->expires = 0;
+    timer->softexpires = 0;
+    timer->function = NULL;
+    timer->base = &cpu_base->clock_base[hrtimer_clockid_to_base(clock_id)];
+    timer->state = HRTIMER_STATE_INACTIVE;
+    timer->is_rel = 0;
+    timer->is_pinned = (mode & HRTIMER_MODE_PINNED) != 0;
+}
+
+/**
+ * Queue a timer on a base
+ *
+ * The caller must hold the base lock.
+ *
+ * @param base Clock base
+ * @param timer Timer
+ * @return 1 if the timer is now the first to expire, 0 if not
+ */
+static int hrtimer_enqueue(hrtimer_clock_base_t *base, struct hrtimer *timer) {
+    struct rb_node **link = &base->active.rb_node;
+    struct rb_node *parent = NULL;
+    int leftmost = 1;
+
+    while (*link != NULL) {
+        struct hrtimer *entry = rb_entry(*link, struct hrtimer, node);
+
+        parent = *link;
+        /* Equal expiries go right, so they run in the order queued */
+        if (timer->expires < entry->expires) {
+            link = &parent->rb_left;
+        } else {
+            link = &parent->rb_right;
+            leftmost = 0;
+        }
+    }
+
+    rb_link_node(&timer->node, parent, link);
+    rb_insert_color(&timer->node, &base->active);
+
+    if (leftmost) {
+        base->first = &timer->node;
+    }
+
+    timer->state = HRTIMER_STATE_ENQUEUED;
+    base->cpu_base->active_bases |= 1U << base->index;
+
+    return leftmost;
+}
+
+/**
+ * Take a queued timer off its base
+ *
+ * The caller must hold the base lock.
+ *
+ * @param base Clock base
+ * @param timer Timer
+ * @return 1 if the timer was queued, 0 if not
+ */
+static int hrtimer_remove(hrtimer_clock_base_t *base, struct hrtimer *timer) {
+    if (!(timer->state & HRTIMER_STATE_ENQUEUED)) {
+        return 0;
+    }
+
+    if (base->first == &timer->node) {
+        base->first = rb_next(&timer->node);
+    }
+
+    rb_erase(&timer->node, &base->active);
+    rb_clear_node(&timer->node);
+    timer->state = HRTIMER_STATE_INACTIVE;
+
+    if (base->first == NULL) {
+        base->cpu_base->active_bases &= ~(1U << base->index);
+    }
+
+    return 1;
+}
+
+/**
+ * Lock the base a timer is on
+ *
+ * The base changes under us while the timer moves to another CPU, so
+ * check it again once locked.
+ *
+ * @param timer Timer
+ * @param flags Saved interrupt state
+ * @return Locked base
+ */
+static hrtimer_clock_base_t *hrtimer_lock_base(const struct hrtimer *timer, unsigned long *flags) {
+    for (;;) {
+        hrtimer_clock_base_t *base = timer->base;
+
+        if (base != NULL) {
+            local_irq_save(*flags);
+            spin_lock(&base->cpu_base->lock);
+            if (base == timer->base) {
+                return base;
+            }
+            spin_unlock(&base->cpu_base->lock);
+            local_irq_restore(*flags);
+        }
+
+        __asm__ volatile("pause" ::: "memory");
+    }
+}
+
+/**
+ * Unlock the base locked by hrtimer_lock_base()
+ *
+ * @param base Clock base
+ * @param flags Saved interrupt state
+ */
+static void hrtimer_unlock_base(hrtimer_clock_base_t *base, unsigned long flags) {
+    spin_unlock(&base->cpu_base->lock);
+    local_irq_restore(flags);
+}
+
+/**
+ * Find the earliest expiry of the queued timers of a CPU
+ *
+ * The caller must hold the CPU base lock.
+ *
+ * @param cpu_base CPU base
+ * @param now Monotonic time now
+ * @return Earliest expiry in monotonic time, KTIME_MAX if none is queued
+ */
+static ktime_t hrtimer_get_next(hrtimer_cpu_base_t *cpu_base, ktime_t now) {
+    ktime_t next = KTIME_MAX;
+
+    for (int i = 0; i < HRTIMER_MAX_CLOCK_BASES; i++) {
+        hrtimer_clock_base_t *base = &cpu_base->clock_base[i];
+        struct hrtimer *timer;
+        ktime_t expires;
+
+        if (base->first == NULL) {
+            continue;
+        }
+
+        timer = rb_entry(base->first, struct hrtimer, node);
+
+        /* Bring expiries of other clocks over to the monotonic clock */
+        expires = timer->expires;
+        if (i != HRTIMER_BASE_MONOTONIC) {
+            expires = now + (expires - base->get_time());
+        }
+
+        if (expires < next) {
+            next = expires;
+        }
+    }
+
+    return next;
+}
+
+/**
+ * Program the clock event of this CPU for its earliest timer
+ *
+ * The caller must hold the CPU base lock.
+ *
+ * @param cpu_base CPU base of this CPU
+ */
+static void hrtimer_force_reprogram(hrtimer_cpu_base_t *cpu_base) {
+    ktime_t now, next;
+
+    if (!cpu_base->hres_active) {
+        return;
+    }
+
+    now = ktime_get();
+    next = hrtimer_get_next(cpu_base, now);
+    cpu_base->expires_next = next;
+
+    if (next != KTIME_MAX) {
+        arch_clockevent_program(next > now ? (u64)(next - now) : 0);
+    }
+}
+
+/**
+ * Start a high resolution timer with a range
+ *
+ * The timer runs once its clock reaches tim, and no later than range_ns
+ * after that. Unless pinned it moves to this CPU.
+ *
+ * @param timer Timer
+ * @param tim Expiry, absolute or relative to now
+ * @param range_ns Nanoseconds the expiry may be delayed by
+ * @param mode HRTIMER_MODE_ABS or HRTIMER_MODE_REL, optionally pinned
+ * @return 1 if the timer was queued, 0 if not
+ */
+int hrtimer_start_range_ns(struct hrtimer *timer, ktime_t tim, u64 range_ns, const enum hrtimer_mode mode) {
+    unsigned long flags;
+    hrtimer_clock_base_t *base = hrtimer_lock_base(timer, &flags);
+    hrtimer_cpu_base_t *this_base = &hrtimer_bases[smp_processor_id()];
+    hrtimer_clock_base_t *new_base;
+    int ret = hrtimer_remove(base, timer);
+
+    if (mode & HRTIMER_MODE_PINNED) {
+        timer->is_pinned = 1;
+    }
+
+    new_base = timer->is_pinned ? base : &this_base->clock_base[base->index];
+
+    /* A running timer stays put so hrtimer_cancel() finds it */
+    if (new_base != base && base->cpu_base->running != timer) {
+        timer->base = NULL;
+        spin_unlock(&base->cpu_base->lock);
+        spin_lock(&new_base->cpu_base->lock);
+        timer->base = new_base;
+        base = new_base;
+    }
+
+    timer->is_rel = (mode & HRTIMER_MODE_REL) != 0;
+    if (timer->is_rel) {
+        tim += base->get_time();
+    }
+
+    timer->softexpires = tim;
+    timer->expires = (u64)(KTIME_MAX - tim) < range_ns ? KTIME_MAX : tim + (ktime_t)range_ns;
+
+    /* A new first timer on this CPU may need an earlier interrupt */
+    if (hrtimer_enqueue(base, timer) && base->cpu_base == this_base) {
+        hrtimer_force_reprogram(this_base);
+    }
+
+    hrtimer_unlock_base(base, flags);
+
+    return ret;
+}
+
+/**
+ * Start a high resolution timer
+ *
+ * @param timer Timer
+ * @param tim Expiry, absolute or relative to now
+ * @param mode HRTIMER_MODE_ABS or HRTIMER_MODE_REL, optionally pinned
+ * @return 1 if the timer was queued, 0 if not
+ */
+int hrtimer_start(struct hrtimer *timer, ktime_t tim, const enum hrtimer_mode mode) {
+    return hrtimer_start_range_ns(timer, tim, 0, mode);
+}
+
+/**
+ * Try to stop a high resolution timer
+ *
+ * @param timer Timer
+ * @return 1 if the timer was queued, 0 if not, -1 if its function is running
+ */
+int hrtimer_try_to_cancel(struct hrtimer *timer) {
+    unsigned long flags;
+    hrtimer_clock_base_t *base;
+    int ret = -1;
+
+    base = hrtimer_lock_base(timer, &flags);
+    if (base->cpu_base->running != timer) {
+        ret = hrtimer_remove(base, timer);
+    }
+    hrtimer_unlock_base(base, flags);
+
+    return ret;
+}
+
+/**
+ * Stop a high resolution timer and wait for its function to finish
+ *
+ * Must not be called from the timer's own function. The clock event is
+ * left as it is; an interrupt for a removed timer finds nothing to run.
+ *
+ * @param timer Timer
+ * @return 1 if the timer was queued, 0 if not
+ */
+int hrtimer_cancel(struct hrtimer *timer) {
+    for (;;) {
+        int ret = hrtimer_try_to_cancel(timer);
+
+        if (ret >= 0) {
+            return ret;
+        }
+
+        __asm__ volatile("pause" ::: "memory");
+    }
+}
+
+/**
+ * Get the time left until a timer expires
+ *
+ * @param timer Timer
+ * @return Nanoseconds until the expiry, negative if it has passed
+ */
+ktime_t hrtimer_get_remaining(const struct hrtimer *timer) {
+    unsigned long flags;
+    hrtimer_clock_base_t *base = hrtimer_lock_base(timer, &flags);
+    ktime_t rem = timer->expires - base->get_time();
+
+    hrtimer_unlock_base(base, flags);
+
+    return rem;
+}
+
+/**
+ * Get the resolution of the high resolution timers
+ *
+ * @param which_clock Clock ID
+ * @param tp Resolution
+ * @return 0 on success, negative error code on failure
+ */
+int hrtimer_get_res(const clockid_t which_clock, struct timespec *tp) {
+    if (which_clock != CLOCK_REALTIME && which_clock != CLOCK_MONOTONIC) {
+        return -EINVAL;
+    }
+
+    tp->tv_sec = 0;
+    tp->tv_nsec = hrtimer_bases[smp_processor_id()].hres_active ? 1 : (long)timer_get_tick_period();
+
+    return 0;
+}
+
+/**
+ * Check whether a timer is queued
+ *
+ * @param timer Timer
+ * @return Nonzero if queued
+ */
+int hrtimer_is_queued(struct hrtimer *timer) {
+    return (timer->state & HRTIMER_STATE_ENQUEUED) != 0;
+}
+
+/**
+ * Check whether a timer is queued or its function is running
+ *
+ * @param timer Timer
+ * @return Nonzero if active
+ */
+int hrtimer_active(const struct hrtimer *timer) {
+    return (timer->state & HRTIMER_STATE_ENQUEUED) || timer->base->cpu_base->running == timer;
+}
+
+/**
+ * Check whether the CPU of a timer runs it from the clock event
+ *
+ * @param timer Timer
+ * @return Nonzero if high resolution mode is active
+ */
+int hrtimer_is_hres_active(struct hrtimer *timer) {
+    return timer->base->cpu_base->hres_active;
+}
+
+/**
+ * Check whether a timer's function is running
+ *
+ * @param timer Timer
+ * @return Nonzero if running
+ */
+int hrtimer_callback_running(struct hrtimer *timer) {
+    return timer->base->cpu_base->running == timer;
+}
+
+/**
+ * Set the expiry of a timer that is not queued
+ *
+ * @param timer Timer
+ * @param time Expiry
+ */
+void hrtimer_set_expires(struct hrtimer *timer, ktime_t time) {
+    timer->expires = time;
+    timer->softexpires = time;
+}
+
+/**
+ * Set the expiry of a timer that is not queued, with a range
+ *
+ * @param timer Timer
+ * @param time Earliest expiry
+ * @param range_ns Nanoseconds the expiry may be delayed by
+ */
+void hrtimer_set_expires_range_ns(struct hrtimer *timer, ktime_t time, u64 range_ns) {
+    timer->softexpires = time;
+    timer->expires = time + (ktime_t)range_ns;
+}
+
+/**
+ * Move the expiry of a timer that is not queued
+ *
+ * @param timer Timer
+ * @param ns Nanoseconds to add
+ */
+void hrtimer_add_expires_ns(struct hrtimer *timer, u64 ns) {
+    timer->expires += (ktime_t)ns;
+    timer->softexpires += (ktime_t)ns;
+}
+
+/**
+ * Forward a timer's expiry past a time by whole intervals
+ *
+ * Used by periodic timers from their function, so missed periods are
+ * counted instead of run one after the other.
+ *
+ * @param timer Timer, not queued
+ * @param now Time to move past
+ * @param interval Period
+ * @return Number of periods moved over, 0 if the expiry is already after now
+ */
+u64 hrtimer_forward(struct hrtimer *timer, ktime_t now, ktime_t interval) {
+    ktime_t delta = now - timer->expires;
+    u64 orun = 1;
+
+    if (delta < 0) {
+        return 0;
+    }
+
+    /* A tiny period would keep the CPU in the interrupt */
+    if (interval < HRTIMER_MIN_INTERVAL_NS) {
+        interval = HRTIMER_MIN_INTERVAL_NS;
+    }
+
+    if (delta >= interval) {
+        orun = (u64)delta / (u64)interval;
+        hrtimer_add_expires_ns(timer, orun * (u64)interval);
+        if (timer->expires > now) {
+            return orun;
+        }
+        orun++;
+    }
+
+    hrtimer_add_expires_ns(timer, (u64)interval);
+
+    return orun;
+}
+
+/**
+ * Forward a timer's expiry past its clock's time now
+ *
+ * @param timer Timer, not queued
+ * @param interval Period
+ * @return Number of periods moved over
+ */
+u64 hrtimer_forward_now(struct hrtimer *timer, ktime_t interval) {
+    return hrtimer_forward(timer, timer->base->get_time(), interval);
+}
+
+/**
+ * Get the time of a timer's clock, for use in its function
+ *
+ * @param timer Timer
+ * @return Time now
+ */
+ktime_t hrtimer_cb_get_time(struct hrtimer *timer) {
+    return timer->base->get_time();
+}
+
+/**
+ * Run one expired timer
+ *
+ * The function runs with the base unlocked and must not sleep. The caller
+ * must hold the CPU base lock.
+ *
+ * @param cpu_base CPU base
+ * @param base Clock base of the timer
+ * @param timer Timer
+ */
+static void hrtimer_run_timer(hrtimer_cpu_base_t *cpu_base, hrtimer_clock_base_t *base, struct hrtimer *timer) {
+    enum hrtimer_restart (*function)(struct hrtimer *) = timer->function;
+    enum hrtimer_restart restart = HRTIMER_NORESTART;
+
+    hrtimer_remove(base, timer);
+    cpu_base->running = timer;
+    cpu_base->nr_expired++;
+
+    spin_unlock(&cpu_base->lock);
+    if (function != NULL) {
+        restart = function(timer);
+    }
+    spin_lock(&cpu_base->lock);
+
+    /* The function may have restarted the timer itself */
+    if (restart != HRTIMER_NORESTART && !(timer->state & HRTIMER_STATE_ENQUEUED)) {
+        hrtimer_enqueue(base, timer);
+    }
+
+    cpu_base->running = NULL;
+}
+
+/**
+ * Run the expired timers of a CPU
+ *
+ * The caller must hold the CPU base lock.
+ *
+ * @param cpu_base CPU base
+ * @param now Monotonic time now
+ */
+static void hrtimer_run_expired(hrtimer_cpu_base_t *cpu_base, ktime_t now) {
+    for (int i = 0; i < HRTIMER_MAX_CLOCK_BASES; i++) {
+        hrtimer_clock_base_t *base = &cpu_base->clock_base[i];
+        ktime_t basenow;
+
+        if (!(cpu_base->active_bases & (1U << i))) {
+            continue;
+        }
+
+        basenow = i == HRTIMER_BASE_MONOTONIC ? now : base->get_time();
+
+        while (base->first != NULL) {
+            struct hrtimer *timer = rb_entry(base->first, struct hrtimer, node);
+
+            /* Sorted by expires, but anything past its softexpires may go */
+            if (basenow < timer->softexpires) {
+                break;
+            }
+
+            hrtimer_run_timer(cpu_base, base, timer);
+        }
+    }
+}
+
+/**
+ * Run the expired timers of this CPU and program its next interrupt
+ *
+ * Called from the clock event interrupt. If timers keep expiring while
+ * the earlier ones run, it gives up after a few rounds and backs off for
+ * as long as it spent, so the CPU is not stuck in the interrupt.
+ */
+void hrtimer_interrupt(void) {
+    hrtimer_cpu_base_t *cpu_base = &hrtimer_bases[smp_processor_id()];
+    unsigned long flags;
+    ktime_t entry_time, now, next;
+    int retries = 0;
+
+    local_irq_save(flags);
+    spin_lock(&cpu_base->lock);
+
+    cpu_base->nr_events++;
+    entry_time = now = ktime_get();
+
+    for (;;) {
+        hrtimer_run_expired(cpu_base, now);
+
+        now = ktime_get();
+        next = hrtimer_get_next(cpu_base, now);
+        cpu_base->expires_next = next;
+
+        if (next > now || !cpu_base->hres_active) {
+            break;
+        }
+
+        if (++retries >= HRTIMER_MAX_RETRIES) {
+            /* Back off rather than spin in the interrupt */
+            ktime_t delta = now - entry_time;
+
+            cpu_base->nr_hangs++;
+            cpu_base->hang_detected = 1;
+            next = now + (delta > HRTIMER_MAX_HANG_NS ? HRTIMER_MAX_HANG_NS : delta);
+            cpu_base->expires_next = next;
+            break;
+        }
+
+        cpu_base->nr_retries++;
+    }
+
+    if (retries < HRTIMER_MAX_RETRIES) {
+        cpu_base->hang_detected = 0;
+    }
+
+    if (cpu_base->hres_active && next != KTIME_MAX) {
+        arch_clockevent_program((u64)(next - now));
+    }
+
+    spin_unlock(&cpu_base->lock);
+    local_irq_restore(flags);
+}
+
+/**
+ * Run the expired timers of this CPU from the tick
+ *
+ * Without a clock event this is where the timers run, at tick resolution.
+ * With one it only catches a missed interrupt, or realtime timers that
+ * came due early because the clock was set.
+ */
+void hrtimer_run_queues(void) {
+    hrtimer_cpu_base_t *cpu_base = &hrtimer_bases[smp_processor_id()];
+    unsigned long flags;
+    ktime_t now;
+    int due;
+
+    if (cpu_base->active_bases == 0) {
+        return;
+    }
+
+    local_irq_save(flags);
+    spin_lock(&cpu_base->lock);
+    now = ktime_get();
+    due = hrtimer_get_next(cpu_base, now) <= now;
+    spin_unlock(&cpu_base->lock);
+    local_irq_restore(flags);
+
+    if (due) {
+        hrtimer_interrupt();
+    }
+}
+
+/**
+ * Get the time until the earliest timer the tick has to run
+ *
+ * Used before stopping the tick, which must not sleep past it. With the
+ * clock event the timers interrupt on their own and none is reported.
+ *
+ * @return Nanoseconds until the earliest timer of this CPU, KTIME_MAX if none
+ */
+ktime_t hrtimer_get_next_event(void) {
+    hrtimer_cpu_base_t *cpu_base = &hrtimer_bases[smp_processor_id()];
+    unsigned long flags;
+    ktime_t now, next;
+
+    if (cpu_base->hres_active || cpu_base->active_bases == 0) {
+        return KTIME_MAX;
+    }
+
+    local_irq_save(flags);
+    spin_lock(&cpu_base->lock);
+    now = ktime_get();
+    next = hrtimer_get_next(cpu_base, now);
+    spin_unlock(&cpu_base->lock);
+    local_irq_restore(flags);
+
+    if (next == KTIME_MAX) {
+        return KTIME_MAX;
+    }
+
+    return next > now ? next - now : 0;
+}
+
+/**
+ * Switch to high resolution mode once the clock event works
+ *
+ * Called by the architecture after calibrating the clock event. Every CPU
+ * runs its timers from the clock event from then on.
+ */
+void hrtimer_switch_to_hres(void) {
+    hrtimer_cpu_base_t *this_base = &hrtimer_bases[smp_processor_id()];
+    unsigned long flags;
+
+    for (int cpu = 0; cpu < CONFIG_NR_CPUS; cpu++) {
+        hrtimer_bases[cpu].hres_active = 1;
+    }
+
+    local_irq_save(flags);
+    spin_lock(&this_base->lock);
+    hrtimer_force_reprogram(this_base);
+    spin_unlock(&this_base->lock);
+    local_irq_restore(flags);
+
+    printk(KERN_INFO "hrtimer: switched to high resolution mode\n");
+}
+
+/**
+ * Wake the thread of a sleeper
+ *
+ * @param timer Timer of the sleeper
+ * @return HRTIMER_NORESTART
+ */
+static enum hrtimer_restart hrtimer_wakeup(struct hrtimer *timer) {
+    struct hrtimer_sleeper *sl = container_of(timer, struct hrtimer_sleeper, timer);
+    struct thread *task = sl->task;
+
+    sl->task = NULL;
+    if (task != NULL) {
+        sched_unblock_thread(task);
+    }
+
+    return HRTIMER_NORESTART;
+}
+
+/**
+ * Initialize a sleeper
+ *
+ * @param sl Sleeper, its timer already initialized
+ * @param task Thread to wake
+ */
+void hrtimer_init_sleeper(struct hrtimer_sleeper *sl, struct thread *task) {
+    sl->timer.function = hrtimer_wakeup;
+    sl->task = task;
+}
+
+/**
+ * Block the current thread until its sleeper's timer runs
+ *
+ * @param sl Sleeper, initialized for the current thread
+ * @param expires Expiry
+ * @param range_ns Nanoseconds the expiry may be delayed by
+ * @param mode HRTIMER_MODE_ABS or HRTIMER_MODE_REL
+ * @param lock Held lock to drop once the thread is blocked, or NULL
+ * @return 0 if the timer ran, -EINTR if woken before with a signal pending,
+ *         -EAGAIN if woken before by anything else
+ */
+static int hrtimer_sleep(struct hrtimer_sleeper *sl, ktime_t expires, u64 range_ns, const enum hrtimer_mode mode,
+                         spinlock_t *lock) {
+    struct thread *self = sl->task;
+    unsigned long flags;
+
+    local_irq_save(flags);
+
+    hrtimer_start_range_ns(&sl->timer, expires, range_ns, mode);
+
+    /* Interrupts stay off until we are off the run queue */
+    if (sl->task != NULL) {
+        sched_block_thread_unlock(self, lock);
+    } else if (lock != NULL) {
+        spin_unlock(lock);
+    }
+
+    local_irq_restore(flags);
+
+    hrtimer_cancel(&sl->timer);
+
+    if (sl->task == NULL) {
+        return 0;
+    }
+
+    return signal_pending_thread(self) ? -EINTR : -EAGAIN;
+}
+
+/**
+ * Sleep until a time on a clock
+ *
+ * @param clockid CLOCK_MONOTONIC or CLOCK_REALTIME
+ * @param expires Wakeup time, absolute or relative
+ * @param mode HRTIMER_MODE_ABS or HRTIMER_MODE_REL
+ * @param remaining Set to the time left when interrupted, may be NULL
+ * @return 0 on success, -EINTR if interrupted by a signal
+ */
+int hrtimer_nanosleep(clockid_t clockid, ktime_t expires, const enum hrtimer_mode mode, ktime_t *remaining) {
+    struct hrtimer_sleeper sl;
+    int ret;
+
+    hrtimer_init(&sl.timer, clockid, mode);
+    hrtimer_init_sleeper(&sl, thread_self());
+
+    ret = hrtimer_sleep(&sl, expires, 0, mode, NULL);
+
+    /* Only the timer or a signal end the sleep, go back to it on other wakeups */
+    while (ret == -EAGAIN) {
+        ret = hrtimer_sleep(&sl, sl.timer.softexpires, 0, HRTIMER_MODE_ABS, NULL);
+    }
+
+    if (remaining != NULL) {
+        ktime_t rem = ret == 0 ? 0 : hrtimer_get_remaining(&sl.timer);
+
+        *remaining = rem > 0 ? rem : 0;
+    }
+
+    return ret;
+}
+
+/**
+ * Sleep until a timeout on the monotonic clock, with a range
+ *
+ * @param expires Timeout, or NULL to sleep until woken
+ * @param delta Nanoseconds the wakeup may be delayed by, so it can share
+ *              an interrupt with other timers
+ * @param mode HRTIMER_MODE_ABS or HRTIMER_MODE_REL
+ * @return 0 if the timeout passed, -EINTR if woken before with a signal
+ *         pending, -EAGAIN if woken before by anything else
+ */
+int schedule_hrtimeout_range(ktime_t *expires, u64 delta, const enum hrtimer_mode mode) {
+    return schedule_hrtimeout_range_unlock(expires, delta, mode, NULL);
+}
+
+/**
+ * Sleep until a timeout, dropping the lock of the condition waited for
+ *
+ * The lock is dropped once the thread is blocked, so a waker that takes
+ * it afterwards always finds the thread blocked.
+ *
+ * @param expires Timeout, or NULL to sleep until woken
+ * @param delta Nanoseconds the wakeup may be delayed by
+ * @param mode HRTIMER_MODE_ABS or HRTIMER_MODE_REL
+ * @param lock Held lock to drop, or NULL
+ * @return 0 if the timeout passed, -EINTR if woken before with a signal
+ *         pending, -EAGAIN if woken before by anything else
+ */
+int schedule_hrtimeout_range_unlock(ktime_t *expires, u64 delta, const enum hrtimer_mode mode, spinlock_t *lock) {
+    struct hrtimer_sleeper sl;
+
+    if (expires == NULL) {
+        unsigned long flags;
+
+        local_irq_save(flags);
+        sched_block_thread_unlock(thread_self(), lock);
+        local_irq_restore(flags);
+
+        return signal_pending_thread(thread_self()) ? -EINTR : -EAGAIN;
+    }
+
+    /* A zero timeout returns at once */
+    if (*expires == 0 && (mode & HRTIMER_MODE_REL)) {
+        if (lock != NULL) {
+            spin_unlock(lock);
+        }
+        return 0;
+    }
+
+    hrtimer_init(&sl.timer, CLOCK_MONOTONIC, mode);
+    hrtimer_init_sleeper(&sl, thread_self());
+
+    return hrtimer_sleep(&sl, *expires, delta, mode, lock);
+}
+
+/**
+ * Sleep until a timeout on the monotonic clock
+ *
+ * @param expires Timeout, or NULL to sleep until woken
+ * @param mode HRTIMER_MODE_ABS or HRTIMER_MODE_REL
+ * @return 0 if the timeout passed, -EINTR if woken before with a signal
+ *         pending, -EAGAIN if woken before by anything else
+ */
+int schedule_hrtimeout(ktime_t *expires, const enum hrtimer_mode mode) {
+    return schedule_hrtimeout_range(expires, 0, mode);
+}
+
+/**
+ * Print high resolution timer statistics
+ */
+void hrtimer_print_stats(void) {
+    printk(KERN_INFO "High resolution timers:\n");
+
+    for (int cpu = 0; cpu < CONFIG_NR_CPUS; cpu++) {
+        hrtimer_cpu_base_t *cpu_base = &hrtimer_bases[cpu];
+
+        if (cpu_base->nr_events == 0 && cpu_base->active_bases == 0) {
+            continue;
+        }
+
+        printk(KERN_INFO "  CPU %d: %s, events %u, expired %llu, retries %u, hangs %u\n",
+               cpu, cpu_base->hres_active ? "hres" : "tick", cpu_base->nr_events,
+               cpu_base->nr_expired, cpu_base->nr_retries, cpu_base->nr_hangs);
+    }
+}
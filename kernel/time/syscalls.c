@@ -90,14 +90,8 @@ long sys_clock_gettime(long clockid, long tp, long unused1, long unused2, long u
     /* Get the time */
     switch (clockid) {
         case CLOCK_REALTIME:
-            tsp->tv_sec = time_get_seconds();
-            tsp->tv_nsec = time_get_nanoseconds();
-            break;
-
         case CLOCK_MONOTONIC:
-            tsp->tv_sec = time_get_monotonic_seconds();
-            tsp->tv_nsec = time_get_monotonic_nanoseconds();
-            break;
+            return time_clock_gettime(clockid, tsp);
 
         case CLOCK_PROCESS_CPUTIME_ID:
             /* This would be implemented with actual process CPU time */
@@ -165,14 +159,8 @@ long sys_clock_getres(long clockid, long res, long unused1, long unused2, long u
     /* Get the resolution */
     switch (clockid) {
         case CLOCK_REALTIME:
-            resp->tv_sec = 0;
-            resp->tv_nsec = 1000; /* 1 microsecond */
-            break;
-
         case CLOCK_MONOTONIC:
-            resp->tv_sec = 0;
-            resp->tv_nsec = 1000; /* 1 microsecond */
-            break;
+            return time_clock_getres(clockid, resp);
 
         case CLOCK_PROCESS_CPUTIME_ID:
             resp->tv_sec = 0;
@@ -201,41 +189,8 @@ long sys_clock_nanosleep(long clockid, long flags, long req, long rem, long unus
         return -1;
     }
 
-    /* Check the clock ID */
-    if (clockid != CLOCK_REALTIME && clockid != CLOCK_MONOTONIC) {
-        return -1;
-    }
-
-    /* Sleep */
-    unsigned long timeout = rqtp->tv_sec * 1000 + rqtp->tv_nsec / 1000000;
-
-    if (flags & TIMER_ABSTIME) {
-        /* Absolute time */
-        unsigned long now;
-
-        if (clockid == CLOCK_REALTIME) {
-            now = time_get_seconds() * 1000 + time_get_microseconds() / 1000;
-        } else {
-            now = time_get_monotonic_seconds() * 1000 + time_get_monotonic_nanoseconds() / 1000000;
-        }
-
-        if (now >= timeout) {
-            return 0;
-        }
-
-        timeout -= now;
-    }
-
-    /* Sleep */
-    schedule_timeout_interruptible(timeout);
-
-    /* Set the remaining time */
-    if (rmtp != NULL) {
-        rmtp->tv_sec = 0;
-        rmtp->tv_nsec = 0;
-    }
-
-    return 0;
+    /* Sleep on a high resolution timer */
+    return time_clock_nanosleep(clockid, flags, rqtp, rmtp);
 }
 
 /* System call: nanosleep */
@@ -1,115 +1,82 @@
 /**
  * time.c - Horizon kernel time implementation
  *
- * This file contains the implementation of the time subsystem.
+ * This file contains the implementation of the time subsystem. The time
+ * is read from the timekeeping, which follows the best clock source, so
+ * it has the clock source's resolution rather than the tick's.
  */
 
 #include <horizon/kernel.h>
 #include <horizon/types.h>
 #include <horizon/time.h>
-
-/* Current time in seconds since the epoch */
-static time_t current_time = 0;
-
-/* Current time in microseconds */
-static u32 current_usec = 0;
-
-/* Current time in nanoseconds */
-static u32 current_nsec = 0;
-
-/* Monotonic time in seconds */
-static time_t monotonic_time = 0;
-
-/* Monotonic time in nanoseconds */
-static u32 monotonic_nsec = 0;
+#include <horizon/timer.h>
+#include <horizon/errno.h>
 
 /* Initialize the time subsystem */
 void time_init(void) {
-    /* Initialize the time */
-    current_time = 0;
-    current_usec = 0;
-    current_nsec = 0;
-    monotonic_time = 0;
-    monotonic_nsec = 0;
-
     /* Initialize the timer file descriptor subsystem */
     timerfd_init();
 }
 
-/* Update the time */
-void time_update(time_t sec, u32 usec) {
-    /* Update the time */
-    current_time = sec;
-    current_usec = usec;
-    current_nsec = usec * 1000;
-
-    /* Update the monotonic time */
-    monotonic_time = sec;
-    monotonic_nsec = usec * 1000;
-}
-
 /* Get the current time in seconds */
 time_t time_get(void) {
-    return current_time;
+    return (time_t)(ktime_get_real() / NSEC_PER_SEC);
 }
 
 /* Get the current time in seconds */
 time_t time_get_seconds(void) {
-    return current_time;
+    return (time_t)(ktime_get_real() / NSEC_PER_SEC);
 }
 
 /* Get the current time in microseconds */
-u32 time_get_microseconds(void) {
-    return current_usec;
+long time_get_microseconds(void) {
+    return (long)((ktime_get_real() % NSEC_PER_SEC) / NSEC_PER_USEC);
 }
 
 /* Get the current time in nanoseconds */
-u32 time_get_nanoseconds(void) {
-    return current_nsec;
+long time_get_nanoseconds(void) {
+    return (long)(ktime_get_real() % NSEC_PER_SEC);
 }
 
 /* Get the monotonic time in seconds */
 time_t time_get_monotonic_seconds(void) {
-    return monotonic_time;
+    return (time_t)(ktime_get() / NSEC_PER_SEC);
 }
 
 /* Get the monotonic time in nanoseconds */
-u32 time_get_monotonic_nanoseconds(void) {
-    return monotonic_nsec;
+long time_get_monotonic_nanoseconds(void) {
+    return (long)(ktime_get() % NSEC_PER_SEC);
 }
 
 /* Get the current timestamp in microseconds */
 u64 get_timestamp(void) {
-    return (u64)monotonic_time * 1000000 + (u64)monotonic_nsec / 1000;
+    return (u64)ktime_get() / NSEC_PER_USEC;
 }
 
 /* Set the current time in seconds */
 int time_set(time_t sec) {
-    /* Set the time */
-    current_time = sec;
-    return 0;
+    return time_set_seconds(sec);
 }
 
-/* Set the current time in seconds */
+/* Set the current time in seconds, keeping the fraction */
 int time_set_seconds(time_t sec) {
-    /* Set the time */
-    current_time = sec;
+    ktime_set_real(ktime_set(sec, (unsigned long)(ktime_get_real() % NSEC_PER_SEC)));
     return 0;
 }
 
-/* Set the current time in microseconds */
-int time_set_microseconds(u32 usec) {
-    /* Set the time */
-    current_usec = usec;
-    current_nsec = usec * 1000;
+/* Set the current time in microseconds, keeping the seconds */
+int time_set_microseconds(long usec) {
+    ktime_t now = ktime_get_real();
+
+    ktime_set_real(now - now % NSEC_PER_SEC + (ktime_t)usec * NSEC_PER_USEC);
     return 0;
 }
 
-/* Set the current time in nanoseconds */
-int time_set_nanoseconds(u32 nsec) {
-    /* Set the time */
-    current_nsec = nsec;
-    current_usec = nsec / 1000;
+/* Set the current time in nanoseconds, keeping the seconds */
+int time_set_nanoseconds(long nsec) {
+    ktime_t now = ktime_get_real();
+
+    ktime_set_real(now - now % NSEC_PER_SEC + nsec);
     return 0;
 }
 
@@ -233,34 +200,45 @@ int time_clock_adjtime(clockid_t clk_id, struct timex *tx) {
 
 /* Sleep for a specific time */
 int time_clock_nanosleep(clockid_t clockid, int flags, const struct timespec *request, struct timespec *remain) {
-    /* This would be implemented with actual sleeping */
+    ktime_t rem = 0;
+    int ret;
+
     if (request == NULL) {
-        return -1;
+        return -EINVAL;
     }
 
     /* Check the clock ID */
     if (clockid != CLOCK_REALTIME && clockid != CLOCK_MONOTONIC) {
-        return -1;
+        return -EINVAL;
+    }
+
+    /* Check the request */
+    if (request->tv_nsec < 0 || request->tv_nsec >= NSEC_PER_SEC) {
+        return -EINVAL;
     }
 
-    /* Set the remaining time */
+    /* Sleep on a high resolution timer */
+    ret = hrtimer_nanosleep(clockid, timespec_to_ktime(request),
+                            (flags & TIMER_ABSTIME) ? HRTIMER_MODE_ABS : HRTIMER_MODE_REL, &rem);
+
+    /* Set the remaining time, an absolute sleep is simply restarted */
     if (remain != NULL) {
-        remain->tv_sec = 0;
-        remain->tv_nsec = 0;
+        if (flags & TIMER_ABSTIME) {
+            rem = 0;
+        }
+        *remain = ktime_to_timespec(rem);
     }
 
-    return 0;
+    return ret;
 }
 
 /* Sleep for a specific time */
 int time_nanosleep(const struct timespec *req, struct timespec *rem) {
-    /* This would be implemented with actual sleeping */
     return time_clock_nanosleep(CLOCK_REALTIME, 0, req, rem);
 }
 
 /* Get the time of a specific clock */
 int time_clock_gettime(clockid_t clk_id, struct timespec *tp) {
-    /* This would be implemented with actual clock getting */
     if (tp == NULL) {
         return -1;
     }
@@ -268,13 +246,11 @@ int time_clock_gettime(clockid_t clk_id, struct timespec *tp) {
     /* Get the time */
     switch (clk_id) {
         case CLOCK_REALTIME:
-            tp->tv_sec = current_time;
-            tp->tv_nsec = current_nsec;
+            *tp = ktime_to_timespec(ktime_get_real());
             break;
 
         case CLOCK_MONOTONIC:
-            tp->tv_sec = monotonic_time;
-            tp->tv_nsec = monotonic_nsec;
+            *tp = ktime_to_timespec(ktime_get());
             break;
 
         default:
@@ -286,7 +262,6 @@ int time_clock_gettime(clockid_t clk_id, struct timespec *tp) {
 
 /* Set the time of a specific clock */
 int time_clock_settime(clockid_t clk_id, const struct timespec *tp) {
-    /* This would be implemented with actual clock setting */
     if (tp == NULL) {
         return -1;
     }
@@ -294,8 +269,10 @@ int time_clock_settime(clockid_t clk_id, const struct timespec *tp) {
     /* Set the time */
     switch (clk_id) {
         case CLOCK_REALTIME:
-            time_set_seconds(tp->tv_sec);
-            time_set_nanoseconds(tp->tv_nsec);
+            if (tp->tv_nsec < 0 || tp->tv_nsec >= NSEC_PER_SEC) {
+                return -1;
+            }
+            ktime_set_real(timespec_to_ktime(tp));
             break;
 
         case CLOCK_MONOTONIC:
@@ -311,22 +288,10 @@ int time_clock_settime(clockid_t clk_id, const struct timespec *tp) {
 
 /* Get the resolution of a specific clock */
 int time_clock_getres(clockid_t clk_id, struct timespec *res) {
-    /* This would be implemented with actual clock resolution getting */
     if (res == NULL) {
         return -1;
     }
 
-    /* Get the resolution */
-    switch (clk_id) {
-        case CLOCK_REALTIME:
-        case CLOCK_MONOTONIC:
-            res->tv_sec = 0;
-            res->tv_nsec = 1000; /* 1 microsecond */
-            break;
-
-        default:
-            return -1;
-    }
-
-    return 0;
+    /* The timers' resolution, the tick until the clock event runs them */
+    return hrtimer_get_res(clk_id, res) < 0 ? -1 : 0;
 }
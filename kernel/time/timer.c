@@ -1,7 +1,12 @@
 /**
  * timer.c - Horizon kernel timer implementation
  *
- * This file contains the implementation of the timer subsystem.
+ * This file contains the implementation of the timer subsystem. Every CPU
+ * has a hierarchical timer wheel: a timer goes straight into the bucket
+ * for its expiry, so adding and removing one is O(1) however many are
+ * pending. Buckets of the first level are a jiffy wide and are run as the
+ * jiffy comes. Coarser levels hold timers further out and are cascaded
+ * into the levels below each time the level below wraps around.
  */
 
 #include <horizon/kernel.h>
@@ -13,12 +18,40 @@
 #include <horizon/sched.h>
 #include <horizon/mm.h>
 #include <horizon/errno.h>
+#include <horizon/irqflags.h>
+#include <horizon/smp.h>
+#include <horizon/printk.h>
+#include <horizon/clocksource.h>
+#include <horizon/vdso.h>
 
-/* Timer list */
-static list_head_t timer_list;
+/* Timer ID hash */
+#define TIMER_ID_HASH_BITS  8
+#define TIMER_ID_HASH_SIZE  (1 << TIMER_ID_HASH_BITS)
+#define TIMER_ID_HASH_MASK  (TIMER_ID_HASH_SIZE - 1)
 
-/* Timer lock */
-static spinlock_t timer_lock = SPIN_LOCK_INITIALIZER;
+/* Bucket of level n for the base's current jiffy */
+#define TIMER_INDEX(base, n) \
+    (((base)->timer_jiffies >> (TVR_BITS + (n) * TVN_BITS)) & TVN_MASK)
+
+/* Timer created through the ID interface */
+typedef struct timer_entry {
+    struct timer_list timer;       /* Wheel timer */
+    struct list_head hash;         /* Link in the ID hash */
+    timer_id_t id;                 /* Timer ID */
+    timer_callback_t callback;     /* Callback */
+    void *data;                    /* Callback data */
+    unsigned long period;          /* Period in jiffies, 0 for one-shot */
+    u32 flags;                     /* Flags passed to timer_start() */
+} timer_entry_t;
+
+/* Per-CPU timer wheels */
+struct timer_base timer_bases[CONFIG_NR_CPUS];
+
+/* Timers by ID */
+static list_head_t timer_id_hash[TIMER_ID_HASH_SIZE];
+
+/* Timer ID lock, protects the hash and the ID counter */
+static spinlock_t timer_id_lock = SPIN_LOCK_INITIALIZER;
 
 /* Timer ID counter */
 static u32 timer_id_counter = 0;
@@ -36,26 +69,657 @@ static u64 timer_tick_period = 0;
  * Initialize the timer subsystem
  */
 void timer_init(void) {
-    /* Initialize the timer list */
-    list_init(&timer_list);
+    /* Initialize the timer wheels */
+    for (int cpu = 0; cpu < CONFIG_NR_CPUS; cpu++) {
+        timer_base_t *base = &timer_bases[cpu];
+
+        spin_lock_init_named(&base->lock, "timer_base");
+        base->running_timer = NULL;
+        base->timer_jiffies = (unsigned long)jiffies;
+        base->active_timers = 0;
+        base->shutdown = 0;
+        base->cpu = cpu;
+        base->nr_expired = 0;
+        base->nr_cascaded = 0;
+
+        for (int i = 0; i < TVR_SIZE; i++) {
+            list_init(&base->tv1[i]);
+        }
+        for (int level = 0; level < TVN_LEVELS; level++) {
+            for (int i = 0; i < TVN_SIZE; i++) {
+                list_init(&base->tvn[level][i]);
+            }
+        }
+    }
+
+    /* Initialize the timer ID hash */
+    for (int i = 0; i < TIMER_ID_HASH_SIZE; i++) {
+        list_init(&timer_id_hash[i]);
+    }
 
     /* Set the timer frequency */
     timer_frequency = 1000; /* 1000 Hz (1ms) */
     timer_tick_period = 1000000000ULL / timer_frequency; /* nanoseconds */
 
+    /* Set up the vDSO pages first, the timekeeping publishes to them */
+    vdso_init();
+
+    /* Keep time on jiffies until a better clock source registers */
+    timekeeping_init();
+    hrtimers_init();
+
     /* Initialize the architecture-specific timer */
     arch_timer_init(timer_frequency);
+
+    /* Calibrate the clock source and the clock event against it */
+    arch_clocksource_init();
+}
+
+/**
+ * Put a timer in the bucket for its expiry
+ *
+ * The caller must hold the base lock.
+ *
+ * @param base Timer base
+ * @param timer Timer to add
+ */
+static void timer_internal_add(timer_base_t *base, struct timer_list *timer) {
+    unsigned long expires = timer->expires;
+    unsigned long idx = expires - base->timer_jiffies;
+    struct list_head *vec;
+
+    if (idx < TVR_SIZE) {
+        vec = &base->tv1[expires & TVR_MASK];
+    } else if (idx < 1UL << (TVR_BITS + TVN_BITS)) {
+        vec = &base->tvn[0][(expires >> TVR_BITS) & TVN_MASK];
+    } else if (idx < 1UL << (TVR_BITS + 2 * TVN_BITS)) {
+        vec = &base->tvn[1][(expires >> (TVR_BITS + TVN_BITS)) & TVN_MASK];
+    } else if (idx < 1UL << (TVR_BITS + 3 * TVN_BITS)) {
+        vec = &base->tvn[2][(expires >> (TVR_BITS + 2 * TVN_BITS)) & TVN_MASK];
+    } else if ((long)idx < 0) {
+        /* Already due, run on the next jiffy processed */
+        vec = &base->tv1[base->timer_jiffies & TVR_MASK];
+    } else {
+        vec = &base->tvn[3][(expires >> (TVR_BITS + 3 * TVN_BITS)) & TVN_MASK];
+    }
+
+    list_add_tail(&timer->entry, vec);
+}
+
+/**
+ * Take a pending timer out of its bucket
+ *
+ * The caller must hold the base lock.
+ *
+ * @param base Timer base
+ * @param timer Timer
+ * @return 1 if the timer was pending, 0 if not
+ */
+static int timer_detach(timer_base_t *base, struct timer_list *timer) {
+    if (timer->entry.next == NULL) {
+        return 0;
+    }
+
+    /* list_del() leaves next NULL, which marks the timer not pending */
+    list_del(&timer->entry);
+    base->active_timers--;
+
+    return 1;
+}
+
+/**
+ * Lock the base a timer is on
+ *
+ * The base changes under us while the timer moves to another CPU, so
+ * check it again once locked.
+ *
+ * @param timer Timer
+ * @param flags Saved interrupt state
+ * @return Locked base
+ */
+static timer_base_t *timer_lock_base(struct timer_list *timer, unsigned long *flags) {
+    for (;;) {
+        timer_base_t *base = timer->base;
+
+        if (base != NULL) {
+            local_irq_save(*flags);
+            spin_lock(&base->lock);
+            if (base == timer->base) {
+                return base;
+            }
+            spin_unlock(&base->lock);
+            local_irq_restore(*flags);
+        }
+
+        __asm__ volatile("pause" ::: "memory");
+    }
+}
+
+/**
+ * Round a timer's expiry up within its slack
+ *
+ * Timers rounded to the same jiffy expire together, so a CPU wakes once
+ * for a group instead of once for each.
+ *
+ * @param timer Timer
+ * @param expires Requested expiry
+ * @return Expiry to use
+ */
+static unsigned long timer_apply_slack(struct timer_list *timer, unsigned long expires) {
+    unsigned long limit, mask;
+
+    if (timer->slack >= 0) {
+        limit = expires + timer->slack;
+    } else {
+        /* Automatic slack, 0.4% of the timeout */
+        long delta = (long)(expires - (unsigned long)jiffies);
+
+        if (delta < 256) {
+            return expires;
+        }
+        limit = expires + delta / 256;
+    }
+
+    /* Clear every bit below the highest one that differs */
+    mask = expires ^ limit;
+    if (mask == 0) {
+        return expires;
+    }
+    mask = (1UL << (sizeof(long) * 8 - 1 - __builtin_clzl(mask))) - 1;
+
+    return limit & ~mask;
+}
+
+/**
+ * Queue a timer on a CPU's wheel, moving it there if needed
+ *
+ * @param timer Timer
+ * @param expires Expiry in jiffies
+ * @param cpu Target CPU, or -1 for the current CPU unless the timer is pinned
+ * @return 1 if the timer was pending, 0 if not
+ */
+static int timer_queue(struct timer_list *timer, unsigned long expires, int cpu) {
+    unsigned long flags;
+    timer_base_t *base = timer_lock_base(timer, &flags);
+    int pending = timer_detach(base, timer);
+    timer_base_t *new_base;
+
+    if (cpu >= 0) {
+        new_base = &timer_bases[cpu];
+    } else if ((timer->flags & TIMER_FLAG_PINNED) && !base->shutdown) {
+        new_base = base;
+    } else {
+        new_base = &timer_bases[smp_processor_id()];
+    }
+
+    /* A running timer stays put so del_timer_sync() finds it */
+    if (new_base != base && base->running_timer != timer) {
+        timer->base = NULL;
+        spin_unlock(&base->lock);
+        spin_lock(&new_base->lock);
+        timer->base = new_base;
+        base = new_base;
+    }
+
+    timer->expires = expires;
+    timer_internal_add(base, timer);
+    base->active_timers++;
+
+    spin_unlock(&base->lock);
+    local_irq_restore(flags);
+
+    return pending;
+}
+
+/**
+ * Initialize a timer
+ *
+ * @param timer Timer
+ */
+void init_timer(struct timer_list *timer) {
+    timer->entry.next = NULL;
+    timer->entry.prev = NULL;
+    timer->expires = 0;
+    timer->function = NULL;
+    timer->data = 0;
+    timer->flags = 0;
+    timer->slack = -1;
+    timer->base = &timer_bases[smp_processor_id()];
+}
+
+/**
+ * Initialize a timer with its function
+ *
+ * @param timer Timer
+ * @param function Timer function
+ * @param data Argument to the function
+ */
+void setup_timer(struct timer_list *timer, void (*function)(unsigned long), unsigned long data) {
+    init_timer(timer);
+    timer->function = function;
+    timer->data = data;
+}
+
+/**
+ * Initialize a timer that lives on the stack
+ *
+ * @param timer Timer
+ * @param function Timer function
+ * @param data Argument to the function
+ */
+void setup_timer_on_stack(struct timer_list *timer, void (*function)(unsigned long), unsigned long data) {
+    setup_timer(timer, function, data);
+}
+
+/**
+ * Release a timer that lives on the stack
+ *
+ * @param timer Timer, which must not be pending
+ */
+void destroy_timer_on_stack(struct timer_list *timer) {
+    (void)timer;
+}
+
+/**
+ * Check if a timer is pending
+ *
+ * @param timer Timer
+ * @return 1 if pending, 0 if not
+ */
+int timer_pending(const struct timer_list *timer) {
+    return timer->entry.next != NULL;
+}
+
+/**
+ * Set the slack of a timer
+ *
+ * @param timer Timer
+ * @param slack_jiffies Jiffies the expiry may be rounded up by, -1 for automatic
+ */
+void set_timer_slack(struct timer_list *timer, long slack_jiffies) {
+    timer->slack = slack_jiffies;
+}
+
+/**
+ * Start a timer on the current CPU
+ *
+ * @param timer Timer, with expires set, which must not be pending
+ */
+void add_timer(struct timer_list *timer) {
+    mod_timer(timer, timer->expires);
+}
+
+/**
+ * Start a timer on a given CPU
+ *
+ * @param timer Timer, with expires set, which must not be pending
+ * @param cpu CPU
+ */
+void add_timer_on(struct timer_list *timer, int cpu) {
+    if (cpu < 0 || cpu >= CONFIG_NR_CPUS) {
+        return;
+    }
+
+    timer_queue(timer, timer->expires, cpu);
+}
+
+/**
+ * Modify a timer's expiry, starting it if it is not pending
+ *
+ * @param timer Timer
+ * @param expires New expiry in jiffies
+ * @return 1 if the timer was pending, 0 if not
+ */
+int mod_timer(struct timer_list *timer, unsigned long expires) {
+    expires = timer_apply_slack(timer, expires);
+
+    /* Re-arming to the same expiry is common for timeouts, leave it be */
+    if (timer_pending(timer) && timer->expires == expires) {
+        return 1;
+    }
+
+    return timer_queue(timer, expires, -1);
+}
+
+/**
+ * Stop a timer
+ *
+ * The function may still be running on another CPU on return.
+ *
+ * @param timer Timer
+ * @return 1 if the timer was pending, 0 if not
+ */
+int del_timer(struct timer_list *timer) {
+    unsigned long flags;
+    timer_base_t *base;
+    int ret;
+
+    if (!timer_pending(timer)) {
+        return 0;
+    }
+
+    base = timer_lock_base(timer, &flags);
+    ret = timer_detach(base, timer);
+    spin_unlock(&base->lock);
+    local_irq_restore(flags);
+
+    return ret;
+}
+
+/**
+ * Stop a timer and wait for its function to finish
+ *
+ * Must not be called from the timer's own function.
+ *
+ * @param timer Timer
+ * @return 1 if the timer was pending, 0 if not
+ */
+int del_timer_sync(struct timer_list *timer) {
+    for (;;) {
+        unsigned long flags;
+        timer_base_t *base = timer_lock_base(timer, &flags);
+        int running = base->running_timer == timer;
+        int ret = 0;
+
+        if (!running) {
+            ret = timer_detach(base, timer);
+        }
+
+        spin_unlock(&base->lock);
+        local_irq_restore(flags);
+
+        if (!running) {
+            return ret;
+        }
+
+        __asm__ volatile("pause" ::: "memory");
+    }
+}
+
+/**
+ * Move the timers of a bucket down to where they now belong
+ *
+ * The caller must hold the base lock.
+ *
+ * @param base Timer base
+ * @param tv Level to cascade from
+ * @param index Bucket in the level
+ * @return index, 0 when the next level up must cascade too
+ */
+static int timer_cascade(timer_base_t *base, struct list_head *tv, int index) {
+    list_head_t work;
+
+    /* Take the whole bucket first, re-adding may land in this level again */
+    list_init(&work);
+    while (!list_empty(&tv[index])) {
+        list_head_t *entry = tv[index].next;
+
+        list_del(entry);
+        list_add_tail(entry, &work);
+    }
+
+    while (!list_empty(&work)) {
+        struct timer_list *timer = list_entry(work.next, struct timer_list, entry);
+
+        list_del(&timer->entry);
+        timer_internal_add(base, timer);
+        base->nr_cascaded++;
+    }
+
+    return index;
+}
+
+/**
+ * Run the expired timers of a base
+ *
+ * Timer functions run with the base unlocked and must not sleep.
+ *
+ * @param base Timer base
+ */
+static void timer_run_timers(timer_base_t *base) {
+    unsigned long now = (unsigned long)jiffies;
+    unsigned long flags;
+
+    local_irq_save(flags);
+    spin_lock(&base->lock);
+
+    while ((long)(now - base->timer_jiffies) >= 0) {
+        int index = base->timer_jiffies & TVR_MASK;
+        list_head_t work;
+
+        /* The first level wrapped, refill it from the levels above */
+        if (index == 0 &&
+            timer_cascade(base, base->tvn[0], TIMER_INDEX(base, 0)) == 0 &&
+            timer_cascade(base, base->tvn[1], TIMER_INDEX(base, 1)) == 0 &&
+            timer_cascade(base, base->tvn[2], TIMER_INDEX(base, 2)) == 0) {
+            timer_cascade(base, base->tvn[3], TIMER_INDEX(base, 3));
+        }
+        base->timer_jiffies++;
+
+        list_init(&work);
+        while (!list_empty(&base->tv1[index])) {
+            list_head_t *entry = base->tv1[index].next;
+
+            list_del(entry);
+            list_add_tail(entry, &work);
+        }
+
+        while (!list_empty(&work)) {
+            struct timer_list *timer = list_entry(work.next, struct timer_list, entry);
+            void (*function)(unsigned long) = timer->function;
+            unsigned long data = timer->data;
+
+            timer_detach(base, timer);
+            base->running_timer = timer;
+            base->nr_expired++;
+
+            spin_unlock(&base->lock);
+            if (function != NULL) {
+                function(data);
+            }
+            spin_lock(&base->lock);
+        }
+    }
+
+    base->running_timer = NULL;
+
+    spin_unlock(&base->lock);
+    local_irq_restore(flags);
+}
+
+/**
+ * Find the earliest expiry of the non-deferrable timers in a bucket
+ *
+ * @param head Bucket
+ * @param earliest Earliest expiry so far, updated
+ * @param found Set if a timer was found
+ */
+static void timer_bucket_earliest(struct list_head *head, unsigned long *earliest, int *found) {
+    struct timer_list *timer;
+
+    list_for_each_entry(timer, head, entry) {
+        if (timer->flags & TIMER_FLAG_DEFERRABLE) {
+            continue;
+        }
+
+        if (!*found || (long)(timer->expires - *earliest) < 0) {
+            *earliest = timer->expires;
+            *found = 1;
+        }
+    }
+}
+
+/**
+ * Get the time until the next timer of the current CPU
+ *
+ * Deferrable timers do not count, they run with the first tick after
+ * the CPU wakes up for something else.
+ *
+ * @return Jiffies until the earliest timer, 0 if one is due, ~0UL if none
+ */
+unsigned long timer_next_expiry(void) {
+    timer_base_t *base = &timer_bases[smp_processor_id()];
+    unsigned long now = (unsigned long)jiffies;
+    unsigned long earliest = 0;
+    unsigned long flags;
+    int found = 0;
+
+    local_irq_save(flags);
+    spin_lock(&base->lock);
+
+    /* The first level is sorted by jiffy, the first hit is its earliest */
+    for (int i = 0; i < TVR_SIZE && !found; i++) {
+        timer_bucket_earliest(&base->tv1[(base->timer_jiffies + i) & TVR_MASK], &earliest, &found);
+    }
+
+    /* The first occupied bucket of each level above may hold earlier ones */
+    for (int level = 0; level < TVN_LEVELS; level++) {
+        unsigned long index = TIMER_INDEX(base, level);
+
+        for (int i = 0; i < TVN_SIZE; i++) {
+            struct list_head *head = &base->tvn[level][(index + i) & TVN_MASK];
+            int level_found = 0;
+            unsigned long level_earliest = 0;
+
+            timer_bucket_earliest(head, &level_earliest, &level_found);
+            if (level_found) {
+                if (!found || (long)(level_earliest - earliest) < 0) {
+                    earliest = level_earliest;
+                    found = 1;
+                }
+                break;
+            }
+        }
+    }
+
+    spin_unlock(&base->lock);
+    local_irq_restore(flags);
+
+    if (!found) {
+        return ~0UL;
+    }
+
+    return (long)(earliest - now) > 0 ? earliest - now : 0;
+}
+
+/**
+ * Move the timers of an offline CPU to another CPU
+ *
+ * @param cpu CPU going offline
+ * @param target CPU to take over its timers
+ */
+void timer_migrate_cpu(int cpu, int target) {
+    timer_base_t *old_base, *new_base;
+    unsigned long flags;
+
+    if (cpu < 0 || cpu >= CONFIG_NR_CPUS || target < 0 || target >= CONFIG_NR_CPUS || cpu == target) {
+        return;
+    }
+
+    old_base = &timer_bases[cpu];
+    new_base = &timer_bases[target];
+
+    /* Lock in CPU order, the other direction may run at the same time */
+    local_irq_save(flags);
+    if (cpu < target) {
+        spin_lock(&old_base->lock);
+        spin_lock(&new_base->lock);
+    } else {
+        spin_lock(&new_base->lock);
+        spin_lock(&old_base->lock);
+    }
+
+    old_base->shutdown = 1;
+
+    for (int i = 0; i < TVR_SIZE + TVN_LEVELS * TVN_SIZE; i++) {
+        struct list_head *head = i < TVR_SIZE ? &old_base->tv1[i] : &old_base->tvn[(i - TVR_SIZE) / TVN_SIZE][(i - TVR_SIZE) % TVN_SIZE];
+
+        while (!list_empty(head)) {
+            struct timer_list *timer = list_entry(head->next, struct timer_list, entry);
+
+            timer_detach(old_base, timer);
+            timer->base = new_base;
+            timer_internal_add(new_base, timer);
+            new_base->active_timers++;
+        }
+    }
+
+    spin_unlock(&old_base->lock);
+    spin_unlock(&new_base->lock);
+    local_irq_restore(flags);
+}
+
+/**
+ * Print timer statistics
+ */
+void timer_print_stats(void) {
+    printk(KERN_INFO "Timer wheels at jiffy %llu:\n", (u64)jiffies);
+
+    for (int cpu = 0; cpu < CONFIG_NR_CPUS; cpu++) {
+        timer_base_t *base = &timer_bases[cpu];
+
+        if (base->nr_expired == 0 && base->active_timers == 0) {
+            continue;
+        }
+
+        printk(KERN_INFO "  CPU %d: pending %u, expired %llu, cascaded %llu%s\n",
+               cpu, base->active_timers, base->nr_expired, base->nr_cascaded,
+               base->shutdown ? ", offline" : "");
+    }
+}
+
+/**
+ * Find a timer by ID
+ *
+ * The caller must hold the timer ID lock.
+ *
+ * @param id Timer ID
+ * @return Timer, or NULL if not found
+ */
+static timer_entry_t *timer_entry_find(timer_id_t id) {
+    timer_entry_t *entry;
+
+    list_for_each_entry(entry, &timer_id_hash[id & TIMER_ID_HASH_MASK], hash) {
+        if (entry->id == id) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Timer function of timers created by ID
+ *
+ * @param data Timer entry
+ */
+static void timer_entry_function(unsigned long data) {
+    timer_entry_t *entry = (timer_entry_t *)data;
+
+    /* Re-arm first so the callback can stop it, skipping missed periods */
+    if (entry->period > 0) {
+        unsigned long now = (unsigned long)jiffies;
+        unsigned long next = entry->timer.expires + entry->period;
+
+        if ((long)(next - now) <= 0) {
+            next = now + entry->period;
+        }
+        timer_queue(&entry->timer, next, -1);
+    }
+
+    entry->callback(entry->id, entry->data);
 }
 
 /**
  * Create a timer
- * 
+ *
  * @param callback Timer callback function
  * @param data Timer callback data
  * @return Timer ID on success, 0 on failure
  */
 timer_id_t timer_create(timer_callback_t callback, void *data) {
-    timer_t *timer;
+    timer_entry_t *entry;
+    unsigned long flags;
 
     /* Check parameters */
     if (callback == NULL) {
@@ -63,61 +727,70 @@ timer_id_t timer_create(timer_callback_t callback, void *data) {
     }
 
     /* Allocate timer */
-    timer = kmalloc(sizeof(timer_t), 0);
-    if (timer == NULL) {
+    entry = kmalloc(sizeof(timer_entry_t), 0);
+    if (entry == NULL) {
         return 0;
     }
 
     /* Initialize timer */
-    timer->id = ++timer_id_counter;
-    timer->callback = callback;
-    timer->data = data;
-    timer->expires = 0;
-    timer->period = 0;
-    timer->flags = 0;
-    list_init(&timer->list);
+    setup_timer(&entry->timer, timer_entry_function, (unsigned long)entry);
+    entry->callback = callback;
+    entry->data = data;
+    entry->period = 0;
+    entry->flags = 0;
+
+    /* Make it known by ID */
+    local_irq_save(flags);
+    spin_lock(&timer_id_lock);
+    entry->id = ++timer_id_counter;
+    list_add(&entry->hash, &timer_id_hash[entry->id & TIMER_ID_HASH_MASK]);
+    spin_unlock(&timer_id_lock);
+    local_irq_restore(flags);
 
-    return timer->id;
+    return entry->id;
 }
 
 /**
  * Delete a timer
- * 
+ *
  * @param id Timer ID
  * @return 0 on success, negative error code on failure
  */
 int timer_delete(timer_id_t id) {
-    timer_t *timer;
-    list_head_t *pos;
+    timer_entry_t *entry;
+    unsigned long flags;
 
     /* Check parameters */
     if (id == 0) {
         return -EINVAL;
     }
 
-    /* Find the timer */
-    spin_lock(&timer_lock);
-    list_for_each(pos, &timer_list) {
-        timer = list_entry(pos, timer_t, list);
-        if (timer->id == id) {
-            /* Remove the timer from the list */
-            list_del(&timer->list);
-            spin_unlock(&timer_lock);
-
-            /* Free the timer */
-            kfree(timer);
-            return 0;
-        }
+    /* Find the timer and forget its ID */
+    local_irq_save(flags);
+    spin_lock(&timer_id_lock);
+    entry = timer_entry_find(id);
+    if (entry != NULL) {
+        list_del(&entry->hash);
     }
-    spin_unlock(&timer_lock);
+    spin_unlock(&timer_id_lock);
+    local_irq_restore(flags);
 
-    /* Timer not found */
-    return -ENOENT;
+    if (entry == NULL) {
+        return -ENOENT;
+    }
+
+    /* A periodic timer re-arms itself, so stop it until it stays stopped */
+    entry->period = 0;
+    del_timer_sync(&entry->timer);
+
+    /* Free the timer */
+    kfree(entry);
+    return 0;
 }
 
 /**
  * Start a timer
- * 
+ *
  * @param id Timer ID
  * @param expires Expiration time in milliseconds
  * @param period Period in milliseconds (0 for one-shot)
@@ -125,8 +798,8 @@ int timer_delete(timer_id_t id) {
  * @return 0 on success, negative error code on failure
  */
 int timer_start(timer_id_t id, u64 expires, u64 period, u32 flags) {
-    timer_t *timer;
-    list_head_t *pos;
+    timer_entry_t *entry;
+    unsigned long irq_flags;
 
     /* Check parameters */
     if (id == 0) {
@@ -134,42 +807,38 @@ int timer_start(timer_id_t id, u64 expires, u64 period, u32 flags) {
     }
 
     /* Find the timer */
-    spin_lock(&timer_lock);
-    list_for_each(pos, &timer_list) {
-        timer = list_entry(pos, timer_t, list);
-        if (timer->id == id) {
-            /* Remove the timer from the list */
-            list_del(&timer->list);
-            break;
-        }
-    }
-    if (pos == &timer_list) {
+    local_irq_save(irq_flags);
+    spin_lock(&timer_id_lock);
+    entry = timer_entry_find(id);
+    if (entry == NULL) {
         /* Timer not found */
-        spin_unlock(&timer_lock);
+        spin_unlock(&timer_id_lock);
+        local_irq_restore(irq_flags);
         return -ENOENT;
     }
 
     /* Set the timer parameters */
-    timer->expires = jiffies + (expires * timer_frequency) / 1000;
-    timer->period = (period * timer_frequency) / 1000;
-    timer->flags = flags;
+    entry->period = (period * timer_frequency) / 1000;
+    entry->flags = flags;
+    entry->timer.flags = flags & (TIMER_FLAG_DEFERRABLE | TIMER_FLAG_PINNED);
 
-    /* Add the timer to the list */
-    list_add_tail(&timer->list, &timer_list);
-    spin_unlock(&timer_lock);
+    /* Queue it, deferrable timers may be batched with their neighbours */
+    timer_queue(&entry->timer, (unsigned long)jiffies + (expires * timer_frequency) / 1000, -1);
+    spin_unlock(&timer_id_lock);
+    local_irq_restore(irq_flags);
 
     return 0;
 }
 
 /**
  * Stop a timer
- * 
+ *
  * @param id Timer ID
  * @return 0 on success, negative error code on failure
  */
 int timer_stop(timer_id_t id) {
-    timer_t *timer;
-    list_head_t *pos;
+    timer_entry_t *entry;
+    unsigned long flags;
 
     /* Check parameters */
     if (id == 0) {
@@ -177,32 +846,30 @@ int timer_stop(timer_id_t id) {
     }
 
     /* Find the timer */
-    spin_lock(&timer_lock);
-    list_for_each(pos, &timer_list) {
-        timer = list_entry(pos, timer_t, list);
-        if (timer->id == id) {
-            /* Remove the timer from the list */
-            list_del(&timer->list);
-            spin_unlock(&timer_lock);
-            return 0;
-        }
+    local_irq_save(flags);
+    spin_lock(&timer_id_lock);
+    entry = timer_entry_find(id);
+    if (entry != NULL) {
+        entry->period = 0;
+        del_timer(&entry->timer);
     }
-    spin_unlock(&timer_lock);
+    spin_unlock(&timer_id_lock);
+    local_irq_restore(flags);
 
     /* Timer not found */
-    return -ENOENT;
+    return entry != NULL ? 0 : -ENOENT;
 }
 
 /**
  * Get timer information
- * 
+ *
  * @param id Timer ID
  * @param info Timer information
  * @return 0 on success, negative error code on failure
  */
 int timer_get_info(timer_id_t id, timer_info_t *info) {
-    timer_t *timer;
-    list_head_t *pos;
+    timer_entry_t *entry;
+    unsigned long flags;
 
     /* Check parameters */
     if (id == 0 || info == NULL) {
@@ -210,76 +877,34 @@ int timer_get_info(timer_id_t id, timer_info_t *info) {
     }
 
     /* Find the timer */
-    spin_lock(&timer_lock);
-    list_for_each(pos, &timer_list) {
-        timer = list_entry(pos, timer_t, list);
-        if (timer->id == id) {
-            /* Get the timer information */
-            info->id = timer->id;
-            info->expires = (timer->expires > jiffies) ? ((timer->expires - jiffies) * 1000) / timer_frequency : 0;
-            info->period = (timer->period * 1000) / timer_frequency;
-            info->flags = timer->flags;
-            spin_unlock(&timer_lock);
-            return 0;
-        }
+    local_irq_save(flags);
+    spin_lock(&timer_id_lock);
+    entry = timer_entry_find(id);
+    if (entry != NULL) {
+        /* Get the timer information */
+        unsigned long now = (unsigned long)jiffies;
+        long left = (long)(entry->timer.expires - now);
+
+        info->id = entry->id;
+        info->expires = (timer_pending(&entry->timer) && left > 0) ? ((u64)left * 1000) / timer_frequency : 0;
+        info->period = ((u64)entry->period * 1000) / timer_frequency;
+        info->flags = entry->flags;
     }
-    spin_unlock(&timer_lock);
+    spin_unlock(&timer_id_lock);
+    local_irq_restore(flags);
 
     /* Timer not found */
-    return -ENOENT;
+    return entry != NULL ? 0 : -ENOENT;
 }
 
 /**
  * Process timers
- * 
- * This function is called by the timer interrupt handler to process expired timers.
+ *
+ * This function is called by the timer interrupt handler to run the
+ * expired timers of the current CPU.
  */
 void timer_process(void) {
-    timer_t *timer;
-    list_head_t *pos, *n;
-    list_head_t expired_timers;
-
-    /* Initialize the expired timers list */
-    list_init(&expired_timers);
-
-    /* Find expired timers */
-    spin_lock(&timer_lock);
-    list_for_each_safe(pos, n, &timer_list) {
-        timer = list_entry(pos, timer_t, list);
-        if (timer->expires <= jiffies) {
-            /* Remove the timer from the list */
-            list_del(&timer->list);
-
-            /* Add the timer to the expired timers list */
-            list_add_tail(&timer->list, &expired_timers);
-        }
-    }
-    spin_unlock(&timer_lock);
-
-    /* Process expired timers */
-    list_for_each_safe(pos, n, &expired_timers) {
-        timer = list_entry(pos, timer_t, list);
-
-        /* Remove the timer from the expired timers list */
-        list_del(&timer->list);
-
-        /* Call the timer callback */
-        if (timer->callback != NULL) {
-            timer->callback(timer->id, timer->data);
-        }
-
-        /* Check if the timer is periodic */
-        if (timer->period > 0) {
-            /* Restart the timer */
-            spin_lock(&timer_lock);
-            timer->expires = jiffies + timer->period;
-            list_add_tail(&timer->list, &timer_list);
-            spin_unlock(&timer_lock);
-        } else {
-            /* Free the timer */
-            kfree(timer);
-        }
-    }
+    timer_run_timers(&timer_bases[smp_processor_id()]);
 }
 
 /**
@@ -292,13 +917,33 @@ void timer_tick(void) {
     jiffies++;
 
     /* Update the time */
-    time_update(jiffies / timer_frequency, (jiffies % timer_frequency) * (1000000 / timer_frequency));
+    timekeeping_tick();
 
     /* Process timers */
     timer_process();
+    hrtimer_run_queues();
 
-    /* Schedule */
-    schedule();
+    /* Run the scheduler tick */
+    sched_tick();
+}
+
+/**
+ * Account for ticks that passed without a timer interrupt
+ *
+ * Called when the periodic tick resumes after a tickless idle period.
+ *
+ * @param ticks Number of missed ticks
+ */
+void timer_account_ticks(u64 ticks) {
+    if (ticks == 0) {
+        return;
+    }
+
+    /* Advance jiffies */
+    jiffies += ticks;
+
+    /* Update the time */
+    timekeeping_tick();
 }
 
 /**
@@ -388,7 +1033,7 @@ void timer_msleep(u64 msec) {
  * @param usec Microseconds to sleep
  */
 void timer_usleep(u64 usec) {
-    timer_msleep(usec / 1000);
+    timer_nsleep(usec * NSEC_PER_USEC);
 }
 
 /**
@@ -397,7 +1042,12 @@ void timer_usleep(u64 usec) {
  * @param nsec Nanoseconds to sleep
  */
 void timer_nsleep(u64 nsec) {
-    timer_msleep(nsec / 1000000);
+    ktime_t expires = ktime_get() + (ktime_t)nsec;
+
+    /* A signal ends the sleep early, sleep on until the expiry */
+    while (hrtimer_nanosleep(CLOCK_MONOTONIC, expires, HRTIMER_MODE_ABS, NULL) != 0) {
+        schedule();
+    }
 }
 
 /**
@@ -1,12 +1,16 @@
 /**
  * timerfd.c - Horizon kernel timer file descriptor implementation
  * 
- * This file contains the implementation of the timer file descriptor.
+ * This file contains the implementation of the timer file descriptor. Each
+ * one runs on a high resolution timer of its clock, so expirations are not
+ * rounded to the tick.
  */
 
 #include <horizon/kernel.h>
 #include <horizon/types.h>
 #include <horizon/time.h>
+#include <horizon/timer.h>
+#include <horizon/irqflags.h>
 #include <horizon/fs/vfs.h>
 #include <horizon/fs/file.h>
 #include <horizon/mm.h>
@@ -31,8 +35,8 @@ typedef struct timerfd {
     struct itimerspec value;    /* Timer value */
     struct wait_queue_head wait; /* Wait queue */
     uint64_t ticks;             /* Number of expirations */
-    struct timer_list timer;    /* Timer */
-    spinlock_t lock;            /* Lock */
+    struct hrtimer timer;       /* Timer */
+    spinlock_t lock;            /* Lock, taken from the timer interrupt */
 } timerfd_t;
 
 /* Maximum number of timer file descriptors */
@@ -61,32 +65,24 @@ void timerfd_init(void) {
  * Timer file descriptor timer callback
  * 
  * @param timer The timer
+ * @return HRTIMER_RESTART if the timer is periodic
  */
-static void timerfd_timer_callback(struct timer_list *timer) {
+static enum hrtimer_restart timerfd_timer_callback(struct hrtimer *timer) {
     /* Get the timer file descriptor */
     timerfd_t *tfd = container_of(timer, timerfd_t, timer);
+    enum hrtimer_restart ret = HRTIMER_NORESTART;
     
     /* Lock the timer file descriptor */
     spin_lock(&tfd->lock);
     
-    /* Increment the number of expirations */
-    tfd->ticks++;
-    
     /* Check if the timer is periodic */
     if (tfd->value.it_interval.tv_sec > 0 || tfd->value.it_interval.tv_nsec > 0) {
-        /* Calculate the next expiration */
-        unsigned long expires = jiffies;
-        
-        if (tfd->value.it_interval.tv_sec > 0) {
-            expires += tfd->value.it_interval.tv_sec * HZ;
-        }
-        
-        if (tfd->value.it_interval.tv_nsec > 0) {
-            expires += tfd->value.it_interval.tv_nsec / (1000000000 / HZ);
-        }
-        
-        /* Set the timer */
-        mod_timer(&tfd->timer, expires);
+        /* Count every period that passed, including any we were late for */
+        tfd->ticks += hrtimer_forward_now(timer, timespec_to_ktime(&tfd->value.it_interval));
+        ret = HRTIMER_RESTART;
+    } else {
+        /* Increment the number of expirations */
+        tfd->ticks++;
     }
     
     /* Unlock the timer file descriptor */
@@ -94,6 +90,33 @@ static void timerfd_timer_callback(struct timer_list *timer) {
     
     /* Wake up any waiting processes */
     wake_up_interruptible(&tfd->wait);
+    
+    return ret;
+}
+
+/**
+ * Get the current value of a timer file descriptor
+ * 
+ * The caller must hold the timer file descriptor lock.
+ * 
+ * @param tfd The timer file descriptor
+ * @param value The current value
+ */
+static void timerfd_get_value(timerfd_t *tfd, struct itimerspec *value) {
+    /* Set the interval */
+    value->it_interval = tfd->value.it_interval;
+    
+    /* Check if the timer is enabled */
+    if (hrtimer_is_queued(&tfd->timer)) {
+        /* Calculate the remaining time */
+        ktime_t remaining = hrtimer_get_remaining(&tfd->timer);
+        
+        value->it_value = ktime_to_timespec(remaining > 0 ? remaining : 0);
+    } else {
+        /* Timer is not enabled */
+        value->it_value.tv_sec = 0;
+        value->it_value.tv_nsec = 0;
+    }
 }
 
 /**
@@ -147,7 +170,8 @@ int time_timerfd_create(int clockid, int flags) {
     memset(&tfd->value, 0, sizeof(struct itimerspec));
     init_waitqueue_head(&tfd->wait);
     tfd->ticks = 0;
-    timer_setup(&tfd->timer, timerfd_timer_callback, 0);
+    hrtimer_init(&tfd->timer, clockid, HRTIMER_MODE_ABS);
+    tfd->timer.function = timerfd_timer_callback;
     spin_lock_init(&tfd->lock);
     
     /* Set the timer file descriptor */
@@ -226,76 +250,47 @@ int time_timerfd_settime(int fd, int flags, const struct itimerspec *new_value,
         return -1;
     }
     
-    /* Lock the timer file descriptor */
-    spin_lock(&tfd->lock);
+    /* Lock the timer file descriptor once the callback is not running */
+    unsigned long irq_flags;
+    int queued;
+    
+    for (;;) {
+        local_irq_save(irq_flags);
+        spin_lock(&tfd->lock);
+        
+        queued = hrtimer_try_to_cancel(&tfd->timer);
+        if (queued >= 0) {
+            break;
+        }
+        
+        /* The callback waits for our lock, let it finish */
+        spin_unlock(&tfd->lock);
+        local_irq_restore(irq_flags);
+        __asm__ volatile("pause" ::: "memory");
+    }
     
     /* Save the old value */
     if (old_value != NULL) {
-        memcpy(old_value, &tfd->value, sizeof(struct itimerspec));
+        ktime_t remaining = queued ? hrtimer_get_remaining(&tfd->timer) : 0;
+        
+        old_value->it_interval = tfd->value.it_interval;
+        old_value->it_value = ktime_to_timespec(remaining > 0 ? remaining : 0);
     }
     
-    /* Cancel the timer */
-    del_timer(&tfd->timer);
-    
-    /* Set the new value */
+    /* Set the new value, expirations of the old one are dropped */
     memcpy(&tfd->value, new_value, sizeof(struct itimerspec));
+    tfd->ticks = 0;
     
     /* Check if the timer is enabled */
     if (new_value->it_value.tv_sec > 0 || new_value->it_value.tv_nsec > 0) {
-        /* Calculate the expiration */
-        unsigned long expires = jiffies;
-        
-        if (flags & TFD_TIMER_ABSTIME) {
-            /* Absolute time */
-            struct timespec now;
-            
-            if (tfd->clockid == CLOCK_REALTIME) {
-                now.tv_sec = time_get_seconds();
-                now.tv_nsec = time_get_nanoseconds();
-            } else {
-                now.tv_sec = time_get_monotonic_seconds();
-                now.tv_nsec = time_get_monotonic_nanoseconds();
-            }
-            
-            /* Calculate the relative time */
-            time_t sec = new_value->it_value.tv_sec - now.tv_sec;
-            long nsec = new_value->it_value.tv_nsec - now.tv_nsec;
-            
-            if (nsec < 0) {
-                sec--;
-                nsec += 1000000000;
-            }
-            
-            if (sec < 0) {
-                sec = 0;
-                nsec = 0;
-            }
-            
-            /* Calculate the expiration */
-            if (sec > 0) {
-                expires += sec * HZ;
-            }
-            
-            if (nsec > 0) {
-                expires += nsec / (1000000000 / HZ);
-            }
-        } else {
-            /* Relative time */
-            if (new_value->it_value.tv_sec > 0) {
-                expires += new_value->it_value.tv_sec * HZ;
-            }
-            
-            if (new_value->it_value.tv_nsec > 0) {
-                expires += new_value->it_value.tv_nsec / (1000000000 / HZ);
-            }
-        }
-        
-        /* Set the timer */
-        mod_timer(&tfd->timer, expires);
+        /* Start the timer on its clock, absolute or relative */
+        hrtimer_start(&tfd->timer, timespec_to_ktime(&new_value->it_value),
+                      (flags & TFD_TIMER_ABSTIME) ? HRTIMER_MODE_ABS : HRTIMER_MODE_REL);
     }
     
     /* Unlock the timer file descriptor */
     spin_unlock(&tfd->lock);
+    local_irq_restore(irq_flags);
     
     return 0;
 }
@@ -328,27 +323,17 @@ int time_timerfd_gettime(int fd, struct itimerspec *curr_value) {
     }
     
     /* Lock the timer file descriptor */
-    spin_lock(&tfd->lock);
+    unsigned long flags;
     
-    /* Set the interval */
-    curr_value->it_interval = tfd->value.it_interval;
+    local_irq_save(flags);
+    spin_lock(&tfd->lock);
     
-    /* Check if the timer is enabled */
-    if (timer_pending(&tfd->timer)) {
-        /* Calculate the remaining time */
-        unsigned long remaining = tfd->timer.expires - jiffies;
-        
-        /* Set the value */
-        curr_value->it_value.tv_sec = remaining / HZ;
-        curr_value->it_value.tv_nsec = (remaining % HZ) * (1000000000 / HZ);
-    } else {
-        /* Timer is not enabled */
-        curr_value->it_value.tv_sec = 0;
-        curr_value->it_value.tv_nsec = 0;
-    }
+    /* Get the value */
+    timerfd_get_value(tfd, curr_value);
     
     /* Unlock the timer file descriptor */
     spin_unlock(&tfd->lock);
+    local_irq_restore(flags);
     
     return 0;
 }
@@ -376,6 +361,9 @@ static ssize_t timerfd_read(file_t *file, char *buf, size_t count, loff_t *ppos)
     }
     
     /* Lock the timer file descriptor */
+    unsigned long flags;
+    
+    local_irq_save(flags);
     spin_lock(&tfd->lock);
     
     /* Check if there are any expirations */
@@ -383,11 +371,13 @@ static ssize_t timerfd_read(file_t *file, char *buf, size_t count, loff_t *ppos)
         /* Check if the file is non-blocking */
         if (file->f_flags & O_NONBLOCK) {
             spin_unlock(&tfd->lock);
+            local_irq_restore(flags);
             return -1;
         }
         
         /* Unlock the timer file descriptor */
         spin_unlock(&tfd->lock);
+        local_irq_restore(flags);
         
         /* Wait for expirations */
         int ret = wait_event_interruptible(tfd->wait, tfd->ticks > 0);
@@ -397,6 +387,7 @@ static ssize_t timerfd_read(file_t *file, char *buf, size_t count, loff_t *ppos)
         }
         
         /* Lock the timer file descriptor */
+        local_irq_save(flags);
         spin_lock(&tfd->lock);
     }
     
@@ -408,6 +399,7 @@ static ssize_t timerfd_read(file_t *file, char *buf, size_t count, loff_t *ppos)
     
     /* Unlock the timer file descriptor */
     spin_unlock(&tfd->lock);
+    local_irq_restore(flags);
     
     /* Copy the number of expirations to the buffer */
     memcpy(buf, &ticks, sizeof(uint64_t));
@@ -478,8 +470,8 @@ static int timerfd_release(inode_t *inode, file_t *file) {
     /* Unlock the mutex */
     mutex_unlock(&timerfd_mutex);
     
-    /* Cancel the timer */
-    del_timer_sync(&tfd->timer);
+    /* Cancel the timer and wait for its callback */
+    hrtimer_cancel(&tfd->timer);
     
     /* Free the timer file descriptor */
     kfree(tfd);
@@ -0,0 +1,174 @@
+/**
+ * vdso.c - Horizon kernel vDSO implementation
+ *
+ * This file contains the implementation of the vDSO pages. There is one
+ * data page and one text page per boot, shared read-only by every process.
+ * The timekeeping publishes to the data page under its sequence counter;
+ * the text page holds a copy of the .vdso.text section.
+ *
+ * vmm_map_page() does not fill in page tables yet, so the pages are only
+ * reserved in each address space for now and processes keep making the
+ * time system calls. The data page is kept up to date regardless.
+ */
+
+#include <horizon/kernel.h>
+#include <horizon/types.h>
+#include <horizon/mm.h>
+#include <horizon/mm/vmm.h>
+#include <horizon/mm/pmm.h>
+#include <horizon/clocksource.h>
+#include <horizon/vdso.h>
+#include <horizon/string.h>
+#include <horizon/printk.h>
+#include <horizon/errno.h>
+
+/* Flags of the vDSO mappings */
+#define VDSO_VM_FLAGS   (VM_READ | VM_MAYREAD | VM_DONTEXPAND | VM_DONTDUMP)
+
+/* Data page */
+struct vdso_data *vdso_data = NULL;
+
+/* Text page */
+static void *vdso_text = NULL;
+
+/**
+ * Allocate the vDSO pages and copy the user code in
+ */
+void vdso_init(void) {
+    unsigned long size = (unsigned long)(__vdso_text_end - __vdso_text_start);
+    struct vdso_data *data;
+
+    if (size > PAGE_SIZE) {
+        printk(KERN_ERR "vDSO: text is %lu bytes, more than a page\n", size);
+        return;
+    }
+
+    data = mm_alloc_pages(1, MEM_KERNEL | MEM_ZERO);
+    vdso_text = mm_alloc_pages(1, MEM_KERNEL | MEM_ZERO);
+
+    if (data == NULL || vdso_text == NULL) {
+        printk(KERN_ERR "vDSO: out of memory\n");
+        if (data != NULL) {
+            mm_free_pages(data, 1);
+        }
+        if (vdso_text != NULL) {
+            mm_free_pages(vdso_text, 1);
+            vdso_text = NULL;
+        }
+        return;
+    }
+
+    memcpy(vdso_text, __vdso_text_start, size);
+
+    seqcount_init(&data->seq);
+    data->version = VDSO_VERSION;
+    data->clock_mode = VDSO_CLOCK_NONE;
+    data->clock_gettime_offset = (u32)((char *)__vdso_clock_gettime - __vdso_text_start);
+    data->gettimeofday_offset = (u32)((char *)__vdso_gettimeofday - __vdso_text_start);
+    data->time_offset = (u32)((char *)__vdso_time - __vdso_text_start);
+
+    /* Published last, the timekeeping only writes the page from here on */
+    __sync_synchronize();
+    vdso_data = data;
+
+    printk(KERN_INFO "vDSO: %lu bytes of text at 0x%lx, data at 0x%lx\n",
+           size, VDSO_TEXT_ADDR, VDSO_DATA_ADDR);
+}
+
+/**
+ * Publish the timekeeping to the data page
+ *
+ * Called by the timekeeping with its lock held for writing, which also
+ * serializes the updates here.
+ *
+ * @param cs Clock source in use
+ * @param cycle_last Clock source cycles at the last update
+ * @param mono Monotonic time at cycle_last
+ * @param real_offset Real time minus monotonic time
+ */
+void vdso_update(struct clocksource *cs, u64 cycle_last, ktime_t mono, ktime_t real_offset) {
+    struct vdso_data *data = vdso_data;
+    ktime_t real = mono + real_offset;
+
+    if (data == NULL) {
+        return;
+    }
+
+    write_seqcount_begin(&data->seq);
+
+    data->clock_mode = cs != NULL ? (u32)cs->vdso_clock_mode : VDSO_CLOCK_NONE;
+    if (data->clock_mode != VDSO_CLOCK_NONE) {
+        data->mult = cs->mult;
+        data->shift = cs->shift;
+        data->mask = cs->mask;
+        data->cycle_last = cycle_last;
+    }
+
+    data->mono_sec = mono / NSEC_PER_SEC;
+    data->mono_nsec = (u32)(mono % NSEC_PER_SEC);
+
+    /* Keep the nanoseconds positive, the user code only carries upward */
+    data->real_sec = real / NSEC_PER_SEC;
+    data->real_nsec = (u32)(real % NSEC_PER_SEC);
+    if (real < 0 && data->real_nsec != 0) {
+        data->real_sec--;
+        data->real_nsec += NSEC_PER_SEC;
+    }
+
+    write_seqcount_end(&data->seq);
+}
+
+/**
+ * Map the vDSO pages into an address space
+ *
+ * The pages are left out if anything is mapped at their addresses already.
+ *
+ * @param mm Memory descriptor
+ * @return 0 on success, negative error code on failure
+ */
+int vdso_map(struct mm_struct *mm) {
+    vm_area_struct_t *data_vma;
+    vm_area_struct_t *text_vma;
+    int ret;
+
+    if (mm == NULL) {
+        return -EINVAL;
+    }
+
+    /* Without the pages, processes make the system calls themselves */
+    if (vdso_data == NULL) {
+        return 0;
+    }
+
+    /* The program may have put a segment there */
+    if (vmm_find_vma(mm, VDSO_DATA_ADDR) != NULL || vmm_find_vma(mm, VDSO_TEXT_ADDR) != NULL) {
+        return -EEXIST;
+    }
+
+    data_vma = vmm_create_vma(mm, VDSO_DATA_ADDR, PAGE_SIZE, VDSO_VM_FLAGS);
+    if (data_vma == NULL) {
+        return -ENOMEM;
+    }
+
+    text_vma = vmm_create_vma(mm, VDSO_TEXT_ADDR, PAGE_SIZE,
+                              VDSO_VM_FLAGS | VM_EXEC | VM_MAYEXEC);
+    if (text_vma == NULL) {
+        vmm_destroy_vma(mm, data_vma);
+        return -ENOMEM;
+    }
+
+    ret = vmm_map_page(mm, VDSO_DATA_ADDR, pmm_virt_to_page(vdso_data), data_vma->vm_flags);
+    if (ret == 0) {
+        ret = vmm_map_page(mm, VDSO_TEXT_ADDR, pmm_virt_to_page(vdso_text), text_vma->vm_flags);
+        if (ret < 0) {
+            vmm_unmap_page(mm, VDSO_DATA_ADDR);
+        }
+    }
+
+    if (ret < 0) {
+        vmm_destroy_vma(mm, text_vma);
+        vmm_destroy_vma(mm, data_vma);
+    }
+
+    return ret;
+}
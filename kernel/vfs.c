@@ -295,6 +295,7 @@ int vfs_open(const char *path, int flags, mode_t mode, file_t **file) {
     f->f_mode = mode;
     f->f_pos = 0;
     f->f_count.counter = 1;
+    INIT_LIST_HEAD(&f->f_ep_links);
 
     /* Set the file operations */
     /* This would be implemented with actual file operations */
@@ -80,7 +80,8 @@ void wake_up(wait_queue_head_t *wq_head) {
     if (!list_empty(&wq_head->head)) {
         wait_queue_entry_t *wq_entry;
         list_for_each_entry(wq_entry, &wq_head->head, link) {
-            if (wq_entry->func(wq_entry, 0, 0, NULL)) {
+            /* Everyone non-exclusive, then the first exclusive waiter woken */
+            if (wq_entry->func(wq_entry, 0, 0, NULL) && (wq_entry->flags & WQ_FLAG_EXCLUSIVE)) {
                 break;
             }
         }
@@ -126,7 +127,8 @@ void wake_up_interruptible(wait_queue_head_t *wq_head) {
     if (!list_empty(&wq_head->head)) {
         wait_queue_entry_t *wq_entry;
         list_for_each_entry(wq_entry, &wq_head->head, link) {
-            if (!(wq_entry->flags & WQ_FLAG_EXCLUSIVE) && wq_entry->func(wq_entry, 0, 0, NULL)) {
+            /* Everyone non-exclusive, then the first exclusive waiter woken */
+            if (wq_entry->func(wq_entry, 0, 0, NULL) && (wq_entry->flags & WQ_FLAG_EXCLUSIVE)) {
                 break;
             }
         }
@@ -0,0 +1,369 @@
+/**
+ * rbtree.c - Red-black tree implementation
+ *
+ * This file contains the rebalancing and iteration code for the intrusive
+ * red-black tree declared in <horizon/rbtree.h>.
+ */
+
+#include <horizon/types.h>
+#include <horizon/rbtree.h>
+
+/* Set the parent of a node, keeping its color */
+static inline void rb_set_parent(rb_node_t *node, rb_node_t *parent) {
+    node->rb_parent_color = (node->rb_parent_color & 3) | (unsigned long)parent;
+}
+
+/* Set the color of a node, keeping its parent */
+static inline void rb_set_color(rb_node_t *node, int color) {
+    node->rb_parent_color = (node->rb_parent_color & ~1UL) | color;
+}
+
+#define rb_set_red(r)   do { (r)->rb_parent_color &= ~1UL; } while (0)
+#define rb_set_black(r) do { (r)->rb_parent_color |= 1UL; } while (0)
+
+/* Rotate a subtree left around node */
+static void __rb_rotate_left(rb_node_t *node, rb_root_t *root) {
+    rb_node_t *right = node->rb_right;
+    rb_node_t *parent = rb_parent(node);
+
+    if ((node->rb_right = right->rb_left) != NULL) {
+        rb_set_parent(right->rb_left, node);
+    }
+    right->rb_left = node;
+
+    rb_set_parent(right, parent);
+
+    if (parent != NULL) {
+        if (node == parent->rb_left) {
+            parent->rb_left = right;
+        } else {
+            parent->rb_right = right;
+        }
+    } else {
+        root->rb_node = right;
+    }
+    rb_set_parent(node, right);
+}
+
+/* Rotate a subtree right around node */
+static void __rb_rotate_right(rb_node_t *node, rb_root_t *root) {
+    rb_node_t *left = node->rb_left;
+    rb_node_t *parent = rb_parent(node);
+
+    if ((node->rb_left = left->rb_right) != NULL) {
+        rb_set_parent(left->rb_right, node);
+    }
+    left->rb_right = node;
+
+    rb_set_parent(left, parent);
+
+    if (parent != NULL) {
+        if (node == parent->rb_right) {
+            parent->rb_right = left;
+        } else {
+            parent->rb_left = left;
+        }
+    } else {
+        root->rb_node = left;
+    }
+    rb_set_parent(node, left);
+}
+
+/* Rebalance the tree after linking a new (red) node */
+void rb_insert_color(rb_node_t *node, rb_root_t *root) {
+    rb_node_t *parent, *gparent;
+
+    while ((parent = rb_parent(node)) != NULL && rb_is_red(parent)) {
+        gparent = rb_parent(parent);
+
+        if (parent == gparent->rb_left) {
+            rb_node_t *uncle = gparent->rb_right;
+
+            /* Red uncle, recolor and move up */
+            if (uncle != NULL && rb_is_red(uncle)) {
+                rb_set_black(uncle);
+                rb_set_black(parent);
+                rb_set_red(gparent);
+                node = gparent;
+                continue;
+            }
+
+            /* Inner child, rotate it to the outside first */
+            if (parent->rb_right == node) {
+                rb_node_t *tmp;
+                __rb_rotate_left(parent, root);
+                tmp = parent;
+                parent = node;
+                node = tmp;
+            }
+
+            rb_set_black(parent);
+            rb_set_red(gparent);
+            __rb_rotate_right(gparent, root);
+        } else {
+            rb_node_t *uncle = gparent->rb_left;
+
+            /* Red uncle, recolor and move up */
+            if (uncle != NULL && rb_is_red(uncle)) {
+                rb_set_black(uncle);
+                rb_set_black(parent);
+                rb_set_red(gparent);
+                node = gparent;
+                continue;
+            }
+
+            /* Inner child, rotate it to the outside first */
+            if (parent->rb_left == node) {
+                rb_node_t *tmp;
+                __rb_rotate_right(parent, root);
+                tmp = parent;
+                parent = node;
+                node = tmp;
+            }
+
+            rb_set_black(parent);
+            rb_set_red(gparent);
+            __rb_rotate_left(gparent, root);
+        }
+    }
+
+    rb_set_black(root->rb_node);
+}
+
+/* Restore the black height after removing a black node */
+static void __rb_erase_color(rb_node_t *node, rb_node_t *parent, rb_root_t *root) {
+    rb_node_t *other;
+
+    while ((node == NULL || rb_is_black(node)) && node != root->rb_node) {
+        if (parent->rb_left == node) {
+            other = parent->rb_right;
+
+            if (rb_is_red(other)) {
+                rb_set_black(other);
+                rb_set_red(parent);
+                __rb_rotate_left(parent, root);
+                other = parent->rb_right;
+            }
+
+            if ((other->rb_left == NULL || rb_is_black(other->rb_left)) &&
+                (other->rb_right == NULL || rb_is_black(other->rb_right))) {
+                rb_set_red(other);
+                node = parent;
+                parent = rb_parent(node);
+            } else {
+                if (other->rb_right == NULL || rb_is_black(other->rb_right)) {
+                    rb_set_black(other->rb_left);
+                    rb_set_red(other);
+                    __rb_rotate_right(other, root);
+                    other = parent->rb_right;
+                }
+                rb_set_color(other, rb_color(parent));
+                rb_set_black(parent);
+                rb_set_black(other->rb_right);
+                __rb_rotate_left(parent, root);
+                node = root->rb_node;
+                break;
+            }
+        } else {
+            other = parent->rb_left;
+
+            if (rb_is_red(other)) {
+                rb_set_black(other);
+                rb_set_red(parent);
+                __rb_rotate_right(parent, root);
+                other = parent->rb_left;
+            }
+
+            if ((other->rb_left == NULL || rb_is_black(other->rb_left)) &&
+                (other->rb_right == NULL || rb_is_black(other->rb_right))) {
+                rb_set_red(other);
+                node = parent;
+                parent = rb_parent(node);
+            } else {
+                if (other->rb_left == NULL || rb_is_black(other->rb_left)) {
+                    rb_set_black(other->rb_right);
+                    rb_set_red(other);
+                    __rb_rotate_left(other, root);
+                    other = parent->rb_left;
+                }
+                rb_set_color(other, rb_color(parent));
+                rb_set_black(parent);
+                rb_set_black(other->rb_left);
+                __rb_rotate_right(parent, root);
+                node = root->rb_node;
+                break;
+            }
+        }
+    }
+
+    if (node != NULL) {
+        rb_set_black(node);
+    }
+}
+
+/* Remove a node from the tree */
+void rb_erase(rb_node_t *node, rb_root_t *root) {
+    rb_node_t *child, *parent;
+    int color;
+
+    if (node->rb_left == NULL) {
+        child = node->rb_right;
+    } else if (node->rb_right == NULL) {
+        child = node->rb_left;
+    } else {
+        /* Two children, splice out the in-order successor instead */
+        rb_node_t *old = node, *left;
+
+        node = node->rb_right;
+        while ((left = node->rb_left) != NULL) {
+            node = left;
+        }
+
+        if (rb_parent(old) != NULL) {
+            if (rb_parent(old)->rb_left == old) {
+                rb_parent(old)->rb_left = node;
+            } else {
+                rb_parent(old)->rb_right = node;
+            }
+        } else {
+            root->rb_node = node;
+        }
+
+        child = node->rb_right;
+        parent = rb_parent(node);
+        color = rb_color(node);
+
+        if (parent == old) {
+            parent = node;
+        } else {
+            if (child != NULL) {
+                rb_set_parent(child, parent);
+            }
+            parent->rb_left = child;
+
+            node->rb_right = old->rb_right;
+            rb_set_parent(old->rb_right, node);
+        }
+
+        node->rb_parent_color = old->rb_parent_color;
+        node->rb_left = old->rb_left;
+        rb_set_parent(old->rb_left, node);
+
+        goto color;
+    }
+
+    parent = rb_parent(node);
+    color = rb_color(node);
+
+    if (child != NULL) {
+        rb_set_parent(child, parent);
+    }
+    if (parent != NULL) {
+        if (parent->rb_left == node) {
+            parent->rb_left = child;
+        } else {
+            parent->rb_right = child;
+        }
+    } else {
+        root->rb_node = child;
+    }
+
+color:
+    if (color == RB_BLACK) {
+        __rb_erase_color(child, parent, root);
+    }
+}
+
+/* Get the leftmost node */
+rb_node_t *rb_first(const rb_root_t *root) {
+    rb_node_t *n = root->rb_node;
+
+    if (n == NULL) {
+        return NULL;
+    }
+    while (n->rb_left != NULL) {
+        n = n->rb_left;
+    }
+
+    return n;
+}
+
+/* Get the rightmost node */
+rb_node_t *rb_last(const rb_root_t *root) {
+    rb_node_t *n = root->rb_node;
+
+    if (n == NULL) {
+        return NULL;
+    }
+    while (n->rb_right != NULL) {
+        n = n->rb_right;
+    }
+
+    return n;
+}
+
+/* Get the in-order successor of a node */
+rb_node_t *rb_next(const rb_node_t *node) {
+    rb_node_t *parent;
+
+    /* Leftmost node of the right subtree */
+    if (node->rb_right != NULL) {
+        node = node->rb_right;
+        while (node->rb_left != NULL) {
+            node = node->rb_left;
+        }
+        return (rb_node_t *)node;
+    }
+
+    /* First ancestor we reach from its left subtree */
+    while ((parent = rb_parent(node)) != NULL && node == parent->rb_right) {
+        node = parent;
+    }
+
+    return parent;
+}
+
+/* Get the in-order predecessor of a node */
+rb_node_t *rb_prev(const rb_node_t *node) {
+    rb_node_t *parent;
+
+    /* Rightmost node of the left subtree */
+    if (node->rb_left != NULL) {
+        node = node->rb_left;
+        while (node->rb_right != NULL) {
+            node = node->rb_right;
+        }
+        return (rb_node_t *)node;
+    }
+
+    /* First ancestor we reach from its right subtree */
+    while ((parent = rb_parent(node)) != NULL && node == parent->rb_left) {
+        node = parent;
+    }
+
+    return parent;
+}
+
+/* Put a new node in the place of an existing one without rebalancing */
+void rb_replace_node(rb_node_t *victim, rb_node_t *new, rb_root_t *root) {
+    rb_node_t *parent = rb_parent(victim);
+
+    if (parent != NULL) {
+        if (victim == parent->rb_left) {
+            parent->rb_left = new;
+        } else {
+            parent->rb_right = new;
+        }
+    } else {
+        root->rb_node = new;
+    }
+
+    if (victim->rb_left != NULL) {
+        rb_set_parent(victim->rb_left, new);
+    }
+    if (victim->rb_right != NULL) {
+        rb_set_parent(victim->rb_right, new);
+    }
+
+    *new = *victim;
+}
@@ -2,90 +2,126 @@
  * memory.c - Memory management implementation
  * 
  * This file contains the implementation of the memory management subsystem.
+ * Physical pages and the vmalloc window are handed out by range allocators
+ * (see mm/range.c), so finding a run costs O(log n) instead of a bit-by-bit
+ * scan of the whole bitmap.
  */
 
 #include <horizon/kernel.h>
 #include <horizon/types.h>
 #include <horizon/mm.h>
+#include <horizon/mm/range.h>
+#include <horizon/rbtree.h>
+#include <horizon/vmm.h>
+#include <horizon/spinlock.h>
+#include <horizon/string.h>
+#include <horizon/printk.h>
+
+/* Maximum number of free extents in the page allocator */
+#define MM_MAX_EXTENTS      4096
+
+/* Virtual address window used by vmalloc */
+#define VMALLOC_START       0xD0000000
+#define VMALLOC_END         0xE0000000
+#define VMALLOC_PAGES       ((VMALLOC_END - VMALLOC_START) / PAGE_SIZE)
+
+/* Maximum number of live vmalloc areas */
+#define VMALLOC_MAX_AREAS   1024
+
+/* vmalloc area */
+typedef struct vmalloc_area {
+    rb_node_t node;                 /* Node in the area tree */
+    u32 addr;                       /* Start address */
+    u32 pages;                      /* Number of pages */
+    struct vmalloc_area *next_free; /* Next unused area */
+} vmalloc_area_t;
 
 /* Memory management state */
 static void *mem_start;
 static void *mem_end;
 static u32 total_pages;
-static u32 free_pages;
 
-/* Page bitmap - one bit per page */
-static u8 *page_bitmap;
+/* Physical page allocator */
+static range_allocator_t page_range;
+
+/* vmalloc address space allocator */
+static range_allocator_t vmalloc_range;
+
+/* vmalloc areas, keyed by start address */
+static vmalloc_area_t vmalloc_areas[VMALLOC_MAX_AREAS];
+static vmalloc_area_t *vmalloc_free_areas;
+static rb_root_t vmalloc_tree = RB_ROOT;
+static spinlock_t vmalloc_lock;
+
+/* Set up the vmalloc address space */
+static void vmalloc_init(void) {
+    size_t meta_size = range_meta_size(VMALLOC_PAGES, VMALLOC_MAX_AREAS + 1);
+    void *meta;
+    
+    spin_lock_init(&vmalloc_lock);
+    
+    /* Chain the area descriptors */
+    vmalloc_free_areas = NULL;
+    for (u32 i = VMALLOC_MAX_AREAS; i > 0; i--) {
+        vmalloc_areas[i - 1].next_free = vmalloc_free_areas;
+        vmalloc_free_areas = &vmalloc_areas[i - 1];
+    }
+    
+    /* The window's bitmap and extent pool come from the page allocator */
+    meta = mm_alloc_pages((meta_size + PAGE_SIZE - 1) / PAGE_SIZE, MEM_KERNEL);
+    if (meta == NULL || range_init(&vmalloc_range, "vmalloc", VMALLOC_PAGES, VMALLOC_MAX_AREAS + 1, meta) < 0) {
+        printk(KERN_ERR "MM: Failed to set up the vmalloc window\n");
+    }
+}
 
 /* Initialize memory management */
 void mm_init(void) {
+    size_t meta_size;
+    u32 meta_pages;
+    
     /* This would be initialized with information from the bootloader */
     /* For now, we'll just use placeholder values */
     mem_start = (void *)0x100000;    /* 1MB */
     mem_end = (void *)0x1000000;     /* 16MB */
     
     total_pages = ((u32)mem_end - (u32)mem_start) / PAGE_SIZE;
-    free_pages = total_pages;
     
-    /* Allocate page bitmap */
-    u32 bitmap_size = (total_pages + 7) / 8;
-    page_bitmap = (u8 *)mem_start;
+    /* The allocator's bitmap and extent pool live at the start of memory */
+    meta_size = range_meta_size(total_pages, MM_MAX_EXTENTS);
+    meta_pages = (meta_size + PAGE_SIZE - 1) / PAGE_SIZE;
     
-    /* Mark all pages as free */
-    for (u32 i = 0; i < bitmap_size; i++) {
-        page_bitmap[i] = 0;
+    if (range_init(&page_range, "pages", total_pages, MM_MAX_EXTENTS, mem_start) < 0) {
+        printk(KERN_ERR "MM: Failed to initialize the page allocator\n");
+        return;
     }
     
-    /* Mark bitmap pages as used */
-    u32 bitmap_pages = (bitmap_size + PAGE_SIZE - 1) / PAGE_SIZE;
-    for (u32 i = 0; i < bitmap_pages; i++) {
-        page_bitmap[i / 8] |= (1 << (i % 8));
-    }
+    /* Mark the metadata pages as used */
+    range_reserve(&page_range, 0, meta_pages);
     
-    free_pages -= bitmap_pages;
+    vmalloc_init();
 }
 
 /* Allocate pages */
 void *mm_alloc_pages(u32 count, u32 flags) {
+    long page;
+    
     if (count == 0) {
         return NULL;
     }
     
-    if (count > free_pages) {
+    /* Find the smallest free run that fits */
+    page = range_alloc(&page_range, count);
+    if (page < 0) {
         return NULL;
     }
     
-    /* Find a contiguous block of free pages */
-    u32 start_page = 0;
-    u32 found_pages = 0;
-    
-    for (u32 i = 0; i < total_pages; i++) {
-        if (page_bitmap[i / 8] & (1 << (i % 8))) {
-            /* Page is used */
-            start_page = i + 1;
-            found_pages = 0;
-        } else {
-            /* Page is free */
-            found_pages++;
-            
-            if (found_pages == count) {
-                /* Found enough contiguous pages */
-                /* Mark pages as used */
-                for (u32 j = 0; j < count; j++) {
-                    u32 page = start_page + j;
-                    page_bitmap[page / 8] |= (1 << (page % 8));
-                }
-                
-                free_pages -= count;
-                
-                /* Return the start address */
-                return (void *)((u32)mem_start + start_page * PAGE_SIZE);
-            }
-        }
+    /* Zero memory if requested */
+    if (flags & MEM_ZERO) {
+        memset((void *)((u32)mem_start + page * PAGE_SIZE), 0, count * PAGE_SIZE);
     }
     
-    /* Not enough contiguous pages */
-    return NULL;
+    /* Return the start address */
+    return (void *)((u32)mem_start + page * PAGE_SIZE);
 }
 
 /* Free pages */
@@ -94,21 +130,18 @@ void mm_free_pages(void *addr, u32 count) {
         return;
     }
     
-    /* Calculate the page index */
-    u32 page = ((u32)addr - (u32)mem_start) / PAGE_SIZE;
-    
-    /* Mark pages as free */
-    for (u32 i = 0; i < count; i++) {
-        u32 p = page + i;
-        
-        if (p < total_pages) {
-            if (page_bitmap[p / 8] & (1 << (p % 8))) {
-                /* Page was used */
-                page_bitmap[p / 8] &= ~(1 << (p % 8));
-                free_pages++;
-            }
-        }
+    if ((u32)addr < (u32)mem_start || (u32)addr >= (u32)mem_end) {
+        return;
     }
+    
+    /* Return the run, merging it with its free neighbours */
+    range_free(&page_range, ((u32)addr - (u32)mem_start) / PAGE_SIZE, count);
+}
+
+/* Print page allocator statistics */
+void mm_print_stats(void) {
+    range_print_stats(&page_range);
+    range_print_stats(&vmalloc_range);
 }
 
 /* Simple kernel memory allocator */
@@ -145,14 +178,148 @@ void kfree(void *addr) {
     mm_free_pages(addr, 1);
 }
 
+/* Find a vmalloc area by start address */
+static vmalloc_area_t *vmalloc_find_area(u32 addr) {
+    rb_node_t *node = vmalloc_tree.rb_node;
+    
+    while (node != NULL) {
+        vmalloc_area_t *area = rb_entry(node, vmalloc_area_t, node);
+        
+        if (addr < area->addr) {
+            node = node->rb_left;
+        } else if (addr > area->addr) {
+            node = node->rb_right;
+        } else {
+            return area;
+        }
+    }
+    
+    return NULL;
+}
+
+/* Add a vmalloc area to the tree */
+static void vmalloc_insert_area(vmalloc_area_t *area) {
+    rb_node_t **link = &vmalloc_tree.rb_node;
+    rb_node_t *parent = NULL;
+    
+    while (*link != NULL) {
+        parent = *link;
+        if (area->addr < rb_entry(parent, vmalloc_area_t, node)->addr) {
+            link = &parent->rb_left;
+        } else {
+            link = &parent->rb_right;
+        }
+    }
+    
+    rb_link_node(&area->node, parent, link);
+    rb_insert_color(&area->node, &vmalloc_tree);
+}
+
+/* Unmap and free the pages backing part of a vmalloc area */
+static void vmalloc_unmap_pages(vm_context_t *ctx, u32 addr, u32 pages) {
+    for (u32 i = 0; i < pages; i++) {
+        void *virt = (void *)(addr + i * PAGE_SIZE);
+        void *phys = vmm_get_phys_addr(ctx, virt);
+        
+        vmm_unmap_page(ctx, virt);
+        if (phys != NULL) {
+            mm_free_pages(phys, 1);
+        }
+    }
+}
+
 /* Virtual memory allocator */
 void *vmalloc(size_t size) {
-    /* For this simple implementation, vmalloc is the same as kmalloc */
-    return kmalloc(size, MEM_KERNEL);
+    vm_context_t *ctx = vmm_get_kernel_context();
+    vmalloc_area_t *area;
+    u32 pages, addr;
+    long start;
+    
+    if (size == 0 || ctx == NULL) {
+        return NULL;
+    }
+    
+    pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    
+    /* Get an area descriptor */
+    spin_lock(&vmalloc_lock);
+    area = vmalloc_free_areas;
+    if (area != NULL) {
+        vmalloc_free_areas = area->next_free;
+    }
+    spin_unlock(&vmalloc_lock);
+    
+    if (area == NULL) {
+        return NULL;
+    }
+    
+    /* Reserve virtually contiguous space */
+    start = range_alloc(&vmalloc_range, pages);
+    if (start < 0) {
+        goto fail_area;
+    }
+    addr = VMALLOC_START + start * PAGE_SIZE;
+    
+    /* Back it with single pages, which need not be physically contiguous */
+    for (u32 i = 0; i < pages; i++) {
+        void *phys = mm_alloc_pages(1, MEM_KERNEL);
+        
+        if (phys == NULL || vmm_map_page(ctx, (void *)(addr + i * PAGE_SIZE), phys, PTE_PRESENT | PTE_WRITE) < 0) {
+            if (phys != NULL) {
+                mm_free_pages(phys, 1);
+            }
+            vmalloc_unmap_pages(ctx, addr, i);
+            range_free(&vmalloc_range, start, pages);
+            goto fail_area;
+        }
+    }
+    
+    /* Remember the size for vfree */
+    area->addr = addr;
+    area->pages = pages;
+    
+    spin_lock(&vmalloc_lock);
+    vmalloc_insert_area(area);
+    spin_unlock(&vmalloc_lock);
+    
+    return (void *)addr;
+    
+fail_area:
+    spin_lock(&vmalloc_lock);
+    area->next_free = vmalloc_free_areas;
+    vmalloc_free_areas = area;
+    spin_unlock(&vmalloc_lock);
+    
+    return NULL;
 }
 
 /* Free virtual memory */
 void vfree(void *addr) {
-    /* For this simple implementation, vfree is the same as kfree */
-    kfree(addr);
+    vmalloc_area_t *area;
+    
+    if (addr == NULL) {
+        return;
+    }
+    
+    /* Look up and unlink the area */
+    spin_lock(&vmalloc_lock);
+    area = vmalloc_find_area((u32)addr);
+    if (area != NULL) {
+        rb_erase(&area->node, &vmalloc_tree);
+    }
+    spin_unlock(&vmalloc_lock);
+    
+    if (area == NULL) {
+        printk(KERN_WARNING "MM: vfree of unknown address %p\n", addr);
+        return;
+    }
+    
+    /* Tear down the mappings and release the address space */
+    vmalloc_unmap_pages(vmm_get_kernel_context(), area->addr, area->pages);
+    range_free(&vmalloc_range, (area->addr - VMALLOC_START) / PAGE_SIZE, area->pages);
+    
+    spin_lock(&vmalloc_lock);
+    area->next_free = vmalloc_free_areas;
+    vmalloc_free_areas = area;
+    spin_unlock(&vmalloc_lock);
 }
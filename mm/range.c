@@ -0,0 +1,619 @@
+/**
+ * range.c - Horizon kernel contiguous range allocator
+ *
+ * This file contains the implementation of the contiguous range allocator.
+ * Free space is kept as extents in two red-black trees: one ordered by
+ * start unit, used to coalesce neighbours on free, and one ordered by
+ * (size, start), used to find the smallest fitting extent in O(log n).
+ * A bitmap with one bit per unit mirrors the allocation state so frees
+ * can be validated and the extent trees rebuilt with word-at-a-time scans.
+ */
+
+#include <horizon/kernel.h>
+#include <horizon/types.h>
+#include <horizon/mm.h>
+#include <horizon/mm/range.h>
+#include <horizon/rbtree.h>
+#include <horizon/spinlock.h>
+#include <horizon/string.h>
+#include <horizon/printk.h>
+#include <horizon/errno.h>
+
+/* Bits per bitmap word */
+#define RANGE_WORD_BITS 32
+
+/**
+ * Get the size of the bitmap, padded so the extent pool after it is aligned
+ *
+ * @param count Number of units
+ * @return Bitmap size in bytes
+ */
+static size_t range_bitmap_size(unsigned long count) {
+    size_t size = ((count + RANGE_WORD_BITS - 1) / RANGE_WORD_BITS) * sizeof(u32);
+
+    return (size + sizeof(unsigned long) - 1) & ~(sizeof(unsigned long) - 1);
+}
+
+/**
+ * Get the size of the metadata needed for an allocator
+ *
+ * @param count Number of units to manage
+ * @param max_extents Maximum number of free extents
+ * @return Metadata size in bytes
+ */
+size_t range_meta_size(unsigned long count, unsigned long max_extents) {
+    return range_bitmap_size(count) + max_extents * sizeof(range_extent_t);
+}
+
+/**
+ * Take an extent from the pool
+ *
+ * @param ra Range allocator
+ * @return Extent, or NULL if the pool is empty
+ */
+static range_extent_t *extent_get(range_allocator_t *ra) {
+    range_extent_t *ext = ra->pool;
+
+    if (ext != NULL) {
+        ra->pool = ext->next_free;
+    }
+
+    return ext;
+}
+
+/**
+ * Return an extent to the pool
+ *
+ * @param ra Range allocator
+ * @param ext Extent to return
+ */
+static void extent_put(range_allocator_t *ra, range_extent_t *ext) {
+    ext->next_free = ra->pool;
+    ra->pool = ext;
+}
+
+/**
+ * Insert an extent into the by-address tree
+ *
+ * @param ra Range allocator
+ * @param ext Extent to insert
+ */
+static void extent_insert_addr(range_allocator_t *ra, range_extent_t *ext) {
+    rb_node_t **link = &ra->by_addr.rb_node;
+    rb_node_t *parent = NULL;
+
+    while (*link != NULL) {
+        range_extent_t *cur = rb_entry(*link, range_extent_t, addr_node);
+
+        parent = *link;
+        if (ext->start < cur->start) {
+            link = &(*link)->rb_left;
+        } else {
+            link = &(*link)->rb_right;
+        }
+    }
+
+    rb_link_node(&ext->addr_node, parent, link);
+    rb_insert_color(&ext->addr_node, &ra->by_addr);
+}
+
+/**
+ * Insert an extent into the by-size tree
+ *
+ * Equal sizes are ordered by address so allocations prefer low units.
+ *
+ * @param ra Range allocator
+ * @param ext Extent to insert
+ */
+static void extent_insert_size(range_allocator_t *ra, range_extent_t *ext) {
+    rb_node_t **link = &ra->by_size.rb_node;
+    rb_node_t *parent = NULL;
+
+    while (*link != NULL) {
+        range_extent_t *cur = rb_entry(*link, range_extent_t, size_node);
+
+        parent = *link;
+        if (ext->count < cur->count || (ext->count == cur->count && ext->start < cur->start)) {
+            link = &(*link)->rb_left;
+        } else {
+            link = &(*link)->rb_right;
+        }
+    }
+
+    rb_link_node(&ext->size_node, parent, link);
+    rb_insert_color(&ext->size_node, &ra->by_size);
+}
+
+/**
+ * Find the smallest free extent holding at least count units
+ *
+ * @param ra Range allocator
+ * @param count Number of units
+ * @return Extent, or NULL if none fits
+ */
+static range_extent_t *extent_find_fit(range_allocator_t *ra, unsigned long count) {
+    rb_node_t *node = ra->by_size.rb_node;
+    range_extent_t *best = NULL;
+
+    while (node != NULL) {
+        range_extent_t *cur = rb_entry(node, range_extent_t, size_node);
+
+        if (cur->count >= count) {
+            best = cur;
+            node = node->rb_left;
+        } else {
+            node = node->rb_right;
+        }
+    }
+
+    return best;
+}
+
+/**
+ * Find the free extent with the highest start at or below a unit
+ *
+ * @param ra Range allocator
+ * @param unit Unit to look up
+ * @return Extent, or NULL if none starts at or below unit
+ */
+static range_extent_t *extent_find_below(range_allocator_t *ra, unsigned long unit) {
+    rb_node_t *node = ra->by_addr.rb_node;
+    range_extent_t *best = NULL;
+
+    while (node != NULL) {
+        range_extent_t *cur = rb_entry(node, range_extent_t, addr_node);
+
+        if (cur->start <= unit) {
+            best = cur;
+            node = node->rb_right;
+        } else {
+            node = node->rb_left;
+        }
+    }
+
+    return best;
+}
+
+/**
+ * Set or clear a run of bits, a whole word at a time where possible
+ *
+ * @param bitmap Bitmap
+ * @param start First bit
+ * @param count Number of bits
+ * @param set Non-zero to set the bits, zero to clear them
+ */
+static void bitmap_update(u32 *bitmap, unsigned long start, unsigned long count, int set) {
+    while (count > 0) {
+        unsigned long word = start / RANGE_WORD_BITS;
+        unsigned int bit = start % RANGE_WORD_BITS;
+        unsigned int n = RANGE_WORD_BITS - bit;
+        u32 mask;
+
+        if (n > count) {
+            n = count;
+        }
+
+        mask = (n == RANGE_WORD_BITS) ? ~0U : (((1U << n) - 1) << bit);
+
+        if (set) {
+            bitmap[word] |= mask;
+        } else {
+            bitmap[word] &= ~mask;
+        }
+
+        start += n;
+        count -= n;
+    }
+}
+
+/**
+ * Check that a run of bits is entirely set
+ *
+ * @param bitmap Bitmap
+ * @param start First bit
+ * @param count Number of bits
+ * @return 1 if every bit is set, 0 otherwise
+ */
+static int bitmap_all_set(const u32 *bitmap, unsigned long start, unsigned long count) {
+    while (count > 0) {
+        unsigned long word = start / RANGE_WORD_BITS;
+        unsigned int bit = start % RANGE_WORD_BITS;
+        unsigned int n = RANGE_WORD_BITS - bit;
+        u32 mask;
+
+        if (n > count) {
+            n = count;
+        }
+
+        mask = (n == RANGE_WORD_BITS) ? ~0U : (((1U << n) - 1) << bit);
+
+        if ((bitmap[word] & mask) != mask) {
+            return 0;
+        }
+
+        start += n;
+        count -= n;
+    }
+
+    return 1;
+}
+
+/**
+ * Count the allocated units on either side of a run
+ *
+ * @param ra Range allocator
+ * @param start First unit of the run
+ * @param count Number of units
+ * @return Number of allocated neighbours, 0 to 2
+ */
+static int range_edges(range_allocator_t *ra, unsigned long start, unsigned long count) {
+    unsigned long end = start + count;
+    int edges = 0;
+
+    if (start > 0 && (ra->bitmap[(start - 1) / RANGE_WORD_BITS] & (1U << ((start - 1) % RANGE_WORD_BITS)))) {
+        edges++;
+    }
+    if (end < ra->count && (ra->bitmap[end / RANGE_WORD_BITS] & (1U << (end % RANGE_WORD_BITS)))) {
+        edges++;
+    }
+
+    return edges;
+}
+
+/**
+ * Find the next clear or set bit at or after a position
+ *
+ * Whole words that cannot contain a match are skipped, and the match
+ * inside a word is located with a single bit-scan-forward.
+ *
+ * @param bitmap Bitmap
+ * @param size Number of bits in the bitmap
+ * @param start First bit to look at
+ * @param want_set Non-zero to find a set bit, zero to find a clear bit
+ * @return Bit index, or size if there is none
+ */
+static unsigned long bitmap_find_next(const u32 *bitmap, unsigned long size, unsigned long start, int want_set) {
+    unsigned long word = start / RANGE_WORD_BITS;
+    unsigned long nr_words = (size + RANGE_WORD_BITS - 1) / RANGE_WORD_BITS;
+    u32 val;
+
+    if (start >= size) {
+        return size;
+    }
+
+    /* Mask off the bits below start in the first word */
+    val = want_set ? bitmap[word] : ~bitmap[word];
+    val &= ~0U << (start % RANGE_WORD_BITS);
+
+    while (val == 0) {
+        if (++word >= nr_words) {
+            return size;
+        }
+        val = want_set ? bitmap[word] : ~bitmap[word];
+    }
+
+    start = word * RANGE_WORD_BITS + __builtin_ctz(val);
+
+    return (start < size) ? start : size;
+}
+
+/**
+ * Rebuild the extent trees from the bitmap
+ *
+ * The caller must hold ra->lock.
+ *
+ * @param ra Range allocator
+ * @return 0 on success, or -ENOMEM if the extent pool is too small
+ */
+static int range_rebuild(range_allocator_t *ra) {
+    range_extent_t *pool = (range_extent_t *)((u8 *)ra->bitmap + range_bitmap_size(ra->count));
+    unsigned long unit = 0;
+    unsigned long extents = 0;
+
+    /* Start from an empty pool and empty trees */
+    ra->pool = NULL;
+    for (unsigned long i = ra->max_extents; i > 0; i--) {
+        extent_put(ra, &pool[i - 1]);
+    }
+    rb_init_root(&ra->by_addr);
+    rb_init_root(&ra->by_size);
+    ra->free = 0;
+
+    /* Turn each run of clear bits into an extent */
+    while (unit < ra->count) {
+        unsigned long start = bitmap_find_next(ra->bitmap, ra->count, unit, 0);
+        unsigned long end;
+        range_extent_t *ext;
+
+        if (start >= ra->count) {
+            break;
+        }
+
+        end = bitmap_find_next(ra->bitmap, ra->count, start, 1);
+
+        ext = extent_get(ra);
+        if (ext == NULL) {
+            return -ENOMEM;
+        }
+
+        ext->start = start;
+        ext->count = end - start;
+        extent_insert_addr(ra, ext);
+        extent_insert_size(ra, ext);
+        ra->free += ext->count;
+        extents++;
+
+        unit = end;
+    }
+
+    /* Allocated runs sit between the free extents */
+    ra->nr_runs = extents + 1;
+    if (!(ra->bitmap[0] & 1U)) {
+        ra->nr_runs--;
+    }
+    if (!(ra->bitmap[(ra->count - 1) / RANGE_WORD_BITS] & (1U << ((ra->count - 1) % RANGE_WORD_BITS)))) {
+        ra->nr_runs--;
+    }
+
+    return 0;
+}
+
+/**
+ * Initialize a range allocator
+ *
+ * @param ra Range allocator
+ * @param name Allocator name
+ * @param count Number of units to manage
+ * @param max_extents Maximum number of free extents, at least 2
+ * @param meta Metadata area of range_meta_size(count, max_extents) bytes
+ * @return 0 on success, or a negative error code
+ */
+int range_init(range_allocator_t *ra, const char *name, unsigned long count, unsigned long max_extents, void *meta) {
+    /* Check parameters */
+    if (ra == NULL || meta == NULL || count == 0 || max_extents < 2) {
+        return -EINVAL;
+    }
+
+    memset(ra, 0, sizeof(range_allocator_t));
+    ra->name = name;
+    ra->count = count;
+    ra->max_extents = max_extents;
+    ra->bitmap = (u32 *)meta;
+    spin_lock_init(&ra->lock);
+
+    /* Everything starts out free */
+    memset(ra->bitmap, 0, range_bitmap_size(count));
+
+    return range_rebuild(ra);
+}
+
+/**
+ * Allocate a contiguous run of units
+ *
+ * Picks the smallest free extent that fits and carves the run from its
+ * start.
+ *
+ * @param ra Range allocator
+ * @param count Number of units
+ * @return First unit of the run, or a negative error code
+ */
+long range_alloc(range_allocator_t *ra, unsigned long count) {
+    range_extent_t *ext;
+    unsigned long start;
+
+    /* Check parameters */
+    if (ra == NULL || count == 0) {
+        return -EINVAL;
+    }
+
+    spin_lock(&ra->lock);
+
+    /*
+     * Free extents and allocated runs alternate, so keeping the runs below
+     * the pool size guarantees that freeing whole allocations never runs
+     * out of extents. An allocation adds at most one run.
+     */
+    if (ra->nr_runs + 1 >= ra->max_extents) {
+        ra->alloc_fail++;
+        spin_unlock(&ra->lock);
+        return -ENOMEM;
+    }
+
+    ext = extent_find_fit(ra, count);
+    if (ext == NULL) {
+        ra->alloc_fail++;
+        spin_unlock(&ra->lock);
+        return -ENOMEM;
+    }
+
+    start = ext->start;
+
+    /* Shrink or remove the extent */
+    rb_erase(&ext->size_node, &ra->by_size);
+    if (ext->count == count) {
+        rb_erase(&ext->addr_node, &ra->by_addr);
+        extent_put(ra, ext);
+    } else {
+        /* The start moves up but stays between its neighbours */
+        ext->start += count;
+        ext->count -= count;
+        extent_insert_size(ra, ext);
+    }
+
+    ra->nr_runs += 1 - range_edges(ra, start, count);
+    bitmap_update(ra->bitmap, start, count, 1);
+    ra->free -= count;
+    ra->alloc_count++;
+
+    spin_unlock(&ra->lock);
+
+    return (long)start;
+}
+
+/**
+ * Free a run of units, merging it with adjacent free extents
+ *
+ * The run may be part of an allocation. Freeing the middle of one splits
+ * it in two and needs a new extent, which fails if the pool is empty.
+ *
+ * @param ra Range allocator
+ * @param start First unit of the run
+ * @param count Number of units
+ * @return 0 on success, or a negative error code
+ */
+int range_free(range_allocator_t *ra, unsigned long start, unsigned long count) {
+    range_extent_t *prev, *next = NULL;
+    rb_node_t *node;
+    int merge_prev, merge_next;
+
+    /* Check parameters */
+    if (ra == NULL || count == 0 || start >= ra->count || count > ra->count - start) {
+        return -EINVAL;
+    }
+
+    spin_lock(&ra->lock);
+
+    /* Refuse double frees and frees of never-allocated units */
+    if (!bitmap_all_set(ra->bitmap, start, count)) {
+        spin_unlock(&ra->lock);
+        printk(KERN_WARNING "RANGE: %s: bad free of %lu units at %lu\n", ra->name, count, start);
+        return -EINVAL;
+    }
+
+    /* Find the neighbouring free extents */
+    prev = extent_find_below(ra, start);
+    if (prev != NULL) {
+        node = rb_next(&prev->addr_node);
+    } else {
+        node = rb_first(&ra->by_addr);
+    }
+    if (node != NULL) {
+        next = rb_entry(node, range_extent_t, addr_node);
+    }
+
+    merge_prev = prev != NULL && prev->start + prev->count == start;
+    merge_next = next != NULL && start + count == next->start;
+
+    /* An isolated run needs an extent, check before changing anything */
+    if (!merge_prev && !merge_next && ra->pool == NULL) {
+        spin_unlock(&ra->lock);
+        return -ENOMEM;
+    }
+
+    ra->nr_runs += range_edges(ra, start, count);
+    ra->nr_runs--;
+    bitmap_update(ra->bitmap, start, count, 0);
+    ra->free += count;
+
+    if (merge_prev) {
+        /* Grow the previous extent, absorbing the next one if it touches */
+        rb_erase(&prev->size_node, &ra->by_size);
+        prev->count += count;
+        ra->merge_count++;
+
+        if (merge_next) {
+            rb_erase(&next->size_node, &ra->by_size);
+            rb_erase(&next->addr_node, &ra->by_addr);
+            prev->count += next->count;
+            extent_put(ra, next);
+            ra->merge_count++;
+        }
+
+        extent_insert_size(ra, prev);
+    } else if (merge_next) {
+        /* Grow the next extent downwards, its tree position is unchanged */
+        rb_erase(&next->size_node, &ra->by_size);
+        next->start = start;
+        next->count += count;
+        extent_insert_size(ra, next);
+        ra->merge_count++;
+    } else {
+        /* Isolated run, it gets its own extent */
+        range_extent_t *ext = extent_get(ra);
+
+        ext->start = start;
+        ext->count = count;
+        extent_insert_addr(ra, ext);
+        extent_insert_size(ra, ext);
+    }
+
+    spin_unlock(&ra->lock);
+
+    return 0;
+}
+
+/**
+ * Mark a run of units as allocated, wherever it lies
+ *
+ * Used for ranges that are in use before the allocator takes over, such
+ * as the allocator's own metadata.
+ *
+ * @param ra Range allocator
+ * @param start First unit of the run
+ * @param count Number of units
+ * @return 0 on success, or a negative error code
+ */
+int range_reserve(range_allocator_t *ra, unsigned long start, unsigned long count) {
+    int ret;
+
+    /* Check parameters */
+    if (ra == NULL || count == 0 || start >= ra->count || count > ra->count - start) {
+        return -EINVAL;
+    }
+
+    spin_lock(&ra->lock);
+
+    if (ra->nr_runs + 1 >= ra->max_extents) {
+        spin_unlock(&ra->lock);
+        return -ENOMEM;
+    }
+
+    /* Mark the run and let the trees and run count be rebuilt around it */
+    bitmap_update(ra->bitmap, start, count, 1);
+    ret = range_rebuild(ra);
+
+    spin_unlock(&ra->lock);
+
+    return ret;
+}
+
+/**
+ * Get the number of free units
+ *
+ * @param ra Range allocator
+ * @return Number of free units
+ */
+unsigned long range_free_units(range_allocator_t *ra) {
+    return ra->free;
+}
+
+/**
+ * Get the size of the largest free extent
+ *
+ * @param ra Range allocator
+ * @return Number of units in the largest free extent
+ */
+unsigned long range_largest_free(range_allocator_t *ra) {
+    rb_node_t *node;
+    unsigned long largest = 0;
+
+    spin_lock(&ra->lock);
+    node = rb_last(&ra->by_size);
+    if (node != NULL) {
+        largest = rb_entry(node, range_extent_t, size_node)->count;
+    }
+    spin_unlock(&ra->lock);
+
+    return largest;
+}
+
+/**
+ * Print range allocator statistics
+ *
+ * @param ra Range allocator
+ */
+void range_print_stats(range_allocator_t *ra) {
+    printk(KERN_INFO "RANGE: %s: %lu/%lu free, largest %lu, allocs=%lu fails=%lu merges=%lu\n",
+           ra->name, ra->free, ra->count, range_largest_free(ra),
+           ra->alloc_count, ra->alloc_fail, ra->merge_count);
+}
@@ -8,10 +8,17 @@
 #include <horizon/types.h>
 #include <horizon/mm.h>
 #include <horizon/mm/slab.h>
+#include <horizon/mm/pmm.h>
+#include <horizon/mm/page.h>
 #include <horizon/spinlock.h>
+#include <horizon/irqflags.h>
+#include <horizon/smp.h>
+#include <horizon/printk.h>
 #include <horizon/list.h>
 #include <horizon/string.h>
 #include <horizon/errno.h>
+#include <horizon/rcupdate.h>
+#include <horizon/stddef.h>
 
 /* Cache list */
 static LIST_HEAD(cache_list);
@@ -27,23 +34,158 @@ static const size_t kmalloc_sizes[] = {
     32, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384, 32768, 65536, 131072
 };
 
+/* Cache names, the caches keep pointers to them */
+static char kmalloc_names[13][16];
+
+/* Cache for off-slab descriptors */
+static slab_cache_t *slab_desc_cache;
+
 /**
  * Initialize slab allocator
  */
 void slab_init(void) {
     int i;
-    char name[32];
+    
+    /* Create the descriptor cache first, off-slab caches depend on it */
+    slab_desc_cache = slab_cache_create("slab-desc", sizeof(slab_t), 0, SLAB_PANIC, NULL, NULL);
     
     /* Create general-purpose caches */
     for (i = 0; i < 13; i++) {
-        snprintf(name, sizeof(name), "kmalloc-%lu", kmalloc_sizes[i]);
-        kmalloc_caches[i] = slab_cache_create(name, kmalloc_sizes[i], 0, SLAB_HWCACHE_ALIGN, NULL, NULL);
+        snprintf(kmalloc_names[i], sizeof(kmalloc_names[i]), "kmalloc-%lu", kmalloc_sizes[i]);
+        kmalloc_caches[i] = slab_cache_create(kmalloc_names[i], kmalloc_sizes[i], 0, SLAB_HWCACHE_ALIGN, NULL, NULL);
         if (kmalloc_caches[i] == NULL) {
             kernel_panic("Failed to create kmalloc cache");
         }
     }
 }
 
+/**
+ * Record the owning cache and slab in every page of a slab
+ * 
+ * @param cache Owning cache
+ * @param slab Owning slab
+ */
+static void slab_set_page_owner(slab_cache_t *cache, slab_t *slab) {
+    page_t *page = pmm_virt_to_page(slab->start);
+    unsigned int i;
+    
+    if (page == NULL) {
+        return;
+    }
+    
+    for (i = 0; i < (1U << cache->order); i++, page++) {
+        page_set_flags(page, (1 << PG_slab));
+        page->slab_cache = cache;
+        page->slab = slab;
+    }
+}
+
+/**
+ * Forget the owner of every page of a slab
+ * 
+ * @param cache Owning cache
+ * @param slab Slab whose pages are about to be freed
+ */
+static void slab_clear_page_owner(slab_cache_t *cache, slab_t *slab) {
+    page_t *page = pmm_virt_to_page(slab->start);
+    unsigned int i;
+    
+    if (page == NULL) {
+        return;
+    }
+    
+    for (i = 0; i < (1U << cache->order); i++, page++) {
+        page_clear_flags(page, (1 << PG_slab));
+        page->slab_cache = NULL;
+        page->slab = NULL;
+    }
+}
+
+/**
+ * Find the slab an object belongs to
+ * 
+ * @param obj Object
+ * @return Owning slab
+ */
+static inline slab_t *slab_from_obj(const void *obj) {
+    return pmm_virt_to_page((void *)obj)->slab;
+}
+
+/**
+ * Pick the slab order, object count and colouring of a cache
+ * 
+ * Takes the smallest order that fits at least one object and wastes no
+ * more than 1/8 of the slab. The leftover space is used for colouring:
+ * consecutive slabs start their objects at different cache-line offsets so
+ * the same object index in different slabs maps to different cache sets.
+ * 
+ * @param cache Cache to lay out
+ */
+static void slab_cache_calculate_layout(slab_cache_t *cache) {
+    size_t mgmt = (cache->flags & SLAB_OFF_SLAB) ? 0 : sizeof(slab_t);
+    size_t slab_size = PAGE_SIZE;
+    size_t left_over = 0;
+    unsigned int order;
+    
+    for (order = 0; order <= SLAB_MAX_ORDER; order++) {
+        slab_size = (size_t)PAGE_SIZE << order;
+        
+        if (slab_size < mgmt + cache->size) {
+            continue;
+        }
+        
+        cache->num = (slab_size - mgmt) / cache->size;
+        left_over = slab_size - mgmt - cache->num * cache->size;
+        
+        if (left_over * 8 <= slab_size) {
+            break;
+        }
+    }
+    
+    if (order > SLAB_MAX_ORDER) {
+        order = SLAB_MAX_ORDER;
+    }
+    cache->order = order;
+    
+    /* Colour in units of a cache line, or of the alignment if larger */
+    cache->colour_off = (cache->align > SLAB_COLOUR_ALIGN) ? cache->align : SLAB_COLOUR_ALIGN;
+    cache->colour = left_over / cache->colour_off;
+    cache->colour_next = 0;
+}
+
+/**
+ * Size the per-CPU magazines and the shared depot of a cache
+ * 
+ * Small objects get deep magazines since they are allocated in bursts;
+ * large objects keep few spares around to limit the memory pinned per CPU.
+ * 
+ * @param cache Cache to set up
+ */
+static void slab_cache_setup_arrays(slab_cache_t *cache) {
+    unsigned int limit;
+    int cpu;
+    
+    if (cache->size <= 256) {
+        limit = SLAB_ARRAY_MAX;
+    } else if (cache->size <= 1024) {
+        limit = 24;
+    } else if (cache->size <= PAGE_SIZE) {
+        limit = 16;
+    } else {
+        limit = 8;
+    }
+    
+    for (cpu = 0; cpu < CONFIG_NR_CPUS; cpu++) {
+        cache->cpu_cache[cpu].avail = 0;
+        cache->cpu_cache[cpu].limit = limit;
+        cache->cpu_cache[cpu].batchcount = (limit + 1) / 2;
+    }
+    
+    spin_lock_init(&cache->shared.lock);
+    cache->shared.avail = 0;
+    cache->shared.limit = (2 * limit < SLAB_SHARED_MAX) ? 2 * limit : SLAB_SHARED_MAX;
+}
+
 /**
  * Create a slab cache
  * 
@@ -92,19 +234,24 @@ slab_cache_t *slab_cache_create(const char *name, size_t size, size_t align, uns
     cache->ctor = ctor;
     cache->dtor = dtor;
     
-    /* Calculate number of objects per slab */
-    cache->num = (PAGE_SIZE - sizeof(slab_t)) / size;
-    if (cache->num == 0) {
-        cache->num = 1;
+    /* Large objects keep their descriptor off-slab so it does not eat into the slab */
+    if (size >= SLAB_OFF_SLAB_MIN && slab_desc_cache != NULL) {
+        cache->flags |= SLAB_OFF_SLAB;
     }
     
+    /* Calculate the slab order, objects per slab and colouring */
+    slab_cache_calculate_layout(cache);
+    
     /* Initialize lists */
     INIT_LIST_HEAD(&cache->slabs_full);
     INIT_LIST_HEAD(&cache->slabs_partial);
     INIT_LIST_HEAD(&cache->slabs_free);
     
     /* Initialize lock */
-    spin_lock_init(&cache->lock, name);
+    spin_lock_init_named(&cache->lock, name);
+    
+    /* Initialize the per-CPU magazines and the shared depot */
+    slab_cache_setup_arrays(cache);
     
     /* Add to cache list */
     spin_lock(&cache_list_lock);
@@ -114,6 +261,53 @@ slab_cache_t *slab_cache_create(const char *name, size_t size, size_t align, uns
     return cache;
 }
 
+/**
+ * Free a slab's pages and its descriptor after a grace period
+ * 
+ * Runs without the cache, which may be gone by now.
+ * 
+ * @param head RCU head of the slab
+ */
+static void slab_destroy_rcu(struct rcu_head *head) {
+    slab_t *slab = container_of(head, slab_t, rcu);
+    void *start = slab->start;
+    unsigned int order = slab->order;
+    
+    /* An on-slab descriptor goes with the pages */
+    if ((void *)slab != start) {
+        slab_cache_free(slab_desc_cache, slab);
+    }
+    
+    mm_free_pages(start, 1U << order);
+}
+
+/**
+ * Free a slab's pages and its descriptor
+ * 
+ * The slab must already be off the cache's lists. In a SLAB_DESTROY_BY_RCU
+ * cache the pages are only returned after a grace period.
+ * 
+ * @param cache Owning cache
+ * @param slab Slab to free
+ */
+static void slab_destroy(slab_cache_t *cache, slab_t *slab) {
+    void *start = slab->start;
+    
+    slab_clear_page_owner(cache, slab);
+    
+    /* Readers may still look at the objects, free once they are done */
+    if (cache->flags & SLAB_DESTROY_BY_RCU) {
+        call_rcu(&slab->rcu, slab_destroy_rcu);
+        return;
+    }
+    
+    if (cache->flags & SLAB_OFF_SLAB) {
+        slab_cache_free(slab_desc_cache, slab);
+    }
+    
+    mm_free_pages(start, 1U << cache->order);
+}
+
 /**
  * Destroy a slab cache
  * 
@@ -132,25 +326,31 @@ void slab_cache_destroy(slab_cache_t *cache) {
     list_del(&cache->list);
     spin_unlock(&cache_list_lock);
     
+    /* Cached objects live in the slabs freed below, just forget them */
+    for (int cpu = 0; cpu < CONFIG_NR_CPUS; cpu++) {
+        cache->cpu_cache[cpu].avail = 0;
+    }
+    cache->shared.avail = 0;
+    
     /* Free all slabs */
     spin_lock(&cache->lock);
     
     /* Free full slabs */
     list_for_each_entry_safe(slab, next, &cache->slabs_full, list) {
         list_del(&slab->list);
-        mm_free_pages(slab->start, 1);
+        slab_destroy(cache, slab);
     }
     
     /* Free partial slabs */
     list_for_each_entry_safe(slab, next, &cache->slabs_partial, list) {
         list_del(&slab->list);
-        mm_free_pages(slab->start, 1);
+        slab_destroy(cache, slab);
     }
     
     /* Free free slabs */
     list_for_each_entry_safe(slab, next, &cache->slabs_free, list) {
         list_del(&slab->list);
-        mm_free_pages(slab->start, 1);
+        slab_destroy(cache, slab);
     }
     
     spin_unlock(&cache->lock);
@@ -169,24 +369,49 @@ static slab_t *slab_alloc(slab_cache_t *cache) {
     slab_t *slab;
     slab_object_t *obj;
     void *start;
+    unsigned int colouroff;
     int i;
     
     /* Allocate slab */
-    start = mm_alloc_pages(1, MEM_KERNEL | MEM_ZERO);
+    start = mm_alloc_pages(1U << cache->order, MEM_KERNEL | MEM_ZERO);
     if (start == NULL) {
         return NULL;
     }
     
+    /* Get the descriptor, either from the descriptor cache or the slab head */
+    if (cache->flags & SLAB_OFF_SLAB) {
+        slab = slab_cache_alloc(slab_desc_cache, MEM_KERNEL);
+        if (slab == NULL) {
+            mm_free_pages(start, 1U << cache->order);
+            return NULL;
+        }
+        colouroff = 0;
+    } else {
+        slab = (slab_t *)start;
+        colouroff = sizeof(slab_t);
+    }
+    
+    /* Shift this slab's objects by the next colour */
+    colouroff += cache->colour_next * cache->colour_off;
+    if (++cache->colour_next >= cache->colour) {
+        cache->colour_next = 0;
+    }
+    
     /* Initialize slab */
-    slab = (slab_t *)start;
     slab->start = start;
+    slab->s_mem = (char *)start + colouroff;
+    slab->colouroff = colouroff;
+    slab->order = cache->order;
     slab->inuse = 0;
     slab->free = cache->num;
     slab->freelist = NULL;
     
-    /* Initialize objects */
-    for (i = 0; i < cache->num; i++) {
-        obj = (slab_object_t *)((char *)start + sizeof(slab_t) + i * cache->size);
+    /* Record the owner in the pages so kfree and slab_cache_free can find it */
+    slab_set_page_owner(cache, slab);
+    
+    /* Initialize objects, lowest address first on the free list */
+    for (i = cache->num - 1; i >= 0; i--) {
+        obj = (slab_object_t *)((char *)slab->s_mem + i * cache->size);
         obj->next = slab->freelist;
         slab->freelist = obj;
         
@@ -207,24 +432,17 @@ static slab_t *slab_alloc(slab_cache_t *cache) {
 }
 
 /**
- * Allocate an object from a slab cache
+ * Take an object from the slab lists
+ * 
+ * The caller must hold cache->lock.
  * 
  * @param cache Cache to allocate from
- * @param flags Allocation flags
- * @return Object, or NULL on failure
+ * @return Object, or NULL if no slab could be allocated
  */
-void *slab_cache_alloc(slab_cache_t *cache, unsigned int flags) {
+static void *__slab_get_obj(slab_cache_t *cache) {
     slab_t *slab;
     slab_object_t *obj;
     
-    /* Check parameters */
-    if (cache == NULL) {
-        return NULL;
-    }
-    
-    /* Allocate object */
-    spin_lock(&cache->lock);
-    
     /* Check if there are any partial slabs */
     if (list_empty(&cache->slabs_partial)) {
         /* Check if there are any free slabs */
@@ -232,18 +450,14 @@ void *slab_cache_alloc(slab_cache_t *cache, unsigned int flags) {
             /* Allocate a new slab */
             slab = slab_alloc(cache);
             if (slab == NULL) {
-                spin_unlock(&cache->lock);
-                if (flags & MEM_PANIC) {
-                    kernel_panic("Failed to allocate slab");
-                }
                 return NULL;
             }
-        } else {
-            /* Get a free slab */
-            slab = list_first_entry(&cache->slabs_free, slab_t, list);
-            list_del(&slab->list);
         }
         
+        /* Get a free slab */
+        slab = list_first_entry(&cache->slabs_free, slab_t, list);
+        list_del(&slab->list);
+        
         /* Add to partial list */
         list_add(&slab->list, &cache->slabs_partial);
     } else {
@@ -263,7 +477,172 @@ void *slab_cache_alloc(slab_cache_t *cache, unsigned int flags) {
         list_add(&slab->list, &cache->slabs_full);
     }
     
+    return obj;
+}
+
+/**
+ * Return an object to its slab
+ * 
+ * The caller must hold cache->lock.
+ * 
+ * @param cache Cache owning the object
+ * @param obj Object to return
+ */
+static void __slab_put_obj(slab_cache_t *cache, void *obj) {
+    slab_t *slab;
+    slab_object_t *sobj;
+    
+    /* Get slab */
+    slab = slab_from_obj(obj);
+    
+    /* Add object to free list */
+    sobj = (slab_object_t *)obj;
+    sobj->next = slab->freelist;
+    slab->freelist = sobj;
+    slab->inuse--;
+    slab->free++;
+    
+    /* Check if slab was full */
+    if (slab->free == 1) {
+        list_del(&slab->list);
+        list_add(&slab->list, &cache->slabs_partial);
+    }
+    
+    /* Check if slab is now empty */
+    if (slab->free == cache->num) {
+        list_del(&slab->list);
+        list_add(&slab->list, &cache->slabs_free);
+    }
+}
+
+/**
+ * Refill a per-CPU magazine from the shared depot, or from the slabs
+ * 
+ * Called with local interrupts disabled.
+ * 
+ * @param cache Cache to refill from
+ * @param ac Magazine to refill
+ */
+static void cache_alloc_refill(slab_cache_t *cache, array_cache_t *ac) {
+    array_depot_t *shared = &cache->shared;
+    unsigned int want = ac->batchcount;
+    
+    /* Try the shared depot first, it is cheaper than walking slabs */
+    spin_lock(&shared->lock);
+    while (want > 0 && shared->avail > 0) {
+        ac->entry[ac->avail++] = shared->entry[--shared->avail];
+        want--;
+    }
+    spin_unlock(&shared->lock);
+    
+    if (want == 0) {
+        return;
+    }
+    
+    /* Pull the rest of the batch from the slabs under one lock hold */
+    spin_lock(&cache->lock);
+    while (want > 0) {
+        void *obj = __slab_get_obj(cache);
+        
+        if (obj == NULL) {
+            break;
+        }
+        
+        ac->entry[ac->avail++] = obj;
+        want--;
+    }
     spin_unlock(&cache->lock);
+}
+
+/**
+ * Flush the oldest objects of a full per-CPU magazine
+ * 
+ * Objects go to the shared depot where other CPUs can pick them up; what
+ * does not fit there is returned to the slabs.
+ * 
+ * Called with local interrupts disabled.
+ * 
+ * @param cache Cache owning the magazine
+ * @param ac Magazine to flush
+ * @param count Number of objects to flush
+ */
+static void cache_flusharray(slab_cache_t *cache, array_cache_t *ac, unsigned int count) {
+    array_depot_t *shared = &cache->shared;
+    unsigned int moved = 0;
+    unsigned int i;
+    
+    if (count > ac->avail) {
+        count = ac->avail;
+    }
+    
+    /* Hand the oldest objects (bottom of the stack) to the depot */
+    spin_lock(&shared->lock);
+    while (moved < count && shared->avail < shared->limit) {
+        shared->entry[shared->avail++] = ac->entry[moved++];
+    }
+    spin_unlock(&shared->lock);
+    
+    /* Return the remainder to the slabs */
+    if (moved < count) {
+        spin_lock(&cache->lock);
+        while (moved < count) {
+            __slab_put_obj(cache, ac->entry[moved++]);
+        }
+        spin_unlock(&cache->lock);
+    }
+    
+    /* Slide the remaining objects down */
+    for (i = 0; i + count < ac->avail; i++) {
+        ac->entry[i] = ac->entry[i + count];
+    }
+    ac->avail -= count;
+}
+
+/**
+ * Allocate an object from a slab cache
+ * 
+ * The common case pops an object from this CPU's magazine without taking
+ * any lock.
+ * 
+ * @param cache Cache to allocate from
+ * @param flags Allocation flags
+ * @return Object, or NULL on failure
+ */
+void *slab_cache_alloc(slab_cache_t *cache, unsigned int flags) {
+    array_cache_t *ac;
+    unsigned long irq_flags;
+    void *obj = NULL;
+    
+    /* Check parameters */
+    if (cache == NULL) {
+        return NULL;
+    }
+    
+    local_irq_save(irq_flags);
+    
+    ac = &cache->cpu_cache[smp_processor_id()];
+    
+    if (ac->avail > 0) {
+        /* Fast path, the most recently freed object is the cache-hottest */
+        ac->alloc_hit++;
+    } else {
+        /* Slow path, refill a batch */
+        ac->alloc_miss++;
+        cache_alloc_refill(cache, ac);
+    }
+    
+    if (ac->avail > 0) {
+        obj = ac->entry[--ac->avail];
+    }
+    
+    local_irq_restore(irq_flags);
+    
+    if (obj == NULL) {
+        if (flags & MEM_PANIC) {
+            kernel_panic("Failed to allocate slab");
+        }
+        return NULL;
+    }
     
     /* Clear object */
     if (flags & MEM_ZERO) {
@@ -276,56 +655,109 @@ void *slab_cache_alloc(slab_cache_t *cache, unsigned int flags) {
 /**
  * Free an object to a slab cache
  * 
+ * The object goes to the freeing CPU's magazine, whichever CPU allocated
+ * it. A full magazine passes its oldest half on to the shared depot.
+ * 
  * @param cache Cache to free to
  * @param obj Object to free
  */
 void slab_cache_free(slab_cache_t *cache, void *obj) {
-    slab_t *slab;
-    slab_object_t *sobj;
+    array_cache_t *ac;
+    unsigned long irq_flags;
     
     /* Check parameters */
     if (cache == NULL || obj == NULL) {
         return;
     }
     
-    /* Get slab */
-    slab = (slab_t *)((unsigned long)obj & PAGE_MASK);
-    
     /* Call destructor */
     if (cache->dtor != NULL) {
         cache->dtor(obj);
     }
     
-    /* Free object */
-    spin_lock(&cache->lock);
+    local_irq_save(irq_flags);
     
-    /* Add object to free list */
-    sobj = (slab_object_t *)obj;
-    sobj->next = slab->freelist;
-    slab->freelist = sobj;
-    slab->inuse--;
-    slab->free++;
+    ac = &cache->cpu_cache[smp_processor_id()];
     
-    /* Check if slab was full */
-    if (slab->free == 1) {
-        list_del(&slab->list);
-        list_add(&slab->list, &cache->slabs_partial);
+    if (ac->avail < ac->limit) {
+        /* Fast path */
+        ac->free_hit++;
+    } else {
+        /* Slow path, make room by flushing a batch */
+        ac->free_miss++;
+        cache_flusharray(cache, ac, ac->batchcount);
     }
     
-    /* Check if slab is now empty */
-    if (slab->free == cache->num) {
-        list_del(&slab->list);
-        list_add(&slab->list, &cache->slabs_free);
+    ac->entry[ac->avail++] = obj;
+    
+    local_irq_restore(irq_flags);
+}
+
+/**
+ * Return all objects cached by a CPU for a cache to the slabs
+ * 
+ * @param cache Cache to drain
+ * @param cpu CPU whose magazine to drain
+ */
+void slab_cache_drain_cpu(slab_cache_t *cache, int cpu) {
+    array_cache_t *ac;
+    unsigned long irq_flags;
+    
+    /* Check parameters */
+    if (cache == NULL || cpu < 0 || cpu >= CONFIG_NR_CPUS) {
+        return;
+    }
+    
+    local_irq_save(irq_flags);
+    
+    ac = &cache->cpu_cache[cpu];
+    
+    spin_lock(&cache->lock);
+    while (ac->avail > 0) {
+        __slab_put_obj(cache, ac->entry[--ac->avail]);
+    }
+    spin_unlock(&cache->lock);
+    
+    local_irq_restore(irq_flags);
+}
+
+/**
+ * Drain the magazines of a CPU in every cache
+ * 
+ * @param cpu CPU whose magazines to drain
+ */
+void slab_drain_cpu(int cpu) {
+    slab_cache_t *cache;
+    
+    spin_lock(&cache_list_lock);
+    list_for_each_entry(cache, &cache_list, list) {
+        slab_cache_drain_cpu(cache, cpu);
     }
+    spin_unlock(&cache_list_lock);
+}
+
+/**
+ * Drain the shared depot of a cache back to the slabs
+ * 
+ * @param cache Cache to drain
+ */
+static void slab_cache_drain_shared(slab_cache_t *cache) {
+    array_depot_t *shared = &cache->shared;
     
+    spin_lock(&shared->lock);
+    spin_lock(&cache->lock);
+    while (shared->avail > 0) {
+        __slab_put_obj(cache, shared->entry[--shared->avail]);
+    }
     spin_unlock(&cache->lock);
+    spin_unlock(&shared->lock);
 }
 
 /**
  * Shrink a slab cache
  * 
  * @param cache Cache to shrink
- * @return Number of pages freed
+ * @return Number of slabs freed
  */
 int slab_cache_shrink(slab_cache_t *cache) {
     slab_t *slab, *next;
@@ -336,12 +768,16 @@ int slab_cache_shrink(slab_cache_t *cache) {
         return 0;
     }
     
+    /* Give the local and shared spares back so their slabs can empty */
+    slab_cache_drain_cpu(cache, smp_processor_id());
+    slab_cache_drain_shared(cache);
+    
     /* Free empty slabs */
     spin_lock(&cache->lock);
     
     list_for_each_entry_safe(slab, next, &cache->slabs_free, list) {
         list_del(&slab->list);
-        mm_free_pages(slab->start, 1);
+        slab_destroy(cache, slab);
         cache->total_slabs--;
         cache->total_objects -= cache->num;
         freed++;
@@ -406,6 +842,58 @@ void slab_cache_info(slab_cache_t *cache, unsigned int *total_objects, unsigned
     spin_unlock(&cache->lock);
 }
 
+/**
+ * Get slab cache magazine statistics, summed over all CPUs
+ * 
+ * @param cache Cache to get statistics of
+ * @param stats Statistics to fill in
+ * @return 0 on success, or a negative error code
+ */
+int slab_cache_get_stats(slab_cache_t *cache, slab_cache_stats_t *stats) {
+    int cpu;
+    
+    /* Check parameters */
+    if (cache == NULL || stats == NULL) {
+        return -EINVAL;
+    }
+    
+    memset(stats, 0, sizeof(slab_cache_stats_t));
+    
+    for (cpu = 0; cpu < CONFIG_NR_CPUS; cpu++) {
+        array_cache_t *ac = &cache->cpu_cache[cpu];
+        
+        stats->alloc_hit += ac->alloc_hit;
+        stats->alloc_miss += ac->alloc_miss;
+        stats->free_hit += ac->free_hit;
+        stats->free_miss += ac->free_miss;
+        stats->cached += ac->avail;
+    }
+    stats->cached += cache->shared.avail;
+    
+    return 0;
+}
+
+/**
+ * Print magazine statistics of every slab cache
+ */
+void slab_print_stats(void) {
+    slab_cache_t *cache;
+    slab_cache_stats_t stats;
+    
+    printk(KERN_INFO "SLAB: Cache statistics\n");
+    
+    spin_lock(&cache_list_lock);
+    list_for_each_entry(cache, &cache_list, list) {
+        slab_cache_get_stats(cache, &stats);
+        
+        printk(KERN_INFO "  %-16s objs=%u slabs=%u alloc=%lu/%lu free=%lu/%lu cached=%u\n",
+               cache->name, cache->total_objects, cache->total_slabs,
+               stats.alloc_hit, stats.alloc_miss, stats.free_hit,
+               stats.free_miss, stats.cached);
+    }
+    spin_unlock(&cache_list_lock);
+}
+
 /**
  * Allocate memory
  * 
@@ -430,7 +918,19 @@ void *kmalloc(size_t size, unsigned int flags) {
     
     /* Size too large, allocate pages */
     size_t pages = (size + PAGE_SIZE - 1) >> PAGE_SHIFT;
-    return mm_alloc_pages(pages, flags);
+    void *addr = mm_alloc_pages(pages, flags);
+    if (addr == NULL) {
+        return NULL;
+    }
+    
+    /* Record the block size in the head page so kfree can find it */
+    page_t *page = pmm_virt_to_page(addr);
+    if (page != NULL) {
+        page_set_flags(page, (1 << PG_head));
+        page->nr_pages = pages;
+    }
+    
+    return addr;
 }
 
 /**
@@ -491,6 +991,12 @@ void *krealloc(void *ptr, size_t size, unsigned int flags) {
         return NULL;
     }
     
+    /* Grow or shrink in place while the block still fits */
+    old_size = ksize(ptr);
+    if (size <= old_size) {
+        return ptr;
+    }
+    
     /* Allocate new memory */
     new = kmalloc(size, flags);
     if (new == NULL) {
@@ -498,10 +1004,6 @@ void *krealloc(void *ptr, size_t size, unsigned int flags) {
     }
     
     /* Copy data */
-    old_size = 0; /* TODO: Get old size */
-    if (old_size > size) {
-        old_size = size;
-    }
     memcpy(new, ptr, old_size);
     
     /* Free old memory */
@@ -510,21 +1012,72 @@ void *krealloc(void *ptr, size_t size, unsigned int flags) {
     return new;
 }
 
+/**
+ * Get the usable size of an allocation
+ * 
+ * @param ptr Memory returned by kmalloc
+ * @return Usable size in bytes, or 0 if ptr is not a kmalloc block
+ */
+size_t ksize(const void *ptr) {
+    page_t *page;
+    
+    /* Check parameters */
+    if (ptr == NULL) {
+        return 0;
+    }
+    
+    page = pmm_virt_to_page((void *)ptr);
+    if (page == NULL) {
+        return 0;
+    }
+    
+    /* Slab objects are as large as their cache's objects */
+    if (page_test_flags(page, (1 << PG_slab))) {
+        return page->slab_cache->size;
+    }
+    
+    /* Large blocks span whole pages */
+    if (page_test_flags(page, (1 << PG_head))) {
+        return page->nr_pages << PAGE_SHIFT;
+    }
+    
+    return 0;
+}
+
 /**
  * Free memory
  * 
  * @param ptr Memory to free
  */
 void kfree(void *ptr) {
+    page_t *page;
+    
     /* Check parameters */
     if (ptr == NULL) {
         return;
     }
     
-    /* TODO: Determine if memory is from slab or pages */
-    /* For now, assume slab */
-    /* This would be implemented by storing metadata with the allocation */
+    page = pmm_virt_to_page(ptr);
+    if (page == NULL) {
+        printk(KERN_WARNING "SLAB: kfree of invalid pointer %p\n", ptr);
+        return;
+    }
+    
+    /* Slab object, free to the owning cache */
+    if (page_test_flags(page, (1 << PG_slab))) {
+        slab_cache_free(page->slab_cache, ptr);
+        return;
+    }
+    
+    /* Large block, free all of its pages */
+    if (page_test_flags(page, (1 << PG_head))) {
+        size_t pages = page->nr_pages;
+        
+        page_clear_flags(page, (1 << PG_head));
+        page->nr_pages = 0;
+        mm_free_pages(ptr, pages);
+        return;
+    }
     
-    /* Free memory */
-    slab_cache_free(kmalloc_caches[0], ptr);
+    printk(KERN_WARNING "SLAB: kfree of non-kmalloc pointer %p\n", ptr);
 }
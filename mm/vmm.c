@@ -113,6 +113,12 @@ vm_context_t *vmm_get_current_context(void)
     return current_context;
 }
 
+/* Get the kernel virtual memory context */
+vm_context_t *vmm_get_kernel_context(void)
+{
+    return kernel_context;
+}
+
 /* Allocate pages in a virtual memory context */
 void *vmm_alloc_pages(vm_context_t *context, void *addr, u32 count, u32 flags)
 {